@@ -29,6 +29,9 @@
 #include <time.h>
 #include <errno.h>
 #include <stdlib.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "tcpbridge.h"
 #include "bridge.h"
@@ -47,69 +50,216 @@ static int live_callback(struct live_data_t *,
 static void signal_catcher(int signo);
 
 /**
- * First, prep our RB Tree which tracks where each (source)
- * MAC really lives so we don't create really nasty network
- * storms.
+ * Table which tracks where each (source) MAC really lives so we don't
+ * create really nasty network storms.  It's open addressed on the 48bit
+ * MAC so a lookup touches one or two cache lines, and it never allocates
+ * once it's been created.  The MAC and its interface share one 64bit
+ * word which is only ever changed with a compare and swap, so the
+ * bridging threads can share the table without a lock.
  */
-static struct macsrc_t *new_node(void);
+static struct macsrc_t *mactable;
 
-RB_HEAD(macsrc_tree, macsrc_t) macsrc_root;
+/**
+ * create the MAC table.  Malloc's memory
+ */
+void
+mactable_init(void)
+{
+    if (mactable == NULL)
+        mactable = (struct macsrc_t *)safe_malloc(sizeof(struct macsrc_t) * MACTABLE_SIZE);
+}
 
+/**
+ * Look up the source MAC of a packet received on the given interface,
+ * learning it if it is new.  A MAC which lives on the other interface is
+ * only moved over once it hasn't been heard from there for age seconds
+ * (never if age is 0).  Returns 0 if the packet should not be bridged.
+ */
 static int
-rbmacsrc_comp(struct macsrc_t *a, struct macsrc_t *b)
+mactable_learn(const u_char *mac, u_char source, time_t now, int age)
 {
-    return (memcmp(a->key, b->key, ETHER_ADDR_LEN));
+    struct macsrc_t *entry, *victim = NULL;
+    uint64_t mackey, key, cur, victim_key = 0;
+    uint32_t slot;
+    int i;
+
+    mackey = MACTABLE_VALID | ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+            ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+            ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+    key = mackey | ((uint64_t)source << MACTABLE_SOURCE_SHIFT);
+
+    /* Fibonacci hash, so sequential MACs don't fill neighbouring slots */
+    slot = (uint32_t)((mackey * 0x9e3779b97f4a7c15ULL) >> (64 - MACTABLE_BITS));
+
+    for (i = 0; i < MACTABLE_PROBE; i++) {
+        entry = &mactable[(slot + i) & (MACTABLE_SIZE - 1)];
+        cur = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+
+        /* nothing is ever deleted, so an empty slot ends the search */
+        if (cur == 0) {
+            if (__atomic_compare_exchange_n(&entry->key, &cur, key, false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                dbg(1, "Unable to find MAC in the table");
+                __atomic_store_n(&entry->last_seen, now, __ATOMIC_RELAXED);
+                return 1;
+            }
+            /* another thread claimed the slot first, cur is what it wrote */
+        }
+
+        if ((cur & MACTABLE_MAC_MASK) == mackey) {
+            if (cur != key) {
+                if (age == 0 ||
+                        now - __atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED) < age)
+                    return 0;
+
+                dbgx(1, "MAC aged out, moving it to interface %d", source);
+                __atomic_compare_exchange_n(&entry->key, &cur, key, false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            }
+            __atomic_store_n(&entry->last_seen, now, __ATOMIC_RELAXED);
+            return 1;
+        }
+
+        /* table is crowded here, remember the stalest entry to evict */
+        if (victim == NULL || entry->last_seen < victim->last_seen) {
+            victim = entry;
+            victim_key = cur;
+        }
+    }
+
+    /* if another thread beat us to the victim, leave it be */
+    dbg(1, "MAC table crowded, evicting the stalest entry");
+    if (__atomic_compare_exchange_n(&victim->key, &victim_key, key, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        __atomic_store_n(&victim->last_seen, now, __ATOMIC_RELAXED);
+
+    return 1;
 }
 
-RB_PROTOTYPE(macsrc_tree, macsrc_t, node, rbmacsrc_comp)
-RB_GENERATE(macsrc_tree, macsrc_t, node, rbmacsrc_comp)
+/**
+ * compile & apply our bpf filter to a receive handle
+ */
+static void
+bridge_setfilter(tcpbridge_opt_t *options, pcap_t *pcap)
+{
+    dbgx(2, "Try to compile pcap bpf filter: %s", options->bpf.filter);
+    if (pcap_compile(pcap, &options->bpf.program, options->bpf.filter, options->bpf.optimize, 0) != 0) {
+        errx(-1, "Error compiling BPF filter: %s", pcap_geterr(pcap));
+    }
+
+    pcap_setfilter(pcap, &options->bpf.program);
+}
 
 /**
- * redblack init
+ * Opens the interface livedata sends out of, the one it doesn't receive
+ * on, for batched sending
  */
-void
-rbinit(void)
+static void
+bridge_open_send(struct live_data_t *livedata)
+{
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    const char *intf;
+    tcpr_dir_t dir;
+
+    if (livedata->source == PCAP_INT1) {
+        intf = livedata->options->intf2;
+        dir = TCPR_DIR_S2C;
+    } else {
+        intf = livedata->options->intf1;
+        dir = TCPR_DIR_C2S;
+    }
+
+    if ((livedata->sp = sendpacket_open(intf, ebuf, dir, SP_TYPE_NONE)) == NULL)
+        errx(-1, "Unable to open interface %s: %s", intf, ebuf);
+
+    livedata->batch = (u_char *)safe_malloc(BRIDGE_BATCH_BYTES);
+}
+
+/**
+ * Sends the packets staged by live_callback() with one sendpacket_batch()
+ */
+static void
+bridge_flush(struct live_data_t *livedata)
 {
-    RB_INIT(&macsrc_root);
+    int sent;
+
+    if (livedata->batch_cnt == 0)
+        return;
+
+    sent = sendpacket_batch(livedata->sp, livedata->batch_iov, livedata->batch_hdr,
+            livedata->batch_cnt);
+    if (sent < (int)livedata->batch_cnt)
+        errx(-1, "Unable to send packet out %s: %s", livedata->sp->device,
+                sendpacket_geterr(livedata->sp));
+
+    livedata->stats->bytes_sent += livedata->batch_len;
+    livedata->stats->pkts_sent += livedata->batch_cnt;
+    dbgx(1, "Sent %u packets, " COUNTER_SPEC " in all", livedata->batch_cnt,
+            livedata->stats->pkts_sent);
+
+    livedata->batch_cnt = 0;
+    livedata->batch_len = 0;
+}
+
+static void
+bridge_close_send(struct live_data_t *livedata)
+{
+    bridge_flush(livedata);
+    sendpacket_close(livedata->sp);
+    livedata->sp = NULL;
+    safe_free(livedata->batch);
+    safe_free(livedata->pktbuff);
 }
 
 /**
- * create a new node... Malloc's memory
+ * Bridges one burst of packets: whatever pcap_dispatch() has for us,
+ * sent as a batch.  Returns what pcap_dispatch() returned.
  */
-struct macsrc_t *
-new_node(void)
+static int
+bridge_dispatch(struct live_data_t *livedata)
 {
-    struct macsrc_t *node;
+    int retcode;
 
-    node = (struct macsrc_t *)safe_malloc(sizeof(struct macsrc_t));
+    retcode = pcap_dispatch(livedata->pcap, -1, (pcap_handler)live_callback,
+            (u_char *)livedata);
+    bridge_flush(livedata);
 
-    memset(node, '\0', sizeof(struct macsrc_t));
-    return (node);
+    return retcode;
 }
 
 
 /**
  * main loop for bridging in only one direction
- * optimized to not use poll(), but rather libpcap's builtin pcap_loop()
+ * optimized to not use poll(), but rather let pcap_dispatch() block.  With
+ * --spin the handle is non-blocking, so this keeps asking it for packets.
  */
 static void
 do_bridge_unidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
 {
     struct live_data_t livedata;
-    int retcode;
 
     assert(options);
     assert(tcpedit);
 
+    memset(&livedata, 0, sizeof(livedata));
     livedata.tcpedit = tcpedit;
     livedata.source = PCAP_INT1;
     livedata.pcap = options->pcap1;
     livedata.options = options;
+    livedata.stats = &stats;
+    bridge_open_send(&livedata);
+
+    while ((options->limit_send == 0) || (options->limit_send > stats.pkts_sent)) {
+        if (didsig)
+            break;
 
-    if ((retcode = pcap_loop(options->pcap1, options->limit_send, 
-            (pcap_handler)live_callback, (u_char *) &livedata)) < 0) {
-        warnx("Error in pcap_loop(): %s", pcap_geterr(options->pcap1));
+        if (bridge_dispatch(&livedata) < 0) {
+            warnx("Error in pcap_dispatch(): %s", pcap_geterr(options->pcap1));
+            break;
+        }
     }
+
+    bridge_close_send(&livedata);
 }
 
 /**
@@ -120,15 +270,21 @@ static void
 do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
 {
     struct pollfd polls[2];     /* one for left & right pcap */
-    int pollresult, pollcount, timeout;
-    struct live_data_t livedata;
+    int pollresult, pollcount, timeout, i;
+    struct live_data_t livedata[2]; /* received on the left & right pcap */
 
     assert(options);
     assert(tcpedit);
 
-    livedata.tcpedit = tcpedit;
-    livedata.options = options;
-
+    memset(livedata, 0, sizeof(livedata));
+    for (i = PCAP_INT1; i <= PCAP_INT2; i++) {
+        livedata[i].tcpedit = tcpedit;
+        livedata[i].source = i;
+        livedata[i].pcap = i == PCAP_INT1 ? options->pcap1 : options->pcap2;
+        livedata[i].options = options;
+        livedata[i].stats = &stats;
+        bridge_open_send(&livedata[i]);
+    }
 
     /* 
      * loop until ctrl-C or we've sent enough packets
@@ -142,6 +298,13 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
         dbgx(3, "limit_send: " COUNTER_SPEC " \t pkts_sent: " COUNTER_SPEC, 
             options->limit_send, stats.pkts_sent);
 
+        /* both handles are non-blocking, skip poll() and just read them */
+        if (options->spin) {
+            bridge_dispatch(&livedata[PCAP_INT1]);
+            bridge_dispatch(&livedata[PCAP_INT2]);
+            continue;
+        }
+
         /* reset the result codes */
         polls[PCAP_INT1].revents = 0;
         polls[PCAP_INT1].events = POLLIN;
@@ -164,19 +327,13 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
             /* success, got one or more packets */
             if (polls[PCAP_INT1].revents > 0) {
                 dbg(5, "Processing first interface");
-                livedata.source = PCAP_INT1;
-                livedata.pcap = options->pcap1;
-                pcap_dispatch(options->pcap1, -1, (pcap_handler) live_callback,
-                              (u_char *) &livedata);
+                bridge_dispatch(&livedata[PCAP_INT1]);
             }
 
             /* check the other interface?? */
             if (polls[PCAP_INT2].revents > 0) {
                 dbg(5, "Processing second interface");
-                livedata.source = PCAP_INT2;
-                livedata.pcap = options->pcap2;
-                pcap_dispatch(options->pcap2, -1, (pcap_handler) live_callback,
-                              (u_char *) &livedata);
+                bridge_dispatch(&livedata[PCAP_INT2]);
             }
 
         }
@@ -192,8 +349,119 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
         /* go back to the top of the loop */
     }
 
+    bridge_close_send(&livedata[PCAP_INT1]);
+    bridge_close_send(&livedata[PCAP_INT2]);
 } /* do_bridge_bidirectional() */
 
+#ifdef HAVE_LIBPTHREAD
+/* how long a worker waits for packets before checking for Ctrl-C */
+#define BRIDGE_WORKER_POLL_MS 100
+
+/* one thread bridging the packets of one receive queue in one direction */
+typedef struct bridge_worker_s {
+    pthread_t thread;
+    struct live_data_t livedata;
+    tcpreplay_stats_t stats;
+    COUNTER *sent;              /* packets sent by all the workers */
+} bridge_worker_t;
+
+/**
+ * main loop of a worker thread.  Besides the MAC table, which is lock
+ * free, a worker only touches its own tcpedit context and counters.
+ */
+static void *
+bridge_worker(void *arg)
+{
+    bridge_worker_t *worker = (bridge_worker_t *)arg;
+    struct live_data_t *livedata = &worker->livedata;
+    tcpbridge_opt_t *options = livedata->options;
+    struct pollfd pfd;
+    COUNTER last = 0;
+
+    pfd.fd = pcap_fileno(livedata->pcap);
+    pfd.events = POLLIN;
+
+    while (!didsig) {
+        if (options->limit_send > 0 &&
+                __atomic_load_n(worker->sent, __ATOMIC_RELAXED) >= options->limit_send)
+            break;
+
+        if (!options->spin) {
+            pfd.revents = 0;
+            if (poll(&pfd, 1, BRIDGE_WORKER_POLL_MS) <= 0)
+                continue;
+        }
+
+        if (bridge_dispatch(livedata) < 0) {
+            warnx("Error in pcap_dispatch(): %s", pcap_geterr(livedata->pcap));
+            didsig = true;  /* take the other workers down with us */
+            break;
+        }
+
+        /* one shared update per batch of packets */
+        if (worker->stats.pkts_sent != last) {
+            __atomic_add_fetch(worker->sent, worker->stats.pkts_sent - last, __ATOMIC_RELAXED);
+            last = worker->stats.pkts_sent;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * main loop for bridging on worker threads: one per receive queue and
+ * direction, each with its own tcpedit context
+ */
+static void
+do_bridge_workers(tcpbridge_opt_t *options)
+{
+    bridge_worker_t *workers;
+    struct live_data_t *livedata;
+    COUNTER sent = 0;
+    int count, queue, i, rcode;
+
+    count = options->workers * (options->unidir ? 1 : 2);
+    workers = (bridge_worker_t *)safe_malloc(sizeof(bridge_worker_t) * count);
+
+    for (i = 0; i < count; i++) {
+        queue = i % options->workers;
+        livedata = &workers[i].livedata;
+        livedata->tcpedit = options->worker_tcpedit[i];
+        livedata->options = options;
+        livedata->stats = &workers[i].stats;
+        workers[i].sent = &sent;
+
+        /* each worker sends with a sendpacket handle of its own */
+        if (i < options->workers) {
+            livedata->source = PCAP_INT1;
+            livedata->pcap = options->queue1[queue];
+        } else {
+            livedata->source = PCAP_INT2;
+            livedata->pcap = options->queue2[queue];
+        }
+        bridge_open_send(livedata);
+    }
+
+    for (i = 1; i < count; i++) {
+        if ((rcode = pthread_create(&workers[i].thread, NULL, bridge_worker, &workers[i])) != 0)
+            errx(-1, "Unable to start worker thread %d: %s", i, strerror(rcode));
+    }
+
+    bridge_worker(&workers[0]);
+
+    for (i = 0; i < count; i++) {
+        if (i > 0 && (rcode = pthread_join(workers[i].thread, NULL)) != 0)
+            errx(-1, "Unable to join worker thread %d: %s", i, strerror(rcode));
+
+        bridge_close_send(&workers[i].livedata);
+        stats.pkts_sent += workers[i].stats.pkts_sent;
+        stats.bytes_sent += workers[i].stats.bytes_sent;
+    }
+
+    safe_free(workers);
+}
+#endif /* HAVE_LIBPTHREAD */
+
 
 /**
  * Main entry point to bridging.  Does some initial setup and then calls the 
@@ -202,35 +470,36 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
 void
 do_bridge(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
 {
+    int i;
+
     /* do we apply a bpf filter? */
     if (options->bpf.filter != NULL) {
-        /* compile filter */
-        dbgx(2, "Try to compile pcap bpf filter: %s", options->bpf.filter);
-        if (pcap_compile(options->pcap1, &options->bpf.program, options->bpf.filter, options->bpf.optimize, 0) != 0) {
-            errx(-1, "Error compiling BPF filter: %s", pcap_geterr(options->pcap1));
-        }
-
-        /* apply filter */
-        pcap_setfilter(options->pcap1, &options->bpf.program);
+        bridge_setfilter(options, options->pcap1);
 
         /* same for other interface if applicable */
-        if (options->unidir == 0) {
-            /* compile filter */
-            dbgx(2, "Try to compile pcap bpf filter: %s", options->bpf.filter);
-            if (pcap_compile(options->pcap2, &options->bpf.program, options->bpf.filter, options->bpf.optimize, 0) != 0) {
-                errx(-1, "Error compiling BPF filter: %s", pcap_geterr(options->pcap2));
-            }
-
-            /* apply filter */
-            pcap_setfilter(options->pcap2, &options->bpf.program);
+        if (options->unidir == 0)
+            bridge_setfilter(options, options->pcap2);
+
+        /* and the extra receive queues of each */
+        for (i = 1; i < options->workers; i++) {
+            bridge_setfilter(options, options->queue1[i]);
+            if (options->unidir == 0)
+                bridge_setfilter(options, options->queue2[i]);
         }
     }
 
+    mactable_init();
+
     /* register signals */
     didsig = 0;
     (void)signal(SIGINT, signal_catcher);
 
 
+#ifdef HAVE_LIBPTHREAD
+    if (options->workers > 0) {
+        do_bridge_workers(options);
+    } else
+#endif
     if (options->unidir == 1) {
         do_bridge_unidirectional(options, tcpedit);
     } else {
@@ -254,31 +523,32 @@ live_callback(struct live_data_t *livedata, struct pcap_pkthdr *pkthdr,
 {
     ipv4_hdr_t *ip_hdr = NULL;
     ipv6_hdr_t *ip6_hdr = NULL;
-    pcap_t *send = NULL;
-    static u_char *pktdata = NULL;     /* full packet buffer */
-    int cache_mode, retcode;
-    static unsigned long packetnum = 0;
-    struct macsrc_t *node, finder;  /* rb tree nodes */
-#ifdef DEBUG
-    u_char dstmac[ETHER_ADDR_LEN];
-#endif
+    u_char *pktdata;
+    int cache_mode, retcode, headroom = 0;
+    const u_char *srcmac;
     u_int16_t l2proto;
 
-    packetnum++;
-    dbgx(2, "packet %lu caplen %d", packetnum, pkthdr->caplen);
+    livedata->packetnum++;
+    dbgx(2, "packet %lu caplen %d", livedata->packetnum, pkthdr->caplen);
 
-    /* only malloc the first time */
-    if (pktdata == NULL) {
-        /* create packet buffers */
-        pktdata = (u_char *)safe_malloc(MAXPACKET);
+    /*
+     * libpcap hands us its own receive buffer (the PACKET_MMAP ring on
+     * Linux) which is writable, so edit the frame where it lies.  Only
+     * when the edits could lengthen it do we need room past the end of
+     * the frame, and so a copy.
+     */
+    if (tcpedit_may_grow(livedata->tcpedit, pkthdr)) {
+        /* only malloc the first time */
+        if (livedata->pktbuff == NULL)
+            livedata->pktbuff = (u_char *)safe_malloc(TCPEDIT_HEADROOM + MAXPACKET);
+
+        pktdata = livedata->pktbuff + TCPEDIT_HEADROOM;
+        memcpy(pktdata, nextpkt, pkthdr->caplen);
+        headroom = TCPEDIT_HEADROOM;
     } else {
-        /* zero out the old packet info */
-        memset(pktdata, '\0', MAXPACKET);
+        pktdata = (u_char *)nextpkt;
     }
 
-    /* copy the packet to our buffer */
-    memcpy(pktdata, nextpkt, pkthdr->caplen);
-
 
 #ifdef ENABLE_VERBOSE
     /* decode packet? */
@@ -287,38 +557,24 @@ live_callback(struct live_data_t *livedata, struct pcap_pkthdr *pkthdr,
 #endif
 
 
-    /* lookup our source MAC in the tree */
-    memcpy(&finder.key, &pktdata[ETHER_ADDR_LEN], ETHER_ADDR_LEN);
-#ifdef DEBUG
-    memcpy(&dstmac, pktdata, ETHER_ADDR_LEN);
+    srcmac = &pktdata[ETHER_ADDR_LEN];
     dbgx(1, "SRC MAC: " MAC_FORMAT "\tDST MAC: " MAC_FORMAT,
-        MAC_STR(finder.key), MAC_STR(dstmac));
-#endif
+        MAC_STR(srcmac), MAC_STR(pktdata));
 
     /* first, is this a packet sent locally?  If so, ignore it */
-    if ((memcmp(livedata->options->intf1_mac, &finder.key, ETHER_ADDR_LEN)) == 0) {
+    if ((memcmp(livedata->options->intf1_mac, srcmac, ETHER_ADDR_LEN)) == 0) {
         dbgx(1, "Packet matches the MAC of %s, skipping.", livedata->options->intf1);
         return (1);
     }
-    else if ((memcmp(livedata->options->intf2_mac, &finder.key, ETHER_ADDR_LEN)) == 0) {
+    else if ((memcmp(livedata->options->intf2_mac, srcmac, ETHER_ADDR_LEN)) == 0) {
         dbgx(1, "Packet matches the MAC of %s, skipping.", livedata->options->intf2);
         return (1);
     }
 
-    node = RB_FIND(macsrc_tree, &macsrc_root, &finder);
-
-    /* if we can't find the node, build a new one */
-    if (node == NULL) {
-        dbg(1, "Unable to find MAC in the tree");
-        node = new_node();
-        node->source = livedata->source;
-        memcpy(&node->key, &finder.key, ETHER_ADDR_LEN);
-        RB_INSERT(macsrc_tree, &macsrc_root, node);
-    }
-
-    /* otherwise compare sources */
-    else if (node->source != livedata->source) {
-        dbg(1, "Found the dest MAC in the tree and it doesn't match this source NIC... skipping packet");
+    /* look up (or learn) our source MAC and compare sources */
+    if (!mactable_learn(srcmac, livedata->source, pkthdr->ts.tv_sec,
+                livedata->options->mac_age)) {
+        dbg(1, "Found the source MAC in the table and it doesn't match this source NIC... skipping packet");
         /*
          * IMPORTANT!!!
          * Never send a packet out the same interface we sourced it on!
@@ -360,7 +616,8 @@ live_callback(struct live_data_t *livedata, struct pcap_pkthdr *pkthdr,
 
     }
 
-    if ((retcode = tcpedit_packet(livedata->tcpedit, &pkthdr, &pktdata, cache_mode)) < 0) {
+    if ((retcode = tcpedit_packet_headroom(livedata->tcpedit, &pkthdr, &pktdata,
+            cache_mode, headroom)) < 0) {
         if (retcode == TCPEDIT_SOFT_ERROR) {
             return 1;
         } else { /* TCPEDIT_ERROR */
@@ -372,36 +629,24 @@ live_callback(struct live_data_t *livedata, struct pcap_pkthdr *pkthdr,
      * send packets out the OTHER interface
      * and update the dst mac if necessary
      */
-    switch(node->source) {
-        case PCAP_INT1:
-            dbgx(2, "Packet source was %s... sending out on %s", livedata->options->intf1, 
-                livedata->options->intf2);
-            send = livedata->options->pcap2;
-            break;
-
-        case PCAP_INT2:
-            dbgx(2, "Packet source was %s... sending out on %s", livedata->options->intf2, 
-                livedata->options->intf1);
-            send = livedata->options->pcap1;
-            break;
-
-        default:
-            errx(-1, "wtf?  our node->source != PCAP_INT1 and != PCAP_INT2: %c", 
-                 node->source);
-    }
+    dbgx(2, "Packet source was %s... sending out on %s",
+        livedata->source == PCAP_INT1 ? livedata->options->intf1 : livedata->options->intf2,
+        livedata->sp->device);
 
     /*
-     * write packet out on the network 
+     * stage the packet for bridge_flush() at the end of this
+     * pcap_dispatch(), or now if the batch is full
      */
-     if (pcap_sendpacket(send, pktdata, pkthdr->caplen) < 0)
-         errx(-1, "Unable to send packet out %s: %s", 
-            send == livedata->options->pcap1 ? livedata->options->intf1 : livedata->options->intf2, pcap_geterr(send));
-
-    stats.bytes_sent += pkthdr->caplen;
-    stats.pkts_sent++;
-
-    dbgx(1, "Sent packet " COUNTER_SPEC, stats.pkts_sent);
-
+    if (livedata->batch_cnt == BRIDGE_BATCH_MAX ||
+            livedata->batch_len + pkthdr->caplen > BRIDGE_BATCH_BYTES)
+        bridge_flush(livedata);
+
+    memcpy(livedata->batch + livedata->batch_len, pktdata, pkthdr->caplen);
+    livedata->batch_iov[livedata->batch_cnt].iov_base = livedata->batch + livedata->batch_len;
+    livedata->batch_iov[livedata->batch_cnt].iov_len = pkthdr->caplen;
+    livedata->batch_hdr[livedata->batch_cnt] = *pkthdr;
+    livedata->batch_cnt++;
+    livedata->batch_len += pkthdr->caplen;
 
     return (1);
 } /* live_callback() */
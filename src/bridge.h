@@ -23,24 +23,36 @@
 #define __BRIDGE_H__
 
 #include "config.h"
-#include "lib/tree.h"
 #include "tcpedit/tcpedit.h"
 
 /*
- * RBTree node object for tracking which side of tcpreplay where 
+ * MAC table entry for tracking which side of tcpreplay where
  * each source MAC address lives
  */
 struct macsrc_t {
-    RB_ENTRY(macsrc_t) node;
-    u_char key[ETHER_ADDR_LEN];
-    u_char source;              /* interface device name we first saw the source MAC */
-    sendpacket_t *sp;           /* sendpacket handle to send packets out */
+    uint64_t key;               /* MACTABLE_VALID | source | 48bit MAC, 0 if unused */
+    time_t last_seen;           /* capture time the MAC last sent from its interface */
 };
 
+#define MACTABLE_BITS   16
+#define MACTABLE_SIZE   (1 << MACTABLE_BITS)    /* entries, power of 2 */
+#define MACTABLE_PROBE  16                      /* max slots checked per lookup */
+#define MACTABLE_VALID  (1ULL << 48)
+#define MACTABLE_MAC_MASK (MACTABLE_VALID | 0xffffffffffffULL)
+#define MACTABLE_SOURCE_SHIFT 56                /* interface we saw the source MAC on */
+
 /* pri and secondary pcap interfaces */
 #define PCAP_INT1 0
 #define PCAP_INT2 1
 
+/*
+ * Packets of one pcap_dispatch() staged for one sendpacket_batch().  They
+ * have to be copied: libpcap hands the ring frames back to the kernel
+ * once the callback returns.
+ */
+#define BRIDGE_BATCH_MAX    SENDPACKET_BATCH_MAX
+#define BRIDGE_BATCH_BYTES  (256 * 1024)    /* at least one MAXPACKET */
+
 /* our custom pcap_dispatch handler user struct */
 struct live_data_t {
     u_int32_t linktype;
@@ -49,11 +61,22 @@ struct live_data_t {
     u_char source;
     char *l2data;
     pcap_t *pcap;
+    sendpacket_t *sp;           /* sends out the OTHER interface */
     tcpedit_t *tcpedit;
     tcpbridge_opt_t *options;
+    tcpreplay_stats_t *stats;
+    u_char *pktbuff;            /* full packet buffer for edits that grow */
+    unsigned long packetnum;
+
+    /* packets waiting for bridge_flush() */
+    u_char *batch;              /* BRIDGE_BATCH_BYTES */
+    size_t batch_len;
+    unsigned int batch_cnt;
+    struct iovec batch_iov[BRIDGE_BATCH_MAX];
+    struct pcap_pkthdr batch_hdr[BRIDGE_BATCH_MAX];
 };
 
-void rbinit(void);
+void mactable_init(void);
 void do_bridge(tcpbridge_opt_t *, tcpedit_t *);
 
 
@@ -46,6 +46,15 @@ extern "C" {
 #include "common/sendpacket.h"
 #include "common/interface.h"
 #include "common/flows.h"
+#include "common/pcap_mmap.h"
+#include "common/compress.h"
+#include "common/pcap_index.h"
+#include "common/pcap_dir.h"
+#include "common/pcap_meta.h"
+#include "common/pcap_writer.h"
+#include "common/shm_ring.h"
+#include "common/ctl_block.h"
+#include "common/measure.h"
 
 const char *git_version(void); /* git_version.c */
 
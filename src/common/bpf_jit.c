@@ -0,0 +1,474 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Translates classic BPF to eBPF for uBPF's JIT, much as the Linux
+ * kernel does for socket filters.  A and X live in r6 and r7, zero
+ * extended to 64 bits so the unsigned 64 bit jumps compare them like
+ * the 32 bit classic ones, and the scratch words M[] are on the eBPF
+ * stack.  Every packet load checks its end against the captured length
+ * and returns 0 past it, like bpf_filter().
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bpf_jit.h"
+
+#ifdef HAVE_UBPF
+#include <ubpf.h>
+
+/* the eBPF registers the translation uses */
+#define R_RET       0
+#define R_CTX       1               /* struct bpf_jit_md */
+#define R_TMP       2
+#define R_END       3
+#define R_A         6
+#define R_X         7
+#define R_PKT       8
+#define R_CAPLEN    9
+#define R_FP        10
+
+/* the eBPF opcodes it emits, ALU and jumps take the classic BPF_OP() */
+#define EBPF_ALU32_K    0x04
+#define EBPF_ALU32_X    0x0c
+#define EBPF_ADD64_K    0x07
+#define EBPF_ADD64_X    0x0f
+#define EBPF_MOV32_K    0xb4
+#define EBPF_MOV64_X    0xbf
+#define EBPF_BE         0xdc
+#define EBPF_LDX_W      0x61
+#define EBPF_LDX_H      0x69
+#define EBPF_LDX_B      0x71
+#define EBPF_LDX_DW     0x79
+#define EBPF_ST_W       0x62
+#define EBPF_STX_W      0x63
+#define EBPF_JA         0x05
+#define EBPF_JEQ_K      0x15
+#define EBPF_JGE_K      0x35
+#define EBPF_JMP_X      0x0d
+#define EBPF_EXIT       0x95
+
+/* not in every bpf.h */
+#ifndef BPF_MOD
+#define BPF_MOD         0x90
+#endif
+#ifndef BPF_XOR
+#define BPF_XOR         0xa0
+#endif
+
+/* M[k] on the stack */
+#define BPF_JIT_MEM(k)  (-(int)((BPF_MEMWORDS - (k)) * sizeof(uint32_t)))
+
+/* the most eBPF instructions one classic instruction becomes */
+#define BPF_JIT_MAX_EXPAND 8
+
+/* what the program gets in r1 */
+struct bpf_jit_md {
+    uint64_t data;
+    uint32_t caplen;
+    uint32_t wirelen;
+};
+
+/* the layout uBPF loads */
+struct ebpf_insn {
+    uint8_t opcode;
+    uint8_t dst:4;
+    uint8_t src:4;
+    int16_t off;
+    int32_t imm;
+};
+
+/* a jump whose off is filled in once every classic instruction is placed */
+typedef struct bpf_jit_fixup_s {
+    int at;
+    u_int target;                   /* classic pc, bf_len for "return 0" */
+} bpf_jit_fixup_t;
+
+typedef struct bpf_jit_prog_s {
+    struct ebpf_insn *insns;
+    int cnt;
+    bpf_jit_fixup_t *fixups;
+    int nfixups;
+} bpf_jit_prog_t;
+
+struct tcpr_bpf_jit_s {
+    struct ubpf_vm *vm;
+    ubpf_jit_fn fn;
+};
+
+static void
+bpf_jit_emit(bpf_jit_prog_t *p, uint8_t opcode, int dst, int src, int off, int32_t imm)
+{
+    struct ebpf_insn *insn = &p->insns[p->cnt++];
+
+    insn->opcode = opcode;
+    insn->dst = dst;
+    insn->src = src;
+    insn->off = (int16_t)off;
+    insn->imm = imm;
+}
+
+static void
+bpf_jit_jump(bpf_jit_prog_t *p, uint8_t opcode, int dst, int src, int32_t imm, u_int target)
+{
+    p->fixups[p->nfixups].at = p->cnt;
+    p->fixups[p->nfixups].target = target;
+    p->nfixups++;
+    bpf_jit_emit(p, opcode, dst, src, 0, imm);
+}
+
+/*
+ * dst = the size bytes at k, or X + k, in network byte order, returning
+ * 0 from the program if they are past the captured length
+ */
+static int
+bpf_jit_load(bpf_jit_prog_t *p, int size, bool indirect, u_int k, int dst, u_int fail)
+{
+    uint8_t opcode;
+    int bytes;
+
+    switch (size) {
+    case BPF_W:
+        opcode = EBPF_LDX_W;
+        bytes = 4;
+        break;
+    case BPF_H:
+        opcode = EBPF_LDX_H;
+        bytes = 2;
+        break;
+    case BPF_B:
+        opcode = EBPF_LDX_B;
+        bytes = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    /* in 64 bits, so X + k + bytes can't wrap */
+    bpf_jit_emit(p, EBPF_MOV32_K, R_TMP, 0, 0, (int32_t)k);
+    if (indirect)
+        bpf_jit_emit(p, EBPF_ADD64_X, R_TMP, R_X, 0, 0);
+    bpf_jit_emit(p, EBPF_MOV64_X, R_END, R_TMP, 0, 0);
+    bpf_jit_emit(p, EBPF_ADD64_K, R_END, 0, 0, bytes);
+    bpf_jit_jump(p, EBPF_JMP_X | BPF_JGT, R_END, R_CAPLEN, 0, fail);
+    bpf_jit_emit(p, EBPF_ADD64_X, R_TMP, R_PKT, 0, 0);
+    bpf_jit_emit(p, opcode, dst, R_TMP, 0, 0);
+    if (bytes > 1)
+        bpf_jit_emit(p, EBPF_BE, dst, 0, 0, bytes * 8);
+
+    return 0;
+}
+
+/* translates program into p, -1 if it has anything we don't know */
+static int
+bpf_jit_translate(bpf_jit_prog_t *p, const struct bpf_program *program)
+{
+    const struct bpf_insn *in;
+    u_int n = program->bf_len, pc, k;
+    int *start, dst, src, i, off;
+
+    start = (int *)safe_malloc((n + 1) * sizeof(int));
+
+    bpf_jit_emit(p, EBPF_MOV32_K, R_A, 0, 0, 0);
+    bpf_jit_emit(p, EBPF_MOV32_K, R_X, 0, 0, 0);
+    bpf_jit_emit(p, EBPF_LDX_DW, R_PKT, R_CTX, offsetof(struct bpf_jit_md, data), 0);
+    bpf_jit_emit(p, EBPF_LDX_W, R_CAPLEN, R_CTX, offsetof(struct bpf_jit_md, caplen), 0);
+    for (i = 0; i < BPF_MEMWORDS; i++)
+        bpf_jit_emit(p, EBPF_ST_W, R_FP, 0, BPF_JIT_MEM(i), 0);
+
+    for (pc = 0; pc < n; pc++) {
+        in = &program->bf_insns[pc];
+        k = in->k;
+        start[pc] = p->cnt;
+
+        switch (BPF_CLASS(in->code)) {
+        case BPF_LD:
+        case BPF_LDX:
+            dst = BPF_CLASS(in->code) == BPF_LD ? R_A : R_X;
+            switch (BPF_MODE(in->code)) {
+            case BPF_IMM:
+                bpf_jit_emit(p, EBPF_MOV32_K, dst, 0, 0, (int32_t)k);
+                break;
+            case BPF_LEN:
+                bpf_jit_emit(p, EBPF_LDX_W, dst, R_CTX,
+                        offsetof(struct bpf_jit_md, wirelen), 0);
+                break;
+            case BPF_MEM:
+                if (k >= BPF_MEMWORDS)
+                    goto fail;
+                bpf_jit_emit(p, EBPF_LDX_W, dst, R_FP, BPF_JIT_MEM(k), 0);
+                break;
+            case BPF_ABS:
+            case BPF_IND:
+                if (dst != R_A || bpf_jit_load(p, BPF_SIZE(in->code),
+                        BPF_MODE(in->code) == BPF_IND, k, R_A, n) < 0)
+                    goto fail;
+                break;
+            case BPF_MSH:
+                /* X = 4 * (P[k] & 0xf), the IPv4 header length */
+                if (dst != R_X || bpf_jit_load(p, BPF_B, false, k, R_X, n) < 0)
+                    goto fail;
+                bpf_jit_emit(p, EBPF_ALU32_K | BPF_AND, R_X, 0, 0, 0xf);
+                bpf_jit_emit(p, EBPF_ALU32_K | BPF_LSH, R_X, 0, 0, 2);
+                break;
+            default:
+                goto fail;
+            }
+            break;
+
+        case BPF_ST:
+        case BPF_STX:
+            if (k >= BPF_MEMWORDS)
+                goto fail;
+            src = BPF_CLASS(in->code) == BPF_ST ? R_A : R_X;
+            bpf_jit_emit(p, EBPF_STX_W, R_FP, src, BPF_JIT_MEM(k), 0);
+            break;
+
+        case BPF_ALU:
+            switch (BPF_OP(in->code)) {
+            case BPF_ADD:
+            case BPF_SUB:
+            case BPF_MUL:
+            case BPF_OR:
+            case BPF_AND:
+            case BPF_XOR:
+                break;
+            case BPF_LSH:
+            case BPF_RSH:
+                /* bpf_filter() gives 0 for X >= 32, eBPF would use X & 31 */
+                if (BPF_SRC(in->code) == BPF_X) {
+                    bpf_jit_emit(p, EBPF_JGE_K, R_X, 0, 2, 32);
+                    bpf_jit_emit(p, EBPF_ALU32_X | BPF_OP(in->code), R_A, R_X, 0, 0);
+                    bpf_jit_emit(p, EBPF_JA, 0, 0, 1, 0);
+                    bpf_jit_emit(p, EBPF_MOV32_K, R_A, 0, 0, 0);
+                    continue;
+                }
+                break;
+            case BPF_DIV:
+            case BPF_MOD:
+                /* bpf_filter() returns 0 rather than divide by 0 */
+                if (BPF_SRC(in->code) == BPF_X) {
+                    bpf_jit_jump(p, EBPF_JEQ_K, R_X, 0, 0, n);
+                } else if (k == 0) {
+                    bpf_jit_jump(p, EBPF_JA, 0, 0, 0, n);
+                    continue;
+                }
+                break;
+            case BPF_NEG:
+                bpf_jit_emit(p, EBPF_ALU32_K | BPF_NEG, R_A, 0, 0, 0);
+                continue;
+            default:
+                goto fail;
+            }
+            if (BPF_SRC(in->code) == BPF_X)
+                bpf_jit_emit(p, EBPF_ALU32_X | BPF_OP(in->code), R_A, R_X, 0, 0);
+            else
+                bpf_jit_emit(p, EBPF_ALU32_K | BPF_OP(in->code), R_A, 0, 0, (int32_t)k);
+            break;
+
+        case BPF_JMP:
+            if (BPF_OP(in->code) == BPF_JA) {
+                if (k >= n - pc - 1)
+                    goto fail;
+                bpf_jit_jump(p, EBPF_JA, 0, 0, 0, pc + 1 + k);
+                break;
+            }
+
+            switch (BPF_OP(in->code)) {
+            case BPF_JEQ:
+            case BPF_JGT:
+            case BPF_JGE:
+            case BPF_JSET:
+                break;
+            default:
+                goto fail;
+            }
+            if (in->jt >= n - pc - 1 || in->jf >= n - pc - 1)
+                goto fail;
+
+            /* an immediate would be sign extended to 64 bits, k isn't */
+            if (BPF_SRC(in->code) == BPF_K) {
+                bpf_jit_emit(p, EBPF_MOV32_K, R_TMP, 0, 0, (int32_t)k);
+                src = R_TMP;
+            } else {
+                src = R_X;
+            }
+            bpf_jit_jump(p, EBPF_JMP_X | BPF_OP(in->code), R_A, src, 0, pc + 1 + in->jt);
+            if (in->jf != 0)
+                bpf_jit_jump(p, EBPF_JA, 0, 0, 0, pc + 1 + in->jf);
+            break;
+
+        case BPF_RET:
+            switch (BPF_RVAL(in->code)) {
+            case BPF_K:
+                bpf_jit_emit(p, EBPF_MOV32_K, R_RET, 0, 0, (int32_t)k);
+                break;
+            case BPF_A:
+                bpf_jit_emit(p, EBPF_MOV64_X, R_RET, R_A, 0, 0);
+                break;
+            default:
+                goto fail;
+            }
+            bpf_jit_emit(p, EBPF_EXIT, 0, 0, 0, 0);
+            break;
+
+        case BPF_MISC:
+            switch (BPF_MISCOP(in->code)) {
+            case BPF_TAX:
+                bpf_jit_emit(p, EBPF_MOV64_X, R_X, R_A, 0, 0);
+                break;
+            case BPF_TXA:
+                bpf_jit_emit(p, EBPF_MOV64_X, R_A, R_X, 0, 0);
+                break;
+            default:
+                goto fail;
+            }
+            break;
+
+        default:
+            goto fail;
+        }
+    }
+
+    /* return 0, for loads past the end and dividing by 0 */
+    start[n] = p->cnt;
+    bpf_jit_emit(p, EBPF_MOV32_K, R_RET, 0, 0, 0);
+    bpf_jit_emit(p, EBPF_EXIT, 0, 0, 0, 0);
+
+    for (i = 0; i < p->nfixups; i++) {
+        off = start[p->fixups[i].target] - (p->fixups[i].at + 1);
+        if (off > INT16_MAX)
+            goto fail;
+        p->insns[p->fixups[i].at].off = (int16_t)off;
+    }
+
+    safe_free(start);
+    return 0;
+
+fail:
+    dbgx(1, "BPF instruction %u (0x%04x) can't be translated for the JIT", pc,
+            pc < n ? program->bf_insns[pc].code : 0);
+    safe_free(start);
+    return -1;
+}
+#endif /* HAVE_UBPF */
+
+/**
+ * \brief Translates a compiled filter for uBPF's JIT
+ *
+ * Returns NULL if tcpreplay was built without uBPF, uBPF has no JIT for
+ * this CPU or the program can't be translated, in which case run it
+ * with bpf_filter() as before.
+ */
+tcpr_bpf_jit_t *
+tcpr_bpf_jit_open(const struct bpf_program *program)
+{
+#ifdef HAVE_UBPF
+    tcpr_bpf_jit_t *jit;
+    bpf_jit_prog_t p;
+    char *errmsg = NULL;
+
+    assert(program);
+
+    if (program->bf_len == 0 || program->bf_len > BPF_MAXINSNS)
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+    p.insns = (struct ebpf_insn *)safe_malloc((program->bf_len * BPF_JIT_MAX_EXPAND +
+            BPF_MEMWORDS + 8) * sizeof(struct ebpf_insn));
+    p.fixups = (bpf_jit_fixup_t *)safe_malloc(program->bf_len * 2 * sizeof(bpf_jit_fixup_t));
+
+    jit = (tcpr_bpf_jit_t *)safe_malloc(sizeof(tcpr_bpf_jit_t));
+    if (bpf_jit_translate(&p, program) < 0)
+        goto fail;
+
+    if ((jit->vm = ubpf_create()) == NULL)
+        goto fail;
+
+    if (ubpf_load(jit->vm, p.insns, p.cnt * sizeof(struct ebpf_insn), &errmsg) < 0) {
+        dbgx(1, "uBPF won't load the translated BPF filter: %s", errmsg ? errmsg : "unknown error");
+        goto fail;
+    }
+
+    if ((jit->fn = ubpf_compile(jit->vm, &errmsg)) == NULL) {
+        dbgx(1, "uBPF can't JIT the BPF filter: %s", errmsg ? errmsg : "unknown error");
+        goto fail;
+    }
+
+    dbgx(1, "BPF filter of %u instructions JIT compiled from %d eBPF instructions",
+            program->bf_len, p.cnt);
+    safe_free(p.insns);
+    safe_free(p.fixups);
+    return jit;
+
+fail:
+    free(errmsg);
+    if (jit->vm != NULL)
+        ubpf_destroy(jit->vm);
+    safe_free(jit);
+    safe_free(p.insns);
+    safe_free(p.fixups);
+    return NULL;
+#else
+    (void)program;
+    return NULL;
+#endif
+}
+
+/**
+ * \brief Runs the filter over a packet
+ *
+ * Returns what bpf_filter() would: 0 if the packet doesn't match.
+ */
+u_int
+tcpr_bpf_jit_filter(const tcpr_bpf_jit_t *jit, const u_char *pktdata, u_int wirelen,
+        u_int caplen)
+{
+#ifdef HAVE_UBPF
+    struct bpf_jit_md md;
+
+    md.data = (uintptr_t)pktdata;
+    md.caplen = caplen;
+    md.wirelen = wirelen;
+    return (u_int)jit->fn(&md, sizeof(md));
+#else
+    (void)jit;
+    (void)pktdata;
+    (void)wirelen;
+    (void)caplen;
+    return 0;
+#endif
+}
+
+void
+tcpr_bpf_jit_close(tcpr_bpf_jit_t *jit)
+{
+    if (jit == NULL)
+        return;
+
+#ifdef HAVE_UBPF
+    ubpf_destroy(jit->vm);
+#endif
+    safe_free(jit);
+}
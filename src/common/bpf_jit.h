@@ -0,0 +1,39 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BPF_JIT_H_
+#define BPF_JIT_H_
+
+#include "config.h"
+#include "defines.h"
+
+/*
+ * A classic BPF program from pcap_compile() translated to eBPF and JIT
+ * compiled by uBPF, for filtering offline packets faster than libpcap's
+ * bpf_filter() interpreter.  The translation does its own bounds checks
+ * and keeps no state between packets, so any number of threads can run
+ * the same filter at once.
+ */
+typedef struct tcpr_bpf_jit_s tcpr_bpf_jit_t;
+
+tcpr_bpf_jit_t *tcpr_bpf_jit_open(const struct bpf_program *program);
+u_int tcpr_bpf_jit_filter(const tcpr_bpf_jit_t *jit, const u_char *pktdata,
+        u_int wirelen, u_int caplen);
+void tcpr_bpf_jit_close(tcpr_bpf_jit_t *jit);
+
+#endif
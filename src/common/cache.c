@@ -31,12 +31,20 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined HAVE_SYS_MMAN_H && !defined MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 
 #ifdef DEBUG
 extern int debug;
 #endif
 
 static tcpr_cache_t *new_cache(void);
+static void cache_store_word(tcpr_cache_t *);
 
 /**
  * Takes a single char and returns a ptr to a string representation of the
@@ -57,28 +65,102 @@ byte2bits(char byte, char *bitstring) {
 }
 #endif
 
+/**
+ * reads exactly len bytes, returns how many were read before EOF or -1
+ */
+static ssize_t
+cache_read(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        if ((n = read(fd, (char *)buf + got, len - got)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (n == 0)
+            break;
+
+        got += n;
+    }
+
+    return got;
+}
+
+/**
+ * writes all of len bytes or aborts
+ */
+static void
+cache_write(int fd, const void *buf, size_t len, const char *what)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = write(fd, (const char *)buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errx(-1, "Only wrote %zu of %zu bytes of the %s!\n%s",
+                 done, len, what, strerror(errno));
+        }
+
+        done += n;
+    }
+
+    dbgx(1, "Wrote %zu bytes of %s", done, what);
+}
+
+/**
+ * bytes of packet data for num_packets packets
+ */
+static COUNTER
+cache_data_len(COUNTER num_packets, COUNTER packets_per_byte)
+{
+    COUNTER len = num_packets / packets_per_byte;
+
+    /* deal with any remainder, because above division is integer */
+    if (num_packets % packets_per_byte)
+        len++;
+
+    return len;
+}
+
 /**
  * simple function to read in a cache file created with tcpprep this let's us
  * be really damn fast in picking an interface to send the packet out returns
  * number of cache entries read
  * 
  * now also checks for the cache magic and version
+ *
+ * The packet data is mapped rather than copied into memory, and in a
+ * version 5 file it starts on a page boundary.  Release it with
+ * close_cache().
  */
 
 COUNTER
 read_cache(char **cachedata, const char *cachefile, char **comment)
 {
-    int cachefd;
+    int cachefd, version;
     tcpr_cache_file_hdr_t header;
+    tcpr_cache_file_idx_t index;
     ssize_t read_size = 0;
-    COUNTER cache_size = 0;
+    COUNTER cache_size = 0, data_offset, pos;
+    size_t pgoff = 0, maplen;
+    char *base;
+#ifdef HAVE_SYS_MMAN_H
+    struct stat statinfo;
+    char skip[CACHE_DATA_ALIGN];
+#endif
 
     /* open the file or abort */
     if ((cachefd = open(cachefile, O_RDONLY)) == -1)
         errx(-1, "unable to open %s:%s", cachefile, strerror(errno));
 
     /* read the cache header and determine compatibility */
-    if ((read_size = read(cachefd, &header, sizeof(header))) < 0)
+    if ((read_size = cache_read(cachefd, &header, sizeof(header))) < 0)
         errx(-1, "unable to read from %s:%s,", cachefile, strerror(errno));
 
     if (read_size < (ssize_t)sizeof(header))
@@ -89,45 +171,107 @@ read_cache(char **cachedata, const char *cachefile, char **comment)
         errx(-1, "Unable to process %s: not a tcpprep cache file", cachefile);
 
     /* verify version */
-    if (atoi(header.version) != atoi(CACHEVERSION))
+    version = atoi(header.version);
+    if (version != atoi(CACHEVERSION) && version != atoi(CACHEVERSION5))
         errx(-1, "Unable to process %s: cache file version mismatch",
              cachefile);
 
+    pos = sizeof(header);
+    if (version >= atoi(CACHEVERSION5)) {
+        if (cache_read(cachefd, &index, sizeof(index)) != (ssize_t)sizeof(index))
+            errx(-1, "Cache file %s doesn't contain a full index", cachefile);
+        pos += sizeof(index);
+    }
+
     /* read the comment */
     header.comment_len = ntohs(header.comment_len);
     *comment = (char *)safe_malloc(header.comment_len + 1);
 
     dbgx(1, "Comment length: %d", header.comment_len);
     
-    if ((read_size = read(cachefd, *comment, header.comment_len)) 
+    if ((read_size = cache_read(cachefd, *comment, header.comment_len)) 
             != header.comment_len)
         errx(-1, "Unable to read %d bytes of data for the comment (%zu) %s", 
             header.comment_len, read_size, 
-            read_size == -1 ? strerror(read_size) : "");
+            read_size == -1 ? strerror(errno) : "");
+    pos += header.comment_len;
 
     dbgx(1, "Cache file comment: %s", *comment);
 
-    /* malloc our cache block */
     header.num_packets = ntohll(header.num_packets);
     header.packets_per_byte = ntohs(header.packets_per_byte);    
-    cache_size = header.num_packets / header.packets_per_byte;
-        
-    /* deal with any remainder, because above division is integer */
-    if (header.num_packets % header.packets_per_byte)
-      cache_size ++;
+    if (header.packets_per_byte != CACHE_PACKETS_PER_BYTE)
+        errx(-1, "Unable to process %s: %d packets per byte isn't supported",
+             cachefile, header.packets_per_byte);
+
+    cache_size = cache_data_len(header.num_packets, header.packets_per_byte);
 
     dbgx(1, "Cache file contains %" PRIu64 " packets in " COUNTER_SPEC " bytes",
         header.num_packets, cache_size);
 
     dbgx(1, "Cache uses %d packets per byte", header.packets_per_byte);
 
-    *cachedata = (char *)safe_malloc(cache_size);
+    if (version >= atoi(CACHEVERSION5)) {
+        data_offset = ntohll(index.data_offset);
+        if (ntohll(index.data_len) != cache_size || data_offset < pos)
+            errx(-1, "Unable to process %s: cache index doesn't match the header",
+                 cachefile);
+    } else {
+        data_offset = pos;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    /* mmap() offsets must be page aligned, version 4 data usually isn't */
+    pgoff = data_offset % (COUNTER)sysconf(_SC_PAGESIZE);
+    maplen = max(pgoff + cache_size, 1);
 
-    /* read in the cache */
-    if ((COUNTER)(read_size = read(cachefd, *cachedata, cache_size)) 
-            != cache_size)
+    base = MAP_FAILED;
+    if (fstat(cachefd, &statinfo) == 0 && S_ISREG(statinfo.st_mode)) {
+        if ((COUNTER)statinfo.st_size < data_offset + cache_size)
+            errx(-1, "Cache data length (" COUNTER_SPEC " bytes) doesn't match "
+                "cache header (" COUNTER_SPEC " bytes)",
+                (COUNTER)statinfo.st_size > data_offset ? (COUNTER)statinfo.st_size - data_offset : 0,
+                cache_size);
+
+        base = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, cachefd, data_offset - pgoff);
+    }
+
+    if (base == MAP_FAILED) {
+        /* a pipe or such: read it into anonymous memory laid out the same way */
+        if ((base = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+            errx(-1, "Unable to allocate " COUNTER_SPEC " bytes for %s: %s",
+                 cache_size, cachefile, strerror(errno));
+
+        /* skip the version 5 padding */
+        while (pos < data_offset) {
+            if (cache_read(cachefd, skip, min(sizeof(skip), data_offset - pos)) <= 0)
+                errx(-1, "Unable to read the cache data of %s", cachefile);
+            pos += min(sizeof(skip), data_offset - pos);
+        }
+
+        if ((COUNTER)(read_size = cache_read(cachefd, base + pgoff, cache_size)) != cache_size)
+            errx(-1, "Cache data length (%zu bytes) doesn't match "
+                "cache header (" COUNTER_SPEC " bytes)", read_size, cache_size);
+    }
+#ifdef MADV_WILLNEED
+    else {
+        madvise(base, maplen, MADV_WILLNEED);
+    }
+#endif
+#else
+    maplen = max(cache_size, 1);
+    base = (char *)safe_malloc(maplen);
+
+    if (lseek(cachefd, (off_t)data_offset, SEEK_SET) < 0)
+        errx(-1, "Unable to seek to the cache data of %s: %s", cachefile, strerror(errno));
+
+    if ((COUNTER)(read_size = cache_read(cachefd, base, cache_size)) != cache_size)
         errx(-1, "Cache data length (%zu bytes) doesn't match "
             "cache header (" COUNTER_SPEC " bytes)", read_size, cache_size);
+#endif
+
+    *cachedata = base + pgoff;
 
     dbgx(1, "Loaded in %" PRIu64 " packets from cache.", header.num_packets);
 
@@ -135,92 +279,164 @@ read_cache(char **cachedata, const char *cachefile, char **comment)
     return (header.num_packets);
 }
 
-
 /**
- * writes out the cache file header, comment and then the
- * contents of *cachedata to out_file and then returns the number 
- * of cache entries written
+ * releases the cachedata of a read_cache() which returned num_packets
  */
-COUNTER
-write_cache(tcpr_cache_t * cachedata, const int out_file, COUNTER numpackets, 
-    char *comment)
+void
+close_cache(char *cachedata, COUNTER num_packets)
 {
-    tcpr_cache_t *mycache = NULL;
-    tcpr_cache_file_hdr_t *cache_header = NULL;
-    uint32_t chars, last = 0;
-    COUNTER packets = 0;
-    ssize_t written = 0;
+    size_t pgoff = 0;
+
+    if (cachedata == NULL)
+        return;
+
+#ifdef HAVE_SYS_MMAN_H
+    pgoff = (uintptr_t)cachedata % (uintptr_t)sysconf(_SC_PAGESIZE);
+    munmap(cachedata - pgoff,
+            max(pgoff + cache_data_len(num_packets, CACHE_PACKETS_PER_BYTE), 1));
+#else
+    (void)num_packets;
+    (void)pgoff;
+    safe_free(cachedata);
+#endif
+}
 
-    assert(cachedata);
-    assert(out_file);
 
-    /* write a header to our file */
-    cache_header = (tcpr_cache_file_hdr_t *)
-        safe_malloc(sizeof(tcpr_cache_file_hdr_t));
-    strncpy(cache_header->magic, CACHEMAGIC, strlen(CACHEMAGIC));
-    strncpy(cache_header->version, CACHEVERSION, strlen(CACHEVERSION));
-    cache_header->packets_per_byte = htons(CACHE_PACKETS_PER_BYTE);
-    cache_header->num_packets = htonll((u_int64_t)numpackets);
+/**
+ * writes the header, index, comment and padding which go before the
+ * packet data of chars bytes
+ */
+static void
+cache_write_header(const int out_file, COUNTER numpackets, COUNTER chars,
+    char *comment, int version)
+{
+    tcpr_cache_file_hdr_t cache_header;
+    tcpr_cache_file_idx_t index;
+    static const char zeros[CACHE_DATA_ALIGN];
+    uint16_t comment_len = 0;
+    COUNTER data_offset;
 
     /* we can't strlen(NULL) so ... */
-    if (comment != NULL) {
-        cache_header->comment_len = htons((uint16_t)strlen(comment));
+    if (comment != NULL)
+        comment_len = (uint16_t)strlen(comment);
+
+    /* write a header to our file */
+    memset(&cache_header, 0, sizeof(cache_header));
+    strncpy(cache_header.magic, CACHEMAGIC, strlen(CACHEMAGIC));
+    if (version >= atoi(CACHEVERSION5)) {
+        strncpy(cache_header.version, CACHEVERSION5, strlen(CACHEVERSION5));
     } else {
-        cache_header->comment_len = 0;
+        strncpy(cache_header.version, CACHEVERSION, strlen(CACHEVERSION));
     }
+    cache_header.packets_per_byte = htons(CACHE_PACKETS_PER_BYTE);
+    cache_header.num_packets = htonll((u_int64_t)numpackets);
+    cache_header.comment_len = htons(comment_len);
+
+    cache_write(out_file, &cache_header, sizeof(cache_header), "cache file header");
 
-    written = write(out_file, cache_header, sizeof(tcpr_cache_file_hdr_t));
-    dbgx(1, "Wrote %zu bytes of cache file header", written);
+    data_offset = sizeof(cache_header) + comment_len;
 
-    if (written != sizeof(tcpr_cache_file_hdr_t))
-        errx(-1, "Only wrote %zu of %zu bytes of the cache file header!\n%s",
-             written, sizeof(tcpr_cache_file_hdr_t),
-             written == -1 ? strerror(errno) : "");
+    if (version >= atoi(CACHEVERSION5)) {
+        data_offset += sizeof(index);
+        data_offset = (data_offset + CACHE_DATA_ALIGN - 1) & ~((COUNTER)CACHE_DATA_ALIGN - 1);
+        index.data_offset = htonll((u_int64_t)data_offset);
+        index.data_len = htonll((u_int64_t)chars);
+        cache_write(out_file, &index, sizeof(index), "cache file index");
+    }
 
     /* don't write comment if there is none */
-    if (comment != NULL) {
-        written = write(out_file, comment, strlen(comment));
-        dbgx(1, "Wrote %zu bytes of comment", written);
-        
-        if (written != (ssize_t)strlen(comment))
-            errx(-1, "Only wrote %zu of %zu bytes of the comment!\n%s",
-                 written, strlen(comment), 
-                 written == -1 ? strerror(errno) : "");
+    if (comment != NULL)
+        cache_write(out_file, comment, comment_len, "comment");
+
+    /* pad out to the aligned start of the data */
+    if (version >= atoi(CACHEVERSION5)) {
+        cache_write(out_file, zeros,
+                data_offset - (sizeof(cache_header) + sizeof(index) + comment_len), "padding");
     }
+}
 
-    mycache = cachedata;
+/**
+ * overwrites a 64 bit header field of a streamed cache file
+ */
+static void
+cache_patch(int fd, off_t offset, u_int64_t value, const char *what)
+{
+    value = htonll(value);
+    if (pwrite(fd, &value, sizeof(value), offset) != (ssize_t)sizeof(value))
+        errx(-1, "Unable to update the %s: %s", what, strerror(errno));
+}
 
-    while (!last) {
-        /* increment total packets */
-        packets += mycache->packets;
+/**
+ * Starts a cache file on out_file and returns a cache whose data
+ * add_cache() writes out every CACHE_STREAM_SIZE bytes, so memory stays
+ * the same however many packets there are.  write_cache() writes the
+ * rest and fills in the counts.  Files which can't seek back to the
+ * header get an in memory cache written by write_cache() as usual.
+ */
+tcpr_cache_t *
+open_cache(const int out_file, char *comment, int version)
+{
+    tcpr_cache_t *cache;
 
-        /* calculate how many chars to write */
-        chars = mycache->packets / CACHE_PACKETS_PER_BYTE;
-        if (mycache->packets % CACHE_PACKETS_PER_BYTE) {
-            chars++;
-            dbgx(1, "Bumping up to the next byte: %d %% %d", mycache->packets,
-                CACHE_PACKETS_PER_BYTE);
-        }
+    cache = new_cache();
 
-        /* write to file, and verify it wrote properly */
-        written = write(out_file, mycache->data, chars);
-        dbgx(1, "Wrote %zu bytes of cache data", written);
-        if (written != (ssize_t)chars)
-            errx(-1, "Only wrote %zu of %i bytes to cache file!", written, chars);
-
-        /*
-         * if that was the last, stop processing, otherwise wash,
-         * rinse, repeat
-         */
-        if (mycache->next != NULL) {
-            mycache = mycache->next;
-        }
-        else {
-            last = 1;
+    if (lseek(out_file, 0, SEEK_CUR) < 0) {
+        dbgx(1, "Cache file isn't seekable, keeping the cache in memory: %s", strerror(errno));
+        return cache;
+    }
+
+    cache_write_header(out_file, 0, 0, comment, version);
+    cache->fd = out_file;
+    cache->version = version;
+    cache->size = CACHE_STREAM_SIZE;
+    cache->data = (char *)safe_malloc(cache->size);
+
+    return cache;
+}
+
+/**
+ * writes out the cache file header, comment and then the
+ * contents of *cachedata to out_file and then returns the number 
+ * of cache entries written.  version is 4 or 5.
+ *
+ * A cache from open_cache() already has its header and most of its
+ * data in out_file: this writes the rest and patches the counts in.
+ */
+COUNTER
+write_cache(tcpr_cache_t * cachedata, const int out_file, COUNTER numpackets, 
+    char *comment, int version)
+{
+    COUNTER chars;
+
+    assert(cachedata);
+    assert(out_file);
+
+    /* the packets since the last whole word */
+    cache_store_word(cachedata);
+    chars = cache_data_len(cachedata->packets, CACHE_PACKETS_PER_BYTE);
+
+    if (cachedata->fd < 0) {
+        cache_write_header(out_file, numpackets, chars, comment, version);
+
+        /* the bitmap is already laid out as the file stores it */
+        cache_write(out_file, cachedata->data, chars, "cache data");
+    } else {
+        assert(cachedata->fd == out_file);
+
+        cache_write(out_file, cachedata->data, chars - cachedata->written, "cache data");
+        cachedata->written = chars;
+
+        cache_patch(out_file, offsetof(tcpr_cache_file_hdr_t, num_packets),
+                (u_int64_t)numpackets, "cache file header");
+        if (cachedata->version >= atoi(CACHEVERSION5)) {
+            cache_patch(out_file, sizeof(tcpr_cache_file_hdr_t) +
+                    offsetof(tcpr_cache_file_idx_t, data_len),
+                    (u_int64_t)chars, "cache file index");
         }
     }
+
     /* return number of packets written */
-    return (packets);
+    return (cachedata->packets);
 }
 
 /**
@@ -234,84 +450,110 @@ new_cache(void)
 
     /* malloc mem */
     newcache = (tcpr_cache_t *)safe_malloc(sizeof(tcpr_cache_t));
+    newcache->fd = -1;
     return (newcache);
 }
 
 /**
- * adds the cache data for a packet to the given cachedata
+ * frees a cache built with add_cache()
  */
+void
+free_cache(tcpr_cache_t *cachedata)
+{
+    if (cachedata == NULL)
+        return;
 
-tcpr_dir_t
-add_cache(tcpr_cache_t ** cachedata, const int send, const tcpr_dir_t interface)
+    safe_free(cachedata->data);
+    safe_free(cachedata);
+}
+
+/**
+ * stores the word add_cache() is filling in the bitmap.  The packets stay
+ * in the word, so a partial one can be stored for write_cache() and then
+ * again once it's full.  data and the stream buffer are a whole number of
+ * words, so a word never straddles the end of either.
+ */
+static void
+cache_store_word(tcpr_cache_t *cache)
 {
-    static tcpr_cache_t *lastcache = NULL;
-    u_char *byte = NULL;
-    uint32_t bit;
-    tcpr_dir_t result = TCPR_DIR_ERROR;
+    u_char *dst;
     COUNTER index;
+    size_t size;
+    int i;
 #ifdef DEBUG
     char bitstring[9] = EIGHT_ZEROS;
 #endif
 
-    assert(cachedata);
-
-    /* first run?  malloc our first entry, set bit count to 0 */
-    if (*cachedata == NULL) {
-        *cachedata = new_cache();
-        lastcache = *cachedata;
-    }
-    else {
-        /* check to see if this is the last bit in this struct */
-        if ((lastcache->packets + 1) > (CACHEDATASIZE * CACHE_PACKETS_PER_BYTE)) {
-            /*
-             * if so, we have to malloc a new one and set bit to 0
-             */
-            dbg(1, "Adding to cachedata linked list");
-            lastcache->next = new_cache();
-            lastcache = lastcache->next;
-        }
+    if (cache->word_cnt == 0)
+        return;
+
+    index = (cache->packets - cache->word_cnt) / (COUNTER)CACHE_PACKETS_PER_BYTE -
+            cache->written;
+    if (index >= cache->size && cache->fd >= 0) {
+        /* streaming: every byte buffered is complete */
+        cache_write(cache->fd, cache->data, cache->size, "cache data");
+        cache->written += cache->size;
+        index -= cache->size;
+    } else if (index >= cache->size) {
+        size = cache->size ? cache->size * 2 : CACHEDATASIZE;
+        dbgx(1, "Growing cachedata to %zu bytes", size);
+        cache->data = (char *)safe_realloc(cache->data, size);
+        cache->size = size;
     }
 
-    /* always increment our bit count */
-    lastcache->packets++;
-    dbgx(1, "Cache array packet %d", lastcache->packets);
+    /* the first packet is in the low bits of the first byte */
+    dst = (u_char *)&cache->data[index];
+    for (i = 0; i < (int)sizeof(cache->word); i++)
+        dst[i] = (u_char)(cache->word >> (i * 8));
 
-    /* send packet ? */
-    if (send == SEND) {
-        index = (lastcache->packets - 1) / (COUNTER)CACHE_PACKETS_PER_BYTE;
-        bit = (((lastcache->packets - 1) % (COUNTER)CACHE_PACKETS_PER_BYTE) * 
-               (COUNTER)CACHE_BITS_PER_PACKET) + 1;
-        dbgx(3, "Bit: %d", bit);
-
-        byte = (u_char *) & lastcache->data[index];
-        *byte += (u_char) (1 << bit);
+#ifdef DEBUG
+    dbgx(3, "Stored cache word at byte " COUNTER_SPEC ", first byte: %c%c%c%c%c%c%c%c",
+        index, BIT_STR(byte2bits(dst[0], bitstring)));
+#endif
+}
 
-        dbgx(2, "set send bit: byte " COUNTER_SPEC " = 0x%x", index, *byte);
+/**
+ * adds the cache data for a packet to the given cachedata
+ *
+ * The 2 bits of each packet go into a 64 bit word and only whole words
+ * are stored, so the bitmap is written once per CACHE_PACKETS_PER_WORD
+ * packets rather than read, changed and written for each one.  All the
+ * state is in cachedata, so each thread can build its own.
+ */
+tcpr_dir_t
+add_cache(tcpr_cache_t ** cachedata, const int send, const tcpr_dir_t interface)
+{
+    tcpr_cache_t *cache;
+    tcpr_dir_t result;
+    u_int64_t bits;
 
-        /* if true, set low order bit. else, do squat */
-        if (interface == TCPR_DIR_C2S) {
-            *byte += (u_char)(1 << (bit - 1));
+    assert(cachedata);
 
-            dbgx(2, "set interface bit: byte " COUNTER_SPEC " = 0x%x", index, *byte);
-            result = TCPR_DIR_C2S;
-        }
-        else {
-            dbgx(2, "don't set interface bit: byte " COUNTER_SPEC " = 0x%x", index, *byte);
-            result = TCPR_DIR_S2C;
-        }
+    /* first run?  malloc our first entry, set bit count to 0 */
+    if (*cachedata == NULL)
+        *cachedata = new_cache();
+    cache = *cachedata;
 
-#ifdef DEBUG
-        /* 
-         * only build the byte string when not in debug mode since
-         * the calculation is a bit expensive
-         */
-        dbgx(3, "Current cache byte: %c%c%c%c%c%c%c%c",
-            BIT_STR(byte2bits(*byte, bitstring)));
-#endif
-    }
-    else {
-        dbg(1, "not setting send bit");
+    /* high bit is send, low bit is the primary interface */
+    if (send != SEND) {
         result = TCPR_DIR_NOSEND;
+        bits = 0;
+    } else if (interface == TCPR_DIR_C2S) {
+        result = TCPR_DIR_C2S;
+        bits = 3;
+    } else {
+        result = TCPR_DIR_S2C;
+        bits = 2;
+    }
+
+    cache->word |= bits << (cache->word_cnt * CACHE_BITS_PER_PACKET);
+    cache->packets++;
+    dbgx(2, "Cache array packet " COUNTER_SPEC ": %d", cache->packets, result);
+
+    if (++cache->word_cnt == CACHE_PACKETS_PER_WORD) {
+        cache_store_word(cache);
+        cache->word = 0;
+        cache->word_cnt = 0;
     }
 
     return result;
@@ -319,7 +561,8 @@ add_cache(tcpr_cache_t ** cachedata, const int send, const tcpr_dir_t interface)
 
 
 /**
- * returns the action for a given packet based on the CACHE
+ * returns the action for a given packet based on the CACHE.  Both file
+ * versions store the same bitmap, so this is just bit arithmetic.
  */
 tcpr_dir_t
 check_cache(char *cachedata, COUNTER packetid)
@@ -356,3 +599,64 @@ check_cache(char *cachedata, COUNTER packetid)
 
     return TCPR_DIR_ERROR;
 }
+
+/* direction of a packet by its two cache bits: send << 1 | primary */
+static const u_int8_t cache_bits_dir[4] = {
+    TCPR_DIR_NOSEND, TCPR_DIR_NOSEND, TCPR_DIR_S2C, TCPR_DIR_C2S
+};
+
+/**
+ * Decodes the actions of up to cnt (at most CACHE_DIR_BATCH) packets
+ * starting with packetid into dirs, one tcpr_dir_t per byte.  num_packets
+ * is the size of the cache.  Returns how many packets were decoded, which
+ * is less than cnt at the end of the cache.
+ *
+ * When packetid - 1 is a multiple of 32, each 32 packets come out of a
+ * single 64 bit word of the cache.
+ */
+int
+check_cache_batch(const char *cachedata, COUNTER num_packets, COUNTER packetid,
+        int cnt, u_int8_t *dirs)
+{
+    const u_char *bytes = (const u_char *)cachedata;
+    COUNTER first;
+    u_int64_t word;
+    int i, j, done = 0;
+
+    assert(cachedata);
+    assert(dirs);
+
+    if (packetid == 0)
+        err(-1, "packetid must be > 0");
+
+    if (packetid > num_packets)
+        return 0;
+
+    if (cnt > CACHE_DIR_BATCH)
+        cnt = CACHE_DIR_BATCH;
+    if ((COUNTER)cnt > num_packets - packetid + 1)
+        cnt = (int)(num_packets - packetid + 1);
+
+    first = packetid - 1;
+    if (first % 32 == 0) {
+        bytes += first / CACHE_PACKETS_PER_BYTE;
+        for (; done + 32 <= cnt; done += 32, bytes += 8) {
+            /* byte by byte so the layout doesn't depend on our byte order */
+            word = 0;
+            for (j = 7; j >= 0; j--)
+                word = word << 8 | bytes[j];
+
+            for (i = 0; i < 32; i++, word >>= CACHE_BITS_PER_PACKET)
+                dirs[done + i] = cache_bits_dir[word & 0x3];
+        }
+    }
+
+    /* unaligned starts and whatever is left of the batch */
+    for (; done < cnt; done++) {
+        first = packetid - 1 + done;
+        dirs[done] = cache_bits_dir[(((const u_char *)cachedata)[first / CACHE_PACKETS_PER_BYTE] >> 
+                ((first % CACHE_PACKETS_PER_BYTE) * CACHE_BITS_PER_PACKET)) & 0x3];
+    }
+
+    return cnt;
+}
@@ -22,10 +22,15 @@
 #define __CACHE_H__
 
 #define CACHEMAGIC "tcpprep"
-#define CACHEVERSION "04"
-#define CACHEDATASIZE 255
+#define CACHEVERSION "04"         /* version written by default */
+#define CACHEVERSION5 "05"
+#define CACHE_DATA_ALIGN 4096       /* version 5 packet data alignment */
+#define CACHEDATASIZE 4096          /* bytes allocated at a time */
 #define CACHE_PACKETS_PER_BYTE 4    /* number of packets / byte */
 #define CACHE_BITS_PER_PACKET 2     /* number of bits / packet */
+#define CACHE_PACKETS_PER_WORD 32   /* packets add_cache() gathers before storing */
+#define CACHE_DIR_BATCH 64          /* most packets check_cache_batch() decodes */
+#define CACHE_STREAM_SIZE (1024 * 1024) /* bytes of bitmap buffered by open_cache() */
 
 #define SEND 1
 #define DONT_SEND 0
@@ -36,12 +41,19 @@
  * 02 - 2 bits of data/packet (drop/send & primary or secondary nic)
  * 03 - Write integers in network-byte order
  * 04 - Increase num_packets from 32 to 64 bit integer
+ * 05 - Index after the header, packet data starts on a CACHE_DATA_ALIGN
+ *      boundary so it can be mapped directly
  */
 
 struct tcpr_cache_s {
-    char data[CACHEDATASIZE];
-    unsigned int packets;       /* number of packets tracked in data */
-    struct tcpr_cache_s *next;
+    char *data;                 /* one flat bitmap of every packet, or the unwritten part */
+    size_t size;                /* bytes allocated for data */
+    COUNTER packets;            /* number of packets tracked */
+    int fd;                     /* open_cache() file data streams to, -1 for none */
+    COUNTER written;            /* bytes of bitmap already in fd */
+    int version;                /* of the header already in fd */
+    u_int64_t word;             /* the last word_cnt packets, not yet in data */
+    int word_cnt;
 };
 typedef struct tcpr_cache_s tcpr_cache_t;
 
@@ -72,6 +84,17 @@ struct tcpr_cache_file_hdr_s {
 
 typedef struct tcpr_cache_file_hdr_s tcpr_cache_file_hdr_t;
 
+/*
+ * Version 5 follows the header with this index, then the comment, then
+ * zeros up to data_offset
+ */
+struct tcpr_cache_file_idx_s {
+    u_int64_t data_offset;      /* start of the packet data, CACHE_DATA_ALIGN aligned */
+    u_int64_t data_len;         /* bytes of packet data */
+} __attribute__((__packed__));
+
+typedef struct tcpr_cache_file_idx_s tcpr_cache_file_idx_t;
+
 enum tcpr_dir_e {
     TCPR_DIR_ERROR  = -1,
     TCPR_DIR_NOSEND = 0,
@@ -81,10 +104,14 @@ enum tcpr_dir_e {
 typedef enum tcpr_dir_e tcpr_dir_t;
 
 
-COUNTER write_cache(tcpr_cache_t *, const int, COUNTER, char *);
+tcpr_cache_t *open_cache(const int, char *, int);
+COUNTER write_cache(tcpr_cache_t *, const int, COUNTER, char *, int);
 tcpr_dir_t add_cache(tcpr_cache_t **, const int, const tcpr_dir_t);
+void free_cache(tcpr_cache_t *);
 COUNTER read_cache(char **, const char *, char **);
+void close_cache(char *, COUNTER);
 tcpr_dir_t check_cache(char *, COUNTER);
+int check_cache_batch(const char *, COUNTER, COUNTER, int, u_int8_t *);
 
 /* return values for check_cache 
 #define CACHE_ERROR -1
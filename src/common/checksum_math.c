@@ -0,0 +1,289 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ones-complement sums shared by tcpedit's checksums and tcpliveplay:
+ * SSE2, AVX2 or NEON kernels for whole packets and the RFC 1624
+ * incremental update for a few rewritten fields.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "checksum_math.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CHECKSUM_HAVE_AVX2
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* the vector kernels work on 32 byte blocks */
+#define CHECKSUM_BLOCK      32
+
+/* blocks summed before the 32 bit vector lanes could overflow */
+#define CHECKSUM_BATCH      8192
+
+/**
+ * Portable kernel: adds 32 bit words into 64 bit accumulators, which can't
+ * overflow for any packet size.  65536 is 1 in ones-complement arithmetic,
+ * so the result folds down to the same sum as adding 16 bit words.
+ */
+static uint64_t
+checksum_words(const uint8_t *p, size_t len)
+{
+    uint64_t s0 = 0, s1 = 0;
+    uint32_t a, b;
+
+    while (len >= 8) {
+        memcpy(&a, p, sizeof(a));
+        memcpy(&b, p + 4, sizeof(b));
+        s0 += a;
+        s1 += b;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len >= 4) {
+        memcpy(&a, p, sizeof(a));
+        s0 += a;
+    }
+
+    return s0 + s1;
+}
+
+#if !defined __SSE2__ && !defined __ARM_NEON
+static uint64_t
+checksum_blocks_portable(const uint8_t *p, size_t blocks)
+{
+    return checksum_words(p, blocks * CHECKSUM_BLOCK);
+}
+#endif
+
+#ifdef __SSE2__
+/**
+ * SSE2 kernel: zero extends 16 bit words into 32 bit lanes
+ */
+static uint64_t
+checksum_blocks_sse2(const uint8_t *p, size_t blocks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t lanes[4];
+    uint64_t sum = 0;
+
+    while (blocks) {
+        size_t n = blocks < CHECKSUM_BATCH ? blocks : CHECKSUM_BATCH;
+        __m128i acc = zero;
+
+        blocks -= n;
+        while (n--) {
+            __m128i a = _mm_loadu_si128((const __m128i *)p);
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(a, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(a, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(b, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(b, zero));
+            p += CHECKSUM_BLOCK;
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return sum;
+}
+#endif
+
+#ifdef CHECKSUM_HAVE_AVX2
+/**
+ * AVX2 kernel, only called once the CPU is known to support it
+ */
+__attribute__((target("avx2")))
+static uint64_t
+checksum_blocks_avx2(const uint8_t *p, size_t blocks)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t lanes[8];
+    uint64_t sum = 0;
+    int i;
+
+    while (blocks) {
+        size_t n = blocks < CHECKSUM_BATCH ? blocks : CHECKSUM_BATCH;
+        __m256i acc = zero;
+
+        blocks -= n;
+        while (n--) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)p);
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(a, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(a, zero));
+            p += CHECKSUM_BLOCK;
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+
+    return sum;
+}
+#endif
+
+#ifdef __ARM_NEON
+/**
+ * NEON kernel: pairwise adds 16 bit words into 32 bit lanes
+ */
+static uint64_t
+checksum_blocks_neon(const uint8_t *p, size_t blocks)
+{
+    uint64_t sum = 0;
+
+    while (blocks) {
+        size_t n = blocks < CHECKSUM_BATCH ? blocks : CHECKSUM_BATCH;
+        uint32x4_t acc = vdupq_n_u32(0);
+
+        blocks -= n;
+        while (n--) {
+            acc = vpadalq_u16(acc, vld1q_u16((const uint16_t *)p));
+            acc = vpadalq_u16(acc, vld1q_u16((const uint16_t *)(p + 16)));
+            p += CHECKSUM_BLOCK;
+        }
+
+        sum += vgetq_lane_u32(acc, 0) + (uint64_t)vgetq_lane_u32(acc, 1) +
+                vgetq_lane_u32(acc, 2) + (uint64_t)vgetq_lane_u32(acc, 3);
+    }
+
+    return sum;
+}
+#endif
+
+static uint64_t (*checksum_blocks)(const uint8_t *, size_t) = NULL;
+
+/**
+ * Picks the fastest kernel this build and CPU support
+ */
+static void
+checksum_select(void)
+{
+#ifdef CHECKSUM_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        checksum_blocks = checksum_blocks_avx2;
+        return;
+    }
+#endif
+
+#if defined __SSE2__
+    checksum_blocks = checksum_blocks_sse2;
+#elif defined __ARM_NEON
+    checksum_blocks = checksum_blocks_neon;
+#else
+    checksum_blocks = checksum_blocks_portable;
+#endif
+}
+
+/**
+ * code to do a ones-compliment checksum
+ *
+ * Returns the sum folded to 16 bits, so callers can add a few of these
+ * and the pseudo header before CHECKSUM_CARRY()
+ */
+int
+do_checksum_math(uint16_t *data, int len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t blocks;
+    uint64_t sum;
+    union {
+        uint16_t s;
+        uint8_t b[2];
+    } pad;
+
+    if (len <= 0)
+        return 0;
+
+    if (checksum_blocks == NULL)
+        checksum_select();
+
+    blocks = (size_t)len / CHECKSUM_BLOCK;
+    sum = blocks ? checksum_blocks(p, blocks) : 0;
+    p += blocks * CHECKSUM_BLOCK;
+    len -= blocks * CHECKSUM_BLOCK;
+
+    sum += checksum_words(p, len);
+    p += len & ~3;
+    len &= 3;
+
+    if (len > 1) {
+        memcpy(&pad.s, p, sizeof(pad.s));
+        sum += pad.s;
+        p += 2;
+        len -= 2;
+    }
+
+    if (len == 1) {
+        pad.b[0] = *p;
+        pad.b[1] = 0;
+        sum += pad.s;
+    }
+
+    /* fold the 64 bit sum down to 16 bits */
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+
+    return (int)sum;
+}
+
+/**
+ * Incrementally update a checksum for len bytes (an even number) which
+ * changed from old to new, see RFC 1624 eqn. 3:  HC' = ~(~HC + ~m + m')
+ *
+ * Like do_checksum_math(), everything stays in host byte order.
+ */
+uint16_t
+do_checksum_adjust(uint16_t csum, const uint8_t *old, const uint8_t *new, int len)
+{
+    uint32_t sum = (uint16_t)~csum;
+    uint16_t m, m1;
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        memcpy(&m, old + i, sizeof(m));
+        memcpy(&m1, new + i, sizeof(m1));
+        sum += (uint16_t)~m + m1;
+    }
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+
+    return (uint16_t)~sum;
+}
@@ -40,6 +40,171 @@ extern int debug;
 
 static tcpr_cidr_t *cidr2cidr(char *);
 
+/*
+ * Lookup trie for long CIDR lists.  Each level consumes CIDR_TRIE_STRIDE
+ * bits of the address; a prefix that ends part way through a level is
+ * expanded into every slot it covers.  Slots hold the list position + 1
+ * of the first entry covering them (0 == none), and a lookup keeps the
+ * lowest position seen on the way down, so the answer is always the
+ * first match in list order -- exactly what walking the list returns.
+ */
+#define CIDR_TRIE_STRIDE 4
+#define CIDR_TRIE_FANOUT (1 << CIDR_TRIE_STRIDE)
+
+typedef struct cidr_trie_node_s {
+    u_int32_t slot[CIDR_TRIE_FANOUT];
+    struct cidr_trie_node_s *child[CIDR_TRIE_FANOUT];
+} cidr_trie_node_t;
+
+struct tcpr_cidr_index_s {
+    u_int32_t dflt4;            /* first 0.0.0.0/0 */
+    u_int32_t dflt6;            /* first ::/0 */
+    cidr_trie_node_t *root4;
+    cidr_trie_node_t *root6;
+    void **entry;               /* list element at each position */
+    u_int32_t count;
+    u_int32_t len;
+};
+typedef struct tcpr_cidr_index_s tcpr_cidr_index_t;
+
+static inline int
+cidr_nibble(const u_char *addr, int level)
+{
+    return (level & 1) ? addr[level >> 1] & 0x0f : addr[level >> 1] >> 4;
+}
+
+static inline void
+cidr_slot_set(u_int32_t *slot, u_int32_t pos)
+{
+    if (*slot == 0 || *slot > pos)
+        *slot = pos;
+}
+
+/**
+ * adds a cidr to the index, remembering entry as the list element to
+ * return when a lookup lands on it
+ */
+static void
+cidr_index_insert(tcpr_cidr_index_t *index, const tcpr_cidr_t *cidr, void *entry)
+{
+    cidr_trie_node_t **node;
+    const u_char *addr;
+    u_int32_t pos;
+    int level, last, bits, v, s;
+
+    if (index->count == index->len) {
+        index->len = index->len ? index->len * 2 : CIDR_INDEX_MIN * 2;
+        index->entry = safe_realloc(index->entry, index->len * sizeof(void *));
+    }
+    index->entry[index->count++] = entry;
+    pos = index->count;
+
+    if (cidr->family == AF_INET) {
+        if (cidr->masklen == 0) {
+            cidr_slot_set(&index->dflt4, pos);
+            return;
+        }
+        addr = (const u_char *)&cidr->u.network;
+        node = &index->root4;
+    } else if (cidr->family == AF_INET6) {
+        if (cidr->masklen == 0) {
+            cidr_slot_set(&index->dflt6, pos);
+            return;
+        }
+        addr = cidr->u.network6.tcpr_s6_addr;
+        node = &index->root6;
+    } else {
+        /* never matches an address, same as ip_in_cidr() */
+        return;
+    }
+
+    last = (cidr->masklen - 1) / CIDR_TRIE_STRIDE;
+    for (level = 0; ; level++) {
+        if (*node == NULL)
+            *node = (cidr_trie_node_t *)safe_malloc(sizeof(cidr_trie_node_t));
+
+        v = cidr_nibble(addr, level);
+        if (level == last)
+            break;
+
+        node = &(*node)->child[v];
+    }
+
+    bits = CIDR_TRIE_STRIDE - (cidr->masklen - last * CIDR_TRIE_STRIDE);
+    v &= ~((1 << bits) - 1);
+    for (s = v; s < v + (1 << bits); s++)
+        cidr_slot_set(&(*node)->slot[s], pos);
+}
+
+/**
+ * returns the list position + 1 of the first entry containing addr
+ * (network byte order, 4 or 16 bytes), or 0 if there is none
+ */
+static u_int32_t
+cidr_index_lookup(const tcpr_cidr_index_t *index, int family, const u_char *addr)
+{
+    const cidr_trie_node_t *node;
+    u_int32_t best, pos;
+    int level, levels, v;
+
+    if (family == AF_INET) {
+        best = index->dflt4;
+        node = index->root4;
+        levels = 32 / CIDR_TRIE_STRIDE;
+    } else {
+        best = index->dflt6;
+        node = index->root6;
+        levels = 128 / CIDR_TRIE_STRIDE;
+    }
+
+    for (level = 0; node != NULL && level < levels; level++) {
+        v = cidr_nibble(addr, level);
+        pos = node->slot[v];
+        if (pos != 0 && (best == 0 || pos < best))
+            best = pos;
+
+        node = node->child[v];
+    }
+
+    return best;
+}
+
+static void
+cidr_trie_free(cidr_trie_node_t *node)
+{
+    int i;
+
+    if (node == NULL)
+        return;
+
+    for (i = 0; i < CIDR_TRIE_FANOUT; i++)
+        cidr_trie_free(node->child[i]);
+
+    safe_free(node);
+}
+
+static void
+cidr_index_destroy(tcpr_cidr_index_t *index)
+{
+    cidr_trie_free(index->root4);
+    cidr_trie_free(index->root6);
+    safe_free(index->entry);
+    safe_free(index);
+}
+
+/**
+ * builds the index for a list of cidrs, hanging it off the list head
+ */
+static void
+cidr_index_list(tcpr_cidr_t *cidrdata)
+{
+    tcpr_cidr_t *cidr_ptr;
+
+    cidrdata->index = (tcpr_cidr_index_t *)safe_malloc(sizeof(tcpr_cidr_index_t));
+    for (cidr_ptr = cidrdata; cidr_ptr != NULL; cidr_ptr = cidr_ptr->next)
+        cidr_index_insert(cidrdata->index, cidr_ptr, cidr_ptr);
+}
+
 /**
  * prints to the given fd all the entries in mycidr
  */
@@ -78,6 +243,9 @@ destroy_cidr(tcpr_cidr_t * cidr)
         if (cidr->next != NULL)
             destroy_cidr(cidr->next);
 
+        if (cidr->index != NULL)
+            cidr_index_destroy(cidr->index);
+
         safe_free(cidr);
     }
     return;
@@ -91,6 +259,7 @@ void
 add_cidr(tcpr_cidr_t ** cidrdata, tcpr_cidr_t ** newcidr)
 {
     tcpr_cidr_t *cidr_ptr;
+    int count = 1;
     dbg(1, "Running new_cidr()");
 
     if (*cidrdata == NULL) {
@@ -98,10 +267,20 @@ add_cidr(tcpr_cidr_t ** cidrdata, tcpr_cidr_t ** newcidr)
     } else {
         cidr_ptr = *cidrdata;
 
-        while (cidr_ptr->next != NULL)
+        while (cidr_ptr->next != NULL) {
             cidr_ptr = cidr_ptr->next;
+            count++;
+        }
 
         cidr_ptr->next = *newcidr;
+
+        /* keep the index in step, or build it once the list gets long */
+        if ((*cidrdata)->index != NULL) {
+            for (cidr_ptr = *newcidr; cidr_ptr != NULL; cidr_ptr = cidr_ptr->next)
+                cidr_index_insert((*cidrdata)->index, cidr_ptr, cidr_ptr);
+        } else if (count + 1 >= CIDR_INDEX_MIN) {
+            cidr_index_list(*cidrdata);
+        }
     }
 }
 
@@ -301,6 +480,7 @@ parse_cidr(tcpr_cidr_t ** cidrdata, char *cidrin, char *delim)
     tcpr_cidr_t *cidr_ptr;             /* ptr to current cidr record */
     char *network = NULL;
     char *token = NULL;
+    int count = 1;
 
     mask_cidr6(&cidrin, delim);
 
@@ -323,7 +503,12 @@ parse_cidr(tcpr_cidr_t ** cidrdata, char *cidrin, char *delim)
         /* next record */
         cidr_ptr->next = cidr2cidr(network);
         cidr_ptr = cidr_ptr->next;
+        count++;
     }
+
+    if (count >= CIDR_INDEX_MIN)
+        cidr_index_list(*cidrdata);
+
     return 1;
 
 }
@@ -407,6 +592,7 @@ parse_cidr_map(tcpr_cidrmap_t **cidrmap, const char *optarg)
     char *map = NULL;
     char *token = NULL, *string = NULL;
     tcpr_cidrmap_t *ptr;
+    int count = 1;
     
     string = safe_strdup(optarg);
 
@@ -446,6 +632,14 @@ parse_cidr_map(tcpr_cidrmap_t **cidrmap, const char *optarg)
         ptr->from = cidr;
         ptr->to = cidr->next;
         ptr->from->next = NULL;
+        count++;
+    }
+
+    /* index on the 'from' side, which is what rewriting looks up */
+    if (count >= CIDR_INDEX_MIN) {
+        (*cidrmap)->index = (tcpr_cidr_index_t *)safe_malloc(sizeof(tcpr_cidr_index_t));
+        for (ptr = *cidrmap; ptr != NULL; ptr = ptr->next)
+            cidr_index_insert((*cidrmap)->index, ptr->from, ptr);
     }
     
     safe_free(string);
@@ -586,6 +780,18 @@ check_ip_cidr(tcpr_cidr_t * cidrdata, const unsigned long ip)
      */
     if (cidrdata == NULL)
         return 1;
+
+    if (cidrdata->index != NULL) {
+        u_int32_t addr = ip;
+
+        if (cidr_index_lookup(cidrdata->index, AF_INET, (u_char *)&addr)) {
+            dbgx(3, "Found %s in cidr", get_addr2name4(ip, RESOLVE));
+            return 1;
+        }
+
+        dbgx(3, "Didn't find %s in cidr", get_addr2name4(ip, RESOLVE));
+        return 0;
+    }
         
     mycidr = cidrdata;
 
@@ -623,6 +829,16 @@ check_ip6_cidr(tcpr_cidr_t * cidrdata, const struct tcpr_in6_addr *addr)
         return 1;
     }
 
+    if (cidrdata->index != NULL) {
+        if (cidr_index_lookup(cidrdata->index, AF_INET6, addr->tcpr_s6_addr)) {
+            dbgx(3, "Found %s in cidr", get_addr2name6(addr, RESOLVE));
+            return 1;
+        }
+
+        dbgx(3, "Didn't find %s in cidr", get_addr2name6(addr, RESOLVE));
+        return 0;
+    }
+
     mycidr = cidrdata;
 
     /* loop through cidr */
@@ -647,6 +863,56 @@ check_ip6_cidr(tcpr_cidr_t * cidrdata, const struct tcpr_in6_addr *addr)
     return 0;
 }
 
+/**
+ * returns the first map whose 'from' cidr contains the ip, or NULL
+ */
+tcpr_cidrmap_t *
+cidrmap_find_ip(tcpr_cidrmap_t *cidrmap, const unsigned long ip)
+{
+    tcpr_cidrmap_t *ptr;
+    u_int32_t addr = ip, pos;
+
+    if (cidrmap == NULL)
+        return NULL;
+
+    if (cidrmap->index != NULL) {
+        pos = cidr_index_lookup(cidrmap->index, AF_INET, (u_char *)&addr);
+        return pos ? (tcpr_cidrmap_t *)cidrmap->index->entry[pos - 1] : NULL;
+    }
+
+    for (ptr = cidrmap; ptr != NULL; ptr = ptr->next) {
+        if (ip_in_cidr(ptr->from, ip))
+            return ptr;
+    }
+
+    return NULL;
+}
+
+/**
+ * IPv6 version of cidrmap_find_ip()
+ */
+tcpr_cidrmap_t *
+cidrmap_find_ip6(tcpr_cidrmap_t *cidrmap, const struct tcpr_in6_addr *addr)
+{
+    tcpr_cidrmap_t *ptr;
+    u_int32_t pos;
+
+    if (cidrmap == NULL)
+        return NULL;
+
+    if (cidrmap->index != NULL) {
+        pos = cidr_index_lookup(cidrmap->index, AF_INET6, addr->tcpr_s6_addr);
+        return pos ? (tcpr_cidrmap_t *)cidrmap->index->entry[pos - 1] : NULL;
+    }
+
+    for (ptr = cidrmap; ptr != NULL; ptr = ptr->next) {
+        if (ip6_in_cidr(ptr->from, addr))
+            return ptr;
+    }
+
+    return NULL;
+}
+
 
 /**
  * cidr2ip takes a tcpr_cidr_t and a delimiter
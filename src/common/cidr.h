@@ -23,6 +23,11 @@
 #ifndef __CIDR_H__
 #define __CIDR_H__
 
+/* lists at least this long get a lookup trie in addition to the list */
+#define CIDR_INDEX_MIN 8
+
+struct tcpr_cidr_index_s;
+
 struct tcpr_cidr_s {
     int family;                 /* AF_INET or AF_INET6 */
     union {
@@ -31,6 +36,7 @@ struct tcpr_cidr_s {
     } u;
     int masklen;
     struct tcpr_cidr_s *next;
+    struct tcpr_cidr_index_s *index;    /* list head only, may be NULL */
 };
 
 typedef struct tcpr_cidr_s tcpr_cidr_t;
@@ -39,12 +45,15 @@ struct tcpr_cidrmap_s {
     tcpr_cidr_t *from;
     tcpr_cidr_t *to;
     struct tcpr_cidrmap_s *next;
+    struct tcpr_cidr_index_s *index;    /* list head only, may be NULL */
 };
 typedef struct tcpr_cidrmap_s tcpr_cidrmap_t;
 
 int ip_in_cidr(const tcpr_cidr_t *, const unsigned long);
 int check_ip_cidr(tcpr_cidr_t *, const unsigned long);
 int check_ip6_cidr(tcpr_cidr_t *, const struct tcpr_in6_addr *addr);
+tcpr_cidrmap_t *cidrmap_find_ip(tcpr_cidrmap_t *, const unsigned long);
+tcpr_cidrmap_t *cidrmap_find_ip6(tcpr_cidrmap_t *, const struct tcpr_in6_addr *);
 int parse_cidr(tcpr_cidr_t **, char *, char *delim);
 int parse_cidr_map(tcpr_cidrmap_t **, const char *);
 int parse_endpoints(tcpr_cidrmap_t **, tcpr_cidrmap_t **, const char *);
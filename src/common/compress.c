@@ -0,0 +1,788 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streaming zstd and lz4 support for capture files.
+ *
+ * Compressed input is decoded on its own thread and fed to the reader
+ * through a socket pair, so anything that reads a file descriptor or a
+ * FILE * -- libpcap included -- can read it as if it were the plain
+ * file, while decompression runs alongside reading, editing and sending.
+ * Compressed output is a stream that encodes buffers and writes them to
+ * a file descriptor; pcap_writer uses it from its flusher thread.
+ */
+
+#define _GNU_SOURCE     /* F_SETPIPE_SZ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#define ZSTD_MAGIC              0xfd2fb528
+#define ZSTD_SKIPPABLE_MAGIC    0x184d2a50  /* low 4 bits are free */
+#define LZ4_MAGIC               0x184d2204
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct compress_stream_s {
+    tcpr_compress_t type;
+    u_char *buf;
+    size_t buf_size;
+    bool started;
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx *zcctx;
+#endif
+#ifdef HAVE_LIBLZ4
+    LZ4F_cctx *lcctx;
+    LZ4F_preferences_t prefs;
+#endif
+    char errbuf[PCAP_ERRBUF_SIZE];
+};
+
+/**
+ * Identifies a compressed stream by its first four bytes
+ */
+tcpr_compress_t
+compress_detect(const u_char *buf, size_t len)
+{
+    uint32_t magic;
+
+    if (len < 4)
+        return TCPR_COMPRESS_NONE;
+
+    /* both formats are little endian */
+    magic = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+
+    if (magic == ZSTD_MAGIC || (magic & ~0xfU) == ZSTD_SKIPPABLE_MAGIC)
+        return TCPR_COMPRESS_ZSTD;
+
+    if (magic == LZ4_MAGIC)
+        return TCPR_COMPRESS_LZ4;
+
+    return TCPR_COMPRESS_NONE;
+}
+
+/**
+ * Picks the compression for an output file from its name
+ */
+tcpr_compress_t
+compress_from_path(const char *path)
+{
+    const char *ext;
+
+    assert(path);
+
+    if ((ext = strrchr(path, '.')) == NULL)
+        return TCPR_COMPRESS_NONE;
+
+    if (strcmp(ext, ".zst") == 0 || strcmp(ext, ".zstd") == 0)
+        return TCPR_COMPRESS_ZSTD;
+
+    if (strcmp(ext, ".lz4") == 0)
+        return TCPR_COMPRESS_LZ4;
+
+    return TCPR_COMPRESS_NONE;
+}
+
+/**
+ * Looks up a compression by the name compress_name() gives it.  Returns 0,
+ * or -1 if there is no such compression.
+ */
+int
+compress_from_name(const char *name, tcpr_compress_t *type)
+{
+    assert(name);
+    assert(type);
+
+    if (strcmp(name, "zstd") == 0)
+        *type = TCPR_COMPRESS_ZSTD;
+    else if (strcmp(name, "lz4") == 0)
+        *type = TCPR_COMPRESS_LZ4;
+    else if (strcmp(name, "none") == 0)
+        *type = TCPR_COMPRESS_NONE;
+    else
+        return -1;
+
+    return 0;
+}
+
+const char *
+compress_name(tcpr_compress_t type)
+{
+    switch (type) {
+    case TCPR_COMPRESS_ZSTD:
+        return "zstd";
+    case TCPR_COMPRESS_LZ4:
+        return "lz4";
+    default:
+        return "none";
+    }
+}
+
+/**
+ * returns true if this build can handle type
+ */
+static bool
+compress_supported(tcpr_compress_t type)
+{
+    switch (type) {
+    case TCPR_COMPRESS_NONE:
+        return true;
+#ifdef HAVE_LIBZSTD
+    case TCPR_COMPRESS_ZSTD:
+        return true;
+#endif
+#ifdef HAVE_LIBLZ4
+    case TCPR_COMPRESS_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * write() all of len, returns 0 or an errno
+ */
+static int
+compress_write_all(int fd, const u_char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_LIBPTHREAD
+typedef struct compress_reader_s {
+    tcpr_compress_t type;
+    int in_fd;                  /* the compressed file */
+    int out_fd;                 /* our end of the socket pair */
+    char *path;
+} compress_reader_t;
+
+/**
+ * hands decoded bytes to the reader.  Returns -1 once the reader has
+ * gone away, which isn't an error: it just stopped reading early.
+ */
+static int
+compress_reader_send(compress_reader_t *cr, const u_char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(cr->out_fd, data, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE && errno != ECONNRESET)
+                warnx("Unable to pass on decompressed %s: %s", cr->path, strerror(errno));
+            return -1;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Main loop of a decompression thread
+ *
+ * Reads the compressed file COMPRESS_BUFSIZE at a time and sends what
+ * it decodes to the reader.  Closing our end of the socket pair is the
+ * reader's EOF, on a decode error the reader sees a truncated file.
+ */
+static void *
+compress_reader(void *arg)
+{
+    compress_reader_t *cr = (compress_reader_t *)arg;
+    u_char *in, *out;
+    ssize_t n;
+    bool full;
+#ifdef HAVE_LIBZSTD
+    ZSTD_DStream *zds = NULL;
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    size_t zret = 0;
+#endif
+#ifdef HAVE_LIBLZ4
+    LZ4F_dctx *ldctx = NULL;
+    size_t lret, in_len, out_len, pos;
+#endif
+
+    in = safe_malloc(COMPRESS_BUFSIZE);
+    out = safe_malloc(COMPRESS_BUFSIZE);
+
+#ifdef HAVE_LIBZSTD
+    if (cr->type == TCPR_COMPRESS_ZSTD) {
+        if ((zds = ZSTD_createDStream()) == NULL) {
+            warnx("Unable to decompress %s: out of memory", cr->path);
+            goto done;
+        }
+        ZSTD_initDStream(zds);
+    }
+#endif
+#ifdef HAVE_LIBLZ4
+    if (cr->type == TCPR_COMPRESS_LZ4 &&
+            LZ4F_isError(LZ4F_createDecompressionContext(&ldctx, LZ4F_VERSION))) {
+        warnx("Unable to decompress %s: out of memory", cr->path);
+        goto done;
+    }
+#endif
+
+    for (;;) {
+        if ((n = read(cr->in_fd, in, COMPRESS_BUFSIZE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            warnx("Unable to read %s: %s", cr->path, strerror(errno));
+            goto done;
+        }
+
+        if (n == 0)
+            break;
+
+#ifdef HAVE_LIBZSTD
+        if (cr->type == TCPR_COMPRESS_ZSTD) {
+            zin.src = in;
+            zin.size = n;
+            zin.pos = 0;
+
+            /* a full output buffer may leave more to flush */
+            do {
+                zout.dst = out;
+                zout.size = COMPRESS_BUFSIZE;
+                zout.pos = 0;
+
+                zret = ZSTD_decompressStream(zds, &zout, &zin);
+                if (ZSTD_isError(zret)) {
+                    warnx("Unable to decompress %s: %s", cr->path, ZSTD_getErrorName(zret));
+                    goto done;
+                }
+
+                if (compress_reader_send(cr, out, zout.pos) < 0)
+                    goto done;
+
+                full = zout.pos == zout.size;
+            } while (zin.pos < zin.size || full);
+        }
+#endif
+#ifdef HAVE_LIBLZ4
+        if (cr->type == TCPR_COMPRESS_LZ4) {
+            pos = 0;
+
+            do {
+                in_len = n - pos;
+                out_len = COMPRESS_BUFSIZE;
+
+                lret = LZ4F_decompress(ldctx, out, &out_len, in + pos, &in_len, NULL);
+                if (LZ4F_isError(lret)) {
+                    warnx("Unable to decompress %s: %s", cr->path, LZ4F_getErrorName(lret));
+                    goto done;
+                }
+                pos += in_len;
+
+                if (compress_reader_send(cr, out, out_len) < 0)
+                    goto done;
+
+                full = out_len == COMPRESS_BUFSIZE;
+            } while (pos < (size_t)n || full);
+        }
+#endif
+    }
+
+#ifdef HAVE_LIBZSTD
+    /* zstd says how far it is from the end of the frame */
+    if (cr->type == TCPR_COMPRESS_ZSTD && zret != 0)
+        warnx("%s: truncated zstd stream", cr->path);
+#endif
+
+done:
+#ifdef HAVE_LIBZSTD
+    if (zds != NULL)
+        ZSTD_freeDStream(zds);
+#endif
+#ifdef HAVE_LIBLZ4
+    if (ldctx != NULL)
+        LZ4F_freeDecompressionContext(ldctx);
+#endif
+    close(cr->out_fd);
+    close(cr->in_fd);
+    safe_free(cr->path);
+    safe_free(cr);
+    safe_free(in);
+    safe_free(out);
+    return NULL;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/**
+ * Opens a capture file for reading, returning a file descriptor.  If the
+ * file is zstd or lz4 compressed, reading the descriptor returns the
+ * decompressed contents.  Returns -1 and fills the PCAP_ERRBUF_SIZE ebuf
+ * on failure.
+ */
+int
+compress_open_read(const char *path, char *ebuf)
+{
+    tcpr_compress_t type;
+    u_char magic[4];
+    ssize_t n;
+    int fd;
+#ifdef HAVE_LIBPTHREAD
+    compress_reader_t *cr;
+    pthread_attr_t attr;
+    int sv[2], bufsize = COMPRESS_BUFSIZE, rcode;
+#endif
+
+    assert(path);
+    assert(ebuf);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if ((n = pread(fd, magic, sizeof(magic), 0)) < 0)
+        n = 0;
+
+    if ((type = compress_detect(magic, n)) == TCPR_COMPRESS_NONE)
+        return fd;
+
+    if (!compress_supported(type)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s is %s compressed, but this build has no %s support",
+                path, compress_name(type), compress_name(type));
+        close(fd);
+        return -1;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create socket pair for %s: %s",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* fewer, larger handoffs between the threads */
+    setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt(sv[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
+    cr = safe_malloc(sizeof(compress_reader_t));
+    cr->type = type;
+    cr->in_fd = fd;
+    cr->out_fd = sv[1];
+    cr->path = safe_strdup(path);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rcode = pthread_create(&(pthread_t){0}, &attr, compress_reader, cr);
+    pthread_attr_destroy(&attr);
+
+    if (rcode != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start decompressing %s: %s",
+                path, strerror(rcode));
+        close(sv[0]);
+        close(sv[1]);
+        close(fd);
+        safe_free(cr->path);
+        safe_free(cr);
+        return -1;
+    }
+
+    return sv[0];
+#else
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Reading compressed %s requires pthread support", path);
+    close(fd);
+    return -1;
+#endif
+}
+
+#ifdef HAVE_PCAP_TSTAMP_PRECISION
+#define pcap_open_offline_prec(path, nsec, ebuf) ((nsec) ? \
+        pcap_open_offline_with_tstamp_precision(path, PCAP_TSTAMP_PRECISION_NANO, ebuf) : \
+        pcap_open_offline(path, ebuf))
+#define pcap_fopen_offline_prec(fp, nsec, ebuf) ((nsec) ? \
+        pcap_fopen_offline_with_tstamp_precision(fp, PCAP_TSTAMP_PRECISION_NANO, ebuf) : \
+        pcap_fopen_offline(fp, ebuf))
+#else
+#define pcap_open_offline_prec(path, nsec, ebuf) pcap_open_offline(path, ebuf)
+#define pcap_fopen_offline_prec(fp, nsec, ebuf) pcap_fopen_offline(fp, ebuf)
+#endif
+
+/**
+ * opens a pcap file, compressed or not, with nanosecond timestamps in
+ * tv_usec if nsec and libpcap supports it
+ */
+static pcap_t *
+pcap_open_offline_compressed(const char *path, bool nsec, char *ebuf)
+{
+    pcap_t *pcap;
+    FILE *fp;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    /* leave STDIN to libpcap */
+    if (strcmp(path, "-") == 0)
+        return pcap_open_offline_prec(path, nsec, ebuf);
+
+    /* a plain file comes back as is, so it is only opened once either way */
+    if ((fd = compress_open_read(path, ebuf)) < 0)
+        return NULL;
+
+    if ((fp = fdopen(fd, "r")) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if ((pcap = pcap_fopen_offline_prec(fp, nsec, ebuf)) == NULL)
+        fclose(fp);
+
+    return pcap;
+}
+
+/**
+ * pcap_open_offline() which also reads zstd and lz4 compressed files
+ */
+pcap_t *
+tcpr_pcap_open_offline(const char *path, char *ebuf)
+{
+    return pcap_open_offline_compressed(path, false, ebuf);
+}
+
+/**
+ * tcpr_pcap_open_offline(), but with libpcaps that can, every packet's
+ * tv_usec holds nanoseconds: check pcap_get_tstamp_precision()
+ */
+pcap_t *
+tcpr_pcap_open_offline_nsec(const char *path, char *ebuf)
+{
+    return pcap_open_offline_compressed(path, true, ebuf);
+}
+
+/**
+ * Opens a pcap stream arriving on fd -- a pipe, a socket or STDIN --
+ * with nanosecond timestamps like tcpr_pcap_open_offline_nsec().  fd is
+ * dup()ed, the caller's stays open.
+ *
+ * libpcap reads through stdio, a few KB at a time by default, so a
+ * pipeline pays a system call and a wakeup of the writer per few
+ * packets.  Here the pipe or socket buffer is grown so the writer can
+ * run ahead and each read() drains up to PCAP_STREAM_BUFSIZE at once.
+ * *buf is that stdio buffer, free it after pcap_close().
+ */
+pcap_t *
+tcpr_pcap_fdopen_offline_nsec(int fd, void **buf, char *ebuf)
+{
+    struct stat st;
+    pcap_t *pcap;
+    FILE *fp;
+    int bufsize = COMPRESS_BUFSIZE;
+
+    assert(buf);
+    assert(ebuf);
+
+    *buf = NULL;
+    if ((fd = dup(fd)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to dup file descriptor: %s", strerror(errno));
+        return NULL;
+    }
+
+    /* best effort: unprivileged pipes can't grow past /proc/sys/fs/pipe-max-size */
+    if (fstat(fd, &st) == 0) {
+#ifdef F_SETPIPE_SZ
+        if (S_ISFIFO(st.st_mode) && fcntl(fd, F_SETPIPE_SZ, bufsize) < 0)
+            dbgx(1, "Unable to grow pipe to %d bytes: %s", bufsize, strerror(errno));
+#endif
+        if (S_ISSOCK(st.st_mode))
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    }
+
+    if ((fp = fdopen(fd, "r")) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to open file descriptor: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    *buf = safe_malloc(PCAP_STREAM_BUFSIZE);
+    setvbuf(fp, *buf, _IOFBF, PCAP_STREAM_BUFSIZE);
+
+    if ((pcap = pcap_fopen_offline_prec(fp, true, ebuf)) == NULL) {
+        fclose(fp);
+        safe_free(*buf);
+        *buf = NULL;
+    }
+
+    return pcap;
+}
+
+/**
+ * Starts a compressed stream.  threads is the number of zstd worker
+ * threads, 0 for one per CPU; lz4 always compresses on the caller's
+ * thread.  Returns NULL and fills the PCAP_ERRBUF_SIZE ebuf on failure.
+ */
+compress_stream_t *
+compress_stream_open(tcpr_compress_t type, int threads, char *ebuf)
+{
+    compress_stream_t *cs;
+
+    assert(ebuf);
+
+    if (type == TCPR_COMPRESS_NONE || !compress_supported(type)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "This build has no %s support", compress_name(type));
+        return NULL;
+    }
+
+    cs = safe_malloc(sizeof(compress_stream_t));
+    cs->type = type;
+
+    if (threads <= 0 && (threads = (int)sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        threads = 1;
+
+#ifdef HAVE_LIBZSTD
+    if (type == TCPR_COMPRESS_ZSTD) {
+        if ((cs->zcctx = ZSTD_createCCtx()) == NULL)
+            goto nomem;
+
+        ZSTD_CCtx_setParameter(cs->zcctx, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+        /* fails harmlessly if libzstd was built without threads */
+        ZSTD_CCtx_setParameter(cs->zcctx, ZSTD_c_nbWorkers, threads);
+
+        cs->buf_size = ZSTD_CStreamOutSize();
+    }
+#endif
+#ifdef HAVE_LIBLZ4
+    if (type == TCPR_COMPRESS_LZ4) {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cs->lcctx, LZ4F_VERSION)))
+            goto nomem;
+
+        cs->buf_size = LZ4F_compressBound(COMPRESS_BUFSIZE, &cs->prefs);
+    }
+#endif
+
+    cs->buf = safe_malloc(cs->buf_size);
+    return cs;
+
+#if defined HAVE_LIBZSTD || defined HAVE_LIBLZ4
+nomem:
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start %s compression: out of memory",
+            compress_name(type));
+    compress_stream_close(cs);
+    return NULL;
+#endif
+}
+
+/**
+ * Compresses len bytes of data and writes the result to fd.  Returns 0,
+ * an errno if writing failed, or -1 if compressing failed: see
+ * compress_stream_geterr()
+ */
+int
+compress_stream_write(compress_stream_t *cs, int fd, const u_char *data, size_t len)
+{
+    int rcode = 0;
+#ifdef HAVE_LIBZSTD
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    size_t zret;
+#endif
+#ifdef HAVE_LIBLZ4
+    size_t lret, chunk;
+#endif
+
+    assert(cs);
+    assert(data);
+
+#ifdef HAVE_LIBZSTD
+    if (cs->type == TCPR_COMPRESS_ZSTD) {
+        zin.src = data;
+        zin.size = len;
+        zin.pos = 0;
+
+        while (zin.pos < zin.size) {
+            zout.dst = cs->buf;
+            zout.size = cs->buf_size;
+            zout.pos = 0;
+
+            zret = ZSTD_compressStream2(cs->zcctx, &zout, &zin, ZSTD_e_continue);
+            if (ZSTD_isError(zret)) {
+                snprintf(cs->errbuf, sizeof(cs->errbuf), "zstd: %s", ZSTD_getErrorName(zret));
+                return -1;
+            }
+
+            if ((rcode = compress_write_all(fd, cs->buf, zout.pos)) != 0)
+                return rcode;
+        }
+    }
+#endif
+#ifdef HAVE_LIBLZ4
+    if (cs->type == TCPR_COMPRESS_LZ4) {
+        if (!cs->started) {
+            lret = LZ4F_compressBegin(cs->lcctx, cs->buf, cs->buf_size, &cs->prefs);
+            if (LZ4F_isError(lret)) {
+                snprintf(cs->errbuf, sizeof(cs->errbuf), "lz4: %s", LZ4F_getErrorName(lret));
+                return -1;
+            }
+
+            if ((rcode = compress_write_all(fd, cs->buf, lret)) != 0)
+                return rcode;
+
+            cs->started = true;
+        }
+
+        /* the output buffer is sized for COMPRESS_BUFSIZE of input */
+        while (len > 0) {
+            chunk = min(len, COMPRESS_BUFSIZE);
+
+            lret = LZ4F_compressUpdate(cs->lcctx, cs->buf, cs->buf_size, data, chunk, NULL);
+            if (LZ4F_isError(lret)) {
+                snprintf(cs->errbuf, sizeof(cs->errbuf), "lz4: %s", LZ4F_getErrorName(lret));
+                return -1;
+            }
+
+            if ((rcode = compress_write_all(fd, cs->buf, lret)) != 0)
+                return rcode;
+
+            data += chunk;
+            len -= chunk;
+        }
+    }
+#endif
+
+    return rcode;
+}
+
+/**
+ * Writes out the end of the stream, same returns as compress_stream_write()
+ */
+int
+compress_stream_finish(compress_stream_t *cs, int fd)
+{
+    int rcode = 0;
+#ifdef HAVE_LIBZSTD
+    ZSTD_inBuffer zin = { NULL, 0, 0 };
+    ZSTD_outBuffer zout;
+    size_t zret;
+#endif
+#ifdef HAVE_LIBLZ4
+    size_t lret;
+#endif
+
+    assert(cs);
+
+#ifdef HAVE_LIBZSTD
+    if (cs->type == TCPR_COMPRESS_ZSTD) {
+        do {
+            zout.dst = cs->buf;
+            zout.size = cs->buf_size;
+            zout.pos = 0;
+
+            zret = ZSTD_compressStream2(cs->zcctx, &zout, &zin, ZSTD_e_end);
+            if (ZSTD_isError(zret)) {
+                snprintf(cs->errbuf, sizeof(cs->errbuf), "zstd: %s", ZSTD_getErrorName(zret));
+                return -1;
+            }
+
+            if ((rcode = compress_write_all(fd, cs->buf, zout.pos)) != 0)
+                return rcode;
+        } while (zret != 0);
+    }
+#endif
+#ifdef HAVE_LIBLZ4
+    if (cs->type == TCPR_COMPRESS_LZ4) {
+        /* an empty stream still needs its frame header */
+        if (!cs->started && (rcode = compress_stream_write(cs, fd, (const u_char *)"", 0)) != 0)
+            return rcode;
+
+        lret = LZ4F_compressEnd(cs->lcctx, cs->buf, cs->buf_size, NULL);
+        if (LZ4F_isError(lret)) {
+            snprintf(cs->errbuf, sizeof(cs->errbuf), "lz4: %s", LZ4F_getErrorName(lret));
+            return -1;
+        }
+
+        rcode = compress_write_all(fd, cs->buf, lret);
+    }
+#endif
+
+    return rcode;
+}
+
+const char *
+compress_stream_geterr(compress_stream_t *cs)
+{
+    assert(cs);
+    return cs->errbuf;
+}
+
+void
+compress_stream_close(compress_stream_t *cs)
+{
+    if (cs == NULL)
+        return;
+
+#ifdef HAVE_LIBZSTD
+    if (cs->zcctx != NULL)
+        ZSTD_freeCCtx(cs->zcctx);
+#endif
+#ifdef HAVE_LIBLZ4
+    if (cs->lcctx != NULL)
+        LZ4F_freeCompressionContext(cs->lcctx);
+#endif
+    safe_free(cs->buf);
+    safe_free(cs);
+}
@@ -0,0 +1,52 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include "defines.h"
+#include "common.h"
+
+#define COMPRESS_BUFSIZE (1024 * 1024)  /* bytes read or produced per step */
+#define PCAP_STREAM_BUFSIZE (4 * 1024 * 1024)   /* stdio buffer of a pcap stream */
+
+typedef enum tcpr_compress_e {
+    TCPR_COMPRESS_NONE,
+    TCPR_COMPRESS_ZSTD,
+    TCPR_COMPRESS_LZ4,
+} tcpr_compress_t;
+
+/* compresses a stream written to a file descriptor */
+typedef struct compress_stream_s compress_stream_t;
+
+tcpr_compress_t compress_detect(const u_char *buf, size_t len);
+tcpr_compress_t compress_from_path(const char *path);
+int compress_from_name(const char *name, tcpr_compress_t *type);
+const char *compress_name(tcpr_compress_t type);
+int compress_open_read(const char *path, char *ebuf);
+pcap_t *tcpr_pcap_open_offline(const char *path, char *ebuf);
+pcap_t *tcpr_pcap_open_offline_nsec(const char *path, char *ebuf);
+pcap_t *tcpr_pcap_fdopen_offline_nsec(int fd, void **buf, char *ebuf);
+
+compress_stream_t *compress_stream_open(tcpr_compress_t type, int threads, char *ebuf);
+int compress_stream_write(compress_stream_t *cs, int fd, const u_char *data, size_t len);
+int compress_stream_finish(compress_stream_t *cs, int fd);
+const char *compress_stream_geterr(compress_stream_t *cs);
+void compress_stream_close(compress_stream_t *cs);
+
+#endif /* COMPRESS_H_ */
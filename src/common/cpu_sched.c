@@ -0,0 +1,290 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CPU placement for the replay threads: --cpu pins the senders, --helper-cpu
+ * the reader and preload threads, --rt-priority runs the senders SCHED_FIFO
+ * and --mlock keeps the preload cache from being paged out.  CPU lists use
+ * the kernel's cpulist format, e.g. "0,2-5".
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_MLOCKALL
+#include <sys/mman.h>
+#endif
+
+#include "cpu_sched.h"
+
+bool
+cpu_list_has(const cpu_list_t *list, int cpu)
+{
+    int i;
+
+    for (i = 0; i < list->cnt; i++) {
+        if (list->cpus[i] == cpu)
+            return true;
+    }
+
+    return false;
+}
+
+static int
+cpu_list_add(cpu_list_t *list, int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SCHED_MAX_CPUS)
+        return -1;
+
+    if (!cpu_list_has(list, cpu))
+        list->cpus[list->cnt++] = cpu;
+
+    return 0;
+}
+
+/**
+ * Parses a cpulist such as "0,2-5" into list.  Returns -1 and fills
+ * errbuf on error.
+ */
+int
+cpu_list_parse(cpu_list_t *list, const char *spec, char *errbuf, size_t errlen)
+{
+    const char *p = spec;
+    char *end;
+    long first, last, cpu;
+
+    assert(list);
+    assert(spec);
+
+    list->cnt = 0;
+
+    while (*p != '\0' && *p != '\n') {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            goto bad_list;
+
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                goto bad_list;
+        }
+
+        for (cpu = first; cpu <= last; cpu++) {
+            if (cpu_list_add(list, (int)cpu) < 0) {
+                snprintf(errbuf, errlen, "CPU %ld out of range in %s (max %d)",
+                        cpu, spec, CPU_SCHED_MAX_CPUS - 1);
+                return -1;
+            }
+        }
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            goto bad_list;
+    }
+
+    if (list->cnt == 0)
+        goto bad_list;
+
+    return 0;
+
+bad_list:
+    snprintf(errbuf, errlen, "Invalid CPU list, expected e.g. 0,2-5: %s", spec);
+    return -1;
+}
+
+/**
+ * Fills list with the CPUs of NUMA node node.  Returns -1 if the node
+ * is unknown.
+ */
+int
+cpu_list_node(cpu_list_t *list, int node)
+{
+    char path[128], line[4096], errbuf[128];
+    FILE *fp;
+    int rcode;
+
+    assert(list);
+
+    if (node < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+
+    rcode = fgets(line, sizeof(line), fp) != NULL ?
+            cpu_list_parse(list, line, errbuf, sizeof(errbuf)) : -1;
+    fclose(fp);
+
+    return rcode;
+}
+
+/**
+ * Fills list with the CPUs the calling thread may run on.
+ */
+int
+cpu_list_current(cpu_list_t *list)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    int cpu;
+
+    assert(list);
+
+    list->cnt = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+
+    for (cpu = 0; cpu < CPU_SETSIZE && cpu < CPU_SCHED_MAX_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            list->cpus[list->cnt++] = cpu;
+    }
+
+    return 0;
+#else
+    assert(list);
+
+    list->cnt = 0;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Drops the CPUs in remove from list, keeping the order of the rest
+ */
+void
+cpu_list_remove(cpu_list_t *list, const cpu_list_t *remove)
+{
+    int i, cnt = 0;
+
+    assert(list);
+    assert(remove);
+
+    for (i = 0; i < list->cnt; i++) {
+        if (!cpu_list_has(remove, list->cpus[i]))
+            list->cpus[cnt++] = list->cpus[i];
+    }
+
+    list->cnt = cnt;
+}
+
+/**
+ * Drops the CPUs of list which are not in keep
+ */
+void
+cpu_list_intersect(cpu_list_t *list, const cpu_list_t *keep)
+{
+    int i, cnt = 0;
+
+    assert(list);
+    assert(keep);
+
+    for (i = 0; i < list->cnt; i++) {
+        if (cpu_list_has(keep, list->cpus[i]))
+            list->cpus[cnt++] = list->cpus[i];
+    }
+
+    list->cnt = cnt;
+}
+
+/**
+ * Pins the calling thread to list->cpus[idx % cnt], or to every CPU in
+ * the list when idx is negative.  Returns -1 and sets errno on error.
+ */
+int
+cpu_sched_pin(const cpu_list_t *list, int idx)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    int i;
+
+    assert(list);
+
+    if (list->cnt == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+    if (idx >= 0) {
+        CPU_SET(list->cpus[idx % list->cnt], &set);
+    } else {
+        for (i = 0; i < list->cnt; i++)
+            CPU_SET(list->cpus[i], &set);
+    }
+
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    assert(list);
+
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Runs the calling thread SCHED_FIFO at priority, or back under the
+ * default scheduler for 0.  Returns -1 and sets errno on error, usually
+ * EPERM without CAP_SYS_NICE.
+ */
+int
+cpu_sched_fifo(int priority)
+{
+    struct sched_param param;
+    int rcode;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    if ((rcode = pthread_setschedparam(pthread_self(),
+            priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param)) != 0) {
+        errno = rcode;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Locks current and future pages into RAM so the preload cache never
+ * faults during the replay, or unlocks them again.
+ */
+int
+cpu_sched_mlock(bool lock)
+{
+#ifdef HAVE_MLOCKALL
+    return lock ? mlockall(MCL_CURRENT | MCL_FUTURE) : munlockall();
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
@@ -0,0 +1,45 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPU_SCHED_H_
+#define CPU_SCHED_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#define CPU_SCHED_MAX_CPUS 1024
+
+/* a set of CPUs, in the order they were given */
+typedef struct cpu_list_s {
+    int cpus[CPU_SCHED_MAX_CPUS];
+    int cnt;
+} cpu_list_t;
+
+int cpu_list_parse(cpu_list_t *list, const char *spec, char *errbuf, size_t errlen);
+int cpu_list_node(cpu_list_t *list, int node);
+int cpu_list_current(cpu_list_t *list);
+bool cpu_list_has(const cpu_list_t *list, int cpu);
+void cpu_list_remove(cpu_list_t *list, const cpu_list_t *remove);
+void cpu_list_intersect(cpu_list_t *list, const cpu_list_t *keep);
+
+int cpu_sched_pin(const cpu_list_t *list, int idx);
+int cpu_sched_fifo(int priority);
+int cpu_sched_mlock(bool lock);
+
+#endif /* CPU_SCHED_H_ */
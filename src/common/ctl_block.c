@@ -0,0 +1,170 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Creates and removes the --control-shm block, see ctl_block.h for the
+ * layout and what controllers do.  The send loop reads it in
+ * send_packets.c.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "ctl_block.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_SHM_OPEN)
+/*
+ * whether the existing object fd is the block of a tcpreplay that is
+ * still running, filling errbuf if so
+ */
+static bool
+ctl_block_in_use(int fd, const char *name, char *errbuf, size_t errlen)
+{
+    const ctl_block_t *old;
+    struct stat st;
+    pid_t owner = 0;
+
+    /* too small to be a block, or from a run that didn't get far */
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ctl_block_t))
+        return false;
+
+    old = mmap(NULL, sizeof(ctl_block_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (old == MAP_FAILED)
+        return false;
+
+    if (__atomic_load_n(&old->magic, __ATOMIC_ACQUIRE) == CTL_BLOCK_MAGIC)
+        owner = (pid_t)old->owner;
+    munmap((void *)old, sizeof(ctl_block_t));
+
+    /* EPERM: it's running, as someone else */
+    if (owner > 0 && (kill(owner, 0) == 0 || errno == EPERM)) {
+        snprintf(errbuf, errlen, "Shared memory %s is the control block of "
+                "tcpreplay process %d, which is still running", name, (int)owner);
+        return true;
+    }
+
+    dbgx(1, "Reusing control block %s left behind by process %d", name, (int)owner);
+    return false;
+}
+#endif
+
+/**
+ * Creates the control block as the POSIX shared memory object name, or
+ * in memory of our own if name is NULL, for a controller thread in the
+ * same process.  An object left behind by an earlier run is reused and
+ * cleared, unless the tcpreplay which made it is still running.  Returns
+ * NULL and fills errbuf on error.
+ */
+ctl_block_t *
+ctl_block_create(const char *name, char *errbuf, size_t errlen)
+{
+#ifdef HAVE_SYS_MMAN_H
+    ctl_block_t *ctl;
+    int fd = -1;
+
+    assert(errbuf);
+
+    if (name != NULL) {
+#ifdef HAVE_SHM_OPEN
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 &&
+                errno == EEXIST) {
+            if ((fd = shm_open(name, O_RDWR, 0600)) >= 0 &&
+                    ctl_block_in_use(fd, name, errbuf, errlen)) {
+                close(fd);
+                return NULL;
+            }
+        }
+
+        if (fd < 0) {
+            snprintf(errbuf, errlen, "Unable to create shared memory %s: %s",
+                    name, strerror(errno));
+            return NULL;
+        }
+
+        if (ftruncate(fd, sizeof(ctl_block_t)) < 0) {
+            snprintf(errbuf, errlen, "Unable to size shared memory %s: %s",
+                    name, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+#else
+        snprintf(errbuf, errlen, "%s", "Shared memory isn't supported on this platform");
+        return NULL;
+#endif
+    }
+
+    ctl = mmap(NULL, sizeof(ctl_block_t), PROT_READ | PROT_WRITE,
+            fd < 0 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (ctl == MAP_FAILED) {
+        snprintf(errbuf, errlen, "Unable to map the control block: %s", strerror(errno));
+#ifdef HAVE_SHM_OPEN
+        if (name != NULL)
+            shm_unlink(name);
+#endif
+        return NULL;
+    }
+
+    /* nothing left from an earlier run applies, controllers wait for magic */
+    memset(ctl, 0, sizeof(ctl_block_t));
+    ctl->version = CTL_BLOCK_VERSION;
+    ctl->owner = (int32_t)getpid();
+    ctl->current = -1;
+    __atomic_store_n(&ctl->magic, CTL_BLOCK_MAGIC, __ATOMIC_RELEASE);
+
+    dbgx(1, "Control block %s is ready", name ? name : "(in memory)");
+    return ctl;
+#else
+    (void)name;
+    snprintf(errbuf, errlen, "%s", "Control blocks aren't supported on this platform");
+    return NULL;
+#endif
+}
+
+/**
+ * Unmaps the control block and removes name, if it has one
+ */
+void
+ctl_block_close(ctl_block_t *ctl, const char *name)
+{
+    if (ctl == NULL)
+        return;
+
+#ifdef HAVE_SYS_MMAN_H
+    munmap(ctl, sizeof(ctl_block_t));
+#endif
+#ifdef HAVE_SHM_OPEN
+    if (name != NULL)
+        shm_unlink(name);
+#endif
+}
@@ -0,0 +1,110 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTL_BLOCK_H_
+#define CTL_BLOCK_H_
+
+/*
+ * --control-shm: a control block in POSIX shared memory through which an
+ * external controller changes a running replay, for closed loop tests
+ * which adjust the offered load many times a second.  This file needs
+ * nothing else from tcpreplay, so controllers can include it on its own.
+ *
+ * tcpreplay creates the object, shm_open() with O_CREAT | O_EXCL, and
+ * removes it when it exits.  One left behind by a tcpreplay which died is
+ * reused, but not one whose owner is still running.  A controller maps it and sets the rate, pauses and
+ * resumes or switches to another input file with the ctl_block_*()
+ * calls below.  Each one bumps gen, which the send loop compares with
+ * the gen it last applied between packets, or batches of packets, so
+ * nothing is locked and the sender only pays for a load when nothing
+ * changed.  A change takes effect from the next packet or batch, and
+ * once it has, tcpreplay copies gen to seen and fills in the status
+ * fields.  Everything is in host byte order.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CTL_BLOCK_MAGIC     0x4c435254  /* "TRCL" */
+#define CTL_BLOCK_VERSION   1
+
+typedef struct ctl_block_s {
+    uint32_t magic;
+    uint32_t version;
+    int32_t owner;              /* pid of the tcpreplay using the block */
+    uint8_t pad1[52];
+    /* controller */
+    uint32_t gen;               /* bumped after any field below changes */
+    uint32_t rate_gen;          /* bumped after rate is set */
+    double rate;                /* in the unit of the speed mode, see tcpreplay_change_rate() */
+    uint32_t paused;            /* non-zero: stop sending until it is cleared */
+    uint32_t source_gen;        /* bumped after source is set */
+    int32_t source;             /* input file to carry on from, counting from 0 */
+    uint8_t pad2[36];
+    /* tcpreplay */
+    uint32_t seen;              /* gen of the last change applied */
+    uint32_t is_paused;
+    int32_t current;            /* input file being sent */
+    uint32_t pad3;
+    uint64_t applied_ns;        /* CLOCK_MONOTONIC when seen was last set */
+    uint64_t pkts_sent;         /* when seen was last set */
+    uint64_t bytes_sent;
+    uint8_t pad4[24];
+} ctl_block_t;
+
+/* the controller's side */
+static inline void
+ctl_block_set_rate(ctl_block_t *ctl, double rate)
+{
+    ctl->rate = rate;
+    __atomic_fetch_add(&ctl->rate_gen, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ctl->gen, 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+ctl_block_pause(ctl_block_t *ctl, bool paused)
+{
+    __atomic_store_n(&ctl->paused, paused ? 1 : 0, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ctl->gen, 1, __ATOMIC_RELEASE);
+}
+
+/* in single file mode, stops the file being sent and carries on with source */
+static inline void
+ctl_block_switch(ctl_block_t *ctl, int32_t source)
+{
+    ctl->source = source;
+    __atomic_fetch_add(&ctl->source_gen, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ctl->gen, 1, __ATOMIC_RELEASE);
+}
+
+/* whether tcpreplay has applied every change made so far */
+static inline bool
+ctl_block_applied(const ctl_block_t *ctl)
+{
+    return __atomic_load_n(&ctl->seen, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&ctl->gen, __ATOMIC_ACQUIRE);
+}
+
+/* tcpreplay's side */
+#define CTL_BLOCK_NAP_NSEC  20000       /* how often a paused replay looks again */
+
+ctl_block_t *ctl_block_create(const char *name, char *errbuf, size_t errlen);
+void ctl_block_close(ctl_block_t *ctl, const char *name);
+
+#endif /* CTL_BLOCK_H_ */
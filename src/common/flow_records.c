@@ -0,0 +1,203 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flow records: tcpreplay --flow-records writes one fixed size record per
+ * flow the flow stats tracked, as it expires or once the replay is over,
+ * so the flows sent can be checked against a DUT's session table.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flow_records.h"
+
+static void
+flowrec_write(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = write(fd, (const char *)buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errx(-1, "Unable to write flow records: %s", strerror(errno));
+        }
+
+        done += n;
+    }
+}
+
+static void
+flowrec_write_buf(flow_records_t *fr, int idx)
+{
+    flowrec_write(fr->fd, fr->bufs[idx], fr->lens[idx] * sizeof(tcpr_flow_record_t));
+    fr->lens[idx] = 0;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/**
+ * writes out the buffers flow_records_add() hands over, in order
+ */
+static void *
+flowrec_thread(void *arg)
+{
+    flow_records_t *fr = (flow_records_t *)arg;
+
+    pthread_mutex_lock(&fr->lock);
+    for (;;) {
+        while (fr->written == fr->fill && !fr->stop)
+            pthread_cond_wait(&fr->full, &fr->lock);
+
+        if (fr->written == fr->fill)
+            break;
+
+        pthread_mutex_unlock(&fr->lock);
+        flowrec_write_buf(fr, fr->written % FLOW_RECORDS_BUFS);
+        pthread_mutex_lock(&fr->lock);
+
+        fr->written++;
+        pthread_cond_signal(&fr->empty);
+    }
+    pthread_mutex_unlock(&fr->lock);
+
+    return NULL;
+}
+#endif
+
+/**
+ * Creates a flow records file.  Returns NULL and fills errbuf on error.
+ */
+flow_records_t *
+flow_records_open(const char *file, char *errbuf, size_t errlen)
+{
+    flow_records_t *fr;
+    tcpr_flow_rec_file_hdr_t header;
+    int i;
+
+    assert(file);
+
+    fr = (flow_records_t *)safe_malloc(sizeof(flow_records_t));
+    if ((fr->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC,
+            S_IREAD | S_IWRITE | S_IRGRP | S_IWGRP | S_IROTH)) == -1) {
+        snprintf(errbuf, errlen, "Unable to open flow records %s for writing: %s",
+                file, strerror(errno));
+        safe_free(fr);
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FLOWRECMAGIC, strlen(FLOWRECMAGIC));
+    memcpy(header.version, FLOWRECVERSION, strlen(FLOWRECVERSION));
+    header.record_len = htons((u_int16_t)sizeof(tcpr_flow_record_t));
+    flowrec_write(fr->fd, &header, sizeof(header));
+
+    for (i = 0; i < FLOW_RECORDS_BUFS; i++)
+        fr->bufs[i] = (tcpr_flow_record_t *)safe_malloc(FLOW_RECORDS_BUF * sizeof(tcpr_flow_record_t));
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&fr->lock, NULL);
+    pthread_cond_init(&fr->full, NULL);
+    pthread_cond_init(&fr->empty, NULL);
+    if ((i = pthread_create(&fr->thread, NULL, flowrec_thread, fr)) != 0)
+        errx(-1, "Unable to start flow records thread: %s", strerror(i));
+#endif
+
+    return fr;
+}
+
+/**
+ * appends a record, handing the buffer to the writer once it is full.
+ * Only waits when the writer is a whole FLOW_RECORDS_BUFS behind.
+ */
+void
+flow_records_add(flow_records_t *fr, const tcpr_flow_record_t *rec)
+{
+    int idx;
+
+    assert(fr);
+    assert(rec);
+
+    idx = fr->fill % FLOW_RECORDS_BUFS;
+    memcpy(&fr->bufs[idx][fr->lens[idx]++], rec, sizeof(*rec));
+    fr->records++;
+
+    if (fr->lens[idx] < FLOW_RECORDS_BUF)
+        return;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&fr->lock);
+    fr->fill++;
+    pthread_cond_signal(&fr->full);
+    while (fr->fill - fr->written >= FLOW_RECORDS_BUFS)
+        pthread_cond_wait(&fr->empty, &fr->lock);
+    pthread_mutex_unlock(&fr->lock);
+#else
+    flowrec_write_buf(fr, idx);
+#endif
+}
+
+/**
+ * Writes out the rest of the records and frees fr.  Returns the number
+ * of records.
+ */
+COUNTER
+flow_records_close(flow_records_t *fr)
+{
+    COUNTER records;
+    int i;
+
+    if (fr == NULL)
+        return 0;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&fr->lock);
+    if (fr->lens[fr->fill % FLOW_RECORDS_BUFS] > 0)
+        fr->fill++;
+    fr->stop = true;
+    pthread_cond_signal(&fr->full);
+    pthread_mutex_unlock(&fr->lock);
+
+    pthread_join(fr->thread, NULL);
+    pthread_mutex_destroy(&fr->lock);
+    pthread_cond_destroy(&fr->full);
+    pthread_cond_destroy(&fr->empty);
+#else
+    flowrec_write_buf(fr, fr->fill % FLOW_RECORDS_BUFS);
+#endif
+
+    close(fr->fd);
+    for (i = 0; i < FLOW_RECORDS_BUFS; i++)
+        safe_free(fr->bufs[i]);
+
+    records = fr->records;
+    safe_free(fr);
+    dbgx(1, "Wrote " COUNTER_SPEC " flow records", records);
+
+    return records;
+}
@@ -0,0 +1,98 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLOW_RECORDS_H_
+#define FLOW_RECORDS_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#define FLOWRECMAGIC "tcpflow"
+#define FLOWRECVERSION "01"
+#define FLOW_RECORDS_BUF 4096       /* records per buffer handed to the writer */
+#define FLOW_RECORDS_BUFS 4         /* buffers, filling or being written */
+
+/*
+ * A flow records file is this header, in network byte order, then one
+ * tcpr_flow_record_t per flow until the end of the file.
+ */
+struct tcpr_flow_rec_file_hdr_s {
+    char magic[8];
+    char version[4];
+    u_int16_t record_len;           /* sizeof(tcpr_flow_record_t) */
+    u_int16_t reserved;
+} __attribute__((__packed__));
+
+typedef struct tcpr_flow_rec_file_hdr_s tcpr_flow_rec_file_hdr_t;
+
+/* why a flow's record was written */
+#define FLOW_RECORD_END     0       /* still open when the replay or its pass ended */
+#define FLOW_RECORD_EXPIRED 1       /* idle for more than --flow-expiry */
+
+/*
+ * One flow as the flow stats saw it, in network byte order.  Each
+ * direction of a conversation is a flow of its own.
+ */
+struct tcpr_flow_record_s {
+    u_int8_t ip_ver;                /* 4 or 6 */
+    u_int8_t protocol;
+    u_int16_t vlan;                 /* innermost 802.1q VLAN id, 0 for none */
+    u_int16_t src_port;             /* ICMP: type */
+    u_int16_t dst_port;             /* ICMP: code */
+    u_int8_t src_ip[16];            /* IPv4 in the first 4 bytes */
+    u_int8_t dst_ip[16];
+    u_int64_t packets;
+    u_int64_t bytes;                /* on the wire, see pcap_pkthdr.len */
+    u_int64_t first_us;             /* capture time of the first packet, usec since the epoch */
+    u_int64_t last_us;              /* and of the last */
+    u_int8_t end;                   /* FLOW_RECORD_* */
+    u_int8_t reserved[7];
+} __attribute__((__packed__));
+
+typedef struct tcpr_flow_record_s tcpr_flow_record_t;
+
+/*
+ * Records are gathered in buffers and written by a thread of their own,
+ * so the flow table never waits on the disk unless every buffer is full.
+ */
+typedef struct flow_records_s {
+    int fd;
+    tcpr_flow_record_t *bufs[FLOW_RECORDS_BUFS];
+    int lens[FLOW_RECORDS_BUFS];    /* records in each buffer */
+    uint32_t fill;                  /* buffer being filled, mod FLOW_RECORDS_BUFS */
+    uint32_t written;               /* buffers written, mod FLOW_RECORDS_BUFS is the next */
+    COUNTER records;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t full;            /* a buffer was handed over, or stop */
+    pthread_cond_t empty;           /* a buffer was written */
+    bool stop;
+#endif
+} flow_records_t;
+
+flow_records_t *flow_records_open(const char *file, char *errbuf, size_t errlen);
+void flow_records_add(flow_records_t *fr, const tcpr_flow_record_t *rec);
+COUNTER flow_records_close(flow_records_t *fr);
+
+#endif /* FLOW_RECORDS_H_ */
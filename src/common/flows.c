@@ -17,12 +17,22 @@
  */
 
 #include "flows.h"
+#include "flow_records.h"
 #include "tcpreplay_api.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../../lib/sll.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define FLOW_HASH_HAVE_CRC32C
+#endif
+
 /* 5-tuple plus VLAN ID */
 typedef struct flow_entry_data {
     union {
@@ -40,16 +50,68 @@ typedef struct flow_entry_data {
     uint8_t protocol;
 } flow_entry_data_t;
 
+/*
+ * Slots are one cache line each and live inline in the table, so a
+ * lookup touches the control bytes and then only the entries whose tag
+ * matches.
+ */
 typedef struct flow_hash_entry {
     uint32_t key;
     flow_entry_data_t data;
-    struct timeval ts_last_seen;
-    struct flow_hash_entry *next;
+    uint64_t last_seen;     /* flow clock in usec, only kept with an expiry */
 } flow_hash_entry_t;
 
+/*
+ * What --flow-records reports of a flow.  Kept in an array beside the
+ * entries, and only with flow records, so the table stays one line per
+ * flow otherwise.
+ */
+typedef struct flow_count {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t first_us;      /* capture time of the first packet */
+    uint64_t last_us;
+    uint8_t ip_ver;
+} flow_count_t;
+
+#define FLOW_GROUP_WIDTH    16              /* control bytes probed at once */
+#define FLOW_CTRL_EMPTY     ((uint8_t)0x80) /* slot never used */
+#define FLOW_CTRL_DELETED   ((uint8_t)0xfe) /* slot freed, keep probing past it */
+#define FLOW_MIGRATE_SLOTS  32              /* old slots moved per insert while resizing */
+#define FLOW_SWEEP_SLOTS    8               /* slots checked for expiry per lookup */
+
+/*
+ * Open addressed slot array.  ctrl[i] holds the top 7 bits of the hash
+ * of entries[i], or one of the FLOW_CTRL_* markers which all have the high
+ * bit set.
+ */
+typedef struct flow_slots {
+    uint8_t *ctrl;
+    flow_hash_entry_t *entries;
+    flow_count_t *counts;   /* counts[i] of entries[i], or NULL without flow records */
+    size_t capacity;        /* power of two, at least FLOW_GROUP_WIDTH */
+    size_t deleted;         /* FLOW_CTRL_DELETED slots */
+} flow_slots_t;
+
+/*
+ * While growing, new flows go into cur and every insert moves a few
+ * slots over from old so that no single packet pays for the whole copy.
+ *
+ * With an expiry set, every lookup also advances a clock hand over a few
+ * slots of cur and frees flows that have been idle too long.  Each slot
+ * is revisited every capacity / FLOW_SWEEP_SLOTS packets, so the table
+ * stays near the number of flows active within the expiry time.
+ */
 struct flow_hash_table {
-    size_t num_buckets;
-    flow_hash_entry_t **buckets;
+    flow_slots_t cur;
+    flow_slots_t old;       /* old.ctrl is NULL unless a resize is under way */
+    size_t migrated;        /* slots of old already moved */
+    size_t count;           /* entries in cur and old */
+    size_t sweep;           /* next slot of cur checked for expiry */
+    COUNTER resets;
+    uint64_t now;           /* flow clock in usec, see flow_clock() */
+    struct timeval last_ts;
+    flow_records_t *records;    /* --flow-records or NULL */
 };
 
 static bool is_power_of_2(size_t n)
@@ -63,9 +125,9 @@ static bool is_power_of_2(size_t n)
  * We do extensive hashing to prevent hash table collisions.
  * It will save time in the long run.
  */
-static inline uint32_t hash_func(const void *key, size_t length)
+static uint32_t hash_perl(const flow_entry_data_t *key)
 {
-    register size_t i = length;
+    register size_t i = sizeof(*key);
     register uint32_t hv = 0;
     register const u_char *s = (u_char *)key;
     while (i--) {
@@ -80,30 +142,419 @@ static inline uint32_t hash_func(const void *key, size_t length)
     return hv;
 }
 
+/* tuples are hashed as whole 64 bit words */
+#define FLOW_KEY_WORDS ((sizeof(flow_entry_data_t) + 7) / 8)
+
+static inline void key_words(const flow_entry_data_t *key, uint64_t *w)
+{
+    w[FLOW_KEY_WORDS - 1] = 0;
+    memcpy(w, key, sizeof(*key));
+}
+
 /*
- * add hash value to hash table bucket
+ * Multiply and fold one word at a time, then finish with the
+ * MurmurHash3 64 bit mixer so that every output bit depends on the key
  */
-static inline flow_hash_entry_t *hash_add_entry(flow_hash_table_t *fht, const uint32_t hv,
-        const uint32_t key, const flow_entry_data_t *hash_entry)
+static uint32_t hash_words(const uint64_t *w)
 {
-    flow_hash_entry_t *he;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    size_t i;
+
+    for (i = 0; i < FLOW_KEY_WORDS; i++) {
+        h = (h ^ w[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (uint32_t)h;
+}
+
+static uint32_t hash_word(const flow_entry_data_t *key)
+{
+    uint64_t w[FLOW_KEY_WORDS];
+
+    key_words(key, w);
+    return hash_words(w);
+}
+
+#ifdef FLOW_HASH_HAVE_CRC32C
+/*
+ * CRC32C via the SSE4.2 crc32 instruction, one cycle per word.  Only
+ * called once the CPU is known to support it.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t hash_crc32c(const flow_entry_data_t *key)
+{
+    uint64_t w[FLOW_KEY_WORDS];
+    uint64_t crc = 0xffffffff;
+    uint32_t h;
+    size_t i;
+
+    key_words(key, w);
+    for (i = 0; i < FLOW_KEY_WORDS; i++)
+        crc = _mm_crc32_u64(crc, w[i]);
+
+    /* CRC bits are linear, spread them before they pick slots and tags */
+    h = (uint32_t)crc;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+
+    return h;
+}
+#endif
+
+static uint32_t (*tuple_hash)(const flow_entry_data_t *) = NULL;
+
+/*
+ * Choose the function used to hash flow tuples.  Returns -1 if this
+ * build or CPU does not support it.
+ */
+int flow_hash_select(flow_hash_impl_t impl)
+{
+    switch (impl) {
+    case FLOW_HASH_AUTO:
+#ifdef FLOW_HASH_HAVE_CRC32C
+        if (__builtin_cpu_supports("sse4.2")) {
+            tuple_hash = hash_crc32c;
+            break;
+        }
+#endif
+        tuple_hash = hash_word;
+        break;
 
-    assert(hv < fht->num_buckets);
+    case FLOW_HASH_PERL:
+        tuple_hash = hash_perl;
+        break;
 
-    he = malloc(sizeof (*he));
-    if (!he) {
-        warn("out of memory");
-        return NULL;
+    case FLOW_HASH_WORD:
+        tuple_hash = hash_word;
+        break;
+
+    case FLOW_HASH_CRC32C:
+#ifdef FLOW_HASH_HAVE_CRC32C
+        if (__builtin_cpu_supports("sse4.2")) {
+            tuple_hash = hash_crc32c;
+            break;
+        }
+#endif
+        return -1;
+
+    default:
+        return -1;
     }
 
+    return 0;
+}
+
+/*
+ * Select by name: auto, perl, word or crc32c
+ */
+int flow_hash_select_name(const char *name)
+{
+    if (strcmp(name, "auto") == 0)
+        return flow_hash_select(FLOW_HASH_AUTO);
+    else if (strcmp(name, "perl") == 0)
+        return flow_hash_select(FLOW_HASH_PERL);
+    else if (strcmp(name, "word") == 0)
+        return flow_hash_select(FLOW_HASH_WORD);
+    else if (strcmp(name, "crc32c") == 0)
+        return flow_hash_select(FLOW_HASH_CRC32C);
+
+    return -1;
+}
+
+/*
+ * Hash the tuple with both end points in a fixed order, so that both
+ * directions of a conversation get the same value
+ */
+static inline uint32_t hash_func(const flow_entry_data_t *entry)
+{
+    flow_entry_data_t key;
+    int cmp;
+
+    if (!tuple_hash)
+        flow_hash_select(FLOW_HASH_AUTO);
+
+    cmp = memcmp(&entry->src_ip, &entry->dst_ip, sizeof(entry->src_ip));
+    if (cmp < 0 || (cmp == 0 && entry->src_port <= entry->dst_port))
+        return tuple_hash(entry);
+
+    memcpy(&key, entry, sizeof(key));
+    memcpy(&key.src_ip, &entry->dst_ip, sizeof(key.src_ip));
+    memcpy(&key.dst_ip, &entry->src_ip, sizeof(key.dst_ip));
+    key.src_port = entry->dst_port;
+    key.dst_port = entry->src_port;
+
+    return tuple_hash(&key);
+}
+
+/*
+ * Return a bit mask of the control bytes in the group equal to c
+ */
+static inline uint32_t group_match(const uint8_t *ctrl, const uint8_t c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < FLOW_GROUP_WIDTH; i++) {
+        if (ctrl[i] == c)
+            mask |= 1U << i;
+    }
+
+    return mask;
+#endif
+}
+
+static void slots_alloc(flow_slots_t *s, size_t capacity, bool counts)
+{
+    s->capacity = capacity;
+    s->ctrl = safe_malloc(capacity);
+    memset(s->ctrl, FLOW_CTRL_EMPTY, capacity);
+    s->entries = safe_malloc(sizeof(flow_hash_entry_t) * capacity);
+    s->counts = counts ? safe_malloc(sizeof(flow_count_t) * capacity) : NULL;
+}
+
+static void slots_free(flow_slots_t *s)
+{
+    safe_free(s->ctrl);
+    safe_free(s->entries);
+    safe_free(s->counts);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Hand the flow in slot i of s to --flow-records
+ */
+static void flow_record(const flow_hash_table_t *fht, const flow_slots_t *s,
+        const size_t i, const uint8_t end)
+{
+    const flow_hash_entry_t *he = &s->entries[i];
+    const flow_count_t *fc = &s->counts[i];
+    tcpr_flow_record_t rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ip_ver = fc->ip_ver;
+    rec.protocol = he->data.protocol;
+    rec.vlan = he->data.vlan;
+    rec.src_port = he->data.src_port;
+    rec.dst_port = he->data.dst_port;
+    memcpy(rec.src_ip, &he->data.src_ip, sizeof(rec.src_ip));
+    memcpy(rec.dst_ip, &he->data.dst_ip, sizeof(rec.dst_ip));
+    rec.packets = htonll(fc->packets);
+    rec.bytes = htonll(fc->bytes);
+    rec.first_us = htonll(fc->first_us);
+    rec.last_us = htonll(fc->last_us);
+    rec.end = end;
+
+    flow_records_add(fht->records, &rec);
+}
+
+/*
+ * Hand every flow in the table to --flow-records
+ */
+static void flow_record_all(const flow_hash_table_t *fht, const uint8_t end)
+{
+    const flow_slots_t *sets[2] = { &fht->cur, &fht->old };
+    size_t i;
+    int j;
+
+    for (j = 0; j < 2; j++) {
+        if (sets[j]->counts == NULL)
+            continue;
+
+        for (i = 0; i < sets[j]->capacity; i++) {
+            if (!(sets[j]->ctrl[i] & FLOW_CTRL_EMPTY))
+                flow_record(fht, sets[j], i, end);
+        }
+    }
+}
+
+/*
+ * Probe the slots for this flow.  If it is not there and empty is set,
+ * return the first free slot on the probe path through it.  If swept is
+ * set it receives the deleted slot flow_sweep() left the flow in, or
+ * SIZE_MAX if there is none.
+ */
+static inline flow_hash_entry_t *slots_find(const flow_slots_t *s, const uint32_t key,
+        const flow_entry_data_t *hash_entry, size_t *empty, size_t *swept)
+{
+    size_t group_mask = s->capacity / FLOW_GROUP_WIDTH - 1;
+    size_t group = key & group_mask;
+    size_t step = 0;
+    size_t free_slot = SIZE_MAX;
+    uint8_t tag = key >> 25;
+    uint32_t match;
+
+    if (swept)
+        *swept = SIZE_MAX;
+
+    for (;;) {
+        const uint8_t *ctrl = s->ctrl + group * FLOW_GROUP_WIDTH;
+
+        for (match = group_match(ctrl, tag); match; match &= match - 1) {
+            flow_hash_entry_t *he = &s->entries[group * FLOW_GROUP_WIDTH + __builtin_ctz(match)];
+
+            /*
+             * found an existing entry with similar hash. double
+             * check to see if it is our flow or just a collision
+             */
+            if (he->key == key && !memcmp(&he->data, hash_entry, sizeof(he->data)))
+                return he;
+        }
+
+        /* a deleted slot can be reused, but the flow may sit beyond it */
+        if (s->deleted && (match = group_match(ctrl, FLOW_CTRL_DELETED)) != 0) {
+            if (free_slot == SIZE_MAX)
+                free_slot = group * FLOW_GROUP_WIDTH + __builtin_ctz(match);
+
+            /* swept slots keep their flow until they are reused */
+            for (; swept && match; match &= match - 1) {
+                size_t i = group * FLOW_GROUP_WIDTH + __builtin_ctz(match);
+                const flow_hash_entry_t *he = &s->entries[i];
+
+                if (he->key == key && !memcmp(&he->data, hash_entry, sizeof(he->data)))
+                    *swept = i;
+            }
+        }
+
+        /* no flow probes past a slot that was never used */
+        if ((match = group_match(ctrl, FLOW_CTRL_EMPTY)) != 0) {
+            if (free_slot == SIZE_MAX)
+                free_slot = group * FLOW_GROUP_WIDTH + __builtin_ctz(match);
+            if (empty)
+                *empty = free_slot;
+            return NULL;
+        }
+
+        /* triangular probing visits every group of a power of two table */
+        group = (group + ++step) & group_mask;
+    }
+}
+
+static inline flow_hash_entry_t *slots_insert(flow_slots_t *s, const size_t i,
+        const uint32_t key, const flow_entry_data_t *hash_entry)
+{
+    flow_hash_entry_t *he = &s->entries[i];
+
+    if (s->ctrl[i] == FLOW_CTRL_DELETED)
+        --s->deleted;
+    s->ctrl[i] = key >> 25;
     he->key = key;
-    he->next = fht->buckets[hv];
-    fht->buckets[hv] = he;
     memcpy(&he->data, hash_entry, sizeof(he->data));
+    if (s->counts)
+        memset(&s->counts[i], 0, sizeof(s->counts[i]));
 
     return he;
 }
 
+/*
+ * Move up to n slots of the old table into the current one
+ */
+static void flow_migrate(flow_hash_table_t *fht, size_t n)
+{
+    size_t end = min(fht->migrated + n, fht->old.capacity);
+    flow_hash_entry_t *he, *moved;
+    size_t i, empty;
+
+    for (i = fht->migrated; i < end; i++) {
+        if (fht->old.ctrl[i] & FLOW_CTRL_EMPTY)
+            continue;
+
+        he = &fht->old.entries[i];
+        slots_find(&fht->cur, he->key, &he->data, &empty, NULL);
+        moved = slots_insert(&fht->cur, empty, he->key, &he->data);
+        moved->last_seen = he->last_seen;
+        if (fht->old.counts)
+            memcpy(&fht->cur.counts[moved - fht->cur.entries], &fht->old.counts[i],
+                    sizeof(flow_count_t));
+        fht->old.ctrl[i] = FLOW_CTRL_DELETED;
+    }
+
+    fht->migrated = end;
+    if (end == fht->old.capacity) {
+        dbgx(1, "flow table resize to %zu slots complete", fht->cur.capacity);
+        slots_free(&fht->old);
+    }
+}
+
+/*
+ * Start moving to a new table.  If expiry has freed most of the flows,
+ * the new table is the same size and only drops the deleted slots.
+ */
+static void flow_grow(flow_hash_table_t *fht)
+{
+    size_t capacity = fht->cur.capacity;
+
+    /* only one resize at a time */
+    if (fht->old.ctrl)
+        flow_migrate(fht, fht->old.capacity);
+
+    if (fht->count >= capacity / 2)
+        capacity *= 2;
+
+    memcpy(&fht->old, &fht->cur, sizeof(fht->old));
+    slots_alloc(&fht->cur, capacity, fht->records != NULL);
+    fht->migrated = 0;
+    fht->sweep = 0;
+}
+
+/*
+ * Advance the flow clock to the packet's timestamp.  Only forward steps
+ * count, so time keeps moving when --loop restarts the capture.
+ */
+static inline void flow_clock(flow_hash_table_t *fht, const struct timeval *tv)
+{
+    struct timeval delta;
+
+    if (timerisset(&fht->last_ts) && timercmp(tv, &fht->last_ts, >)) {
+        timersub(tv, &fht->last_ts, &delta);
+        fht->now += TIMEVAL_TO_MICROSEC(&delta);
+    }
+
+    memcpy(&fht->last_ts, tv, sizeof(fht->last_ts));
+}
+
+static inline bool flow_is_expired(const flow_hash_table_t *fht,
+        const flow_hash_entry_t *he, const int expiry)
+{
+    return fht->now - he->last_seen > (uint64_t)expiry * 1000000;
+}
+
+/*
+ * Free up to FLOW_SWEEP_SLOTS flows idle for more than expiry seconds.
+ * The entry stays in the deleted slot until an insert reuses it, so a
+ * flow which comes back before then is still reported as expired.
+ */
+static void flow_sweep(flow_hash_table_t *fht, const int expiry)
+{
+    flow_slots_t *s = &fht->cur;
+    size_t i;
+
+    for (i = 0; i < FLOW_SWEEP_SLOTS; i++) {
+        size_t slot = fht->sweep++ & (s->capacity - 1);
+
+        if (s->ctrl[slot] & FLOW_CTRL_EMPTY)
+            continue;
+
+        if (flow_is_expired(fht, &s->entries[slot], expiry)) {
+            if (s->counts)
+                flow_record(fht, s, slot, FLOW_RECORD_EXPIRED);
+            s->ctrl[slot] = FLOW_CTRL_DELETED;
+            ++s->deleted;
+            --fht->count;
+        }
+    }
+}
+
 /*
  * Search for this entry in the hash table and
  * insert it if not found. Report whether this
@@ -112,39 +563,70 @@ static inline flow_hash_entry_t *hash_add_entry(flow_hash_table_t *fht, const ui
  * Only check for expiry if 'expiry' is set
  */
 static inline flow_entry_type_t hash_put_data(flow_hash_table_t *fht, const uint32_t key,
-        const flow_entry_data_t *hash_entry, const struct timeval *tv, const int expiry)
-{
-    uint32_t hash_value = key & (fht->num_buckets - 1);
-    flow_hash_entry_t *he = NULL;
-    flow_entry_type_t res = FLOW_ENTRY_INVALID;
-
-    for (he = fht->buckets[hash_value]; he; he = he->next) {
-        /*
-         * found an existing entry with similar hash. double
-         * check to see if it is our flow or just a collision
-         */
-        if (he->key == key && !memcmp(&he->data, hash_entry, sizeof(he->data)))
-            break;
+        const flow_entry_data_t *hash_entry, const struct pcap_pkthdr *pkthdr,
+        const uint8_t ip_ver, const int expiry)
+{
+    flow_slots_t *hs = &fht->cur;
+    flow_hash_entry_t *he;
+    flow_entry_type_t res;
+    flow_count_t *fc;
+    size_t empty, swept;
+
+    if (fht->old.ctrl)
+        flow_migrate(fht, FLOW_MIGRATE_SLOTS);
+
+    if (expiry)
+        flow_clock(fht, &pkthdr->ts);
+
+    he = slots_find(&fht->cur, key, hash_entry, &empty, expiry ? &swept : NULL);
+    if (!he && fht->old.ctrl) {
+        he = slots_find(&fht->old, key, hash_entry, NULL, NULL);
+        hs = &fht->old;
     }
 
     if (he) {
         /* this is not a new flow */
-        if (expiry && tv->tv_sec > (expiry + he->ts_last_seen.tv_sec))
+        if (expiry && flow_is_expired(fht, he, expiry)) {
             res = FLOW_ENTRY_EXPIRED;
-        else
+            if (hs->counts) {
+                flow_record(fht, hs, he - hs->entries, FLOW_RECORD_EXPIRED);
+                memset(&hs->counts[he - hs->entries], 0, sizeof(flow_count_t));
+            }
+        } else {
             res = FLOW_ENTRY_EXISTING;
-
-        if (expiry)
-            memcpy(&he->ts_last_seen, tv, sizeof(he->ts_last_seen));
+        }
+    } else if (expiry && swept != SIZE_MAX) {
+        /* flow_sweep() freed this flow and it came back */
+        he = slots_insert(&fht->cur, swept, key, hash_entry);
+        hs = &fht->cur;
+        ++fht->count;
+        res = FLOW_ENTRY_EXPIRED;
     } else {
-        /* this is a new flow */
-        if ((he = hash_add_entry(fht, hash_value, key, hash_entry)) != NULL) {
-            res = FLOW_ENTRY_NEW;
-
-            if (expiry)
-                memcpy(&he->ts_last_seen, tv, sizeof(he->ts_last_seen));
-        } else
-            res = FLOW_ENTRY_INVALID;
+        /* this is a new flow, keep the load under 7/8 */
+        if (fht->count + fht->cur.deleted + 1 > fht->cur.capacity / 8 * 7) {
+            flow_grow(fht);
+            slots_find(&fht->cur, key, hash_entry, &empty, NULL);
+        }
+
+        he = slots_insert(&fht->cur, empty, key, hash_entry);
+        hs = &fht->cur;
+        ++fht->count;
+        res = FLOW_ENTRY_NEW;
+    }
+
+    if (hs->counts) {
+        fc = &hs->counts[he - hs->entries];
+        if (fc->packets++ == 0) {
+            fc->first_us = TIMEVAL_TO_MICROSEC(&pkthdr->ts);
+            fc->ip_ver = ip_ver;
+        }
+        fc->bytes += pkthdr->len;
+        fc->last_us = TIMEVAL_TO_MICROSEC(&pkthdr->ts);
+    }
+
+    if (expiry) {
+        he->last_seen = fht->now;
+        flow_sweep(fht, expiry);
     }
 
     dbgx(2, "flow type=%d\n", (int)res);
@@ -152,169 +634,242 @@ static inline flow_entry_type_t hash_put_data(flow_hash_table_t *fht, const uint
 }
 
 /*
- * Decode the packet, study it's flow status and report
+ * Extract the 5-tuple and VLAN ID of the packet, whose headers are
+ * described by meta, into entry.
+ *
+ * Returns FLOW_ENTRY_NEW if entry now describes a flow, otherwise
+ * FLOW_ENTRY_NON_IP.
  */
-flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
-        const u_char *pktdata, const int datalink, const int expiry)
-{
-    uint16_t ether_type = 0;
-    vlan_hdr_t *vlan_hdr;
-    ipv4_hdr_t *ip_hdr = NULL;
-    ipv6_hdr_t *ip6_hdr = NULL;
-    tcp_hdr_t *tcp_hdr;
-    udp_hdr_t *udp_hdr;
-    icmpv4_hdr_t *icmp_hdr;
-    hdlc_hdr_t *hdlc_hdr;
-    sll_hdr_t *sll_hdr;
-    struct tcpr_pppserial_hdr *ppp;
-    flow_entry_data_t entry;
-    int l2_len = 0;
-    int ip_len;
-    uint8_t protocol;
-    uint32_t hash;
-
-    assert(fht);
-    assert(pktdata);
-
-    /*
-     * extract the 5-tuple and populate the entry data
-     */
-
-    memset(&entry, 0, sizeof(entry));
+static flow_entry_type_t flow_extract(const u_char *pktdata, const pkt_meta_t *meta,
+        flow_entry_data_t *entry)
+{
+    const ipv4_hdr_t *ip_hdr;
+    const ipv6_hdr_t *ip6_hdr;
+    const tcp_hdr_t *tcp_hdr;
+    const udp_hdr_t *udp_hdr;
+    const icmpv4_hdr_t *icmp_hdr;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->vlan = meta->vlan;
+
+    if (meta->ip_ver == 4) {
+        ip_hdr = (const ipv4_hdr_t *)(pktdata + meta->l2len);
+        entry->src_ip.in = ip_hdr->ip_src;
+        entry->dst_ip.in = ip_hdr->ip_dst;
+    } else if (meta->ip_ver == 6) {
+        ip6_hdr = (const ipv6_hdr_t *)(pktdata + meta->l2len);
+        memcpy(&entry->src_ip.in6, &ip6_hdr->ip_src, sizeof(entry->src_ip.in6));
+        memcpy(&entry->dst_ip.in6, &ip6_hdr->ip_dst, sizeof(entry->dst_ip.in6));
+    } else {
+        return FLOW_ENTRY_NON_IP;
+    }
 
-    switch (datalink) {
-    case DLT_LINUX_SLL:
-        l2_len = 16;
-        sll_hdr = (sll_hdr_t *)pktdata;
-        ether_type = sll_hdr->sll_protocol;
-        break;
+    entry->protocol = meta->proto;
 
-    case DLT_PPP_SERIAL:
-        l2_len = 4;
-        ppp = (struct tcpr_pppserial_hdr *)pktdata;
-        if (ntohs(ppp->protocol) == 0x0021)
-            ether_type = htons(ETHERTYPE_IP);
-        else
-            ether_type = ppp->protocol;
-        break;
+    /* no ports if the L4 header wasn't captured */
+    if (meta->l4off == 0)
+        return FLOW_ENTRY_NEW;
 
-    case DLT_C_HDLC:
-        l2_len = 4;
-        hdlc_hdr = (hdlc_hdr_t *)pktdata;
-        ether_type = hdlc_hdr->protocol;
+    switch (meta->proto) {
+    case IPPROTO_UDP:
+        udp_hdr = (const udp_hdr_t *)(pktdata + meta->l4off);
+        entry->src_port = udp_hdr->uh_sport;
+        entry->dst_port = udp_hdr->uh_dport;
         break;
 
-    case DLT_RAW:
-        if ((pktdata[0] >> 4) == 4)
-            ether_type = ETHERTYPE_IP;
-        else if ((pktdata[0] >> 4) == 6)
-            ether_type = ETHERTYPE_IP6;
+    case IPPROTO_TCP:
+        tcp_hdr = (const tcp_hdr_t *)(pktdata + meta->l4off);
+        entry->src_port = tcp_hdr->th_sport;
+        entry->dst_port = tcp_hdr->th_dport;
         break;
 
-    case DLT_JUNIPER_ETHER:
-        if (memcmp(pktdata, "MGC", 3))
-            warnx("No Magic Number found: %s (0x%x)",
-                 pcap_datalink_val_to_description(datalink), datalink);
-
-        if ((pktdata[3] & 0x80) == 0x80) {
-            l2_len = ntohs(*((uint16_t*)&pktdata[4]));
-            l2_len += 6;
-        } else
-            l2_len = 4; /* no header extensions */
-        /* fall through */
-    case DLT_EN10MB:
-        ether_type = ntohs(((eth_hdr_t*)(pktdata + l2_len))->ether_type);
-
-        while (ether_type == ETHERTYPE_VLAN) {
-            vlan_hdr = (vlan_hdr_t *)(pktdata + l2_len);
-            entry.vlan = vlan_hdr->vlan_priority_c_vid & htons(0xfff);
-            ether_type = ntohs(vlan_hdr->vlan_len);
-            l2_len += 4;
-        }
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        icmp_hdr = (const icmpv4_hdr_t *)(pktdata + meta->l4off);
+        entry->src_port = icmp_hdr->icmp_type;
+        entry->dst_port = icmp_hdr->icmp_code;
+    }
 
-        l2_len += sizeof(eth_hdr_t);
-        break;
+    return FLOW_ENTRY_NEW;
+}
 
-    default:
+/*
+ * Finds the headers of the packet for flow_decode() and flow_hash().
+ * Returns false if the datalink isn't supported.
+ */
+static bool flow_meta(const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const int datalink, pkt_meta_t *meta)
+{
+    if (get_pkt_meta(pktdata, pkthdr->caplen, datalink, meta) < 0) {
         warnx("Unable to process unsupported DLT type: %s (0x%x)",
              pcap_datalink_val_to_description(datalink), datalink);
-        return FLOW_ENTRY_INVALID;
+        return false;
     }
 
-    if (ether_type == ETHERTYPE_IP) {
-        ip_hdr = (ipv4_hdr_t *)(pktdata + l2_len);
-
-        if (ip_hdr->ip_v != 4)
-            return FLOW_ENTRY_NON_IP;
-
-        ip_len = ip_hdr->ip_hl * 4;
-        protocol = ip_hdr->ip_p;
-        entry.src_ip.in = ip_hdr->ip_src;
-        entry.dst_ip.in = ip_hdr->ip_dst;
-    } else if (ether_type == ETHERTYPE_IP6) {
+    return true;
+}
 
-        if ((pktdata[0] >> 4) != 6)
-            return FLOW_ENTRY_NON_IP;
+/*
+ * Decode the packet, study it's flow status and report
+ *
+ * If hash is set it receives the flow_hash() of the packet, which
+ * costs nothing extra since the table is keyed on it.
+ */
+flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink, const int expiry, uint32_t *hash)
+{
+    pkt_meta_t meta;
 
-        ip6_hdr = (ipv6_hdr_t *)(pktdata + l2_len);
-        ip_len = sizeof(*ip6_hdr);
-        protocol = ip6_hdr->ip_nh;
+    assert(pktdata);
 
-        if (protocol == 0) {
-            struct tcpr_ipv6_ext_hdr_base *ext = (struct tcpr_ipv6_ext_hdr_base *)(ip6_hdr + 1);
-            ip_len += (ext->ip_len + 1) * 8;
-            protocol = ext->ip_nh;
-        }
-        memcpy(&entry.src_ip.in6, &ip6_hdr->ip_src, sizeof(entry.src_ip.in6));
-        memcpy(&entry.dst_ip.in6, &ip6_hdr->ip_dst, sizeof(entry.dst_ip.in6));
-    } else {
-        return FLOW_ENTRY_NON_IP;
+    if (!flow_meta(pkthdr, pktdata, datalink, &meta)) {
+        if (hash)
+            *hash = 0;
+        return FLOW_ENTRY_INVALID;
     }
 
-    entry.protocol = protocol;
+    return flow_decode_meta(fht, pkthdr, pktdata, &meta, expiry, hash);
+}
 
-    switch (protocol) {
-    case IPPROTO_UDP:
-        udp_hdr = (udp_hdr_t*)(pktdata + ip_len + l2_len);
-        entry.src_port = udp_hdr->uh_sport;
-        entry.dst_port = udp_hdr->uh_dport;
-        break;
+/*
+ * flow_decode() of a packet whose headers get_pkt_meta() already found
+ */
+flow_entry_type_t flow_decode_meta(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const pkt_meta_t *meta, const int expiry, uint32_t *hash)
+{
+    flow_entry_data_t entry;
+    flow_entry_type_t res;
+    uint32_t hv;
 
-    case IPPROTO_TCP:
-        tcp_hdr = (tcp_hdr_t*)(pktdata + ip_len + l2_len);
-        entry.src_port = tcp_hdr->th_sport;
-        entry.dst_port = tcp_hdr->th_dport;
-        break;
+    assert(fht);
+    assert(pktdata);
+    assert(meta);
 
-    case IPPROTO_ICMP:
-    case IPPROTO_ICMPV6:
-        icmp_hdr = (icmpv4_hdr_t*)(pktdata + ip_len + l2_len);
-        entry.src_port = icmp_hdr->icmp_type;
-        entry.dst_port = icmp_hdr->icmp_code;
+    if ((res = flow_extract(pktdata, meta, &entry)) != FLOW_ENTRY_NEW) {
+        if (hash)
+            *hash = 0;
+        return res;
     }
 
     /* hash the 5-tuple */
-    hash = hash_func(&entry, sizeof(entry));
+    hv = hash_func(&entry);
+    if (hash)
+        *hash = hv;
 
-    return hash_put_data(fht, hash, &entry, &pkthdr->ts, expiry);
+    return hash_put_data(fht, hv, &entry, pkthdr, meta->ip_ver, expiry);
 }
 
-static void flow_cache_clear(flow_hash_table_t *fht)
+/*
+ * Hash the 5-tuple of the packet without touching any flow table.
+ * Both directions of a conversation produce the same value, which makes
+ * this suitable for pinning flows to a transmit queue.  Returns 0 for
+ * packets which do not belong to a flow.
+ */
+uint32_t flow_hash(const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const int datalink)
 {
-    flow_hash_entry_t *fhe = NULL;
-    flow_hash_entry_t *fhe_tmp = NULL;
-    size_t i;
+    pkt_meta_t meta;
 
-    for (i = 0; i < fht->num_buckets; i++) {
-        if ( (fhe = fht->buckets[i]) ) {
-            while (fhe) {
-                fhe_tmp = fhe;
-                fhe = fhe->next;
-                free(fhe_tmp);
-            }
-            fht->buckets[i] = NULL;
-        }
+    assert(pktdata);
+
+    if (!flow_meta(pkthdr, pktdata, datalink, &meta))
+        return 0;
+
+    return flow_hash_meta(pktdata, &meta);
+}
+
+/*
+ * flow_hash() of a packet whose headers get_pkt_meta() already found
+ */
+uint32_t flow_hash_meta(const u_char *pktdata, const pkt_meta_t *meta)
+{
+    flow_entry_data_t entry;
+
+    assert(pktdata);
+    assert(meta);
+
+    if (flow_extract(pktdata, meta, &entry) != FLOW_ENTRY_NEW)
+        return 0;
+
+    return hash_func(&entry);
+}
+
+/*
+ * Like flow_hash(), but the same packet gets the same value on every
+ * machine, for hashes written to files: the tuple is laid out in network
+ * byte order and always goes through the word hash.
+ */
+uint32_t flow_hash_portable(const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const int datalink)
+{
+    pkt_meta_t meta;
+
+    assert(pktdata);
+
+    if (!flow_meta(pkthdr, pktdata, datalink, &meta))
+        return 0;
+
+    return flow_hash_meta_portable(pktdata, &meta);
+}
+
+/*
+ * flow_hash_portable() of a packet whose headers get_pkt_meta() already found
+ */
+uint32_t flow_hash_meta_portable(const u_char *pktdata, const pkt_meta_t *meta)
+{
+    flow_entry_data_t entry;
+    u_char key[FLOW_KEY_WORDS * 8], *p;
+    uint64_t w[FLOW_KEY_WORDS];
+    uint16_t lo_port, hi_port;
+    const void *lo_ip, *hi_ip;
+    size_t i, j;
+    int cmp;
+
+    assert(pktdata);
+    assert(meta);
+
+    if (flow_extract(pktdata, meta, &entry) != FLOW_ENTRY_NEW)
+        return 0;
+
+    /* ICMP type and code are kept as numbers, ports and VLAN ID as on the wire */
+    if (entry.protocol == IPPROTO_ICMP || entry.protocol == IPPROTO_ICMPV6) {
+        entry.src_port = htons(entry.src_port);
+        entry.dst_port = htons(entry.dst_port);
+    }
+
+    /* both directions in the same order, as hash_func() does */
+    cmp = memcmp(&entry.src_ip, &entry.dst_ip, sizeof(entry.src_ip));
+    if (cmp < 0 || (cmp == 0 && ntohs(entry.src_port) <= ntohs(entry.dst_port))) {
+        lo_ip = &entry.src_ip;
+        hi_ip = &entry.dst_ip;
+        lo_port = entry.src_port;
+        hi_port = entry.dst_port;
+    } else {
+        lo_ip = &entry.dst_ip;
+        hi_ip = &entry.src_ip;
+        lo_port = entry.dst_port;
+        hi_port = entry.src_port;
     }
+
+    memset(key, 0, sizeof(key));
+    p = key;
+    memcpy(p, lo_ip, sizeof(entry.src_ip));
+    p += sizeof(entry.src_ip);
+    memcpy(p, hi_ip, sizeof(entry.dst_ip));
+    p += sizeof(entry.dst_ip);
+    memcpy(p, &lo_port, 2);
+    memcpy(p + 2, &hi_port, 2);
+    memcpy(p + 4, &entry.vlan, 2);
+    p[6] = entry.protocol;
+
+    /* words are read big endian whatever the CPU */
+    for (i = 0; i < FLOW_KEY_WORDS; i++) {
+        w[i] = 0;
+        for (j = 0; j < 8; j++)
+            w[i] = (w[i] << 8) | key[i * 8 + j];
+    }
+
+    return hash_words(w);
 }
 
 flow_hash_table_t *flow_hash_table_init(size_t n)
@@ -324,18 +879,79 @@ flow_hash_table_t *flow_hash_table_init(size_t n)
         errx(-1, "invalid table size: %zu\n", n);
 
     fht = safe_malloc(sizeof(*fht));
-    fht->num_buckets = n;
-    fht->buckets = safe_malloc(sizeof(flow_hash_entry_t) * n);
+    slots_alloc(&fht->cur, max(n, FLOW_GROUP_WIDTH), false);
 
     return fht;
 }
 
+/*
+ * Forget every flow but keep the memory for the next pass.  Only the
+ * control bytes are cleared, the entries are left as they are.
+ */
+void flow_hash_table_reset(flow_hash_table_t *fht)
+{
+    assert(fht);
+
+    if (fht->records)
+        flow_record_all(fht, FLOW_RECORD_END);
+
+    slots_free(&fht->old);
+    memset(fht->cur.ctrl, FLOW_CTRL_EMPTY, fht->cur.capacity);
+    fht->cur.deleted = 0;
+    fht->count = 0;
+    fht->migrated = 0;
+    fht->sweep = 0;
+    ++fht->resets;
+}
+
+/*
+ * Report the table's size and allocations in the flow counters of stats
+ */
+void flow_hash_table_stats(const flow_hash_table_t *fht, tcpreplay_stats_t *stats)
+{
+    assert(fht);
+    assert(stats);
+
+    stats->flow_table_flows = fht->count;
+    stats->flow_table_slots = fht->cur.capacity + fht->old.capacity;
+    stats->flow_table_bytes = sizeof(*fht) +
+            stats->flow_table_slots * (sizeof(flow_hash_entry_t) + 1 +
+                    (fht->records ? sizeof(flow_count_t) : 0));
+    stats->flow_table_resets = fht->resets;
+}
+
+/*
+ * Have every flow reported to fr as it expires, is reset or the table is
+ * released, or stop reporting them with a NULL fr.  The counts of flows
+ * already in the table start over.
+ */
+void flow_hash_table_records(flow_hash_table_t *fht, flow_records_t *fr)
+{
+    assert(fht);
+
+    fht->records = fr;
+    safe_free(fht->cur.counts);
+    safe_free(fht->old.counts);
+    fht->cur.counts = NULL;
+    fht->old.counts = NULL;
+    if (fr == NULL)
+        return;
+
+    fht->cur.counts = safe_malloc(sizeof(flow_count_t) * fht->cur.capacity);
+    if (fht->old.ctrl)
+        fht->old.counts = safe_malloc(sizeof(flow_count_t) * fht->old.capacity);
+}
+
 void flow_hash_table_release(flow_hash_table_t *fht)
 {
     if (!fht)
         return;
 
-    flow_cache_clear(fht);
-    free(fht->buckets);
-    free(fht);
+    /* the flows still open end with the table */
+    if (fht->records)
+        flow_record_all(fht, FLOW_RECORD_END);
+
+    slots_free(&fht->cur);
+    slots_free(&fht->old);
+    safe_free(fht);
 }
@@ -21,7 +21,7 @@
 #include "defines.h"
 #include "common.h"
 
-#define DEFAULT_FLOW_HASH_BUCKET_SIZE (1 << 16)       /* 64K - must be a power of two */
+#define DEFAULT_FLOW_HASH_BUCKET_SIZE (1 << 16)       /* 64K initial slots - must be a power of two */
 
 typedef enum flow_entry_type_e {
     FLOW_ENTRY_INVALID,     /* unknown packet type */
@@ -32,10 +32,32 @@ typedef enum flow_entry_type_e {
 } flow_entry_type_t;
 
 typedef struct flow_hash_table flow_hash_table_t;
+struct flow_records_s;
+
+/* tuple hash implementations, see flow_hash_select() */
+typedef enum flow_hash_impl_e {
+    FLOW_HASH_AUTO,         /* crc32c if the CPU has it, else word */
+    FLOW_HASH_PERL,         /* one byte at a time, the original */
+    FLOW_HASH_WORD,         /* 64 bit multiply and fold */
+    FLOW_HASH_CRC32C,       /* SSE4.2 crc32 instruction */
+} flow_hash_impl_t;
 
 flow_hash_table_t *flow_hash_table_init(size_t n);
 void flow_hash_table_release(flow_hash_table_t * table);
+void flow_hash_table_reset(flow_hash_table_t *fht);
+void flow_hash_table_stats(const flow_hash_table_t *fht, tcpreplay_stats_t *stats);
+void flow_hash_table_records(flow_hash_table_t *fht, struct flow_records_s *fr);
 flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
-        const u_char *pktdata, const int datalink, const int expiry);
+        const u_char *pktdata, const int datalink, const int expiry, uint32_t *hash);
+flow_entry_type_t flow_decode_meta(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const pkt_meta_t *meta, const int expiry, uint32_t *hash);
+uint32_t flow_hash(const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const int datalink);
+uint32_t flow_hash_meta(const u_char *pktdata, const pkt_meta_t *meta);
+uint32_t flow_hash_portable(const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const int datalink);
+uint32_t flow_hash_meta_portable(const u_char *pktdata, const pkt_meta_t *meta);
+int flow_hash_select(flow_hash_impl_t impl);
+int flow_hash_select_name(const char *name);
 
 #endif /* FLOWS_H_ */
@@ -39,6 +39,14 @@ extern int debug;
 extern const char pcap_version[];
 #endif
 
+#define GET_META_PREFETCH 4     /* packets get_pkt_meta_batch() prefetches ahead */
+
+#ifdef __GNUC__
+#define GET_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define GET_PREFETCH(p)
+#endif
+
 
 /**
  * Depending on what version of libpcap/WinPcap there are different ways to get 
@@ -71,261 +79,377 @@ get_pcap_version(void)
 
 
 
+/*
+ * get_pkt_meta() comes in one version per datalink, so callers going
+ * through a file can pick it once with get_pkt_meta_fn() rather than
+ * switch on the datalink for every packet.  Each version fills in the L2
+ * fields and hands the rest to pkt_meta_l3().  These are the only L2
+ * decoders outside the tcpedit plugins: get_l2len(), get_l2protocol(),
+ * the flow table, tcpprep, tcpcapinfo and the packet metadata sidecar
+ * all go through them.
+ */
+
 /**
- * returns the L2 protocol (IP, ARP, etc)
- * or 0 for error
+ * finds the IP and L4 headers behind an L2 header of l2_len bytes
  */
-uint16_t
-get_l2protocol(const u_char *pktdata, const int datalen, const int datalink)
+static inline int
+pkt_meta_l3(const u_char *pktdata, const int datalen, const int l2_len,
+        const uint16_t ether_type, pkt_meta_t *meta)
+{
+    const ipv4_hdr_t *ip_hdr;
+    const ipv6_hdr_t *ip6_hdr;
+    const struct tcpr_ipv6_ext_hdr_base *ext;
+    int l4_off;
+    uint8_t proto;
+
+    meta->l2len = l2_len;
+    meta->ether_type = ether_type;
+
+    if (ether_type == ETHERTYPE_IP && l2_len + TCPR_IPV4_H <= datalen) {
+        ip_hdr = (const ipv4_hdr_t *)(pktdata + l2_len);
+        if (ip_hdr->ip_v != 4 || ip_hdr->ip_hl < 5)
+            return 0;
+
+        proto = ip_hdr->ip_p;
+        l4_off = l2_len + (ip_hdr->ip_hl << 2);
+    } else if (ether_type == ETHERTYPE_IP6 && l2_len + TCPR_IPV6_H <= datalen) {
+        ip6_hdr = (const ipv6_hdr_t *)(pktdata + l2_len);
+        if ((ip6_hdr->ip_flags[0] >> 4) != 6)
+            return 0;
+
+        /* skip the options headers, the L4 header follows them */
+        proto = ip6_hdr->ip_nh;
+        l4_off = l2_len + TCPR_IPV6_H;
+        while (proto == TCPR_IPV6_NH_HBH || proto == TCPR_IPV6_NH_ROUTING ||
+                proto == TCPR_IPV6_NH_DESTOPTS) {
+            if (l4_off + (int)sizeof(*ext) > datalen)
+                return 0;
+
+            ext = (const struct tcpr_ipv6_ext_hdr_base *)(pktdata + l4_off);
+            proto = ext->ip_nh;
+            l4_off += (ext->ip_len + 1) * 8;
+        }
+    } else {
+        return 0;
+    }
+
+    meta->ip_ver = ether_type == ETHERTYPE_IP ? 4 : 6;
+    meta->proto = proto;
+    if (l4_off + 4 <= datalen)
+        meta->l4off = l4_off;
+
+    return 0;
+}
+
+/**
+ * an Ethernet header and any 802.1q tags, l2_len bytes into the packet
+ */
+static inline int
+pkt_meta_ether(const u_char *pktdata, const int datalen, int l2_len, pkt_meta_t *meta)
 {
-    eth_hdr_t *eth_hdr;
-    vlan_hdr_t *vlan_hdr;
-    hdlc_hdr_t *hdlc_hdr;
-    sll_hdr_t *sll_hdr;
+    const vlan_hdr_t *vlan_hdr;
     uint16_t ether_type;
-    uint16_t eth_hdr_offset = 0;
-    struct tcpr_pppserial_hdr *ppp;
 
-    assert(pktdata);
-    assert(datalen);
+    if (l2_len + TCPR_ETH_H > datalen)
+        return 0;
 
-    switch (datalink) {
-    case DLT_RAW:
-        if ((pktdata[0] >> 4) == 4)
-            return ETHERTYPE_IP;
-        else if ((pktdata[0] >> 4) == 6)
-            return ETHERTYPE_IP6;
-        break;
+    ether_type = ntohs(((const eth_hdr_t *)(pktdata + l2_len))->ether_type);
+    while (ether_type == ETHERTYPE_VLAN || ether_type == ETHERTYPE_QINQ) {
+        if (l2_len + 4 + TCPR_ETH_H > datalen)
+            return 0;
 
-    case DLT_JUNIPER_ETHER:
-        if (memcmp(pktdata, "MGC", 3))
-            warnx("No Magic Number found: %s (0x%x)",
-                 pcap_datalink_val_to_description(datalink), datalink);
-
-        if ((pktdata[3] & 0x80) == 0x80) {
-            eth_hdr_offset = ntohs(*((uint16_t*)&pktdata[4]));
-            eth_hdr_offset += 6;
-        } else
-            eth_hdr_offset = 4; /* no header extensions */
-        /* fall through */
-    case DLT_EN10MB:
-        eth_hdr = (eth_hdr_t *)(pktdata + eth_hdr_offset);
-        ether_type = ntohs(eth_hdr->ether_type);
-        switch (ether_type) {
-        case ETHERTYPE_VLAN: /* 802.1q */
-            vlan_hdr = (vlan_hdr_t *)pktdata;
-            return ntohs(vlan_hdr->vlan_len);
-        default:
-            return ether_type; /* yes, return it in host byte order */
-        }
-        break;
+        vlan_hdr = (const vlan_hdr_t *)(pktdata + l2_len);
+        meta->vlan = vlan_hdr->vlan_priority_c_vid & htons(0xfff);
+        ether_type = ntohs(vlan_hdr->vlan_len);
+        l2_len += 4;
+        meta->vlans++;
+    }
 
-    case DLT_PPP_SERIAL:
-        ppp = (struct tcpr_pppserial_hdr *)pktdata;
-        if (ntohs(ppp->protocol) == 0x0021)
-            return htons(ETHERTYPE_IP);
-        else
-            return ppp->protocol;
-        break;
+    return pkt_meta_l3(pktdata, datalen, l2_len + TCPR_ETH_H, ether_type, meta);
+}
 
-    case DLT_C_HDLC:
-        hdlc_hdr = (hdlc_hdr_t *)pktdata;
-        return hdlc_hdr->protocol;
-        break;
+static int
+pkt_meta_en10mb(const u_char *pktdata, const int datalen, pkt_meta_t *meta)
+{
+    memset(meta, 0, sizeof(*meta));
+    return pkt_meta_ether(pktdata, datalen, 0, meta);
+}
 
-    case DLT_LINUX_SLL:
-        sll_hdr = (sll_hdr_t *)pktdata;
-        return sll_hdr->sll_protocol;
-        break;
+static int
+pkt_meta_juniper(const u_char *pktdata, const int datalen, pkt_meta_t *meta)
+{
+    uint16_t ext_len;
+    int l2_len;
 
-    default:
-        errx(-1, "Unable to process unsupported DLT type: %s (0x%x)", 
-             pcap_datalink_val_to_description(datalink), datalink);
+    memset(meta, 0, sizeof(*meta));
+    if (datalen < 6)
+        return 0;
+
+    if (memcmp(pktdata, "MGC", 3))
+        warnx("No Magic Number found: %s (0x%x)",
+             pcap_datalink_val_to_description(DLT_JUNIPER_ETHER), DLT_JUNIPER_ETHER);
+
+    if ((pktdata[3] & 0x80) == 0x80) {
+        memcpy(&ext_len, &pktdata[4], sizeof(ext_len));
+        l2_len = ntohs(ext_len) + 6;
+    } else
+        l2_len = 4; /* no header extensions */
+
+    return pkt_meta_ether(pktdata, datalen, l2_len, meta);
+}
+
+static int
+pkt_meta_raw(const u_char *pktdata, const int datalen, pkt_meta_t *meta)
+{
+    uint16_t ether_type = 0;
+
+    memset(meta, 0, sizeof(*meta));
+    if (datalen < 1)
+        return 0;
 
+    if ((pktdata[0] >> 4) == 4)
+        ether_type = ETHERTYPE_IP;
+    else if ((pktdata[0] >> 4) == 6)
+        ether_type = ETHERTYPE_IP6;
+
+    return pkt_meta_l3(pktdata, datalen, 0, ether_type, meta);
+}
+
+static int
+pkt_meta_ppp_serial(const u_char *pktdata, const int datalen, pkt_meta_t *meta)
+{
+    uint16_t ether_type;
+
+    memset(meta, 0, sizeof(*meta));
+    if (datalen < 4)
+        return 0;
+
+    ether_type = ntohs(((const struct tcpr_pppserial_hdr *)pktdata)->protocol);
+    if (ether_type == 0x0021)
+        ether_type = ETHERTYPE_IP;
+    else if (ether_type == 0x0057)
+        ether_type = ETHERTYPE_IP6;
+
+    return pkt_meta_l3(pktdata, datalen, 4, ether_type, meta);
+}
+
+static int
+pkt_meta_c_hdlc(const u_char *pktdata, const int datalen, pkt_meta_t *meta)
+{
+    memset(meta, 0, sizeof(*meta));
+    if (datalen < CISCO_HDLC_LEN)
+        return 0;
+
+    return pkt_meta_l3(pktdata, datalen, CISCO_HDLC_LEN,
+            ntohs(((const hdlc_hdr_t *)pktdata)->protocol), meta);
+}
+
+static int
+pkt_meta_linux_sll(const u_char *pktdata, const int datalen, pkt_meta_t *meta)
+{
+    memset(meta, 0, sizeof(*meta));
+    if (datalen < SLL_HDR_LEN)
+        return 0;
+
+    return pkt_meta_l3(pktdata, datalen, SLL_HDR_LEN,
+            ntohs(((const sll_hdr_t *)pktdata)->sll_protocol), meta);
+}
+
+static int
+pkt_meta_unsupported(_U_ const u_char *pktdata, _U_ const int datalen, pkt_meta_t *meta)
+{
+    memset(meta, 0, sizeof(*meta));
+    return -1;
+}
+
+/**
+ * \brief Returns the get_pkt_meta() of a datalink
+ *
+ * The function returned doesn't look at the datalink again, so a caller
+ * going through a file picks it once.  An unsupported datalink gets one
+ * which always returns -1.
+ */
+pkt_meta_fn_t
+get_pkt_meta_fn(const int datalink)
+{
+    switch (datalink) {
+    case DLT_EN10MB:
+        return pkt_meta_en10mb;
+    case DLT_JUNIPER_ETHER:
+        return pkt_meta_juniper;
+    case DLT_RAW:
+        return pkt_meta_raw;
+    case DLT_PPP_SERIAL:
+        return pkt_meta_ppp_serial;
+    case DLT_C_HDLC:
+        return pkt_meta_c_hdlc;
+    case DLT_LINUX_SLL:
+        return pkt_meta_linux_sll;
+    default:
+        return pkt_meta_unsupported;
     }
+}
 
-    return 0;
+/**
+ * Can get_pkt_meta() decode the datalink?
+ */
+bool
+get_pkt_meta_supported(const int datalink)
+{
+    return get_pkt_meta_fn(datalink) != pkt_meta_unsupported;
+}
+
+/**
+ * \brief Finds a packet's L2, L3 and L4 headers in one walk
+ *
+ * Fills in meta so later stages needn't walk the headers again with
+ * get_l2len(), get_l2protocol() and friends.  A header which runs past
+ * datalen is left out: ether_type is 0 if the L2 header was cut short,
+ * ip_ver is 0 if the IP header was, and l4off is 0 unless at least the
+ * first 4 bytes (the ports) of the L4 header were captured.  Returns 0,
+ * or -1 if the datalink isn't supported.
+ */
+int
+get_pkt_meta(const u_char *pktdata, const int datalen, const int datalink,
+        pkt_meta_t *meta)
+{
+    assert(pktdata);
+    assert(meta);
 
+    return get_pkt_meta_fn(datalink)(pktdata, datalen, meta);
 }
 
 /**
- * returns the length in number of bytes of the L2 header, or -1 on error
+ * \brief get_pkt_meta() of cnt packets of one datalink
+ *
+ * fn is the get_pkt_meta_fn() of the datalink.  Packets a few ahead are
+ * prefetched while one is walked, so their headers are in cache by the
+ * time they are reached.  Returns 0, or -1 if the datalink isn't supported.
  */
 int
-get_l2len(const u_char *pktdata, const int datalen, const int datalink)
+get_pkt_meta_batch(pkt_meta_fn_t fn, const u_char *const *pktdata, const int *datalen,
+        pkt_meta_t *meta, const int cnt)
 {
-    uint16_t ether_type = 0;
-    vlan_hdr_t *vlan_hdr;
-    int l2_len = 0;
+    int i;
 
-    assert(pktdata);
-    assert(datalen);
+    assert(fn);
 
-    switch (datalink) {
-    case DLT_RAW:
-        /* pktdata IS the ip header! */
-        return 0;
-        break;
+    for (i = 0; i < cnt; i++) {
+        if (i + GET_META_PREFETCH < cnt)
+            GET_PREFETCH(pktdata[i + GET_META_PREFETCH]);
 
-    case DLT_JUNIPER_ETHER:
-        l2_len = 24;
-        /* fall through */
-    case DLT_EN10MB:
-        ether_type = ntohs(((eth_hdr_t*)(pktdata + l2_len))->ether_type);
+        if (fn(pktdata[i], datalen[i], &meta[i]) < 0)
+            return -1;
+    }
 
-        while (ether_type == ETHERTYPE_VLAN) {
-            vlan_hdr = (vlan_hdr_t *)(pktdata + l2_len);
-            ether_type = ntohs(vlan_hdr->vlan_len);
-            l2_len += 4;
-        }
+    return 0;
+}
 
-        l2_len += sizeof(eth_hdr_t);
+/**
+ * returns the L2 protocol (IP, ARP, etc) in host byte order
+ * or 0 for error
+ */
+uint16_t
+get_l2protocol(const u_char *pktdata, const int datalen, const int datalink)
+{
+    pkt_meta_t meta;
 
-        return l2_len;
-        break;
+    assert(pktdata);
+    assert(datalen);
 
-    case DLT_PPP_SERIAL:
-        return 4;
-        break;
+    if (get_pkt_meta(pktdata, datalen, datalink, &meta) < 0)
+        errx(-1, "Unable to process unsupported DLT type: %s (0x%x)", 
+             pcap_datalink_val_to_description(datalink), datalink);
 
-    case DLT_C_HDLC:
-        return CISCO_HDLC_LEN;
-        break;
+    return meta.ether_type;
+}
 
-    case DLT_LINUX_SLL:
-        return SLL_HDR_LEN;
-        break;
+/**
+ * returns the length in number of bytes of the L2 header, 0 if it wasn't
+ * all captured
+ */
+int
+get_l2len(const u_char *pktdata, const int datalen, const int datalink)
+{
+    pkt_meta_t meta;
 
-    default:
+    assert(pktdata);
+    assert(datalen);
+
+    if (get_pkt_meta(pktdata, datalen, datalink, &meta) < 0)
         errx(-1, "Unable to process unsupported DLT type: %s (0x%x)", 
              pcap_datalink_val_to_description(datalink), datalink);
-        break;
-    }
 
-    return -1; /* we shouldn't get here */
+    return meta.l2len;
 }
 
 /**
  * \brief returns a ptr to the ipv4 header + data or NULL if it's not IP
  *
- * we may use an extra buffer for the ip header (and above)
- * on stricly aligned systems where the layer 2 header doesn't
- * fall on a 4 byte boundry (like a standard ethernet header)
+ * The header is used where it lies in pktdata.  On stricly aligned systems
+ * the header structs are packed (see TCPR_UNALIGNED), so the layer 2 header
+ * leaving it off a 4 byte boundry (like a standard ethernet header) is fine
  *
  * Note: you can cast the result as an ip_hdr_t, but you'll be able 
  * to access data above the header minus any stripped L2 data
  */
 const u_char *
-get_ipv4(const u_char *pktdata, int datalen, int datalink, u_char **newbuff)
+get_ipv4(const u_char *pktdata, int datalen, int datalink)
 {
-    const u_char *ip_hdr = NULL;
-    int l2_len = 0;
-    uint16_t proto;
+    pkt_meta_t meta;
 
     assert(pktdata);
     assert(datalen);
-    assert(*newbuff);
 
-    l2_len = get_l2len(pktdata, datalen, datalink);
+    if (get_pkt_meta(pktdata, datalen, datalink, &meta) < 0)
+        errx(-1, "Unable to process unsupported DLT type: %s (0x%x)", 
+             pcap_datalink_val_to_description(datalink), datalink);
+
+    if (meta.ether_type != ETHERTYPE_IP)
+        return NULL;
 
     /* sanity... datalen must be > l2_len + IP header len*/
-    if (l2_len + TCPR_IPV4_H > datalen) {
+    if (meta.l2len + TCPR_IPV4_H > datalen) {
         dbg(1, "get_ipv4(): Layer 2 len > total packet len, hence no IP header");
         return NULL;
     }
 
-    proto = get_l2protocol(pktdata, datalen, datalink);
-
-    if (proto != ETHERTYPE_IP)
-        return NULL;
-
-#ifdef FORCE_ALIGN
-    /*
-     * copy layer 3 and up to our temp packet buffer
-     * for now on, we have to edit the packetbuff because
-     * just before we send the packet, we copy the packetbuff 
-     * back onto the pkt.data + l2len buffer
-     * we do all this work to prevent byte alignment issues
-     */
-    if (l2_len % 4) {
-        ip_hdr = *newbuff;
-        memcpy(ip_hdr, (pktdata + l2_len), (datalen - l2_len));
-    } else {
-
-        /* we don't have to do a memcpy if l2_len lands on a boundry */
-        ip_hdr = (pktdata + l2_len);
-    }
-#else
-    /*
-     * on non-strict byte align systems, don't need to memcpy(), 
-     * just point to l2len bytes into the existing buffer
-     */
-    ip_hdr = (pktdata + l2_len);
-#endif
-
-    return ip_hdr;
+    return pktdata + meta.l2len;
 }
 
 
 /**
  * \brief returns a ptr to the ipv6 header + data or NULL if it's not IP
  *
- * we may use an extra buffer for the ip header (and above)
- * on stricly aligned systems where the layer 2 header doesn't
- * fall on a 4 byte boundry (like a standard ethernet header)
+ * The header is used where it lies in pktdata.  On stricly aligned systems
+ * the header structs are packed (see TCPR_UNALIGNED), so the layer 2 header
+ * leaving it off a 4 byte boundry (like a standard ethernet header) is fine
  *
  * Note: you can cast the result as an ip_hdr_t, but you'll be able 
  * to access data above the header minus any stripped L2 data
  */
 const u_char *
-get_ipv6(const u_char *pktdata, int datalen, int datalink, u_char **newbuff)
+get_ipv6(const u_char *pktdata, int datalen, int datalink)
 {
-    const u_char *ip6_hdr = NULL;
-    int l2_len = 0;
-    uint16_t proto;
+    pkt_meta_t meta;
 
     assert(pktdata);
     assert(datalen);
-    assert(*newbuff);
 
-    l2_len = get_l2len(pktdata, datalen, datalink);
+    if (get_pkt_meta(pktdata, datalen, datalink, &meta) < 0)
+        errx(-1, "Unable to process unsupported DLT type: %s (0x%x)", 
+             pcap_datalink_val_to_description(datalink), datalink);
 
-    /* sanity... datalen must be > l2_len + IP header len*/
-    if (l2_len + TCPR_IPV6_H > datalen) {
-        dbg(1, "get_ipv6(): Layer 2 len > total packet len, hence no IPv6 header");
+    if (meta.ether_type != ETHERTYPE_IP6)
         return NULL;
-    }
-
-    proto = get_l2protocol(pktdata, datalen, datalink);
 
-    if (proto != ETHERTYPE_IP6)
+    /* sanity... datalen must be > l2_len + IP header len*/
+    if (meta.l2len + TCPR_IPV6_H > datalen) {
+        dbg(1, "get_ipv6(): Layer 2 len > total packet len, hence no IPv6 header");
         return NULL;
-
-#ifdef FORCE_ALIGN
-    /*
-     * copy layer 3 and up to our temp packet buffer
-     * for now on, we have to edit the packetbuff because
-     * just before we send the packet, we copy the packetbuff
-     * back onto the pkt.data + l2len buffer
-     * we do all this work to prevent byte alignment issues
-     */
-    if (l2_len % 4) {
-        ip6_hdr = *newbuff;
-        memcpy(ip6_hdr, (pktdata + l2_len), (datalen - l2_len));
-    } else {
-
-        /* we don't have to do a memcpy if l2_len lands on a boundry */
-        ip6_hdr = (pktdata + l2_len);
     }
-#else
-    /*
-     * on non-strict byte align systems, don't need to memcpy(),
-     * just point to l2len bytes into the existing buffer
-     */
-    ip6_hdr = (pktdata + l2_len);
-#endif
 
-    return ip6_hdr;
+    return pktdata + meta.l2len;
 }
 
 /**
@@ -26,6 +26,27 @@
 #include "common.h"
 
 
+/* where a packet's headers are, see get_pkt_meta() */
+typedef struct pkt_meta_s {
+    uint16_t l2len;         /* offset of the L3 header */
+    uint16_t ether_type;    /* L3 protocol in host byte order, 0 if unknown */
+    uint16_t l4off;         /* offset of the L4 header, 0 if not captured */
+    uint16_t vlan;          /* innermost 802.1q VLAN id, network byte order */
+    uint8_t vlans;          /* 802.1q/802.1ad tags in front of the L3 header */
+    uint8_t ip_ver;         /* 4 or 6 for a captured IP header, else 0 */
+    uint8_t proto;          /* IP protocol past any IPv6 options headers */
+} pkt_meta_t;
+
+/* get_pkt_meta() of one datalink, see get_pkt_meta_fn() */
+typedef int (*pkt_meta_fn_t)(const u_char *pktdata, const int datalen, pkt_meta_t *meta);
+
+int get_pkt_meta(const u_char *pktdata, const int datalen, const int datalink,
+        pkt_meta_t *meta);
+pkt_meta_fn_t get_pkt_meta_fn(const int datalink);
+bool get_pkt_meta_supported(const int datalink);
+int get_pkt_meta_batch(pkt_meta_fn_t fn, const u_char *const *pktdata, const int *datalen,
+        pkt_meta_t *meta, const int cnt);
+
 int get_l2len(const u_char *pktdata, const int datalen, const int datalink);
 
 u_int16_t get_l2protocol(const u_char *pktdata, const int datalen, const int datalink);
@@ -36,8 +57,8 @@ void *get_layer4_v6(const ipv6_hdr_t *ip_hdr, const int len);
 u_int8_t get_ipv6_l4proto(const ipv6_hdr_t *ip6_hdr, const int len);
 void *get_ipv6_next(struct tcpr_ipv6_ext_hdr_base *exthdr, const int len);
 
-const u_char *get_ipv4(const u_char *pktdata, int datalen, int datalink, u_char **newbuff);
-const u_char *get_ipv6(const u_char *pktdata, int datalen, int datalink, u_char **newbuff);
+const u_char *get_ipv4(const u_char *pktdata, int datalen, int datalink);
+const u_char *get_ipv6(const u_char *pktdata, int datalen, int datalink);
 
 u_int32_t get_name2addr4(const char *hostname, bool dnslookup);
 const char *get_addr2name4(const u_int32_t ip, bool dnslookup);
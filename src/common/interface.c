@@ -26,6 +26,9 @@
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#ifndef HAVE_WIN32
+#include <net/if.h>
+#endif
 
 #include "config.h"
 #include "defines.h"
@@ -69,13 +72,38 @@ get_interface(interface_list_t *list, const char *alias)
         } while (ptr != NULL);
     } else {
         name = (char *)safe_malloc(strlen(alias) + 1);
-        strlcpy(name, alias, sizeof(name));
+        strlcpy(name, alias, strlen(alias) + 1);
         return(name);
     }
     
     return(NULL);
 }
 
+/**
+ * Like get_interface(), but only enumerates the interfaces, into *list
+ * for the next call, when alias isn't already the name of an interface.
+ * Named interfaces then cost one lookup each instead of a walk over
+ * every interface of the host.
+ */
+char *
+get_interface_lazy(interface_list_t **list, const char *alias)
+{
+    assert(list);
+    assert(alias);
+
+#ifndef HAVE_WIN32
+    if (if_nametoindex(alias) != 0)
+        return((char *)alias);
+#endif
+
+#ifdef ENABLE_PCAP_FINDALLDEVS
+    if (*list == NULL)
+        *list = get_interface_list();
+#endif
+
+    return(get_interface(*list, alias));
+}
+
 /** 
  * Get all available interfaces as an interface_list *
  */
@@ -32,6 +32,7 @@ typedef struct interface_list_s {
 #define INTERFACE_LIST_SIZE (80 * 80) /* 80 cols * 80 rows */
 
 char *get_interface(interface_list_t *, const char *);
+char *get_interface_lazy(interface_list_t **, const char *);
 interface_list_t *get_interface_list(void);
 void list_interfaces(interface_list_t *);
 
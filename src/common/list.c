@@ -37,6 +37,132 @@
 #include <errno.h>
 
 
+/*
+ * Long lists, such as generated lists of bad packets, are also kept as
+ * sorted, merged intervals.  Packet numbers only go up, so a lookup
+ * starts from the interval the last one ended on.
+ */
+struct tcpr_list_index_s {
+    COUNTER *lo;
+    COUNTER *hi;        /* inclusive */
+    int count;
+    int cursor;         /* hint only, lookups on other threads may move it */
+};
+
+typedef struct tcpr_list_index_s tcpr_list_index_t;
+
+static int
+list_range_cmp(const void *a, const void *b)
+{
+    const COUNTER *x = (const COUNTER *)a, *y = (const COUNTER *)b;
+
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+
+    return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+/**
+ * builds the index for a list, hanging it off the list head.  Ranges
+ * mean the same as in check_list(): min 0 is everything up to max and
+ * max 0 is everything from min on.
+ */
+static void
+list_index_build(tcpr_list_t *list)
+{
+    tcpr_list_index_t *index;
+    tcpr_list_t *cur;
+    COUNTER *ranges, lo, hi;
+    int cnt = 0, i;
+
+    for (cur = list; cur != NULL; cur = cur->next)
+        cnt++;
+
+    ranges = (COUNTER *)safe_malloc(sizeof(COUNTER) * 2 * cnt);
+    cnt = 0;
+    for (cur = list; cur != NULL; cur = cur->next) {
+        lo = cur->min;
+        hi = (cur->max == 0 && cur->min != 0) ? (COUNTER)-1 : cur->max;
+        if (lo > hi)
+            continue;       /* never matches */
+
+        ranges[cnt * 2] = lo;
+        ranges[cnt * 2 + 1] = hi;
+        cnt++;
+    }
+
+    qsort(ranges, cnt, sizeof(COUNTER) * 2, list_range_cmp);
+
+    index = (tcpr_list_index_t *)safe_malloc(sizeof(tcpr_list_index_t));
+    index->lo = (COUNTER *)safe_malloc(sizeof(COUNTER) * (cnt + 1));
+    index->hi = (COUNTER *)safe_malloc(sizeof(COUNTER) * (cnt + 1));
+
+    /* merge overlapping and adjacent ranges */
+    for (i = 0; i < cnt; i++) {
+        lo = ranges[i * 2];
+        hi = ranges[i * 2 + 1];
+        if (index->count > 0 && (index->hi[index->count - 1] == (COUNTER)-1 ||
+                lo <= index->hi[index->count - 1] + 1)) {
+            index->hi[index->count - 1] = max(index->hi[index->count - 1], hi);
+        } else {
+            index->lo[index->count] = lo;
+            index->hi[index->count] = hi;
+            index->count++;
+        }
+    }
+
+    safe_free(ranges);
+    list->index = index;
+    dbgx(1, "Indexed packet list as %d intervals", index->count);
+}
+
+/**
+ * returns the last interval starting at or before value, or -1
+ */
+static int
+list_index_find(tcpr_list_index_t *index, COUNTER value)
+{
+    int cur, lo, hi, mid;
+
+    cur = __atomic_load_n(&index->cursor, __ATOMIC_RELAXED);
+
+    /* usually the same interval as last time, or the next one */
+    if (cur < index->count && index->lo[cur] <= value) {
+        if (cur + 1 == index->count || index->lo[cur + 1] > value)
+            return cur;
+        if (cur + 2 == index->count || index->lo[cur + 2] > value) {
+            __atomic_store_n(&index->cursor, cur + 1, __ATOMIC_RELAXED);
+            return cur + 1;
+        }
+    }
+
+    lo = 0;
+    hi = index->count - 1;
+    cur = -1;
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->lo[mid] <= value) {
+            cur = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    if (cur >= 0)
+        __atomic_store_n(&index->cursor, cur, __ATOMIC_RELAXED);
+
+    return cur;
+}
+
+static void
+list_index_destroy(tcpr_list_index_t *index)
+{
+    safe_free(index->lo);
+    safe_free(index->hi);
+    safe_free(index);
+}
+
 /**
  * Creates a new tcpr_list entry.  Malloc's memory.
  */
@@ -66,6 +192,7 @@ parse_list(tcpr_list_t ** listdata, char *ourstr)
     char regex[] = "^[0-9]+(-[0-9]+)?$";
     char *token = NULL;
     u_int i;
+    int cnt = 1;
 
 
     /* compile the regex first */
@@ -122,6 +249,7 @@ parse_list(tcpr_list_t ** listdata, char *ourstr)
 
         listcur->next = new_list();
         listcur = listcur->next;
+        cnt++;
 
         for (i = 0; i < strlen(this); i++) {
             if (this[i] == '-') {
@@ -140,6 +268,9 @@ parse_list(tcpr_list_t ** listdata, char *ourstr)
 
     }
 
+    if (cnt >= LIST_INDEX_MIN)
+        list_index_build(*listdata);
+
     return 1;
 }
 
@@ -152,6 +283,13 @@ tcpr_dir_t
 check_list(tcpr_list_t * list, COUNTER value)
 {
     tcpr_list_t *current;
+    int pos;
+
+    if (list->index != NULL) {
+        pos = list_index_find(list->index, value);
+        return (pos >= 0 && value <= list->index->hi[pos]) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
+    }
+
     current = list;
 
     do {
@@ -189,6 +327,9 @@ void
 free_list(tcpr_list_t * list)
 {
 
+    if (list->index != NULL)
+        list_index_destroy(list->index);
+
     /* recursively go down the list */
     if (list->next != NULL)
         free_list(list->next);
@@ -21,10 +21,16 @@
 #ifndef __LIST_H__
 #define __LIST_H__
 
+/* lists at least this long get a sorted interval index */
+#define LIST_INDEX_MIN 8
+
+struct tcpr_list_index_s;
+
 struct list_s {
     COUNTER max;
     COUNTER min;
     struct list_s *next;
+    struct tcpr_list_index_s *index;    /* list head only, may be NULL */
 };
 
 typedef struct list_s tcpr_list_t;
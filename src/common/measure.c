@@ -0,0 +1,300 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loopback latency and loss measurement.  The sender stamps a sequence
+ * number and the time into each packet, see measure_tag_t; a receive
+ * thread captures on another interface like tcpbridge does and matches
+ * the tags that come back.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "measure.h"
+
+/**
+ * Opens intf to receive the tagged packets on.  offset is where the tag
+ * goes in each frame, or MEASURE_TRAILER.  Returns NULL and fills ebuf,
+ * PCAP_ERRBUF_SIZE bytes, on error.
+ */
+measure_t *
+measure_open(const char *intf, int offset, char *ebuf)
+{
+    measure_t *m;
+    pcap_t *pcap;
+
+    assert(intf);
+    assert(ebuf);
+
+#ifdef HAVE_PCAP_SET_IMMEDIATE_MODE
+    int rcode;
+
+    /* immediate mode, or TPACKET_V3 holds packets back a block at a time */
+    if ((pcap = pcap_create(intf, ebuf)) == NULL)
+        return NULL;
+
+    pcap_set_snaplen(pcap, MAX_SNAPLEN);
+    pcap_set_promisc(pcap, 1);
+    pcap_set_timeout(pcap, MEASURE_TICK_MS);
+    pcap_set_immediate_mode(pcap, 1);
+    pcap_set_buffer_size(pcap, MEASURE_RX_BUFFER);
+#ifdef HAVE_PCAP_TSTAMP_PRECISION
+    pcap_set_tstamp_precision(pcap, PCAP_TSTAMP_PRECISION_NANO);
+#endif
+
+    if ((rcode = pcap_activate(pcap)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", rcode == PCAP_ERROR ?
+                pcap_geterr(pcap) : pcap_statustostr(rcode));
+        pcap_close(pcap);
+        return NULL;
+    } else if (rcode > 0) {
+        warnx("%s: %s", intf, rcode == PCAP_WARNING ?
+                pcap_geterr(pcap) : pcap_statustostr(rcode));
+    }
+#else
+    if ((pcap = pcap_open_live(intf, MAX_SNAPLEN, 1, MEASURE_TICK_MS, ebuf)) == NULL)
+        return NULL;
+#endif
+
+    m = safe_malloc(sizeof(measure_t));
+    m->pcap = pcap;
+    m->offset = offset;
+    m->run = (u_int32_t)time(NULL) ^ ((u_int32_t)getpid() << 16);
+#ifdef HAVE_PCAP_TSTAMP_PRECISION
+    m->nsec = pcap_get_tstamp_precision(pcap) == PCAP_TSTAMP_PRECISION_NANO;
+#endif
+
+    dbgx(1, "--measure: receiving on %s, tag %s%d, run %08x", intf,
+            offset == MEASURE_TRAILER ? "trailer" : "at offset ",
+            offset == MEASURE_TRAILER ? 0 : offset, m->run);
+    return m;
+}
+
+/**
+ * \brief Returns a copy of the packet with the next tag in it
+ *
+ * At a fixed offset the tag overwrites what was there; as a trailer it is
+ * appended, after padding the frame to MEASURE_MIN_FRAME so the NIC adds
+ * nothing behind it.  *pktlen is updated.  Packets too short to hold the
+ * tag at its offset are returned as they were.
+ */
+u_char *
+measure_tag(measure_t *m, const u_char *pktdata, uint32_t *pktlen)
+{
+    measure_tag_t tag;
+    struct timespec now;
+    u_int64_t now_ns;
+    uint32_t len = *pktlen;
+    size_t pos;
+
+    if (m->offset == MEASURE_TRAILER) {
+        if (len > MAXPACKET) {
+            m->skipped++;
+            return (u_char *)pktdata;
+        }
+
+        memcpy(m->buf, pktdata, len);
+        if (len < MEASURE_MIN_FRAME) {
+            memset(m->buf + len, 0, MEASURE_MIN_FRAME - len);
+            len = MEASURE_MIN_FRAME;
+        }
+        pos = len;
+        len += sizeof(tag);
+    } else {
+        if ((size_t)m->offset + sizeof(tag) > len) {
+            m->skipped++;
+            return (u_char *)pktdata;
+        }
+
+        memcpy(m->buf, pktdata, len);
+        pos = m->offset;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+    tag.magic = htonl(MEASURE_MAGIC);
+    tag.run = htonl(m->run);
+    tag.seq = htonll(m->seq);
+    tag.tx_ns = htonll(now_ns);
+    memcpy(m->buf + pos, &tag, sizeof(tag));
+    m->seq++;
+
+    *pktlen = len;
+    return m->buf;
+}
+
+/*
+ * Counts a tag that came back: a duplicate if its sequence number is one
+ * of the last MEASURE_WINDOW and arrived before, reordered if a later one
+ * did
+ */
+static void
+measure_receive(measure_t *m, const struct pcap_pkthdr *pkthdr, const measure_tag_t *tag)
+{
+    u_int64_t seq = ntohll(tag->seq), tx_ns = ntohll(tag->tx_ns), rx_ns;
+    u_int64_t bit;
+
+    if (seq >= m->seq_end) {
+        /* forget what was seen MEASURE_WINDOW before the sequence numbers skipped */
+        if (seq - m->seq_end >= MEASURE_WINDOW)
+            memset(m->seen, 0, sizeof(m->seen));
+        else
+            for (bit = m->seq_end; bit < seq; bit++)
+                m->seen[(bit % MEASURE_WINDOW) / 8] &= ~(1 << (bit % 8));
+        m->seq_end = seq + 1;
+    } else {
+        if (m->seq_end - seq <= MEASURE_WINDOW &&
+                (m->seen[(seq % MEASURE_WINDOW) / 8] & (1 << (seq % 8)))) {
+            m->duplicates++;
+            return;
+        }
+        m->reordered++;
+    }
+    m->seen[(seq % MEASURE_WINDOW) / 8] |= 1 << (seq % 8);
+    m->received++;
+
+    rx_ns = (u_int64_t)pkthdr->ts.tv_sec * 1000000000 +
+            (u_int64_t)pkthdr->ts.tv_usec * (m->nsec ? 1 : 1000);
+    if (rx_ns < tx_ns)
+        m->early++;
+    else
+        timing_hist_add(&m->latency, rx_ns - tx_ns);
+}
+
+/*
+ * pcap_dispatch() callback: looks for a tag of this run where the sender
+ * put it
+ */
+static void
+measure_callback(u_char *user, const struct pcap_pkthdr *pkthdr, const u_char *pktdata)
+{
+    measure_t *m = (measure_t *)user;
+    measure_tag_t tag;
+    size_t pos;
+
+    if (m->offset == MEASURE_TRAILER) {
+        if (pkthdr->caplen < pkthdr->len || pkthdr->caplen < sizeof(tag))
+            return;
+        pos = pkthdr->caplen - sizeof(tag);
+    } else {
+        if ((size_t)m->offset + sizeof(tag) > pkthdr->caplen)
+            return;
+        pos = m->offset;
+    }
+
+    memcpy(&tag, pktdata + pos, sizeof(tag));
+    if (tag.magic != htonl(MEASURE_MAGIC) || tag.run != htonl(m->run))
+        return;
+
+    measure_receive(m, pkthdr, &tag);
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *
+measure_thread(void *arg)
+{
+    measure_t *m = (measure_t *)arg;
+
+    while (!m->stop) {
+        /* -2 is pcap_breakloop() from measure_stop() */
+        if (pcap_dispatch(m->pcap, -1, measure_callback, (u_char *)m) == -1) {
+            warnx("--measure: %s", pcap_geterr(m->pcap));
+            break;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/**
+ * Starts receiving.  Returns -1 and fills ebuf, PCAP_ERRBUF_SIZE bytes,
+ * if the receive thread can't be started.
+ */
+int
+measure_start(measure_t *m, char *ebuf)
+{
+    assert(m);
+
+    if (m->running)
+        return 0;
+
+#ifdef HAVE_LIBPTHREAD
+    int rcode;
+
+    m->stop = false;
+    if ((rcode = pthread_create(&m->thread, NULL, measure_thread, m)) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start the --measure receiver: %s",
+                strerror(rcode));
+        return -1;
+    }
+
+    m->running = true;
+    return 0;
+#else
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", "--measure requires thread support");
+    return -1;
+#endif
+}
+
+/**
+ * Gives the packets still in flight linger_ms to arrive, then stops the
+ * receive thread
+ */
+void
+measure_stop(measure_t *m, int linger_ms)
+{
+    struct timespec nap;
+
+    assert(m);
+
+    if (!m->running)
+        return;
+
+    if (linger_ms > 0) {
+        nap.tv_sec = linger_ms / 1000;
+        nap.tv_nsec = (linger_ms % 1000) * 1000000;
+        nanosleep(&nap, NULL);
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    m->stop = true;
+    pcap_breakloop(m->pcap);
+    pthread_join(m->thread, NULL);
+#endif
+    m->running = false;
+}
+
+void
+measure_close(measure_t *m)
+{
+    if (m == NULL)
+        return;
+
+    measure_stop(m, 0);
+    pcap_close(m->pcap);
+    safe_free(m);
+}
@@ -0,0 +1,88 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEASURE_H_
+#define MEASURE_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+#include "timing_hist.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#define MEASURE_MAGIC       0x5443524d  /* "TCRM" */
+#define MEASURE_TRAILER     -1          /* tag appended to the packet, not at an offset */
+#define MEASURE_MIN_FRAME   60          /* shorter frames get padded behind the trailer */
+#define MEASURE_BUF_LEN     (MAXPACKET + MEASURE_MIN_FRAME + sizeof(measure_tag_t))
+#define MEASURE_WINDOW      65536       /* recent sequence numbers checked for duplicates */
+#define MEASURE_TICK_MS     10          /* receive thread checks for the end this often */
+#define MEASURE_LINGER_MS   500         /* for packets in flight when the replay ends */
+#define MEASURE_RX_BUFFER   (32 * 1024 * 1024)
+
+/*
+ * --measure: what every packet sent carries, at a fixed offset or as a
+ * trailer after the packet.  All fields are in network byte order.
+ */
+struct measure_tag_s {
+    u_int32_t magic;
+    u_int32_t run;          /* tags left over from other runs are ignored */
+    u_int64_t seq;          /* from 0 */
+    u_int64_t tx_ns;        /* CLOCK_REALTIME as it was handed to the interface */
+} __attribute__((__packed__));
+typedef struct measure_tag_s measure_tag_t;
+
+/*
+ * Tags packets on the way out and matches them on the receiving interface
+ * in a thread of its own.  The results are only complete once
+ * measure_stop() returns.
+ */
+typedef struct measure_s {
+    int offset;                 /* of the tag in the frame, or MEASURE_TRAILER */
+    u_int32_t run;
+    u_int64_t seq;              /* sender: packets tagged */
+    COUNTER skipped;            /* sender: too short to carry a tag */
+    u_char buf[MEASURE_BUF_LEN];    /* sender: the tagged copy */
+
+    pcap_t *pcap;
+    bool nsec;                  /* pcap timestamps are in nsec */
+    volatile bool stop;
+    bool running;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t thread;
+#endif
+
+    /* receiver */
+    timing_hist_t latency;      /* nsec from sending to receiving */
+    COUNTER received;           /* unique tags */
+    COUNTER reordered;          /* arrived after a later sequence number */
+    COUNTER duplicates;
+    COUNTER early;              /* arrived before they were sent, clocks out of sync */
+    u_int64_t seq_end;          /* highest sequence number received + 1 */
+    u_int8_t seen[MEASURE_WINDOW / 8];  /* which of the last MEASURE_WINDOW arrived */
+} measure_t;
+
+measure_t *measure_open(const char *intf, int offset, char *ebuf);
+u_char *measure_tag(measure_t *m, const u_char *pktdata, uint32_t *pktlen);
+int measure_start(measure_t *m, char *ebuf);
+void measure_stop(measure_t *m, int linger_ms);
+void measure_close(measure_t *m);
+
+#endif /* MEASURE_H_ */
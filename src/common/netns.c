@@ -0,0 +1,106 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Linux network namespaces, so that interfaces of a container can be
+ * opened without running in it: a socket belongs to the namespace it was
+ * created in, wherever the thread using it moves to afterwards.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "netns.h"
+
+/**
+ * Moves the calling thread into the network namespace netns, either a
+ * name made by ip netns add or a path such as /proc/PID/ns/net.  Returns
+ * an fd of the namespace it was in for netns_leave(), or -1 and fills
+ * errbuf.
+ */
+int
+netns_enter(const char *netns, char *errbuf, size_t errlen)
+{
+#ifdef HAVE_SETNS
+    char path[PATH_MAX];
+    int fd, self;
+
+    assert(netns);
+
+    if (strchr(netns, '/') != NULL)
+        strlcpy(path, netns, sizeof(path));
+    else
+        snprintf(path, sizeof(path), "%s/%s", NETNS_RUN_DIR, netns);
+
+    if ((self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+        snprintf(errbuf, errlen, "Unable to open the current network namespace: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        snprintf(errbuf, errlen, "Unable to open network namespace %s: %s",
+                path, strerror(errno));
+        close(self);
+        return -1;
+    }
+
+    if (setns(fd, CLONE_NEWNET) < 0) {
+        snprintf(errbuf, errlen, "Unable to enter network namespace %s: %s",
+                netns, strerror(errno));
+        close(fd);
+        close(self);
+        return -1;
+    }
+
+    close(fd);
+    dbgx(1, "Entered network namespace %s", netns);
+    return self;
+#else
+    (void)netns;
+    snprintf(errbuf, errlen, "Network namespaces are not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * Moves the calling thread back to the namespace netns_enter() left
+ */
+void
+netns_leave(int self)
+{
+#ifdef HAVE_SETNS
+    if (setns(self, CLONE_NEWNET) < 0)
+        errx(-1, "Unable to return to the original network namespace: %s",
+                strerror(errno));
+    close(self);
+#else
+    (void)self;
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include "pacer.h"
+
+/**
+ * Sets up pacer for tokens earned every nsec_per_token nsec, of which
+ * up to burst can be spent at once.  The bucket starts out full.
+ */
+void
+pacer_init(pacer_t *pacer, double nsec_per_token, COUNTER burst)
+{
+    pacer->nsec_per_token = (uint64_t)(nsec_per_token * (1 << PACER_FP_SHIFT));
+    pacer->tolerance = (burst * pacer->nsec_per_token) >> PACER_FP_SHIFT;
+    pacer->tat = 0;
+
+    dbgx(1, "pacer: %.3f nsec per token, burst " COUNTER_SPEC " tokens = %" PRIu64 " nsec",
+            nsec_per_token, burst, pacer->tolerance);
+}
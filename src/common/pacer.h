@@ -0,0 +1,71 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACER_H_
+#define PACER_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+/*
+ * A token bucket, implemented as a virtual scheduler (GCRA): instead of
+ * a token count we track the time at which the bucket would be empty,
+ * tat.  Something may go once tat is at most tolerance (the burst size
+ * worth of tokens) in the future, and going pushes tat out by its cost.
+ * Idle time refills the bucket but never beyond the burst size, so
+ * falling behind never produces more than one burst.  All the math past
+ * pacer_init() is multiplies and shifts.
+ */
+#define PACER_FP_SHIFT  16      /* nsec_per_token is 48.16 fixed point */
+
+typedef struct pacer_s {
+    uint64_t nsec_per_token;    /* fixed point, PACER_FP_SHIFT */
+    uint64_t tolerance;         /* burst size in nsec */
+    uint64_t tat;               /* CLOCK_MONOTONIC nsec the bucket is empty at */
+} pacer_t;
+
+void pacer_init(pacer_t *pacer, double nsec_per_token, COUNTER burst);
+
+/* how long it takes to earn cost tokens in nsec */
+static inline uint64_t
+pacer_cost(const pacer_t *pacer, uint64_t cost)
+{
+    return (cost * pacer->nsec_per_token) >> PACER_FP_SHIFT;
+}
+
+/* nsec to wait at now_ns before the bucket has tokens, 0 if it has some */
+static inline uint64_t
+pacer_wait(pacer_t *pacer, uint64_t now_ns)
+{
+    if (pacer->tat < now_ns)
+        pacer->tat = now_ns;    /* bucket is full, anything more is lost */
+    else if (pacer->tat > now_ns + pacer->tolerance)
+        return pacer->tat - pacer->tolerance - now_ns;
+
+    return 0;
+}
+
+/* takes cost tokens, after pacer_wait() */
+static inline void
+pacer_take(pacer_t *pacer, uint64_t cost)
+{
+    pacer->tat += pacer_cost(pacer, cost);
+}
+
+#endif /* PACER_H_ */
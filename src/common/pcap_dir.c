@@ -0,0 +1,581 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A directory or a glob of capture files, such as tcpdump -G or -C
+ * rotates through, read as one pcap stream.  Like a compressed file, see
+ * compress_open_read(), the files are read on a thread of their own and
+ * fed to the reader through a socket pair: the packets of each file, in
+ * natural order, behind the header of the first.  The next file is opened
+ * and read ahead while the current one is sent, and the replay sees one
+ * capture with one timeline.  With follow the thread keeps reading the
+ * newest file as it grows and moves on to the files added after it.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+#include "lib/strlcpy.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "pcap_dir.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define PCAP_DIR_BUFSIZE    COMPRESS_BUFSIZE
+#define PCAP_DIR_READAHEAD  (16 * 1024 * 1024)  /* of the next file, while the current is sent */
+
+typedef struct pcap_dir_s {
+    char *path;                 /* the directory or glob */
+    bool is_dir;
+    bool follow;
+    int cur_fd;                 /* file being sent, -1 before the first */
+    char *cur;
+    int out_fd;                 /* our end of the socket pair */
+    int notify_fd;              /* inotify on the directory, -1 if none */
+    char **files;               /* of the last scan, in natural order */
+    int file_cnt;
+    char *last;                 /* newest file opened, NULL before the first */
+    u_char hdr[PCAP_DIR_HDR_LEN];   /* of the first file, the rest must match it */
+    bool have_hdr;
+    u_char *buf;
+} pcap_dir_t;
+
+/**
+ * Is path a directory, or a glob, rather than a file?
+ */
+bool
+pcap_dir_is_source(const char *path)
+{
+    struct stat st;
+
+    assert(path);
+
+    if (stat(path, &st) == 0)
+        return S_ISDIR(st.st_mode);
+
+    return strpbrk(path, "*?[") != NULL;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Orders file names with the numbers in them compared by value, so the
+ * file1, file2 ... file10 of tcpdump -C come in the order written
+ */
+static int
+pcap_dir_cmp(const char *a, const char *b)
+{
+    const char *sa = a, *sb = b;
+    size_t la, lb;
+    int c;
+
+    while (*a != '\0' && *b != '\0') {
+        if (isdigit((u_char)*a) && isdigit((u_char)*b)) {
+            while (*a == '0')
+                a++;
+            while (*b == '0')
+                b++;
+            for (la = 0; isdigit((u_char)a[la]); la++)
+                ;
+            for (lb = 0; isdigit((u_char)b[lb]); lb++)
+                ;
+            if (la != lb)
+                return la < lb ? -1 : 1;
+            if ((c = strncmp(a, b, la)) != 0)
+                return c;
+            a += la;
+            b += lb;
+            continue;
+        }
+
+        if (*a != *b)
+            return (u_char)*a - (u_char)*b;
+        a++;
+        b++;
+    }
+
+    if (*a != *b)
+        return (u_char)*a - (u_char)*b;
+
+    /* only the leading zeros differ */
+    return strcmp(sa, sb);
+}
+
+static int
+pcap_dir_qsort_cmp(const void *a, const void *b)
+{
+    return pcap_dir_cmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void
+pcap_dir_free_files(pcap_dir_t *pd)
+{
+    int i;
+
+    for (i = 0; i < pd->file_cnt; i++)
+        safe_free(pd->files[i]);
+    safe_free(pd->files);
+    pd->files = NULL;
+    pd->file_cnt = 0;
+}
+
+static void
+pcap_dir_add_file(pcap_dir_t *pd, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+
+    pd->files = safe_realloc(pd->files, sizeof(char *) * (pd->file_cnt + 1));
+    pd->files[pd->file_cnt++] = safe_strdup(path);
+}
+
+/*
+ * Lists the regular files of the directory, other than dot files, or that
+ * the glob matches.  Returns how many, or -1 and errno.
+ */
+static int
+pcap_dir_scan(pcap_dir_t *pd)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    glob_t g;
+    DIR *dir;
+    size_t i;
+    int rcode;
+
+    pcap_dir_free_files(pd);
+
+    if (pd->is_dir) {
+        if ((dir = opendir(pd->path)) == NULL)
+            return -1;
+
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", pd->path, de->d_name);
+            pcap_dir_add_file(pd, path);
+        }
+        closedir(dir);
+    } else {
+        if ((rcode = glob(pd->path, 0, NULL, &g)) == 0) {
+            for (i = 0; i < g.gl_pathc; i++)
+                pcap_dir_add_file(pd, g.gl_pathv[i]);
+            globfree(&g);
+        } else if (rcode != GLOB_NOMATCH) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    if (pd->file_cnt > 1)
+        qsort(pd->files, pd->file_cnt, sizeof(char *), pcap_dir_qsort_cmp);
+
+    return pd->file_cnt;
+}
+
+/* reads len bytes unless the file ends first */
+static ssize_t
+pcap_dir_read(int fd, u_char *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = read(fd, buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+/* pcap, not pcapng: only those can be joined by dropping the file headers */
+static bool
+pcap_dir_magic_ok(const u_char *hdr)
+{
+    uint32_t magic;
+
+    memcpy(&magic, hdr, sizeof(magic));
+    switch (magic) {
+    case 0xa1b2c3d4:    /* usec */
+    case 0xd4c3b2a1:
+    case 0xa1b23c4d:    /* nsec */
+    case 0x4d3cb2a1:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Opens the first file after the last one opened and reads its header,
+ * which must match the first file's.  Files which can't be joined are
+ * skipped.  Returns the file descriptor, at the first packet, or -1 if
+ * there is no such file (yet).
+ */
+static int
+pcap_dir_open_next(pcap_dir_t *pd)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    u_char hdr[PCAP_DIR_HDR_LEN];
+    struct stat st;
+    int i, fd;
+
+    for (i = 0; i < pd->file_cnt; i++) {
+        if (pd->last != NULL && pcap_dir_cmp(pd->files[i], pd->last) <= 0)
+            continue;
+
+        /* --follow: a file just created may not have its header yet */
+        if (pd->follow && stat(pd->files[i], &st) == 0 && st.st_size < PCAP_DIR_HDR_LEN)
+            return -1;
+
+        safe_free(pd->last);
+        pd->last = safe_strdup(pd->files[i]);
+
+        if ((fd = compress_open_read(pd->last, ebuf)) < 0) {
+            warnx("Skipping %s", ebuf);
+            continue;
+        }
+
+        if (pcap_dir_read(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+            warnx("Skipping %s: too short for a pcap file", pd->last);
+            close(fd);
+            continue;
+        }
+
+        if (!pcap_dir_magic_ok(hdr)) {
+            warnx("Skipping %s: not a pcap file, pcapng files can't be joined", pd->last);
+            close(fd);
+            continue;
+        }
+
+        if (!pd->have_hdr) {
+            memcpy(pd->hdr, hdr, sizeof(hdr));
+            pd->have_hdr = true;
+        } else if (memcmp(hdr, pd->hdr, 4) != 0 || memcmp(hdr + 20, pd->hdr + 20, 4) != 0) {
+            /* the magic says byte order and precision, the last word the DLT */
+            warnx("Skipping %s: byte order, timestamp precision or DLT differs from the first file",
+                    pd->last);
+            close(fd);
+            continue;
+        }
+
+#ifdef POSIX_FADV_WILLNEED
+        /* a no-op on the socket of a compressed file */
+        posix_fadvise(fd, 0, PCAP_DIR_READAHEAD, POSIX_FADV_WILLNEED);
+#endif
+        dbgx(1, "%s: opened %s", pd->path, pd->last);
+        return fd;
+    }
+
+    return -1;
+}
+
+static int
+pcap_dir_send(pcap_dir_t *pd, const u_char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(pd->out_fd, data, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE && errno != ECONNRESET)
+                warnx("Unable to pass on %s: %s", pd->cur, strerror(errno));
+            return -1;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * --follow: waits until the directory changes or PCAP_DIR_POLL_MS pass,
+ * then lists it again.  Returns -1 once the reader has closed its end.
+ */
+static int
+pcap_dir_wait(pcap_dir_t *pd)
+{
+    struct pollfd pfd[2];
+    char events[4096];
+    int cnt = 1;
+
+    /* POLLHUP needs no asking for */
+    pfd[0].fd = pd->out_fd;
+    pfd[0].events = 0;
+    pfd[0].revents = 0;
+    if (pd->notify_fd >= 0) {
+        pfd[1].fd = pd->notify_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        cnt = 2;
+    }
+
+    if (poll(pfd, cnt, PCAP_DIR_POLL_MS) < 0 && errno != EINTR)
+        return -1;
+
+    if (pfd[0].revents & (POLLHUP | POLLERR))
+        return -1;
+
+    if (cnt == 2 && (pfd[1].revents & POLLIN)) {
+        while (read(pd->notify_fd, events, sizeof(events)) > 0)
+            ;
+    }
+
+    if (pcap_dir_scan(pd) < 0)
+        warnx("Unable to list %s: %s", pd->path, strerror(errno));
+
+    return 0;
+}
+
+static void
+pcap_dir_free(pcap_dir_t *pd)
+{
+    if (pd->cur_fd >= 0)
+        close(pd->cur_fd);
+    if (pd->notify_fd >= 0)
+        close(pd->notify_fd);
+    if (pd->out_fd >= 0)
+        close(pd->out_fd);
+
+    pcap_dir_free_files(pd);
+    safe_free(pd->cur);
+    safe_free(pd->last);
+    safe_free(pd->path);
+    safe_free(pd->buf);
+    safe_free(pd);
+}
+
+/**
+ * \brief Main loop of a directory thread
+ *
+ * Sends the header of the first file, then the packets of each file in
+ * turn, opening the next before the current one ends.  Closing our end of
+ * the socket pair is the reader's EOF.
+ */
+static void *
+pcap_dir_thread(void *arg)
+{
+    pcap_dir_t *pd = (pcap_dir_t *)arg;
+    int next_fd = -1;
+    ssize_t n;
+
+    /* --follow may have started before the first file */
+    while (pd->cur_fd < 0) {
+        if (pcap_dir_wait(pd) < 0)
+            goto done;
+        if ((pd->cur_fd = pcap_dir_open_next(pd)) >= 0)
+            pd->cur = safe_strdup(pd->last);
+    }
+
+    if (pcap_dir_send(pd, pd->hdr, sizeof(pd->hdr)) < 0)
+        goto done;
+
+    for (;;) {
+        if (next_fd < 0)
+            next_fd = pcap_dir_open_next(pd);
+
+        if ((n = read(pd->cur_fd, pd->buf, PCAP_DIR_BUFSIZE)) > 0) {
+            if (pcap_dir_send(pd, pd->buf, n) < 0)
+                goto done;
+            continue;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            warnx("Unable to read %s: %s", pd->cur, strerror(errno));
+            if (next_fd < 0)
+                break;
+        }
+
+        /* the end of this file: on to the next */
+        if (next_fd >= 0) {
+            close(pd->cur_fd);
+            pd->cur_fd = next_fd;
+            next_fd = -1;
+            safe_free(pd->cur);
+            pd->cur = safe_strdup(pd->last);
+            dbgx(1, "%s: reading %s", pd->path, pd->cur);
+            continue;
+        }
+
+        if (!pd->follow)
+            break;
+
+        /*
+         * --follow: wait for this file to grow or a newer one to appear.
+         * tcpdump finishes a file before starting the next, so once there
+         * is a newer one, the next read of this one gets the rest of it.
+         */
+        if (pcap_dir_wait(pd) < 0)
+            break;
+    }
+
+done:
+    if (next_fd >= 0)
+        close(next_fd);
+    pcap_dir_free(pd);
+    return NULL;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/**
+ * \brief Opens a directory or glob of pcap files as one pcap stream
+ *
+ * Returns a file descriptor to read the stream from, see the top of this
+ * file, or -1 and fills the PCAP_ERRBUF_SIZE ebuf.  Without follow there
+ * has to be at least one pcap file to read, and the files are those there
+ * are now; with follow, the stream only ends when the descriptor is closed.
+ */
+int
+pcap_dir_open_read(const char *path, bool follow, char *ebuf)
+{
+#ifdef HAVE_LIBPTHREAD
+    pcap_dir_t *pd;
+    pthread_attr_t attr;
+    struct stat st;
+    int sv[2], bufsize = PCAP_DIR_BUFSIZE, rcode;
+
+    assert(path);
+    assert(ebuf);
+
+    pd = safe_malloc(sizeof(pcap_dir_t));
+    pd->path = safe_strdup(path);
+    pd->is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    pd->follow = follow;
+    pd->cur_fd = -1;
+    pd->out_fd = -1;
+    pd->notify_fd = -1;
+
+    if (pcap_dir_scan(pd) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to list %s: %s", path, strerror(errno));
+        pcap_dir_free(pd);
+        return -1;
+    }
+
+    /* the first file is checked here, so a bad one fails the replay */
+    if ((pd->cur_fd = pcap_dir_open_next(pd)) >= 0) {
+        pd->cur = safe_strdup(pd->last);
+    } else if (!follow) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "No pcap files to replay in %s", path);
+        pcap_dir_free(pd);
+        return -1;
+    }
+
+#ifdef HAVE_SYS_INOTIFY_H
+    /* wake up as files are written rather than every PCAP_DIR_POLL_MS */
+    if (follow) {
+        char dir[PATH_MAX];
+        const char *slash;
+
+        if (pd->is_dir) {
+            strlcpy(dir, path, sizeof(dir));
+        } else if ((slash = strrchr(path, '/')) == NULL) {
+            strlcpy(dir, ".", sizeof(dir));
+        } else {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+        }
+
+        if (strpbrk(dir, "*?[") == NULL &&
+                (pd->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+                inotify_add_watch(pd->notify_fd, dir,
+                        IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            dbgx(1, "Unable to watch %s: %s", dir, strerror(errno));
+            close(pd->notify_fd);
+            pd->notify_fd = -1;
+        }
+    }
+#endif
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create socket pair for %s: %s",
+                path, strerror(errno));
+        pcap_dir_free(pd);
+        return -1;
+    }
+
+    /* fewer, larger handoffs between the threads */
+    setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt(sv[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
+    pd->out_fd = sv[1];
+    pd->buf = safe_malloc(PCAP_DIR_BUFSIZE);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rcode = pthread_create(&(pthread_t){0}, &attr, pcap_dir_thread, pd);
+    pthread_attr_destroy(&attr);
+
+    if (rcode != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start reading %s: %s",
+                path, strerror(rcode));
+        close(sv[0]);
+        pcap_dir_free(pd);
+        return -1;
+    }
+
+    return sv[0];
+#else
+    (void)follow;
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Replaying %s requires pthread support", path);
+    return -1;
+#endif
+}
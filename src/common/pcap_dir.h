@@ -0,0 +1,31 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAP_DIR_H_
+#define PCAP_DIR_H_
+
+#include "defines.h"
+#include "common.h"
+
+#define PCAP_DIR_HDR_LEN    24      /* pcap file header */
+#define PCAP_DIR_POLL_MS    1000    /* --follow looks for new files at least this often */
+
+bool pcap_dir_is_source(const char *path);
+int pcap_dir_open_read(const char *path, bool follow, char *ebuf);
+
+#endif /* PCAP_DIR_H_ */
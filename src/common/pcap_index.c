@@ -0,0 +1,361 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sidecar offset index for pcap files.
+ *
+ * Finding packet N, or the first packet after some point in time, in a
+ * pcap normally means reading every packet before it.  The index records
+ * the file offset and timestamp of every interval'th packet, so a reader
+ * can seek to the closest entry at or before what it wants and only read
+ * the remaining (at most interval - 1) packets.  Only classic pcap files
+ * can be indexed: pcapng interface blocks may appear anywhere in the
+ * file and would be skipped by a seek.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCAPNG_SHB  0x0a0d0d0a
+
+/**
+ * Returns the malloc'd name of the index of pcapfile
+ */
+char *
+pcap_index_path(const char *pcapfile)
+{
+    char *path;
+    size_t len;
+
+    assert(pcapfile);
+
+    len = strlen(pcapfile) + strlen(PCAP_INDEX_SUFFIX) + 1;
+    path = safe_malloc(len);
+    snprintf(path, len, "%s%s", pcapfile, PCAP_INDEX_SUFFIX);
+    return path;
+}
+
+/**
+ * Adds an entry to an index being built
+ */
+static void
+pcap_index_add(pcap_index_t *idx, COUNTER *alloc, COUNTER packet, COUNTER offset,
+        COUNTER ts_usec)
+{
+    pcap_index_entry_t *entry;
+
+    if (idx->entry_cnt == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 1024;
+        idx->entries = safe_realloc(idx->entries, sizeof(pcap_index_entry_t) * *alloc);
+    }
+
+    entry = &idx->entries[idx->entry_cnt++];
+    entry->packet = packet;
+    entry->offset = offset;
+    entry->ts_usec = ts_usec;
+}
+
+/**
+ * Writes idx to indexfile.  Returns 0 or -1 and fills ebuf.
+ */
+static int
+pcap_index_save(const pcap_index_t *idx, const char *indexfile, COUNTER pcap_size,
+        char *ebuf)
+{
+    pcap_index_file_hdr_t hdr;
+    pcap_index_entry_t entry;
+    COUNTER i;
+    FILE *fp;
+
+    if ((fp = fopen(indexfile, "wb")) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create %s: %s", indexfile, strerror(errno));
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, PCAP_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = htonl(PCAP_INDEX_VERSION);
+    hdr.interval = htonl(idx->interval);
+    hdr.flags = htonl(idx->ts_sorted ? PCAP_INDEX_TS_SORTED : 0);
+    hdr.packets = htonll((u_int64_t)idx->packets);
+    hdr.entries = htonll((u_int64_t)idx->entry_cnt);
+    hdr.pcap_size = htonll((u_int64_t)pcap_size);
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto fail;
+
+    for (i = 0; i < idx->entry_cnt; i++) {
+        entry.packet = htonll(idx->entries[i].packet);
+        entry.offset = htonll(idx->entries[i].offset);
+        entry.ts_usec = htonll(idx->entries[i].ts_usec);
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+            goto fail;
+    }
+
+    if (fclose(fp) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", indexfile, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", indexfile, strerror(errno));
+    fclose(fp);
+    return -1;
+}
+
+/**
+ * Reads all of pcapfile and writes an index with an entry every interval
+ * packets to indexfile.  Returns the index, or NULL and fills the
+ * PCAP_ERRBUF_SIZE ebuf.
+ */
+pcap_index_t *
+pcap_index_build(const char *pcapfile, const char *indexfile, u_int32_t interval,
+        char *ebuf)
+{
+    pcap_index_t *idx;
+    pcap_t *pcap;
+    FILE *fp;
+    struct stat statinfo;
+    struct pcap_pkthdr *pkthdr;
+    const u_char *pktdata;
+    COUNTER alloc = 0, ts_usec, last_usec = 0;
+    off_t offset;
+    u_int32_t magic;
+    int rcode;
+
+    assert(pcapfile);
+    assert(indexfile);
+    assert(ebuf);
+
+    if (interval == 0)
+        interval = PCAP_INDEX_INTERVAL;
+
+    if (strcmp(pcapfile, "-") == 0 || stat(pcapfile, &statinfo) < 0 ||
+            !S_ISREG(statinfo.st_mode)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: only regular files can be indexed", pcapfile);
+        return NULL;
+    }
+
+    if (compress_from_path(pcapfile) != TCPR_COMPRESS_NONE) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: compressed files can't be indexed", pcapfile);
+        return NULL;
+    }
+
+    if ((pcap = pcap_open_offline(pcapfile, ebuf)) == NULL)
+        return NULL;
+
+    fp = pcap_file(pcap);
+    offset = fp != NULL ? ftello(fp) : -1;
+    if (offset < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: unable to find packet offsets", pcapfile);
+        pcap_close(pcap);
+        return NULL;
+    }
+
+    /* libpcap has read ahead of the magic by now, so look at the file itself */
+    if (pread(fileno(fp), &magic, sizeof(magic), 0) == sizeof(magic) && magic == PCAPNG_SHB) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: pcapng files can't be indexed", pcapfile);
+        pcap_close(pcap);
+        return NULL;
+    }
+
+    idx = safe_malloc(sizeof(pcap_index_t));
+    idx->interval = interval;
+    idx->ts_sorted = true;
+
+    while ((rcode = pcap_next_ex(pcap, &pkthdr, &pktdata)) == 1) {
+        ts_usec = TIMEVAL_TO_MICROSEC(&pkthdr->ts);
+        if (ts_usec < last_usec)
+            idx->ts_sorted = false;
+        last_usec = ts_usec;
+
+        if (idx->packets++ % interval == 0)
+            pcap_index_add(idx, &alloc, idx->packets, (COUNTER)offset, ts_usec);
+
+        offset = ftello(fp);
+    }
+
+    if (rcode == -1)
+        warnx("%s: stopped indexing after " COUNTER_SPEC " packets: %s",
+                pcapfile, idx->packets, pcap_geterr(pcap));
+
+    pcap_close(pcap);
+
+    if (pcap_index_save(idx, indexfile, (COUNTER)statinfo.st_size, ebuf) < 0) {
+        pcap_index_free(idx);
+        return NULL;
+    }
+
+    dbgx(1, "Indexed " COUNTER_SPEC " packets of %s with " COUNTER_SPEC " entries",
+            idx->packets, pcapfile, idx->entry_cnt);
+
+    return idx;
+}
+
+/**
+ * Loads the index of pcapfile.  Returns NULL if there is none, in which
+ * case ebuf is empty, or if it is unusable, in which case ebuf says why.
+ */
+pcap_index_t *
+pcap_index_load(const char *pcapfile, char *ebuf)
+{
+    pcap_index_file_hdr_t hdr;
+    pcap_index_t *idx;
+    struct stat statinfo;
+    char *indexfile;
+    COUNTER i;
+    FILE *fp;
+
+    assert(pcapfile);
+    assert(ebuf);
+
+    ebuf[0] = '\0';
+
+    if (strcmp(pcapfile, "-") == 0 || compress_from_path(pcapfile) != TCPR_COMPRESS_NONE)
+        return NULL;
+
+    indexfile = pcap_index_path(pcapfile);
+    fp = fopen(indexfile, "rb");
+    safe_free(indexfile);
+    if (fp == NULL)
+        return NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, PCAP_INDEX_MAGIC, sizeof(PCAP_INDEX_MAGIC)) != 0 ||
+            ntohl(hdr.version) != PCAP_INDEX_VERSION) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s%s is not a supported index", 
+                pcapfile, PCAP_INDEX_SUFFIX);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (stat(pcapfile, &statinfo) < 0 || 
+            (u_int64_t)statinfo.st_size != ntohll(hdr.pcap_size)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s%s is out of date, rebuild it with tcpcapinfo --index",
+                pcapfile, PCAP_INDEX_SUFFIX);
+        fclose(fp);
+        return NULL;
+    }
+
+    idx = safe_malloc(sizeof(pcap_index_t));
+    idx->interval = ntohl(hdr.interval);
+    idx->ts_sorted = (ntohl(hdr.flags) & PCAP_INDEX_TS_SORTED) != 0;
+    idx->packets = ntohll(hdr.packets);
+    idx->entry_cnt = ntohll(hdr.entries);
+    idx->entries = safe_malloc(sizeof(pcap_index_entry_t) * max(idx->entry_cnt, 1));
+
+    if (fread(idx->entries, sizeof(pcap_index_entry_t), idx->entry_cnt, fp) != idx->entry_cnt) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s%s is truncated", pcapfile, PCAP_INDEX_SUFFIX);
+        fclose(fp);
+        pcap_index_free(idx);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    for (i = 0; i < idx->entry_cnt; i++) {
+        idx->entries[i].packet = ntohll(idx->entries[i].packet);
+        idx->entries[i].offset = ntohll(idx->entries[i].offset);
+        idx->entries[i].ts_usec = ntohll(idx->entries[i].ts_usec);
+    }
+
+    dbgx(1, "Loaded " COUNTER_SPEC " index entries for %s", idx->entry_cnt, pcapfile);
+    return idx;
+}
+
+/**
+ * Returns the last entry at or before packet (0 for any packet) which is
+ * also older than the absolute timestamp ts_usec (0 for any time), or
+ * NULL if reading has to start at the beginning of the file.
+ */
+const pcap_index_entry_t *
+pcap_index_find(const pcap_index_t *idx, COUNTER packet, COUNTER ts_usec)
+{
+    COUNTER lo, hi, mid;
+
+    assert(idx);
+
+    if (idx->entry_cnt == 0)
+        return NULL;
+
+    /* packet positions are evenly spaced, timestamps are not */
+    hi = idx->entry_cnt;
+    if (packet > 0)
+        hi = min((packet - 1) / idx->interval + 1, hi);
+
+    if (ts_usec > 0) {
+        /* out of order, any packet could be the first one at ts_usec */
+        if (!idx->ts_sorted)
+            return NULL;
+
+        /* find the first entry at or after ts_usec */
+        lo = 0;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (idx->entries[mid].ts_usec < ts_usec)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+
+    return hi > 0 ? &idx->entries[hi - 1] : NULL;
+}
+
+/**
+ * Moves the libpcap reader of a classic pcap file to an index entry.
+ * Returns 0, or -1 if the handle can't seek (eg: a pipe).
+ */
+int
+pcap_index_seek(pcap_t *pcap, const pcap_index_entry_t *entry)
+{
+    FILE *fp;
+
+    assert(pcap);
+    assert(entry);
+
+    if ((fp = pcap_file(pcap)) == NULL)
+        return -1;
+
+    return fseeko(fp, (off_t)entry->offset, SEEK_SET);
+}
+
+/**
+ * Frees an index
+ */
+void
+pcap_index_free(pcap_index_t *idx)
+{
+    if (idx == NULL)
+        return;
+
+    safe_free(idx->entries);
+    safe_free(idx);
+}
@@ -0,0 +1,72 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAP_INDEX_H_
+#define PCAP_INDEX_H_
+
+#include "defines.h"
+#include "common.h"
+
+#define PCAP_INDEX_MAGIC    "tcpridx"   /* includes the \0 */
+#define PCAP_INDEX_VERSION  1
+#define PCAP_INDEX_SUFFIX   ".tcpridx"
+#define PCAP_INDEX_INTERVAL 1024        /* default packets between entries */
+
+#define PCAP_INDEX_TS_SORTED 0x1        /* no timestamp goes backwards */
+
+/*
+ * Sidecar index of a pcap file, stored next to it as <pcap>.tcpridx.
+ * Every interval'th packet, starting with the first, gets an entry.
+ * All fields are in network byte order.
+ */
+struct pcap_index_file_hdr_s {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t interval;
+    u_int32_t flags;
+    u_int32_t reserved;
+    u_int64_t packets;      /* in the whole pcap */
+    u_int64_t entries;
+    u_int64_t pcap_size;    /* to spot an index of an older copy of the file */
+} __attribute__((__packed__));
+typedef struct pcap_index_file_hdr_s pcap_index_file_hdr_t;
+
+typedef struct pcap_index_entry_s {
+    u_int64_t packet;       /* 1 based packet number */
+    u_int64_t offset;       /* of the packet record in the pcap */
+    u_int64_t ts_usec;      /* packet timestamp */
+} __attribute__((__packed__)) pcap_index_entry_t;
+
+/* an index loaded into memory, fields in host byte order */
+typedef struct pcap_index_s {
+    u_int32_t interval;
+    bool ts_sorted;
+    COUNTER packets;
+    COUNTER entry_cnt;
+    pcap_index_entry_t *entries;
+} pcap_index_t;
+
+char *pcap_index_path(const char *pcapfile);
+pcap_index_t *pcap_index_build(const char *pcapfile, const char *indexfile,
+        u_int32_t interval, char *ebuf);
+pcap_index_t *pcap_index_load(const char *pcapfile, char *ebuf);
+const pcap_index_entry_t *pcap_index_find(const pcap_index_t *idx, COUNTER packet, COUNTER ts_usec);
+int pcap_index_seek(pcap_t *pcap, const pcap_index_entry_t *entry);
+void pcap_index_free(pcap_index_t *idx);
+
+#endif /* PCAP_INDEX_H_ */
@@ -0,0 +1,542 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Columnar packet metadata sidecar for pcap files.
+ *
+ * Timestamps, lengths, header offsets, the 5-tuple and the direction of
+ * every packet are worked out once by tcpcapinfo --meta and stored next
+ * to the pcap.  Anything which only needs those can then read them back
+ * a group at a time with sequential reads, one column per array, rather
+ * than reading and parsing the whole pcap again.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCAP_META_COLS 14
+
+/* bytes of a value of each column, in the order of pcap_meta_group_t */
+static const size_t col_width[PCAP_META_COLS] = {
+    8, 4, 4, 16, 16, 2, 2, 2, 2, 2, 2, 1, 1, 1
+};
+
+/* a conversation, with the lower of its two endpoints first */
+typedef struct meta_conv_key_s {
+    u_int8_t lo_ip[16];
+    u_int8_t hi_ip[16];
+    u_int16_t lo_port;
+    u_int16_t hi_port;
+    u_int16_t vlan;
+    u_int8_t proto;
+    u_int8_t ip_ver;
+} meta_conv_key_t;
+
+typedef struct meta_conv_s {
+    meta_conv_key_t key;
+    bool used;
+    bool lo_first;          /* the first packet came from the lower endpoint */
+} meta_conv_t;
+
+/* open addressing table of the conversations seen while building */
+typedef struct meta_convs_s {
+    meta_conv_t *slots;
+    size_t capacity;        /* power of two */
+    size_t count;
+} meta_convs_t;
+
+/**
+ * Returns the malloc'd name of the metadata sidecar of pcapfile
+ */
+char *
+pcap_meta_path(const char *pcapfile)
+{
+    char *path;
+    size_t len;
+
+    assert(pcapfile);
+
+    len = strlen(pcapfile) + strlen(PCAP_META_SUFFIX) + 1;
+    path = safe_malloc(len);
+    snprintf(path, len, "%s%s", pcapfile, PCAP_META_SUFFIX);
+    return path;
+}
+
+/**
+ * Points the columns of g at buf, laid out for rows packets, and fills in
+ * cols with where each one starts
+ */
+static void
+group_layout(pcap_meta_group_t *g, u_char *buf, u_int32_t rows, u_char **cols)
+{
+    size_t off = 0;
+    int i;
+
+    /* widest first, so every column is aligned for its type */
+    for (i = 0; i < PCAP_META_COLS; i++) {
+        cols[i] = buf + off;
+        off += col_width[i] * rows;
+    }
+
+    g->ts_usec = (u_int64_t *)cols[0];
+    g->caplen = (u_int32_t *)cols[1];
+    g->len = (u_int32_t *)cols[2];
+    g->src_ip = (u_int8_t (*)[16])cols[3];
+    g->dst_ip = (u_int8_t (*)[16])cols[4];
+    g->l3off = (u_int16_t *)cols[5];
+    g->l4off = (u_int16_t *)cols[6];
+    g->ether_type = (u_int16_t *)cols[7];
+    g->vlan = (u_int16_t *)cols[8];
+    g->src_port = (u_int16_t *)cols[9];
+    g->dst_port = (u_int16_t *)cols[10];
+    g->ip_ver = cols[11];
+    g->proto = cols[12];
+    g->flags = cols[13];
+}
+
+static u_int64_t
+conv_hash(const meta_conv_key_t *key)
+{
+    const u_char *p = (const u_char *)key;
+    u_int64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/**
+ * Returns the slot of key, or the empty one it goes into
+ */
+static meta_conv_t *
+conv_find(meta_conv_t *slots, size_t capacity, const meta_conv_key_t *key)
+{
+    size_t i = conv_hash(key) & (capacity - 1);
+
+    while (slots[i].used && memcmp(&slots[i].key, key, sizeof(*key)) != 0)
+        i = (i + 1) & (capacity - 1);
+
+    return &slots[i];
+}
+
+static void
+conv_grow(meta_convs_t *convs)
+{
+    meta_conv_t *slots;
+    size_t capacity, i;
+
+    capacity = convs->capacity ? convs->capacity * 2 : 4096;
+    slots = safe_malloc(sizeof(meta_conv_t) * capacity);
+    for (i = 0; i < convs->capacity; i++) {
+        if (convs->slots[i].used)
+            memcpy(conv_find(slots, capacity, &convs->slots[i].key), &convs->slots[i],
+                    sizeof(meta_conv_t));
+    }
+
+    safe_free(convs->slots);
+    convs->slots = slots;
+    convs->capacity = capacity;
+}
+
+/**
+ * Returns the PCAP_META_NEW_CONV and PCAP_META_REPLY flags of a packet
+ */
+static u_int8_t
+conv_flags(meta_convs_t *convs, const u_int8_t *src_ip, const u_int8_t *dst_ip,
+        u_int16_t src_port, u_int16_t dst_port, u_int16_t vlan, u_int8_t proto,
+        u_int8_t ip_ver)
+{
+    meta_conv_key_t key;
+    meta_conv_t *conv;
+    bool src_lo;
+    int cmp;
+
+    cmp = memcmp(src_ip, dst_ip, 16);
+    src_lo = cmp < 0 || (cmp == 0 && ntohs(src_port) <= ntohs(dst_port));
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.lo_ip, src_lo ? src_ip : dst_ip, 16);
+    memcpy(key.hi_ip, src_lo ? dst_ip : src_ip, 16);
+    key.lo_port = src_lo ? src_port : dst_port;
+    key.hi_port = src_lo ? dst_port : src_port;
+    key.vlan = vlan;
+    key.proto = proto;
+    key.ip_ver = ip_ver;
+
+    /* keep the load under half */
+    if ((convs->count + 1) * 2 > convs->capacity)
+        conv_grow(convs);
+
+    conv = conv_find(convs->slots, convs->capacity, &key);
+    if (conv->used)
+        return conv->lo_first == src_lo ? 0 : PCAP_META_REPLY;
+
+    memcpy(&conv->key, &key, sizeof(key));
+    conv->used = true;
+    conv->lo_first = src_lo;
+    ++convs->count;
+
+    return PCAP_META_NEW_CONV;
+}
+
+/**
+ * Fills in row i of g, in network byte order, from a packet
+ */
+static void
+meta_row(pcap_meta_group_t *g, u_int32_t i, meta_convs_t *convs,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, const pkt_meta_t *meta)
+{
+    const ipv4_hdr_t *ip_hdr;
+    const ipv6_hdr_t *ip6_hdr;
+    const tcp_hdr_t *tcp_hdr;
+    const udp_hdr_t *udp_hdr;
+    const icmpv4_hdr_t *icmp_hdr;
+    u_int16_t src_port = 0, dst_port = 0;
+
+    g->ts_usec[i] = htonll((u_int64_t)TIMEVAL_TO_MICROSEC(&pkthdr->ts));
+    g->caplen[i] = htonl(pkthdr->caplen);
+    g->len[i] = htonl(pkthdr->len);
+    g->l3off[i] = htons(meta->l2len);
+    g->l4off[i] = htons(meta->l4off);
+    g->ether_type[i] = htons(meta->ether_type);
+    g->vlan[i] = meta->vlan;
+    g->ip_ver[i] = meta->ip_ver;
+    g->proto[i] = meta->ip_ver ? meta->proto : 0;
+    g->flags[i] = pkthdr->caplen < pkthdr->len ? PCAP_META_TRUNCATED : 0;
+    memset(g->src_ip[i], 0, 16);
+    memset(g->dst_ip[i], 0, 16);
+
+    if (meta->ip_ver == 4) {
+        ip_hdr = (const ipv4_hdr_t *)(pktdata + meta->l2len);
+        memcpy(g->src_ip[i], &ip_hdr->ip_src, 4);
+        memcpy(g->dst_ip[i], &ip_hdr->ip_dst, 4);
+    } else if (meta->ip_ver == 6) {
+        ip6_hdr = (const ipv6_hdr_t *)(pktdata + meta->l2len);
+        memcpy(g->src_ip[i], &ip6_hdr->ip_src, 16);
+        memcpy(g->dst_ip[i], &ip6_hdr->ip_dst, 16);
+    }
+
+    if (meta->ip_ver && meta->l4off) {
+        switch (meta->proto) {
+        case IPPROTO_UDP:
+            udp_hdr = (const udp_hdr_t *)(pktdata + meta->l4off);
+            src_port = udp_hdr->uh_sport;
+            dst_port = udp_hdr->uh_dport;
+            break;
+
+        case IPPROTO_TCP:
+            tcp_hdr = (const tcp_hdr_t *)(pktdata + meta->l4off);
+            src_port = tcp_hdr->th_sport;
+            dst_port = tcp_hdr->th_dport;
+            break;
+
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            icmp_hdr = (const icmpv4_hdr_t *)(pktdata + meta->l4off);
+            src_port = htons(icmp_hdr->icmp_type);
+            dst_port = htons(icmp_hdr->icmp_code);
+        }
+    }
+
+    g->src_port[i] = src_port;
+    g->dst_port[i] = dst_port;
+
+    if (meta->ip_ver)
+        g->flags[i] |= conv_flags(convs, g->src_ip[i], g->dst_ip[i], src_port, dst_port,
+                meta->vlan, meta->proto, meta->ip_ver);
+}
+
+/**
+ * Writes the rows of g, one column after another
+ */
+static int
+meta_write_group(FILE *fp, pcap_meta_group_t *g, u_char **cols)
+{
+    pcap_meta_group_hdr_t hdr;
+    int i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.rows = htonl(g->rows);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return -1;
+
+    for (i = 0; i < PCAP_META_COLS; i++) {
+        if (fwrite(cols[i], col_width[i], g->rows, fp) != g->rows)
+            return -1;
+    }
+
+    g->rows = 0;
+    return 0;
+}
+
+/**
+ * Reads all of pcapfile and writes the metadata of every packet to
+ * metafile.  Returns 0 and the number of packets, or -1 and fills the
+ * PCAP_ERRBUF_SIZE ebuf.
+ */
+int
+pcap_meta_build(const char *pcapfile, const char *metafile, COUNTER *packets, char *ebuf)
+{
+    pcap_meta_file_hdr_t hdr;
+    pcap_meta_group_t g;
+    meta_convs_t convs;
+    pkt_meta_fn_t meta_fn;
+    pkt_meta_t meta;
+    struct stat statinfo;
+    struct pcap_pkthdr *pkthdr;
+    const u_char *pktdata;
+    u_char *cols[PCAP_META_COLS];
+    u_char *buf;
+    COUNTER groups = 0;
+    pcap_t *pcap;
+    FILE *fp;
+    int rcode, datalink;
+
+    assert(pcapfile);
+    assert(metafile);
+    assert(packets);
+    assert(ebuf);
+
+    *packets = 0;
+
+    if (strcmp(pcapfile, "-") == 0 || stat(pcapfile, &statinfo) < 0 ||
+            !S_ISREG(statinfo.st_mode)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: only regular files can have metadata", pcapfile);
+        return -1;
+    }
+
+    if ((pcap = tcpr_pcap_open_offline(pcapfile, ebuf)) == NULL)
+        return -1;
+
+    datalink = pcap_datalink(pcap);
+    meta_fn = get_pkt_meta_fn(datalink);
+
+    if ((fp = fopen(metafile, "wb")) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create %s: %s", metafile, strerror(errno));
+        pcap_close(pcap);
+        return -1;
+    }
+
+    /* the counts are filled in once the file has been read */
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, PCAP_META_MAGIC, sizeof(hdr.magic));
+    hdr.version = htonl(PCAP_META_VERSION);
+    hdr.group_rows = htonl(PCAP_META_GROUP);
+    hdr.datalink = htonl(datalink);
+    hdr.pcap_size = htonll((u_int64_t)statinfo.st_size);
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto fail;
+
+    memset(&g, 0, sizeof(g));
+    memset(&convs, 0, sizeof(convs));
+    buf = safe_malloc((size_t)PCAP_META_ROW * PCAP_META_GROUP);
+    group_layout(&g, buf, PCAP_META_GROUP, cols);
+
+    while ((rcode = pcap_next_ex(pcap, &pkthdr, &pktdata)) == 1) {
+        if (meta_fn(pktdata, pkthdr->caplen, &meta) < 0) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: unsupported DLT type: %s (0x%x)", pcapfile,
+                    pcap_datalink_val_to_description(datalink), datalink);
+            goto fail_buf;
+        }
+
+        meta_row(&g, g.rows++, &convs, pkthdr, pktdata, &meta);
+        ++*packets;
+
+        if (g.rows == PCAP_META_GROUP) {
+            if (meta_write_group(fp, &g, cols) < 0)
+                goto fail_write;
+            ++groups;
+        }
+    }
+
+    if (rcode == -1)
+        warnx("%s: stopped after " COUNTER_SPEC " packets: %s",
+                pcapfile, *packets, pcap_geterr(pcap));
+
+    if (g.rows > 0) {
+        if (meta_write_group(fp, &g, cols) < 0)
+            goto fail_write;
+        ++groups;
+    }
+
+    hdr.packets = htonll((u_int64_t)*packets);
+    hdr.groups = htonll((u_int64_t)groups);
+    if (fseeko(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto fail_write;
+
+    safe_free(buf);
+    safe_free(convs.slots);
+    pcap_close(pcap);
+
+    if (fclose(fp) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", metafile, strerror(errno));
+        return -1;
+    }
+
+    dbgx(1, "Wrote the metadata of " COUNTER_SPEC " packets of %s in " COUNTER_SPEC " groups",
+            *packets, pcapfile, groups);
+
+    return 0;
+
+fail_write:
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", metafile, strerror(errno));
+fail_buf:
+    safe_free(buf);
+    safe_free(convs.slots);
+    pcap_close(pcap);
+    fclose(fp);
+    unlink(metafile);
+    return -1;
+
+fail:
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", metafile, strerror(errno));
+    pcap_close(pcap);
+    fclose(fp);
+    unlink(metafile);
+    return -1;
+}
+
+/**
+ * Opens the metadata sidecar of pcapfile.  Returns NULL if there is none,
+ * in which case ebuf is empty, or if it is unusable, in which case ebuf
+ * says why.
+ */
+pcap_meta_t *
+pcap_meta_open(const char *pcapfile, char *ebuf)
+{
+    pcap_meta_file_hdr_t hdr;
+    pcap_meta_t *pm;
+    struct stat statinfo;
+    char *metafile;
+    FILE *fp;
+
+    assert(pcapfile);
+    assert(ebuf);
+
+    ebuf[0] = '\0';
+
+    if (strcmp(pcapfile, "-") == 0)
+        return NULL;
+
+    metafile = pcap_meta_path(pcapfile);
+    fp = fopen(metafile, "rb");
+    safe_free(metafile);
+    if (fp == NULL)
+        return NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, PCAP_META_MAGIC, sizeof(PCAP_META_MAGIC)) != 0 ||
+            ntohl(hdr.version) != PCAP_META_VERSION ||
+            ntohl(hdr.group_rows) == 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s%s is not a supported metadata file",
+                pcapfile, PCAP_META_SUFFIX);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (stat(pcapfile, &statinfo) < 0 ||
+            (u_int64_t)statinfo.st_size != ntohll(hdr.pcap_size)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s%s is out of date, rebuild it with tcpcapinfo --meta",
+                pcapfile, PCAP_META_SUFFIX);
+        fclose(fp);
+        return NULL;
+    }
+
+    pm = safe_malloc(sizeof(pcap_meta_t));
+    pm->fp = fp;
+    pm->datalink = (int)ntohl(hdr.datalink);
+    pm->group_rows = ntohl(hdr.group_rows);
+    pm->packets = ntohll(hdr.packets);
+    pm->groups = ntohll(hdr.groups);
+    pm->buf = safe_malloc((size_t)PCAP_META_ROW * pm->group_rows);
+
+    dbgx(1, "Opened the metadata of " COUNTER_SPEC " packets of %s", pm->packets, pcapfile);
+    return pm;
+}
+
+/**
+ * Reads the next group of packets, its columns in host byte order where
+ * pcap_meta_group_t says so.  The group is only valid until the next
+ * call.  Returns NULL at the end, with an empty ebuf, or on error.
+ */
+const pcap_meta_group_t *
+pcap_meta_next(pcap_meta_t *pm, char *ebuf)
+{
+    pcap_meta_group_hdr_t hdr;
+    pcap_meta_group_t *g;
+    u_char *cols[PCAP_META_COLS];
+    u_int32_t rows, i;
+
+    assert(pm);
+    assert(ebuf);
+
+    ebuf[0] = '\0';
+    if (pm->group == pm->groups)
+        return NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, pm->fp) != 1 ||
+            (rows = ntohl(hdr.rows)) == 0 || rows > pm->group_rows ||
+            fread(pm->buf, PCAP_META_ROW, rows, pm->fp) != rows) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "metadata group " COUNTER_SPEC " is truncated",
+                pm->group);
+        return NULL;
+    }
+
+    ++pm->group;
+    g = &pm->cur;
+    g->rows = rows;
+    group_layout(g, pm->buf, rows, cols);
+
+    for (i = 0; i < rows; i++) {
+        g->ts_usec[i] = ntohll(g->ts_usec[i]);
+        g->caplen[i] = ntohl(g->caplen[i]);
+        g->len[i] = ntohl(g->len[i]);
+        g->l3off[i] = ntohs(g->l3off[i]);
+        g->l4off[i] = ntohs(g->l4off[i]);
+        g->ether_type[i] = ntohs(g->ether_type[i]);
+    }
+
+    return g;
+}
+
+/**
+ * Closes a sidecar opened with pcap_meta_open()
+ */
+void
+pcap_meta_close(pcap_meta_t *pm)
+{
+    if (pm == NULL)
+        return;
+
+    fclose(pm->fp);
+    safe_free(pm->buf);
+    safe_free(pm);
+}
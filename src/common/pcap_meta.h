@@ -0,0 +1,106 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAP_META_H_
+#define PCAP_META_H_
+
+#include "defines.h"
+#include "common.h"
+
+#define PCAP_META_MAGIC     "tcprmet"   /* includes the \0 */
+#define PCAP_META_VERSION   1
+#define PCAP_META_SUFFIX    ".tcprmeta"
+#define PCAP_META_GROUP     65536       /* packets per group */
+
+/* pcap_meta_group_t.flags */
+#define PCAP_META_NEW_CONV  0x1         /* first packet of its conversation */
+#define PCAP_META_REPLY     0x2         /* goes against the first packet of its conversation */
+#define PCAP_META_TRUNCATED 0x4         /* caplen < len */
+
+/*
+ * Sidecar of a pcap file's packet metadata, stored next to it as
+ * <pcap>.tcprmeta.  The header is followed by groups of up to group_rows
+ * packets, each a pcap_meta_group_hdr_t and then one column after another
+ * in the order of pcap_meta_group_t, each column holding a value of every
+ * packet in the group.  All fields are in network byte order.
+ */
+struct pcap_meta_file_hdr_s {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t group_rows;
+    u_int32_t datalink;
+    u_int32_t reserved;
+    u_int64_t packets;      /* in the whole pcap */
+    u_int64_t groups;
+    u_int64_t pcap_size;    /* to spot metadata of an older copy of the file */
+} __attribute__((__packed__));
+typedef struct pcap_meta_file_hdr_s pcap_meta_file_hdr_t;
+
+struct pcap_meta_group_hdr_s {
+    u_int32_t rows;
+    u_int32_t reserved;
+} __attribute__((__packed__));
+typedef struct pcap_meta_group_hdr_s pcap_meta_group_hdr_t;
+
+/*
+ * The columns of a loaded group.  ts_usec, caplen, len, l3off, l4off and
+ * ether_type are in host byte order; vlan, the addresses and the ports
+ * stay in network byte order, as they are in the packets.  Without a
+ * captured IP header ip_ver is 0 and the addresses and ports are zero;
+ * ICMP puts the type and code in the ports.
+ */
+typedef struct pcap_meta_group_s {
+    u_int32_t rows;
+    u_int64_t *ts_usec;
+    u_int32_t *caplen;
+    u_int32_t *len;
+    u_int8_t (*src_ip)[16];     /* IPv4 in the first 4 bytes */
+    u_int8_t (*dst_ip)[16];
+    u_int16_t *l3off;
+    u_int16_t *l4off;           /* 0 if the L4 header wasn't captured */
+    u_int16_t *ether_type;
+    u_int16_t *vlan;
+    u_int16_t *src_port;
+    u_int16_t *dst_port;
+    u_int8_t *ip_ver;
+    u_int8_t *proto;
+    u_int8_t *flags;            /* PCAP_META_* */
+} pcap_meta_group_t;
+
+/* bytes of all the columns of a packet */
+#define PCAP_META_ROW   (8 + 4 + 4 + 16 + 16 + 2 * 6 + 3)
+
+/* a sidecar open for reading */
+typedef struct pcap_meta_s {
+    FILE *fp;
+    int datalink;
+    u_int32_t group_rows;
+    COUNTER packets;
+    COUNTER groups;
+    COUNTER group;          /* groups read so far */
+    u_char *buf;
+    pcap_meta_group_t cur;
+} pcap_meta_t;
+
+char *pcap_meta_path(const char *pcapfile);
+int pcap_meta_build(const char *pcapfile, const char *metafile, COUNTER *packets, char *ebuf);
+pcap_meta_t *pcap_meta_open(const char *pcapfile, char *ebuf);
+const pcap_meta_group_t *pcap_meta_next(pcap_meta_t *pm, char *ebuf);
+void pcap_meta_close(pcap_meta_t *pm);
+
+#endif /* PCAP_META_H_ */
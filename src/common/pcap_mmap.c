@@ -0,0 +1,583 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads pcap and pcapng files by mapping them into memory.  Packets are
+ * returned as pointers straight into the mapping, so unlike pcap_next()
+ * nothing is copied.  The mapping is private and writable, which lets
+ * callers edit packets in place without touching the file.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_NSEC_MAGIC         0xa1b23c4d
+#define PCAP_FILE_HDR_LEN       24
+#define PCAP_REC_HDR_LEN        16
+
+#define PCAPNG_SHB              0x0a0d0d0a  /* same in either byte order */
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_PB               0x00000002  /* obsolete packet block */
+#define PCAPNG_SPB              0x00000003
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_ENDOFOPT     0
+#define PCAPNG_OPT_IF_TSRESOL   9
+
+#define SWAP16(x) ((uint16_t)((((x) & 0x00ff) << 8) | (((x) & 0xff00) >> 8)))
+#define SWAP32(x) ((uint32_t)((((x) & 0x000000ff) << 24) | \
+                              (((x) & 0x0000ff00) << 8)  | \
+                              (((x) & 0x00ff0000) >> 8)  | \
+                              (((x) & 0xff000000) >> 24)))
+
+static inline uint16_t
+get16(const pcap_mmap_t *pm, const u_char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return pm->swapped ? SWAP16(v) : v;
+}
+
+static inline uint32_t
+get32(const pcap_mmap_t *pm, const u_char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return pm->swapped ? SWAP32(v) : v;
+}
+
+/**
+ * Prefetch the next PCAP_MMAP_READAHEAD bytes once the reader has
+ * consumed half of the previous window
+ */
+static void
+pcap_mmap_readahead(pcap_mmap_t *pm)
+{
+#if defined HAVE_SYS_MMAN_H && defined MADV_WILLNEED
+    size_t start, end;
+    long pagesize;
+
+    if (pm->offset + PCAP_MMAP_READAHEAD / 2 < pm->readahead)
+        return;
+
+    if ((pagesize = sysconf(_SC_PAGESIZE)) <= 0)
+        pagesize = 4096;
+
+    start = max(pm->offset, pm->readahead);
+    start -= start % pagesize;
+    end = min(pm->len, pm->offset + PCAP_MMAP_READAHEAD);
+
+    if (end > start)
+        madvise(pm->base + start, end - start, MADV_WILLNEED);
+
+    pm->readahead = end;
+#else
+    (void)pm;
+#endif
+}
+
+/**
+ * Parses the options of a pcapng Interface Description Block for the
+ * timestamp resolution.  Returns units per second.
+ */
+static uint64_t
+pcapng_if_tsresol(const pcap_mmap_t *pm, const u_char *opt, uint32_t left)
+{
+    uint64_t tsresol = 1000000;
+    uint16_t code, len;
+    uint32_t padded;
+    u_char v;
+
+    while (left >= 4) {
+        code = get16(pm, opt);
+        len = get16(pm, opt + 2);
+        opt += 4;
+        left -= 4;
+
+        if (code == PCAPNG_OPT_ENDOFOPT || len > left)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+            v = opt[0];
+            if (v & 0x80) {
+                /* negative power of two */
+                if ((v & 0x7f) < 64)
+                    tsresol = (uint64_t)1 << (v & 0x7f);
+            } else if (v <= 19) {
+                /* negative power of ten */
+                tsresol = 1;
+                while (v--)
+                    tsresol *= 10;
+            }
+        }
+
+        padded = (len + 3) & ~3;
+        if (padded > left)
+            break;
+        opt += padded;
+        left -= padded;
+    }
+
+    return tsresol;
+}
+
+/**
+ * Processes the pcapng block at the current offset.  If it holds a packet,
+ * *pktdata and pkthdr are filled in.
+ * Returns 1 if a block was processed, 0 at end of file and -1 if the
+ * block is malformed
+ */
+static int
+pcapng_block(pcap_mmap_t *pm, struct pcap_pkthdr *pkthdr, u_char **pktdata)
+{
+    u_char *block, *body, *data = NULL;
+    uint32_t magic, type, block_len, body_len, iface = 0;
+    uint32_t caplen = 0, len = 0;
+    uint64_t ts = 0, tsresol;
+    pcap_mmap_if_t *ifp;
+
+    *pktdata = NULL;
+
+    if (pm->len - pm->offset < 12)
+        return 0;
+
+    block = pm->base + pm->offset;
+    type = get32(pm, block);
+
+    /* a section header sets the byte order of everything that follows */
+    if (type == PCAPNG_SHB) {
+        if (pm->len - pm->offset < 28)
+            return -1;
+
+        memcpy(&magic, block + 8, sizeof(magic));
+        if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+            pm->swapped = false;
+        else if (magic == SWAP32(PCAPNG_BYTE_ORDER_MAGIC))
+            pm->swapped = true;
+        else
+            return -1;
+
+        /* interface ids are local to a section */
+        pm->if_cnt = 0;
+    }
+
+    block_len = get32(pm, block + 4);
+    if (block_len < 12 || (block_len & 3) != 0 || block_len > pm->len - pm->offset)
+        return -1;
+
+    body = block + 8;
+    body_len = block_len - 12;
+
+    switch (type) {
+    case PCAPNG_IDB:
+        if (body_len < 8)
+            return -1;
+
+        pm->ifs = safe_realloc(pm->ifs, sizeof(pcap_mmap_if_t) * (pm->if_cnt + 1));
+        ifp = &pm->ifs[pm->if_cnt++];
+        ifp->linktype = get16(pm, body);
+        ifp->snaplen = get32(pm, body + 4);
+        ifp->tsresol = pcapng_if_tsresol(pm, body + 8, body_len - 8);
+        break;
+
+    case PCAPNG_EPB:
+    case PCAPNG_PB:
+        if (body_len < 20)
+            return -1;
+
+        iface = type == PCAPNG_EPB ? get32(pm, body) : get16(pm, body);
+        ts = ((uint64_t)get32(pm, body + 4) << 32) | get32(pm, body + 8);
+        caplen = get32(pm, body + 12);
+        len = get32(pm, body + 16);
+        data = body + 20;
+        if (caplen > body_len - 20)
+            return -1;
+        break;
+
+    case PCAPNG_SPB:
+        if (body_len < 4 || pm->if_cnt == 0)
+            return -1;
+
+        len = get32(pm, body);
+        caplen = min(len, body_len - 4);
+        if (pm->ifs[0].snaplen > 0)
+            caplen = min(caplen, pm->ifs[0].snaplen);
+        data = body + 4;
+        break;
+
+    default:
+        /* name resolution, statistics, etc. */
+        break;
+    }
+
+    if (data != NULL) {
+        if (iface >= pm->if_cnt)
+            return -1;
+
+        tsresol = pm->ifs[iface].tsresol;
+        pkthdr->ts.tv_sec = ts / tsresol;
+        ts %= tsresol;
+        /* to nanoseconds, ts < tsresol < 1e9 can't overflow */
+        if (tsresol >= 1000000000)
+            ts /= tsresol / 1000000000;
+        else if (1000000000 % tsresol == 0)
+            ts *= 1000000000 / tsresol;
+        else
+            ts = ts * 1000000000 / tsresol;
+        pkthdr->ts.tv_usec = ts / 1000;
+        pm->pkt_nsec = ts % 1000;
+        pm->pkt_iface = iface;
+        pkthdr->caplen = caplen;
+        pkthdr->len = len;
+        *pktdata = data;
+    }
+
+    pm->offset += block_len;
+    return 1;
+}
+
+/**
+ * Maps a pcap or pcapng file for reading.  Returns NULL and fills the
+ * PCAP_ERRBUF_SIZE ebuf if the file can't be mapped or isn't in a
+ * supported format; callers should fall back to libpcap.
+ */
+pcap_mmap_t *
+pcap_mmap_open(const char *path, char *ebuf)
+{
+#ifdef HAVE_SYS_MMAN_H
+    pcap_mmap_t *pm;
+    struct stat st;
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata;
+    uint32_t magic;
+    int rcode;
+
+    assert(path);
+    assert(ebuf);
+
+    pm = safe_malloc(sizeof(pcap_mmap_t));
+
+    if ((pm->fd = open(path, O_RDONLY)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    if (fstat(pm->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: not a regular file", path);
+        goto fail;
+    }
+
+    if (st.st_size < PCAP_FILE_HDR_LEN) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: file too short", path);
+        goto fail;
+    }
+
+    pm->len = st.st_size;
+    pm->base = mmap(NULL, pm->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, pm->fd, 0);
+    if (pm->base == MAP_FAILED) {
+        pm->base = NULL;
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to mmap %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(pm->base, pm->len, MADV_SEQUENTIAL);
+#endif
+
+    memcpy(&magic, pm->base, sizeof(magic));
+    switch (magic) {
+    case PCAP_MAGIC:
+        break;
+    case PCAP_NSEC_MAGIC:
+        pm->nsec = true;
+        break;
+    case SWAP32(PCAP_MAGIC):
+        pm->swapped = true;
+        break;
+    case SWAP32(PCAP_NSEC_MAGIC):
+        pm->swapped = true;
+        pm->nsec = true;
+        break;
+    case PCAPNG_SHB:
+        pm->format = PCAP_MMAP_PCAPNG;
+        break;
+    default:
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: unsupported file format 0x%08x", path, magic);
+        goto fail;
+    }
+
+    if (pm->format == PCAP_MMAP_PCAP) {
+        pm->snaplen = get32(pm, pm->base + 16);
+        pm->linktype = get32(pm, pm->base + 20);
+        pm->offset = PCAP_FILE_HDR_LEN;
+    } else {
+        /* the first interface must be described before any packet */
+        while (pm->if_cnt == 0) {
+            rcode = pcapng_block(pm, &pkthdr, &pktdata);
+            if (rcode <= 0 || pktdata != NULL) {
+                snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: no pcapng interface description", path);
+                goto fail;
+            }
+        }
+        pm->snaplen = pm->ifs[0].snaplen;
+        pm->linktype = pm->ifs[0].linktype;
+    }
+
+    dbgx(1, "mapped %s: %zu bytes, %s, linktype %d", path, pm->len,
+            pm->format == PCAP_MMAP_PCAP ? "pcap" : "pcapng", pm->linktype);
+
+    pcap_mmap_readahead(pm);
+    return pm;
+
+fail:
+    pcap_mmap_close(pm);
+    return NULL;
+#else
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", "mmap() is not supported on this platform");
+    return NULL;
+#endif
+}
+
+/**
+ * Returns the next packet in the file and fills out pkthdr, or NULL
+ * at the end of the file.  The data stays valid until pcap_mmap_close().
+ * pkt_nsec and pkt_iface then describe the packet returned.
+ */
+u_char *
+pcap_mmap_next(pcap_mmap_t *pm, struct pcap_pkthdr *pkthdr)
+{
+    u_char *rec, *pktdata = NULL;
+    uint32_t frac;
+    int rcode;
+
+    assert(pm);
+    assert(pkthdr);
+
+    pcap_mmap_readahead(pm);
+
+    if (pm->format == PCAP_MMAP_PCAPNG) {
+        while ((rcode = pcapng_block(pm, pkthdr, &pktdata)) > 0 && pktdata == NULL)
+            ;
+
+        if (rcode < 0)
+            warnx("Malformed pcapng block at offset %zu", pm->offset);
+
+        return pktdata;
+    }
+
+    if (pm->len - pm->offset < PCAP_REC_HDR_LEN) {
+        if (pm->offset != pm->len)
+            warnx("Truncated packet header at offset %zu", pm->offset);
+        return NULL;
+    }
+
+    rec = pm->base + pm->offset;
+    pkthdr->caplen = get32(pm, rec + 8);
+    pkthdr->len = get32(pm, rec + 12);
+
+    if (pkthdr->caplen > pm->len - pm->offset - PCAP_REC_HDR_LEN) {
+        warnx("Truncated packet at offset %zu", pm->offset);
+        return NULL;
+    }
+
+    pkthdr->ts.tv_sec = get32(pm, rec);
+    frac = get32(pm, rec + 4);
+    pkthdr->ts.tv_usec = pm->nsec ? frac / 1000 : frac;
+    pm->pkt_nsec = pm->nsec ? frac % 1000 : 0;
+
+    pm->offset += PCAP_REC_HDR_LEN + pkthdr->caplen;
+    return rec + PCAP_REC_HDR_LEN;
+}
+
+/**
+ * Moves the reader to the packet record at offset of a classic pcap
+ * file, eg: from a pcap_index entry.  Returns 0 or -1.
+ */
+int
+pcap_mmap_seek(pcap_mmap_t *pm, size_t offset)
+{
+    assert(pm);
+
+    if (pm->format != PCAP_MMAP_PCAP || offset < PCAP_FILE_HDR_LEN || offset > pm->len)
+        return -1;
+
+    pm->offset = offset;
+    return 0;
+}
+
+/*
+ * pcap_mmap_seek_time() finds record boundaries in the middle of a file
+ * by looking for a record header followed by PCAP_SYNC_RECS more which
+ * all make sense, within PCAP_SYNC_SCAN bytes.
+ */
+#define PCAP_SYNC_RECS      4
+#define PCAP_SYNC_SCAN      (1024 * 1024)
+#define PCAP_SYNC_MAX_LEN   (256 * 1024)    /* longest believable packet */
+#define PCAP_SEEK_SLACK     (64 * 1024)     /* close enough to read forward */
+
+/**
+ * Checks whether a classic pcap record header could start at offset.
+ * On success fills the offset of the following record and the record's
+ * timestamp in usec.
+ */
+static bool
+pcap_rec_sane(const pcap_mmap_t *pm, size_t offset, COUNTER first_sec,
+        size_t *next, COUNTER *ts_usec)
+{
+    const u_char *rec;
+    uint32_t sec, frac, caplen, len;
+
+    if (pm->len - offset < PCAP_REC_HDR_LEN)
+        return false;
+
+    rec = pm->base + offset;
+    sec = get32(pm, rec);
+    frac = get32(pm, rec + 4);
+    caplen = get32(pm, rec + 8);
+    len = get32(pm, rec + 12);
+
+    if (sec < first_sec || frac >= (pm->nsec ? 1000000000U : 1000000U))
+        return false;
+
+    if (caplen > len || len > PCAP_SYNC_MAX_LEN ||
+            (pm->snaplen > 0 && caplen > max(pm->snaplen, 65535U)) ||
+            caplen > pm->len - offset - PCAP_REC_HDR_LEN)
+        return false;
+
+    *next = offset + PCAP_REC_HDR_LEN + caplen;
+    *ts_usec = (COUNTER)sec * 1000000 + (pm->nsec ? frac / 1000 : frac);
+    return true;
+}
+
+/**
+ * Finds the first record starting in [from, to).  Returns its offset and
+ * timestamp, or false if there is none within PCAP_SYNC_SCAN bytes.
+ */
+static bool
+pcap_rec_sync(const pcap_mmap_t *pm, size_t from, size_t to, COUNTER first_sec,
+        size_t *offset, COUNTER *ts_usec)
+{
+    size_t p, next;
+    COUNTER ts, unused;
+    int i;
+
+    to = min(to, from + PCAP_SYNC_SCAN);
+    for (p = from; p < to; p++) {
+        if (!pcap_rec_sane(pm, p, first_sec, &next, &ts))
+            continue;
+
+        for (i = 0; i < PCAP_SYNC_RECS && next < pm->len; i++) {
+            if (!pcap_rec_sane(pm, next, first_sec, &next, &unused))
+                break;
+        }
+
+        if (i == PCAP_SYNC_RECS || next == pm->len) {
+            *offset = p;
+            *ts_usec = ts;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Moves the reader of a classic pcap file, without an index, to a packet
+ * shortly before the first one captured offset_usec after the first
+ * packet of the file, by bisecting the file on the timestamps.  This
+ * assumes the timestamps don't go backwards; the caller still skips the
+ * packets before the window.  first_usec receives the timestamp of the
+ * first packet.  Returns 0 or -1.
+ */
+int
+pcap_mmap_seek_time(pcap_mmap_t *pm, COUNTER offset_usec, COUNTER *first_usec)
+{
+    size_t lo, hi, mid, next, offset;
+    COUNTER target, ts;
+
+    assert(pm);
+    assert(first_usec);
+
+    if (pm->format != PCAP_MMAP_PCAP ||
+            !pcap_rec_sane(pm, PCAP_FILE_HDR_LEN, 0, &next, first_usec))
+        return -1;
+
+    target = *first_usec + offset_usec;
+
+    /* lo is always the start of a record before the target */
+    lo = PCAP_FILE_HDR_LEN;
+    hi = pm->len;
+    while (hi - lo > PCAP_SEEK_SLACK) {
+        mid = lo + (hi - lo) / 2;
+        if (pcap_rec_sync(pm, mid, hi, *first_usec / 1000000, &offset, &ts) && ts < target)
+            lo = offset;
+        else
+            hi = mid;
+    }
+
+    dbgx(1, "Bisected to offset %zu for a timestamp of " COUNTER_SPEC, lo, target);
+    pm->offset = lo;
+    return 0;
+}
+
+/**
+ * Returns the DLT of the file (of the first interface for pcapng)
+ */
+int
+pcap_mmap_datalink(pcap_mmap_t *pm)
+{
+    assert(pm);
+    return pm->linktype;
+}
+
+/**
+ * Unmaps the file and frees the reader
+ */
+void
+pcap_mmap_close(pcap_mmap_t *pm)
+{
+    if (pm == NULL)
+        return;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (pm->base != NULL)
+        munmap(pm->base, pm->len);
+#endif
+
+    if (pm->fd >= 0)
+        close(pm->fd);
+
+    safe_free(pm->ifs);
+    safe_free(pm);
+}
@@ -0,0 +1,64 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAP_MMAP_H_
+#define PCAP_MMAP_H_
+
+#include "defines.h"
+#include "common.h"
+
+#define PCAP_MMAP_READAHEAD (8 * 1024 * 1024)   /* bytes to prefetch ahead of the reader */
+
+typedef enum pcap_mmap_format_e {
+    PCAP_MMAP_PCAP,
+    PCAP_MMAP_PCAPNG,
+} pcap_mmap_format_t;
+
+/* pcapng interface description */
+typedef struct pcap_mmap_if_s {
+    int linktype;
+    uint32_t snaplen;
+    uint64_t tsresol;           /* timestamp units per second */
+} pcap_mmap_if_t;
+
+/* a pcap/pcapng file mapped into memory */
+typedef struct pcap_mmap_s {
+    int fd;
+    u_char *base;
+    size_t len;
+    size_t offset;              /* next record */
+    size_t readahead;           /* prefetched up to here */
+    pcap_mmap_format_t format;
+    bool swapped;               /* file byte order differs from ours */
+    bool nsec;                  /* classic pcap with nanosecond timestamps */
+    int linktype;
+    uint32_t snaplen;
+    pcap_mmap_if_t *ifs;        /* pcapng interfaces of the current section */
+    uint32_t if_cnt;
+    uint32_t pkt_iface;         /* pcapng interface of the last packet */
+    uint32_t pkt_nsec;          /* nanoseconds the last packet's tv_usec drops */
+} pcap_mmap_t;
+
+pcap_mmap_t *pcap_mmap_open(const char *path, char *ebuf);
+u_char *pcap_mmap_next(pcap_mmap_t *pm, struct pcap_pkthdr *pkthdr);
+int pcap_mmap_seek(pcap_mmap_t *pm, size_t offset);
+int pcap_mmap_seek_time(pcap_mmap_t *pm, COUNTER offset_usec, COUNTER *first_usec);
+int pcap_mmap_datalink(pcap_mmap_t *pm);
+void pcap_mmap_close(pcap_mmap_t *pm);
+
+#endif /* PCAP_MMAP_H_ */
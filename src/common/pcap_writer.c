@@ -0,0 +1,547 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writes classic pcap files through a pair of large buffers instead of
+ * stdio.  pcap_dump() costs an fwrite() per header and per packet; here
+ * records are copied into the current buffer and a full buffer is
+ * handed to a flusher thread while the other one fills, so the caller
+ * only ever waits on the disk when it's slower than the caller.  The
+ * output is byte for byte what pcap_dump_open()/pcap_dump() writes.
+ *
+ * With O_DIRECT the buffers skip the page cache.  Every write but the
+ * last is then a multiple of PCAP_WRITER_ALIGN; the bytes past the last
+ * aligned boundary of a full buffer move to the front of the next one.
+ *
+ * A compressed file is compressed by whichever thread writes it out,
+ * which keeps the encoder off the editing path.
+ *
+ * pcapng files get a section header, a single interface description
+ * and an enhanced packet block per packet, all in our byte order and
+ * with the default microsecond timestamps.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_VERSION_MAJOR      2
+#define PCAP_VERSION_MINOR      4
+#define PCAP_FILE_HDR_LEN       24
+#define PCAP_REC_HDR_LEN        16
+#define PCAP_WRITER_MIN_BUFSIZE (1024 * 1024)
+
+#define PCAPNG_SHB              0x0a0d0d0a
+#define PCAPNG_SHB_LEN          28
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_IDB_LEN          20
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_EPB_HDR_LEN      28      /* before the packet data */
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+/* LINKTYPE_* values for the DLT_* values which differ between the two */
+#define LINKTYPE_ATM_RFC1483    100
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LOOP           108
+
+/**
+ * The file header holds a LINKTYPE_ value.  For nearly every DLT_ they
+ * are the same number, libpcap translates the few that aren't.
+ */
+static uint32_t
+pcap_writer_linktype(int dlt)
+{
+    switch (dlt) {
+#ifdef DLT_ATM_RFC1483
+    case DLT_ATM_RFC1483:
+        return LINKTYPE_ATM_RFC1483;
+#endif
+#ifdef DLT_RAW
+    case DLT_RAW:
+        return LINKTYPE_RAW;
+#endif
+#if defined DLT_LOOP && DLT_LOOP != LINKTYPE_LOOP
+    case DLT_LOOP:
+        return LINKTYPE_LOOP;
+#endif
+    default:
+        return (uint32_t)dlt;
+    }
+}
+
+/**
+ * write() all of len, returns 0 or an errno
+ */
+static int
+pcap_writer_write_all(int fd, const u_char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * writes out a buffer, compressing it if need be.  Returns 0, an errno
+ * or -1 for a compression error.
+ */
+static int
+pcap_writer_output(pcap_writer_t *pw, const u_char *data, size_t len)
+{
+    if (pw->compress != NULL)
+        return compress_stream_write(pw->compress, pw->fd, data, len);
+
+    return pcap_writer_write_all(pw->fd, data, len);
+}
+
+/**
+ * describes a pcap_writer_output() failure
+ */
+static const char *
+pcap_writer_strerror(pcap_writer_t *pw, int rcode)
+{
+    if (rcode < 0 && pw->compress != NULL)
+        return compress_stream_geterr(pw->compress);
+
+    return strerror(rcode);
+}
+
+#ifdef HAVE_LIBPTHREAD
+/**
+ * \brief Main loop of the flusher thread
+ *
+ * Writes each buffer it's handed, then clears pending so the caller can
+ * hand over the next one.
+ */
+static void *
+pcap_writer_flusher(void *arg)
+{
+    pcap_writer_t *pw = (pcap_writer_t *)arg;
+    u_char *buf;
+    size_t len;
+    int rcode;
+
+    pthread_mutex_lock(&pw->lock);
+    for (;;) {
+        while (pw->pending == NULL && !pw->stop)
+            pthread_cond_wait(&pw->cond, &pw->lock);
+
+        if (pw->pending == NULL)
+            break;
+
+        buf = pw->pending;
+        len = pw->pending_len;
+        pthread_mutex_unlock(&pw->lock);
+
+        rcode = pcap_writer_output(pw, buf, len);
+
+        pthread_mutex_lock(&pw->lock);
+        if (rcode != 0 && pw->error == 0)
+            pw->error = rcode;
+        pw->pending = NULL;
+        pthread_cond_broadcast(&pw->cond);
+    }
+    pthread_mutex_unlock(&pw->lock);
+
+    return NULL;
+}
+
+/**
+ * waits for the flusher to be done with its buffer, returns the errno
+ * of any write it failed
+ */
+static int
+pcap_writer_wait(pcap_writer_t *pw)
+{
+    int rcode;
+
+    pthread_mutex_lock(&pw->lock);
+    while (pw->pending != NULL)
+        pthread_cond_wait(&pw->cond, &pw->lock);
+    rcode = pw->error;
+    pthread_mutex_unlock(&pw->lock);
+
+    return rcode;
+}
+#endif
+
+/**
+ * Writes out the full part of the current buffer and switches to the
+ * other one.  Returns 0 or -1 with the error in errbuf.
+ */
+static int
+pcap_writer_flush(pcap_writer_t *pw)
+{
+    size_t out = pw->len, tail = 0;
+    int next, rcode;
+
+    if (pw->direct) {
+        tail = out % PCAP_WRITER_ALIGN;
+        out -= tail;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    if (pw->threaded) {
+        /* the other buffer must be written before we start filling it */
+        if ((rcode = pcap_writer_wait(pw)) == 0) {
+            pthread_mutex_lock(&pw->lock);
+            pw->pending = pw->buf[pw->cur];
+            pw->pending_len = out;
+            pthread_cond_broadcast(&pw->cond);
+            pthread_mutex_unlock(&pw->lock);
+        }
+    } else
+#endif
+    if ((rcode = pcap_writer_output(pw, pw->buf[pw->cur], out)) != 0) {
+        pw->error = rcode;
+    }
+
+    if (rcode != 0) {
+        snprintf(pw->errbuf, sizeof(pw->errbuf), "Unable to write pcap file: %s",
+                pcap_writer_strerror(pw, rcode));
+        return -1;
+    }
+
+    next = pw->cur ^ 1;
+    memcpy(pw->buf[next], pw->buf[pw->cur] + out, tail);
+    pw->cur = next;
+    pw->len = tail;
+
+    return 0;
+}
+
+/**
+ * fills buf with the pcapng section header and interface description,
+ * returns their length
+ */
+static size_t
+pcap_writer_pcapng_hdr(u_char *buf, int dlt, uint32_t snaplen)
+{
+    uint32_t hdr32;
+    uint16_t hdr16;
+    int64_t section_len = -1;   /* unknown */
+
+    hdr32 = PCAPNG_SHB;
+    memcpy(buf, &hdr32, 4);
+    hdr32 = PCAPNG_SHB_LEN;
+    memcpy(buf + 4, &hdr32, 4);
+    memcpy(buf + 24, &hdr32, 4);
+    hdr32 = PCAPNG_BYTE_ORDER_MAGIC;
+    memcpy(buf + 8, &hdr32, 4);
+    hdr16 = 1;
+    memcpy(buf + 12, &hdr16, 2);
+    hdr16 = 0;
+    memcpy(buf + 14, &hdr16, 2);
+    memcpy(buf + 16, &section_len, 8);
+
+    buf += PCAPNG_SHB_LEN;
+    hdr32 = PCAPNG_IDB;
+    memcpy(buf, &hdr32, 4);
+    hdr32 = PCAPNG_IDB_LEN;
+    memcpy(buf + 4, &hdr32, 4);
+    memcpy(buf + 16, &hdr32, 4);
+    hdr16 = (uint16_t)pcap_writer_linktype(dlt);
+    memcpy(buf + 8, &hdr16, 2);
+    hdr16 = 0;
+    memcpy(buf + 10, &hdr16, 2);
+    memcpy(buf + 12, &snaplen, 4);
+
+    return PCAPNG_SHB_LEN + PCAPNG_IDB_LEN;
+}
+
+/**
+ * Creates a pcap file for writing packets of the given DLT.  bufsize is
+ * the size of each of the two buffers, 0 for PCAP_WRITER_BUFSIZE.  Use
+ * "-" for standard output.  compress other than TCPR_COMPRESS_NONE
+ * writes a zstd or lz4 compressed file, which can't be combined with
+ * direct.  format picks classic pcap or pcapng.  Returns NULL and
+ * fills the PCAP_ERRBUF_SIZE ebuf on failure.
+ */
+pcap_writer_t *
+pcap_writer_open(const char *path, pcap_writer_format_t format, int dlt,
+        uint32_t snaplen, size_t bufsize, bool direct, tcpr_compress_t compress,
+        char *ebuf)
+{
+    pcap_writer_t *pw;
+    uint32_t hdr32;
+    uint16_t hdr16;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int i, rcode;
+
+    assert(path);
+    assert(ebuf);
+
+    pw = safe_malloc(sizeof(pcap_writer_t));
+    pw->fd = -1;
+    pw->format = format;
+
+    if (bufsize == 0)
+        bufsize = PCAP_WRITER_BUFSIZE;
+    bufsize = max(bufsize, PCAP_WRITER_MIN_BUFSIZE);
+    pw->bufsize = (bufsize + PCAP_WRITER_ALIGN - 1) & ~((size_t)PCAP_WRITER_ALIGN - 1);
+
+    if (direct && compress != TCPR_COMPRESS_NONE) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", "O_DIRECT can not be used with compressed output");
+        goto fail;
+    }
+
+    if (compress != TCPR_COMPRESS_NONE &&
+            (pw->compress = compress_stream_open(compress, 0, ebuf)) == NULL)
+        goto fail;
+
+    if (direct) {
+#ifdef O_DIRECT
+        if (strcmp(path, "-") == 0) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", "O_DIRECT can not be used with standard output");
+            goto fail;
+        }
+        flags |= O_DIRECT;
+        pw->direct = true;
+#else
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", "O_DIRECT is not supported on this platform");
+        goto fail;
+#endif
+    }
+
+    if (strcmp(path, "-") == 0) {
+        pw->fd = STDOUT_FILENO;
+    } else if ((pw->fd = open(path, flags, 0666)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if ((rcode = posix_memalign((void **)&pw->buf[i], PCAP_WRITER_ALIGN, pw->bufsize)) != 0) {
+            pw->buf[i] = NULL;
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to allocate %zu byte pcap write buffer: %s",
+                    pw->bufsize, strerror(rcode));
+            goto fail;
+        }
+    }
+
+    if (format == PCAP_WRITER_PCAPNG) {
+        pw->len = pcap_writer_pcapng_hdr(pw->buf[0], dlt, snaplen);
+    } else {
+        /* same file header as pcap_dump_open() */
+        hdr32 = PCAP_MAGIC;
+        memcpy(pw->buf[0], &hdr32, 4);
+        hdr16 = PCAP_VERSION_MAJOR;
+        memcpy(pw->buf[0] + 4, &hdr16, 2);
+        hdr16 = PCAP_VERSION_MINOR;
+        memcpy(pw->buf[0] + 6, &hdr16, 2);
+        hdr32 = 0;
+        memcpy(pw->buf[0] + 8, &hdr32, 4);      /* thiszone */
+        memcpy(pw->buf[0] + 12, &hdr32, 4);     /* sigfigs */
+        memcpy(pw->buf[0] + 16, &snaplen, 4);
+        hdr32 = pcap_writer_linktype(dlt);
+        memcpy(pw->buf[0] + 20, &hdr32, 4);
+        pw->len = PCAP_FILE_HDR_LEN;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_cond_init(&pw->cond, NULL);
+    if ((rcode = pthread_create(&pw->thread, NULL, pcap_writer_flusher, pw)) == 0) {
+        pw->threaded = true;
+    } else {
+        /* not fatal, just flush on the caller's thread */
+        pthread_cond_destroy(&pw->cond);
+        pthread_mutex_destroy(&pw->lock);
+    }
+#endif
+
+    return pw;
+
+fail:
+    if (pw->fd > STDOUT_FILENO)
+        close(pw->fd);
+    for (i = 0; i < 2; i++)
+        safe_free(pw->buf[i]);
+    compress_stream_close(pw->compress);
+    safe_free(pw);
+    return NULL;
+}
+
+/**
+ * Appends a packet to the file, the equivalent of pcap_dump(). Returns
+ * 0 or -1 if writing the file failed: see pcap_writer_geterr()
+ */
+int
+pcap_writer_write(pcap_writer_t *pw, const struct pcap_pkthdr *pkthdr, const u_char *pktdata)
+{
+    size_t reclen, padded = 0;
+    uint32_t word;
+    uint64_t ts;
+    int32_t ts32;
+    u_char *p;
+
+    assert(pw);
+    assert(pkthdr);
+    assert(pktdata);
+
+    if (pw->format == PCAP_WRITER_PCAPNG) {
+        padded = (pkthdr->caplen + 3) & ~(size_t)3;
+        reclen = PCAPNG_EPB_HDR_LEN + padded + 4;
+    } else {
+        reclen = PCAP_REC_HDR_LEN + pkthdr->caplen;
+    }
+
+    if (pw->len + reclen > pw->bufsize) {
+        if (pcap_writer_flush(pw) < 0)
+            return -1;
+
+        if (pw->len + reclen > pw->bufsize) {
+            snprintf(pw->errbuf, sizeof(pw->errbuf), "Packet of %u bytes is larger than the "
+                    "%zu byte pcap write buffer", pkthdr->caplen, pw->bufsize);
+            return -1;
+        }
+    }
+
+    p = pw->buf[pw->cur] + pw->len;
+    if (pw->format == PCAP_WRITER_PCAPNG) {
+        /* enhanced packet block on interface 0 */
+        word = PCAPNG_EPB;
+        memcpy(p, &word, 4);
+        word = (uint32_t)reclen;
+        memcpy(p + 4, &word, 4);
+        memcpy(p + reclen - 4, &word, 4);
+        word = 0;
+        memcpy(p + 8, &word, 4);
+        ts = (uint64_t)pkthdr->ts.tv_sec * 1000000 + pkthdr->ts.tv_usec;
+        word = (uint32_t)(ts >> 32);
+        memcpy(p + 12, &word, 4);
+        word = (uint32_t)ts;
+        memcpy(p + 16, &word, 4);
+        memcpy(p + 20, &pkthdr->caplen, 4);
+        memcpy(p + 24, &pkthdr->len, 4);
+        memcpy(p + PCAPNG_EPB_HDR_LEN, pktdata, pkthdr->caplen);
+        memset(p + PCAPNG_EPB_HDR_LEN + pkthdr->caplen, 0, padded - pkthdr->caplen);
+    } else {
+        /* 32bit timestamps, as struct pcap_sf_pkthdr */
+        ts32 = (int32_t)pkthdr->ts.tv_sec;
+        memcpy(p, &ts32, 4);
+        ts32 = (int32_t)pkthdr->ts.tv_usec;
+        memcpy(p + 4, &ts32, 4);
+        memcpy(p + 8, &pkthdr->caplen, 4);
+        memcpy(p + 12, &pkthdr->len, 4);
+        memcpy(p + PCAP_REC_HDR_LEN, pktdata, pkthdr->caplen);
+    }
+    pw->len += reclen;
+
+    return 0;
+}
+
+/**
+ * Returns the reason the last pcap_writer_write() failed
+ */
+char *
+pcap_writer_geterr(pcap_writer_t *pw)
+{
+    assert(pw);
+    return pw->errbuf;
+}
+
+/**
+ * Writes out whatever is buffered, closes the file and frees pw.
+ * Returns 0 or -1 and fills the PCAP_ERRBUF_SIZE ebuf.
+ */
+int
+pcap_writer_close(pcap_writer_t *pw, char *ebuf)
+{
+    size_t out;
+    int rcode = 0;
+    int i;
+
+    assert(pw);
+    assert(ebuf);
+
+#ifdef HAVE_LIBPTHREAD
+    if (pw->threaded) {
+        rcode = pcap_writer_wait(pw);
+
+        pthread_mutex_lock(&pw->lock);
+        pw->stop = true;
+        pthread_cond_broadcast(&pw->cond);
+        pthread_mutex_unlock(&pw->lock);
+        pthread_join(pw->thread, NULL);
+        pthread_cond_destroy(&pw->cond);
+        pthread_mutex_destroy(&pw->lock);
+    }
+#endif
+
+    if (rcode == 0 && pw->error == 0) {
+        out = pw->len;
+#ifdef O_DIRECT
+        if (pw->direct) {
+            int flags;
+
+            /* the file probably doesn't end on a block boundary */
+            out -= pw->len % PCAP_WRITER_ALIGN;
+            rcode = pcap_writer_write_all(pw->fd, pw->buf[pw->cur], out);
+            if (rcode == 0 && out < pw->len) {
+                if ((flags = fcntl(pw->fd, F_GETFL)) < 0 ||
+                        fcntl(pw->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+                    rcode = errno;
+                else
+                    rcode = pcap_writer_write_all(pw->fd, pw->buf[pw->cur] + out, pw->len - out);
+            }
+        } else
+#endif
+        {
+            rcode = pcap_writer_output(pw, pw->buf[pw->cur], out);
+            if (rcode == 0 && pw->compress != NULL)
+                rcode = compress_stream_finish(pw->compress, pw->fd);
+        }
+    } else if (rcode == 0) {
+        rcode = pw->error;
+    }
+
+    if (close(pw->fd) < 0 && rcode == 0)
+        rcode = errno;
+
+    if (rcode != 0)
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write pcap file: %s",
+                pcap_writer_strerror(pw, rcode));
+
+    for (i = 0; i < 2; i++)
+        safe_free(pw->buf[i]);
+    compress_stream_close(pw->compress);
+    safe_free(pw);
+
+    return rcode != 0 ? -1 : 0;
+}
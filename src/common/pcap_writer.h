@@ -0,0 +1,66 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PCAP_WRITER_H_
+#define PCAP_WRITER_H_
+
+#include "defines.h"
+#include "common.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#define PCAP_WRITER_BUFSIZE (4 * 1024 * 1024)   /* default size of each buffer */
+#define PCAP_WRITER_ALIGN   4096                /* O_DIRECT buffer and write alignment */
+
+typedef enum pcap_writer_format_e {
+    PCAP_WRITER_PCAP,
+    PCAP_WRITER_PCAPNG,
+} pcap_writer_format_t;
+
+/* a pcap file written through large buffers */
+typedef struct pcap_writer_s {
+    int fd;
+    pcap_writer_format_t format;
+    bool direct;                /* fd was opened O_DIRECT */
+    size_t bufsize;
+    u_char *buf[2];
+    int cur;                    /* buffer being filled */
+    size_t len;                 /* bytes in buf[cur] */
+    int error;                  /* errno of the first failed write */
+    char errbuf[PCAP_ERRBUF_SIZE];
+    compress_stream_t *compress;    /* NULL to write the buffers as is */
+#ifdef HAVE_LIBPTHREAD
+    bool threaded;              /* flushes run on the flusher thread */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    u_char *pending;            /* buffer handed to the flusher */
+    size_t pending_len;
+    bool stop;
+#endif
+} pcap_writer_t;
+
+pcap_writer_t *pcap_writer_open(const char *path, pcap_writer_format_t format, int dlt,
+        uint32_t snaplen, size_t bufsize, bool direct, tcpr_compress_t compress, char *ebuf);
+int pcap_writer_write(pcap_writer_t *pw, const struct pcap_pkthdr *pkthdr, const u_char *pktdata);
+char *pcap_writer_geterr(pcap_writer_t *pw);
+int pcap_writer_close(pcap_writer_t *pw, char *ebuf);
+
+#endif /* PCAP_WRITER_H_ */
@@ -0,0 +1,52 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_H_
+#define PROBES_H_
+
+#include "config.h"
+
+/*
+ * USDT (SystemTap/DTrace compatible) static probes on the replay path.
+ * Each is a single nop in the binary until a tracer attaches to it, so
+ * they stay in release builds, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/local/bin/tcpreplay:tcpreplay:tx_stall
+ *           { printf("%s stalled\n", str(arg0)); }'
+ *
+ * tcpreplay provider:
+ *   packet_read(packetnum, caplen)         packet read from the pcap/cache
+ *   packet_edited(packetnum, pktlen)       edits and flow stats are done
+ *   pre_sleep(packetnum, ts_nsec)          about to wait for the capture time
+ *   post_send(pkts_sent, bytes, packets)   a packet or batch was sent
+ *   tx_stall(device, eagain, enobufs)      a send is being retried
+ *   tx_ring_full(device, ring)             netmap is polling for TX ring space
+ *
+ * Without <sys/sdt.h> they compile to nothing.
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define TCPR_PROBE2(name, a, b)         DTRACE_PROBE2(tcpreplay, name, a, b)
+#define TCPR_PROBE3(name, a, b, c)      DTRACE_PROBE3(tcpreplay, name, a, b, c)
+#else
+#define TCPR_PROBE2(name, a, b)         do { } while (0)
+#define TCPR_PROBE3(name, a, b, c)      do { } while (0)
+#endif
+
+#endif /* PROBES_H_ */
@@ -0,0 +1,187 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Queue maps: tcpprep --queue-map writes the queue of every packet next
+ * to the cache file, tcpreplay --queue-map hands each preloaded packet
+ * to that --workers thread or netmap TX ring instead of hashing it.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "queue_map.h"
+
+static void
+qmap_write(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = write(fd, (const char *)buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errx(-1, "Unable to write queue map: %s", strerror(errno));
+        }
+
+        done += n;
+    }
+}
+
+static void
+qmap_flush(tcpr_qmap_t *qmap)
+{
+    qmap_write(qmap->fd, qmap->buf, qmap->len);
+    qmap->len = 0;
+}
+
+/**
+ * Creates a queue map file for packets spread over queues queues.
+ * Aborts on error.
+ */
+tcpr_qmap_t *
+qmap_open(const char *file, int queues)
+{
+    tcpr_qmap_t *qmap;
+    tcpr_qmap_file_hdr_t header;
+
+    assert(file);
+    assert(queues > 0 && queues <= QMAP_MAX_QUEUES);
+
+    qmap = (tcpr_qmap_t *)safe_malloc(sizeof(tcpr_qmap_t));
+    qmap->queues = queues;
+
+    if ((qmap->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC,
+            S_IREAD | S_IWRITE | S_IRGRP | S_IWGRP | S_IROTH)) == -1)
+        errx(-1, "Unable to open queue map %s for writing: %s", file, strerror(errno));
+
+    /* the packet count is filled in by qmap_close() */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, QMAPMAGIC, strlen(QMAPMAGIC));
+    memcpy(header.version, QMAPVERSION, strlen(QMAPVERSION));
+    header.queues = htons((u_int16_t)queues);
+    qmap_write(qmap->fd, &header, sizeof(header));
+
+    return qmap;
+}
+
+/**
+ * appends the queue of the next packet
+ */
+void
+qmap_add(tcpr_qmap_t *qmap, u_int8_t queue)
+{
+    assert(qmap);
+
+    if (qmap->len == sizeof(qmap->buf))
+        qmap_flush(qmap);
+
+    qmap->buf[qmap->len++] = queue;
+    qmap->packets++;
+}
+
+/**
+ * Writes out the rest of the map, fills in the packet count and frees
+ * qmap.  Returns the number of packets.
+ */
+COUNTER
+qmap_close(tcpr_qmap_t *qmap)
+{
+    u_int64_t num_packets;
+    COUNTER packets;
+
+    assert(qmap);
+
+    qmap_flush(qmap);
+
+    num_packets = htonll((u_int64_t)qmap->packets);
+    if (pwrite(qmap->fd, &num_packets, sizeof(num_packets),
+            offsetof(tcpr_qmap_file_hdr_t, num_packets)) != (ssize_t)sizeof(num_packets))
+        errx(-1, "Unable to update the queue map header: %s", strerror(errno));
+
+    close(qmap->fd);
+    packets = qmap->packets;
+    safe_free(qmap);
+
+    return packets;
+}
+
+/**
+ * Reads a queue map file into *queues, one byte per packet, and its
+ * number of queues into *queue_cnt.  Returns the number of packets,
+ * aborts on error.
+ */
+COUNTER
+read_qmap(u_int8_t **queues, const char *file, int *queue_cnt)
+{
+    tcpr_qmap_file_hdr_t header;
+    COUNTER num_packets, got = 0;
+    ssize_t n;
+    int fd;
+
+    assert(queues);
+    assert(file);
+    assert(queue_cnt);
+
+    if ((fd = open(file, O_RDONLY)) == -1)
+        errx(-1, "Unable to open queue map %s: %s", file, strerror(errno));
+
+    if (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+        errx(-1, "Queue map %s doesn't contain a full header", file);
+
+    if (memcmp(header.magic, QMAPMAGIC, sizeof(QMAPMAGIC)) != 0)
+        errx(-1, "Unable to process %s: not a tcpprep queue map", file);
+
+    if (atoi(header.version) != atoi(QMAPVERSION))
+        errx(-1, "Unable to process %s: queue map version mismatch", file);
+
+    num_packets = ntohll(header.num_packets);
+    *queue_cnt = ntohs(header.queues);
+    if (*queue_cnt < 1 || *queue_cnt > QMAP_MAX_QUEUES)
+        errx(-1, "Unable to process %s: invalid number of queues %d", file, *queue_cnt);
+
+    *queues = (u_int8_t *)safe_malloc(max(num_packets, 1));
+    while (got < num_packets) {
+        if ((n = read(fd, *queues + got, num_packets - got)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errx(-1, "Unable to read queue map %s: %s", file, strerror(errno));
+        }
+
+        if (n == 0)
+            errx(-1, "Queue map %s is truncated: " COUNTER_SPEC " of " COUNTER_SPEC " packets",
+                    file, got, num_packets);
+
+        got += n;
+    }
+
+    close(fd);
+    dbgx(1, "Queue map %s: " COUNTER_SPEC " packets over %d queues", file, num_packets, *queue_cnt);
+
+    return num_packets;
+}
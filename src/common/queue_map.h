@@ -0,0 +1,61 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUEUE_MAP_H_
+#define QUEUE_MAP_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#define QMAPMAGIC "tcpqmap"
+#define QMAPVERSION "01"
+#define QMAP_MAX_QUEUES 256         /* queue indexes are one byte */
+#define QMAP_BUF_SIZE (64 * 1024)   /* bytes buffered by qmap_add() */
+
+/*
+ * A queue map file is this header, in network byte order, then one byte
+ * per packet, in the order of the tcpprep cache file written with it:
+ * the flow_hash_portable() of the packet modulo queues.  Both directions of a flow
+ * get the same queue.
+ */
+struct tcpr_qmap_file_hdr_s {
+    char magic[8];
+    char version[4];
+    u_int64_t num_packets;
+    u_int16_t queues;
+    u_int16_t reserved;
+} __attribute__((__packed__));
+
+typedef struct tcpr_qmap_file_hdr_s tcpr_qmap_file_hdr_t;
+
+/* a queue map being written */
+typedef struct tcpr_qmap_s {
+    int fd;
+    int queues;
+    COUNTER packets;
+    size_t len;                     /* bytes in buf */
+    u_int8_t buf[QMAP_BUF_SIZE];
+} tcpr_qmap_t;
+
+tcpr_qmap_t *qmap_open(const char *file, int queues);
+void qmap_add(tcpr_qmap_t *qmap, u_int8_t queue);
+COUNTER qmap_close(tcpr_qmap_t *qmap);
+COUNTER read_qmap(u_int8_t **queues, const char *file, int *queue_cnt);
+
+#endif /* QUEUE_MAP_H_ */
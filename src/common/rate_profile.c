@@ -0,0 +1,249 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Rate profiles for tcpreplay --rate-profile.  A profile is a list of
+ * points in time, each either holding its rate until the next point or
+ * ramping linearly to it; after the last point its rate holds.  Rates
+ * are in the unit of the speed option (Mbps, pps or a multiplier), the
+ * caller scales them.  A profile is one of:
+ *
+ *   ramp:FROM:TO:SECS          FROM to TO linearly over SECS seconds
+ *   step:FROM:TO:BY:SECS       FROM, FROM+BY, ... TO, each for SECS seconds
+ *   FILE                       lines of "secs,rate" or "secs,rate,ramp",
+ *                              # starts a comment
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rate_profile.h"
+
+#define SECS_TO_NANOSEC(x) ((uint64_t)((x) * 1000000000.0))
+
+static void
+rate_profile_add(rate_profile_t *profile, double secs, double rate, bool ramp)
+{
+    rate_point_t *point;
+
+    profile->points = safe_realloc(profile->points,
+            sizeof(rate_point_t) * (profile->cnt + 1));
+    point = &profile->points[profile->cnt++];
+    point->at_ns = SECS_TO_NANOSEC(secs);
+    point->rate = rate;
+    point->ramp = ramp;
+}
+
+static int
+rate_profile_ramp(rate_profile_t *profile, const char *args, char *errbuf, size_t errlen)
+{
+    double from, to, secs;
+
+    if (sscanf(args, "%lf:%lf:%lf", &from, &to, &secs) != 3 ||
+            from <= 0.0 || to <= 0.0 || secs <= 0.0) {
+        snprintf(errbuf, errlen, "Invalid rate ramp, expected ramp:FROM:TO:SECS: %s", args);
+        return -1;
+    }
+
+    rate_profile_add(profile, 0.0, from, true);
+    rate_profile_add(profile, secs, to, false);
+    return 0;
+}
+
+static int
+rate_profile_step(rate_profile_t *profile, const char *args, char *errbuf, size_t errlen)
+{
+    double from, to, by, secs, rate;
+    int i, steps;
+
+    if (sscanf(args, "%lf:%lf:%lf:%lf", &from, &to, &by, &secs) != 4 ||
+            from <= 0.0 || to <= 0.0 || by <= 0.0 || secs <= 0.0) {
+        snprintf(errbuf, errlen, "Invalid rate steps, expected step:FROM:TO:BY:SECS: %s", args);
+        return -1;
+    }
+
+    /* steps go down when TO is below FROM */
+    steps = (int)((to > from ? to - from : from - to) / by + 1e-9);
+    if (steps >= RATE_PROFILE_MAX_POINTS) {
+        snprintf(errbuf, errlen, "Too many rate steps: %d", steps + 1);
+        return -1;
+    }
+
+    for (i = 0; i <= steps; i++) {
+        rate = to > from ? from + i * by : from - i * by;
+        rate_profile_add(profile, i * secs, rate, false);
+    }
+
+    /* BY doesn't divide the range, finish on TO */
+    if (profile->points[steps].rate != to)
+        rate_profile_add(profile, (steps + 1) * secs, to, false);
+
+    return 0;
+}
+
+static int
+rate_profile_file(rate_profile_t *profile, const char *file, char *errbuf, size_t errlen)
+{
+    FILE *fp;
+    char line[256], *p, *end;
+    double secs, rate;
+    int lineno = 0;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        snprintf(errbuf, errlen, "Unable to open rate profile %s: %s", file, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+
+        p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '\r')
+            continue;
+
+        secs = strtod(p, &end);
+        if (end == p || *end != ',')
+            goto bad_line;
+
+        p = end + 1;
+        rate = strtod(p, &end);
+        if (end == p || rate <= 0.0 || secs < 0.0)
+            goto bad_line;
+
+        while (*end == ' ' || *end == '\t')
+            end++;
+
+        if (profile->cnt && SECS_TO_NANOSEC(secs) <= profile->points[profile->cnt - 1].at_ns) {
+            snprintf(errbuf, errlen, "%s:%d: times must increase", file, lineno);
+            fclose(fp);
+            return -1;
+        }
+
+        if (profile->cnt == RATE_PROFILE_MAX_POINTS) {
+            snprintf(errbuf, errlen, "%s: more than %d points", file, RATE_PROFILE_MAX_POINTS);
+            fclose(fp);
+            return -1;
+        }
+
+        if (*end == ',') {
+            p = end + 1;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (strncmp(p, "ramp", 4) != 0)
+                goto bad_line;
+            rate_profile_add(profile, secs, rate, true);
+        } else if (*end == '\0' || *end == '\n' || *end == '\r') {
+            rate_profile_add(profile, secs, rate, false);
+        } else {
+            goto bad_line;
+        }
+    }
+
+    fclose(fp);
+
+    if (profile->cnt == 0) {
+        snprintf(errbuf, errlen, "Rate profile %s is empty", file);
+        return -1;
+    }
+
+    return 0;
+
+bad_line:
+    snprintf(errbuf, errlen, "%s:%d: expected secs,rate[,ramp]", file, lineno);
+    fclose(fp);
+    return -1;
+}
+
+/**
+ * Parses a --rate-profile, see the top of this file.  Returns NULL and
+ * fills errbuf on error.
+ */
+rate_profile_t *
+rate_profile_parse(const char *spec, char *errbuf, size_t errlen)
+{
+    rate_profile_t *profile;
+    int rcode;
+
+    assert(spec);
+
+    profile = (rate_profile_t *)safe_malloc(sizeof(rate_profile_t));
+
+    if (strncmp(spec, "ramp:", 5) == 0)
+        rcode = rate_profile_ramp(profile, spec + 5, errbuf, errlen);
+    else if (strncmp(spec, "step:", 5) == 0)
+        rcode = rate_profile_step(profile, spec + 5, errbuf, errlen);
+    else
+        rcode = rate_profile_file(profile, spec, errbuf, errlen);
+
+    if (rcode < 0) {
+        rate_profile_free(profile);
+        return NULL;
+    }
+
+    dbgx(1, "rate profile %s: %d points, %.3f to %.3f", spec, profile->cnt,
+            profile->points[0].rate, profile->points[profile->cnt - 1].rate);
+    return profile;
+}
+
+/**
+ * Returns the rate elapsed_ns into the profile.  Lookups usually move
+ * forward in time, so they carry on from the previous segment.
+ */
+double
+rate_profile_rate(rate_profile_t *profile, uint64_t elapsed_ns)
+{
+    rate_point_t *a, *b;
+
+    assert(profile);
+    assert(profile->cnt > 0);
+
+    if (elapsed_ns < profile->points[profile->cur].at_ns)
+        profile->cur = 0;
+
+    while (profile->cur + 1 < profile->cnt &&
+            profile->points[profile->cur + 1].at_ns <= elapsed_ns)
+        profile->cur++;
+
+    a = &profile->points[profile->cur];
+    if (elapsed_ns < a->at_ns || !a->ramp || profile->cur + 1 == profile->cnt)
+        return a->rate;
+
+    b = a + 1;
+    return a->rate + (b->rate - a->rate) *
+            (double)(elapsed_ns - a->at_ns) / (double)(b->at_ns - a->at_ns);
+}
+
+void
+rate_profile_free(rate_profile_t *profile)
+{
+    if (profile == NULL)
+        return;
+
+    safe_free(profile->points);
+    safe_free(profile);
+}
@@ -0,0 +1,46 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RATE_PROFILE_H_
+#define RATE_PROFILE_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#define RATE_PROFILE_MAX_POINTS 100000
+
+/* from at_ns on the rate is rate, or heads linearly for the next point */
+typedef struct rate_point_s {
+    uint64_t at_ns;         /* since the start of the profile */
+    double rate;
+    bool ramp;
+} rate_point_t;
+
+/* --rate-profile: the rate to replay at over time */
+typedef struct rate_profile_s {
+    rate_point_t *points;
+    int cnt;
+    int cur;                /* segment of the last lookup */
+} rate_profile_t;
+
+rate_profile_t *rate_profile_parse(const char *spec, char *errbuf, size_t errlen);
+double rate_profile_rate(rate_profile_t *profile, uint64_t elapsed_ns);
+void rate_profile_free(rate_profile_t *profile);
+
+#endif /* RATE_PROFILE_H_ */
@@ -0,0 +1,161 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#ifdef HAVE_TX_RING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "rxring.h"
+
+/**
+ * Opens a receive ring of about mem_size bytes on dev for the packets
+ * passing filter, a program compiled for DLT_EN10MB.  Returns NULL and
+ * fills errbuf if the kernel can't give us one.
+ */
+rxring_t *
+rxring_open(const char *dev, struct bpf_program *filter, size_t mem_size,
+        char *errbuf, size_t errlen)
+{
+    rxring_t *rx;
+    struct tpacket_req req;
+    struct sock_fprog fprog;
+    struct sockaddr_ll sll;
+    unsigned int ifindex;
+    int version = TPACKET_V2;
+
+    assert(dev);
+    assert(filter);
+
+    if ((ifindex = if_nametoindex(dev)) == 0) {
+        snprintf(errbuf, errlen, "unknown interface %s", dev);
+        return NULL;
+    }
+
+    /* no protocol until bind(), so nothing gets in before the filter */
+    rx = (rxring_t *)safe_malloc(sizeof(rxring_t));
+    if ((rx->fd = socket(PF_PACKET, SOCK_RAW, 0)) < 0) {
+        snprintf(errbuf, errlen, "socket: %s", strerror(errno));
+        safe_free(rx);
+        return NULL;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RXRING_BLOCK_SIZE;
+    req.tp_block_nr = max(mem_size / RXRING_BLOCK_SIZE, 1);
+    req.tp_frame_size = RXRING_FRAME_SIZE;
+    req.tp_frame_nr = req.tp_block_nr * (RXRING_BLOCK_SIZE / RXRING_FRAME_SIZE);
+
+    /* struct bpf_insn and struct sock_filter are the same classic BPF */
+    fprog.len = filter->bf_len;
+    fprog.filter = (struct sock_filter *)filter->bf_insns;
+
+    if (setsockopt(rx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+            setsockopt(rx->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0 ||
+            setsockopt(rx->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        snprintf(errbuf, errlen, "RX ring setup: %s", strerror(errno));
+        goto fail;
+    }
+
+    rx->rx_size = (size_t)req.tp_block_nr * req.tp_block_size;
+    rx->rx_head = mmap(NULL, rx->rx_size, PROT_READ | PROT_WRITE, MAP_SHARED, rx->fd, 0);
+    if (rx->rx_head == MAP_FAILED) {
+        snprintf(errbuf, errlen, "RX ring mmap: %s", strerror(errno));
+        rx->rx_head = NULL;
+        goto fail;
+    }
+    rx->frame_nr = req.tp_frame_nr;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = ifindex;
+    if (bind(rx->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        snprintf(errbuf, errlen, "RX ring bind to %s: %s", dev, strerror(errno));
+        goto fail;
+    }
+
+    dbgx(1, "rxring: TPACKET_V2 block_nr=%u frame_size=%u frame_nr=%u on %s",
+            req.tp_block_nr, req.tp_frame_size, req.tp_frame_nr, dev);
+    return rx;
+
+fail:
+    rxring_close(rx);
+    return NULL;
+}
+
+/**
+ * Hands every packet waiting in the ring to callback, like
+ * pcap_dispatch(), and gives its frame back to the kernel.  Never
+ * blocks, poll rxring_fd() to wait for packets.  Returns the number of
+ * packets.
+ */
+int
+rxring_dispatch(rxring_t *rx, pcap_handler callback, u_char *user)
+{
+    struct tpacket2_hdr *hdr;
+    struct pcap_pkthdr pkthdr;
+    int n = 0;
+
+    assert(rx);
+
+    for (;;) {
+        /* RXRING_BLOCK_SIZE is a multiple of the frame size, no gaps */
+        hdr = (struct tpacket2_hdr *)(rx->rx_head + (size_t)rx->frame * RXRING_FRAME_SIZE);
+        if (!(*(volatile uint32_t *)&hdr->tp_status & TP_STATUS_USER))
+            break;
+        __sync_synchronize();
+
+        pkthdr.ts.tv_sec = hdr->tp_sec;
+        pkthdr.ts.tv_usec = hdr->tp_nsec / 1000;
+        pkthdr.caplen = hdr->tp_snaplen;
+        pkthdr.len = hdr->tp_len;
+        callback(user, &pkthdr, (u_char *)hdr + hdr->tp_mac);
+
+        __sync_synchronize();
+        *(volatile uint32_t *)&hdr->tp_status = TP_STATUS_KERNEL;
+        if (++rx->frame == rx->frame_nr)
+            rx->frame = 0;
+        n++;
+    }
+
+    return n;
+}
+
+void
+rxring_close(rxring_t *rx)
+{
+    if (rx == NULL)
+        return;
+
+    if (rx->rx_head != NULL)
+        munmap(rx->rx_head, rx->rx_size);
+    close(rx->fd);
+    safe_free(rx);
+}
+
+#endif /* HAVE_TX_RING */
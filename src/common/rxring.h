@@ -0,0 +1,54 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMON_RXRING_H
+#define COMMON_RXRING_H
+#include "config.h"
+#include "defines.h"
+
+#ifdef HAVE_TX_RING
+
+/*
+ * A PACKET_MMAP (TPACKET_V2) receive ring: the kernel writes each packet
+ * that passes the filter straight into memory we share with it, so a
+ * packet is handled without a read() or any buffering of its own.
+ */
+#define RXRING_BLOCK_SIZE   (1 << 16)   /* ring block size */
+#define RXRING_FRAME_SIZE   2048        /* longer packets are cut to fit */
+
+typedef struct rxring_s {
+    int fd;
+    u_char *rx_head;                /* mmaped ring */
+    size_t rx_size;                 /* size of the mmaped ring */
+    unsigned int frame_nr;          /* frames in the ring */
+    unsigned int frame;             /* next frame the kernel fills */
+} rxring_t;
+
+rxring_t *rxring_open(const char *dev, struct bpf_program *filter, size_t mem_size,
+        char *errbuf, size_t errlen);
+int rxring_dispatch(rxring_t *rx, pcap_handler callback, u_char *user);
+void rxring_close(rxring_t *rx);
+
+static inline int
+rxring_fd(const rxring_t *rx)
+{
+    return rx->fd;
+}
+
+#endif /* HAVE_TX_RING */
+#endif /* COMMON_RXRING_H */
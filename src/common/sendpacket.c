@@ -50,6 +50,8 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/socket.h>
@@ -58,6 +60,8 @@
 #include "defines.h"
 #include "common.h"
 #include "sendpacket.h"
+#include "netns.h"
+#include "probes.h"
 
 #ifdef FORCE_INJECT_TX_RING
 /* TX_RING uses PF_PACKET API so don't undef it here */
@@ -135,6 +139,10 @@
 #   include <linux/sockios.h>
 #endif /* linux */
 static int nm_do_ioctl (sendpacket_t *sp, u_long what, int subcmd);
+static void nm_wait_link(sendpacket_t *sp);
+#define NM_LINK_TIMEOUT_MS  4000    /* most a PHY reset is waited for */
+#define NM_LINK_SETTLE_MS   200     /* how long the link has to stay up */
+#define NM_LINK_POLL_MS     10
 static sendpacket_t *sendpacket_open_netmap(const char *device, char *errbuf);
 #if NETMAP_API >= 10
 #define NETMAP_TX_RING_EMPTY nm_ring_empty
@@ -144,6 +152,48 @@ static sendpacket_t *sendpacket_open_netmap(const char *device, char *errbuf);
 #endif /* NETMAP_API < 10 */
 #endif /* HAVE_NETMAP */
 
+#ifdef HAVE_AF_XDP
+#include <sys/mman.h>
+#include <net/if.h>
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+static sendpacket_t *sendpacket_open_af_xdp(const char *device, char *errbuf);
+static uint32_t xdp_reap(sendpacket_t *sp);
+static int xdp_queue(sendpacket_t *sp, const u_char *data, size_t len);
+static void xdp_commit(sendpacket_t *sp);
+#endif /* HAVE_AF_XDP */
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+static sendpacket_t *sendpacket_open_io_uring(const char *device, char *errbuf);
+static void uring_free(uring_t *u);
+static uint32_t uring_reap(sendpacket_t *sp);
+static int uring_queue(sendpacket_t *sp, const u_char *data, size_t len);
+static void uring_commit(sendpacket_t *sp, unsigned int wait);
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_DPDK
+static sendpacket_t *sendpacket_open_dpdk(const char *device, char *errbuf);
+static unsigned int dpdk_tx(sendpacket_t *sp, const struct iovec *iov, unsigned int n, int *retcodes);
+
+/* a port is started by the first sendpacket_open() of it and then shared */
+typedef struct dpdk_port_s {
+    bool started;
+    struct rte_mempool *pool;
+    uint16_t queues;            /* TX queues set up */
+    uint16_t next_queue;        /* for the next sendpacket_open() */
+    int open;                   /* # of sendpacket_t's using it */
+} dpdk_port_t;
+
+static dpdk_port_t dpdk_ports[RTE_MAX_ETHPORTS];
+static bool dpdk_eal_started;
+#endif /* HAVE_DPDK */
+
 #ifdef HAVE_PF_PACKET
 #undef INJECT_METHOD
 
@@ -160,20 +210,55 @@ static sendpacket_t *sendpacket_open_netmap(const char *device, char *errbuf);
 #include <netinet/in.h>
 #include <linux/if_ether.h>
 #include <net/if_arp.h>
-#include <netpacket/packet.h>
 
 #ifdef HAVE_TX_RING
 #include "txring.h"
+#else
+#include <netpacket/packet.h>
 #endif
 
 #ifndef __GLIBC__
 typedef int socklen_t;
 #endif
 
-static sendpacket_t *sendpacket_open_pf(const char *, char *);
+static sendpacket_t *sendpacket_open_pf(const char *, char *, bool);
 static struct tcpr_ether_addr *sendpacket_get_hwaddr_pf(sendpacket_t *);
 static int get_iface_index(int fd, const char *device, char *);
 
+#ifdef HAVE_SO_TXTIME
+#include <linux/net_tstamp.h>
+
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+
+static int sendpacket_send_txtime(sendpacket_t *, const u_char *, size_t);
+#endif
+
+#ifdef HAVE_SO_TIMESTAMPING
+#include <poll.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+
+#ifndef PACKET_TX_TIMESTAMP
+#define PACKET_TX_TIMESTAMP 16
+#endif
+
+static int sendpacket_hwtstamp(sendpacket_t *, int, int *);
+#endif
+
+#ifdef HAVE_PACKET_VNET_HDR
+#include <linux/virtio_net.h>
+
+static int sendpacket_vnet_iov(sendpacket_t *, const u_char *, size_t,
+        struct virtio_net_hdr *, uint16_t *, struct iovec *);
+static int sendpacket_send_vnet(sendpacket_t *, const u_char *, size_t);
+
+/* frames carry a virtio_net_hdr, for checksum offload or GSO */
+#define SENDPACKET_VNET(sp) ((sp)->csum_offload || (sp)->gso)
+#endif
+
 #endif /* HAVE_PF_PACKET */
 
 #if defined HAVE_BPF && ! defined INJECT_METHOD
@@ -226,35 +311,228 @@ static struct tcpr_ether_addr *sendpacket_get_hwaddr_pcap(sendpacket_t *) _U_;
 
 static void sendpacket_seterr(sendpacket_t *sp, const char *fmt, ...);
 static sendpacket_t * sendpacket_open_khial(const char *, char *) _U_;
+static sendpacket_t *sendpacket_open_null(const char *, char *);
 static struct tcpr_ether_addr * sendpacket_get_hwaddr_khial(sendpacket_t *) _U_;
+static int khial_set_direction(sendpacket_t *);
+static void sendpacket_backoff(sendpacket_t *, unsigned int *);
 
 /**
- * returns number of bytes sent on success or -1 on error
- * Note: it is theoretically possible to get a return code >0 and < len
- * which for most people would be considered an error (the packet wasn't fully sent)
- * so you may want to test for recode != len too.
- *
- * Most socket API's have two interesting errors: ENOBUFS & EAGAIN.  ENOBUFS
- * is usually due to the kernel buffers being full.  EAGAIN happens when you
- * try to send traffic faster then the PHY allows.
+ * monotonic nsec for the transmit telemetry
  */
-int
-sendpacket(sendpacket_t *sp, const u_char *data, size_t len, struct pcap_pkthdr *pkthdr)
-{
-    int retcode = 0, val;
-    static u_char buffer[10000]; /* 10K bytes, enough for jumbo frames + pkthdr
-                                  * larger than page size so made static to
-                                  * prevent page misses on stack
-                                  */
-    static const size_t buffer_payload_size = sizeof(buffer) + sizeof(struct pcap_pkthdr);
+static inline uint64_t
+sendpacket_telemetry_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * file descriptor which polls writable once the device has room, or -1
+ */
+static int
+sendpacket_poll_fd(sendpacket_t *sp)
+{
+    switch (sp->handle_type) {
+        case SP_TYPE_LIBPCAP:
+#if defined HAVE_PCAP_GET_SELECTABLE_FD && (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
+            return pcap_get_selectable_fd(sp->handle.pcap);
+#else
+            return -1;
+#endif
+        case SP_TYPE_LIBDNET:
+        case SP_TYPE_DPDK:
+        case SP_TYPE_NULL:
+            return -1;
+
+        default:
+            return sp->handle.fd;
+    }
+}
+
+/**
+ * Called before each retry of a send the device pushed back on.  step
+ * counts the retries of the current send.  Adaptive backoff retries
+ * straight away at first, then yields the CPU, and finally waits for
+ * the device to poll writable.  Sockets whose qdisc is full still poll
+ * writable, so then it sleeps instead, for twice as long each time.
+ * Time spent other than spinning is added to sp->blocked_ns.
+ */
+static void
+sendpacket_backoff(sendpacket_t *sp, unsigned int *step)
+{
+    struct pollfd x[1];
+    struct timespec ts;
+    uint64_t start;
+    unsigned int n = (*step)++;
+
+    if (sp->backoff == SP_BACKOFF_SPIN ||
+            (sp->backoff == SP_BACKOFF_ADAPTIVE && n < BACKOFF_SPINS))
+        return;
+
+    start = sendpacket_telemetry_now();
+
+    if (sp->backoff == SP_BACKOFF_YIELD ||
+            (sp->backoff == SP_BACKOFF_ADAPTIVE && n < BACKOFF_SPINS + BACKOFF_YIELDS)) {
+        sched_yield();
+    } else {
+        if (sp->backoff == SP_BACKOFF_ADAPTIVE)
+            n -= BACKOFF_SPINS + BACKOFF_YIELDS;
+
+        x[0].fd = sendpacket_poll_fd(sp);
+        x[0].events = POLLOUT;
+        x[0].revents = 0;
+        if (x[0].fd < 0 || poll(x, 1, BACKOFF_POLL_MS) > 0) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = BACKOFF_SLEEP_NS << min(n, BACKOFF_SLEEP_SHIFT_MAX);
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    sp->blocked_ns += sendpacket_telemetry_now() - start;
+}
+
+/**
+ * record one send call (or native batch) which began at start.  A call
+ * which had to retry or wait for ring space is also counted as a stall.
+ */
+static void
+sendpacket_telemetry_call(sendpacket_t *sp, uint64_t start, bool stalled)
+{
+    sendpacket_telemetry_t *t = sp->telemetry;
+    uint64_t elapsed = sendpacket_telemetry_now() - start;
+
+    timing_hist_add(&t->call, elapsed);
+    if (stalled) {
+        timing_hist_add(&t->stall, elapsed);
+        t->stall_ns += elapsed;
+    }
+}
+
+/**
+ * sample how many TX ring slots are in use.  For AF_XDP, io_uring and
+ * TX_RING this counts slots which haven't been reclaimed yet.
+ */
+static void
+sendpacket_ring_sample(sendpacket_t *sp)
+{
+    sendpacket_telemetry_t *t = sp->telemetry;
+    uint64_t used;
+
+    switch (sp->handle_type) {
 #ifdef HAVE_NETMAP
-    struct netmap_ring *txring;
+        case SP_TYPE_NETMAP: {
+            struct netmap_ring *txring = NETMAP_TXRING(sp->nm_if, sp->nm_tx_ring);
+#if NETMAP_API > 4
+            used = txring->num_slots - nm_ring_space(txring);
+#else
+            used = txring->num_slots - txring->avail;
+#endif
+            break;
+        }
+#endif
+#ifdef HAVE_AF_XDP
+        case SP_TYPE_AF_XDP:
+            used = XDP_FRAME_NR - sp->xdp_free_cnt;
+            break;
+#endif
+#ifdef HAVE_IO_URING
+        case SP_TYPE_IO_URING:
+            used = URING_ENTRIES - sp->uring->free_cnt;
+            break;
+#endif
+#ifdef HAVE_TX_RING
+        case SP_TYPE_TX_RING:
+            used = txring_used(sp->tx_ring);
+            break;
+#endif
+        default:
+            return;
+    }
+
+    timing_hist_add(&t->ring, used);
+    t->ring_last = used;
+}
+
+#ifdef HAVE_NETMAP
+#if NETMAP_API >= 10
+#define SENDPACKET_NM_NEXT(ring, cur) nm_ring_next(ring, cur)
+#else
+#define SENDPACKET_NM_NEXT(ring, cur) NETMAP_RING_NEXT(ring, cur)
+#endif
+
+/*
+ * netmap: TX slots a frame of len bytes takes.  Frames bigger than a
+ * netmap buffer, jumbo frames, are split over several slots chained with
+ * NS_MOREFRAG; netmap versions without it truncate them to one.
+ */
+static inline uint32_t
+sendpacket_netmap_slots(const struct netmap_ring *txring, size_t len)
+{
+#ifdef NS_MOREFRAG
+    return (uint32_t)((len + txring->nr_buf_size - 1) / txring->nr_buf_size);
+#else
+    (void)len;
+    return 1;
+#endif
+}
+
+/*
+ * Copies a frame into the slots from cur on, unless it was built in the
+ * first one (see sendpacket_slot()), and returns the slot after it.
+ * Returns the bytes queued, less than len if it had to be truncated.
+ */
+static size_t
+sendpacket_netmap_fill(struct netmap_ring *txring, uint32_t *cur, const u_char *data, size_t len)
+{
+    uint32_t i, slots = sendpacket_netmap_slots(txring, len);
     struct netmap_slot *slot;
+    size_t off = 0, chunk;
     char *p;
-    uint32_t cur, avail;
+
+    for (i = 0; i < slots; i++) {
+        slot = &txring->slot[*cur];
+        chunk = min(len - off, (size_t)txring->nr_buf_size);
+        p = NETMAP_BUF(txring, slot->buf_idx);
+        if (p != (const char *)data + off)
+            memcpy(p, data + off, chunk);
+        slot->len = chunk;
+#ifdef NS_MOREFRAG
+        /* slots are reused, so the last one has to lose the flag */
+        if (i + 1 < slots)
+            slot->flags |= NS_MOREFRAG;
+        else
+            slot->flags &= ~NS_MOREFRAG;
+#endif
+        off += chunk;
+        *cur = SENDPACKET_NM_NEXT(txring, *cur);
+    }
+
+    return off;
+}
+#endif /* HAVE_NETMAP */
+
+/**
+ * sends one packet for sendpacket(), retrying until it goes out or fails
+ */
+static int
+sendpacket_send(sendpacket_t *sp, const u_char *data, size_t len, const struct pcap_pkthdr *pkthdr)
+{
+    int retcode = 0;
+    unsigned int backoff = 0;
+    struct iovec khial_iov[2];
+#ifdef HAVE_DPDK
+    struct iovec iov;
+#endif
+#ifdef HAVE_NETMAP
+    struct netmap_ring *txring;
+    uint32_t cur, avail, slots;
     bool tx_queue_empty;
 #endif
 
+    COUNTER attempt = sp->attempt;
+
     assert(sp);
     assert(data);
 
@@ -262,44 +540,34 @@ sendpacket(sendpacket_t *sp, const u_char *data, size_t len, struct pcap_pkthdr
         return -1;
 
 TRY_SEND_AGAIN:
-    sp->attempt ++;
+    if (sp->attempt++ != attempt)
+        TCPR_PROBE3(tx_stall, sp->device, sp->retry_eagain, sp->retry_enobufs);
 
 
     switch (sp->handle_type) {
         case SP_TYPE_KHIAL:
 
-            memcpy(buffer, pkthdr, sizeof(struct pcap_pkthdr));
-            memcpy(buffer + sizeof(struct pcap_pkthdr), data, min(len, buffer_payload_size));
-
-            /* tell the kernel module which direction the traffic is going */
-            if (sp->cache_dir == TCPR_DIR_C2S) {  /* aka PRIMARY */
-                val = KHIAL_DIRECTION_RX;
-                if (ioctl(sp->handle.fd, KHIAL_SET_DIRECTION, (void *)&val) < 0) {
-                    sendpacket_seterr(sp, "Error setting direction on %s: %s (%d)",
-                            sp->device, strerror(errno), errno);
-                    return -1;
-                }
-            } else if (sp->cache_dir == TCPR_DIR_S2C) {
-                val = KHIAL_DIRECTION_TX;
-                if (ioctl(sp->handle.fd, KHIAL_SET_DIRECTION, (void *)&val) < 0) {
-                    sendpacket_seterr(sp, "Error setting direction on %s: %s (%d)",
-                            sp->device, strerror(errno), errno);
-                    return -1;
-                }
-            }
+            if (khial_set_direction(sp) < 0)
+                return -1;
 
-            /* write the pkthdr + packet data all at once */
-            retcode = write(sp->handle.fd, (void *)buffer, sizeof(struct pcap_pkthdr) + len);
+            /* write the pkthdr + packet data as one record */
+            khial_iov[0].iov_base = (void *)pkthdr;
+            khial_iov[0].iov_len = sizeof(struct pcap_pkthdr);
+            khial_iov[1].iov_base = (void *)data;
+            khial_iov[1].iov_len = len;
+            retcode = writev(sp->handle.fd, khial_iov, 2);
             retcode -= sizeof(struct pcap_pkthdr); /* only record packet bytes we sent, not pcap data too */
-                    
+
             if (retcode < 0 && !sp->abort) {
                 switch(errno) {
                     case EAGAIN:
                         sp->retry_eagain ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
                     case ENOBUFS:
                         sp->retry_enobufs ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
                     default:
@@ -316,10 +584,25 @@ TRY_SEND_AGAIN:
         case SP_TYPE_TX_RING:
 #if defined HAVE_PF_PACKET
 #ifdef HAVE_TX_RING
-            retcode = (int)txring_put(sp->tx_ring, data, len);
-#else
-            retcode = (int)send(sp->handle.fd, (void *)data, len, 0);
+            if (sp->handle_type == SP_TYPE_TX_RING) {
+                /* queue the frame, then have the kernel send whatever is queued */
+                retcode = txring_put(sp->tx_ring, data, len);
+                if (retcode >= 0 && txring_flush(sp->tx_ring, 0) < 0 &&
+                        errno != EAGAIN && errno != ENOBUFS)
+                    retcode = -1;
+            } else
 #endif
+#ifdef HAVE_SO_TXTIME
+            if (sp->txtime_enabled)
+                retcode = sendpacket_send_txtime(sp, data, len);
+            else
+#endif
+#ifdef HAVE_PACKET_VNET_HDR
+            if (SENDPACKET_VNET(sp))
+                retcode = sendpacket_send_vnet(sp, data, len);
+            else
+#endif
+                retcode = (int)send(sp->handle.fd, (void *)data, len, 0);
 
             /* out of buffers, or hit max PHY speed, silently retry
              * as long as we're not told to abort
@@ -328,10 +611,12 @@ TRY_SEND_AGAIN:
                 switch (errno) {
                     case EAGAIN:
                         sp->retry_eagain ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
                     case ENOBUFS:
                         sp->retry_enobufs ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
@@ -356,11 +641,13 @@ TRY_SEND_AGAIN:
                 switch (errno) {
                     case EAGAIN:
                         sp->retry_eagain ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
                     case ENOBUFS:
                         sp->retry_enobufs ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
@@ -383,11 +670,13 @@ TRY_SEND_AGAIN:
                 switch (errno) {
                     case EAGAIN:
                         sp->retry_eagain ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
                     case ENOBUFS:
                         sp->retry_enobufs ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
@@ -416,11 +705,13 @@ TRY_SEND_AGAIN:
                 switch (errno) {
                     case EAGAIN:
                         sp->retry_eagain ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
                     case ENOBUFS:
                         sp->retry_enobufs ++;
+                        sendpacket_backoff(sp, &backoff);
                         goto TRY_SEND_AGAIN;
                         break;
 
@@ -442,23 +733,83 @@ TRY_SEND_AGAIN:
 
             break;
 
+        case SP_TYPE_AF_XDP:
+#ifdef HAVE_AF_XDP
+            retcode = xdp_queue(sp, data, len);
+            if (retcode >= 0) {
+                xdp_commit(sp);
+            } else if (errno == EAGAIN && !sp->abort) {
+                /* all UMEM chunks or TX slots are in flight */
+                sp->retry_eagain ++;
+                sendpacket_backoff(sp, &backoff);
+                goto TRY_SEND_AGAIN;
+            } else if (!sp->abort) {
+                sendpacket_seterr(sp, "Error with AF_XDP [" COUNTER_SPEC "]: %s (errno = %d)",
+                        sp->sent + sp->failed + 1, strerror(errno), errno);
+            }
+#endif
+            break;
+
+        case SP_TYPE_DPDK:
+#ifdef HAVE_DPDK
+            iov.iov_base = (void *)data;
+            iov.iov_len = len;
+            if (dpdk_tx(sp, &iov, 1, &retcode) == 0)
+                retcode = -1;
+#endif
+            break;
+
+        case SP_TYPE_IO_URING:
+#ifdef HAVE_IO_URING
+            retcode = uring_queue(sp, data, len);
+            if (retcode >= 0) {
+                uring_commit(sp, 0);
+            } else if (errno == EAGAIN && !sp->abort) {
+                /* every buffer is in flight, wait for a send to complete */
+                sp->retry_eagain ++;
+                uring_commit(sp, 1);
+                goto TRY_SEND_AGAIN;
+            }
+#endif
+            break;
+
         case SP_TYPE_NETMAP:
 #ifdef HAVE_NETMAP
-            txring = NETMAP_TXRING(sp->nm_if, 0);
+            txring = NETMAP_TXRING(sp->nm_if, sp->nm_tx_ring);
+            slots = sendpacket_netmap_slots(txring, len);
+            if (slots >= txring->num_slots) {
+                sendpacket_seterr(sp, "A %zu byte frame needs more netmap slots than the ring has",
+                        len);
+                retcode = -1;
+                break;
+            }
 #if NETMAP_API > 4
             avail = nm_ring_space(txring);
 #else
             avail = txring->avail;
 #endif
-            while (avail == 0) {
+            while (avail < slots) {
                 struct pollfd x[1];
+                uint64_t wait_start = 0;
+                int ready;
+
+                TCPR_PROBE2(tx_ring_full, sp->device, sp->nm_tx_ring);
+                if (sp->telemetry) {
+                    sp->telemetry->waits++;
+                    wait_start = sendpacket_telemetry_now();
+                }
 
                 /* send TX interrupt signal just in case */
                 ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
                 x[0].fd = sp->handle.fd;
                 x[0].events = POLLOUT;
                 x[0].revents = 0;
-                if (poll(x, 1, 100) <= 0) {
+                ready = poll(x, 1, 100);
+                if (sp->telemetry)
+                    timing_hist_add(&sp->telemetry->wait,
+                            sendpacket_telemetry_now() - wait_start);
+
+                if (ready <= 0) {
                     if (sp->abort)
                         return retcode;
 
@@ -489,29 +840,19 @@ TRY_SEND_AGAIN:
              * send
              */
             cur = txring->cur;
-            slot = &txring->slot[cur];
-            p = NETMAP_BUF(txring, slot->buf_idx);
-            memcpy(p, data, min(len, txring->nr_buf_size));
-            slot->len = len;
+            dbgx(2, "netmap cur=%d slots=%u empty=%d avail=%u bufsize=%d\n",
+                    cur, slots, NETMAP_TX_RING_EMPTY(txring), avail, txring->nr_buf_size);
+            retcode = (int)sendpacket_netmap_fill(txring, &cur, data, len);
 
             /* let kernel know that packet is available */
 #if NETMAP_API >= 10
-            dbgx(2, "netmap cur=%d slot index=%d flags=0x%x empty=%d avail=%u bufsize=%d\n",
-                    cur, slot->buf_idx, slot->flags, NETMAP_TX_RING_EMPTY(txring),
-                    nm_ring_space(txring), txring->nr_buf_size);
-            cur = nm_ring_next(txring, cur);
             tx_queue_empty = nm_ring_empty(txring);
             txring->head = cur;
 #else
-            dbgx(2, "netmap cur=%d slot index=%d flags=0x%x empty=%d avail=%u bufsize=%d\n",
-                    cur, slot->buf_idx, slot->flags, NETMAP_TX_RING_EMPTY(txring),
-                    txring->avail, txring->nr_buf_size);
-            cur = NETMAP_RING_NEXT(txring, cur);
             tx_queue_empty = NETMAP_TX_RING_EMPTY(txring);
-            txring->avail--;
+            txring->avail -= slots;
 #endif
             txring->cur = cur;
-            retcode = len;
 
             /*
              *  If the queue is empty, tell netmap that packets are ready to TX
@@ -522,6 +863,10 @@ TRY_SEND_AGAIN:
 #endif /* HAVE_NETMAP */
             break;
 
+        case SP_TYPE_NULL:
+            retcode = len;
+            break;
+
         default:
             errx(1, "Unsupported sp->handle_type = %d", sp->handle_type);
     } /* end case */
@@ -540,1010 +885,3413 @@ TRY_SEND_AGAIN:
 }
 
 /**
- * Open the given network device name and returns a sendpacket_t struct
- * pass the error buffer (in case there's a problem) and the direction
- * that this interface represents
+ * returns number of bytes sent on success or -1 on error
+ * Note: it is theoretically possible to get a return code >0 and < len
+ * which for most people would be considered an error (the packet wasn't fully sent)
+ * so you may want to test for recode != len too.
+ *
+ * Most socket API's have two interesting errors: ENOBUFS & EAGAIN.  ENOBUFS
+ * is usually due to the kernel buffers being full.  EAGAIN happens when you
+ * try to send traffic faster then the PHY allows.
  */
-sendpacket_t *
-sendpacket_open(const char *device, char *errbuf, tcpr_dir_t direction,
-        sendpacket_type_t sendpacket_type)
+int
+sendpacket(sendpacket_t *sp, const u_char *data, size_t len, const struct pcap_pkthdr *pkthdr)
 {
-    sendpacket_t *sp;
-    struct stat sdata;
-
-    assert(device);
-    assert(errbuf);
+    sendpacket_telemetry_t *t = sp->telemetry;
+    COUNTER retries, waits;
+    uint64_t start;
+    int retcode;
 
-    errbuf[0] = '\0';
-    /* khial is universal */
-    if (stat(device, &sdata) == 0) {
-        if (((sdata.st_mode & S_IFMT) == S_IFCHR)) { 
+    if (t == NULL)
+        return sendpacket_send(sp, data, len, pkthdr);
 
-            sp = sendpacket_open_khial(device, errbuf);
+    retries = sp->retry_eagain + sp->retry_enobufs;
+    waits = t->waits;
+    sendpacket_ring_sample(sp);
+    start = sendpacket_telemetry_now();
 
-        } else {
-            errx(1, "%s is not a valid Tcpreplay character device",
-                    device);
-        }
-    } else {
-#ifdef HAVE_NETMAP
-        if (sendpacket_type == SP_TYPE_NETMAP)
-            sp = sendpacket_open_netmap(device, errbuf);
-        else
-#endif
-#if defined HAVE_PF_PACKET
-            sp = sendpacket_open_pf(device, errbuf);
-#elif defined HAVE_BPF
-            sp = sendpacket_open_bpf(device, errbuf);
-#elif defined HAVE_LIBDNET
-            sp = sendpacket_open_libdnet(device, errbuf);
-#elif (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
-            sp = sendpacket_open_pcap(device, errbuf);
-#else
-#error "No defined packet injection method for sendpacket_open()"
-#endif
-    }
+    retcode = sendpacket_send(sp, data, len, pkthdr);
 
-    if (sp) {
-        sp->open = 1;
-        sp->cache_dir = direction;
-    } else {
-        errx(1, "failed to open device %s", device);
-    }
-    return sp;
+    sendpacket_telemetry_call(sp, start,
+            sp->retry_eagain + sp->retry_enobufs != retries || t->waits != waits);
+    return retcode;
 }
 
 /**
- * Get packet stats for the given sendpacket_t
+ * \brief The buffer the next packet sent on sp is copied into
+ *
+ * For netmap that's the slot at the TX ring's cur, for TX_RING the next
+ * frame.  A packet built there and then passed to sendpacket() goes out
+ * without being copied again.  Nothing is queued until sendpacket() is
+ * called, so a packet built but never sent just leaves the buffer to the
+ * next one.  Any other send on sp, or picking another netmap ring, may
+ * overwrite it first.  Returns the buffer and its size in *room, or NULL
+ * if the method has none or none is free right now.
  */
-size_t
-sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size)
+u_char *
+sendpacket_slot(sendpacket_t *sp, size_t *room)
 {
-    size_t offset;
+#ifdef HAVE_NETMAP
+    struct netmap_ring *txring;
+    uint32_t avail;
+#endif
 
     assert(sp);
-    assert(buf);
+    assert(room);
 
-    memset(buf, 0, buf_size);
-    offset = snprintf(buf, buf_size, "Statistics for network device: %s\n"
-            "\tAttempted packets:         " COUNTER_SPEC "\n"
-            "\tSuccessful packets:        " COUNTER_SPEC "\n"
-            "\tFailed packets:            " COUNTER_SPEC "\n"
-            "\tTruncated packets:         " COUNTER_SPEC "\n"
-            "\tRetried packets (ENOBUFS): " COUNTER_SPEC "\n"
-            "\tRetried packets (EAGAIN):  " COUNTER_SPEC "\n",
-            sp->device, sp->attempt, sp->sent, sp->failed, sp->trunc_packets,
-            sp->retry_enobufs, sp->retry_eagain);
+    switch (sp->handle_type) {
+#ifdef HAVE_TX_RING
+        case SP_TYPE_TX_RING:
+            return txring_slot(sp->tx_ring, room);
+#endif
+#ifdef HAVE_NETMAP
+        case SP_TYPE_NETMAP:
+            txring = NETMAP_TXRING(sp->nm_if, sp->nm_tx_ring);
+#if NETMAP_API > 4
+            avail = nm_ring_space(txring);
+#else
+            avail = txring->avail;
+#endif
+            if (avail == 0)
+                return NULL;
 
-    if (sp->flow_packets && offset > 0) {
-        offset += snprintf(&buf[offset], buf_size - offset,
-                "\tFlows total:               " COUNTER_SPEC "\n"
-                "\tFlows unique:              " COUNTER_SPEC "\n"
-                "\tFlows expired:             " COUNTER_SPEC "\n"
-                "\tFlow packets:              " COUNTER_SPEC "\n"
-                "\tNon-flow packets:          " COUNTER_SPEC "\n"
-                "\tInvalid flow packets:      " COUNTER_SPEC "\n",
-                sp->flows, sp->flows_expired, sp->flows_expired, sp->flow_packets,
-                sp->flow_non_flow_packets, sp->flows_invalid_packets);
+            *room = txring->nr_buf_size;
+            return (u_char *)NETMAP_BUF(txring, txring->slot[txring->cur].buf_idx);
+#endif
+        default:
+            return NULL;
     }
-
-    return offset;
 }
 
 /**
- * close the given sendpacket
+ * account for one packet of a batch, the same way sendpacket() does
  */
-int
-sendpacket_close(sendpacket_t *sp)
+static inline void
+sendpacket_batch_account(sendpacket_t *sp, int retcode, size_t len)
 {
-    assert(sp);
-    switch(sp->handle_type) {
-        case SP_TYPE_KHIAL:
-            close(sp->handle.fd);
-            break;
-
-        case SP_TYPE_BPF:
-#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
-            close(sp->handle.fd);
-#endif
-            break;
-
-        case SP_TYPE_PF_PACKET:
-        case SP_TYPE_TX_RING:
-#ifdef HAVE_PF_PACKET
-            close(sp->handle.fd);
-#endif
-            break;
+    if (retcode < 0) {
+        sp->failed ++;
+    } else if (retcode != (int)len) {
+        sendpacket_seterr(sp, "Only able to write %d bytes out of %u bytes total",
+                retcode, len);
+        sp->trunc_packets ++;
+    } else {
+        sp->bytes_sent += len;
+        sp->sent ++;
+    }
+}
 
-        case SP_TYPE_LIBPCAP:
-#ifdef HAVE_LIBPCAP
-            pcap_close(sp->handle.pcap);
+#if defined HAVE_PF_PACKET && defined HAVE_SENDMMSG
+/**
+ * PF_PACKET: hand up to SENDPACKET_BATCH_MAX frames to the kernel
+ * per sendmmsg() call.  Returns the number of packets processed.
+ */
+static unsigned int
+sendpacket_batch_pf(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
+{
+    struct mmsghdr msgs[SENDPACKET_BATCH_MAX];
+#ifdef HAVE_PACKET_VNET_HDR
+    struct virtio_net_hdr vhs[SENDPACKET_BATCH_MAX];
+    struct iovec vecs[SENDPACKET_BATCH_MAX][4];
+    uint16_t pseudo[SENDPACKET_BATCH_MAX];
 #endif
-            break;
-
-        case SP_TYPE_LIBDNET:
-#ifdef HAVE_LIBDNET            
-            eth_close(sp->handle.ldnet);
+    unsigned int i, cnt, done = 0, backoff = 0;
+    int retcode;
+
+    while (done < n) {
+        cnt = min(n - done, SENDPACKET_BATCH_MAX);
+        memset(msgs, 0, sizeof(msgs[0]) * cnt);
+        for (i = 0; i < cnt; i++) {
+#ifdef HAVE_PACKET_VNET_HDR
+            if (SENDPACKET_VNET(sp)) {
+                msgs[i].msg_hdr.msg_iov = vecs[i];
+                msgs[i].msg_hdr.msg_iovlen = sendpacket_vnet_iov(sp,
+                        iov[done + i].iov_base, iov[done + i].iov_len,
+                        &vhs[i], &pseudo[i], vecs[i]);
+                continue;
+            }
 #endif
-            break;
-
-        case SP_TYPE_LIBNET:
-            err(-1, "Libnet is no longer supported!");
-            break;
+            msgs[i].msg_hdr.msg_iov = (struct iovec *)&iov[done + i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
 
-        case SP_TYPE_NETMAP:
-#ifdef HAVE_NETMAP
-            fprintf(stderr, "Switching network driver for %s to normal mode... ",
-                    sp->device);
-            fflush(NULL);
-              /* flush any remaining packets */
-            ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+        sp->attempt += cnt;
+        retcode = sendmmsg(sp->handle.fd, msgs, cnt, 0);
+        if (retcode < 0) {
+            if (sp->abort)
+                break;
 
-#ifdef linux
-            /* restore original settings:
-             * - generic-segmentation-offload
-             * - tcp-segmentation-offload
-             * - rx-checksumming
-             * - tx-checksumming
-             */
-            sp->data = sp->gso;
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SGSO);
-            sp->data = sp->tso;
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STSO);
-            sp->data = sp->rxcsum;
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SRXCSUM);
-            sp->data = sp->txcsum;
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STXCSUM);
-#endif /* linux */
+            switch (errno) {
+                case EAGAIN:
+                    sp->retry_eagain ++;
+                    sendpacket_backoff(sp, &backoff);
+                    continue;
+
+                case ENOBUFS:
+                    sp->retry_enobufs ++;
+                    sendpacket_backoff(sp, &backoff);
+                    continue;
+
+                default:
+                    /* count the offending packet as failed and move on */
+                    sendpacket_seterr(sp, "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                            INJECT_METHOD, sp->sent + sp->failed + 1, strerror(errno), errno);
+                    sendpacket_batch_account(sp, -1, iov[done].iov_len);
+                    ++done;
+                    continue;
+            }
+        }
 
-            /* restore interface to normal mode */
-#if NETMAP_API < 10
-            ioctl(sp->handle.fd, NIOCUNREGIF, NULL);
+        for (i = 0; i < (unsigned int)retcode; i++) {
+#ifdef HAVE_PACKET_VNET_HDR
+            if (SENDPACKET_VNET(sp))
+                msgs[i].msg_len -= sizeof(struct virtio_net_hdr);
 #endif
-            munmap(sp->mmap_addr, sp->mmap_size);
-            close(sp->handle.fd);
-            notice("done!");
-#endif /* HAVE_NETMAP */
-            break;
+            sendpacket_batch_account(sp, (int)msgs[i].msg_len, iov[done + i].iov_len);
+        }
 
-        case SP_TYPE_NONE:
-            err(-1, "no injector selected!");
-            break;
+        done += retcode;
+        backoff = 0;
     }
-    safe_free(sp);
-    return 0;
+
+    return done;
 }
+#endif /* HAVE_PF_PACKET && HAVE_SENDMMSG */
 
+#ifdef HAVE_TX_RING
 /**
- * returns the Layer 2 address of the interface current
- * open.  on error, return NULL
+ * TX_RING: copy the whole batch into the ring, then have the kernel
+ * send it with a single system call.  Returns the number of packets
+ * processed.
  */
-struct tcpr_ether_addr *
-sendpacket_get_hwaddr(sendpacket_t *sp)
+static unsigned int
+sendpacket_batch_txring(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
 {
-    struct tcpr_ether_addr *addr;
-    assert(sp);
+    unsigned int done = 0, backoff = 0;
+    int retcode;
+
+    while (done < n && !sp->abort) {
+        sp->attempt ++;
+        retcode = txring_put(sp->tx_ring, iov[done].iov_base, iov[done].iov_len);
+        if (retcode < 0) {
+            if (errno == ENOBUFS) {
+                sp->retry_enobufs ++;
+                sendpacket_backoff(sp, &backoff);
+                continue;
+            }
 
-    /* if we already have our MAC address stored, just return it */
-    if (memcmp(&sp->ether, "\x00\x00\x00\x00\x00\x00", ETHER_ADDR_LEN) != 0)
-        return &sp->ether;
+            sendpacket_seterr(sp, "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                    INJECT_METHOD, sp->sent + sp->failed + 1, strerror(errno), errno);
+        }
 
-    if (sp->handle_type == SP_TYPE_KHIAL) {
-        addr = sendpacket_get_hwaddr_khial(sp);
-    } else {    
-#if defined HAVE_PF_PACKET
-        addr = sendpacket_get_hwaddr_pf(sp);
-#elif defined HAVE_BPF
-        addr = sendpacket_get_hwaddr_bpf(sp);
-#elif defined HAVE_LIBDNET
-        addr = sendpacket_get_hwaddr_libdnet(sp);
-#elif (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
-        addr = sendpacket_get_hwaddr_pcap(sp);
-#endif
+        sendpacket_batch_account(sp, retcode, iov[done].iov_len);
+        ++done;
+        backoff = 0;
     }
-    return addr;
+
+    if (txring_flush(sp->tx_ring, 0) < 0 && errno != EAGAIN && errno != ENOBUFS)
+        sendpacket_seterr(sp, "Error with %s: %s (errno = %d)",
+                INJECT_METHOD, strerror(errno), errno);
+
+    return done;
 }
+#endif /* HAVE_TX_RING */
 
+#ifdef HAVE_AF_XDP
 /**
- * returns the error string
+ * AF_XDP: queue as many descriptors as there are free UMEM chunks and TX
+ * slots, then make them visible to the kernel at once.  Returns the
+ * number of packets queued.
  */
-char *
-sendpacket_geterr(sendpacket_t *sp)
+static unsigned int
+sendpacket_batch_af_xdp(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
 {
-    assert(sp);
-    return sp->errbuf;
+    unsigned int done = 0, backoff = 0;
+    int retcode;
+
+    while (done < n && !sp->abort) {
+        sp->attempt ++;
+        retcode = xdp_queue(sp, iov[done].iov_base, iov[done].iov_len);
+        if (retcode < 0) {
+            if (done > 0)
+                break;
+
+            /* nothing queued yet, wait for the kernel to complete something */
+            sp->retry_eagain ++;
+            xdp_commit(sp);
+            sendpacket_backoff(sp, &backoff);
+            continue;
+        }
+
+        sendpacket_batch_account(sp, retcode, iov[done].iov_len);
+        ++done;
+    }
+
+    xdp_commit(sp);
+
+    return done;
 }
+#endif /* HAVE_AF_XDP */
 
+#ifdef HAVE_IO_URING
 /**
- * Set's the error string
+ * io_uring: queue a send for every packet there is a free buffer for,
+ * then submit them with at most one system call.  Returns the number of
+ * packets processed.
  */
-static void
-sendpacket_seterr(sendpacket_t *sp, const char *fmt, ...)
+static unsigned int
+sendpacket_batch_io_uring(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
 {
-    va_list ap;
+    unsigned int done = 0;
+    int retcode;
+
+    while (done < n && !sp->abort) {
+        sp->attempt ++;
+        retcode = uring_queue(sp, iov[done].iov_base, iov[done].iov_len);
+        if (retcode < 0 && errno == EAGAIN) {
+            /* submit what we have and wait for a buffer to come back */
+            sp->retry_eagain ++;
+            uring_commit(sp, 1);
+            continue;
+        }
 
-    assert(sp);
+        sendpacket_batch_account(sp, retcode, iov[done].iov_len);
+        ++done;
+    }
 
-    va_start(ap, fmt);
-    if (fmt != NULL)
-        (void)vsnprintf(sp->errbuf, SENDPACKET_ERRBUF_SIZE, fmt, ap);
-    va_end(ap);
+    uring_commit(sp, 0);
 
-    sp->errbuf[(SENDPACKET_ERRBUF_SIZE-1)] = '\0'; // be safe
+    return done;
 }
+#endif /* HAVE_IO_URING */
 
+#ifdef HAVE_DPDK
+/**
+ * DPDK: copy the packets into mbufs and hand them to our TX queue
+ * DPDK_BURST at a time.  Returns the number of packets processed.
+ */
+static unsigned int
+sendpacket_batch_dpdk(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
+{
+    int retcodes[DPDK_BURST];
+    unsigned int i, cnt, done = 0;
+
+    while (done < n && !sp->abort) {
+        cnt = dpdk_tx(sp, iov + done, min(n - done, DPDK_BURST), retcodes);
+        for (i = 0; i < cnt; i++)
+            sendpacket_batch_account(sp, retcodes[i], iov[done + i].iov_len);
+        done += cnt;
+    }
 
-#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET) && !(defined HAVE_PF_PACKET || defined BPF || defined HAVE_LIBDNET)
+    return done;
+}
+#endif /* HAVE_DPDK */
+
+#ifdef HAVE_NETMAP
 /**
- * Inner sendpacket_open() method for using libpcap
+ * netmap: fill as many TX slots as are available before telling the
+ * kernel about them with a single NIOCTXSYNC.  A jumbo frame takes all
+ * its slots in the same sync.  Returns the number of packets processed.
  */
-static sendpacket_t *
-sendpacket_open_pcap(const char *device, char *errbuf)
+static unsigned int
+sendpacket_batch_netmap(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
 {
-    pcap_t *pcap;
-    sendpacket_t *sp;
-#ifdef BIOCSHDRCMPLT
-    u_int spoof_eth_src = 1;
-    int fd;
+    struct netmap_ring *txring = NETMAP_TXRING(sp->nm_if, sp->nm_tx_ring);
+    uint32_t cur, avail, queued, slots;
+    unsigned int done = 0;
+    size_t len;
+
+    while (done < n) {
+        sp->attempt ++;
+        slots = sendpacket_netmap_slots(txring, iov[done].iov_len);
+        if (slots >= txring->num_slots) {
+            sendpacket_seterr(sp, "A %zu byte frame needs more netmap slots than the ring has",
+                    iov[done].iov_len);
+            sendpacket_batch_account(sp, -1, iov[done].iov_len);
+            done++;
+            continue;
+        }
+
+#if NETMAP_API > 4
+        avail = nm_ring_space(txring);
+#else
+        avail = txring->avail;
 #endif
+        if (avail < slots) {
+            struct pollfd x[1];
 
-    assert(device);
-    assert(errbuf);
+            ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+            x[0].fd = sp->handle.fd;
+            x[0].events = POLLOUT;
+            x[0].revents = 0;
+            if (poll(x, 1, 100) <= 0 && sp->abort)
+                break;
 
-    dbg(1, "sendpacket: using Libpcap");
+            continue;
+        }
 
-    /* open_pcap_live automatically fills out our errbuf for us */
-    if ((pcap = pcap_open_live(device, 0, 0, 0, errbuf)) == NULL)
-        return NULL;
+        cur = txring->cur;
+        for (queued = 0; done < n; ++done) {
+            len = iov[done].iov_len;
+            slots = sendpacket_netmap_slots(txring, len);
+            if (queued + slots > avail || slots >= txring->num_slots)
+                break;
 
-    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
-    strlcpy(sp->device, device, sizeof(sp->device));
-    sp->handle.pcap = pcap;
+            sendpacket_batch_account(sp, (int)sendpacket_netmap_fill(txring, &cur,
+                    iov[done].iov_base, len), len);
+            queued += slots;
+        }
 
-#ifdef BIOCSHDRCMPLT
-    /* 
-     * Only systems using BPF on the backend need this... 
-     * other systems don't have ioctl and will get compile errors.
-     */
-    fd = pcap_get_selectable_fd(pcap);
-    if (ioctl(fd, BIOCSHDRCMPLT, &spoof_eth_src) == -1)
-        errx(-1, "Unable to enable source MAC spoof support: %s", strerror(errno));
+        dbgx(2, "netmap batch queued=%u cur=%u bufsize=%d", queued, cur,
+                txring->nr_buf_size);
+
+#if NETMAP_API >= 10
+        txring->head = cur;
+#else
+        txring->avail -= queued;
 #endif
-    sp->handle_type = SP_TYPE_LIBPCAP;
+        txring->cur = cur;
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+    }
 
-    return sp;
+    return done;
 }
+#endif /* HAVE_NETMAP */
 
+#ifdef HAVE_BPF
 /**
- * Get the hardware MAC address for the given interface using libpcap
+ * BPF: /dev/bpf takes exactly one frame per write(), so the batch is
+ * still one syscall per packet, but without the per-packet overhead of
+ * going through sendpacket().  Returns the number of packets written.
  */
-static struct tcpr_ether_addr *
-sendpacket_get_hwaddr_pcap(sendpacket_t *sp)
+static unsigned int
+sendpacket_batch_bpf(sendpacket_t *sp, const struct iovec *iov, unsigned int n)
 {
-    assert(sp);
-    sendpacket_seterr(sp, "Error: sendpacket_get_hwaddr() not yet supported for pcap injection");
-    return NULL;
+    unsigned int i, backoff = 0;
+    ssize_t retcode;
+
+    for (i = 0; i < n && !sp->abort; i++, backoff = 0) {
+TRY_WRITE_AGAIN:
+        sp->attempt ++;
+        retcode = write(sp->handle.fd, iov[i].iov_base, iov[i].iov_len);
+        if (retcode < 0) {
+            if (sp->abort)
+                break;
+
+            switch (errno) {
+                case EAGAIN:
+                    sp->retry_eagain ++;
+                    sendpacket_backoff(sp, &backoff);
+                    goto TRY_WRITE_AGAIN;
+
+                case ENOBUFS:
+                    sp->retry_enobufs ++;
+                    sendpacket_backoff(sp, &backoff);
+                    goto TRY_WRITE_AGAIN;
+
+                default:
+                    sendpacket_seterr(sp, "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                            INJECT_METHOD, sp->sent + sp->failed + 1, strerror(errno), errno);
+            }
+            break;
+        }
+
+        sendpacket_batch_account(sp, (int)retcode, iov[i].iov_len);
+    }
+
+    return i;
 }
-#endif /* HAVE_PCAP_INJECT || HAVE_PCAP_SENDPACKET */
+#endif /* HAVE_BPF */
 
-#if defined HAVE_LIBDNET
 /**
- * Inner sendpacket_open() method for using libdnet
+ * Sets the khial direction for sp->cache_dir, only calling into the
+ * driver when it differs from the last one set on this handle.
  */
-static sendpacket_t * 
-sendpacket_open_libdnet(const char *device, char *errbuf)
+static int
+khial_set_direction(sendpacket_t *sp)
 {
-    eth_t *ldnet;
-    sendpacket_t *sp;
+    int val;
 
-    assert(device);
-    assert(errbuf);
+    if (sp->cache_dir != TCPR_DIR_C2S && sp->cache_dir != TCPR_DIR_S2C)
+        return 0;
 
-    dbg(1, "sendpacket: using Libdnet");
+    /* C2S aka PRIMARY is what the kernel module receives */
+    val = sp->cache_dir == TCPR_DIR_C2S ? KHIAL_DIRECTION_RX : KHIAL_DIRECTION_TX;
+    if (val == sp->khial_dir)
+        return 0;
 
-    if ((ldnet = eth_open(device)) == NULL)
-        return NULL;
+    if (ioctl(sp->handle.fd, KHIAL_SET_DIRECTION, (void *)&val) < 0) {
+        sendpacket_seterr(sp, "Error setting direction on %s: %s (%d)",
+                sp->device, strerror(errno), errno);
+        return -1;
+    }
 
-    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
-    strlcpy(sp->device, device, sizeof(sp->device));
-    sp->handle.ldnet = ldnet;
-    sp->handle_type = SP_TYPE_LIBDNET;    
-    return sp;    
+    sp->khial_dir = val;
+    return 0;
 }
 
 /**
- * Get the hardware MAC address for the given interface using libdnet
+ * khial: hand every pkthdr + packet record to the driver in a single
+ * writev(), pointing straight at the caller's buffers.  If the driver
+ * takes less than everything, only the records that went out in full
+ * are counted and the rest are left for the caller.  Returns the number
+ * of packets written.
  */
-static struct tcpr_ether_addr *
-sendpacket_get_hwaddr_libdnet(sendpacket_t *sp)
+static unsigned int
+sendpacket_batch_khial(sendpacket_t *sp, const struct iovec *iov,
+        struct pcap_pkthdr *pkthdrs, unsigned int n)
 {
-    struct tcpr_ether_addr *addr;
-    int ret;
-    assert(sp);
+    struct iovec recs[SENDPACKET_BATCH_MAX * 2];
+    size_t offset, rec_len;
+    unsigned int i, done, backoff = 0;
+    ssize_t retcode;
 
-    ret = eth_get(sp->handle.ldnet, (eth_addr_t *)addr);
+    assert(n <= SENDPACKET_BATCH_MAX);
 
-    if (addr == NULL || ret < 0) {
-        sendpacket_seterr(sp, "Error getting hwaddr via libdnet: %s", strerror(errno));
-        return NULL;
+    for (i = 0; i < n; i++) {
+        recs[2 * i].iov_base = &pkthdrs[i];
+        recs[2 * i].iov_len = sizeof(struct pcap_pkthdr);
+        recs[2 * i + 1] = iov[i];
     }
 
-    memcpy(&sp->ether, addr, sizeof(struct tcpr_ether_addr));
-    return(&sp->ether);
+    /* direction is the same for the whole batch */
+    if (khial_set_direction(sp) < 0)
+        return 0;
+
+TRY_WRITE_AGAIN:
+    sp->attempt ++;
+    retcode = writev(sp->handle.fd, recs, 2 * n);
+    if (retcode < 0) {
+        if (sp->abort)
+            return 0;
+
+        switch (errno) {
+            case EAGAIN:
+                sp->retry_eagain ++;
+                sendpacket_backoff(sp, &backoff);
+                goto TRY_WRITE_AGAIN;
+
+            case ENOBUFS:
+                sp->retry_enobufs ++;
+                sendpacket_backoff(sp, &backoff);
+                goto TRY_WRITE_AGAIN;
+
+            default:
+                sendpacket_seterr(sp, "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                        "khial", sp->sent + sp->failed + 1, strerror(errno), errno);
+        }
+        return 0;
+    }
+
+    for (done = 0, offset = 0; done < n; done++) {
+        rec_len = sizeof(struct pcap_pkthdr) + iov[done].iov_len;
+        if (offset + rec_len > (size_t)retcode)
+            break;
+
+        offset += rec_len;
+        sendpacket_batch_account(sp, (int)iov[done].iov_len, iov[done].iov_len);
+    }
+
+    return done;
 }
-#endif /* HAVE_LIBDNET */
 
-#ifdef HAVE_NETMAP
 /**
- * ioctl support for netmap
+ * \brief Sends n packets with as few system calls as the injector allows
+ *
+ * iov[i] holds the data of packet i and pkthdrs[i] its pcap header.
+ * PF_PACKET uses sendmmsg(), netmap syncs the TX ring once per batch and
+ * khial writes the batch at once.  Every other injector, and any packets
+ * a native path was unable to send, go through sendpacket() one by one.
+ * Statistics are updated exactly as if sendpacket() had been called n
+ * times.  Returns the number of packets sent in full; if this is less than
+ * n, sendpacket_geterr() describes the last failure.
  */
-static int nm_do_ioctl (sendpacket_t *sp, u_long what, int subcmd) {
-    struct ifreq ifr;
-    int error;
-    int fd;
-#ifdef linux
-    struct ethtool_value eval;
-#endif
+int
+sendpacket_batch(sendpacket_t *sp, const struct iovec *iov,
+        struct pcap_pkthdr *pkthdrs, unsigned int n)
+{
+    COUNTER sent, retries = 0, waits = 0;
+    uint64_t start = 0;
+    unsigned int i = 0;
 
     assert(sp);
+    assert(iov);
+    assert(pkthdrs);
 
-    fd = socket (AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) {
-        dbg(1, "ioctl error: cannot get device control socket.\n");
-        return -1;
+    sent = sp->sent;
+    retries = sp->retry_eagain + sp->retry_enobufs;
+
+    if (sp->telemetry) {
+        waits = sp->telemetry->waits;
+        sendpacket_ring_sample(sp);
+        start = sendpacket_telemetry_now();
     }
 
-    bzero (&ifr, sizeof(ifr));
-    strncpy (ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+    switch (sp->handle_type) {
+        case SP_TYPE_KHIAL:
+            i = sendpacket_batch_khial(sp, iov, pkthdrs, n);
+            break;
 
-    switch (what) {
-    case SIOCSIFFLAGS:
-        ifr.ifr_flags = sp->if_flags >> 16;
-        ifr.ifr_flags = sp->if_flags & 0xffff;
-        break;
+#if defined HAVE_PF_PACKET && defined HAVE_SENDMMSG
+        case SP_TYPE_PF_PACKET:
+            i = sendpacket_batch_pf(sp, iov, n);
+            break;
+#endif
 
-#ifdef linux
-    case SIOCETHTOOL:
-        eval.cmd = subcmd;
-        eval.data = sp->data;
-        ifr.ifr_data = (caddr_t)&eval;
-        dbgx(1, "ioctl SIOCETHTOOL subcmd=%d data=%u", subcmd, eval.data);
-        break;
+#ifdef HAVE_TX_RING
+        case SP_TYPE_TX_RING:
+            i = sendpacket_batch_txring(sp, iov, n);
+            break;
 #endif
-    }
 
-    error = ioctl (fd, what, &ifr);
-    if (error)
-        goto done;
+#ifdef HAVE_AF_XDP
+        case SP_TYPE_AF_XDP:
+            i = sendpacket_batch_af_xdp(sp, iov, n);
+            break;
+#endif
 
-    switch (what) {
-    case SIOCGIFFLAGS:
-        sp->if_flags = (ifr.ifr_flags << 16) | (0xffff & ifr.ifr_flags);
-        dbgx(1, "SIOCGIFFLAGS flags are 0x%x", sp->if_flags);
-        break;
+#ifdef HAVE_IO_URING
+        case SP_TYPE_IO_URING:
+            i = sendpacket_batch_io_uring(sp, iov, n);
+            break;
+#endif
 
-#ifdef linux
-    case SIOCETHTOOL:
-        switch (subcmd) {
-        case ETHTOOL_GGSO:
-            sp->gso = eval.data;
-            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GGSO=%u", eval.data);
+#ifdef HAVE_DPDK
+        case SP_TYPE_DPDK:
+            i = sendpacket_batch_dpdk(sp, iov, n);
             break;
+#endif
 
-        case ETHTOOL_GTSO:
-            sp->tso = eval.data;
-            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GTSO=%u", eval.data);
+#ifdef HAVE_NETMAP
+        case SP_TYPE_NETMAP:
+            i = sendpacket_batch_netmap(sp, iov, n);
             break;
+#endif
 
-        case ETHTOOL_GRXCSUM:
-            sp->rxcsum = eval.data;
-            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GRXCSUM=%u", eval.data);
+#ifdef HAVE_BPF
+        case SP_TYPE_BPF:
+            i = sendpacket_batch_bpf(sp, iov, n);
             break;
+#endif
 
-        case ETHTOOL_GTXCSUM:
-            sp->txcsum = eval.data;
-            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GTXCSUM=%u", eval.data);
+        case SP_TYPE_NULL:
+            sp->attempt += n;
+            for (; i < n; i++)
+                sendpacket_batch_account(sp, iov[i].iov_len, iov[i].iov_len);
             break;
-        }
-        break;
+
+        default:
+            break;
+    }
+
+    if (sp->retry_eagain + sp->retry_enobufs != retries)
+        TCPR_PROBE3(tx_stall, sp->device, sp->retry_eagain, sp->retry_enobufs);
+
+    /* packets left to the loop below are timed by sendpacket() itself */
+    if (sp->telemetry && i > 0)
+        sendpacket_telemetry_call(sp, start,
+                sp->retry_eagain + sp->retry_enobufs != retries ||
+                sp->telemetry->waits != waits);
+
+    for (; i < n && !sp->abort; i++)
+        sendpacket(sp, iov[i].iov_base, iov[i].iov_len, &pkthdrs[i]);
+
+    return (int)(sp->sent - sent);
+}
+
+/* METHOD: prefixes of an interface, picking its injection method */
+static const struct {
+    const char *prefix;
+    sendpacket_type_t type;
+} sendpacket_methods[] = {
+#ifdef HAVE_AF_XDP
+    { "af-xdp:", SP_TYPE_AF_XDP },
+#endif
+#ifdef HAVE_IO_URING
+    { "io-uring:", SP_TYPE_IO_URING },
+#endif
+#ifdef HAVE_PF_PACKET
+    { "pf-packet:", SP_TYPE_PF_PACKET },
 #endif
+#ifdef HAVE_TX_RING
+    { "tx-ring:", SP_TYPE_TX_RING },
+#endif
+    { NULL, SP_TYPE_NONE }
+};
 
+/**
+ * Splits a [METHOD:]DEVICE[@NETNS] interface into the device name, copied
+ * to name, and the network namespace, pointing into spec or NULL if there
+ * is none.  A METHOD from sendpacket_methods replaces *type.
+ */
+static void
+sendpacket_parse_device(const char *spec, char *name, size_t len,
+        const char **netns, sendpacket_type_t *type)
+{
+    const char *at;
+    size_t i, n;
+
+    for (i = 0; sendpacket_methods[i].prefix != NULL; i++) {
+        n = strlen(sendpacket_methods[i].prefix);
+        if (strncmp(spec, sendpacket_methods[i].prefix, n) == 0) {
+            *type = sendpacket_methods[i].type;
+            spec += n;
+            break;
+        }
     }
 
-done:
-    close (fd);
+    strlcpy(name, spec, len);
+    *netns = NULL;
+    if ((at = strrchr(spec, '@')) != NULL && at[1] != '\0') {
+        name[min((size_t)(at - spec), len - 1)] = '\0';
+        *netns = at + 1;
+    }
+}
 
-    if (error)
-        warnx("ioctl error %d %lu:%d", error, what, subcmd);
-    return error;
+/**
+ * Open the given network device name and returns a sendpacket_t struct
+ * pass the error buffer (in case there's a problem) and the direction
+ * that this interface represents
+ *
+ * A kernel interface may be given as [METHOD:]DEVICE[@NETNS].  METHOD
+ * (af-xdp, io-uring, pf-packet or tx-ring) overrides sendpacket_type for
+ * this interface alone, and NETNS opens DEVICE in that Linux network
+ * namespace, an ip netns name or a path like /proc/PID/ns/net.  The
+ * socket stays in the namespace, the caller doesn't.
+ */
+sendpacket_t *
+sendpacket_open(const char *device, char *errbuf, tcpr_dir_t direction,
+        sendpacket_type_t sendpacket_type)
+{
+    sendpacket_t *sp;
+
+    if ((sp = sendpacket_try_open(device, errbuf, direction, sendpacket_type)) == NULL)
+        errx(1, "failed to open device %s", device);
+
+    return sp;
 }
 
 /**
- * Inner sendpacket_open() method for using Linux version of netmap
+ * Same as sendpacket_open(), but returns NULL with the reason in errbuf
+ * if the device can't be opened with the given method, e.g. when probing
+ * which methods an interface supports.
  */
-static sendpacket_t *
-sendpacket_open_netmap(const char *device, char *errbuf)
+sendpacket_t *
+sendpacket_try_open(const char *device, char *errbuf, tcpr_dir_t direction,
+        sendpacket_type_t sendpacket_type)
 {
-    sendpacket_t *sp = NULL;
-    struct nmreq nmr;
+    sendpacket_t *sp;
+    struct stat sdata;
+    char name[256];
+    const char *netns = NULL;
+    int self = -1;
 
     assert(device);
     assert(errbuf);
 
-    dbg(1, "sendpacket_open_netmap: using netmap");
-
-    /* prep & return our sp handle */
-    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
-
-    /*
-     * Open the netmap device to fetch the number of queues of our
-     * interface.
-     *
-     * The first NIOCREGIF also detaches the card from the
-     * protocol stack and may cause a reset of the card,
-     * which in turn may take some time for the PHY to
-     * reconfigure.
-     */
-    if ((sp->handle.fd = open ("/dev/netmap", O_RDWR)) < 0) {
-        dbg(1, "sendpacket_open_netmap: Unable to access netmap");
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to access netmap.\n"
-                "See INSTALL to learn how to set up netmap-capable network drivers.");
-        goto OPEN_FAILED;
+    errbuf[0] = '\0';
+    if (sendpacket_type != SP_TYPE_NULL && sendpacket_type != SP_TYPE_DPDK) {
+        sendpacket_parse_device(device, name, sizeof(name), &netns, &sendpacket_type);
+        device = name;
+        if (netns != NULL &&
+                (self = netns_enter(netns, errbuf, SENDPACKET_ERRBUF_SIZE)) < 0)
+            return NULL;
     }
 
-    /*
-     * Register the interface on the netmap device: from now on,
-     * we can operate on the network interface without any
-     * interference from the legacy network stack.
-     *
-     * Cards take a long time to reset the PHY.
-     */
-    fprintf(stderr, "Switching network driver for %s to netmap bypass mode... ",
-            device);
-    fflush(NULL);
+    if (sendpacket_type == SP_TYPE_NULL) {
+        sp = sendpacket_open_null(device, errbuf);
+#ifdef HAVE_DPDK
+    } else if (sendpacket_type == SP_TYPE_DPDK) {
+        /* a DPDK port number or device name, not a kernel interface */
+        sp = sendpacket_open_dpdk(device, errbuf);
+#endif
+    } else if (stat(device, &sdata) == 0) {
+        /* khial is universal */
+        if (((sdata.st_mode & S_IFMT) == S_IFCHR)) { 
 
-    bzero (&nmr, sizeof(nmr));
-    strncpy (nmr.nr_name, device, sizeof(nmr.nr_name));
-    nmr.nr_version = NETMAP_API;
+            sp = sendpacket_open_khial(device, errbuf);
 
-    if (ioctl (sp->handle.fd, NIOCREGIF, &nmr) == -1) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Failure accessing netmap.\n"
-                "\tRequest for netmap version %u failed.\n\tMake sure netmap driver is version %u.\n\tError=%s\n",
-                NETMAP_API, NETMAP_API, strerror(errno));
-        goto NETMAP_UP_FAILED;
+        } else {
+            errx(1, "%s is not a valid Tcpreplay character device",
+                    device);
+        }
+    } else {
+#ifdef HAVE_NETMAP
+        if (sendpacket_type == SP_TYPE_NETMAP)
+            sp = sendpacket_open_netmap(device, errbuf);
+        else
+#endif
+#ifdef HAVE_AF_XDP
+        if (sendpacket_type == SP_TYPE_AF_XDP)
+            sp = sendpacket_open_af_xdp(device, errbuf);
+        else
+#endif
+#ifdef HAVE_IO_URING
+        if (sendpacket_type == SP_TYPE_IO_URING)
+            sp = sendpacket_open_io_uring(device, errbuf);
+        else
+#endif
+#if defined HAVE_PF_PACKET
+            /* SP_TYPE_PF_PACKET asks for plain send() without TX_RING */
+            sp = sendpacket_open_pf(device, errbuf,
+                    sendpacket_type != SP_TYPE_PF_PACKET);
+#elif defined HAVE_BPF
+            sp = sendpacket_open_bpf(device, errbuf);
+#elif defined HAVE_LIBDNET
+            sp = sendpacket_open_libdnet(device, errbuf);
+#elif (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
+            sp = sendpacket_open_pcap(device, errbuf);
+#else
+#error "No defined packet injection method for sendpacket_open()"
+#endif
     }
 
-    sp->mmap_size = nmr.nr_memsize;
-
-    dbgx(1, "sendpacket_open_netmap: mapping %d Kbytes queues=%d",
-            sp->mmap_size >> 10, nmr.nr_tx_rings);
-    sp->mmap_addr = (struct netmap_d *)mmap (0, sp->mmap_size,
-            PROT_WRITE | PROT_READ, MAP_SHARED, sp->handle.fd, 0);
+    if (self >= 0)
+        netns_leave(self);
 
-    if (sp->mmap_addr == MAP_FAILED ) {
-        snprintf (errbuf, SENDPACKET_ERRBUF_SIZE, "mmap: %s", strerror (errno));
-        goto MMAP_FAILED;
+    if (sp) {
+        sp->open = 1;
+        sp->cache_dir = direction;
+        if (netns != NULL)
+            sp->netns = safe_strdup(netns);
     }
+    return sp;
+}
 
-    bzero (&nmr, sizeof(nmr));
-    strncpy (nmr.nr_name, device, sizeof(nmr.nr_name));
-    nmr.nr_version = NETMAP_API;
-    strlcpy (sp->device, device, sizeof(sp->device));
-    sp->nm_if = NETMAP_IF(sp->mmap_addr, nmr.nr_offset);
-    sp->nmr = nmr;
-    sp->handle_type = SP_TYPE_NETMAP;
+/**
+ * Get packet stats for the given sendpacket_t
+ */
+size_t
+sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size)
+{
+    size_t offset;
 
-    dbg(2, "Waiting 4 seconds for phy reset...");
-    sleep (4);
-    dbg(2, "Ready!");
+    assert(sp);
+    assert(buf);
 
-    if (nm_do_ioctl(sp, SIOCGIFFLAGS, 0) < 0)
-        goto NM_DO_IOCTL_FAILED;
+    memset(buf, 0, buf_size);
+    offset = snprintf(buf, buf_size, "Statistics for network device: %s\n"
+            "\tAttempted packets:         " COUNTER_SPEC "\n"
+            "\tSuccessful packets:        " COUNTER_SPEC "\n"
+            "\tSuccessful bytes:          " COUNTER_SPEC "\n"
+            "\tFailed packets:            " COUNTER_SPEC "\n"
+            "\tTruncated packets:         " COUNTER_SPEC "\n"
+            "\tRetried packets (ENOBUFS): " COUNTER_SPEC "\n"
+            "\tRetried packets (EAGAIN):  " COUNTER_SPEC "\n",
+            sp->device, sp->attempt, sp->sent, sp->bytes_sent, sp->failed, sp->trunc_packets,
+            sp->retry_enobufs, sp->retry_eagain);
 
-    if ((sp->if_flags & IFF_UP) == 0) {
-        dbgx(1, "%s is down, bringing up...", device);
-        sp->if_flags |= IFF_UP;
-    }
+    if (sp->blocked_ns && offset < buf_size)
+        offset += snprintf(&buf[offset], buf_size - offset,
+                "\tBlocked on backpressure:   %" PRIu64 ".%06" PRIu64 " sec\n",
+                (uint64_t)sp->blocked_ns / 1000000000ULL,
+                (uint64_t)(sp->blocked_ns % 1000000000ULL) / 1000);
 
-    /* set promiscuous mode */
-    sp->if_flags |= IFF_PROMISC;
-    if (nm_do_ioctl(sp, SIOCSIFFLAGS, 0) < 0)
-        goto NM_DO_IOCTL_FAILED;
+    if (sp->flow_packets && offset > 0) {
+        offset += snprintf(&buf[offset], buf_size - offset,
+                "\tFlows total:               " COUNTER_SPEC "\n"
+                "\tFlows unique:              " COUNTER_SPEC "\n"
+                "\tFlows expired:             " COUNTER_SPEC "\n"
+                "\tFlow packets:              " COUNTER_SPEC "\n"
+                "\tNon-flow packets:          " COUNTER_SPEC "\n"
+                "\tInvalid flow packets:      " COUNTER_SPEC "\n",
+                sp->flows, sp->flows_expired, sp->flows_expired, sp->flow_packets,
+                sp->flow_non_flow_packets, sp->flows_invalid_packets);
+    }
 
-#ifdef linux
-    /* disable:
-     * - generic-segmentation-offload
-     * - tcp-segmentation-offload
-     * - rx-checksumming
-     * - tx-checksumming
-     */
-    if (nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GGSO) < 0 ||
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GTSO) < 0 ||
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GRXCSUM) < 0 ||
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GTXCSUM) < 0)
-        goto NM_DO_IOCTL_FAILED;
+    if (sp->telemetry && sp->telemetry->call.count && offset < buf_size) {
+        sendpacket_telemetry_t *t = sp->telemetry;
+        char p50[32], p99[32], max[32];
 
-    sp->data = 0;
-    if (nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SGSO) < 0 ||
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STSO) < 0 ||
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SRXCSUM) < 0 ||
-            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STXCSUM))
-        goto NM_DO_IOCTL_FAILED;
+        offset += snprintf(&buf[offset], buf_size - offset,
+                "\tSend calls:                " COUNTER_SPEC " (p50 %s, p99 %s, max %s)\n",
+                t->call.count,
+                timing_hist_fmt(p50, sizeof(p50), timing_hist_percentile(&t->call, 50.0)),
+                timing_hist_fmt(p99, sizeof(p99), timing_hist_percentile(&t->call, 99.0)),
+                timing_hist_fmt(max, sizeof(max), t->call.max));
+        if (offset < buf_size)
+            offset += snprintf(&buf[offset], buf_size - offset,
+                    "\tStalled calls:             " COUNTER_SPEC " (total %s, p99 %s, max %s)\n",
+                    t->stall.count,
+                    timing_hist_fmt(p50, sizeof(p50), t->stall_ns),
+                    timing_hist_fmt(p99, sizeof(p99), timing_hist_percentile(&t->stall, 99.0)),
+                    timing_hist_fmt(max, sizeof(max), t->stall.max));
+        if (t->wait.count && offset < buf_size)
+            offset += snprintf(&buf[offset], buf_size - offset,
+                    "\tTX ring full waits:        " COUNTER_SPEC " (p50 %s, p99 %s, max %s)\n",
+                    t->wait.count,
+                    timing_hist_fmt(p50, sizeof(p50), timing_hist_percentile(&t->wait, 50.0)),
+                    timing_hist_fmt(p99, sizeof(p99), timing_hist_percentile(&t->wait, 99.0)),
+                    timing_hist_fmt(max, sizeof(max), t->wait.max));
+        if (t->ring.count && offset < buf_size)
+            offset += snprintf(&buf[offset], buf_size - offset,
+                    "\tTX ring slots in use:      p50 %" PRIu64 ", p99 %" PRIu64 ", max " COUNTER_SPEC "\n",
+                    timing_hist_percentile(&t->ring, 50.0),
+                    timing_hist_percentile(&t->ring, 99.0),
+                    t->ring.max);
+        if (offset > buf_size)
+            offset = buf_size - 1;
+    }
 
-#endif
+    return offset;
+}
 
-    notice("done!");
+/**
+ * close the given sendpacket
+ */
+int
+sendpacket_close(sendpacket_t *sp)
+{
+#ifdef HAVE_AF_XDP
+    int i;
+#endif
+
+    assert(sp);
+    switch(sp->handle_type) {
+        case SP_TYPE_KHIAL:
+            close(sp->handle.fd);
+            break;
+
+        case SP_TYPE_BPF:
+#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
+            close(sp->handle.fd);
+#endif
+            break;
+
+        case SP_TYPE_PF_PACKET:
+        case SP_TYPE_TX_RING:
+#ifdef HAVE_TX_RING
+            if (sp->tx_ring != NULL) {
+                /* don't drop frames that are still queued in the ring */
+                if (!sp->abort)
+                    txring_flush(sp->tx_ring, 1);
+                txring_close(sp->tx_ring);
+            }
+#endif
+#ifdef HAVE_PF_PACKET
+#ifdef HAVE_SO_TIMESTAMPING
+            if (sp->tx_hwtstamp_set)
+                sendpacket_hwtstamp(sp, sp->tx_hwtstamp_old, NULL);
+#endif
+            close(sp->handle.fd);
+#endif
+            break;
+
+        case SP_TYPE_LIBPCAP:
+#ifdef HAVE_LIBPCAP
+            pcap_close(sp->handle.pcap);
+#endif
+            break;
+
+        case SP_TYPE_LIBDNET:
+#ifdef HAVE_LIBDNET            
+            eth_close(sp->handle.ldnet);
+#endif
+            break;
+
+        case SP_TYPE_LIBNET:
+            err(-1, "Libnet is no longer supported!");
+            break;
+
+        case SP_TYPE_NULL:
+            break;
+
+        case SP_TYPE_AF_XDP:
+#ifdef HAVE_AF_XDP
+            /* give queued packets up to 100ms to leave before freeing the UMEM */
+            for (i = 0; i < 1000 && !sp->abort && sp->xdp_free_cnt < XDP_FRAME_NR; i++) {
+                xdp_commit(sp);
+                usleep(100);
+                xdp_reap(sp);
+            }
+            munmap(sp->xdp_tx.map, sp->xdp_tx.map_len);
+            munmap(sp->xdp_cq.map, sp->xdp_cq.map_len);
+            close(sp->handle.fd);
+            munmap(sp->xdp_umem, sp->xdp_umem_len);
+            safe_free(sp->xdp_free);
+#endif
+            break;
+
+        case SP_TYPE_DPDK:
+#ifdef HAVE_DPDK
+            /* the last handle on a port stops it, once the TX rings drained */
+            if (--dpdk_ports[sp->dpdk_port].open == 0) {
+                if (!sp->abort)
+                    usleep(100000);
+                rte_eth_dev_stop(sp->dpdk_port);
+                rte_eth_dev_close(sp->dpdk_port);
+            }
+#endif
+            break;
+
+        case SP_TYPE_IO_URING:
+#ifdef HAVE_IO_URING
+            /* let queued packets leave before their buffers are freed */
+            while (!sp->abort && sp->uring->free_cnt < URING_ENTRIES)
+                uring_commit(sp, 1);
+            uring_free(sp->uring);
+            close(sp->handle.fd);
+#endif
+            break;
+
+        case SP_TYPE_NETMAP:
+#ifdef HAVE_NETMAP
+            fprintf(stderr, "Switching network driver for %s to normal mode... ",
+                    sp->device);
+            fflush(NULL);
+              /* flush any remaining packets */
+            ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+
+#ifdef linux
+            /* restore original settings:
+             * - generic-segmentation-offload
+             * - tcp-segmentation-offload
+             * - rx-checksumming
+             * - tx-checksumming
+             */
+            if ((sp->data = sp->gso))
+                nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SGSO);
+            if ((sp->data = sp->tso))
+                nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STSO);
+            if ((sp->data = sp->rxcsum))
+                nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SRXCSUM);
+            if ((sp->data = sp->txcsum))
+                nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STXCSUM);
+#endif /* linux */
+
+            /* restore interface to normal mode */
+#if NETMAP_API < 10
+            ioctl(sp->handle.fd, NIOCUNREGIF, NULL);
+#endif
+            munmap(sp->mmap_addr, sp->mmap_size);
+            close(sp->handle.fd);
+            notice("done!");
+#endif /* HAVE_NETMAP */
+            break;
+
+        case SP_TYPE_NONE:
+            err(-1, "no injector selected!");
+            break;
+    }
+    safe_free(sp->telemetry);
+    safe_free(sp->netns);
+    safe_free(sp);
+    return 0;
+}
+
+/**
+ * returns the Layer 2 address of the interface current
+ * open.  on error, return NULL
+ */
+struct tcpr_ether_addr *
+sendpacket_get_hwaddr(sendpacket_t *sp)
+{
+    struct tcpr_ether_addr *addr;
+    assert(sp);
+
+    /* if we already have our MAC address stored, just return it */
+    if (memcmp(&sp->ether, "\x00\x00\x00\x00\x00\x00", ETHER_ADDR_LEN) != 0)
+        return &sp->ether;
+
+    if (sp->handle_type == SP_TYPE_KHIAL) {
+        addr = sendpacket_get_hwaddr_khial(sp);
+    } else if (sp->handle_type == SP_TYPE_NULL) {
+        sendpacket_seterr(sp, "Error: sendpacket_get_hwaddr() not supported for the null sink");
+        addr = NULL;
+    } else {    
+#if defined HAVE_PF_PACKET
+        addr = sendpacket_get_hwaddr_pf(sp);
+#elif defined HAVE_BPF
+        addr = sendpacket_get_hwaddr_bpf(sp);
+#elif defined HAVE_LIBDNET
+        addr = sendpacket_get_hwaddr_libdnet(sp);
+#elif (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
+        addr = sendpacket_get_hwaddr_pcap(sp);
+#endif
+    }
+    return addr;
+}
+
+/**
+ * returns the error string
+ */
+char *
+sendpacket_geterr(sendpacket_t *sp)
+{
+    assert(sp);
+    return sp->errbuf;
+}
+
+/**
+ * Set's the error string
+ */
+static void
+sendpacket_seterr(sendpacket_t *sp, const char *fmt, ...)
+{
+    va_list ap;
+
+    assert(sp);
+
+    va_start(ap, fmt);
+    if (fmt != NULL)
+        (void)vsnprintf(sp->errbuf, SENDPACKET_ERRBUF_SIZE, fmt, ap);
+    va_end(ap);
+
+    sp->errbuf[(SENDPACKET_ERRBUF_SIZE-1)] = '\0'; // be safe
+}
+
+
+#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET) && !(defined HAVE_PF_PACKET || defined BPF || defined HAVE_LIBDNET)
+/**
+ * Inner sendpacket_open() method for using libpcap
+ */
+static sendpacket_t *
+sendpacket_open_pcap(const char *device, char *errbuf)
+{
+    pcap_t *pcap;
+    sendpacket_t *sp;
+#ifdef BIOCSHDRCMPLT
+    u_int spoof_eth_src = 1;
+    int fd;
+#endif
+
+    assert(device);
+    assert(errbuf);
+
+    dbg(1, "sendpacket: using Libpcap");
+
+    /* open_pcap_live automatically fills out our errbuf for us */
+    if ((pcap = pcap_open_live(device, 0, 0, 0, errbuf)) == NULL)
+        return NULL;
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.pcap = pcap;
+
+#ifdef BIOCSHDRCMPLT
+    /* 
+     * Only systems using BPF on the backend need this... 
+     * other systems don't have ioctl and will get compile errors.
+     */
+    fd = pcap_get_selectable_fd(pcap);
+    if (ioctl(fd, BIOCSHDRCMPLT, &spoof_eth_src) == -1)
+        errx(-1, "Unable to enable source MAC spoof support: %s", strerror(errno));
+#endif
+    sp->handle_type = SP_TYPE_LIBPCAP;
+
+    return sp;
+}
+
+/**
+ * Get the hardware MAC address for the given interface using libpcap
+ */
+static struct tcpr_ether_addr *
+sendpacket_get_hwaddr_pcap(sendpacket_t *sp)
+{
+    assert(sp);
+    sendpacket_seterr(sp, "Error: sendpacket_get_hwaddr() not yet supported for pcap injection");
+    return NULL;
+}
+#endif /* HAVE_PCAP_INJECT || HAVE_PCAP_SENDPACKET */
+
+#if defined HAVE_LIBDNET
+/**
+ * Inner sendpacket_open() method for using libdnet
+ */
+static sendpacket_t * 
+sendpacket_open_libdnet(const char *device, char *errbuf)
+{
+    eth_t *ldnet;
+    sendpacket_t *sp;
+
+    assert(device);
+    assert(errbuf);
+
+    dbg(1, "sendpacket: using Libdnet");
+
+    if ((ldnet = eth_open(device)) == NULL)
+        return NULL;
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.ldnet = ldnet;
+    sp->handle_type = SP_TYPE_LIBDNET;    
+    return sp;    
+}
+
+/**
+ * Get the hardware MAC address for the given interface using libdnet
+ */
+static struct tcpr_ether_addr *
+sendpacket_get_hwaddr_libdnet(sendpacket_t *sp)
+{
+    struct tcpr_ether_addr *addr;
+    int ret;
+    assert(sp);
+
+    ret = eth_get(sp->handle.ldnet, (eth_addr_t *)addr);
+
+    if (addr == NULL || ret < 0) {
+        sendpacket_seterr(sp, "Error getting hwaddr via libdnet: %s", strerror(errno));
+        return NULL;
+    }
+
+    memcpy(&sp->ether, addr, sizeof(struct tcpr_ether_addr));
+    return(&sp->ether);
+}
+#endif /* HAVE_LIBDNET */
+
+#ifdef HAVE_NETMAP
+/**
+ * ioctl support for netmap
+ */
+static int nm_do_ioctl (sendpacket_t *sp, u_long what, int subcmd) {
+    struct ifreq ifr;
+    int error;
+    int fd;
+#ifdef linux
+    struct ethtool_value eval;
+#endif
+
+    assert(sp);
+
+    fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        dbg(1, "ioctl error: cannot get device control socket.\n");
+        return -1;
+    }
+
+    bzero (&ifr, sizeof(ifr));
+    strncpy (ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+
+    switch (what) {
+    case SIOCSIFFLAGS:
+        ifr.ifr_flags = sp->if_flags >> 16;
+        ifr.ifr_flags = sp->if_flags & 0xffff;
+        break;
+
+#ifdef linux
+    case SIOCETHTOOL:
+        eval.cmd = subcmd;
+        eval.data = sp->data;
+        ifr.ifr_data = (caddr_t)&eval;
+        dbgx(1, "ioctl SIOCETHTOOL subcmd=%d data=%u", subcmd, eval.data);
+        break;
+#endif
+    }
+
+    error = ioctl (fd, what, &ifr);
+    if (error)
+        goto done;
+
+    switch (what) {
+    case SIOCGIFFLAGS:
+        sp->if_flags = (ifr.ifr_flags << 16) | (0xffff & ifr.ifr_flags);
+        dbgx(1, "SIOCGIFFLAGS flags are 0x%x", sp->if_flags);
+        break;
+
+#ifdef linux
+    case SIOCETHTOOL:
+        switch (subcmd) {
+        case ETHTOOL_GGSO:
+            sp->gso = eval.data;
+            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GGSO=%u", eval.data);
+            break;
+
+        case ETHTOOL_GTSO:
+            sp->tso = eval.data;
+            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GTSO=%u", eval.data);
+            break;
+
+        case ETHTOOL_GRXCSUM:
+            sp->rxcsum = eval.data;
+            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GRXCSUM=%u", eval.data);
+            break;
+
+        case ETHTOOL_GTXCSUM:
+            sp->txcsum = eval.data;
+            dbgx(1, "ioctl SIOCETHTOOL ETHTOOL_GTXCSUM=%u", eval.data);
+            break;
+        }
+        break;
+#endif
+
+    }
+
+done:
+    close (fd);
+
+    if (error)
+        warnx("ioctl error %d %lu:%d", error, what, subcmd);
+    return error;
+}
+
+/**
+ * Returns 1 if the interface has link, 0 if not or -1 if it can't say
+ */
+static int
+nm_link_up(sendpacket_t *sp)
+{
+    struct ifreq ifr;
+    int fd, up = -1;
+#ifdef linux
+    struct ethtool_value eval;
+#endif
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+#ifdef linux
+    bzero(&ifr, sizeof(ifr));
+    strncpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+    eval.cmd = ETHTOOL_GLINK;
+    ifr.ifr_data = (caddr_t)&eval;
+    if (ioctl(fd, SIOCETHTOOL, &ifr) == 0)
+        up = eval.data != 0;
+#endif
+
+    /* drivers without ethtool link state still say if they're running */
+    if (up < 0) {
+        bzero(&ifr, sizeof(ifr));
+        strncpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+        if (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0)
+            up = (ifr.ifr_flags & IFF_RUNNING) != 0;
+    }
+
+    close(fd);
+    return up;
+}
+
+/**
+ * Waits for the link to come back after netmap takes over the card, rather
+ * than the fixed 4 seconds it used to get.  The link has to stay up for a
+ * while since the reset may only start after registering.  When the link
+ * state can't be read, the whole 4 seconds are waited out as before.
+ */
+static void
+nm_wait_link(sendpacket_t *sp)
+{
+    int waited, up = -1, up_ms = 0;
+
+    dbgx(2, "Waiting up to %d ms for phy reset...", NM_LINK_TIMEOUT_MS);
+
+    for (waited = 0; waited < NM_LINK_TIMEOUT_MS; waited += NM_LINK_POLL_MS) {
+        up = nm_link_up(sp);
+        up_ms = up > 0 ? up_ms + NM_LINK_POLL_MS : 0;
+        if (up_ms >= NM_LINK_SETTLE_MS) {
+            dbgx(2, "Ready after %d ms", waited);
+            return;
+        }
+
+        usleep(NM_LINK_POLL_MS * 1000);
+    }
+
+    if (up == 0)
+        warnx("%s: no link after %d ms", sp->device, NM_LINK_TIMEOUT_MS);
+}
+
+/**
+ * Returns true if device has a netmap capable driver.  Only asks the
+ * netmap device about it, the interface is left attached to the stack.
+ */
+bool
+sendpacket_netmap_capable(const char *device)
+{
+    struct nmreq nmr;
+    int fd;
+    bool capable;
+
+    assert(device);
+
+    if ((fd = open("/dev/netmap", O_RDWR)) < 0)
+        return false;
+
+    bzero(&nmr, sizeof(nmr));
+    strncpy(nmr.nr_name, device, sizeof(nmr.nr_name));
+    nmr.nr_version = NETMAP_API;
+    capable = ioctl(fd, NIOCGINFO, &nmr) == 0;
+    close(fd);
+
+    return capable;
+}
+
+/**
+ * Inner sendpacket_open() method for using Linux version of netmap
+ */
+static sendpacket_t *
+sendpacket_open_netmap(const char *device, char *errbuf)
+{
+    sendpacket_t *sp = NULL;
+    struct nmreq nmr;
+
+    assert(device);
+    assert(errbuf);
+
+    dbg(1, "sendpacket_open_netmap: using netmap");
+
+    /* prep & return our sp handle */
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+
+    /*
+     * Open the netmap device to fetch the number of queues of our
+     * interface.
+     *
+     * The first NIOCREGIF also detaches the card from the
+     * protocol stack and may cause a reset of the card,
+     * which in turn may take some time for the PHY to
+     * reconfigure.
+     */
+    if ((sp->handle.fd = open ("/dev/netmap", O_RDWR)) < 0) {
+        dbg(1, "sendpacket_open_netmap: Unable to access netmap");
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to access netmap.\n"
+                "See INSTALL to learn how to set up netmap-capable network drivers.");
+        goto OPEN_FAILED;
+    }
+
+    /*
+     * Register the interface on the netmap device: from now on,
+     * we can operate on the network interface without any
+     * interference from the legacy network stack.
+     *
+     * Cards take a long time to reset the PHY.
+     */
+    fprintf(stderr, "Switching network driver for %s to netmap bypass mode... ",
+            device);
+    fflush(NULL);
+
+    bzero (&nmr, sizeof(nmr));
+    strncpy (nmr.nr_name, device, sizeof(nmr.nr_name));
+    nmr.nr_version = NETMAP_API;
+
+    if (ioctl (sp->handle.fd, NIOCREGIF, &nmr) == -1) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Failure accessing netmap.\n"
+                "\tRequest for netmap version %u failed.\n\tMake sure netmap driver is version %u.\n\tError=%s\n",
+                NETMAP_API, NETMAP_API, strerror(errno));
+        goto NETMAP_UP_FAILED;
+    }
+
+    sp->mmap_size = nmr.nr_memsize;
+    sp->nm_tx_rings = nmr.nr_tx_rings ? nmr.nr_tx_rings : 1;
+
+    dbgx(1, "sendpacket_open_netmap: mapping %d Kbytes queues=%d",
+            sp->mmap_size >> 10, nmr.nr_tx_rings);
+    sp->mmap_addr = (struct netmap_d *)mmap (0, sp->mmap_size,
+            PROT_WRITE | PROT_READ, MAP_SHARED, sp->handle.fd, 0);
+
+    if (sp->mmap_addr == MAP_FAILED ) {
+        snprintf (errbuf, SENDPACKET_ERRBUF_SIZE, "mmap: %s", strerror (errno));
+        goto MMAP_FAILED;
+    }
+
+    bzero (&nmr, sizeof(nmr));
+    strncpy (nmr.nr_name, device, sizeof(nmr.nr_name));
+    nmr.nr_version = NETMAP_API;
+    strlcpy (sp->device, device, sizeof(sp->device));
+    sp->nm_if = NETMAP_IF(sp->mmap_addr, nmr.nr_offset);
+    sp->nmr = nmr;
+    sp->handle_type = SP_TYPE_NETMAP;
+
+    if (nm_do_ioctl(sp, SIOCGIFFLAGS, 0) < 0)
+        goto NM_DO_IOCTL_FAILED;
+
+    /* set promiscuous mode, and bring the interface up if it's down */
+    if ((sp->if_flags & (IFF_UP | IFF_PROMISC)) != (IFF_UP | IFF_PROMISC)) {
+        if ((sp->if_flags & IFF_UP) == 0)
+            dbgx(1, "%s is down, bringing up...", device);
+        sp->if_flags |= IFF_UP | IFF_PROMISC;
+        if (nm_do_ioctl(sp, SIOCSIFFLAGS, 0) < 0)
+            goto NM_DO_IOCTL_FAILED;
+    }
+
+#ifdef linux
+    /* disable:
+     * - generic-segmentation-offload
+     * - tcp-segmentation-offload
+     * - rx-checksumming
+     * - tx-checksumming
+     */
+    if (nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GGSO) < 0 ||
+            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GTSO) < 0 ||
+            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GRXCSUM) < 0 ||
+            nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_GTXCSUM) < 0)
+        goto NM_DO_IOCTL_FAILED;
+
+    /* only what's on is turned off, each change may reset the link again */
+    sp->data = 0;
+    if ((sp->gso && nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SGSO) < 0) ||
+            (sp->tso && nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STSO) < 0) ||
+            (sp->rxcsum && nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_SRXCSUM) < 0) ||
+            (sp->txcsum && nm_do_ioctl(sp, SIOCETHTOOL, ETHTOOL_STXCSUM)))
+        goto NM_DO_IOCTL_FAILED;
+
+#endif
+
+    /* the register and the changes above may have reset the PHY */
+    nm_wait_link(sp);
+
+    notice("done!");
+
+    return sp;
+
+NM_DO_IOCTL_FAILED:
+    snprintf (errbuf, SENDPACKET_ERRBUF_SIZE, "nm_do_ioctl: %s", strerror (errno));
+    munmap(sp->mmap_addr, sp->mmap_size);
+MMAP_FAILED:
+#if NETMAP_API < 10
+    ioctl(sp->handle.fd, NIOCUNREGIF, NULL);
+#endif
+NETMAP_UP_FAILED:
+    close (sp->handle.fd);
+OPEN_FAILED:
+    safe_free(sp);
+
+    notice("failed!");
+    return NULL;
+}
+#endif /* HAVE_NETMAP */
+
+#ifdef HAVE_AF_XDP
+/**
+ * map one of the AF_XDP rings shared with the kernel
+ */
+static int
+xdp_ring_map(int fd, xdp_ring_t *r, const struct xdp_ring_offset *off,
+        size_t entry_size, off_t pgoff)
+{
+    u_char *map;
+
+    r->map_len = off->desc + XDP_RING_SIZE * entry_size;
+    map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (map == MAP_FAILED)
+        return -1;
+
+    r->map = map;
+    r->producer = (volatile uint32_t *)(map + off->producer);
+    r->consumer = (volatile uint32_t *)(map + off->consumer);
+    r->flags = (volatile uint32_t *)(map + off->flags);
+    r->ring = map + off->desc;
+    r->cached_prod = *r->producer;
+    r->cached_cons = *r->consumer;
+
+    return 0;
+}
+
+/**
+ * Inner sendpacket_open() method for using Linux's AF_XDP
+ *
+ * Binds a TX only socket to queue 0 of the device.  Zero-copy mode is
+ * used if the driver supports it, else the kernel copies out of the UMEM.
+ */
+static sendpacket_t *
+sendpacket_open_af_xdp(const char *device, char *errbuf)
+{
+    sendpacket_t *sp;
+    struct xdp_umem_reg umem;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen;
+    unsigned int ifindex;
+    int n = XDP_RING_SIZE;
+    uint32_t i;
+
+    assert(device);
+    assert(errbuf);
+
+    dbg(1, "sendpacket: using AF_XDP");
+
+    if ((ifindex = if_nametoindex(device)) == 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unknown interface %s: %s",
+                device, strerror(errno));
+        return NULL;
+    }
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle_type = SP_TYPE_AF_XDP;
+
+    if ((sp->handle.fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "socket(AF_XDP): %s", strerror(errno));
+        goto SOCKET_FAILED;
+    }
+
+    /* UMEM must be page aligned */
+    sp->xdp_umem_len = (size_t)XDP_FRAME_SIZE * XDP_FRAME_NR;
+    sp->xdp_umem = mmap(NULL, sp->xdp_umem_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (sp->xdp_umem == MAP_FAILED) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to allocate UMEM: %s", strerror(errno));
+        goto UMEM_FAILED;
+    }
+
+    memset(&umem, 0, sizeof(umem));
+    umem.addr = (uintptr_t)sp->xdp_umem;
+    umem.len = sp->xdp_umem_len;
+    umem.chunk_size = XDP_FRAME_SIZE;
+    umem.headroom = 0;
+    if (setsockopt(sp->handle.fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "XDP_UMEM_REG: %s", strerror(errno));
+        goto RING_FAILED;
+    }
+
+    /* the kernel insists on a fill ring even though we never receive */
+    if (setsockopt(sp->handle.fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof(n)) < 0 ||
+            setsockopt(sp->handle.fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n, sizeof(n)) < 0 ||
+            setsockopt(sp->handle.fd, SOL_XDP, XDP_TX_RING, &n, sizeof(n)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to size AF_XDP rings: %s", strerror(errno));
+        goto RING_FAILED;
+    }
+
+    optlen = sizeof(off);
+    if (getsockopt(sp->handle.fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ||
+            optlen < sizeof(off)) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "XDP_MMAP_OFFSETS: %s",
+                optlen < sizeof(off) ? "kernel too old" : strerror(errno));
+        goto RING_FAILED;
+    }
+
+    if (xdp_ring_map(sp->handle.fd, &sp->xdp_tx, &off.tx, sizeof(struct xdp_desc),
+                XDP_PGOFF_TX_RING) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to map TX ring: %s", strerror(errno));
+        goto RING_FAILED;
+    }
+
+    if (xdp_ring_map(sp->handle.fd, &sp->xdp_cq, &off.cr, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_COMPLETION_RING) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to map completion ring: %s", strerror(errno));
+        goto CQ_FAILED;
+    }
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = 0;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    if (bind(sp->handle.fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        dbgx(1, "AF_XDP zero-copy unavailable on %s: %s", device, strerror(errno));
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        if (bind(sp->handle.fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+            snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to bind AF_XDP socket to %s: %s",
+                    device, strerror(errno));
+            goto BIND_FAILED;
+        }
+    }
+    sp->xdp_bind_flags = sxdp.sxdp_flags;
+
+    /* every chunk starts out owned by us */
+    sp->xdp_free = safe_malloc(sizeof(uint64_t) * XDP_FRAME_NR);
+    for (i = 0; i < XDP_FRAME_NR; i++)
+        sp->xdp_free[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    sp->xdp_free_cnt = XDP_FRAME_NR;
+
+    notice("AF_XDP: %s queue 0 in %s mode", device,
+            (sp->xdp_bind_flags & XDP_ZEROCOPY) ? "zero-copy" : "copy");
+
+    return sp;
+
+BIND_FAILED:
+    munmap(sp->xdp_cq.map, sp->xdp_cq.map_len);
+CQ_FAILED:
+    munmap(sp->xdp_tx.map, sp->xdp_tx.map_len);
+RING_FAILED:
+    munmap(sp->xdp_umem, sp->xdp_umem_len);
+UMEM_FAILED:
+    close(sp->handle.fd);
+SOCKET_FAILED:
+    safe_free(sp);
+    return NULL;
+}
+
+/**
+ * Take back the UMEM chunks of packets the kernel has finished sending.
+ * Returns the number of chunks reclaimed
+ */
+static uint32_t
+xdp_reap(sendpacket_t *sp)
+{
+    xdp_ring_t *cq = &sp->xdp_cq;
+    uint64_t *addrs = (uint64_t *)cq->ring;
+    uint32_t prod, cnt;
+
+    prod = *cq->producer;
+    __sync_synchronize();
+
+    for (cnt = 0; cq->cached_cons != prod; cnt++, cq->cached_cons++)
+        sp->xdp_free[sp->xdp_free_cnt++] = addrs[cq->cached_cons & (XDP_RING_SIZE - 1)];
+
+    if (cnt > 0) {
+        __sync_synchronize();
+        *cq->consumer = cq->cached_cons;
+    }
+
+    return cnt;
+}
+
+/**
+ * Wake the kernel up to process the TX ring, if it asked us to
+ */
+static void
+xdp_kick(sendpacket_t *sp)
+{
+    if (!(*sp->xdp_tx.flags & XDP_RING_NEED_WAKEUP))
+        return;
+
+    if (sendto(sp->handle.fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+        dbgx(1, "AF_XDP wakeup on %s failed: %s", sp->device, strerror(errno));
+}
+
+/**
+ * Copy a packet into a free UMEM chunk and add it to the TX ring.  The
+ * kernel won't see it until xdp_commit() is called.  Returns the number
+ * of bytes queued, or -1 with errno set to EAGAIN if no chunk or TX slot
+ * is free.
+ */
+static int
+xdp_queue(sendpacket_t *sp, const u_char *data, size_t len)
+{
+    xdp_ring_t *tx = &sp->xdp_tx;
+    struct xdp_desc *desc;
+    uint64_t addr;
+
+    if (sp->xdp_free_cnt == 0)
+        xdp_reap(sp);
+
+    if (tx->cached_prod - tx->cached_cons >= XDP_RING_SIZE) {
+        tx->cached_cons = *tx->consumer;
+        __sync_synchronize();
+    }
+
+    if (sp->xdp_free_cnt == 0 || tx->cached_prod - tx->cached_cons >= XDP_RING_SIZE) {
+        xdp_kick(sp);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (len > XDP_FRAME_SIZE) {
+        sendpacket_seterr(sp, "Truncating %zu byte packet to %d bytes for AF_XDP",
+                len, XDP_FRAME_SIZE);
+        len = XDP_FRAME_SIZE;
+    }
+
+    addr = sp->xdp_free[--sp->xdp_free_cnt];
+    memcpy(sp->xdp_umem + addr, data, len);
+
+    desc = &((struct xdp_desc *)tx->ring)[tx->cached_prod & (XDP_RING_SIZE - 1)];
+    desc->addr = addr;
+    desc->len = len;
+    desc->options = 0;
+    tx->cached_prod++;
+
+    return (int)len;
+}
+
+/**
+ * Publish queued descriptors to the kernel and reclaim completed chunks
+ */
+static void
+xdp_commit(sendpacket_t *sp)
+{
+    __sync_synchronize();
+    *sp->xdp_tx.producer = sp->xdp_tx.cached_prod;
+
+    xdp_kick(sp);
+    xdp_reap(sp);
+}
+#endif /* HAVE_AF_XDP */
+
+#ifdef HAVE_IO_URING
+/**
+ * map the SQ, CQ and SQE array of a new io_uring
+ */
+static int
+uring_map(uring_t *u, const struct io_uring_params *p)
+{
+    u_char *sq, *cq;
+
+    u->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    u->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_map_len = u->cq_map_len = max(u->sq_map_len, u->cq_map_len);
+
+    sq = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    u->sq_map = sq;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+    }
+    u->cq_map = cq;
+
+    u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return -1;
+    }
+
+    u->sq_head = (volatile uint32_t *)(sq + p->sq_off.head);
+    u->sq_tail = (volatile uint32_t *)(sq + p->sq_off.tail);
+    u->sq_flags = (volatile uint32_t *)(sq + p->sq_off.flags);
+    u->sq_mask = *(uint32_t *)(sq + p->sq_off.ring_mask);
+    u->sq_array = (uint32_t *)(sq + p->sq_off.array);
+    u->cq_head = (volatile uint32_t *)(cq + p->cq_off.head);
+    u->cq_tail = (volatile uint32_t *)(cq + p->cq_off.tail);
+    u->cq_mask = *(uint32_t *)(cq + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    return 0;
+}
+
+static void
+uring_free(uring_t *u)
+{
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_map != NULL && u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map != NULL)
+        munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    safe_free(u->bufs);
+    safe_free(u);
+}
+
+/**
+ * Inner sendpacket_open() method for sending through an io_uring
+ *
+ * Opens a plain PF_PACKET socket and an io_uring to send on it.  Where the
+ * kernel allows, a kernel thread polls the submission queue so queueing a
+ * packet takes no system call at all.
+ */
+static sendpacket_t *
+sendpacket_open_io_uring(const char *device, char *errbuf)
+{
+    sendpacket_t *sp;
+    uring_t *u;
+    struct io_uring_params p;
+    uint32_t i;
+
+    assert(device);
+    assert(errbuf);
+
+    dbg(1, "sendpacket: using io_uring");
+
+    if ((sp = sendpacket_open_pf(device, errbuf, false)) == NULL)
+        return NULL;
+
+    u = (uring_t *)safe_malloc(sizeof(uring_t));
+
+    /* SQPOLL needs CAP_SYS_NICE before Linux 5.11 */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = URING_SQPOLL_IDLE;
+    if ((u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        dbgx(1, "io_uring SQPOLL unavailable on %s: %s", device, strerror(errno));
+        memset(&p, 0, sizeof(p));
+        u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+
+    if (u->fd < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "io_uring_setup: %s", strerror(errno));
+        goto FAILED;
+    }
+    u->sqpoll = (p.flags & IORING_SETUP_SQPOLL) != 0;
+
+    if (uring_map(u, &p) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to map io_uring: %s", strerror(errno));
+        goto FAILED;
+    }
+
+    /* SQPOLL before Linux 5.11 only takes registered files */
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, &sp->handle.fd, 1) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "IORING_REGISTER_FILES: %s", strerror(errno));
+        goto FAILED;
+    }
+
+    /* the caller's packet may be gone before the kernel sends it, so it's copied */
+    u->bufs = safe_malloc((size_t)URING_ENTRIES * URING_FRAME_SIZE);
+    for (i = 0; i < URING_ENTRIES; i++)
+        u->free[i] = i;
+    u->free_cnt = URING_ENTRIES;
+
+    sp->uring = u;
+    sp->handle_type = SP_TYPE_IO_URING;
+
+    notice("io_uring: %s %s", device,
+            u->sqpoll ? "with a kernel submission thread" : "without a kernel submission thread");
+
+    return sp;
+
+FAILED:
+    uring_free(u);
+    close(sp->handle.fd);
+    safe_free(sp);
+    return NULL;
+}
+
+/**
+ * add a send of one of our buffers to the SQ
+ */
+static void
+uring_push(uring_t *u, uint16_t buf)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t idx = u->tail & u->sq_mask;
+
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;                /* the registered PF_PACKET socket */
+    sqe->addr = (uintptr_t)(u->bufs + (size_t)buf * URING_FRAME_SIZE);
+    sqe->len = u->lens[buf];
+    sqe->user_data = buf;
+    u->sq_array[idx] = idx;
+
+    u->tail++;
+    u->to_submit++;
+}
+
+/**
+ * Take back the buffers of completed sends.  Sends which ran out of
+ * socket buffers are queued again, failed ones are taken back out of the
+ * statistics they were counted in when queued.  Returns the number of
+ * buffers reclaimed
+ */
+static uint32_t
+uring_reap(sendpacket_t *sp)
+{
+    uring_t *u = sp->uring;
+    struct io_uring_cqe *cqe;
+    uint32_t head, tail, cnt = 0;
+    uint16_t buf;
+
+    head = *u->cq_head;
+    tail = *u->cq_tail;
+    __sync_synchronize();
+
+    for (; head != tail; head++) {
+        cqe = &u->cqes[head & u->cq_mask];
+        buf = (uint16_t)cqe->user_data;
+
+        if ((cqe->res == -EAGAIN || cqe->res == -ENOBUFS) && !sp->abort) {
+            if (cqe->res == -EAGAIN)
+                sp->retry_eagain ++;
+            else
+                sp->retry_enobufs ++;
+            uring_push(u, buf);
+            continue;
+        }
+
+        if (cqe->res != (int)u->lens[buf]) {
+            sp->sent --;
+            sp->bytes_sent -= u->lens[buf];
+            if (cqe->res < 0) {
+                sp->failed ++;
+                sendpacket_seterr(sp, "Error with io_uring [" COUNTER_SPEC "]: %s (errno = %d)",
+                        sp->sent + sp->failed, strerror(-cqe->res), -cqe->res);
+            } else {
+                sp->trunc_packets ++;
+                sendpacket_seterr(sp, "Only able to write %d bytes out of %u bytes total",
+                        cqe->res, u->lens[buf]);
+            }
+        }
+
+        u->free[u->free_cnt++] = buf;
+        cnt++;
+    }
+
+    __sync_synchronize();
+    *u->cq_head = head;
+
+    return cnt;
+}
+
+/**
+ * Copy a packet into a free buffer and queue a send of it.  The kernel
+ * won't see it until uring_commit() is called.  Returns the number of
+ * bytes queued, or -1 with errno set to EAGAIN if every buffer is in
+ * flight or EMSGSIZE if the packet doesn't fit a buffer.
+ */
+static int
+uring_queue(sendpacket_t *sp, const u_char *data, size_t len)
+{
+    uring_t *u = sp->uring;
+    uint16_t buf;
+
+    if (len > URING_FRAME_SIZE) {
+        sendpacket_seterr(sp, "%zu byte packet is too large for io_uring, max %d bytes",
+                len, URING_FRAME_SIZE);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (u->free_cnt == 0)
+        uring_reap(sp);
+
+    if (u->free_cnt == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    buf = u->free[--u->free_cnt];
+    memcpy(u->bufs + (size_t)buf * URING_FRAME_SIZE, data, len);
+    u->lens[buf] = len;
+    uring_push(u, buf);
+
+    return (int)len;
+}
+
+/**
+ * Publish queued sends to the kernel, wait for at least wait of them to
+ * complete, then reclaim the buffers of those which have.  With a kernel
+ * submission thread this only takes a system call to wake it up or to
+ * wait.
+ */
+static void
+uring_commit(sendpacket_t *sp, unsigned int wait)
+{
+    uring_t *u = sp->uring;
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret = 0;
+
+    __sync_synchronize();
+    *u->sq_tail = u->tail;
+    __sync_synchronize();
+
+    if (u->sqpoll) {
+        if (*u->sq_flags & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        u->to_submit = 0;
+        if (flags)
+            ret = syscall(__NR_io_uring_enter, u->fd, 0, wait, flags, NULL, 0);
+    } else if (u->to_submit || wait) {
+        ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait, flags, NULL, 0);
+        if (ret > 0)
+            u->to_submit -= min((uint32_t)ret, u->to_submit);
+    }
+
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        sendpacket_seterr(sp, "io_uring_enter: %s", strerror(errno));
+
+    uring_reap(sp);
+}
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_DPDK
+/**
+ * \brief Starts the DPDK environment abstraction layer
+ *
+ * eal_args holds the usual EAL command line arguments (cores, devices,
+ * ...) separated by whitespace.  Must be called before a DPDK port is
+ * opened.  Returns 0 on success, -1 and fills errbuf on error.
+ */
+int
+sendpacket_dpdk_init(const char *eal_args, char *errbuf)
+{
+    char *args, *tok, *save = NULL;
+    char *argv[64];
+    int argc = 0;
+
+    assert(errbuf);
+
+    if (dpdk_eal_started)
+        return 0;
+
+    /* the EAL may keep pointers into argv, so args is never freed */
+    args = safe_strdup(eal_args ? eal_args : "");
+    argv[argc++] = (char *)"tcpreplay";
+    for (tok = strtok_r(args, " \t", &save); tok != NULL && argc < 63;
+            tok = strtok_r(NULL, " \t", &save))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+
+    if (rte_eal_init(argc, argv) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "rte_eal_init: %s", rte_strerror(rte_errno));
+        return -1;
+    }
+
+    dpdk_eal_started = true;
+    return 0;
+}
+
+/**
+ * Configures and starts a DPDK port with up to DPDK_MAX_QUEUES TX queues
+ */
+static int
+dpdk_port_start(uint16_t port, char *errbuf)
+{
+    dpdk_port_t *p = &dpdk_ports[port];
+    struct rte_eth_dev_info info;
+    struct rte_eth_conf conf;
+    char name[RTE_MEMPOOL_NAMESIZE];
+    int socket = rte_eth_dev_socket_id(port);
+    uint16_t q;
+    int ret;
+
+    if ((ret = rte_eth_dev_info_get(port, &info)) != 0)
+        goto FAILED;
+
+    p->queues = min(info.max_tx_queues, DPDK_MAX_QUEUES);
+
+    /* some drivers won't start without an RX queue */
+    memset(&conf, 0, sizeof(conf));
+    if ((ret = rte_eth_dev_configure(port, 1, p->queues, &conf)) < 0)
+        goto FAILED;
+
+    /* enough mbufs to fill every ring twice over */
+    snprintf(name, sizeof(name), "tcpreplay_%u", port);
+    p->pool = rte_pktmbuf_pool_create(name,
+            2 * (DPDK_TX_DESC * p->queues + DPDK_RX_DESC) - 1, 256, 0,
+            RTE_MBUF_DEFAULT_BUF_SIZE, socket);
+    if (p->pool == NULL) {
+        ret = -rte_errno;
+        goto FAILED;
+    }
+
+    if ((ret = rte_eth_rx_queue_setup(port, 0, DPDK_RX_DESC, socket, NULL, p->pool)) < 0)
+        goto FAILED;
+
+    for (q = 0; q < p->queues; q++) {
+        if ((ret = rte_eth_tx_queue_setup(port, q, DPDK_TX_DESC, socket, NULL)) < 0)
+            goto FAILED;
+    }
+
+    if ((ret = rte_eth_dev_start(port)) < 0)
+        goto FAILED;
+
+    p->started = true;
+    return 0;
+
+FAILED:
+    snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to start DPDK port %u: %s",
+            port, rte_strerror(-ret));
+    return -1;
+}
+
+/**
+ * Inner sendpacket_open() method for DPDK ports
+ *
+ * device is a port number or a device name such as a PCI address.  Each
+ * open of a port transmits on a TX queue of its own, so the sending
+ * threads of --workers never contend for one.
+ */
+static sendpacket_t *
+sendpacket_open_dpdk(const char *device, char *errbuf)
+{
+    sendpacket_t *sp;
+    dpdk_port_t *p;
+    unsigned long n;
+    uint16_t port;
+    char *end;
+
+    assert(device);
+    assert(errbuf);
+
+    dbg(1, "sendpacket: using DPDK");
+
+    if (!dpdk_eal_started) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "%s", "DPDK EAL has not been started");
+        return NULL;
+    }
+
+    n = strtoul(device, &end, 10);
+    if (*device != '\0' && *end == '\0' && n < RTE_MAX_ETHPORTS) {
+        port = (uint16_t)n;
+    } else if (rte_eth_dev_get_port_by_name(device, &port) != 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unknown DPDK port %s", device);
+        return NULL;
+    }
+
+    if (!rte_eth_dev_is_valid_port(port)) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Invalid DPDK port %s", device);
+        return NULL;
+    }
+
+    p = &dpdk_ports[port];
+    if (!p->started && dpdk_port_start(port, errbuf) < 0)
+        return NULL;
+
+    if (p->next_queue == p->queues) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "All %u TX queues of DPDK port %s are in use",
+                p->queues, device);
+        return NULL;
+    }
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle_type = SP_TYPE_DPDK;
+    sp->handle.fd = -1;
+    sp->dpdk_port = port;
+    sp->dpdk_queue = p->next_queue++;
+    sp->dpdk_pool = p->pool;
+    p->open++;
+
+    rte_eth_macaddr_get(port, (struct rte_ether_addr *)&sp->ether);
+
+    notice("DPDK: port %u TX queue %u of %u", port, sp->dpdk_queue, p->queues);
+
+    return sp;
+}
+
+/**
+ * Copy up to DPDK_BURST packets into mbufs and transmit them, waiting for
+ * room in the TX ring.  retcodes[i] is set to the bytes of packet i that
+ * fit in its mbuf.  Returns the number of packets transmitted, which is
+ * only short of n if told to abort.
+ */
+static unsigned int
+dpdk_tx(sendpacket_t *sp, const struct iovec *iov, unsigned int n, int *retcodes)
+{
+    struct rte_mbuf *mbufs[DPDK_BURST];
+    unsigned int i, sent = 0;
+    uint16_t len;
+    char *p;
+
+    assert(n <= DPDK_BURST);
+
+    /* mbufs come back as the driver reclaims sent TX descriptors */
+    while (rte_pktmbuf_alloc_bulk(sp->dpdk_pool, mbufs, n) != 0) {
+        if (sp->abort)
+            return 0;
+        sp->retry_enobufs ++;
+        rte_eth_tx_done_cleanup(sp->dpdk_port, sp->dpdk_queue, 0);
+    }
+
+    for (i = 0; i < n; i++) {
+        len = min(iov[i].iov_len, rte_pktmbuf_tailroom(mbufs[i]));
+        if (len < iov[i].iov_len)
+            sendpacket_seterr(sp, "Truncating %zu byte packet to %u bytes for DPDK",
+                    iov[i].iov_len, len);
+        p = rte_pktmbuf_append(mbufs[i], len);
+        memcpy(p, iov[i].iov_base, len);
+        retcodes[i] = len;
+    }
+
+    sp->attempt += n;
+    while (sent < n) {
+        sent += rte_eth_tx_burst(sp->dpdk_port, sp->dpdk_queue, mbufs + sent, n - sent);
+        if (sent < n) {
+            /* TX ring full */
+            if (sp->abort)
+                break;
+            sp->retry_eagain ++;
+        }
+    }
+
+    for (i = sent; i < n; i++)
+        rte_pktmbuf_free(mbufs[i]);
+
+    return sent;
+}
+#endif /* HAVE_DPDK */
+
+#if defined HAVE_PF_PACKET
+/**
+ * Inner sendpacket_open() method for using Linux's PF_PACKET or TX_RING.
+ * use_ring is ignored unless TX_RING support is compiled in.
+ */
+static sendpacket_t *
+sendpacket_open_pf(const char *device, char *errbuf, bool use_ring)
+{
+    int mysocket;
+    sendpacket_t *sp;
+    struct ifreq ifr;
+    struct sockaddr_ll sa;
+    int n = 1, err;
+    socklen_t errlen = sizeof(err);
+#ifdef HAVE_TX_RING
+    unsigned int mtu;
+#endif
+
+    assert(device);
+    assert(errbuf);
+
+#if defined HAVE_TX_RING
+    if (use_ring)
+        dbg(1, "sendpacket: using TX_RING");
+    else
+#endif
+        dbg(1, "sendpacket: using PF_PACKET");
+
+    /* open our socket */
+    if ((mysocket = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "socket: %s", strerror(errno));
+        return NULL;
+    }
+
+
+    /* get the interface id for the device */
+    if ((sa.sll_ifindex = get_iface_index(mysocket, device, errbuf)) < 0) {
+        close(mysocket);
+        return NULL;
+    }
+
+    /* bind socket to our interface id */
+    sa.sll_family = AF_PACKET;
+    sa.sll_protocol = htons(ETH_P_ALL);
+    if (bind(mysocket, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "bind error: %s", strerror(errno));
+        close(mysocket);
+        return NULL;
+    }
+
+    /* check for errors, network down, etc... */
+    if (getsockopt(mysocket, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "error opening %s: %s", device,
+                 strerror(errno));
+        close(mysocket);
+        return NULL;
+    }
+
+    if (err > 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "error opening %s: %s", device,
+                 strerror(err));
+        close(mysocket);
+        return NULL;
+    }
+
+    /* get hardware type for our interface */
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+
+    if (ioctl(mysocket, SIOCGIFHWADDR, &ifr) < 0) {
+        close(mysocket);
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Error getting hardware type: %s", 
+                strerror(errno));
+        return NULL;
+    }
+
+    /* make sure it's not loopback (PF_PACKET doesn't support it) */
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+        warnx("Unsupported physical layer type 0x%04x on %s.  Maybe it works, maybe it wont."
+              "  See tickets #123/318", ifr.ifr_hwaddr.sa_family, device);
+
+#ifdef SO_BROADCAST
+    /*
+     * man 7 socket
+     *
+     * Set or get the broadcast flag. When  enabled,  datagram  sockets
+     * receive packets sent to a broadcast address and they are allowed
+     * to send packets to a broadcast  address.   This  option  has no
+     * effect on stream-oriented sockets.
+     */
+    if (setsockopt(mysocket, SOL_SOCKET, SO_BROADCAST, &n, sizeof(n)) == -1) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE,
+                "SO_BROADCAST: %s", strerror(errno));
+        close(mysocket);
+        return NULL;
+    }
+#endif  /*  SO_BROADCAST  */
+
+    /* prep & return our sp handle */
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = mysocket;
+
+#ifdef HAVE_TX_RING
+    if (!use_ring) {
+        sp->handle_type = SP_TYPE_PF_PACKET;
+        return sp;
+    }
+
+    /* Look up for MTU */
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+
+    if (ioctl(mysocket, SIOCGIFMTU, &ifr) < 0) {
+        close(mysocket);
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Error getting MTU: %s", strerror(errno));
+        return NULL;
+    }
+    mtu = ifr.ifr_ifru.ifru_mtu;
+
+    /* Init TX ring for sp->handle.fd socket */
+    if ((sp->tx_ring = txring_init(sp->handle.fd, mtu)) == NULL) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "txring_init: %s", strerror(errno));
+        close(mysocket);
+        return NULL;
+    }
+    sp->handle_type = SP_TYPE_TX_RING;
+#else
+    sp->handle_type = SP_TYPE_PF_PACKET;
+#endif
+    return sp;
+}
+
+/**
+ * get the interface index (necessary for sending packets w/ PF_PACKET)
+ */
+static int
+get_iface_index(int fd, const char *device, char *errbuf) {
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, (const char *)device, sizeof(ifr.ifr_name));
+
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "ioctl: %s", strerror(errno));
+        return (-1);
+    }
+
+    return ifr.ifr_ifindex;
+}
+
+/**
+ * get's the hardware address via Linux's PF packet interface
+ */
+static struct tcpr_ether_addr *
+sendpacket_get_hwaddr_pf(sendpacket_t *sp)
+{
+    struct ifreq ifr;
+    int fd;
+
+    assert(sp);
+
+    if (!sp->open) {
+        sendpacket_seterr(sp, "Unable to get hardware address on un-opened sendpacket handle");
+        return NULL;
+    }
+
+
+    /* create dummy socket for ioctl */
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        sendpacket_seterr(sp, "Unable to open dummy socket for get_hwaddr: %s", strerror(errno));
+        return NULL;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+
+    if (ioctl(fd, SIOCGIFHWADDR, (int8_t *)&ifr) < 0) {
+        close(fd);
+        sendpacket_seterr(sp, "Error getting hardware address: %s", strerror(errno));
+        return NULL;
+    }
+
+    memcpy(&sp->ether, &ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    close(fd);
+    return(&sp->ether);
+}
+#endif /* HAVE_PF_PACKET */
+
+#if defined HAVE_BPF
+/**
+ * Inner sendpacket_open() method for using BSD's BPF interface
+ */
+static sendpacket_t *
+sendpacket_open_bpf(const char *device, char *errbuf)
+{
+    sendpacket_t *sp;
+    char bpf_dev[10];
+    int dev, mysocket, link_offset, link_type;
+    struct ifreq ifr;
+    struct bpf_version bv;
+    u_int v;
+#if defined(BIOCGHDRCMPLT) && defined(BIOCSHDRCMPLT)
+    u_int spoof_eth_src = 1;
+#endif
+
+    assert(device);
+    assert(errbuf);
+    memset(&ifr, '\0', sizeof(struct ifreq));
+
+    dbg(1, "sendpacket: using BPF");
+    /* open socket */
+    mysocket = -1;
+    for (dev = 0; dev <= 9; dev ++) {
+        memset(bpf_dev, '\0', sizeof(bpf_dev));
+        snprintf(bpf_dev, sizeof(bpf_dev), "/dev/bpf%d", dev);
+        if ((mysocket = open(bpf_dev, O_RDWR, 0)) > 0) {
+            break;
+        }
+    }
+
+    /* error?? */
+    if (mysocket < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE,
+                 "Unable to open /dev/bpfX: %s", strerror(errno));
+        errbuf[SENDPACKET_ERRBUF_SIZE -1] = '\0';
+        return NULL;
+    }
+
+    /* get BPF version */
+    if (ioctl(mysocket, BIOCVERSION, (caddr_t)&bv) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to get bpf version: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (bv.bv_major != BPF_MAJOR_VERSION || bv.bv_minor != BPF_MINOR_VERSION) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Kernel's bpf version is out of date.");
+        return NULL;
+    }
+
+    /* attach to device */
+    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+    if (ioctl(mysocket, BIOCSETIF, (caddr_t)&ifr) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to bind %s to %s: %s",
+                 bpf_dev, device, strerror(errno));
+        return NULL;
+    }
+
+    /* get datalink type */
+    if (ioctl(mysocket, BIOCGDLT, (caddr_t)&v) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to get datalink type: %s",
+                 strerror(errno));
+        return NULL;
+    }
+
+    /*
+     *  NetBSD and FreeBSD BPF have an ioctl for enabling/disabling
+     *  automatic filling of the link level source address.
+     */
+#if defined(BIOCGHDRCMPLT) && defined(BIOCSHDRCMPLT)
+    if (ioctl(mysocket, BIOCSHDRCMPLT, &spoof_eth_src) == -1) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE,
+                 "Unable to enable spoofing src MAC: %s", strerror(errno));
+        return NULL;
+    }
+#endif
+
+    /* assign link type and offset */
+    switch (v) {
+    case DLT_SLIP:
+        link_offset = 0x10;
+        break;
+    case DLT_RAW:
+        link_offset = 0x0;
+        break;
+    case DLT_PPP:
+        link_offset = 0x04;
+        break;
+    case DLT_EN10MB:
+    default: /* default to Ethernet */
+        link_offset = 0xe;
+        break;
+    }
+#if _BSDI_VERSION - 0 > 199510
+    switch (v) {
+    case DLT_SLIP:
+        v = DLT_SLIP_BSDOS;
+        link_offset = 0x10;
+        break;
+    case DLT_PPP:
+        v = DLT_PPP_BSDOS;
+        link_offset = 0x04;
+        break;
+    }
+#endif
+
+    link_type = v;
+
+    /* allocate our sp handle, and return it */
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = mysocket;
+    //sp->link_type = link_type;
+    //sp->link_offset = link_offset;
+    sp->handle_type = SP_TYPE_BPF;
+
+    return sp;
+}
+
+/**
+ * Get the interface hardware MAC address when using BPF
+ */
+static struct tcpr_ether_addr *
+sendpacket_get_hwaddr_bpf(sendpacket_t *sp)
+{
+    int mib[6];
+    size_t len;
+    int8_t *buf, *next, *end;
+    struct if_msghdr *ifm;
+    struct sockaddr_dl *sdl;
+
+    assert(sp);
+
+    mib[0] = CTL_NET;
+    mib[1] = AF_ROUTE;
+    mib[2] = 0;
+    mib[3] = AF_LINK;
+    mib[4] = NET_RT_IFLIST;
+    mib[5] = 0;
+
+    if (sysctl(mib, 6, NULL, &len, NULL, 0) == -1) {
+        sendpacket_seterr(sp, "%s(): sysctl(): %s", __func__, strerror(errno));
+        return NULL;
+    }
+
+    buf = (int8_t *)safe_malloc(len);
+
+    if (sysctl(mib, 6, buf, &len, NULL, 0) == -1) {
+        sendpacket_seterr(sp, "%s(): sysctl(): %s", __func__, strerror(errno));
+        safe_free(buf);
+        return NULL;
+    }
+
+    end = buf + len;
+    for (next = buf; next < end; next += ifm->ifm_msglen) {
+        ifm = (struct if_msghdr *)next;
+        if (ifm->ifm_type == RTM_IFINFO) {
+            sdl = (struct sockaddr_dl *)(ifm + 1);
+            if (strncmp(&sdl->sdl_data[0], sp->device, sdl->sdl_len) == 0) {
+                memcpy(&sp->ether, LLADDR(sdl), ETHER_ADDR_LEN);
+                break;
+            }
+        }
+    }
+    safe_free(buf);
+    return(&sp->ether);
+}
+
+#endif /* HAVE_BPF */
+
+/**
+ * Get the NUMA node the network device is attached to.
+ * Return -1 if the platform doesn't report it or the device is not local
+ * to a particular node
+ */
+int
+sendpacket_get_numa_node(sendpacket_t *sp)
+{
+    int node = -1;
+#ifdef linux
+    char path[sizeof(sp->device) + 64];
+    FILE *f;
+
+    assert(sp);
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", sp->device);
+    if ((f = fopen(path, "r")) == NULL) {
+        dbgx(1, "Unable to read %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+
+    fclose(f);
+#endif
+    return node;
+}
+
+/**
+ * Get the DLT type of the opened sendpacket
+ * Return -1 if we can't figure it out, else return the DLT_ value
+ */
+int
+sendpacket_get_dlt(sendpacket_t *sp)
+{
+    int dlt = DLT_EN10MB;
+
+    if (sp->handle_type == SP_TYPE_KHIAL ||
+            sp->handle_type == SP_TYPE_NETMAP ||
+            sp->handle_type == SP_TYPE_AF_XDP ||
+            sp->handle_type == SP_TYPE_DPDK ||
+            sp->handle_type == SP_TYPE_NULL) {
+        /* always EN10MB */
+        ;
+    } else {
+#if defined HAVE_BPF
+    int rcode;
+
+    if ((rcode = ioctl(sp->handle.fd, BIOCGDLT, &dlt)) < 0) {
+        warnx("Unable to get DLT value for BPF device (%s): %s", sp->device, strerror(errno));
+        return(-1);
+    }
+#elif defined HAVE_PF_PACKET || defined HAVE_LIBDNET
+    /* use libpcap to get dlt */
+    pcap_t *pcap;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    int self = -1;
+
+    /* the device is only known by name in its own namespace */
+    if (sp->netns != NULL && (self = netns_enter(sp->netns, errbuf, sizeof(errbuf))) < 0) {
+        warnx("Unable to get DLT value for %s: %s", sp->device, errbuf);
+        return(-1);
+    }
+    pcap = pcap_open_live(sp->device, 65535, 0, 0, errbuf);
+    if (self >= 0)
+        netns_leave(self);
+    if (pcap == NULL) {
+        warnx("Unable to get DLT value for %s: %s", sp->device, errbuf);
+        return(-1);
+    }
+    dlt = pcap_datalink(pcap);
+    pcap_close(pcap);
+#elif defined HAVE_PCAP_SENDPACKET || defined HAVE_PCAP_INJECT
+    dlt = pcap_datalink(sp->handle.pcap);
+#endif
+    }
+    return dlt;
+}
+
+/**
+ * \brief Returns a string of the name of the injection method being used
+ */
+const char *
+sendpacket_get_method(sendpacket_t *sp)
+{
+    if (sp == NULL) {
+        return INJECT_METHOD;
+    } else if (sp->handle_type == SP_TYPE_KHIAL) {
+        return "khial";
+    } else if (sp->handle_type == SP_TYPE_NETMAP) {
+        return "netmap";
+    } else if (sp->handle_type == SP_TYPE_AF_XDP) {
+        return "AF_XDP";
+    } else if (sp->handle_type == SP_TYPE_IO_URING) {
+        return "PF_PACKET / io_uring";
+    } else if (sp->handle_type == SP_TYPE_DPDK) {
+        return "DPDK";
+    } else if (sp->handle_type == SP_TYPE_NULL) {
+        return "null";
+    } else {
+        return INJECT_METHOD;
+    }
+}
+
+/**
+ * Opens a character device for injecting packets directly into 
+ * your kernel via a custom driver
+ */
+static sendpacket_t *
+sendpacket_open_khial(const char *device, char *errbuf)
+{
+    int mysocket;
+    sendpacket_t *sp;
+
+    assert(device);
+    assert(errbuf);
+
+    if ((mysocket = open(device, O_WRONLY|O_EXCL)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "error opening khial device: %s", strerror(errno));
+        return NULL;
+    }
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = mysocket;
+    sp->handle_type = SP_TYPE_KHIAL;
+    sp->khial_dir = -1;
 
     return sp;
-
-NM_DO_IOCTL_FAILED:
-    snprintf (errbuf, SENDPACKET_ERRBUF_SIZE, "nm_do_ioctl: %s", strerror (errno));
-    munmap(sp->mmap_addr, sp->mmap_size);
-MMAP_FAILED:
-#if NETMAP_API < 10
-    ioctl(sp->handle.fd, NIOCUNREGIF, NULL);
-#endif
-NETMAP_UP_FAILED:
-    close (sp->handle.fd);
-OPEN_FAILED:
-    safe_free(sp);
-
-    notice("failed!");
-    return NULL;
 }
-#endif /* HAVE_NETMAP */
 
-#if defined HAVE_PF_PACKET
 /**
- * Inner sendpacket_open() method for using Linux's PF_PACKET or TX_RING
+ * Opens a sink which accounts for every packet as sent without making a
+ * syscall, so benchmarks can measure the replay loop on its own.  device
+ * is only used as the name in the statistics.
  */
 static sendpacket_t *
-sendpacket_open_pf(const char *device, char *errbuf)
+sendpacket_open_null(const char *device, char *errbuf)
 {
-    int mysocket;
     sendpacket_t *sp;
-    struct ifreq ifr;
-    struct sockaddr_ll sa;
-    int n = 1, err;
-    socklen_t errlen = sizeof(err);
-    unsigned int UNUSED(mtu) = 1500;
 
     assert(device);
     assert(errbuf);
 
-#if defined TX_RING
-    dbg(1, "sendpacket: using TX_RING");
-#else
-    dbg(1, "sendpacket: using PF_PACKET");
-#endif
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = -1;
+    sp->handle_type = SP_TYPE_NULL;
 
-    /* open our socket */
-    if ((mysocket = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "socket: %s", strerror(errno));
-        return NULL;
-    }
+    return sp;
+}
 
+/**
+ * Get the hardware MAC address for the given interface using khial
+ */
+static struct tcpr_ether_addr *
+sendpacket_get_hwaddr_khial(sendpacket_t *sp)
+{
+    assert(sp);
+    sendpacket_seterr(sp, "Error: sendpacket_get_hwaddr() not yet supported for character devices");
+    return NULL;
+}
 
-    /* get the interface id for the device */
-    if ((sa.sll_ifindex = get_iface_index(mysocket, device, errbuf)) < 0) {
-        close(mysocket);
-        return NULL;
-    }
+/**
+ * \brief Cause the currently running sendpacket() call to stop
+ */
+void
+sendpacket_abort(sendpacket_t *sp)
+{
+    assert(sp);
 
-    /* bind socket to our interface id */
-    sa.sll_family = AF_PACKET;
-    sa.sll_protocol = htons(ETH_P_ALL);
-    if (bind(mysocket, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "bind error: %s", strerror(errno));
-        close(mysocket);
-        return NULL;
-    }
+    sp->abort = true;
+}
 
-    /* check for errors, network down, etc... */
-    if (getsockopt(mysocket, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "error opening %s: %s", device,
-                 strerror(errno));
-        close(mysocket);
-        return NULL;
-    }
+/**
+ * \brief Pick the TX ring used by subsequent sendpacket() calls
+ *
+ * hash is usually the flow_hash() of the next packet, so that every
+ * packet of a flow leaves through the same hardware queue and stays in
+ * order.  Only netmap supports multiple rings; others always use ring 0.
+ * Returns the selected ring.
+ */
+uint32_t
+sendpacket_select_tx_ring(sendpacket_t *sp, uint32_t hash)
+{
+    assert(sp);
 
-    if (err > 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "error opening %s: %s", device,
-                 strerror(err));
-        close(mysocket);
-        return NULL;
+#ifdef HAVE_NETMAP
+    if (sp->handle_type == SP_TYPE_NETMAP && sp->nm_tx_rings > 1) {
+        sp->nm_tx_ring = hash % sp->nm_tx_rings;
+        return sp->nm_tx_ring;
     }
+#endif
 
-    /* get hardware type for our interface */
-    memset(&ifr, 0, sizeof(ifr));
-    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+    return 0;
+}
 
-    if (ioctl(mysocket, SIOCGIFHWADDR, &ifr) < 0) {
-        close(mysocket);
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Error getting hardware type: %s", 
-                strerror(errno));
-        return NULL;
-    }
+/**
+ * \brief Send PF_PACKET traffic straight to the driver
+ *
+ * Skips the kernel's queueing discipline layer (PACKET_QDISC_BYPASS,
+ * Linux 3.14+), which is much faster but bypasses any tc shaping
+ * configured on the interface.  Returns 0 on success, -1 if the platform
+ * or injection method doesn't support it.
+ */
+int
+sendpacket_set_qdisc_bypass(sendpacket_t *sp, bool value)
+{
+    assert(sp);
 
-    /* make sure it's not loopback (PF_PACKET doesn't support it) */
-    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
-        warnx("Unsupported physical layer type 0x%04x on %s.  Maybe it works, maybe it wont."
-              "  See tickets #123/318", ifr.ifr_hwaddr.sa_family, device);
+#if defined HAVE_PF_PACKET && defined PACKET_QDISC_BYPASS
+    if (sp->handle_type == SP_TYPE_PF_PACKET || sp->handle_type == SP_TYPE_TX_RING ||
+            sp->handle_type == SP_TYPE_IO_URING) {
+        int n = value ? 1 : 0;
 
-#ifdef SO_BROADCAST
-    /*
-     * man 7 socket
-     *
-     * Set or get the broadcast flag. When  enabled,  datagram  sockets
-     * receive packets sent to a broadcast address and they are allowed
-     * to send packets to a broadcast  address.   This  option  has no
-     * effect on stream-oriented sockets.
-     */
-    if (setsockopt(mysocket, SOL_SOCKET, SO_BROADCAST, &n, sizeof(n)) == -1) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE,
-                "SO_BROADCAST: %s", strerror(errno));
-        close(mysocket);
-        return NULL;
+        if (setsockopt(sp->handle.fd, SOL_PACKET, PACKET_QDISC_BYPASS, &n, sizeof(n)) < 0) {
+            sendpacket_seterr(sp, "PACKET_QDISC_BYPASS: %s", strerror(errno));
+            return -1;
+        }
+
+        return 0;
     }
-#endif  /*  SO_BROADCAST  */
+#endif
 
-    /* prep & return our sp handle */
-    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
-    strlcpy(sp->device, device, sizeof(sp->device));
-    sp->handle.fd = mysocket;
+    sendpacket_seterr(sp, "qdisc bypass is not supported by %s", sendpacket_get_method(sp));
+    return -1;
+}
 
-#ifdef HAVE_TX_RING
-    /* Look up for MTU */
-    memset(&ifr, 0, sizeof(ifr));
-    strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+/**
+ * \brief Have the kernel release PF_PACKET frames at their launch time
+ *
+ * Turns on SO_TXTIME (Linux 4.19+) against CLOCK_TAI.  From then on every
+ * packet is sent with the launch time last given to sendpacket_set_txtime()
+ * and it is up to the ETF qdisc, or the NIC when ETF offload is enabled, to
+ * hold the frame until then.  Only plain PF_PACKET sockets can do this; a
+ * TX_RING has no way to attach a timestamp to a frame.  Returns 0 on success,
+ * -1 on error.
+ */
+int
+sendpacket_enable_txtime(sendpacket_t *sp)
+{
+    assert(sp);
 
-    if (ioctl(mysocket, SIOCGIFMTU, &ifr) < 0) {
-        close(mysocket);
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Error getting MTU: %s", strerror(errno));
-        return NULL;
-    }
-    mtu = ifr.ifr_ifru.ifru_mtu;
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TXTIME
+    if (sp->handle_type == SP_TYPE_PF_PACKET) {
+        struct sock_txtime cfg;
 
-    /* Init TX ring for sp->handle.fd socket */
-    if ((sp->tx_ring = txring_init(sp->handle.fd, mtu)) == 0) { 
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "txring_init: %s", strerror(errno));
-        close(mysocket);
-        return NULL;
+#ifdef HAVE_PACKET_VNET_HDR
+        if (SENDPACKET_VNET(sp)) {
+            sendpacket_seterr(sp, "%s", "launch times can't be combined with checksum offload or GSO");
+            return -1;
+        }
+#endif
+
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.clockid = CLOCK_TAI;
+        if (setsockopt(sp->handle.fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0) {
+            sendpacket_seterr(sp, "SO_TXTIME: %s", strerror(errno));
+            return -1;
+        }
+
+        sp->txtime_enabled = true;
+        return 0;
     }
-    sp->handle_type = SP_TYPE_TX_RING;
-#else
-    sp->handle_type = SP_TYPE_PF_PACKET;
 #endif
-    return sp;
+
+    sendpacket_seterr(sp, "launch time scheduling is not supported by %s",
+            sendpacket_get_method(sp));
+    return -1;
 }
 
 /**
- * get the interface index (necessary for sending packets w/ PF_PACKET)
+ * \brief Leave TCP/UDP checksums to the kernel or the NIC
+ *
+ * Turns on PACKET_VNET_HDR so every PF_PACKET frame is preceded by a
+ * virtio_net_hdr.  sendpacket() fills it in for unfragmented TCP and UDP
+ * over IPv4/IPv6 in Ethernet frames, asking for the checksum to be
+ * completed from the L4 header onwards, and sends the pseudo-header sum in
+ * place of the checksum field, so the frame's own checksum doesn't matter
+ * (tcpedit_set_csum_offload() skips computing it).
+ * netmap and AF_XDP slots have no per-packet checksum flags, a TX_RING frame
+ * has no room for the header and SCM_TXTIME sends don't carry it, so only
+ * plain PF_PACKET sockets without launch times qualify.  Returns 0 on
+ * success, -1 on error.
  */
-static int
-get_iface_index(int fd, const char *device, char *errbuf) {
-    struct ifreq ifr;
+int
+sendpacket_set_csum_offload(sendpacket_t *sp, bool value)
+{
+    assert(sp);
 
-    memset(&ifr, 0, sizeof(ifr));
-    strlcpy(ifr.ifr_name, (const char *)device, sizeof(ifr.ifr_name));
+#if defined HAVE_PF_PACKET && defined HAVE_PACKET_VNET_HDR
+    if (sp->handle_type == SP_TYPE_PF_PACKET) {
+        int n = value ? 1 : 0;
 
-    if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "ioctl: %s", strerror(errno));
-        return (-1);
+#ifdef HAVE_SO_TXTIME
+        if (value && sp->txtime_enabled) {
+            sendpacket_seterr(sp, "%s", "checksum offload can't be combined with launch times");
+            return -1;
+        }
+#endif
+        /* GSO keeps the header on */
+        n = n || sp->gso;
+        if (setsockopt(sp->handle.fd, SOL_PACKET, PACKET_VNET_HDR, &n, sizeof(n)) < 0) {
+            sendpacket_seterr(sp, "PACKET_VNET_HDR: %s", strerror(errno));
+            return -1;
+        }
+
+        sp->csum_offload = value;
+        return 0;
     }
+#endif
 
-    return ifr.ifr_ifindex;
+    if (!value)
+        return 0;
+
+    sendpacket_seterr(sp, "checksum offload is not supported by %s",
+            sendpacket_get_method(sp));
+    return -1;
 }
 
 /**
- * get's the hardware address via Linux's PF packet interface
+ * \brief Have the kernel or NIC segment TCP packets longer than the MTU
+ *
+ * Turns on PACKET_VNET_HDR like sendpacket_set_csum_offload().  A TCP
+ * frame whose IP packet exceeds the interface MTU, as captured with
+ * TSO/GRO on, is then passed down whole with virtio_net_hdr GSO metadata:
+ * the NIC (TSO) or the kernel cuts it into MTU sized segments and fills
+ * in their checksums, so the capture's TCP checksum doesn't matter.
+ * Other frames go out unchanged.  Same restrictions as checksum offload.
+ * Returns 0 on success, -1 on error.
  */
-static struct tcpr_ether_addr *
-sendpacket_get_hwaddr_pf(sendpacket_t *sp)
+int
+sendpacket_set_gso(sendpacket_t *sp, bool value)
 {
-    struct ifreq ifr;
-    int fd;
-
     assert(sp);
 
-    if (!sp->open) {
-        sendpacket_seterr(sp, "Unable to get hardware address on un-opened sendpacket handle");
-        return NULL;
-    }
-
+#if defined HAVE_PF_PACKET && defined HAVE_PACKET_VNET_HDR
+    if (sp->handle_type == SP_TYPE_PF_PACKET) {
+        struct ifreq ifr;
+        int n = value || sp->csum_offload;
 
-    /* create dummy socket for ioctl */
-    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        sendpacket_seterr(sp, "Unable to open dummy socket for get_hwaddr: %s", strerror(errno));
-        return NULL;
-    }
+#ifdef HAVE_SO_TXTIME
+        if (value && sp->txtime_enabled) {
+            sendpacket_seterr(sp, "%s", "GSO can't be combined with launch times");
+            return -1;
+        }
+#endif
+        if (value) {
+            memset(&ifr, 0, sizeof(ifr));
+            strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+            if (ioctl(sp->handle.fd, SIOCGIFMTU, &ifr) < 0) {
+                sendpacket_seterr(sp, "SIOCGIFMTU: %s", strerror(errno));
+                return -1;
+            }
+            sp->gso_mtu = (uint32_t)ifr.ifr_mtu;
+        }
 
-    memset(&ifr, 0, sizeof(ifr));
-    strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+        if (setsockopt(sp->handle.fd, SOL_PACKET, PACKET_VNET_HDR, &n, sizeof(n)) < 0) {
+            sendpacket_seterr(sp, "PACKET_VNET_HDR: %s", strerror(errno));
+            return -1;
+        }
 
-    if (ioctl(fd, SIOCGIFHWADDR, (int8_t *)&ifr) < 0) {
-        close(fd);
-        sendpacket_seterr(sp, "Error getting hardware address: %s", strerror(errno));
-        return NULL;
+        sp->gso = value;
+        return 0;
     }
+#endif
 
-    memcpy(&sp->ether, &ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
-    close(fd);
-    return(&sp->ether);
+    if (!value)
+        return 0;
+
+    sendpacket_seterr(sp, "GSO is not supported by %s", sendpacket_get_method(sp));
+    return -1;
 }
-#endif /* HAVE_PF_PACKET */
 
-#if defined HAVE_BPF
 /**
- * Inner sendpacket_open() method for using BSD's BPF interface
+ * \brief Turns transmit telemetry on or off
+ *
+ * While on, every sendpacket() call is timed, calls which had to retry on
+ * EAGAIN/ENOBUFS or wait for TX ring space are timed again as stalls, and
+ * netmap/AF_XDP ring occupancy is sampled before each send.  The results
+ * are appended to sendpacket_getstat().  Turning it off discards them.
+ * Returns 0.
  */
-static sendpacket_t *
-sendpacket_open_bpf(const char *device, char *errbuf)
+int
+sendpacket_set_telemetry(sendpacket_t *sp, bool value)
 {
-    sendpacket_t *sp;
-    char bpf_dev[10];
-    int dev, mysocket, link_offset, link_type;
-    struct ifreq ifr;
-    struct bpf_version bv;
-    u_int v;
-#if defined(BIOCGHDRCMPLT) && defined(BIOCSHDRCMPLT)
-    u_int spoof_eth_src = 1;
-#endif
+    assert(sp);
 
-    assert(device);
-    assert(errbuf);
-    memset(&ifr, '\0', sizeof(struct ifreq));
+    if (value && sp->telemetry == NULL)
+        sp->telemetry = (sendpacket_telemetry_t *)safe_malloc(sizeof(*sp->telemetry));
+    else if (!value)
+        safe_free(sp->telemetry);
 
-    dbg(1, "sendpacket: using BPF");
-    /* open socket */
-    mysocket = -1;
-    for (dev = 0; dev <= 9; dev ++) {
-        memset(bpf_dev, '\0', sizeof(bpf_dev));
-        snprintf(bpf_dev, sizeof(bpf_dev), "/dev/bpf%d", dev);
-        if ((mysocket = open(bpf_dev, O_RDWR, 0)) > 0) {
-            break;
-        }
-    }
+    return 0;
+}
 
-    /* error?? */
-    if (mysocket < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE,
-                 "Unable to open /dev/bpfX: %s", strerror(errno));
-        errbuf[SENDPACKET_ERRBUF_SIZE -1] = '\0';
-        return NULL;
-    }
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TIMESTAMPING
+/**
+ * Sets the NIC's HWTSTAMP_TX_* mode, leaving its RX filter alone, and
+ * stores the mode it was in to old unless NULL.  Returns 0 on success,
+ * -1 if the driver can't timestamp or we aren't allowed to ask.
+ */
+static int
+sendpacket_hwtstamp(sendpacket_t *sp, int tx_type, int *old)
+{
+    struct hwtstamp_config cfg;
+    struct ifreq ifr;
 
-    /* get BPF version */
-    if (ioctl(mysocket, BIOCVERSION, (caddr_t)&bv) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to get bpf version: %s", strerror(errno));
-        return NULL;
-    }
+    memset(&ifr, 0, sizeof(ifr));
+    memset(&cfg, 0, sizeof(cfg));
+    strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+    ifr.ifr_data = (void *)&cfg;
 
-    if (bv.bv_major != BPF_MAJOR_VERSION || bv.bv_minor != BPF_MINOR_VERSION) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Kernel's bpf version is out of date.");
-        return NULL;
-    }
+    /* older drivers can only be set, in which case PTP's filter is lost */
+    if (ioctl(sp->handle.fd, SIOCGHWTSTAMP, &ifr) < 0)
+        memset(&cfg, 0, sizeof(cfg));
 
-    /* attach to device */
-    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
-    if (ioctl(mysocket, BIOCSETIF, (caddr_t)&ifr) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to bind %s to %s: %s",
-                 bpf_dev, device, strerror(errno));
-        return NULL;
-    }
+    if (old != NULL)
+        *old = cfg.tx_type;
 
-    /* get datalink type */
-    if (ioctl(mysocket, BIOCGDLT, (caddr_t)&v) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to get datalink type: %s",
-                 strerror(errno));
-        return NULL;
+    cfg.tx_type = tx_type;
+    if (ioctl(sp->handle.fd, SIOCSHWTSTAMP, &ifr) < 0) {
+        dbgx(1, "%s: SIOCSHWTSTAMP: %s", sp->device, strerror(errno));
+        return -1;
     }
 
-    /*
-     *  NetBSD and FreeBSD BPF have an ioctl for enabling/disabling
-     *  automatic filling of the link level source address.
-     */
-#if defined(BIOCGHDRCMPLT) && defined(BIOCSHDRCMPLT)
-    if (ioctl(mysocket, BIOCSHDRCMPLT, &spoof_eth_src) == -1) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE,
-                 "Unable to enable spoofing src MAC: %s", strerror(errno));
-        return NULL;
-    }
+    return 0;
+}
 #endif
 
-    /* assign link type and offset */
-    switch (v) {
-    case DLT_SLIP:
-        link_offset = 0x10;
-        break;
-    case DLT_RAW:
-        link_offset = 0x0;
-        break;
-    case DLT_PPP:
-        link_offset = 0x04;
-        break;
-    case DLT_EN10MB:
-    default: /* default to Ethernet */
-        link_offset = 0xe;
-        break;
-    }
-#if _BSDI_VERSION - 0 > 199510
-    switch (v) {
-    case DLT_SLIP:
-        v = DLT_SLIP_BSDOS;
-        link_offset = 0x10;
-        break;
-    case DLT_PPP:
-        v = DLT_PPP_BSDOS;
-        link_offset = 0x04;
-        break;
+/**
+ * \brief Turns transmit timestamps on or off
+ *
+ * Asks SO_TIMESTAMPING to report when each frame left: stamped by the NIC
+ * if SIOCSHWTSTAMP lets us turn its TX timestamping on, otherwise by the
+ * driver as it hands the frame to the NIC.  The reports queue up on the
+ * socket's error queue until sendpacket_tx_timestamps() reads them.  Only
+ * plain PF_PACKET sockets have an error queue to read; TX_RING, AF_XDP and
+ * netmap frames are never reported.  Returns 0 on success, -1 on error.
+ */
+int
+sendpacket_set_tx_timestamps(sendpacket_t *sp, bool value)
+{
+    assert(sp);
+
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TIMESTAMPING
+    if (sp->handle_type == SP_TYPE_PF_PACKET) {
+        int flags = 0;
+
+        if (value) {
+            if (sp->tx_hwtstamp_set ||
+                    sendpacket_hwtstamp(sp, HWTSTAMP_TX_ON, &sp->tx_hwtstamp_old) == 0) {
+                sp->tx_hwtstamp_set = true;
+                flags = SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+            } else {
+                flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+            }
+            /* no copy of the frame, and number the reports */
+            flags |= SOF_TIMESTAMPING_OPT_TSONLY | SOF_TIMESTAMPING_OPT_ID;
+        }
+
+        if (setsockopt(sp->handle.fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+            sendpacket_seterr(sp, "SO_TIMESTAMPING: %s", strerror(errno));
+            return -1;
+        }
+
+        if (!value && sp->tx_hwtstamp_set) {
+            sendpacket_hwtstamp(sp, sp->tx_hwtstamp_old, NULL);
+            sp->tx_hwtstamp_set = false;
+        }
+
+        dbgx(1, "%s: %s TX timestamps %s", sp->device,
+                (flags & SOF_TIMESTAMPING_TX_HARDWARE) ? "hardware" : "software",
+                value ? "on" : "off");
+        sp->tx_tstamp = flags;
+        sp->tx_tstamp_base = sp->sent;
+        return 0;
     }
 #endif
 
-    link_type = v;
-
-    /* allocate our sp handle, and return it */
-    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
-    strlcpy(sp->device, device, sizeof(sp->device));
-    sp->handle.fd = mysocket;
-    //sp->link_type = link_type;
-    //sp->link_offset = link_offset;
-    sp->handle_type = SP_TYPE_BPF;
+    if (!value)
+        return 0;
 
-    return sp;
+    sendpacket_seterr(sp, "transmit timestamps are not supported by %s",
+            sendpacket_get_method(sp));
+    return -1;
 }
 
 /**
- * Get the interface hardware MAC address when using BPF
+ * Returns the id the timestamp of the next frame sent will carry
  */
-static struct tcpr_ether_addr *
-sendpacket_get_hwaddr_bpf(sendpacket_t *sp)
+uint32_t
+sendpacket_tx_timestamp_next(sendpacket_t *sp)
 {
-    int mib[6];
-    size_t len;
-    int8_t *buf, *next, *end;
-    struct if_msghdr *ifm;
-    struct sockaddr_dl *sdl;
-
     assert(sp);
 
-    mib[0] = CTL_NET;
-    mib[1] = AF_ROUTE;
-    mib[2] = 0;
-    mib[3] = AF_LINK;
-    mib[4] = NET_RT_IFLIST;
-    mib[5] = 0;
-
-    if (sysctl(mib, 6, NULL, &len, NULL, 0) == -1) {
-        sendpacket_seterr(sp, "%s(): sysctl(): %s", __func__, strerror(errno));
-        return NULL;
-    }
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TIMESTAMPING
+    return (uint32_t)(sp->sent - sp->tx_tstamp_base);
+#else
+    return 0;
+#endif
+}
 
-    buf = (int8_t *)safe_malloc(len);
+/**
+ * \brief Reads back transmit timestamps, see sendpacket_set_tx_timestamps()
+ *
+ * Fills in up to max timestamps of frames that have left since the last
+ * call.  If there are none yet it waits up to timeout_ms for one.  Ids
+ * come from SOF_TIMESTAMPING_OPT_ID, which PF_PACKET sockets only fill in
+ * from Linux 5.16 on.  Returns how many were filled in, -1 on error.
+ */
+int
+sendpacket_tx_timestamps(sendpacket_t *sp, sendpacket_tstamp_t *ts, int max, int timeout_ms)
+{
+    assert(sp);
+    assert(ts);
+
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TIMESTAMPING
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *stamps;
+    struct sock_extended_err *serr;
+    struct timespec *when;
+    struct pollfd pfd;
+    char data[64];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                 CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_ll))];
+        struct cmsghdr align;
+    } control;
+    int cnt = 0;
+
+    if (!sp->tx_tstamp)
+        return 0;
+
+    while (cnt < max) {
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        if (recvmsg(sp->handle.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                sendpacket_seterr(sp, "MSG_ERRQUEUE: %s", strerror(errno));
+                return -1;
+            }
 
-    if (sysctl(mib, 6, buf, &len, NULL, 0) == -1) {
-        sendpacket_seterr(sp, "%s(): sysctl(): %s", __func__, strerror(errno));
-        safe_free(buf);
-        return NULL;
-    }
+            if (cnt || timeout_ms <= 0)
+                break;
 
-    end = buf + len;
-    for (next = buf; next < end; next += ifm->ifm_msglen) {
-        ifm = (struct if_msghdr *)next;
-        if (ifm->ifm_type == RTM_IFINFO) {
-            sdl = (struct sockaddr_dl *)(ifm + 1);
-            if (strncmp(&sdl->sdl_data[0], sp->device, sdl->sdl_len) == 0) {
-                memcpy(&sp->ether, LLADDR(sdl), ETHER_ADDR_LEN);
+            /* the error queue raises POLLERR, which needn't be asked for */
+            pfd.fd = sp->handle.fd;
+            pfd.events = 0;
+            if (poll(&pfd, 1, timeout_ms) <= 0)
                 break;
+
+            timeout_ms = 0;
+            continue;
+        }
+
+        when = NULL;
+        serr = NULL;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                /* ts[0] is the software stamp, ts[2] the NIC's */
+                stamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+                when = &stamps->ts[(sp->tx_tstamp & SOF_TIMESTAMPING_TX_HARDWARE) ? 2 : 0];
+            } else if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP) {
+                serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
             }
         }
+
+        if (when == NULL || (when->tv_sec == 0 && when->tv_nsec == 0) ||
+                serr == NULL || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+            continue;
+
+        ts[cnt].id = serr->ee_data;
+        ts[cnt].ns = (uint64_t)when->tv_sec * 1000000000 + when->tv_nsec;
+        cnt++;
     }
-    safe_free(buf);
-    return(&sp->ether);
-}
 
-#endif /* HAVE_BPF */
+    return cnt;
+#else
+    (void)max;
+    (void)timeout_ms;
+    return 0;
+#endif
+}
 
 /**
- * Get the DLT type of the opened sendpacket
- * Return -1 if we can't figure it out, else return the DLT_ value
+ * Sets how sp waits out EAGAIN and ENOBUFS, see sendpacket_backoff()
  */
-int
-sendpacket_get_dlt(sendpacket_t *sp)
+void
+sendpacket_set_backoff(sendpacket_t *sp, sendpacket_backoff_t backoff)
 {
-    int dlt = DLT_EN10MB;
+    assert(sp);
+    sp->backoff = backoff;
+}
 
-    if (sp->handle_type == SP_TYPE_KHIAL ||
-            sp->handle_type == SP_TYPE_NETMAP) {
-        /* always EN10MB */
-        ;
-    } else {
-#if defined HAVE_BPF
-    int rcode;
+/**
+ * \brief Sets the launch time of the following packets in CLOCK_TAI nsec
+ */
+void
+sendpacket_set_txtime(sendpacket_t *sp, uint64_t txtime)
+{
+    assert(sp);
 
-    if ((rcode = ioctl(sp->handle.fd, BIOCGDLT, &dlt)) < 0) {
-        warnx("Unable to get DLT value for BPF device (%s): %s", sp->device, strerror(errno));
-        return(-1);
-    }
-#elif defined HAVE_PF_PACKET || defined HAVE_LIBDNET
-    /* use libpcap to get dlt */
-    pcap_t *pcap;
-    char errbuf[PCAP_ERRBUF_SIZE];
-    if ((pcap = pcap_open_live(sp->device, 65535, 0, 0, errbuf)) == NULL) {
-        warnx("Unable to get DLT value for %s: %s", sp->device, errbuf);
-        return(-1);
-    }
-    dlt = pcap_datalink(pcap);
-    pcap_close(pcap);
-#elif defined HAVE_PCAP_SENDPACKET || defined HAVE_PCAP_INJECT
-    dlt = pcap_datalink(sp->handle.pcap);
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TXTIME
+    sp->txtime = txtime;
+#else
+    (void)txtime;   /* SO_TXTIME can never be enabled */
 #endif
-    }
-    return dlt;
 }
 
+#if defined HAVE_PF_PACKET && defined HAVE_SO_TXTIME
 /**
- * \brief Returns a string of the name of the injection method being used
+ * PF_PACKET: send one frame with its launch time attached as SCM_TXTIME
  */
-const char *
-sendpacket_get_method(sendpacket_t *sp)
+static int
+sendpacket_send_txtime(sendpacket_t *sp, const u_char *data, size_t len)
 {
-    if (sp == NULL) {
-        return INJECT_METHOD;
-    } else if (sp->handle_type == SP_TYPE_KHIAL) {
-        return "khial";
-    } else if (sp->handle_type == SP_TYPE_NETMAP) {
-        return "netmap";
-    } else {
-        return INJECT_METHOD;
-    }
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } control;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &sp->txtime, sizeof(uint64_t));
+
+    return (int)sendmsg(sp->handle.fd, &msg, 0);
 }
+#endif
 
+#if defined HAVE_PF_PACKET && defined HAVE_PACKET_VNET_HDR
 /**
- * Opens a character device for injecting packets directly into 
- * your kernel via a custom driver
+ * TCP or UDP pseudo-header sum of an IPv4 or IPv6 header, in network byte
+ * order, as the checksum field of a packet marked NEEDS_CSUM must hold it
  */
-static sendpacket_t *
-sendpacket_open_khial(const char *device, char *errbuf)
+static uint16_t
+sendpacket_pseudo_sum(const u_char *ip, bool ip6, uint8_t proto, uint32_t l4_len)
 {
-    int mysocket;
-    sendpacket_t *sp;
+    const u_char *addr = ip6 ? ip + 8 : ip + 12;     /* source, then destination */
+    int addr_len = ip6 ? 32 : 8;
+    uint32_t sum = proto + (l4_len >> 16) + (l4_len & 0xffff);
+    int i;
 
-    assert(device);
-    assert(errbuf);
+    for (i = 0; i < addr_len; i += 2)
+        sum += (addr[i] << 8) | addr[i + 1];
 
-    if ((mysocket = open(device, O_WRONLY|O_EXCL)) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "error opening khial device: %s", strerror(errno));
-        return NULL;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons((uint16_t)sum);
+}
+
+/**
+ * PF_PACKET: build the virtio_net_hdr for an Ethernet frame.  With checksum
+ * offload the checksum is only marked as partial for whole, unfragmented
+ * TCP/UDP packets whose L4 header directly follows the IP header.  With
+ * GSO, such TCP packets longer than the MTU get the segmentation metadata.
+ * The checksum field of a marked packet has to be replaced by *pseudo,
+ * whatever it held: the offset of the field is returned, else 0.
+ * Everything else goes out as is.
+ */
+static size_t
+sendpacket_vnet_hdr(sendpacket_t *sp, const u_char *data, size_t len,
+        struct virtio_net_hdr *vh, uint16_t *pseudo)
+{
+    size_t l3, l4, ip_len, th_len;
+    uint16_t proto;
+    int csum_off;
+
+    memset(vh, 0, sizeof(*vh));
+    vh->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+    if (len < TCPR_ETH_H)
+        return 0;
+
+    l3 = TCPR_ETH_H;
+    proto = (data[12] << 8) | data[13];
+    while ((proto == ETHERTYPE_VLAN || proto == 0x88a8) && len >= l3 + 4) {
+        proto = (data[l3 + 2] << 8) | data[l3 + 3];
+        l3 += 4;
     }
 
-    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
-    strlcpy(sp->device, device, sizeof(sp->device));
-    sp->handle.fd = mysocket;
-    sp->handle_type = SP_TYPE_KHIAL;
+    if (proto == ETHERTYPE_IP && len >= l3 + TCPR_IPV4_H) {
+        const u_char *ip = data + l3;
 
+        if ((ip[0] >> 4) != 4 || (ip[0] & 0x0f) < 5)
+            return 0;
 
-    return sp;
+        /* any fragment, including the first, is summed over the datagram */
+        if (((ip[6] << 8) | ip[7]) & (IP_MF | IP_OFFMASK))
+            return 0;
+
+        l4 = l3 + ((ip[0] & 0x0f) << 2);
+        ip_len = (ip[2] << 8) | ip[3];
+        proto = ip[9];
+        if (l3 + ip_len > len || l4 > l3 + ip_len)
+            return 0;
+    } else if (proto == ETHERTYPE_IP6 && len >= l3 + TCPR_IPV6_H) {
+        const u_char *ip6 = data + l3;
+
+        if ((ip6[0] >> 4) != 6)
+            return 0;
+
+        l4 = l3 + TCPR_IPV6_H;
+        ip_len = TCPR_IPV6_H + ((ip6[4] << 8) | ip6[5]);
+        proto = ip6[6];
+        if (l3 + ip_len > len)
+            return 0;
+    } else {
+        return 0;
+    }
+
+    switch (proto) {
+        case IPPROTO_TCP:
+            csum_off = 16;
+            if (l3 + ip_len < l4 + TCPR_TCP_H)
+                return 0;
+            break;
+
+        case IPPROTO_UDP:
+            csum_off = 6;
+            if (l3 + ip_len < l4 + TCPR_UDP_H)
+                return 0;
+            break;
+
+        default:
+            return 0;
+    }
+
+    /* a TSO/GRO super-packet: cut into segments of at most the MTU */
+    if (sp->gso && proto == IPPROTO_TCP && ip_len > sp->gso_mtu) {
+        th_len = (data[l4 + 12] >> 4) << 2;
+        if (th_len >= TCPR_TCP_H && l4 + th_len <= l3 + ip_len &&
+                l4 - l3 + th_len < sp->gso_mtu) {
+            vh->gso_type = (data[l3] >> 4) == 4 ?
+                    VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+            vh->gso_size = (uint16_t)(sp->gso_mtu - (l4 - l3) - th_len);
+            vh->hdr_len = (uint16_t)(l4 + th_len);
+            vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            vh->csum_start = (uint16_t)l4;
+            vh->csum_offset = (uint16_t)csum_off;
+            *pseudo = sendpacket_pseudo_sum(data + l3, vh->gso_type == VIRTIO_NET_HDR_GSO_TCPV6,
+                    IPPROTO_TCP, (uint32_t)(l3 + ip_len - l4));
+            return l4 + csum_off;
+        }
+    }
+
+    if (!sp->csum_offload)
+        return 0;
+
+    vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vh->csum_start = (uint16_t)l4;
+    vh->csum_offset = (uint16_t)csum_off;
+    *pseudo = sendpacket_pseudo_sum(data + l3, (data[l3] >> 4) == 6, (uint8_t)proto,
+            (uint32_t)(l3 + ip_len - l4));
+    return l4 + csum_off;
 }
 
 /**
- * Get the hardware MAC address for the given interface using khial
+ * PF_PACKET: the iovecs of a frame behind its virtio_net_hdr, splitting
+ * out the checksum field of a marked packet so *pseudo is sent instead of it
+ * without touching the frame.  iov needs room for 4, returns how many
+ * were used.
  */
-static struct tcpr_ether_addr *
-sendpacket_get_hwaddr_khial(sendpacket_t *sp)
+static int
+sendpacket_vnet_iov(sendpacket_t *sp, const u_char *data, size_t len,
+        struct virtio_net_hdr *vh, uint16_t *pseudo, struct iovec *iov)
 {
-    assert(sp);
-    sendpacket_seterr(sp, "Error: sendpacket_get_hwaddr() not yet supported for character devices");
-    return NULL;
+    size_t csum;
+
+    csum = sendpacket_vnet_hdr(sp, data, len, vh, pseudo);
+    iov[0].iov_base = vh;
+    iov[0].iov_len = sizeof(*vh);
+    iov[1].iov_base = (void *)data;
+    if (csum == 0) {
+        iov[1].iov_len = len;
+        return 2;
+    }
+
+    iov[1].iov_len = csum;
+    iov[2].iov_base = pseudo;
+    iov[2].iov_len = sizeof(*pseudo);
+    iov[3].iov_base = (void *)(data + csum + sizeof(*pseudo));
+    iov[3].iov_len = len - csum - sizeof(*pseudo);
+    return 4;
 }
 
 /**
- * \brief Cause the currently running sendpacket() call to stop
+ * PF_PACKET: send one frame behind its virtio_net_hdr.  Returns the number
+ * of bytes of the frame which were sent, like send().
  */
-void
-sendpacket_abort(sendpacket_t *sp)
+static int
+sendpacket_send_vnet(sendpacket_t *sp, const u_char *data, size_t len)
 {
-    assert(sp);
+    struct virtio_net_hdr vh;
+    struct msghdr msg;
+    struct iovec iov[4];
+    uint16_t pseudo;
+    int retcode;
 
-    sp->abort = true;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = sendpacket_vnet_iov(sp, data, len, &vh, &pseudo, iov);
+
+    retcode = (int)sendmsg(sp->handle.fd, &msg, 0);
+    if (retcode >= (int)sizeof(vh))
+        retcode -= sizeof(vh);
+
+    return retcode;
 }
+#endif
@@ -20,6 +20,9 @@
 
 #include "config.h"
 #include "defines.h"
+#include "timing_hist.h"
+
+#include <sys/uio.h>
 
 #if defined HAVE_NETMAP
 #include <net/if.h>
@@ -27,12 +30,25 @@
 #include <net/netmap_user.h>
 #endif
 
-#ifdef HAVE_PF_PACKET
-#include <netpacket/packet.h>
+#ifdef HAVE_AF_XDP
+#include <linux/if_xdp.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_DPDK
+#include <rte_eal.h>
+#include <rte_errno.h>
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
 #endif
 
 #ifdef HAVE_TX_RING
-#include "txring.h"
+#include "txring.h"     /* in place of <netpacket/packet.h> */
+#elif defined HAVE_PF_PACKET
+#include <netpacket/packet.h>
 #endif
 
 #ifdef HAVE_LIBDNET
@@ -62,6 +78,10 @@ typedef enum sendpacket_type_e {
     SP_TYPE_TX_RING,
     SP_TYPE_KHIAL,
     SP_TYPE_NETMAP,
+    SP_TYPE_AF_XDP,
+    SP_TYPE_IO_URING,   /* PF_PACKET socket fed through an io_uring */
+    SP_TYPE_DPDK,
+    SP_TYPE_NULL,       /* discards every packet, for benchmarks */
 } sendpacket_type_t;
 
 /* these are the file_operations ioctls */
@@ -85,6 +105,99 @@ union sendpacket_handle {
 
 #define SENDPACKET_ERRBUF_SIZE 1024
 #define NETMAP_BACKOFF (1 << 4)     /* 16 - must be power of 2 */
+#define SENDPACKET_BATCH_MAX 256    /* max packets per sendpacket_batch() syscall */
+
+/* what to do when the device pushes back with EAGAIN or ENOBUFS */
+typedef enum sendpacket_backoff_e {
+    SP_BACKOFF_ADAPTIVE,    /* spin, then yield, then wait on the device */
+    SP_BACKOFF_SPIN,        /* retry straight away */
+    SP_BACKOFF_YIELD,       /* give up the CPU between retries */
+    SP_BACKOFF_POLL,        /* wait on the device between retries */
+} sendpacket_backoff_t;
+
+#define BACKOFF_SPINS           8       /* adaptive: immediate retries */
+#define BACKOFF_YIELDS          8       /* adaptive: then sched_yield() retries */
+#define BACKOFF_POLL_MS         1       /* longest poll() for POLLOUT */
+#define BACKOFF_SLEEP_NS        1000    /* first sleep when the device looks writable */
+#define BACKOFF_SLEEP_SHIFT_MAX 10      /* sleeps double up to ~1ms */
+
+#ifdef HAVE_AF_XDP
+#define XDP_FRAME_SIZE  4096        /* UMEM chunk, also the max packet size */
+#define XDP_FRAME_NR    4096        /* # of chunks in the UMEM */
+#define XDP_RING_SIZE   2048        /* TX and completion ring entries */
+
+/* one of the rings an AF_XDP socket shares with the kernel */
+typedef struct xdp_ring_s {
+    volatile uint32_t *producer;
+    volatile uint32_t *consumer;
+    volatile uint32_t *flags;
+    void *ring;
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    void *map;
+    size_t map_len;
+} xdp_ring_t;
+#endif
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES       256     /* SQ entries, also the # of send buffers */
+#define URING_FRAME_SIZE    16384   /* send buffer, also the max packet size */
+#define URING_SQPOLL_IDLE   1000    /* msec before the SQPOLL thread sleeps */
+
+/* an io_uring, its rings mapped from the kernel */
+typedef struct uring_s {
+    int fd;
+    bool sqpoll;                /* kernel thread polls the SQ, no submit syscall */
+    volatile uint32_t *sq_head;
+    volatile uint32_t *sq_tail;
+    volatile uint32_t *sq_flags;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t tail;              /* our SQ tail, published by uring_commit() */
+    uint32_t to_submit;         /* SQEs queued since the last io_uring_enter() */
+    volatile uint32_t *cq_head;
+    volatile uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;               /* == sq_map with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_map_len;
+    size_t sqes_len;
+    u_char *bufs;               /* URING_ENTRIES buffers of URING_FRAME_SIZE */
+    uint32_t lens[URING_ENTRIES];
+    uint16_t free[URING_ENTRIES];   /* buffers not owned by the kernel */
+    uint32_t free_cnt;
+} uring_t;
+#endif
+
+#ifdef HAVE_DPDK
+#define DPDK_MAX_QUEUES     8       /* TX queues set up on each port */
+#define DPDK_TX_DESC        1024    /* descriptors per TX queue */
+#define DPDK_RX_DESC        128     /* the one RX queue, which is never read */
+#define DPDK_BURST          32      /* mbufs per rte_eth_tx_burst() */
+#endif
+
+/*
+ * optional transmit telemetry, see sendpacket_set_telemetry().  All the
+ * histograms are in nsec except ring, which counts occupied slots.
+ */
+typedef struct sendpacket_telemetry_s {
+    timing_hist_t call;         /* duration of every sendpacket() call */
+    timing_hist_t stall;        /* duration of calls which had to retry */
+    timing_hist_t wait;         /* netmap poll() for TX ring space */
+    timing_hist_t ring;         /* TX ring slots in use before a send */
+    COUNTER stall_ns;           /* total time spent in stalled calls */
+    COUNTER waits;              /* # of times the TX ring was full */
+    COUNTER ring_last;          /* most recent ring sample */
+} sendpacket_telemetry_t;
+
+/* a transmit timestamp read back by sendpacket_tx_timestamps() */
+typedef struct sendpacket_tstamp_s {
+    uint32_t id;                /* frames sent before it since timestamps were turned on */
+    uint64_t ns;                /* when it left, NIC clock or CLOCK_REALTIME */
+} sendpacket_tstamp_t;
 
 struct sendpacket_s {
     tcpr_dir_t cache_dir;
@@ -107,12 +220,19 @@ struct sendpacket_s {
     sendpacket_type_t handle_type;
     union sendpacket_handle handle;
     struct tcpr_ether_addr ether;
+    sendpacket_telemetry_t *telemetry;  /* NULL unless enabled */
+    sendpacket_backoff_t backoff;
+    COUNTER blocked_ns;     /* time spent backing off, bar spinning */
+    int khial_dir;          /* khial: direction last set, -1 for none */
+    char *netns;            /* network namespace of the device, NULL for ours */
 #ifdef HAVE_NETMAP
     struct netmap_if *nm_if;
     struct nmreq nmr;
     void *mmap_addr;
     int mmap_size;
     uint32_t if_flags;
+    uint32_t nm_tx_rings;       /* # of hardware TX rings registered */
+    uint32_t nm_tx_ring;        /* ring sendpacket() currently writes to */
 #ifdef linux
     uint32_t data;
     uint32_t gso;
@@ -121,8 +241,40 @@ struct sendpacket_s {
     uint32_t txcsum;
 #endif /* linux */
 #endif /* HAVE_NETMAP */
+#ifdef HAVE_AF_XDP
+    u_char *xdp_umem;           /* packet buffers shared with the NIC */
+    size_t xdp_umem_len;
+    uint64_t *xdp_free;         /* UMEM chunks not owned by the kernel */
+    uint32_t xdp_free_cnt;
+    uint32_t xdp_bind_flags;    /* XDP_ZEROCOPY or XDP_COPY */
+    xdp_ring_t xdp_tx;
+    xdp_ring_t xdp_cq;
+#endif
+#ifdef HAVE_IO_URING
+    uring_t *uring;
+#endif
+#ifdef HAVE_DPDK
+    uint16_t dpdk_port;
+    uint16_t dpdk_queue;        /* TX queue of its own, never shared */
+    struct rte_mempool *dpdk_pool;
+#endif
 #ifdef HAVE_PF_PACKET
     struct sockaddr_ll sa;
+#ifdef HAVE_SO_TXTIME
+    bool txtime_enabled;
+    uint64_t txtime;            /* SCM_TXTIME launch time, CLOCK_TAI nsec */
+#endif
+#ifdef HAVE_SO_TIMESTAMPING
+    int tx_tstamp;              /* SOF_TIMESTAMPING_* asked for, 0 when off */
+    COUNTER tx_tstamp_base;     /* sent when they were turned on */
+    bool tx_hwtstamp_set;       /* we turned on the NIC's TX timestamping */
+    int tx_hwtstamp_old;        /* and its HWTSTAMP_TX_* before that */
+#endif
+#ifdef HAVE_PACKET_VNET_HDR
+    bool csum_offload;          /* frames carry a virtio_net_hdr */
+    bool gso;                   /* and so do TCP frames to segment */
+    uint32_t gso_mtu;
+#endif
 #ifdef HAVE_TX_RING
     txring_t * tx_ring;
 #endif
@@ -132,15 +284,39 @@ struct sendpacket_s {
 
 typedef struct sendpacket_s sendpacket_t;
 
-int sendpacket(sendpacket_t *, const u_char *, size_t, struct pcap_pkthdr *);
+/* sends repeated because the interface had no room */
+#define SENDPACKET_RETRIES(sp) ((sp)->retry_eagain + (sp)->retry_enobufs)
+
+int sendpacket(sendpacket_t *, const u_char *, size_t, const struct pcap_pkthdr *);
+int sendpacket_batch(sendpacket_t *, const struct iovec *, struct pcap_pkthdr *, unsigned int);
+u_char *sendpacket_slot(sendpacket_t *, size_t *);
 int sendpacket_close(sendpacket_t *);
 char *sendpacket_geterr(sendpacket_t *);
 size_t sendpacket_getstat(sendpacket_t *, char *, size_t);
 sendpacket_t *sendpacket_open(const char *, char *, tcpr_dir_t, sendpacket_type_t);
+sendpacket_t *sendpacket_try_open(const char *, char *, tcpr_dir_t, sendpacket_type_t);
 struct tcpr_ether_addr *sendpacket_get_hwaddr(sendpacket_t *);
 int sendpacket_get_dlt(sendpacket_t *);
+int sendpacket_get_numa_node(sendpacket_t *);
 const char *sendpacket_get_method(sendpacket_t *);
 void sendpacket_abort(sendpacket_t *);
+uint32_t sendpacket_select_tx_ring(sendpacket_t *, uint32_t);
+int sendpacket_set_qdisc_bypass(sendpacket_t *, bool);
+int sendpacket_enable_txtime(sendpacket_t *);
+void sendpacket_set_txtime(sendpacket_t *, uint64_t);
+int sendpacket_set_csum_offload(sendpacket_t *, bool);
+int sendpacket_set_gso(sendpacket_t *, bool);
+int sendpacket_set_telemetry(sendpacket_t *, bool);
+int sendpacket_set_tx_timestamps(sendpacket_t *, bool);
+uint32_t sendpacket_tx_timestamp_next(sendpacket_t *);
+int sendpacket_tx_timestamps(sendpacket_t *, sendpacket_tstamp_t *, int, int);
+void sendpacket_set_backoff(sendpacket_t *, sendpacket_backoff_t);
+#ifdef HAVE_NETMAP
+bool sendpacket_netmap_capable(const char *);
+#endif
+#ifdef HAVE_DPDK
+int sendpacket_dpdk_init(const char *, char *);
+#endif
 
 #endif /* _SENDPACKET_H_ */
 
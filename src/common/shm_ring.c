@@ -0,0 +1,194 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The reading side of a shared memory packet ring, see shm_ring.h for
+ * the layout and what producers do.  Packets are sent straight out of
+ * the mapping: a slot stays tcpreplay's until the next packet is asked
+ * for.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "shm_ring.h"
+
+/**
+ * Attaches the ring a producer created as the POSIX shared memory object
+ * name.  Returns NULL and fills ebuf, PCAP_ERRBUF_SIZE bytes, on error.
+ */
+shm_ring_t *
+shm_ring_open(const char *name, char *ebuf)
+{
+#if defined HAVE_SHM_OPEN && defined HAVE_SYS_MMAN_H
+    shm_ring_t *ring;
+    shm_ring_hdr_t *hdr;
+    struct stat st;
+    int fd;
+
+    assert(name);
+    assert(ebuf);
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to open shared memory %s: %s",
+                name, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(shm_ring_hdr_t)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: too short for a packet ring", name);
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to mmap %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+            hdr->version != SHM_RING_VERSION) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: not a version %d packet ring", name,
+                SHM_RING_VERSION);
+        goto fail;
+    }
+
+    if (hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) != 0 ||
+            hdr->size > (uint64_t)st.st_size ||
+            hdr->desc_off + (uint64_t)hdr->slots * sizeof(shm_ring_desc_t) > hdr->size) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: invalid packet ring layout", name);
+        goto fail;
+    }
+
+    ring = safe_malloc(sizeof(shm_ring_t));
+    ring->hdr = hdr;
+    ring->base = (unsigned char *)hdr;
+    ring->size = hdr->size;
+    ring->desc = (shm_ring_desc_t *)(ring->base + hdr->desc_off);
+    ring->mask = hdr->slots - 1;
+    /* carry on after whatever an earlier reader sent */
+    ring->pos = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+
+    dbgx(1, "Attached %s: %u slots of %u bytes, DLT %u", name, hdr->slots,
+            hdr->slot_size, hdr->datalink);
+    return ring;
+
+fail:
+    munmap(hdr, st.st_size);
+    return NULL;
+#else
+    (void)name;
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", "Shared memory packet rings aren't supported on this platform");
+    return NULL;
+#endif
+}
+
+/**
+ * Returns the next packet, waiting for the producers to publish it, and
+ * hands the slot of the one before back to them.  Returns NULL once the
+ * producers have finished and everything was sent, or if *abort is set.
+ */
+unsigned char *
+shm_ring_next(shm_ring_t *ring, struct pcap_pkthdr *pkthdr, uint32_t *nsec,
+        volatile bool *abort)
+{
+    shm_ring_hdr_t *hdr = ring->hdr;
+    shm_ring_desc_t *desc;
+    struct timespec nap = { 0, SHM_RING_NAP_NSEC };
+    uint64_t ts;
+    uint32_t spins = 0;
+
+    assert(ring);
+    assert(pkthdr);
+
+    if (ring->held) {
+        __atomic_store_n(&hdr->tail, ring->pos, __ATOMIC_RELEASE);
+        ring->held = false;
+    }
+
+    if (ring->done)
+        return NULL;
+
+    desc = &ring->desc[ring->pos & ring->mask];
+    while (__atomic_load_n(&desc->seq, __ATOMIC_ACQUIRE) != ring->pos + 1) {
+        if (*abort)
+            return NULL;
+
+        /* nothing claimed before the producers finished is left */
+        if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&hdr->claim, __ATOMIC_ACQUIRE) <= ring->pos) {
+            ring->done = true;
+            return NULL;
+        }
+
+        if (++spins > SHM_RING_SPINS)
+            nanosleep(&nap, NULL);
+    }
+
+    if (desc->caplen > desc->len || desc->off > ring->size ||
+            desc->caplen > ring->size - desc->off) {
+        warnx("Packet ring position %" PRIu64 " is out of bounds, ending the replay", ring->pos);
+        ring->done = true;
+        return NULL;
+    }
+
+    ts = desc->ts_nsec;
+    pkthdr->ts.tv_sec = ts / 1000000000;
+    pkthdr->ts.tv_usec = (ts % 1000000000) / 1000;
+    pkthdr->caplen = desc->caplen;
+    pkthdr->len = desc->len;
+    if (nsec != NULL)
+        *nsec = ts % 1000;
+
+    ring->pos++;
+    ring->held = true;
+    return ring->base + desc->off;
+}
+
+/**
+ * Hands back the last slot and detaches the ring
+ */
+void
+shm_ring_close(shm_ring_t *ring)
+{
+    if (ring == NULL)
+        return;
+
+    if (ring->held)
+        __atomic_store_n(&ring->hdr->tail, ring->pos, __ATOMIC_RELEASE);
+
+#ifdef HAVE_SYS_MMAN_H
+    munmap(ring->base, ring->size);
+#endif
+    safe_free(ring);
+}
@@ -0,0 +1,168 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+/*
+ * A ring of packets in POSIX shared memory, written by one or more
+ * external generators and sent by tcpreplay shm:NAME.  This file needs
+ * nothing else from tcpreplay, so generators can include it on its own.
+ *
+ * The producer creates the shared memory object (shm_open()), sizes it
+ * to SHM_RING_SIZE() and lays it out with shm_ring_init(): this header,
+ * then slots descriptors, then slots payload buffers of slot_size bytes
+ * starting on a page boundary.  Everything is in host byte order.
+ *
+ * Each packet takes the next position, shm_ring_claim(), which is safe
+ * for any number of producers.  Once shm_ring_writable() says tcpreplay
+ * is done with the slot the position maps to, the producer fills in its
+ * descriptor and payload and hands it over with shm_ring_publish().
+ * tcpreplay sends in position order and moves tail past a packet once
+ * it has been sent.  A descriptor's off may point anywhere inside the
+ * mapping, not just at its own slot, so packets can be built in place in
+ * a frame area of the producer's choosing.  shm_ring_finish() ends the
+ * replay once every position claimed so far has been published; nothing
+ * may be claimed after it.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_RING_MAGIC      0x52524354  /* "TCRR" */
+#define SHM_RING_VERSION    1
+#define SHM_RING_ALIGN      4096
+
+typedef struct shm_ring_hdr_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t datalink;          /* DLT_* of every packet */
+    uint32_t slots;             /* a power of 2 */
+    uint32_t slot_size;         /* payload bytes of each slot */
+    uint32_t closed;            /* producers: no more packets, see shm_ring_finish() */
+    uint64_t size;              /* of the whole mapping */
+    uint64_t desc_off;          /* of the descriptors */
+    uint64_t data_off;          /* of the payload of slot 0 */
+    uint8_t pad1[16];
+    uint64_t claim;             /* producers: next position to claim */
+    uint8_t pad2[56];
+    uint64_t tail;              /* tcpreplay: every position before it is sent */
+    uint8_t pad3[56];
+} shm_ring_hdr_t;
+
+typedef struct shm_ring_desc_s {
+    uint64_t seq;               /* position + 1 once published */
+    uint64_t off;               /* of the packet data, from the start of the mapping */
+    uint64_t ts_nsec;           /* capture time, nsec since the epoch */
+    uint32_t caplen;            /* bytes at off */
+    uint32_t len;               /* on the wire */
+} shm_ring_desc_t;
+
+#define SHM_RING_DATA_OFF(slots) \
+    (((uint64_t)sizeof(shm_ring_hdr_t) + (uint64_t)(slots) * sizeof(shm_ring_desc_t) + \
+      SHM_RING_ALIGN - 1) & ~(uint64_t)(SHM_RING_ALIGN - 1))
+#define SHM_RING_SIZE(slots, slot_size) \
+    (SHM_RING_DATA_OFF(slots) + (uint64_t)(slots) * (slot_size))
+
+/**
+ * Lays out a new ring at base, which is at least SHM_RING_SIZE() bytes.
+ * Returns -1 if slots isn't a power of 2.
+ */
+static inline int
+shm_ring_init(void *base, uint64_t size, uint32_t slots, uint32_t slot_size, uint32_t datalink)
+{
+    shm_ring_hdr_t *hdr = (shm_ring_hdr_t *)base;
+
+    if (slots == 0 || (slots & (slots - 1)) != 0 || size < SHM_RING_SIZE(slots, slot_size))
+        return -1;
+
+    memset(hdr, 0, SHM_RING_DATA_OFF(slots));
+    hdr->version = SHM_RING_VERSION;
+    hdr->datalink = datalink;
+    hdr->slots = slots;
+    hdr->slot_size = slot_size;
+    hdr->size = size;
+    hdr->desc_off = sizeof(shm_ring_hdr_t);
+    hdr->data_off = SHM_RING_DATA_OFF(slots);
+    __atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline uint64_t
+shm_ring_claim(shm_ring_hdr_t *hdr)
+{
+    return __atomic_fetch_add(&hdr->claim, 1, __ATOMIC_RELAXED);
+}
+
+/* whether tcpreplay is done with what was in the slot of pos */
+static inline int
+shm_ring_writable(const shm_ring_hdr_t *hdr, uint64_t pos)
+{
+    return pos - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) < hdr->slots;
+}
+
+static inline shm_ring_desc_t *
+shm_ring_desc(shm_ring_hdr_t *hdr, uint64_t pos)
+{
+    return (shm_ring_desc_t *)((uint8_t *)hdr + hdr->desc_off) + (pos & (hdr->slots - 1));
+}
+
+/* payload buffer of the slot of pos, the default descriptor off */
+static inline uint8_t *
+shm_ring_slot(shm_ring_hdr_t *hdr, uint64_t pos)
+{
+    return (uint8_t *)hdr + hdr->data_off + (pos & (hdr->slots - 1)) * (uint64_t)hdr->slot_size;
+}
+
+static inline void
+shm_ring_publish(shm_ring_hdr_t *hdr, uint64_t pos)
+{
+    __atomic_store_n(&shm_ring_desc(hdr, pos)->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+shm_ring_finish(shm_ring_hdr_t *hdr)
+{
+    __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+}
+
+/* tcpreplay's side */
+#define SHM_RING_SPINS      1024        /* empty polls before napping */
+#define SHM_RING_NAP_NSEC   10000
+
+struct pcap_pkthdr;
+
+/* a ring attached for reading */
+typedef struct shm_ring_s {
+    shm_ring_hdr_t *hdr;
+    shm_ring_desc_t *desc;
+    unsigned char *base;
+    uint64_t size;
+    uint64_t mask;
+    uint64_t pos;               /* next position to send */
+    bool held;                  /* pos - 1 is still being sent */
+    bool done;                  /* the producers finished and everything was sent */
+} shm_ring_t;
+
+shm_ring_t *shm_ring_open(const char *name, char *ebuf);
+unsigned char *shm_ring_next(shm_ring_t *ring, struct pcap_pkthdr *pkthdr, uint32_t *nsec,
+        volatile bool *abort);
+void shm_ring_close(shm_ring_t *ring);
+
+#endif /* SHM_RING_H_ */
@@ -0,0 +1,431 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Machine readable statistics for tcpreplay.
+ *
+ * The sending thread hands the exporter a consistent copy of its
+ * counters through a sequence lock, and a side thread turns the latest
+ * copy into JSON or Prometheus text.  That text is rewritten to a file
+ * every interval (atomically, for scrapers like the node_exporter
+ * textfile collector) and/or served to anyone connecting to a TCP port
+ * with an HTTP GET: /json gets JSON, any other path Prometheus text.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats_export.h"
+
+#define STATS_EXPORT_BUF        4096
+#define STATS_EXPORT_POLL_MS    250     /* how quickly stats_export_close() returns */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* add one interface's transmit telemetry to snap */
+static void
+stats_export_telemetry(stats_snapshot_t *snap, const sendpacket_telemetry_t *t)
+{
+    if (t == NULL)
+        return;
+
+    snap->tx_calls += t->call.count;
+    snap->tx_stalls += t->stall.count;
+    snap->tx_stall_ns += t->stall_ns;
+    snap->tx_waits += t->waits;
+    snap->tx_ring_used += t->ring_last;
+}
+
+/**
+ * Called by the sending thread: copy the counters into the snapshot.
+ * Never blocks.
+ */
+void
+stats_export_publish(stats_export_t *exp, const tcpreplay_stats_t *stats,
+        sendpacket_t *sp1, sendpacket_t *sp2, bool running)
+{
+    stats_snapshot_t *snap = &exp->snap;
+
+    exp->seq++;
+    __sync_synchronize();
+
+    snap->start_time = stats->start_time;
+    snap->pkts_sent = stats->pkts_sent;
+    snap->bytes_sent = stats->bytes_sent;
+    snap->failed = stats->failed;
+    snap->flows = stats->flows;
+    snap->flows_unique = stats->flows_unique;
+    snap->flows_expired = stats->flows_expired;
+    snap->sp_failed = sp1->failed;
+    snap->retry_eagain = sp1->retry_eagain;
+    snap->retry_enobufs = sp1->retry_enobufs;
+    snap->trunc_packets = sp1->trunc_packets;
+    snap->blocked_ns = sp1->blocked_ns;
+    if (sp2 != NULL) {
+        snap->sp_failed += sp2->failed;
+        snap->retry_eagain += sp2->retry_eagain;
+        snap->retry_enobufs += sp2->retry_enobufs;
+        snap->trunc_packets += sp2->trunc_packets;
+        snap->blocked_ns += sp2->blocked_ns;
+    }
+    snap->tx_telemetry = sp1->telemetry != NULL;
+    snap->tx_calls = snap->tx_stalls = snap->tx_stall_ns = 0;
+    snap->tx_waits = snap->tx_ring_used = 0;
+    stats_export_telemetry(snap, sp1->telemetry);
+    if (sp2 != NULL)
+        stats_export_telemetry(snap, sp2->telemetry);
+    snap->running = running;
+
+    __sync_synchronize();
+    exp->seq++;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/* copy the latest complete snapshot */
+static void
+stats_export_read(stats_export_t *exp, stats_snapshot_t *snap)
+{
+    uint32_t seq;
+
+    do {
+        while ((seq = exp->seq) & 1)
+            ;
+        __sync_synchronize();
+        memcpy(snap, &exp->snap, sizeof(*snap));
+        __sync_synchronize();
+    } while (seq != exp->seq);
+}
+
+/* format snap into buf, returns the length */
+static size_t
+stats_export_render(const stats_snapshot_t *snap, stats_export_format_t format,
+        char *buf, size_t len)
+{
+    struct timeval now, diff;
+    double elapsed = 0.0;
+    int n;
+
+    if (timerisset(&snap->start_time)) {
+        gettimeofday(&now, NULL);
+        timersub(&now, &snap->start_time, &diff);
+        elapsed = diff.tv_sec + diff.tv_usec / 1000000.0;
+    }
+
+    if (format == STATS_EXPORT_JSON) {
+        n = snprintf(buf, len,
+                "{\"running\":%s,\"elapsed\":%.6f,"
+                "\"packets_sent\":" COUNTER_SPEC ",\"bytes_sent\":" COUNTER_SPEC ","
+                "\"failed\":" COUNTER_SPEC ",\"retry_eagain\":" COUNTER_SPEC ","
+                "\"retry_enobufs\":" COUNTER_SPEC ",\"send_failed\":" COUNTER_SPEC ","
+                "\"truncated\":" COUNTER_SPEC ",\"blocked_seconds\":%.9f,"
+                "\"flows\":" COUNTER_SPEC ","
+                "\"flows_unique\":" COUNTER_SPEC ",\"flows_expired\":" COUNTER_SPEC,
+                snap->running ? "true" : "false", elapsed,
+                snap->pkts_sent, snap->bytes_sent, snap->failed, snap->retry_eagain,
+                snap->retry_enobufs, snap->sp_failed, snap->trunc_packets,
+                snap->blocked_ns / 1000000000.0,
+                snap->flows, snap->flows_unique, snap->flows_expired);
+        if (n >= 0 && (size_t)n < len && snap->tx_telemetry)
+            n += snprintf(buf + n, len - n,
+                    ",\"tx_calls\":" COUNTER_SPEC ",\"tx_stalls\":" COUNTER_SPEC ","
+                    "\"tx_stall_seconds\":%.9f,\"tx_ring_full\":" COUNTER_SPEC ","
+                    "\"tx_ring_used\":" COUNTER_SPEC,
+                    snap->tx_calls, snap->tx_stalls, snap->tx_stall_ns / 1000000000.0,
+                    snap->tx_waits, snap->tx_ring_used);
+        if (n >= 0 && (size_t)n < len)
+            n += snprintf(buf + n, len - n, "}\n");
+    } else {
+        n = snprintf(buf, len,
+                "# TYPE tcpreplay_running gauge\n"
+                "tcpreplay_running %d\n"
+                "# TYPE tcpreplay_elapsed_seconds gauge\n"
+                "tcpreplay_elapsed_seconds %.6f\n"
+                "# TYPE tcpreplay_packets_sent_total counter\n"
+                "tcpreplay_packets_sent_total " COUNTER_SPEC "\n"
+                "# TYPE tcpreplay_bytes_sent_total counter\n"
+                "tcpreplay_bytes_sent_total " COUNTER_SPEC "\n"
+                "# HELP tcpreplay_failed_total Writes that failed from full buffers and were repeated\n"
+                "# TYPE tcpreplay_failed_total counter\n"
+                "tcpreplay_failed_total " COUNTER_SPEC "\n"
+                "# TYPE tcpreplay_retry_eagain_total counter\n"
+                "tcpreplay_retry_eagain_total " COUNTER_SPEC "\n"
+                "# TYPE tcpreplay_retry_enobufs_total counter\n"
+                "tcpreplay_retry_enobufs_total " COUNTER_SPEC "\n"
+                "# HELP tcpreplay_send_failed_total Packets that could not be sent\n"
+                "# TYPE tcpreplay_send_failed_total counter\n"
+                "tcpreplay_send_failed_total " COUNTER_SPEC "\n"
+                "# TYPE tcpreplay_truncated_packets_total counter\n"
+                "tcpreplay_truncated_packets_total " COUNTER_SPEC "\n"
+                "# HELP tcpreplay_blocked_seconds_total Time spent waiting out EAGAIN and ENOBUFS\n"
+                "# TYPE tcpreplay_blocked_seconds_total counter\n"
+                "tcpreplay_blocked_seconds_total %.9f\n"
+                "# TYPE tcpreplay_flows_total counter\n"
+                "tcpreplay_flows_total " COUNTER_SPEC "\n"
+                "# TYPE tcpreplay_flows_unique_total counter\n"
+                "tcpreplay_flows_unique_total " COUNTER_SPEC "\n"
+                "# TYPE tcpreplay_flows_expired_total counter\n"
+                "tcpreplay_flows_expired_total " COUNTER_SPEC "\n",
+                snap->running, elapsed,
+                snap->pkts_sent, snap->bytes_sent, snap->failed, snap->retry_eagain,
+                snap->retry_enobufs, snap->sp_failed, snap->trunc_packets,
+                snap->blocked_ns / 1000000000.0,
+                snap->flows, snap->flows_unique, snap->flows_expired);
+        if (n >= 0 && (size_t)n < len && snap->tx_telemetry)
+            n += snprintf(buf + n, len - n,
+                    "# HELP tcpreplay_tx_calls_total Timed sendpacket() calls and native batches\n"
+                    "# TYPE tcpreplay_tx_calls_total counter\n"
+                    "tcpreplay_tx_calls_total " COUNTER_SPEC "\n"
+                    "# HELP tcpreplay_tx_stalls_total Calls which retried or waited for TX ring space\n"
+                    "# TYPE tcpreplay_tx_stalls_total counter\n"
+                    "tcpreplay_tx_stalls_total " COUNTER_SPEC "\n"
+                    "# TYPE tcpreplay_tx_stall_seconds_total counter\n"
+                    "tcpreplay_tx_stall_seconds_total %.9f\n"
+                    "# TYPE tcpreplay_tx_ring_full_total counter\n"
+                    "tcpreplay_tx_ring_full_total " COUNTER_SPEC "\n"
+                    "# HELP tcpreplay_tx_ring_used TX ring slots in use at the last send\n"
+                    "# TYPE tcpreplay_tx_ring_used gauge\n"
+                    "tcpreplay_tx_ring_used " COUNTER_SPEC "\n",
+                    snap->tx_calls, snap->tx_stalls, snap->tx_stall_ns / 1000000000.0,
+                    snap->tx_waits, snap->tx_ring_used);
+    }
+
+    if (n < 0)
+        return 0;
+    return (size_t)n < len ? (size_t)n : len - 1;
+}
+
+/* replace the export file, readers never see it half written */
+static void
+stats_export_write(stats_export_t *exp)
+{
+    stats_snapshot_t snap;
+    char buf[STATS_EXPORT_BUF];
+    size_t len;
+    FILE *fp;
+    int ok;
+
+    stats_export_read(exp, &snap);
+    len = stats_export_render(&snap, exp->format, buf, sizeof(buf));
+
+    if ((fp = fopen(exp->tmpfile, "w")) == NULL) {
+        dbgx(1, "stats export: unable to open %s: %s", exp->tmpfile, strerror(errno));
+        return;
+    }
+
+    ok = fwrite(buf, 1, len, fp) == len;
+    if (fclose(fp) != 0 || !ok) {
+        unlink(exp->tmpfile);
+        return;
+    }
+
+    if (rename(exp->tmpfile, exp->file) < 0)
+        dbgx(1, "stats export: unable to rename %s: %s", exp->tmpfile, strerror(errno));
+}
+
+/* answer one HTTP request on the listening socket */
+static void
+stats_export_serve(stats_export_t *exp)
+{
+    stats_snapshot_t snap;
+    stats_export_format_t format = STATS_EXPORT_PROMETHEUS;
+    char req[1024], body[STATS_EXPORT_BUF], hdr[256];
+    struct timeval tv = { 1, 0 };
+    ssize_t n;
+    size_t len;
+    int fd, hlen;
+
+    if ((fd = accept(exp->listen_fd, NULL, NULL)) < 0)
+        return;
+
+    /* a client that never sends its request can't stall us */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ((n = recv(fd, req, sizeof(req) - 1, 0)) <= 0) {
+        close(fd);
+        return;
+    }
+    req[n] = '\0';
+
+    if (strncmp(req, "GET ", 4) != 0) {
+        hlen = snprintf(hdr, sizeof(hdr),
+                "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n");
+        send(fd, hdr, hlen, MSG_NOSIGNAL);
+        close(fd);
+        return;
+    }
+
+    if (strncmp(req + 4, "/json", 5) == 0)
+        format = STATS_EXPORT_JSON;
+
+    stats_export_read(exp, &snap);
+    len = stats_export_render(&snap, format, body, sizeof(body));
+    hlen = snprintf(hdr, sizeof(hdr),
+            "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            format == STATS_EXPORT_JSON ? "application/json" :
+                    "text/plain; version=0.0.4", len);
+
+    if (send(fd, hdr, hlen, MSG_NOSIGNAL) == hlen)
+        send(fd, body, len, MSG_NOSIGNAL);
+    close(fd);
+}
+
+static void *
+stats_export_thread(void *arg)
+{
+    stats_export_t *exp = (stats_export_t *)arg;
+    struct pollfd pfd;
+    struct timeval now, next;
+
+    gettimeofday(&next, NULL);
+    pfd.fd = exp->listen_fd;
+    pfd.events = POLLIN;
+
+    while (!exp->stop) {
+        pfd.revents = 0;
+        if (poll(&pfd, exp->listen_fd >= 0 ? 1 : 0, STATS_EXPORT_POLL_MS) > 0 &&
+                (pfd.revents & POLLIN))
+            stats_export_serve(exp);
+
+        if (exp->file == NULL)
+            continue;
+
+        gettimeofday(&now, NULL);
+        if (timercmp(&now, &next, >=)) {
+            stats_export_write(exp);
+            next = now;
+            next.tv_sec += exp->interval;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts exporting statistics: to file every interval seconds when file
+ * isn't NULL, and over HTTP when port isn't 0.  The HTTP endpoint listens
+ * on the IPv4 address bind_addr, or only on the loopback when it is NULL.
+ * Returns NULL on error, with the reason in errbuf.
+ */
+stats_export_t *
+stats_export_open(const char *file, stats_export_format_t format,
+        const char *bind_addr, int port, int interval, char *errbuf, size_t errlen)
+{
+    stats_export_t *exp;
+    struct sockaddr_in sin;
+    int on = 1;
+
+    exp = (stats_export_t *)safe_malloc(sizeof(stats_export_t));
+    exp->format = format;
+    exp->interval = interval > 0 ? interval : 1;
+    exp->listen_fd = -1;
+    if (file != NULL) {
+        exp->file = safe_strdup(file);
+        exp->tmpfile = (char *)safe_malloc(strlen(file) + 5);
+        sprintf(exp->tmpfile, "%s.tmp", file);
+    }
+
+    if (port) {
+        if ((exp->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            snprintf(errbuf, errlen, "stats export socket: %s", strerror(errno));
+            goto fail;
+        }
+        setsockopt(exp->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(port);
+        if (bind_addr != NULL && inet_pton(AF_INET, bind_addr, &sin.sin_addr) != 1) {
+            snprintf(errbuf, errlen, "invalid stats export address: %s", bind_addr);
+            goto fail;
+        }
+        if (bind(exp->listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+                listen(exp->listen_fd, 16) < 0) {
+            snprintf(errbuf, errlen, "stats export port %d: %s", port, strerror(errno));
+            goto fail;
+        }
+    }
+
+    if (pthread_create(&exp->thread, NULL, stats_export_thread, exp) != 0) {
+        snprintf(errbuf, errlen, "%s", "unable to start the stats export thread");
+        goto fail;
+    }
+
+    return exp;
+
+fail:
+    if (exp->listen_fd >= 0)
+        close(exp->listen_fd);
+    safe_free(exp->file);
+    safe_free(exp->tmpfile);
+    safe_free(exp);
+    return NULL;
+}
+
+/**
+ * Stops the exporter thread, after one last write of the file
+ */
+void
+stats_export_close(stats_export_t *exp)
+{
+    if (exp == NULL)
+        return;
+
+    exp->stop = true;
+    pthread_join(exp->thread, NULL);
+
+    if (exp->file != NULL)
+        stats_export_write(exp);
+    if (exp->listen_fd >= 0)
+        close(exp->listen_fd);
+
+    safe_free(exp->file);
+    safe_free(exp->tmpfile);
+    safe_free(exp);
+}
+
+#else
+
+stats_export_t *
+stats_export_open(const char *UNUSED(file), stats_export_format_t UNUSED(format),
+        const char *UNUSED(bind_addr), int UNUSED(port), int UNUSED(interval), char *errbuf, size_t errlen)
+{
+    snprintf(errbuf, errlen, "%s", "stats export requires pthread support");
+    return NULL;
+}
+
+void
+stats_export_close(stats_export_t *UNUSED(exp))
+{
+}
+
+#endif /* HAVE_LIBPTHREAD */
@@ -0,0 +1,85 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_EXPORT_H_
+#define STATS_EXPORT_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#define STATS_EXPORT_STRIDE     64      /* --topspeed packets between snapshots */
+
+typedef enum {
+    STATS_EXPORT_JSON,
+    STATS_EXPORT_PROMETHEUS,
+} stats_export_format_t;
+
+/* what the exporter reports, copied out of the sending thread's counters */
+typedef struct stats_snapshot_s {
+    struct timeval start_time;
+    COUNTER pkts_sent;
+    COUNTER bytes_sent;
+    COUNTER failed;
+    COUNTER sp_failed;
+    COUNTER retry_eagain;
+    COUNTER retry_enobufs;
+    COUNTER trunc_packets;
+    COUNTER blocked_ns;             /* backing off from EAGAIN/ENOBUFS */
+    COUNTER flows;
+    COUNTER flows_unique;
+    COUNTER flows_expired;
+    bool tx_telemetry;              /* the tx_ fields below are valid */
+    COUNTER tx_calls;
+    COUNTER tx_stalls;
+    COUNTER tx_stall_ns;
+    COUNTER tx_waits;
+    COUNTER tx_ring_used;
+    bool running;
+} stats_snapshot_t;
+
+/*
+ * The sender publishes snapshots under a sequence lock: seq is odd while
+ * snap is being written, so the exporter thread retries until it reads
+ * the same even seq before and after copying.  The sender never waits.
+ */
+typedef struct stats_export_s {
+    volatile uint32_t seq;
+    stats_snapshot_t snap;
+    char *file;                     /* rewritten every interval, or NULL */
+    char *tmpfile;                  /* written first, then renamed to file */
+    stats_export_format_t format;
+    int interval;                   /* seconds */
+    int listen_fd;                  /* HTTP endpoint or -1 */
+    volatile bool stop;
+#ifdef HAVE_LIBPTHREAD
+    pthread_t thread;
+#endif
+} stats_export_t;
+
+stats_export_t *stats_export_open(const char *file, stats_export_format_t format,
+        const char *bind_addr, int port, int interval, char *errbuf, size_t errlen);
+void stats_export_publish(stats_export_t *exp, const tcpreplay_stats_t *stats,
+        sendpacket_t *sp1, sendpacket_t *sp2, bool running);
+void stats_export_close(stats_export_t *exp);
+
+#endif /* STATS_EXPORT_H_ */
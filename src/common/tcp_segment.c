@@ -0,0 +1,165 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Software TCP segmentation: splits a TCP packet bigger than the MTU into
+ * MSS sized segments, the way a NIC's TSO would, for captures taken with
+ * the offloads on.  The inverse of tcpedit's --mtu-trunc.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcp_segment.h"
+#include "checksum_math.h"
+
+/**
+ * \brief Splits an oversized TCP packet on MSS boundaries
+ *
+ * Every segment gets a copy of the L2, IP and TCP headers, with the IP
+ * length, IPv4 ID and checksum, TCP sequence number and checksum fixed up.
+ * FIN and PSH stay on the last segment and CWR on the first.  Only the IP
+ * datagram is split; trailing L2 padding is dropped.
+ *
+ * Returns the number of segments in seg, or 0 when the packet should be
+ * sent as is: it isn't TCP, isn't bigger than mtu bytes of IP, is a
+ * fragment, wasn't captured in full or would take more than
+ * TCP_SEGMENT_MAX segments.
+ *
+ * The headers are edited through the TCPR_UNALIGNED structs and raw words
+ * are reached by offsetof(), so the L3 header can start anywhere.
+ */
+int
+tcp_segment(tcp_segment_t *seg, const u_char *pktdata, uint32_t caplen,
+        int datalink, uint32_t mtu)
+{
+    pkt_meta_t meta;
+    const u_char *l3, *payload;
+    ipv4_hdr_t *ip_hdr = NULL;
+    ipv6_hdr_t *ip6_hdr;
+    tcp_hdr_t *tcp_hdr;
+    uint32_t iplen, hlen, l34len, paylen, mss, chunk, seq, need;
+    uint16_t id, be16;
+    int pseudo, cnt, i;
+    u_char *out;
+    int sum;
+
+    assert(seg);
+    assert(pktdata);
+
+    seg->cnt = 0;
+    if (get_pkt_meta(pktdata, caplen, datalink, &meta) < 0 ||
+            meta.proto != IPPROTO_TCP || meta.l4off == 0)
+        return 0;
+
+    l3 = pktdata + meta.l2len;
+    if (meta.ip_ver == 4) {
+        ip_hdr = (ipv4_hdr_t *)l3;
+        if (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK))
+            return 0;
+        iplen = ntohs(ip_hdr->ip_len);
+        pseudo = do_checksum_math((uint16_t *)(l3 + offsetof(ipv4_hdr_t, ip_src)), 8);
+    } else if (meta.ip_ver == 6) {
+        ip6_hdr = (ipv6_hdr_t *)l3;
+        /* 0 is a jumbogram, whose length is in a hop-by-hop option */
+        if (ip6_hdr->ip_len == 0)
+            return 0;
+        iplen = TCPR_IPV6_H + ntohs(ip6_hdr->ip_len);
+        pseudo = do_checksum_math((uint16_t *)(l3 + offsetof(ipv6_hdr_t, ip_src)), 32);
+    } else {
+        return 0;
+    }
+
+    if (iplen <= mtu || meta.l2len + iplen > caplen ||
+            meta.l4off + TCPR_TCP_H > meta.l2len + iplen)
+        return 0;
+
+    tcp_hdr = (tcp_hdr_t *)(pktdata + meta.l4off);
+    hlen = meta.l4off + (tcp_hdr->th_off << 2);
+    l34len = hlen - meta.l2len;
+    if (hlen > meta.l2len + iplen || l34len >= mtu)
+        return 0;
+
+    mss = mtu - l34len;
+    payload = pktdata + hlen;
+    paylen = meta.l2len + iplen - hlen;
+    cnt = (paylen + mss - 1) / mss;
+    if (cnt < 2 || cnt > TCP_SEGMENT_MAX)
+        return 0;
+
+    need = cnt * hlen + paylen;
+    if (need > seg->size) {
+        seg->buf = safe_realloc(seg->buf, need);
+        seg->size = need;
+    }
+
+    seq = ntohl(tcp_hdr->th_seq);
+    id = meta.ip_ver == 4 ? ntohs(ip_hdr->ip_id) : 0;
+    out = seg->buf;
+    for (i = 0; i < cnt; i++) {
+        chunk = i < cnt - 1 ? mss : paylen - i * mss;
+        memcpy(out, pktdata, hlen);
+        memcpy(out + hlen, payload + i * mss, chunk);
+
+        if (meta.ip_ver == 4) {
+            ipv4_hdr_t *seg_ip = (ipv4_hdr_t *)(out + meta.l2len);
+
+            seg_ip->ip_len = htons(l34len + chunk);
+            seg_ip->ip_id = htons(id + i);
+            /* ip_len and ip_id are next to each other */
+            seg_ip->ip_sum = do_checksum_adjust(ip_hdr->ip_sum, l3 + offsetof(ipv4_hdr_t, ip_len),
+                    out + meta.l2len + offsetof(ipv4_hdr_t, ip_len), 4);
+        } else {
+            be16 = htons(l34len - TCPR_IPV6_H + chunk);
+            memcpy(out + meta.l2len + offsetof(ipv6_hdr_t, ip_len), &be16, sizeof(be16));
+        }
+
+        tcp_hdr = (tcp_hdr_t *)(out + meta.l4off);
+        tcp_hdr->th_seq = htonl(seq + i * mss);
+        if (i < cnt - 1)
+            tcp_hdr->th_flags &= ~(TH_FIN | TH_PUSH);
+        if (i > 0)
+            tcp_hdr->th_flags &= ~TH_CWR;
+        tcp_hdr->th_sum = 0;
+        sum = pseudo + ntohs(IPPROTO_TCP + hlen - meta.l4off + chunk);
+        sum += do_checksum_math((uint16_t *)tcp_hdr, hlen - meta.l4off + chunk);
+        tcp_hdr->th_sum = CHECKSUM_CARRY(sum);
+
+        seg->data[i] = out;
+        seg->len[i] = hlen + chunk;
+        out += hlen + chunk;
+    }
+
+    seg->cnt = cnt;
+    dbgx(3, "Split %u bytes of IP into %d segments of up to %u bytes", iplen, cnt, mtu);
+    return cnt;
+}
+
+/* frees the buffer of seg, which can be used again afterwards */
+void
+tcp_segment_free(tcp_segment_t *seg)
+{
+    safe_free(seg->buf);
+    seg->size = 0;
+    seg->cnt = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCP_SEGMENT_H_
+#define TCP_SEGMENT_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#define TCP_SEGMENT_MAX     128     /* segments of one packet, 64KB at a 536 byte MSS */
+#define TCP_SEGMENT_MIN_MTU 68      /* smallest IPv4 MTU, RFC 791 */
+
+/*
+ * The segments of the last packet tcp_segment() split, one after another
+ * in buf, which is kept from packet to packet so segmenting doesn't
+ * allocate once it has grown to the largest packet seen.
+ */
+typedef struct tcp_segment_s {
+    u_char *buf;
+    size_t size;
+    int cnt;
+    u_char *data[TCP_SEGMENT_MAX];
+    uint32_t len[TCP_SEGMENT_MAX];
+} tcp_segment_t;
+
+int tcp_segment(tcp_segment_t *seg, const u_char *pktdata, uint32_t caplen,
+        int datalink, uint32_t mtu);
+void tcp_segment_free(tcp_segment_t *seg);
+
+#endif /* TCP_SEGMENT_H_ */
@@ -60,15 +60,153 @@ extern int debug;
 char *options_vec[OPTIONS_VEC_SIZE];
 static int tcpdump_fill_in_options(char *opt);
 static int can_exec(const char *filename);
+static void tcpdump_decode(tcpdump_t *tcpdump, const struct pcap_pkthdr *pkthdr, const u_char *data);
+
+/*
+ * Is this packet part of the --verbose-sample/--verbose-rate sample?
+ * The clock is only read for packets the 1 in N sample keeps.
+ */
+static inline bool
+tcpdump_sample(tcpdump_t *tcpdump)
+{
+    time_t now;
+
+    if (tcpdump->sample_every > 1) {
+        if (tcpdump->sample_skip) {
+            tcpdump->sample_skip--;
+            return false;
+        }
+        tcpdump->sample_skip = tcpdump->sample_every - 1;
+    }
+
+    if (tcpdump->sample_rate) {
+        now = time(NULL);
+        if (now != tcpdump->sample_sec) {
+            tcpdump->sample_sec = now;
+            tcpdump->sample_left = tcpdump->sample_rate;
+        }
+
+        if (tcpdump->sample_left == 0)
+            return false;
+        tcpdump->sample_left--;
+    }
+
+    return true;
+}
 
 /**
- * given a packet, print a decode of via tcpdump
+ * given a packet, print a decode of via tcpdump.  After tcpdump_async()
+ * the packet is only queued for the decoder thread, and never waits.
+ * Packets left out of the sample, if any, are skipped.
  */
 int
-tcpdump_print(tcpdump_t *tcpdump, struct pcap_pkthdr *pkthdr, const u_char *data)
+tcpdump_print(tcpdump_t *tcpdump, const struct pcap_pkthdr *pkthdr, const u_char *data)
+{
+#ifdef HAVE_LIBPTHREAD
+    tcpdump_slot_t *slot;
+    uint32_t head;
+#endif
+
+    assert(tcpdump);
+
+    if (!tcpdump_sample(tcpdump))
+        return FALSE;
+
+#ifdef HAVE_LIBPTHREAD
+    if (tcpdump->ring != NULL) {
+        head = tcpdump->head;
+        if (head - __atomic_load_n(&tcpdump->tail, __ATOMIC_ACQUIRE) == TCPDUMP_RING_SLOTS) {
+            /* the decoder fell behind, this one isn't shown */
+            tcpdump->dropped++;
+            return FALSE;
+        }
+
+        slot = &tcpdump->ring[head & (TCPDUMP_RING_SLOTS - 1)];
+        memcpy(&slot->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+        slot->pkthdr.caplen = min(pkthdr->caplen, (bpf_u_int32)TCPDUMP_RING_SNAPLEN);
+        memcpy(slot->data, data, slot->pkthdr.caplen);
+        __atomic_store_n(&tcpdump->head, head + 1, __ATOMIC_RELEASE);
+        return TRUE;
+    }
+#endif
+
+    tcpdump_decode(tcpdump, pkthdr, data);
+    return TRUE;
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *
+tcpdump_decoder(void *arg)
+{
+    tcpdump_t *tcpdump = (tcpdump_t *)arg;
+    struct timespec nap = { 0, TCPDUMP_RING_NAP_NSEC };
+    uint32_t tail = tcpdump->tail;
+    tcpdump_slot_t *slot;
+
+    for (;;) {
+        if (__atomic_load_n(&tcpdump->head, __ATOMIC_ACQUIRE) == tail) {
+            if (__atomic_load_n(&tcpdump->stop, __ATOMIC_ACQUIRE) &&
+                    __atomic_load_n(&tcpdump->head, __ATOMIC_ACQUIRE) == tail)
+                return NULL;
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        slot = &tcpdump->ring[tail & (TCPDUMP_RING_SLOTS - 1)];
+        tcpdump_decode(tcpdump, &slot->pkthdr, slot->data);
+        __atomic_store_n(&tcpdump->tail, ++tail, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+/**
+ * Decode packets on a thread of their own from now on, so tcpdump_print()
+ * never holds up the caller.  The decoder gets the first
+ * TCPDUMP_RING_SNAPLEN bytes of each packet, and when it falls
+ * TCPDUMP_RING_SLOTS packets behind the rest aren't shown; tcpdump_close()
+ * says how many.  Returns FALSE if decoding stays synchronous.
+ */
+int
+tcpdump_async(tcpdump_t *tcpdump)
+{
+#ifdef HAVE_LIBPTHREAD
+    int rcode;
+
+    assert(tcpdump);
+
+    if (tcpdump->ring != NULL)
+        return TRUE;
+
+    if (tcpdump->pid <= 0)
+        return FALSE;
+
+    tcpdump->ring = (tcpdump_slot_t *)safe_malloc(sizeof(tcpdump_slot_t) * TCPDUMP_RING_SLOTS);
+    tcpdump->head = tcpdump->tail = 0;
+    tcpdump->stop = false;
+    tcpdump->dropped = 0;
+
+    if ((rcode = pthread_create(&tcpdump->thread, NULL, tcpdump_decoder, tcpdump)) != 0) {
+        warnx("Unable to start the tcpdump decoder thread: %s", strerror(rcode));
+        safe_free(tcpdump->ring);
+        return FALSE;
+    }
+
+    return TRUE;
+#else
+    (void)tcpdump;
+    return FALSE;
+#endif
+}
+
+/**
+ * writes a packet to tcpdump and prints its decode
+ */
+static void
+tcpdump_decode(tcpdump_t *tcpdump, const struct pcap_pkthdr *pkthdr, const u_char *data)
 {
     struct pollfd poller[1];
     int result;
+    ssize_t len;
     char decode[TCPDUMP_DECODE_LEN];
 
     assert(tcpdump);
@@ -91,13 +229,13 @@ tcpdump_print(tcpdump_t *tcpdump, struct pcap_pkthdr *pkthdr, const u_char *data
 
     /* result > 0 if we get here */
 
-    if (write(tcpdump->infd, (char *)pkthdr, sizeof(struct pcap_pkthdr))
+    if (write(tcpdump->infd, (const char *)pkthdr, sizeof(struct pcap_pkthdr))
         != sizeof(struct pcap_pkthdr))
         errx(-1, "Error writing pcap file header to tcpdump\n%s", strerror(errno));
 
 #ifdef DEBUG
     if (debug >= 5) {
-        if (write(tcpdump->debugfd, (char *)pkthdr, sizeof(struct pcap_pkthdr))
+        if (write(tcpdump->debugfd, (const char *)pkthdr, sizeof(struct pcap_pkthdr))
             != sizeof(struct pcap_pkthdr))
             errx(-1, "Error writing pcap file header to tcpdump debug\n%s", strerror(errno));
     }
@@ -127,12 +265,11 @@ tcpdump_print(tcpdump_t *tcpdump, struct pcap_pkthdr *pkthdr, const u_char *data
             "Try increasing TCPDUMP_POLL_TIMEOUT");
 
     /* result > 0 if we get here */
-    if (read(tcpdump->outfd, &decode, TCPDUMP_DECODE_LEN) < 0)
+    if ((len = read(tcpdump->outfd, &decode, TCPDUMP_DECODE_LEN - 1)) < 0)
         errx(-1, "Error reading tcpdump decode: %s", strerror(errno));
-            
-    printf("%s", decode);
 
-    return TRUE;
+    decode[len] = '\0';
+    printf("%s", decode);
 }
 
 /**
@@ -259,6 +396,19 @@ tcpdump_close(tcpdump_t *tcpdump)
     if (tcpdump->pid <= 0)
         return;
 
+#ifdef HAVE_LIBPTHREAD
+    if (tcpdump->ring != NULL) {
+        /* let the decoder finish what's queued */
+        __atomic_store_n(&tcpdump->stop, true, __ATOMIC_RELEASE);
+        pthread_join(tcpdump->thread, NULL);
+        safe_free(tcpdump->ring);
+
+        if (tcpdump->dropped)
+            notice("Not decoded: " COUNTER_SPEC " packets, tcpdump couldn't keep up",
+                    tcpdump->dropped);
+    }
+#endif
+
     dbgx(2, "[parent] killing tcpdump pid: %d", tcpdump->pid);
 
     kill(tcpdump->pid, SIGKILL);
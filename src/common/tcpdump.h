@@ -21,6 +21,10 @@
 #ifndef __TCPDUMP_H__
 #define __TCPDUMP_H__
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 /* line buffer stdout, read from stdin */
 #define TCPDUMP_ARGS " -n -l -r -"
 
@@ -42,6 +46,16 @@
 
 #define TCPDUMP_DECODE_LEN 65535
 
+/* tcpdump_async(): packets queued for the decoder, and how much of each */
+#define TCPDUMP_RING_SLOTS 1024         /* must be a power of 2 */
+#define TCPDUMP_RING_SNAPLEN 256
+#define TCPDUMP_RING_NAP_NSEC 1000000   /* decoder nap when the ring is empty */
+
+typedef struct tcpdump_slot_s {
+    struct pcap_pkthdr pkthdr;
+    u_char data[TCPDUMP_RING_SNAPLEN];
+} tcpdump_slot_t;
+
 typedef struct tcpdump_s {
     char *filename;
     char *args;
@@ -51,6 +65,13 @@ typedef struct tcpdump_s {
     int outfd; /* fd to read from. */
     pcap_dumper_t *dumper;
 
+    /* only decode a sample, see tcpdump_sample() */
+    uint32_t sample_every;  /* 1 in sample_every packets, 0 for all */
+    uint32_t sample_rate;   /* at most sample_rate packets a second, 0 for all */
+    uint32_t sample_skip;   /* packets left until the next 1 in sample_every */
+    uint32_t sample_left;   /* packets left to decode in sample_sec */
+    time_t sample_sec;
+
     /* following vars are for figuring out exactly what we send to
      * tcpdump.  See TCPDUMP_DEBUG 
      */
@@ -58,12 +79,23 @@ typedef struct tcpdump_s {
     int debugfd;
     char debugfile[255];
 #endif
+
+#ifdef HAVE_LIBPTHREAD
+    /* tcpdump_async(): tcpdump_print() queues, a thread decodes */
+    tcpdump_slot_t *ring;
+    uint32_t head;          /* next slot tcpdump_print() fills */
+    uint32_t tail;          /* next slot the decoder takes */
+    bool stop;
+    COUNTER dropped;        /* packets the ring had no room for */
+    pthread_t thread;
+#endif
 } tcpdump_t;
 
 //int tcpdump_init(tcpdump_t *tcpdump);
 int tcpdump_open(tcpdump_t *tcpdump, pcap_t *pcap);
 //int tcpdump_open_live(tcpdump_t *tcpdump, pcap_t *pcap);
-int tcpdump_print(tcpdump_t *tcpdump, struct pcap_pkthdr *pkthdr, const u_char *data);
+int tcpdump_print(tcpdump_t *tcpdump, const struct pcap_pkthdr *pkthdr, const u_char *data);
+int tcpdump_async(tcpdump_t *tcpdump);
 void tcpdump_close(tcpdump_t *tcpdump);
 void tcpdump_kill(tcpdump_t *tcpdump);
 
@@ -0,0 +1,189 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Achieved versus target rate over time for tcpreplay.  The run averages
+ * in packet_stats() hide a replay which slows down half way through a
+ * long --loop; this writes what each interval actually did, as CSV or
+ * as a JSON array, so it can be graphed.
+ *
+ * Every row has the interval's packets, bytes, Mbps and pps, send
+ * failures and EAGAIN/ENOBUFS retries.  With --mbps or --pps the target
+ * rate is included and pace is achieved/target.  With --multiplier pace
+ * is how much capture time was replayed per multiplied second of wall
+ * time, so 1.0 is on schedule.  Either way, below 1.0 is falling behind.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "timeline.h"
+
+static uint64_t
+timeline_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return TIMESPEC_TO_NANOSEC(&now);
+}
+
+static COUNTER
+timeline_retries(sendpacket_t *sp)
+{
+    return sp ? sp->retry_eagain + sp->retry_enobufs : 0;
+}
+
+/**
+ * Creates file and writes the CSV header or opens the JSON array.  Returns
+ * NULL and fills errbuf on error.
+ */
+timeline_t *
+timeline_open(const char *file, timeline_format_t format, uint32_t interval_ms,
+        char *errbuf, size_t errlen)
+{
+    timeline_t *tl;
+
+    assert(file);
+
+    tl = (timeline_t *)safe_malloc(sizeof(timeline_t));
+    if ((tl->fp = fopen(file, "w")) == NULL) {
+        snprintf(errbuf, errlen, "Unable to open timeline %s: %s", file, strerror(errno));
+        safe_free(tl);
+        return NULL;
+    }
+
+    tl->format = format;
+    tl->interval_ns = (uint64_t)(interval_ms ? interval_ms : TIMELINE_INTERVAL_MS) * 1000000;
+
+    if (format == TIMELINE_CSV)
+        fprintf(tl->fp, "time_ms,interval_ms,packets,bytes,mbps,pps,"
+                "target_mbps,target_pps,pace,failed,retries\n");
+    else
+        fprintf(tl->fp, "[");
+
+    return tl;
+}
+
+/**
+ * Sets the rate the rows are compared to.  At most one of them should be
+ * non-zero; all zero (--topspeed) leaves target and pace empty.
+ */
+void
+timeline_set_target(timeline_t *tl, double mbps, double pps, double multiplier)
+{
+    assert(tl);
+
+    tl->target_mbps = mbps;
+    tl->target_pps = pps;
+    tl->multiplier = multiplier;
+}
+
+/**
+ * Writes a row for everything sent since the previous one.  The first
+ * call only records where the run started.
+ */
+void
+timeline_sample(timeline_t *tl, const tcpreplay_stats_t *stats,
+        sendpacket_t *sp1, sendpacket_t *sp2)
+{
+    uint64_t now_ns = timeline_now();
+    COUNTER pkts, bytes, failed, retries;
+    double secs, mbps, pps, pace = -1.0;
+    char pace_str[32];
+
+    assert(tl);
+    assert(stats);
+
+    failed = stats->failed + (sp1 ? sp1->failed : 0) + (sp2 ? sp2->failed : 0);
+    retries = timeline_retries(sp1) + timeline_retries(sp2);
+
+    if (!tl->start_ns) {
+        tl->start_ns = now_ns;
+    } else if (now_ns > tl->last_ns) {
+        pkts = stats->pkts_sent - tl->pkts;
+        bytes = stats->bytes_sent - tl->bytes;
+        secs = (double)(now_ns - tl->last_ns) / 1000000000.0;
+        mbps = (double)bytes * 8.0 / secs / 1000000.0;
+        pps = (double)pkts / secs;
+
+        if (tl->target_mbps > 0.0)
+            pace = mbps / tl->target_mbps;
+        else if (tl->target_pps > 0.0)
+            pace = pps / tl->target_pps;
+        else if (tl->multiplier > 0.0 && stats->last_ts_ns >= tl->last_ts_ns && tl->last_ts_ns)
+            /* a new file or --loop pass moves the capture clock, skip those */
+            pace = (double)(stats->last_ts_ns - tl->last_ts_ns) /
+                    ((double)(now_ns - tl->last_ns) * tl->multiplier);
+
+        if (pace >= 0.0)
+            snprintf(pace_str, sizeof(pace_str), "%.3f", pace);
+        else
+            snprintf(pace_str, sizeof(pace_str), "%s", tl->format == TIMELINE_CSV ? "" : "null");
+
+        if (tl->format == TIMELINE_CSV) {
+            fprintf(tl->fp, "%.1f,%.1f," COUNTER_SPEC "," COUNTER_SPEC ",%.3f,%.1f,%.3f,%.1f,%s,"
+                    COUNTER_SPEC "," COUNTER_SPEC "\n",
+                    (double)(now_ns - tl->start_ns) / 1000000.0, secs * 1000.0,
+                    pkts, bytes, mbps, pps, tl->target_mbps, tl->target_pps, pace_str,
+                    failed - tl->failed, retries - tl->retries);
+        } else {
+            fprintf(tl->fp, "%s\n  {\"time_ms\": %.1f, \"interval_ms\": %.1f, "
+                    "\"packets\": " COUNTER_SPEC ", \"bytes\": " COUNTER_SPEC ", "
+                    "\"mbps\": %.3f, \"pps\": %.1f, \"target_mbps\": %.3f, \"target_pps\": %.1f, "
+                    "\"pace\": %s, \"failed\": " COUNTER_SPEC ", \"retries\": " COUNTER_SPEC "}",
+                    tl->rows ? "," : "",
+                    (double)(now_ns - tl->start_ns) / 1000000.0, secs * 1000.0,
+                    pkts, bytes, mbps, pps, tl->target_mbps, tl->target_pps, pace_str,
+                    failed - tl->failed, retries - tl->retries);
+        }
+        tl->rows++;
+    } else {
+        return;
+    }
+
+    tl->last_ns = now_ns;
+    tl->pkts = stats->pkts_sent;
+    tl->bytes = stats->bytes_sent;
+    tl->failed = failed;
+    tl->retries = retries;
+    tl->last_ts_ns = stats->last_ts_ns;
+}
+
+/**
+ * Closes the JSON array and the file
+ */
+void
+timeline_close(timeline_t *tl)
+{
+    assert(tl);
+
+    if (tl->format == TIMELINE_JSON)
+        fprintf(tl->fp, "%s]\n", tl->rows ? "\n" : "");
+
+    if (fclose(tl->fp) != 0)
+        warnx("Unable to write the timeline: %s", strerror(errno));
+
+    safe_free(tl);
+}
@@ -0,0 +1,64 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdio.h>
+
+#define TIMELINE_INTERVAL_MS    100     /* default --timeline-interval */
+
+typedef enum {
+    TIMELINE_CSV,
+    TIMELINE_JSON,
+} timeline_format_t;
+
+/*
+ * --timeline: one row per interval of what was sent during it, next to
+ * the rate that was asked for
+ */
+typedef struct timeline_s {
+    FILE *fp;
+    timeline_format_t format;
+    uint64_t interval_ns;
+    double target_mbps;         /* --mbps, or 0 */
+    double target_pps;          /* --pps, or 0 */
+    double multiplier;          /* --multiplier, or 0 */
+    COUNTER rows;
+    /* CLOCK_MONOTONIC and totals at the start of the run and the last row */
+    uint64_t start_ns;
+    uint64_t last_ns;
+    COUNTER pkts;
+    COUNTER bytes;
+    COUNTER failed;
+    COUNTER retries;
+    COUNTER last_ts_ns;
+} timeline_t;
+
+timeline_t *timeline_open(const char *file, timeline_format_t format,
+        uint32_t interval_ms, char *errbuf, size_t errlen);
+void timeline_set_target(timeline_t *tl, double mbps, double pps, double multiplier);
+void timeline_sample(timeline_t *tl, const tcpreplay_stats_t *stats,
+        sendpacket_t *sp1, sendpacket_t *sp2);
+void timeline_close(timeline_t *tl);
+
+#endif /* TIMELINE_H_ */
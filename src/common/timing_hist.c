@@ -0,0 +1,109 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdio.h>
+
+/* highest value that lands in bucket idx */
+static uint64_t
+timing_hist_bucket_max(int idx)
+{
+    int shift;
+
+    if (idx < TIMING_HIST_SUB)
+        return (uint64_t)idx;
+
+    shift = (idx >> TIMING_HIST_SUB_BITS) - 1;
+    return (((uint64_t)(idx & (TIMING_HIST_SUB - 1)) + TIMING_HIST_SUB + 1) << shift) - 1;
+}
+
+/**
+ * Returns the value percentile (0-100) percent of the recorded values
+ * are at or below, rounded up to the end of its bucket but never more
+ * than the largest value recorded.
+ */
+uint64_t
+timing_hist_percentile(const timing_hist_t *hist, double percentile)
+{
+    COUNTER want, seen = 0;
+    uint64_t value;
+    int i;
+
+    if (!hist->count)
+        return 0;
+
+    want = (COUNTER)(hist->count * percentile / 100.0 + 0.5);
+    if (want < 1)
+        want = 1;
+
+    for (i = 0; i < TIMING_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= want)
+            break;
+    }
+
+    value = timing_hist_bucket_max(i);
+    return value < hist->max ? value : hist->max;
+}
+
+/**
+ * Returns the exact mean of the recorded values, 0 when there are none
+ */
+uint64_t
+timing_hist_mean(const timing_hist_t *hist)
+{
+    return hist->count ? hist->sum / hist->count : 0;
+}
+
+/**
+ * format nsec with a unit that keeps it short, returns buf
+ */
+char *
+timing_hist_fmt(char *buf, size_t len, uint64_t nsec)
+{
+    if (nsec < 10000)
+        snprintf(buf, len, "%" PRIu64 " ns", nsec);
+    else if (nsec < 10000000)
+        snprintf(buf, len, "%.1f us", nsec / 1000.0);
+    else
+        snprintf(buf, len, "%.2f ms", nsec / 1000000.0);
+
+    return buf;
+}
+
+/**
+ * Prints the usual percentiles of hist on one line
+ */
+void
+timing_hist_print(const char *name, const timing_hist_t *hist)
+{
+    char p50[32], p90[32], p99[32], p999[32], max[32];
+
+    if (!hist->count)
+        return;
+
+    printf("%s: p50 %s, p90 %s, p99 %s, p99.9 %s, max %s\n", name,
+            timing_hist_fmt(p50, sizeof(p50), timing_hist_percentile(hist, 50.0)),
+            timing_hist_fmt(p90, sizeof(p90), timing_hist_percentile(hist, 90.0)),
+            timing_hist_fmt(p99, sizeof(p99), timing_hist_percentile(hist, 99.0)),
+            timing_hist_fmt(p999, sizeof(p999), timing_hist_percentile(hist, 99.9)),
+            timing_hist_fmt(max, sizeof(max), hist->max));
+}
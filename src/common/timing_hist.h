@@ -0,0 +1,71 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it 
+ *   and/or modify it under the terms of the GNU General Public License as 
+ *   published by the Free Software Foundation, either version 3 of the 
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMING_HIST_H_
+#define TIMING_HIST_H_
+
+#include "config.h"
+#include "defines.h"
+
+/*
+ * Log-linear (HDR style) histogram of nanosecond values.  Every power of
+ * two range is split into TIMING_HIST_SUB linear buckets, so any value is
+ * reported within 1/TIMING_HIST_SUB (~6%) of what was recorded, from 1
+ * nsec up to 2^64, in a fixed 8K array.  Adding a value is a count
+ * leading zeros, a shift and an increment.
+ */
+#define TIMING_HIST_SUB_BITS    4
+#define TIMING_HIST_SUB         (1 << TIMING_HIST_SUB_BITS)
+#define TIMING_HIST_BUCKETS     ((65 - TIMING_HIST_SUB_BITS) * TIMING_HIST_SUB)
+
+typedef struct timing_hist_s {
+    COUNTER count;
+    COUNTER max;
+    COUNTER sum;                /* for the mean, wraps after ~584 years of nsec */
+    COUNTER buckets[TIMING_HIST_BUCKETS];
+} timing_hist_t;
+
+static inline int
+timing_hist_index(uint64_t value)
+{
+    int shift;
+
+    if (value < TIMING_HIST_SUB)
+        return (int)value;
+
+    /* position of the top bit, less the bits kept below it */
+    shift = 63 - __builtin_clzll(value) - TIMING_HIST_SUB_BITS;
+    return ((shift + 1) << TIMING_HIST_SUB_BITS) + (int)(value >> shift) - TIMING_HIST_SUB;
+}
+
+static inline void
+timing_hist_add(timing_hist_t *hist, uint64_t value)
+{
+    hist->buckets[timing_hist_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+uint64_t timing_hist_percentile(const timing_hist_t *hist, double percentile);
+uint64_t timing_hist_mean(const timing_hist_t *hist);
+char *timing_hist_fmt(char *buf, size_t len, uint64_t nsec);
+void timing_hist_print(const char *name, const timing_hist_t *hist);
+
+#endif /* TIMING_HIST_H_ */
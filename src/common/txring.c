@@ -31,6 +31,9 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
+#include "defines.h"
+
 #ifdef HAVE_TX_RING
 
 #include "err.h"
@@ -39,203 +42,302 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <errno.h>
 
-volatile int shutdown_flag = 0;
-int tdata_offset = TPACKET_HDRLEN - sizeof(struct sockaddr_ll);
+/**
+ * Address of the given frame.  Frames never straddle ring blocks.
+ */
+static inline u_char *
+txring_frame(txring_t *txp, unsigned int index)
+{
+    unsigned int per_block = txp->treq.tp_block_size / txp->treq.tp_frame_size;
 
+    return txp->tx_head + (size_t)(index / per_block) * txp->treq.tp_block_size +
+        (index % per_block) * txp->treq.tp_frame_size;
+}
 
 /**
- * This task will call send() procedure
+ * Status word of a frame, shared with the kernel
  */
-void *
-txring_send(void *arg)
+static inline volatile uint32_t *
+txring_status(txring_t *txp, u_char *frame)
 {
-    int ec_send;
-    static int total = 0;
-    int fd_socket = (int)arg;
-
-    do {
-        /* send all buffers with TP_STATUS_SEND_REQUEST */
-        ec_send=sendto(fd_socket, NULL, 0, MSG_DONTWAIT,
-                (struct sockaddr *)NULL, sizeof(struct sockaddr_ll));
-
-        if (ec_send > 0) {
-            total += ec_send;
-            dbgx(2, "Sent %d bytes (+%d bytes)", total, ec_send);
-        } else  {
-            /* nothing to do => schedule : useful if no SMP */
-            usleep(100);
-        }
+#ifdef TPACKET3_HDRLEN
+    if (txp->version == TPACKET_V3)
+        return &((struct tpacket3_hdr *)frame)->tp_status;
+#endif
+    return &((struct tpacket2_hdr *)frame)->tp_status;
+}
 
+/**
+ * Tell the kernel to send all frames marked TP_STATUS_SEND_REQUEST.
+ * If wait is set, blocks until they have all left the ring.
+ * Returns the number of bytes sent or -1 on error
+ */
+int
+txring_flush(txring_t *txp, int wait)
+{
+    int sent;
 
-    } while (!shutdown_flag);
+    if (txp->tx_pending == 0 && !wait)
+        return 0;
 
-    //if(blocking) printf("end of task send()\n");
-    //printf("end of task send(ec=%x)\n", ec_send);
+    if ((sent = (int)sendto(txp->fd, NULL, 0, wait ? 0 : MSG_DONTWAIT, NULL, 0)) >= 0)
+        txp->tx_pending = 0;
 
-    return (void*) ec_send;
+    return sent;
 }
 
 /**
- * Put data in TX ring buffer and rotate it if necessary
+ * Move the tail past every frame the kernel has finished with.  Frames
+ * are handed out in order, so stop at the first one still in use.
+ * Returns the number of frames freed.
  */
-int
-txring_put(txring_t *txp, const void * data, size_t length)
+static unsigned int
+txring_reap(txring_t *txp)
 {
-    struct tpacket_hdr *ps_header;
-    char * to_data;
-    int loop = 1;
-    int first_loop = 1;
-    unsigned int start_index = txp->tx_index;
-
-    do {
-        ps_header = ((struct tpacket_hdr *)((void *)txp->tx_head + 
-                    (txp->treq->tp_frame_size * txp->tx_index)));
-        to_data = ((void*) ps_header) + tdata_offset;
-
-        switch ((volatile uint32_t)ps_header->tp_status) {
-            case TP_STATUS_WRONG_FORMAT:
-                warnx("TP_STATUS_WRONG_FORMAT occuries O_o. Frame %d, pkt len %d\n", 
-                        txp->tx_index, length);
-                break;
-
-            case TP_STATUS_AVAILABLE:
-                if (length > txp->treq->tp_frame_size) {
-                    //TODO Fragment packet
-                    warnx("[!] %d bytes from %d packet truncated\n",
-                            length-txp->treq->tp_frame_size, length);
-                    length = txp->treq->tp_frame_size;
-                }
-                memcpy(to_data, data, length);
-                ps_header->tp_len = length;
-                ps_header->tp_status = TP_STATUS_SEND_REQUEST;
-                loop = 0;
-                break;
-
-            default:
-                dbgx(2,"TPACKET status %u at frame %d with length %d\n",
-                        ps_header->tp_status, txp->tx_index, ps_header->tp_len);
-                usleep(0);
-                break;
+    volatile uint32_t *status;
+    unsigned int reaped = 0;
+
+    while (txp->tx_used > 0) {
+        status = txring_status(txp, txring_frame(txp, txp->tx_tail));
+        if (*status == TP_STATUS_WRONG_FORMAT) {
+            warnx("TX ring frame %u was rejected by the kernel", txp->tx_tail);
+            *status = TP_STATUS_AVAILABLE;
+        } else if (*status != TP_STATUS_AVAILABLE) {
+            break;
         }
-        txp->tx_index++;
 
-        if (txp->tx_index >= txp->treq->tp_frame_nr) {
-            txp->tx_index = 0;
-            first_loop = 0;
-        }
+        if (++txp->tx_tail >= txp->treq.tp_frame_nr)
+            txp->tx_tail = 0;
+        --txp->tx_used;
+        ++reaped;
+    }
+
+    return reaped;
+}
 
-        /* check if we've runned over all ring */
-        if ((txp->tx_index == start_index) && !first_loop) {
-            errno = ENOBUFS;
+/**
+ * Number of frames queued or in flight, as of the last time the ring
+ * was reaped.
+ */
+unsigned int
+txring_used(txring_t *txp)
+{
+    return txp->tx_used;
+}
+
+/**
+ * Copy a packet into the frame at the head of the TX ring.  This does not
+ * send it, call txring_flush() once a batch has been queued.
+ *
+ * Frame status is only read once the ring looks full, and then every
+ * finished frame is reclaimed at once.  Never blocks: if the kernel still
+ * holds every frame, queued frames are kicked and -1 is returned with
+ * errno set to ENOBUFS, so the caller can wait for POLLOUT and retry.
+ * Returns the # of bytes queued.
+ */
+int
+txring_put(txring_t *txp, const void *data, size_t length)
+{
+    u_char *frame;
+    size_t max_len = txp->treq.tp_frame_size - txp->data_offset;
+
+    if (txp->tx_used == txp->treq.tp_frame_nr && txring_reap(txp) == 0) {
+        if (txring_flush(txp, 0) < 0 && errno != EAGAIN && errno != ENOBUFS)
             return -1;
-        }
-    } while(loop == 1);
 
-    return ps_header->tp_len;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* don't let the data copy be reordered before the status reads */
+    __sync_synchronize();
+
+    if (length > max_len) {
+        warnx("%zu bytes from %zu byte packet truncated", length - max_len, length);
+        length = max_len;
+    }
+
+    /* txring_slot() may have had the packet built in the frame already */
+    frame = txring_frame(txp, txp->tx_index);
+    if (frame + txp->data_offset != (const u_char *)data)
+        memcpy(frame + txp->data_offset, data, length);
+#ifdef TPACKET3_HDRLEN
+    if (txp->version == TPACKET_V3)
+        ((struct tpacket3_hdr *)frame)->tp_len = length;
+    else
+#endif
+        ((struct tpacket2_hdr *)frame)->tp_len = length;
+
+    /* the frame must be complete before the kernel may see it */
+    __sync_synchronize();
+    *txring_status(txp, frame) = TP_STATUS_SEND_REQUEST;
+
+    if (++txp->tx_index >= txp->treq.tp_frame_nr)
+        txp->tx_index = 0;
+    ++txp->tx_used;
+    ++txp->tx_pending;
+
+    return (int)length;
 }
 
 
 /**
- * \brief Build TX ring buffer request structure
+ * \brief The frame the next txring_put() sends from
  *
- * This builds a ring buffer request structure making sure
- * that we have buffers big enough so that a frame which
- * is the size of the MTU doesn't get truncated. We also
- * need to structure things with minimum memory wastage 
+ * A packet built there by the caller and then passed to txring_put()
+ * isn't copied.  Nothing is queued until then, so the frame is free to be
+ * left for the next packet.  Returns the packet data area and its size in
+ * *room, or NULL if every frame is still in flight.
  */
-void
-txring_mkreq(struct tpacket_req* treq, unsigned int mtu)
+u_char *
+txring_slot(txring_t *txp, size_t *room)
 {
-    unsigned int pg,bs;
-    unsigned int s;
-    unsigned int mult = 1;
-    unsigned nr_blocks = 1000;
-
-    bs = pg = getpagesize();
-    s = mtu + TPACKET_HDRLEN;
-
-    memset(treq, 0, sizeof(struct tpacket_req));
-    if (bs <= s) {
-        while(bs < s) {
-            bs += pg;
-            mult++;
-        }
+    if (txp->tx_used == txp->treq.tp_frame_nr && txring_reap(txp) == 0)
+        return NULL;
 
-        treq->tp_block_size = bs;
-        treq->tp_frame_size = bs / mult;
-        treq->tp_block_nr   = nr_blocks;
-        treq->tp_frame_nr   = mult * nr_blocks;
-    } else {
-        while ((s * (mult + 1)) <=pg) {
-            mult++;
-        }
-        treq->tp_block_size = pg;
-        treq->tp_frame_size = pg / mult;
-        treq->tp_block_nr   = nr_blocks;
-        treq->tp_frame_nr   = mult * nr_blocks;
-    }
-    dbgx(1, "txring: block_size=%d block_nr=%d frame_size=%d frame_nr=%d", 
-            treq->tp_block_size, treq->tp_block_nr, treq->tp_frame_size, 
-            treq->tp_frame_nr);
+    /* don't let the caller's writes be reordered before the status reads */
+    __sync_synchronize();
+
+    *room = txp->treq.tp_frame_size - txp->data_offset;
+    return txring_frame(txp, txp->tx_index) + txp->data_offset;
+}
+
+
+/**
+ * \brief Build TX ring buffer request structure
+ *
+ * Frames are sized for an MTU sized packet plus ethernet and VLAN headers.
+ * Blocks are at least TXRING_BLOCK_SIZE so that several frames share each
+ * one.  The ring gets as many frames as fit in TXRING_MEM_SIZE, or in
+ * 1/TXRING_MEM_SHARE of physical memory if that is less, but never fewer
+ * than TXRING_MIN_FRAMES.
+ */
+static void
+txring_mkreq(txring_t *txp, unsigned int mtu)
+{
+    unsigned int pagesize = getpagesize();
+    unsigned int frame_size, block_size, per_block, frames;
+    size_t mem = TXRING_MEM_SIZE;
+    long phys_pages;
+
+    frame_size = TPACKET_ALIGN(txp->data_offset + mtu + ETH_HLEN + 4);
+    block_size = TXRING_BLOCK_SIZE;
+    while (block_size < frame_size)
+        block_size += pagesize;
+
+    per_block = block_size / frame_size;
+
+#ifdef _SC_PHYS_PAGES
+    if ((phys_pages = sysconf(_SC_PHYS_PAGES)) > 0 &&
+            (size_t)phys_pages / TXRING_MEM_SHARE * pagesize < mem)
+        mem = (size_t)phys_pages / TXRING_MEM_SHARE * pagesize;
+#else
+    phys_pages = 0;
+#endif
+
+    frames = max(mem / frame_size, TXRING_MIN_FRAMES);
+
+    memset(&txp->treq, 0, sizeof(txp->treq));
+    txp->treq.tp_block_size = block_size;
+    txp->treq.tp_frame_size = frame_size;
+    txp->treq.tp_block_nr = (frames + per_block - 1) / per_block;
+    txp->treq.tp_frame_nr = per_block * txp->treq.tp_block_nr;
+
+    dbgx(1, "txring: TPACKET_V%d block_size=%d block_nr=%d frame_size=%d frame_nr=%d phys_pages=%ld",
+            txp->version + 1, txp->treq.tp_block_size, txp->treq.tp_block_nr,
+            txp->treq.tp_frame_size, txp->treq.tp_frame_nr, phys_pages);
 }
 
 /**
  * \brief Create TX ring for socket and init indexes
  *
- * Creates our pthread for sending, currently hardcoded for priority = 20
+ * Uses TPACKET_V3 frames if the kernel supports them for transmit
+ * (Linux 4.11+), else TPACKET_V2.  Returns NULL and sets errno on error.
  */
 txring_t *
 txring_init(int fd, unsigned int mtu)
 {
-    pthread_attr_t t_attr_send;
-    struct sched_param para_send;
+    static const int versions[] = {
+#ifdef TPACKET3_HDRLEN
+        TPACKET_V3,
+#endif
+        TPACKET_V2,
+    };
     int mode_loss = 0;
     txring_t *txp;
+    unsigned int i;
+    int err = EINVAL;
 
-    /* allocate memory for structure and fill it with different stuff*/
-    *txp = (txring_t *)safe_malloc(sizeof(txring_t));
-    txp->treq = (struct tpacket_req *)safe_malloc(sizeof(struct tpacket_req));
-
-    txring_mkreq(txp->treq, mtu);
-    txp->tx_size = txp->treq->tp_block_size * txp->treq->tp_block_nr;
-    txp->tx_index = 0; /* Set index on start*/
+    txp = (txring_t *)safe_malloc(sizeof(txring_t));
+    txp->fd = fd;
 
     /* Set PACKET_LOSS sockoption */
     if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, (char *)&mode_loss,
                 sizeof(mode_loss)) < 0) {
-        perror("setsockopt: PACKET_LOSS");
-        return NULL;
+        err = errno;
+        goto fail;
     }
 
-    /* Enable TX Ring */
-    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, (char *)txp->treq,
-                sizeof(struct tpacket_req)) < 0) {
-        perror("Can't setsockopt PACKET_TX_RING");
-        return NULL;
+    for (i = 0; i < sizeof(versions) / sizeof(versions[0]); i++) {
+        txp->version = versions[i];
+        if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &txp->version,
+                    sizeof(txp->version)) < 0) {
+            err = errno;
+            continue;
+        }
+
+#ifdef TPACKET3_HDRLEN
+        if (txp->version == TPACKET_V3)
+            txp->data_offset = TPACKET3_HDRLEN - sizeof(struct sockaddr_ll);
+        else
+#endif
+            txp->data_offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+        txring_mkreq(txp, mtu);
+
+        /* Enable TX Ring */
+        if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, (char *)&txp->treq,
+                    sizeof(txp->treq)) == 0)
+            break;
+
+        err = errno;
+        dbgx(1, "txring: TPACKET_V%d TX ring unavailable: %s", txp->version + 1,
+                strerror(err));
     }
 
+    if (i == sizeof(versions) / sizeof(versions[0]))
+        goto fail;
 
     /* mmap unswapped memory with TX ring buffer*/
+    txp->tx_size = (size_t)txp->treq.tp_block_size * txp->treq.tp_block_nr;
     txp->tx_head = mmap(0, txp->tx_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (txp->tx_head == MAP_FAILED) {
-        perror("mmap() failed ");
-        return NULL;
+        err = errno;
+        goto fail;
     }
 
-    /* Start poll thread*/
-    pthread_attr_init(&t_attr_send);
-    pthread_attr_setschedpolicy(&t_attr_send, SCHED_RR);
-    para_send.sched_priority = 20;
-    pthread_attr_setschedparam(&t_attr_send, &para_send);
+    return txp;
+
+fail:
+    safe_free(txp);
+    errno = err;
+    return NULL;
+}
 
-    if (pthread_create(&txp->tx_send, &t_attr_send, txring_send, (void *)fd) != 0) {
-        perror("pthread_create() failed\n");
-        abort();
-    }
+/**
+ * Unmap the ring.  Frames not yet sent are dropped, so flush first.
+ */
+void
+txring_close(txring_t *txp)
+{
+    if (txp == NULL)
+        return;
 
-    return txp;
+    munmap(txp->tx_head, txp->tx_size);
+    safe_free(txp);
 }
 
 #endif /* HAVE_TX_RING */
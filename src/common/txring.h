@@ -39,29 +39,44 @@
 
 #ifdef HAVE_TX_RING
 
-#if __GLIBC__ >= 2 && __GLIBC_MINOR >= 1
-#include <netpacket/packet.h>
-#include <net/ethernet.h>       /* the L2 protocols */
-#else
+/*
+ * linux/if_packet.h has the tpacket ring structures, but it also defines
+ * struct sockaddr_ll so it can't be mixed with <netpacket/packet.h>
+ */
 #include <asm/types.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>     /* The L2 protocols */
-#endif
-#include <pthread.h>
+
+#define TXRING_MEM_SIZE     (8 << 20)   /* ring memory budget */
+#define TXRING_MEM_SHARE    64          /* ... but at most 1/64 of RAM */
+#define TXRING_MIN_FRAMES   256         /* whatever the MTU */
+#define TXRING_BLOCK_SIZE   (1 << 16)   /* minimum ring block size */
 
 struct txring_s
 {
-    pthread_t tx_send; /*Poll TX thread*/
-
-    volatile struct tpacket_hdr * tx_head; /* Pointer to mmaped memory with TX ring */
-    struct tpacket_req* treq; /* TX ring parametrs */
-    volatile unsigned int tx_index; /* TX index */
-    int tx_size; /* Size of mmaped TX ring */
+    u_char *tx_head;                /* Pointer to mmaped memory with TX ring */
+    size_t tx_size;                 /* Size of mmaped TX ring */
+#ifdef TPACKET3_HDRLEN
+    struct tpacket_req3 treq;       /* TX ring parameters, V2 uses the first half */
+#else
+    struct tpacket_req treq;        /* TX ring parameters */
+#endif
+    unsigned int tx_index;          /* head: next frame to fill */
+    unsigned int tx_tail;           /* oldest frame handed to the kernel */
+    unsigned int tx_used;           /* frames from tail to head in flight */
+    unsigned int tx_pending;        /* frames queued since the last flush */
+    unsigned int data_offset;       /* start of packet data within a frame */
+    int version;                    /* TPACKET_V2 or TPACKET_V3 */
+    int fd;
 };
 typedef struct txring_s txring_t;
 
-int txring_put(txring_t *txp, const void * data, size_t length);
-txring_t* txring_init(int fd, unsigned int mtu);
+int txring_put(txring_t *txp, const void *data, size_t length);
+u_char *txring_slot(txring_t *txp, size_t *room);
+int txring_flush(txring_t *txp, int wait);
+unsigned int txring_used(txring_t *txp);
+txring_t *txring_init(int fd, unsigned int mtu);
+void txring_close(txring_t *txp);
 #endif /* HAVE_TX_RING */
 
 #endif /*COMMON_TXRING_H */
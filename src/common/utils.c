@@ -31,6 +31,8 @@
 extern int debug;
 #endif
 
+static void stage_stats(const tcpreplay_stats_t *stats);
+
 /**
  * this is wrapped up in a #define safe_malloc
  * This function, detects failures to malloc memory and zeros out the
@@ -175,6 +177,69 @@ packet_stats(const tcpreplay_stats_t *stats)
     if (stats->failed)
         printf(COUNTER_SPEC " write attempts failed from full buffers and were repeated\n",
                 stats->failed);
+
+    if (stats->send_gap.count) {
+        timing_hist_print("Gap", &stats->send_gap);
+        timing_hist_print("Gap error", &stats->send_error);
+        printf("Gaps: " COUNTER_SPEC " shorter than scheduled, " COUNTER_SPEC " on time or longer\n",
+                stats->send_early, stats->send_error.count - stats->send_early);
+    }
+
+    if (stats->wire_gaps || stats->wire_missed)
+        printf("Gaps timed on the wire: " COUNTER_SPEC ", departure times missing: " COUNTER_SPEC "\n",
+                stats->wire_gaps, stats->wire_missed);
+
+    if (stats->measure_sent) {
+        COUNTER lost = stats->measure_received < stats->measure_sent ?
+                stats->measure_sent - stats->measure_received : 0;
+
+        if (stats->latency.count)
+            timing_hist_print("Latency", &stats->latency);
+        printf("Measured: " COUNTER_SPEC " sent, " COUNTER_SPEC " received, " COUNTER_SPEC
+                " lost (%.3f%%), " COUNTER_SPEC " reordered, " COUNTER_SPEC " duplicated\n",
+                stats->measure_sent, stats->measure_received, lost,
+                (double)lost * 100.0 / (double)stats->measure_sent,
+                stats->measure_reordered, stats->measure_duplicates);
+        if (stats->measure_early)
+            printf("Measured: " COUNTER_SPEC " received before they were sent, are the clocks in sync?\n",
+                    stats->measure_early);
+    }
+
+    if (stats->late.count) {
+        timing_hist_print("Late", &stats->late);
+        printf("Late: " COUNTER_SPEC " packets past --late-threshold, " COUNTER_SPEC " dropped\n",
+                stats->late_packets, stats->late_dropped);
+    }
+
+    if (stats->stage_samples)
+        stage_stats(stats);
+}
+
+/**
+ * Prints where the packets timed by --stage-profile spent their time
+ */
+static void
+stage_stats(const tcpreplay_stats_t *stats)
+{
+    static const char *names[STAGE_MAX] = {
+        "read", "edit", "unique-ip", "flow stats", "sleep", "send"
+    };
+    COUNTER total = 0;
+    int i;
+
+    for (i = 0; i < STAGE_MAX; i++)
+        total += stats->stage_ns[i];
+
+    printf("Stage profile: " COUNTER_SPEC " packets timed, 1 in " COUNTER_SPEC "\n",
+            stats->stage_samples, stats->stage_every);
+    for (i = 0; i < STAGE_MAX; i++) {
+        if (!stats->stage_ns[i])
+            continue;
+
+        printf("\t%-11s %10.1f ns/pkt %5.1f%%\n", names[i],
+                (double)stats->stage_ns[i] / stats->stage_samples,
+                total ? 100.0 * stats->stage_ns[i] / total : 0.0);
+    }
 }
 
 /**
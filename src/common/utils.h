@@ -25,6 +25,18 @@
 #include "config.h"
 #include "defines.h"
 #include "common.h"
+#include "timing_hist.h"
+
+/* parts of the send loop --stage-profile times, in the order they run */
+typedef enum {
+    STAGE_READ,                 /* get_next_packet() */
+    STAGE_EDIT,                 /* tcpedit_packet() */
+    STAGE_UNIQUE_IP,            /* fast_edit_packet() */
+    STAGE_FLOW,                 /* update_flow_stats() */
+    STAGE_SLEEP,                /* do_sleep() */
+    STAGE_SEND,                 /* sendpacket() */
+    STAGE_MAX
+} replay_stage_t;
 
 typedef struct {
     char *active_pcap;
@@ -33,7 +45,7 @@ typedef struct {
     COUNTER failed;
     struct timeval start_time;
     struct timeval end_time;
-    struct timeval last_time;
+    COUNTER last_ts_ns;         /* capture time of the newest packet sent */
     struct timeval last_print;
     COUNTER flow_non_flow_packets;
     COUNTER flows;
@@ -41,6 +53,29 @@ typedef struct {
     COUNTER flow_packets;
     COUNTER flows_expired;
     COUNTER flows_invalid_packets;
+    COUNTER flow_table_flows;   /* flows held in the flow table */
+    COUNTER flow_table_slots;   /* slots allocated for them */
+    COUNTER flow_table_bytes;
+    COUNTER flow_table_resets;  /* times the table was emptied between passes */
+    COUNTER preload_bytes;      /* --preload-pcap cache headers, data and tables */
+    COUNTER cache_bytes;        /* tcpprep cache bitmap */
+    timing_hist_t send_gap;     /* nsec between consecutive sends */
+    timing_hist_t send_error;   /* nsec those gaps were off from the capture/rate */
+    COUNTER send_early;         /* gaps that were shorter than asked for */
+    COUNTER wire_gaps;          /* --tx-timestamps: of those, timed by departure */
+    COUNTER wire_missed;        /* packets whose departure time never came back */
+    timing_hist_t latency;      /* --measure: nsec from sending to receiving */
+    COUNTER measure_sent;       /* packets tagged */
+    COUNTER measure_received;
+    COUNTER measure_reordered;
+    COUNTER measure_duplicates;
+    COUNTER measure_early;      /* received before they were sent */
+    timing_hist_t late;         /* nsec packets were behind their time */
+    COUNTER late_packets;       /* more than --late-threshold behind */
+    COUNTER late_dropped;       /* of those, dropped by --late-policy=drop */
+    COUNTER stage_every;        /* --stage-profile: 1 in this many packets is timed */
+    COUNTER stage_samples;      /* packets timed */
+    COUNTER stage_ns[STAGE_MAX];    /* nsec those packets spent in each stage */
 } tcpreplay_stats_t;
 
 
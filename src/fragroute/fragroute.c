@@ -36,43 +36,68 @@
 #include "mod.h"
 // #include "tun.h"
 
+/*
+ * hand the packets of the last fragroute_process() back to the pool,
+ * the caller has copied out everything it wanted by now
+ */
+static void
+fragroute_recycle(fragroute_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < PKTQ_COUNT(&ctx->pktq); i++)
+        pkt_free(PKTQ_GET(&ctx->pktq, i));
+    ctx->pktq.cnt = 0;
+}
+
 void
 fragroute_close(fragroute_t *ctx)
 {
-    free(ctx->pktq);
+    fragroute_recycle(ctx);
+    mod_close(&ctx->rules);
+    pkt_pool_close(&ctx->pool);
+    safe_free(ctx->frags);
+    pktq_release(&ctx->pktq);
+    pktq_release(&ctx->runq);
     free(ctx);
     ctx = NULL;
 }
 
 
-int
-fragroute_process(fragroute_t *ctx, void *buf, size_t len)
+/*
+ * run one packet through the fragroute rules, leaving what comes out of
+ * them in pktq
+ */
+static int
+fragroute_run(fragroute_t *ctx, void *buf, size_t len, const pkt_meta_t *meta,
+        struct pktq *pktq)
 {
     struct pkt *pkt;
-    assert(ctx);
-    assert(buf);
-    
-    ctx->first_packet = 0;
+
     /* save the l2 header of the original packet for later */
-    ctx->l2len = get_l2len(buf, len, ctx->dlt);
+    ctx->l2len = meta ? meta->l2len : get_l2len(buf, len, ctx->dlt);
     memcpy(ctx->l2header, buf, ctx->l2len);
 
-    if ((pkt = pkt_new()) == NULL) {
-        strcpy(ctx->errbuf, "unable to pkt_new()");
-        return -1;
-    }
     if (len > PKT_BUF_LEN) {
         sprintf(ctx->errbuf, "skipping oversized packet: %zu", len);
         return -1;
     }
+    if ((pkt = pkt_new(&ctx->pool)) == NULL) {
+        strcpy(ctx->errbuf, "unable to pkt_new()");
+        return -1;
+    }
 
     memcpy(pkt->pkt_data, buf, len);
     pkt->pkt_end = pkt->pkt_data + len;
 
-    pkt_decorate(pkt);
+    if (meta)
+        pkt_decorate_meta(pkt, meta);
+    else
+        pkt_decorate(pkt);
 
     if (pkt->pkt_ip == NULL) {
         strcpy(ctx->errbuf, "skipping non-IP packet");
+        pkt_free(pkt);
         return -1;
     }
 /*  Don't always checksum packets before being fragged
@@ -81,14 +106,26 @@ fragroute_process(fragroute_t *ctx, void *buf, size_t len)
     }
 */
 
-    TAILQ_INIT(ctx->pktq);
-    TAILQ_INSERT_TAIL(ctx->pktq, pkt, pkt_next);
+    pktq->cnt = 0;
+    pktq_append(pktq, pkt);
 
-    mod_apply(ctx->pktq);
+    mod_apply(&ctx->rules, pktq);
 
     return 0;
 }
 
+int
+fragroute_process(fragroute_t *ctx, void *buf, size_t len)
+{
+    assert(ctx);
+    assert(buf);
+    
+    ctx->first_packet = 0;
+    fragroute_recycle(ctx);
+
+    return fragroute_run(ctx, buf, len, NULL, &ctx->pktq);
+}
+
 /*
  * keep calling this after fragroute_process() to get all the fragments.
  * Each call returns the fragment length which is stored in **packet.
@@ -97,32 +134,87 @@ fragroute_process(fragroute_t *ctx, void *buf, size_t len)
 int
 fragroute_getfragment(fragroute_t *ctx, char **packet)
 {
-    static struct pkt *pkt = NULL;
-    static struct pkt *next = NULL;
+    struct pkt *pkt;
     char *pkt_data = *packet;
     u_int32_t length;
     
-    if (ctx->first_packet != 0) {
-        pkt = next;
-    } else {
+    if (ctx->first_packet == 0) {
         ctx->first_packet = 1;
-        pkt = TAILQ_FIRST(ctx->pktq);
+        ctx->next_frag = 0;
     }
     
-    if (pkt != TAILQ_END(&(ctx->pktq))) {
-        next = TAILQ_NEXT(pkt, pkt_next);
+    if (ctx->next_frag < PKTQ_COUNT(&ctx->pktq)) {
+        pkt = PKTQ_GET(&ctx->pktq, ctx->next_frag++);
+        pkt_flatten(pkt);
         memcpy(pkt_data, pkt->pkt_data, pkt->pkt_end - pkt->pkt_data);
         
         /* return the original L2 header */
         memcpy(pkt_data, ctx->l2header, ctx->l2len);
         length = pkt->pkt_end - pkt->pkt_data;
-        pkt = next;
         return length;
     }
 
     return 0; // nothing
 }
 
+/*
+ * Runs count packets through fragroute at once.  *frags is set to an
+ * array describing all the fragments, in order, which is returned.  The
+ * fragments are not copied: the descriptors point into fragroute's own
+ * packet buffers, which already carry the original L2 header and stay
+ * valid until the next call on ctx.  metas, unless NULL, has the
+ * get_pkt_meta() of every packet so they aren't decoded again.
+ * Returns -1 on error.
+ */
+int
+fragroute_process_batch(fragroute_t *ctx, u_char *const *bufs, const size_t *lens,
+        const pkt_meta_t *metas, int count, fragroute_frag_t **frags)
+{
+    struct pkt *pkt;
+    int i, j, nfrags = 0;
+
+    assert(ctx);
+    assert(bufs);
+    assert(lens);
+    assert(frags);
+
+    ctx->first_packet = 0;
+    fragroute_recycle(ctx);
+
+    for (i = 0; i < count; i++) {
+        if (fragroute_run(ctx, bufs[i], lens[i], metas ? &metas[i] : NULL,
+                &ctx->runq) < 0)
+            return -1;
+
+        /* the fragments stay in ctx->pktq until the next call */
+        for (j = 0; j < PKTQ_COUNT(&ctx->runq); j++) {
+            pkt = PKTQ_GET(&ctx->runq, j);
+            pktq_append(&ctx->pktq, pkt);
+
+            /* segments and fragments are joined only here, see pkt_slice() */
+            pkt_flatten(pkt);
+
+            if (nfrags == ctx->frags_len) {
+                ctx->frags_len = ctx->frags_len ? ctx->frags_len * 2 : 64;
+                ctx->frags = (fragroute_frag_t *)safe_realloc(ctx->frags,
+                        ctx->frags_len * sizeof(fragroute_frag_t));
+            }
+
+            /* return the original L2 header */
+            memcpy(pkt->pkt_data, ctx->l2header, ctx->l2len);
+            ctx->frags[nfrags].data = pkt->pkt_data;
+            ctx->frags[nfrags].len = pkt->pkt_end - pkt->pkt_data;
+            ctx->frags[nfrags].packet = i;
+            ctx->frags[nfrags].delay = pkt->pkt_ts;
+            nfrags++;
+        }
+        ctx->runq.cnt = 0;
+    }
+
+    *frags = ctx->frags;
+    return nfrags;
+}
+
 fragroute_t *
 fragroute_init(const int mtu, const int dlt, const char *config, char *errbuf)
 {
@@ -135,15 +227,17 @@ fragroute_init(const int mtu, const int dlt, const char *config, char *errbuf)
         
 
     ctx = (fragroute_t *)safe_malloc(sizeof(fragroute_t));
-    ctx->pktq = (struct pktq *)safe_malloc(sizeof(struct pktq));
+    pktq_init(&ctx->pktq);
+    pktq_init(&ctx->runq);
+    TAILQ_INIT(&ctx->rules);
     ctx->dlt = dlt;
 
-    pkt_init(128);
+    pkt_pool_init(&ctx->pool, 128);
 
     ctx->mtu = mtu;
 
     /* parse the config */
-    if (mod_open(config, errbuf) < 0) {
+    if (mod_open(&ctx->rules, config, errbuf) < 0) {
         fragroute_close(ctx);
         return NULL;
     }
@@ -22,12 +22,28 @@
 
 #include "config.h"
 #include "pkt.h"
+#include "mod.h"
 
 #ifndef __FRAGROUTE_H__
 #define __FRAGROUTE_H__
 
 #define FRAGROUTE_ERRBUF_LEN 1024
 
+/* which packets --fragdir sends through fragroute */
+#define FRAGROUTE_DIR_C2S  1
+#define FRAGROUTE_DIR_S2C  2
+#define FRAGROUTE_DIR_BOTH 4
+
+/* One fragment produced by fragroute_process_batch() */
+struct fragroute_frag_s {
+    u_char  *data;      /* in fragroute's buffers, valid until the next call */
+    int     len;
+    int     packet;     /* index of the packet it was made from */
+    struct timeval delay; /* send this long after the packet, set by delay and ordering rules */
+};
+
+typedef struct fragroute_frag_s fragroute_frag_t;
+
 /* Fragroute context. */
 struct fragroute_s {
 	struct addr	 src;
@@ -45,13 +61,21 @@ struct fragroute_s {
 //	route_t		*route;
 //	tun_t		*tun;
     char        errbuf[FRAGROUTE_ERRBUF_LEN];
-	struct pktq *pktq; /* packet chain */    
+	struct pktq pktq; /* fragments of the last process call */
+    struct pktq runq; /* one packet going through the rules */
+    struct pkt_pool pool; /* where this instance's packets come from */
+    struct rules rules; /* parsed from the config file */
+    int     next_frag; /* pktq position fragroute_getfragment() returns next */
+    fragroute_frag_t *frags; /* fragroute_process_batch() results */
+    int     frags_len; /* entries allocated in frags */
 };
 
 typedef struct fragroute_s fragroute_t;
 
 int fragroute_process(fragroute_t *ctx, void *buf, size_t len);
 int fragroute_getfragment(fragroute_t *ctx, char **packet);
+int fragroute_process_batch(fragroute_t *ctx, u_char *const *bufs, const size_t *lens,
+        const struct pkt_meta_s *metas, int count, fragroute_frag_t **frags);
 fragroute_t * fragroute_init(const int mtu, const int dlt, const char *config, char *errbuf);
 void fragroute_close(fragroute_t *ctx);
 
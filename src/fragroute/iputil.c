@@ -96,6 +96,45 @@ inet_checksum(uint16_t eth_type, void *buf, size_t len)
     }
 }
 
+/*
+ * inet_checksum() of a TCP segment whose payload isn't behind its
+ * headers: buf holds the IP and TCP headers, hdrlen bytes, and data
+ * the len bytes of payload.
+ */
+void
+inet_checksum_tcp(uint16_t eth_type, void *buf, size_t hdrlen,
+        const void *data, size_t len)
+{
+    struct ip_hdr *ip = (struct ip_hdr *)buf;
+    struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+    struct tcp_hdr *tcp;
+    size_t hl;
+    int sum;
+
+    if (eth_type == ETH_TYPE_IP) {
+        hl = ip->ip_hl << 2;
+        ip_checksum(buf, hl);       /* the IP header only */
+    } else if (eth_type == ETH_TYPE_IPV6) {
+        hl = IP6_HDR_LEN;
+    } else {
+        return;
+    }
+
+    /* the headers are a whole number of 16 bit words */
+    tcp = (struct tcp_hdr *)((u_char *)buf + hl);
+    tcp->th_sum = 0;
+    sum = ip_cksum_add(tcp, hdrlen - hl, 0);
+    sum = ip_cksum_add(data, len, sum);
+    sum += htons(IP_PROTO_TCP + hdrlen - hl + len);
+
+    if (eth_type == ETH_TYPE_IP)
+        sum = ip_cksum_add(&ip->ip_src, 8, sum);
+    else
+        sum = ip_cksum_add(&ip6->ip6_src, 32, sum);
+
+    tcp->th_sum = ip_cksum_carry(sum);
+}
+
 int
 raw_ip_opt_parse(int argc, char *argv[], uint8_t *opt_type, uint8_t *opt_len,
         uint8_t *buff, int buff_len)
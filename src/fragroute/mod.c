@@ -67,8 +67,6 @@ static struct mod *mods[] = {
 	NULL
 };
 
-static TAILQ_HEAD(head, rule) rules;
-
 void
 mod_usage(void)
 {
@@ -80,7 +78,7 @@ mod_usage(void)
 }
 
 int
-mod_open(const char *script, char *errbuf)
+mod_open(struct rules *rules, const char *script, char *errbuf)
 {
 	FILE *fp;
 	struct mod **m;
@@ -88,7 +86,7 @@ mod_open(const char *script, char *errbuf)
 	char *argv[MAX_ARGS], buf[BUFSIZ];
 	int i, argc, ret = 0;
 
-	TAILQ_INIT(&rules);
+	TAILQ_INIT(rules);
 	
 	/* open the config/script file */
 	if ((fp = fopen(script, "r")) == NULL) {
@@ -139,11 +137,12 @@ mod_open(const char *script, char *errbuf)
 		    (rule->data = rule->mod->open(argc, argv)) == NULL) {
 			sprintf(errbuf, "invalid argument to directive '%s' (line %d)",
 			    rule->mod->name, i);
+			free(rule);
 			ret = -1;
 			break;
 		}
 		/* append the rule to the rule list */
-		TAILQ_INSERT_TAIL(&rules, rule, next);
+		TAILQ_INSERT_TAIL(rules, rule, next);
 	}
 	
 	/* close the file */
@@ -152,7 +151,7 @@ mod_open(const char *script, char *errbuf)
     
 	if (ret == 0) {
 		buf[0] = '\0';
-		TAILQ_FOREACH(rule, &rules, next) {
+		TAILQ_FOREACH(rule, rules, next) {
 			strlcat(buf, rule->mod->name, sizeof(buf));
 			strlcat(buf, " -> ", sizeof(buf));
 		}
@@ -164,24 +163,26 @@ mod_open(const char *script, char *errbuf)
 }
 
 void
-mod_apply(struct pktq *pktq)
+mod_apply(struct rules *rules, struct pktq *pktq)
 {
 	struct rule *rule;
 	
-	TAILQ_FOREACH(rule, &rules, next) {
+	TAILQ_FOREACH(rule, rules, next) {
+		if ((rule->mod->flags & MOD_SLICES) == 0)
+			pktq_flatten(pktq);
 		rule->mod->apply(rule->data, pktq);
 	}
 }
 
 void
-mod_close(void)
+mod_close(struct rules *rules)
 {
 	struct rule *rule;
 	
-	TAILQ_FOREACH_REVERSE(rule, &rules, next, head) {
+	while ((rule = TAILQ_LAST(rules, rules)) != NULL) {
 		if (rule->mod->close != NULL)
 			rule->data = rule->mod->close(rule->data);
-		TAILQ_REMOVE(&rules, rule, next);
+		TAILQ_REMOVE(rules, rule, next);
 		free(rule);
 	}
 }
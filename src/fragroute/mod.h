@@ -9,6 +9,7 @@
 #ifndef MOD_H
 #define MOD_H
 
+#include "../../lib/queue.h"
 #include "pkt.h"
 
 struct mod {
@@ -17,11 +18,18 @@ struct mod {
 	void	*(*open)(int argc, char *argv[]);
 	int	 (*apply)(void *data, struct pktq *pktq);
 	void	*(*close)(void *data);
+	int	  flags;
 };
 
+#define MOD_SLICES	0x01	/* apply() doesn't look at pkt_slice() payloads */
+
+/* the rules of one fragroute instance, in the order they are applied */
+struct rule;
+TAILQ_HEAD(rules, rule);
+
 void	mod_usage(void);
-int	mod_open(const char *script, char *errbuf);
-void	mod_apply(struct pktq *pktq);
-void	mod_close(void);
+int	mod_open(struct rules *rules, const char *script, char *errbuf);
+void	mod_apply(struct rules *rules, struct pktq *pktq);
+void	mod_close(struct rules *rules);
 
 #endif /* MOD_H */
@@ -74,16 +74,19 @@ int
 delay_apply(void *d, struct pktq *pktq)
 {
 	struct delay_data *data = (struct delay_data *)d;
-	struct pkt *pkt;
+	int i;
 	
 	if (data->which == DELAY_FIRST)
-		pkt = TAILQ_FIRST(pktq);
+		i = 0;
 	else if (data->which == DELAY_LAST)
-		pkt = TAILQ_LAST(pktq, pktq);
+		i = PKTQ_COUNT(pktq) - 1;
 	else 
-		pkt = pktq_random(data->rnd, pktq);
+		i = pktq_random(data->rnd, pktq);
+
+	if (i < 0)
+		return (0);
 	
-	memcpy(&pkt->pkt_ts, &data->tv, sizeof(pkt->pkt_ts));
+	PKTQ_GET(pktq, i)->pkt_ts = data->tv;
 	
 	return (0);
 }
@@ -93,5 +96,6 @@ struct mod mod_delay = {
 	"delay first|last|random <ms>",	/* usage */
 	delay_open,			/* open */
 	delay_apply,			/* apply */
-	delay_close			/* close */
+	delay_close,			/* close */
+	MOD_SLICES			/* flags */
 };
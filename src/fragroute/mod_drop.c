@@ -69,21 +69,23 @@ int
 drop_apply(void *d, struct pktq *pktq)
 {
 	struct drop_data *data = (struct drop_data *)d;
-	struct pkt *pkt;
+	int i;
 
 	if (data->percent < 100 &&
 	    (rand_uint16(data->rnd) % 100) > data->percent)
 		return (0);
 	
 	if (data->which == DROP_FIRST)
-		pkt = TAILQ_FIRST(pktq);
+		i = 0;
 	else if (data->which == DROP_LAST)
-		pkt = TAILQ_LAST(pktq, pktq);
+		i = PKTQ_COUNT(pktq) - 1;
 	else
-		pkt = pktq_random(data->rnd, pktq);
+		i = pktq_random(data->rnd, pktq);
 
-	TAILQ_REMOVE(pktq, pkt, pkt_next);
-	pkt_free(pkt);
+	if (i < 0)
+		return (0);
+
+	pkt_free(pktq_remove(pktq, i));
 	
 	return (0);
 }
@@ -93,5 +95,6 @@ struct mod mod_drop = {
 	"drop first|last|random <prob-%>",	/* usage */
 	drop_open,				/* open */
 	drop_apply,				/* apply */
-	drop_close				/* close */
+	drop_close,				/* close */
+	MOD_SLICES				/* flags */
 };
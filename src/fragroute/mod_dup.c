@@ -69,24 +69,26 @@ int
 dup_apply(void *d, struct pktq *pktq)
 {
 	struct dup_data *data = (struct dup_data *)d;
-	struct pkt *pkt, *new;
+	struct pkt *new;
+	int i;
 	
 	if (data->percent < 100 &&
 	    (rand_uint16(data->rnd) % 100) > data->percent)
 		return (0);
 	
-	if ((new = pkt_new()) == NULL)
-		return (-1);
-	
 	if (data->which == DUP_FIRST)
-		pkt = TAILQ_FIRST(pktq);
+		i = 0;
 	else if (data->which == DUP_LAST)
-		pkt = TAILQ_LAST(pktq, pktq);
+		i = PKTQ_COUNT(pktq) - 1;
 	else
-		pkt = pktq_random(data->rnd, pktq);
+		i = pktq_random(data->rnd, pktq);
+
+	if (i < 0)
+		return (0);
 	
-	new = pkt_dup(pkt);
-	TAILQ_INSERT_AFTER(pktq, pkt, new, pkt_next);
+	if ((new = pkt_dup(PKTQ_GET(pktq, i))) == NULL)
+		return (-1);
+	pktq_insert(pktq, i + 1, new);
 	
 	return (0);
 }
@@ -96,5 +98,6 @@ struct mod mod_dup = {
 	"dup first|last|random <prob-%>",	/* usage */
 	dup_open,				/* open */
 	dup_apply,				/* apply */
-	dup_close				/* close */
+	dup_close,				/* close */
+	MOD_SLICES				/* flags */
 };
@@ -53,5 +53,6 @@ struct mod mod_echo = {
 	"echo <string> ...",		/* usage */
 	echo_open,			/* open */
 	echo_apply,			/* apply */
-	echo_close			/* close */
+	echo_close,			/* close */
+	MOD_SLICES			/* flags */
 };
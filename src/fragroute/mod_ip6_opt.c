@@ -111,11 +111,12 @@ ip6_opt_apply(void *d, struct pktq *pktq)
 	struct ip6_ext_hdr* ext;
 	int offset, len;
 	struct pkt *pkt;
+	int n;
 	uint8_t nxt, iph_nxt;
 	uint8_t* p;
 	int i;
 
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
+	PKTQ_FOREACH(pkt, n, pktq) {
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
 		if (eth_type != ETH_TYPE_IPV6) {
@@ -128,9 +129,7 @@ ip6_opt_apply(void *d, struct pktq *pktq)
 		if (opt->type == OPT6_TYPE_ROUTE) {
 			offset = 8 + IP6_ADDR_LEN * opt->u.route.segments;
 			memmove(((u_char*)ext) + offset, ext, pkt->pkt_end - (u_char*)ext);
-
-			pkt->pkt_end += offset;
-			pkt->pkt_ip_data += offset;
+			pkt_insert_hdr(pkt, (u_char *)ext, offset);
 
 			len = (IP6_ADDR_LEN / 8) * opt->u.route.segments;
 
@@ -151,9 +150,7 @@ ip6_opt_apply(void *d, struct pktq *pktq)
 		} else if (opt->type == OPT6_TYPE_RAW) {
 			offset = opt->u.raw.len;
 			memmove(((u_char*)ext) + offset, ext, pkt->pkt_end - (u_char*)ext);
-
-			pkt->pkt_end += offset;
-			pkt->pkt_ip_data += offset;
+			pkt_insert_hdr(pkt, (u_char *)ext, offset);
 
 			iph_nxt = opt->u.raw.proto;
 
@@ -180,8 +177,6 @@ ip6_opt_apply(void *d, struct pktq *pktq)
 		pkt->pkt_ip6->ip6_nxt = iph_nxt;
 		pkt->pkt_ip6->ip6_plen = htons(htons(pkt->pkt_ip6->ip6_plen) + offset);
 
-		/* XXX: do we need it? */
-		pkt_decorate(pkt);
 		/* ip6_checksum(pkt->pkt_ip, pkt->pkt_end - pkt->pkt_eth_data); */
 	}
 	return (0);
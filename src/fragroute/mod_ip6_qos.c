@@ -59,8 +59,9 @@ ip6_qos_apply(void *d, struct pktq *pktq)
 {
 	struct ip6_qos_data *data = (struct ip6_qos_data *)d;
 	struct pkt *pkt;
+	int n;
 
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
+	PKTQ_FOREACH(pkt, n, pktq) {
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
 		if (eth_type == ETH_TYPE_IPV6) {
@@ -24,7 +24,6 @@ struct ip_chaff_data {
 	rand_t		*rnd;
 	int		 type;
 	int		 ttl;
-	struct pktq	*pktq;
 };
 
 void *
@@ -68,13 +67,13 @@ int
 ip_chaff_apply(void *d, struct pktq *pktq)
 {
 	struct ip_chaff_data *data = (struct ip_chaff_data *)d;
-	struct pkt *pkt, *new, *next;
+	struct pkt *pkt, *new;
 	struct ip_opt opt;
-	int i;
+	int i, n;
 	uint16_t eth_type;
 	
-	for (pkt = TAILQ_FIRST(pktq); pkt != TAILQ_END(pktq); pkt = next) {
-		next = TAILQ_NEXT(pkt, pkt_next);
+	for (n = 0; n < PKTQ_COUNT(pktq); n++) {
+		pkt = PKTQ_GET(pktq, n);
 		eth_type = htons(pkt->pkt_eth->eth_type);
 		
 		if (pkt->pkt_ip_data == NULL)
@@ -121,9 +120,9 @@ ip_chaff_apply(void *d, struct pktq *pktq)
 		}
 		/* Minimal random reordering - for ipv4 and ipv6 */
 		if ((new->pkt_ip_data[0] & 1) == 0)
-			TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+			pktq_insert(pktq, n++, new);
 		else
-			TAILQ_INSERT_AFTER(pktq, pkt, new, pkt_next);
+			pktq_insert(pktq, ++n, new);
 	}
 	return (0);
 }
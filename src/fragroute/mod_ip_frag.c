@@ -31,51 +31,94 @@ ip_frag_apply_ipv4(void *d, struct pktq *pktq);
 static int
 ip_frag_apply_ipv6(void *d, struct pktq *pktq);
 
-static struct ip_frag_data
+struct ip_frag_data
 {
 	rand_t	*rnd;
 	int	 size;
 	int	 overlap;
 	uint32_t ident;
-} ip_frag_data;
+};
 
 void *
 ip_frag_close(void *d)
 {
-	if (ip_frag_data.rnd != NULL)
-		rand_close(ip_frag_data.rnd);
-	ip_frag_data.size = 0;
+	struct ip_frag_data *data = (struct ip_frag_data *)d;
+
+	if (data != NULL) {
+		if (data->rnd != NULL)
+			rand_close(data->rnd);
+		free(data);
+	}
 	return (NULL);
 }
 
 void *
 ip_frag_open(int argc, char *argv[])
 {
+	struct ip_frag_data *data;
+
 	if (argc < 2) {
 		warn("need fragment <size> in bytes");
 		return (NULL);
 	}
-	ip_frag_data.rnd = rand_open();
-	ip_frag_data.size = atoi(argv[1]);
+	if ((data = calloc(1, sizeof(*data))) == NULL)
+		return (NULL);
+
+	data->rnd = rand_open();
+	data->size = atoi(argv[1]);
 	
-	if (ip_frag_data.size == 0 || (ip_frag_data.size % 8) != 0) {
+	if (data->size == 0 || (data->size % 8) != 0) {
 		warn("fragment size must be a multiple of 8");
-		return (ip_frag_close(&ip_frag_data));
+		return (ip_frag_close(data));
 	}
 	if (argc == 3) {
 		if (strcmp(argv[2], "old") == 0 ||
 		    strcmp(argv[2], "win32") == 0)
-			ip_frag_data.overlap = FAVOR_OLD;
+			data->overlap = FAVOR_OLD;
 		else if (strcmp(argv[2], "new") == 0 ||
 		    strcmp(argv[2], "unix") == 0)
-			ip_frag_data.overlap = FAVOR_NEW;
+			data->overlap = FAVOR_NEW;
 		else
-			return (ip_frag_close(&ip_frag_data));
+			return (ip_frag_close(data));
 	}
 
-	ip_frag_data.ident = rand_uint32(ip_frag_data.rnd);
+	data->ident = rand_uint32(data->rnd);
 
-	return (&ip_frag_data);
+	return (data);
+}
+
+/*
+ * Fills in the fraglen bytes of fragment data at p in pkt, or the
+ * random ones in front of the real ones when overlapping in favour of
+ * the new data.  Only the random bytes are written out, the rest stays
+ * in pkt, see pkt_slice().
+ */
+static void
+ip_frag_payload(struct ip_frag_data *data, struct pkt *new, struct pkt *pkt,
+    u_char *p, int fraglen, int overlap)
+{
+	if (overlap && data->overlap == FAVOR_NEW) {
+		rand_strset(data->rnd, new->pkt_ip_data, fraglen);
+		new->pkt_end = new->pkt_ip_data + fraglen;
+	} else {
+		pkt_slice(new, pkt, overlap ? p + fraglen : p, fraglen);
+	}
+}
+
+/* the real fragment at p followed by the other half of the overlap */
+static void
+ip_frag_overlap(struct ip_frag_data *data, struct pkt *new, struct pkt *pkt,
+    u_char *p, int fraglen)
+{
+	new->pkt_end = new->pkt_ip_data;
+	if (data->overlap == FAVOR_NEW) {
+		pkt_slice(new, pkt, p, fraglen << 1);
+	} else {
+		pkt_unslice(new);
+		memcpy(new->pkt_ip_data, p, fraglen);
+		rand_strset(data->rnd, new->pkt_ip_data + fraglen, fraglen);
+		new->pkt_end += fraglen << 1;
+	}
 }
 
 int
@@ -84,8 +127,8 @@ ip_frag_apply(void *d, struct pktq *pktq)
 	struct pkt *pkt;
 
 	/* Select eth protocol via first packet in que: */
-	pkt = TAILQ_FIRST(pktq);
-	if (pkt != TAILQ_END(pktq)) {
+	if (PKTQ_COUNT(pktq) > 0) {
+		pkt = PKTQ_GET(pktq, 0);
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
 		if (eth_type == ETH_TYPE_IP) {
@@ -101,12 +144,13 @@ ip_frag_apply(void *d, struct pktq *pktq)
 static int
 ip_frag_apply_ipv4(void *d, struct pktq *pktq)
 {
-	struct pkt *pkt, *new, *next, tmp;
-	int hl, fraglen, off;
-	u_char *p, *p1, *p2;
+	struct ip_frag_data *data = (struct ip_frag_data *)d;
+	struct pkt *pkt, *new;
+	int hl, fraglen, off, n, overlap;
+	u_char *p;
 
-	for (pkt = TAILQ_FIRST(pktq); pkt != TAILQ_END(pktq); pkt = next) {
-		next = TAILQ_NEXT(pkt, pkt_next);
+	for (n = 0; n < PKTQ_COUNT(pktq); n++) {
+		pkt = PKTQ_GET(pktq, n);
 		
 		if (pkt->pkt_ip == NULL || pkt->pkt_ip_data == NULL)
 			continue;
@@ -119,17 +163,17 @@ ip_frag_apply_ipv4(void *d, struct pktq *pktq)
 		 */
 		switch (pkt->pkt_ip->ip_p) {
 		case IP_PROTO_ICMP:
-			fraglen = MAX(ICMP_LEN_MIN, ip_frag_data.size);
+			fraglen = MAX(ICMP_LEN_MIN, data->size);
 			break;
 		case IP_PROTO_UDP:
-			fraglen = MAX(UDP_HDR_LEN, ip_frag_data.size);
+			fraglen = MAX(UDP_HDR_LEN, data->size);
 			break;
 		case IP_PROTO_TCP:
 			fraglen = MAX(pkt->pkt_tcp->th_off << 2,
-			    ip_frag_data.size);
+			    data->size);
 			break;
 		default:
-			fraglen = ip_frag_data.size;
+			fraglen = data->size;
 			break;
 		}
 		if (fraglen & 7)
@@ -139,25 +183,17 @@ ip_frag_apply_ipv4(void *d, struct pktq *pktq)
 			continue;
 		
 		for (p = pkt->pkt_ip_data; p < pkt->pkt_end; ) {
-			new = pkt_new();
+			new = pkt_new(pkt->pkt_pool);
 			memcpy(new->pkt_eth, pkt->pkt_eth, (u_char*)pkt->pkt_eth_data - (u_char*)pkt->pkt_eth);
 			memcpy(new->pkt_ip, pkt->pkt_ip, hl);
 			new->pkt_ip_data = new->pkt_eth_data + hl;
+			new->pkt_end = new->pkt_ip_data;
 			
-			p1 = p, p2 = NULL;
 			off = (p - pkt->pkt_ip_data) >> 3;
+			overlap = data->overlap != 0 && (off & 1) != 0 &&
+			    p + (fraglen << 1) < pkt->pkt_end;
 
-			if (ip_frag_data.overlap != 0 && (off & 1) != 0 &&
-			    p + (fraglen << 1) < pkt->pkt_end) {
-				rand_strset(ip_frag_data.rnd, tmp.pkt_buf,
-				    fraglen);
-				if (ip_frag_data.overlap == FAVOR_OLD) {
-					p1 = p + fraglen;
-					p2 = tmp.pkt_buf;
-				} else if (ip_frag_data.overlap == FAVOR_NEW) {
-					p1 = tmp.pkt_buf;
-					p2 = p + fraglen;
-				}
+			if (overlap) {
 				new->pkt_ip->ip_off = htons(IP_MF |
 				    (off + (fraglen >> 3)));
 			} else {
@@ -165,32 +201,29 @@ ip_frag_apply_ipv4(void *d, struct pktq *pktq)
 				    ((p + fraglen < pkt->pkt_end) ? IP_MF: 0));
 			}
 			new->pkt_ip->ip_len = htons(hl + fraglen);
-			ip_checksum(new->pkt_ip, hl + fraglen);
+			/* the header only, the data keeps its checksum */
+			ip_checksum(new->pkt_ip, hl);
 			
-			memcpy(new->pkt_ip_data, p1, fraglen);
-			new->pkt_end = new->pkt_ip_data + fraglen;
-			TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+			ip_frag_payload(data, new, pkt, p, fraglen, overlap);
+			pktq_insert(pktq, n++, new);
 
-			if (p2 != NULL) {
+			if (overlap) {
 				new = pkt_dup(new);
 				new->pkt_ts.tv_usec = 1;
 				new->pkt_ip->ip_off = htons(IP_MF | off);
 				new->pkt_ip->ip_len = htons(hl + (fraglen<<1));
-				ip_checksum(new->pkt_ip, hl + (fraglen<<1));
+				ip_checksum(new->pkt_ip, hl);
 				
-				memcpy(new->pkt_ip_data, p, fraglen);
-				memcpy(new->pkt_ip_data+fraglen, p2, fraglen);
-				new->pkt_end = new->pkt_ip_data + (fraglen<<1);
-				TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+				ip_frag_overlap(data, new, pkt, p, fraglen);
+				pktq_insert(pktq, n++, new);
 				p += (fraglen << 1);
 			} else
 				p += fraglen;
 			
-			if ((fraglen = pkt->pkt_end - p) > ip_frag_data.size)
-				fraglen = ip_frag_data.size;
+			if ((fraglen = pkt->pkt_end - p) > data->size)
+				fraglen = data->size;
 		}
-		TAILQ_REMOVE(pktq, pkt, pkt_next);
-		pkt_free(pkt);
+		pkt_free(pktq_remove(pktq, n--));
 	}
 	return (0);
 }
@@ -199,16 +232,17 @@ ip_frag_apply_ipv4(void *d, struct pktq *pktq)
 static int
 ip_frag_apply_ipv6(void *d, struct pktq *pktq)
 {
-	struct pkt *pkt, *new, *next, tmp;
+	struct ip_frag_data *data = (struct ip_frag_data *)d;
+	struct pkt *pkt, *new;
 	struct ip6_ext_hdr *ext;
-	int hl, fraglen, off;
-	u_char *p, *p1, *p2;
+	int hl, fraglen, off, n, overlap;
+	u_char *p;
 	uint8_t next_hdr;
 
-	ip_frag_data.ident++;
+	data->ident++;
 
-	for (pkt = TAILQ_FIRST(pktq); pkt != TAILQ_END(pktq); pkt = next) {
-		next = TAILQ_NEXT(pkt, pkt_next);
+	for (n = 0; n < PKTQ_COUNT(pktq); n++) {
+		pkt = PKTQ_GET(pktq, n);
 
 		if (pkt->pkt_ip == NULL || pkt->pkt_ip_data == NULL)
 			continue;
@@ -221,17 +255,17 @@ ip_frag_apply_ipv6(void *d, struct pktq *pktq)
 		 */
 		switch (pkt->pkt_ip->ip_p) {
 		case IP_PROTO_ICMP:
-			fraglen = MAX(ICMP_LEN_MIN, ip_frag_data.size);
+			fraglen = MAX(ICMP_LEN_MIN, data->size);
 			break;
 		case IP_PROTO_UDP:
-			fraglen = MAX(UDP_HDR_LEN, ip_frag_data.size);
+			fraglen = MAX(UDP_HDR_LEN, data->size);
 			break;
 		case IP_PROTO_TCP:
 			fraglen = MAX(pkt->pkt_tcp->th_off << 2,
-			    ip_frag_data.size);
+			    data->size);
 			break;
 		default:
-			fraglen = ip_frag_data.size;
+			fraglen = data->size;
 			break;
 		}
 		if (fraglen & 7)
@@ -243,7 +277,7 @@ ip_frag_apply_ipv6(void *d, struct pktq *pktq)
 		next_hdr = pkt->pkt_ip6->ip6_nxt;
 
 		for (p = pkt->pkt_ip_data; p < pkt->pkt_end; ) {
-			new = pkt_new();
+			new = pkt_new(pkt->pkt_pool);
 			memcpy(new->pkt_eth, pkt->pkt_eth, (u_char*)pkt->pkt_eth_data - (u_char*)pkt->pkt_eth);
 			memcpy(new->pkt_ip, pkt->pkt_ip, hl);
 			ext = (struct ip6_ext_hdr *)((u_char*)new->pkt_eth_data + hl);
@@ -253,23 +287,14 @@ ip_frag_apply_ipv6(void *d, struct pktq *pktq)
 
 			ext->ext_nxt = next_hdr;
 			ext->ext_len = 0; /* ip6 fragf reserved */
-			ext->ext_data.fragment.ident = ip_frag_data.ident;
-
+			ext->ext_data.fragment.ident = data->ident;
+			new->pkt_end = new->pkt_ip_data;
 
-			p1 = p, p2 = NULL;
 			off = (p - pkt->pkt_ip_data) >> 3;
+			overlap = data->overlap != 0 && (off & 1) != 0 &&
+			    p + (fraglen << 1) < pkt->pkt_end;
 
-			if (ip_frag_data.overlap != 0 && (off & 1) != 0 &&
-			    p + (fraglen << 1) < pkt->pkt_end) {
-				rand_strset(ip_frag_data.rnd, tmp.pkt_buf,
-				    fraglen);
-				if (ip_frag_data.overlap == FAVOR_OLD) {
-					p1 = p + fraglen;
-					p2 = tmp.pkt_buf;
-				} else if (ip_frag_data.overlap == FAVOR_NEW) {
-					p1 = tmp.pkt_buf;
-					p2 = p + fraglen;
-				}
+			if (overlap) {
 				ext->ext_data.fragment.offlg = 
 					htons((off /*+ (fraglen >> 3)*/) << 3) | IP6_MORE_FRAG;
 			} else {
@@ -278,31 +303,27 @@ ip_frag_apply_ipv6(void *d, struct pktq *pktq)
 			}
 			new->pkt_ip6->ip6_plen = htons(fraglen + 8);
 
-			memcpy(new->pkt_ip_data, p1, fraglen);
-			new->pkt_end = new->pkt_ip_data + fraglen;
-			TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+			ip_frag_payload(data, new, pkt, p, fraglen, overlap);
+			pktq_insert(pktq, n++, new);
 
-			if (p2 != NULL) {
+			if (overlap) {
 				new = pkt_dup(new);
 				new->pkt_ts.tv_usec = 1;
 
 				ext->ext_data.fragment.offlg = htons(off << 3) | IP6_MORE_FRAG;
 				new->pkt_ip6->ip6_plen = htons((fraglen << 1) + 8);
 
-				memcpy(new->pkt_ip_data, p, fraglen);
-				memcpy(new->pkt_ip_data + fraglen, p2, fraglen);
-				new->pkt_end = new->pkt_ip_data + (fraglen << 1);
-				TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+				ip_frag_overlap(data, new, pkt, p, fraglen);
+				pktq_insert(pktq, n++, new);
 				p += (fraglen << 1);
 			} else {
 				p += fraglen;
 			}
 
-			if ((fraglen = pkt->pkt_end - p) > ip_frag_data.size)
-				fraglen = ip_frag_data.size;
+			if ((fraglen = pkt->pkt_end - p) > data->size)
+				fraglen = data->size;
 		}
-		TAILQ_REMOVE(pktq, pkt, pkt_next);
-		pkt_free(pkt);
+		pkt_free(pktq_remove(pktq, n--));
 	}
 	return 0;
 }
@@ -73,18 +73,20 @@ ip_opt_apply(void *d, struct pktq *pktq)
 {
 	struct ip_opt *opt = (struct ip_opt *)d;
 	struct pkt *pkt;
+	u_char *at;
+	int n;
 	size_t len;
 
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
+	PKTQ_FOREACH(pkt, n, pktq) {
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
 		if (eth_type == ETH_TYPE_IP) {
+		at = pkt->pkt_eth_data + (pkt->pkt_ip->ip_hl << 2);
 		len = ip_add_option(pkt->pkt_ip, PKT_BUF_LEN - ETH_HDR_LEN,
 		    IP_PROTO_IP, opt, opt->opt_len);
 
 		if (len > 0) {
-			pkt->pkt_end += len;
-			pkt_decorate(pkt);
+			pkt_insert_hdr(pkt, at, len);
 			ip_checksum(pkt->pkt_ip,
 			    pkt->pkt_end - pkt->pkt_eth_data);
 		}
@@ -51,8 +51,9 @@ ip_tos_apply(void *d, struct pktq *pktq)
 {
 	struct ip_tos_data *data = (struct ip_tos_data *)d;
 	struct pkt *pkt;
+	int n;
 
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
+	PKTQ_FOREACH(pkt, n, pktq) {
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
 		if (eth_type == ETH_TYPE_IP) {
@@ -50,9 +50,10 @@ ip_ttl_apply(void *d, struct pktq *pktq)
 {
 	struct ip_ttl_data *data = (struct ip_ttl_data *)d;
 	struct pkt *pkt;
+	int n;
 	int ttldec;
 
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
+	PKTQ_FOREACH(pkt, n, pktq) {
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
 		if (eth_type == ETH_TYPE_IP) {
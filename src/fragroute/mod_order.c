@@ -75,5 +75,6 @@ struct mod mod_order = {
 	"order random|reverse",		/* usage */
 	order_open,			/* open */
 	order_apply,			/* apply */
-	order_close			/* close */
+	order_close,			/* close */
+	MOD_SLICES			/* flags */
 };
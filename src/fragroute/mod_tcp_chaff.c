@@ -80,14 +80,14 @@ int
 tcp_chaff_apply(void *d, struct pktq *pktq)
 {
 	struct tcp_chaff_data *data = (struct tcp_chaff_data *)d;
-	struct pkt *pkt, *new, *next;
+	struct pkt *pkt, *new;
 	struct tcp_opt opt;
-	int i;
+	int i, n;
 	uint16_t eth_type;
 	uint8_t nxt;
 	
-	for (pkt = TAILQ_FIRST(pktq); pkt != TAILQ_END(pktq); pkt = next) {
-		next = TAILQ_NEXT(pkt, pkt_next);
+	for (n = 0; n < PKTQ_COUNT(pktq); n++) {
+		pkt = PKTQ_GET(pktq, n);
 		
 		eth_type = htons(pkt->pkt_eth->eth_type);
 
@@ -144,7 +144,11 @@ tcp_chaff_apply(void *d, struct pktq *pktq)
 			new->pkt_end += i;
 			inet_checksum(eth_type, new->pkt_ip,
 					new->pkt_ip_data - new->pkt_eth_data);
-			pkt_decorate(new);
+			/* the data is behind the new options now */
+			new->pkt_tcp_data = new->pkt_ip_data +
+			    (new->pkt_tcp->th_off << 2);
+			if (new->pkt_tcp_data >= new->pkt_end)
+				new->pkt_tcp_data = NULL;
 			break;
 		case CHAFF_TYPE_REXMIT:
 			new->pkt_ts.tv_usec = 1;
@@ -181,9 +185,9 @@ tcp_chaff_apply(void *d, struct pktq *pktq)
 		}
 		/* Minimal random reordering. */
 		if ((new->pkt_tcp->th_sum & 1) == 0)
-			TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+			pktq_insert(pktq, n++, new);
 		else
-			TAILQ_INSERT_AFTER(pktq, pkt, new, pkt_next);
+			pktq_insert(pktq, ++n, new);
 	}
 	return (0);
 }
@@ -71,18 +71,22 @@ tcp_opt_apply(void *d, struct pktq *pktq)
 {
 	struct tcp_opt *opt = (struct tcp_opt *)d;
 	struct pkt *pkt;
+	u_char *at;
+	int n;
 	size_t len;
 
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
+	PKTQ_FOREACH(pkt, n, pktq) {
 		uint16_t eth_type = htons(pkt->pkt_eth->eth_type);
 
+		/* the options go behind the TCP header, the data moves */
+		at = (pkt->pkt_tcp != NULL) ?
+		    pkt->pkt_ip_data + (pkt->pkt_tcp->th_off << 2) : pkt->pkt_end;
 		len = inet_add_option(eth_type, pkt->pkt_ip,
 		    sizeof(pkt->pkt_data) - ETH_HDR_LEN,
 		    IP_PROTO_TCP, opt, opt->opt_len);
 
 		if (len > 0) {
-			pkt->pkt_end += len;
-			pkt_decorate(pkt);
+			pkt_insert_hdr(pkt, at, len);
 			inet_checksum(eth_type, pkt->pkt_ip, pkt->pkt_end - pkt->pkt_eth_data);
 		}
 	}
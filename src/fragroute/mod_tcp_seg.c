@@ -26,59 +26,79 @@
 #define FAVOR_OLD	1
 #define FAVOR_NEW	2
 
-static struct tcp_seg_data {
+struct tcp_seg_data {
 	rand_t	*rnd;
 	int	 size;
 	int	 overlap;
-} tcp_seg_data;
+};
 
 void *
 tcp_seg_close(void *d)
 {
-	if (tcp_seg_data.rnd != NULL)
-		rand_close(tcp_seg_data.rnd);
-	tcp_seg_data.size = 0;
+	struct tcp_seg_data *data = (struct tcp_seg_data *)d;
+
+	if (data != NULL) {
+		if (data->rnd != NULL)
+			rand_close(data->rnd);
+		free(data);
+	}
 	return (NULL);
 }
 
 void *
 tcp_seg_open(int argc, char *argv[])
 {
+	struct tcp_seg_data *data;
+
 	if (argc < 2) {
 		warn("need segment <size> in bytes");
 		return (NULL);
 	}
-	tcp_seg_data.rnd = rand_open();
+	if ((data = calloc(1, sizeof(*data))) == NULL)
+		return (NULL);
+
+	data->rnd = rand_open();
 	
-	if ((tcp_seg_data.size = atoi(argv[1])) == 0) {
+	if ((data->size = atoi(argv[1])) == 0) {
 		warnx("invalid segment size '%s'", argv[1]);
-		return (tcp_seg_close(&tcp_seg_data));
+		return (tcp_seg_close(data));
 	}
 	if (argc == 3) {
 		if (strcmp(argv[2], "old") == 0 ||
 		    strcmp(argv[2], "win32") == 0)
-			tcp_seg_data.overlap = FAVOR_OLD;
+			data->overlap = FAVOR_OLD;
 		else if (strcmp(argv[2], "new") == 0 ||
 		    strcmp(argv[2], "unix") == 0)
-			tcp_seg_data.overlap = FAVOR_NEW;
+			data->overlap = FAVOR_NEW;
 		else
-			return (tcp_seg_close(&tcp_seg_data));
+			return (tcp_seg_close(data));
 	}
-	return (&tcp_seg_data);
+	return (data);
+}
+
+static void
+tcp_seg_checksum(uint16_t eth_type, struct pkt *new, int hdrlen, int len)
+{
+	if (new->pkt_ref != NULL)
+		inet_checksum_tcp(eth_type, new->pkt_ip, hdrlen,
+		    new->pkt_slice, new->pkt_slice_len);
+	else
+		inet_checksum(eth_type, new->pkt_ip, hdrlen + len);
 }
 
 int
 tcp_seg_apply(void *d, struct pktq *pktq)
 {
-	struct pkt *pkt, *new, *next, tmp;
+	struct tcp_seg_data *data = (struct tcp_seg_data *)d;
+	struct pkt *pkt, *new;
 	uint32_t seq;
-	int hl, tl, len;	
-	u_char *p, *p1, *p2;
+	int hl, tl, len, n, overlap;
+	u_char *p;
 	uint16_t eth_type;
 	uint8_t nxt;
 
-	for (pkt = TAILQ_FIRST(pktq); pkt != TAILQ_END(pktq); pkt = next) {
-		next = TAILQ_NEXT(pkt, pkt_next);
+	for (n = 0; n < PKTQ_COUNT(pktq); n++) {
+		pkt = PKTQ_GET(pktq, n);
 		
 		eth_type = htons(pkt->pkt_eth->eth_type);
 
@@ -96,7 +116,7 @@ tcp_seg_apply(void *d, struct pktq *pktq)
 		if (nxt != IP_PROTO_TCP ||
 		    pkt->pkt_tcp == NULL || pkt->pkt_tcp_data == NULL ||
 		    (pkt->pkt_tcp->th_flags & TH_ACK) == 0 ||
-		    pkt->pkt_end - pkt->pkt_tcp_data <= tcp_seg_data.size)
+		    pkt->pkt_end - pkt->pkt_tcp_data <= data->size)
 			continue;
 		
 		if (eth_type == ETH_TYPE_IP) {
@@ -111,64 +131,71 @@ tcp_seg_apply(void *d, struct pktq *pktq)
 		seq = ntohl(pkt->pkt_tcp->th_seq);
 	
 		for (p = pkt->pkt_tcp_data; p < pkt->pkt_end; p += len) {
-			new = pkt_new();
+			new = pkt_new(pkt->pkt_pool);
 			memcpy(new->pkt_eth, pkt->pkt_eth, (u_char*)pkt->pkt_eth_data - (u_char*)pkt->pkt_eth);
-			p1 = p, p2 = NULL;
-			len = MIN(pkt->pkt_end - p, tcp_seg_data.size);
+			len = MIN(pkt->pkt_end - p, data->size);
+			overlap = data->overlap != 0 &&
+			    p + (len << 1) < pkt->pkt_end;
 		
-			if (tcp_seg_data.overlap != 0 &&
-			    p + (len << 1) < pkt->pkt_end) {
-				rand_strset(tcp_seg_data.rnd, tmp.pkt_buf,len);
-				
-				if (tcp_seg_data.overlap == FAVOR_OLD) {
-					p1 = p + len;
-					p2 = tmp.pkt_buf;
-				} else if (tcp_seg_data.overlap == FAVOR_NEW) {
-					p1 = tmp.pkt_buf;
-					p2 = p + len;
-				}
-				len = tcp_seg_data.size;
-				seq += tcp_seg_data.size;
+			if (overlap) {
+				len = data->size;
+				seq += data->size;
 			}
 			memcpy(new->pkt_ip, pkt->pkt_ip, hl + tl);
 			new->pkt_ip_data = new->pkt_eth_data + hl;
 			new->pkt_tcp_data = new->pkt_ip_data + tl;
-			memcpy(new->pkt_tcp_data, p1, len);
-			new->pkt_end = new->pkt_tcp_data + len;
+			new->pkt_end = new->pkt_tcp_data;
+
+			/*
+			 * The payload stays in pkt, only the random bytes
+			 * of an overlap are written out.
+			 */
+			if (overlap && data->overlap == FAVOR_NEW) {
+				rand_strset(data->rnd, new->pkt_tcp_data, len);
+				new->pkt_end += len;
+			} else {
+				pkt_slice(new, pkt, overlap ? p + len : p, len);
+			}
 			
 			if (eth_type == ETH_TYPE_IP) {
-			new->pkt_ip->ip_id = rand_uint16(tcp_seg_data.rnd);
+			new->pkt_ip->ip_id = rand_uint16(data->rnd);
 			new->pkt_ip->ip_len = htons(hl + tl + len);
 			} else {
 				new->pkt_ip6->ip6_plen = htons(tl + len);
 			}
 
 			new->pkt_tcp->th_seq = htonl(seq);
-			inet_checksum(eth_type, new->pkt_ip, hl + tl + len);
-			TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+			tcp_seg_checksum(eth_type, new, hl + tl, len);
+			pktq_insert(pktq, n++, new);
 			
-			if (p2 != NULL) {
+			if (overlap) {
 				new = pkt_dup(new);
 				new->pkt_ts.tv_usec = 1;
 				if (eth_type == ETH_TYPE_IP) {
-					new->pkt_ip->ip_id = rand_uint16(tcp_seg_data.rnd);
+					new->pkt_ip->ip_id = rand_uint16(data->rnd);
 					new->pkt_ip->ip_len = htons(hl + tl + (len << 1));
 				} else if (eth_type == ETH_TYPE_IPV6) {
 					new->pkt_ip6->ip6_plen = htons(tl + (len << 1));
 				}
 				new->pkt_tcp->th_seq = htonl(seq - len);
 				
-				memcpy(new->pkt_tcp_data, p, len);
-				memcpy(new->pkt_tcp_data + len, p2, len);
-				new->pkt_end = new->pkt_tcp_data + (len << 1);
-				inet_checksum(eth_type, new->pkt_ip, hl + tl + (len << 1));
-				TAILQ_INSERT_BEFORE(pkt, new, pkt_next);
+				/* the real bytes, then the other half of the first segment */
+				new->pkt_end = new->pkt_tcp_data;
+				if (data->overlap == FAVOR_NEW) {
+					pkt_slice(new, pkt, p, len << 1);
+				} else {
+					pkt_unslice(new);
+					memcpy(new->pkt_tcp_data, p, len);
+					rand_strset(data->rnd, new->pkt_tcp_data + len, len);
+					new->pkt_end += len << 1;
+				}
+				tcp_seg_checksum(eth_type, new, hl + tl, len << 1);
+				pktq_insert(pktq, n++, new);
 				p += len;
 			}
 			seq += len;
 		}
-		TAILQ_REMOVE(pktq, pkt, pkt_next);
-		pkt_free(pkt);
+		pkt_free(pktq_remove(pktq, n--));
 	}
 	return (0);
 }
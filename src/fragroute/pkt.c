@@ -7,6 +7,8 @@
  */
 
 #include "config.h"
+#include "defines.h"
+#include "common.h"
 
 #include <sys/types.h>
 
@@ -14,21 +16,90 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "bget.h"
 #include "pkt.h"
 
+/*
+ * struct pkt is fixed size, so packets come from slabs of them and go
+ * back onto a freelist (linked through pkt_next) instead of a general
+ * purpose allocator: pkt_new() and pkt_free() are O(1) and recently
+ * freed, cache-hot packets are the first ones handed out again.
+ *
+ * Each fragroute instance owns its pool and every packet remembers the
+ * pool it came from, so instances never share allocator state.
+ */
+struct pkt_slab {
+	struct pkt_slab	*next;
+	int		 count;
+	struct pkt	 pkts[];
+};
+
+static int
+pkt_grow(struct pkt_pool *pool)
+{
+	struct pkt_slab *slab;
+	int i;
+
+	if ((slab = malloc(sizeof(*slab) +
+	    sizeof(struct pkt) * pool->slab_size)) == NULL)
+		return (-1);
+
+	slab->count = pool->slab_size;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	/* hand out the slab front to back */
+	for (i = slab->count - 1; i >= 0; i--) {
+		slab->pkts[i].pkt_pool = pool;
+		slab->pkts[i].pkt_next = pool->freelist;
+		pool->freelist = &slab->pkts[i];
+	}
+	return (0);
+}
+
+void
+pkt_pool_init(struct pkt_pool *pool, int size)
+{
+	pool->slabs = NULL;
+	pool->freelist = NULL;
+	pool->slab_size = (size > 0) ? size : 128;
+	pkt_grow(pool);
+}
+
 void
-pkt_init(int size)
+pkt_pool_close(struct pkt_pool *pool)
 {
-	bectl(NULL, malloc, free, sizeof(struct pkt) * size);
+	struct pkt_slab *slab;
+
+	while ((slab = pool->slabs) != NULL) {
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	pool->freelist = NULL;
+}
+
+static struct pkt *
+pkt_alloc(struct pkt_pool *pool)
+{
+	struct pkt *pkt;
+
+	if (pool->freelist == NULL && pkt_grow(pool) < 0)
+		return (NULL);
+
+	pkt = pool->freelist;
+	pool->freelist = pkt->pkt_next;
+	pkt->pkt_slice = NULL;
+	pkt->pkt_slice_len = 0;
+	pkt->pkt_ref = NULL;
+	pkt->pkt_refs = 1;
+	return (pkt);
 }
 
 struct pkt *
-pkt_new(void)
+pkt_new(struct pkt_pool *pool)
 {
 	struct pkt *pkt;
 	
-	if ((pkt = bget(sizeof(*pkt))) == NULL)
+	if ((pkt = pkt_alloc(pool)) == NULL)
 		return (NULL);
 	
 	timerclear(&pkt->pkt_ts);
@@ -50,7 +121,7 @@ pkt_dup(struct pkt *pkt)
 	struct pkt *new;
 	off_t off;
 	
-	if ((new = bget(sizeof(*new))) == NULL)
+	if ((new = pkt_alloc(pkt->pkt_pool)) == NULL)
 		return (NULL);
 	
 	off = new->pkt_buf - pkt->pkt_buf;
@@ -75,10 +146,15 @@ pkt_dup(struct pkt *pkt)
 	memcpy(new->pkt_data, pkt->pkt_data, pkt->pkt_end - pkt->pkt_data);
 	
 	new->pkt_end = pkt->pkt_end + off;
+
+	if (pkt->pkt_ref != NULL)
+		pkt_slice(new, pkt->pkt_ref, pkt->pkt_slice, pkt->pkt_slice_len);
 	
 	return (new);
 }
 
+static void pkt_decorate_l4(struct pkt *pkt, u_char *p, uint8_t next_hdr);
+
 #define IP6_IS_EXT(n)   \
 	((n) == IP_PROTO_HOPOPTS || (n) == IP_PROTO_DSTOPTS || \
 	 (n) == IP_PROTO_ROUTING || (n) == IP_PROTO_FRAGMENT)
@@ -151,6 +227,73 @@ pkt_decorate(struct pkt *pkt)
 		return;
 	}
 
+	pkt_decorate_l4(pkt, p, next_hdr);
+}
+
+/*
+ * pkt_decorate() of a packet whose headers the caller already found
+ * with get_pkt_meta(): the IP header is only checked, not walked.
+ * Anything but TCP, UDP or ICMP straight behind an untagged Ethernet
+ * header goes through pkt_decorate().
+ */
+void
+pkt_decorate_meta(struct pkt *pkt, const struct pkt_meta_s *meta)
+{
+	u_char *p;
+	int len, off;
+
+	if (meta->l2len != ETH_HDR_LEN || meta->l4off == 0 ||
+	    (meta->proto != IP_PROTO_TCP && meta->proto != IP_PROTO_UDP &&
+	     meta->proto != IP_PROTO_ICMP && meta->proto != IP_PROTO_ICMPV6)) {
+		pkt_decorate(pkt);
+		return;
+	}
+
+	pkt->pkt_data = pkt->pkt_buf + PKT_BUF_ALIGN;
+	pkt->pkt_eth = (struct eth_hdr *)pkt->pkt_data;
+	pkt->pkt_eth_data = pkt->pkt_data + ETH_HDR_LEN;
+	pkt->pkt_ip_data = NULL;
+	pkt->pkt_tcp_data = NULL;
+	p = pkt->pkt_data + meta->l4off;
+
+	if (meta->ip_ver == 4) {
+		/* the same checks pkt_decorate() makes */
+		if (p > pkt->pkt_end) {
+			pkt->pkt_ip = NULL;
+			return;
+		}
+		len = ntohs(pkt->pkt_ip->ip_len);
+		if (pkt->pkt_eth_data + len > pkt->pkt_end)
+			return;
+		off = ntohs(pkt->pkt_ip->ip_off);
+		if ((off & IP_OFFMASK) != 0 || (off & IP_MF) != 0)
+			return;
+		pkt->pkt_end = pkt->pkt_eth_data + len;
+	}
+
+	pkt_decorate_l4(pkt, p, meta->proto);
+}
+
+/*
+ * Once len bytes of options have been inserted at at, moves the header
+ * pointers behind them and the end instead of decorating pkt again.
+ */
+void
+pkt_insert_hdr(struct pkt *pkt, u_char *at, int len)
+{
+	if (pkt->pkt_ip_data != NULL && pkt->pkt_ip_data >= at)
+		pkt->pkt_ip_data += len;
+	if (pkt->pkt_tcp_data != NULL && pkt->pkt_tcp_data >= at)
+		pkt->pkt_tcp_data += len;
+	pkt->pkt_end += len;
+}
+
+/* decorates the transport layer header of type next_hdr at p */
+static void
+pkt_decorate_l4(struct pkt *pkt, u_char *p, uint8_t next_hdr)
+{
+	int hl;
+
 	/* If transport layer header is longer than packet length, stop. */
 	switch (next_hdr) {
 	case IP_PROTO_ICMP:
@@ -243,70 +386,147 @@ pkt_decorate(struct pkt *pkt)
 void
 pkt_free(struct pkt *pkt)
 {
-	brel(pkt);
+	struct pkt_pool *pool = pkt->pkt_pool;
+
+	/* slices of it are still around */
+	if (--pkt->pkt_refs > 0)
+		return;
+
+	pkt_unslice(pkt);
+	pkt->pkt_next = pool->freelist;
+	pool->freelist = pkt;
 }
 
+/*
+ * Makes the len bytes at p in src the payload of pkt, behind its
+ * headers, without copying them: segments and fragments are made of
+ * their own headers and a slice of the packet they were cut from,
+ * which stays allocated until the last of its slices is freed or
+ * flattened.  Rules which only move packets around never touch the
+ * payload, mod_apply() flattens the queue for all the others.
+ */
 void
-pktq_reverse(struct pktq *pktq)
+pkt_slice(struct pkt *pkt, struct pkt *src, u_char *p, int len)
 {
-	struct pktq tmpq;
-	struct pkt *pkt, *next;
+	assert(src->pkt_ref == NULL);
 
-	TAILQ_INIT(&tmpq);
-	for (pkt = TAILQ_FIRST(pktq); pkt != TAILQ_END(pktq); pkt = next) {
-		next = TAILQ_NEXT(pkt, pkt_next);
-		TAILQ_INSERT_HEAD(&tmpq, pkt, pkt_next);
-	}
-	TAILQ_COPY(pktq, &tmpq, pkt_next);
+	pkt_unslice(pkt);
+	pkt->pkt_slice = p;
+	pkt->pkt_slice_len = len;
+	pkt->pkt_ref = src;
+	src->pkt_refs++;
 }
 
+/* drops pkt's slice without copying it in */
 void
-pktq_shuffle(rand_t *r, struct pktq *pktq)
+pkt_unslice(struct pkt *pkt)
 {
-	static struct pkt **pvbase;
-	static int pvlen;
-	struct pkt *pkt;
-	int i;
+	struct pkt *ref;
 
-	i = 0;
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
-		i++;
-	}
-	if (i > pvlen) {
-		pvlen = i;
-		if (pvbase == NULL)
-			pvbase = malloc(sizeof(pkt) * pvlen);
-		else
-			pvbase = realloc(pvbase, sizeof(pkt) * pvlen);
-	}
-	i = 0;
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
-		pvbase[i++] = pkt;
-	}
-	TAILQ_INIT(pktq);
-	
-	rand_shuffle(r, pvbase, i, sizeof(pkt));
+	if ((ref = pkt->pkt_ref) == NULL)
+		return;
+
+	pkt->pkt_slice = NULL;
+	pkt->pkt_slice_len = 0;
+	pkt->pkt_ref = NULL;
+	pkt_free(ref);
+}
+
+/* copies pkt's slice in behind its headers */
+void
+pkt_flatten(struct pkt *pkt)
+{
+	if (pkt->pkt_ref == NULL)
+		return;
+
+	memcpy(pkt->pkt_end, pkt->pkt_slice, pkt->pkt_slice_len);
+	pkt->pkt_end += pkt->pkt_slice_len;
+	pkt_unslice(pkt);
+}
+
+void
+pktq_init(struct pktq *pktq)
+{
+	pktq->pkts = NULL;
+	pktq->cnt = 0;
+	pktq->size = 0;
+}
+
+/* frees the queue's storage, not the packets still in it */
+void
+pktq_release(struct pktq *pktq)
+{
+	safe_free(pktq->pkts);
+	pktq_init(pktq);
+}
+
+/* puts pkt at position i, moving the packets from i on back one */
+void
+pktq_insert(struct pktq *pktq, int i, struct pkt *pkt)
+{
+	assert(i >= 0 && i <= pktq->cnt);
 
-	while (--i >= 0) {
-		TAILQ_INSERT_TAIL(pktq, pvbase[i], pkt_next);
+	if (pktq->cnt == pktq->size) {
+		pktq->size = pktq->size ? pktq->size * 2 : 16;
+		pktq->pkts = safe_realloc(pktq->pkts,
+		    sizeof(struct pkt *) * pktq->size);
 	}
+	memmove(&pktq->pkts[i + 1], &pktq->pkts[i],
+	    sizeof(struct pkt *) * (pktq->cnt - i));
+	pktq->pkts[i] = pkt;
+	pktq->cnt++;
 }
 
+/* takes the packet at position i out of the queue and returns it */
 struct pkt *
-pktq_random(rand_t *r, struct pktq *pktq)
+pktq_remove(struct pktq *pktq, int i)
 {
 	struct pkt *pkt;
+
+	assert(i >= 0 && i < pktq->cnt);
+
+	pkt = pktq->pkts[i];
+	pktq->cnt--;
+	memmove(&pktq->pkts[i], &pktq->pkts[i + 1],
+	    sizeof(struct pkt *) * (pktq->cnt - i));
+	return (pkt);
+}
+
+void
+pktq_flatten(struct pktq *pktq)
+{
 	int i;
-	
-	i = 0;
-	TAILQ_FOREACH(pkt, pktq, pkt_next) {
-		i++;
-	}
-	i = rand_uint32(r) % (i - 1);
-	pkt = TAILQ_FIRST(pktq);
-	
-	while (--i >= 0) {
-		pkt = TAILQ_NEXT(pkt, pkt_next);
+
+	for (i = 0; i < pktq->cnt; i++)
+		pkt_flatten(pktq->pkts[i]);
+}
+
+void
+pktq_reverse(struct pktq *pktq)
+{
+	struct pkt *pkt;
+	int i, j;
+
+	for (i = 0, j = pktq->cnt - 1; i < j; i++, j--) {
+		pkt = pktq->pkts[i];
+		pktq->pkts[i] = pktq->pkts[j];
+		pktq->pkts[j] = pkt;
 	}
-	return (pkt);
+}
+
+void
+pktq_shuffle(rand_t *r, struct pktq *pktq)
+{
+	if (pktq->cnt > 1)
+		rand_shuffle(r, pktq->pkts, pktq->cnt, sizeof(struct pkt *));
+}
+
+/* returns the position of a random packet, -1 if the queue is empty */
+int
+pktq_random(rand_t *r, struct pktq *pktq)
+{
+	if (pktq->cnt == 0)
+		return (-1);
+
+	return (rand_uint32(r) % pktq->cnt);
 }
@@ -11,7 +11,6 @@
 
 #include "config.h"
 #include "defines.h"
-#include "../../lib/queue.h"
 #include <sys/time.h>
 
 #ifdef HAVE_LIBDNET
@@ -56,7 +55,18 @@ struct pkt {
 	u_char		*pkt_data;
 	u_char		*pkt_end;
 
-	TAILQ_ENTRY(pkt) pkt_next;
+	/*
+	 * pkt_slice() packets: the payload behind pkt_end is still the
+	 * pkt_slice_len bytes at pkt_slice in pkt_ref, pkt_flatten()
+	 * copies it in.
+	 */
+	u_char		*pkt_slice;
+	int		 pkt_slice_len;
+	struct pkt	*pkt_ref;
+	int		 pkt_refs;	/* pkt_free() calls until it's free */
+
+	struct pkt_pool	*pkt_pool;	/* where pkt_free() returns it */
+	struct pkt	*pkt_next;	/* pool freelist link */
 };
 #define pkt_ip		 pkt_n_hdr_u.ip
 #define pkt_ip6		 pkt_n_hdr_u.ip6
@@ -71,17 +81,54 @@ struct pkt {
 #define pkt_udp_data	 pkt_t_data_u.t_data
 #define pkt_icmp_msg	 pkt_t_data_u.icmp
 
-TAILQ_HEAD(pktq, pkt);
+/*
+ * The packets a rule chain works on, in send order.  Rules pick packets
+ * by position (first, last, random) and shuffle or reverse the whole
+ * queue, so it is an array rather than a list; the storage is kept
+ * between packets by whoever owns the queue.
+ */
+struct pktq {
+	struct pkt	**pkts;
+	int		 cnt;
+	int		 size;	/* entries allocated in pkts */
+};
+
+#define PKTQ_COUNT(q)	((q)->cnt)
+#define PKTQ_GET(q, i)	((q)->pkts[(i)])
+#define PKTQ_FOREACH(pkt, i, q) \
+	for ((i) = 0; (i) < (q)->cnt && ((pkt) = (q)->pkts[(i)], 1); (i)++)
 
-void		 pkt_init(int size);
+struct pkt_meta_s;
 
-struct pkt	*pkt_new(void);
+/* slab allocator for struct pkt, one per fragroute instance */
+struct pkt_pool {
+	struct pkt_slab	*slabs;
+	struct pkt	*freelist;
+	int		 slab_size;
+};
+
+void		 pkt_pool_init(struct pkt_pool *pool, int size);
+void		 pkt_pool_close(struct pkt_pool *pool);
+
+struct pkt	*pkt_new(struct pkt_pool *pool);
 struct pkt	*pkt_dup(struct pkt *);
 void		 pkt_decorate(struct pkt *pkt);
+void		 pkt_decorate_meta(struct pkt *pkt, const struct pkt_meta_s *meta);
+void		 pkt_insert_hdr(struct pkt *pkt, u_char *at, int len);
 void		 pkt_free(struct pkt *pkt);
+void		 pkt_slice(struct pkt *pkt, struct pkt *src, u_char *p, int len);
+void		 pkt_unslice(struct pkt *pkt);
+void		 pkt_flatten(struct pkt *pkt);
+
+void		 pktq_init(struct pktq *pktq);
+void		 pktq_release(struct pktq *pktq);
+void		 pktq_insert(struct pktq *pktq, int i, struct pkt *pkt);
+struct pkt	*pktq_remove(struct pktq *pktq, int i);
+#define pktq_append(q, pkt)	pktq_insert((q), (q)->cnt, (pkt))
 
+void		 pktq_flatten(struct pktq *pktq);
 void		 pktq_reverse(struct pktq *pktq);
 void		 pktq_shuffle(rand_t *r, struct pktq *pktq);
-struct pkt	*pktq_random(rand_t *r, struct pktq *pktq);
+int		 pktq_random(rand_t *r, struct pktq *pktq);
 
 #endif /* PKT_H */
@@ -20,6 +20,9 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "defines.h"
@@ -30,10 +33,156 @@
 
 static int replay_file(tcpreplay_t *ctx, int idx);
 static int replay_two_files(tcpreplay_t *ctx, int idx1, int idx2);
+static int replay_merged_files(tcpreplay_t *ctx);
 static int replay_cache(tcpreplay_t *ctx, int idx);
 static int replay_two_caches(tcpreplay_t *ctx, int idx1, int idx2);
 static int replay_fd(tcpreplay_t *ctx, int idx);
 static int replay_two_fds(tcpreplay_t *ctx, int idx1, int idx2);
+static int replay_shm(tcpreplay_t *ctx, int idx);
+static void replay_mmap_open(tcpreplay_t *ctx, int idx);
+static void replay_mmap_close(tcpreplay_t *ctx, int idx);
+static pcap_t *replay_reader_open(tcpreplay_t *ctx, int idx, char *ebuf);
+static void replay_reader_close(tcpreplay_t *ctx, int idx, pcap_t *pcap);
+
+/* --loop: readers kept open between passes, and how far ahead to hint */
+#define REPLAY_KEEP_FILES   64
+#define REPLAY_WILLNEED     (8 * 1024 * 1024)
+#define PCAPNG_MAGIC        0x0a0d0d0a
+
+/* --plan: what the replay asks of the interface, one bucket per msec */
+#define PLAN_BUCKET_NSEC    1000000
+#define PLAN_CALIBRATE_NSEC 200000000   /* how long the backend is timed */
+
+typedef struct plan_s {
+    COUNTER *pkts;          /* packets due in each bucket */
+    COUNTER *bytes;
+    COUNTER bucket_cnt;
+    COUNTER bucket_alloc;
+    COUNTER packets;
+    COUNTER total_bytes;
+    uint64_t file_nsec;     /* replay time the current file starts at */
+    uint64_t last_nsec;     /* replay time of the last packet */
+    COUNTER first_usec;     /* --multiplier: capture time of the file's first packet */
+    bool file_started;
+} plan_t;
+
+/* the counters when a source started, see source_stats_start() */
+typedef struct source_mark_s {
+    COUNTER pkts_sent;
+    COUNTER bytes_sent;
+    COUNTER retries;
+    COUNTER late_packets;
+    COUNTER late_dropped;
+    uint64_t ns;
+    /* dual file mode: each file of the pair has an interface of its own */
+    COUNTER sp_sent[2];
+    COUNTER sp_bytes[2];
+    COUNTER sp_retries[2];
+} source_mark_t;
+
+/* sends retried on every interface, the per source stats take the difference */
+static COUNTER
+replay_retries(const tcpreplay_t *ctx)
+{
+    COUNTER retries = 0;
+    int i;
+
+    if (ctx->intf1 != NULL)
+        retries += SENDPACKET_RETRIES(ctx->intf1);
+    if (ctx->intf2 != NULL)
+        retries += SENDPACKET_RETRIES(ctx->intf2);
+    for (i = 1; i < ctx->merge_intf_cnt; i++)
+        retries += SENDPACKET_RETRIES(ctx->merge_intf[i]);
+    for (i = 0; i < ctx->fanout_intf_cnt; i++)
+        retries += SENDPACKET_RETRIES(ctx->fanout_intf[i]);
+
+    return retries;
+}
+
+static uint64_t
+replay_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return TIMESPEC_TO_NANOSEC(&now);
+}
+
+/*
+ * Per source stats are the difference in the totals from before a source
+ * was replayed to after, so nothing is added for each packet.  Between
+ * sources ctx->stats has the counts of any --workers too.
+ */
+static void
+source_stats_start(const tcpreplay_t *ctx, source_mark_t *mark)
+{
+    int i;
+
+    mark->pkts_sent = ctx->stats.pkts_sent;
+    mark->bytes_sent = ctx->stats.bytes_sent;
+    mark->retries = replay_retries(ctx);
+    mark->late_packets = ctx->stats.late_packets;
+    mark->late_dropped = ctx->stats.late_dropped;
+
+    for (i = 0; i < 2; i++) {
+        sendpacket_t *sp = i ? ctx->intf2 : ctx->intf1;
+
+        mark->sp_sent[i] = sp ? sp->sent : 0;
+        mark->sp_bytes[i] = sp ? sp->bytes_sent : 0;
+        mark->sp_retries[i] = sp ? SENDPACKET_RETRIES(sp) : 0;
+    }
+
+    mark->ns = replay_now_ns();
+}
+
+static void
+source_stats_add(tcpreplay_t *ctx, int idx, const source_mark_t *mark, uint64_t now_ns,
+        bool late)
+{
+    tcpreplay_source_stats_t *stats = &ctx->options->sources[idx].stats;
+
+    if (late) {
+        stats->late_packets += ctx->stats.late_packets - mark->late_packets;
+        stats->late_dropped += ctx->stats.late_dropped - mark->late_dropped;
+    }
+    stats->time_ns += now_ns - mark->ns;
+    stats->passes++;
+}
+
+static void
+source_stats_stop(tcpreplay_t *ctx, int idx, const source_mark_t *mark)
+{
+    tcpreplay_source_stats_t *stats = &ctx->options->sources[idx].stats;
+
+    stats->pkts_sent += ctx->stats.pkts_sent - mark->pkts_sent;
+    stats->bytes_sent += ctx->stats.bytes_sent - mark->bytes_sent;
+    stats->retries += replay_retries(ctx) - mark->retries;
+    source_stats_add(ctx, idx, mark, replay_now_ns(), true);
+}
+
+/* dual file mode: idx1 goes out intf1 and idx2 out intf2 */
+static void
+source_stats_stop_pair(tcpreplay_t *ctx, int idx1, int idx2, const source_mark_t *mark)
+{
+    uint64_t now_ns = replay_now_ns();
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        sendpacket_t *sp = i ? ctx->intf2 : ctx->intf1;
+        tcpreplay_source_stats_t *stats = &ctx->options->sources[i ? idx2 : idx1].stats;
+
+        if (sp == NULL)
+            continue;
+
+        stats->pkts_sent += sp->sent - mark->sp_sent[i];
+        stats->bytes_sent += sp->bytes_sent - mark->sp_bytes[i];
+        stats->retries += SENDPACKET_RETRIES(sp) - mark->sp_retries[i];
+    }
+
+    /* which of the pair a late packet came from isn't kept */
+    source_stats_add(ctx, idx1, mark, now_ns, true);
+    source_stats_add(ctx, idx2, mark, now_ns, false);
+}
 
 /**
  * \brief Internal tcpreplay method to replay a given index
@@ -43,16 +192,41 @@ static int replay_two_fds(tcpreplay_t *ctx, int idx1, int idx2);
 int 
 tcpr_replay_index(tcpreplay_t *ctx, int idx)
 {
+    source_mark_t mark;
+    uint64_t now_ns;
     int rcode = 0;
+    int i;
     assert(ctx);
 
+    send_loop_select(ctx);
+
+    /* --unique-ip flows never match an earlier pass, so start the table over */
+    if (ctx->iteration && ctx->options->unique_ip && ctx->options->flow_stats)
+        flow_hash_table_reset(ctx->flow_hash_table);
+
+    /* merge mode: every file at once, each out its own interface */
+    if (ctx->options->merge) {
+        /* send_merged_packets() counts the packets of each source as it sends them */
+        source_stats_start(ctx, &mark);
+        rcode = replay_merged_files(ctx);
+        now_ns = replay_now_ns();
+        for (i = 0; i < ctx->options->source_cnt; i++)
+            source_stats_add(ctx, i, &mark, now_ns, false);
+    }
+
     /* only process a single file */
-    if (! ctx->options->dualfile) {
+    else if (! ctx->options->dualfile) {
         /* process each pcap file in order */
         for (idx = 0; idx < ctx->options->source_cnt && !ctx->abort; idx++) {
+            if (ctx->source_sel && !ctx->source_sel[idx])
+                continue;
+
             /* reset cache markers for each iteration */
             ctx->cache_byte = 0;
             ctx->cache_bit = 0;
+            source_stats_start(ctx, &mark);
+            if (ctx->ctl != NULL)
+                __atomic_store_n(&ctx->ctl->current, idx, __ATOMIC_RELEASE);
             switch(ctx->options->sources[idx].type) {
                 case source_filename:
                     rcode = replay_file(ctx, idx);
@@ -63,10 +237,22 @@ tcpr_replay_index(tcpreplay_t *ctx, int idx)
                 case source_cache:
                     rcode = replay_cache(ctx, idx);
                     break;
+                case source_shm:
+                    rcode = replay_shm(ctx, idx);
+                    break;
                 default:
                     tcpreplay_seterr(ctx, "Invalid source type: %d", ctx->options->sources[idx].type);
                     rcode = -1;
             }
+            source_stats_stop(ctx, idx, &mark);
+
+            /* --control-shm stopped this file to carry on with another */
+            if (ctx->ctl_switch >= 0) {
+                dbgx(1, "--control-shm: switching from source %d to %d", idx, ctx->ctl_switch);
+                idx = ctx->ctl_switch - 1;
+                ctx->ctl_switch = -1;
+                ctx->abort = false;
+            }
         }
     }
 
@@ -74,10 +260,16 @@ tcpr_replay_index(tcpreplay_t *ctx, int idx)
     else {
         /* process each pcap file in order */
         for (idx = 0; idx < ctx->options->source_cnt && !ctx->abort; idx += 2) {
+            if (ctx->source_sel && !ctx->source_sel[idx])
+                continue;
+
             if (ctx->options->sources[idx].type != ctx->options->sources[(idx+1)].type) {
                 tcpreplay_seterr(ctx, "Both source indexes (%d, %d) must be of the same type", idx, (idx+1));
                 return -1;
             }
+            source_stats_start(ctx, &mark);
+            if (ctx->ctl != NULL)
+                __atomic_store_n(&ctx->ctl->current, idx, __ATOMIC_RELEASE);
             switch(ctx->options->sources[idx].type) {
                 case source_filename:
                     rcode = replay_two_files(ctx, idx, (idx+1));
@@ -88,14 +280,30 @@ tcpr_replay_index(tcpreplay_t *ctx, int idx)
                 case source_cache:
                     rcode = replay_two_caches(ctx, idx, (idx+1));
                     break;
+                case source_shm:
+                    tcpreplay_seterr(ctx, "%s", "Shared memory rings can't be replayed in dual file mode");
+                    rcode = -1;
+                    break;
                 default:
                     tcpreplay_seterr(ctx, "Invalid source type: %d", ctx->options->sources[idx].type);
                     rcode = -1;
             }
-
+            source_stats_stop_pair(ctx, idx, idx + 1, &mark);
         }
 
     }
+
+    /* --late-policy=fail stopped the replay */
+    if (ctx->late_failed)
+        rcode = -1;
+
+    if (ctx->options->flow_stats)
+        flow_hash_table_stats(ctx->flow_hash_table, &ctx->stats);
+
+    ctx->stats.preload_bytes = preload_memory(ctx);
+    ctx->stats.cache_bytes = (ctx->options->cache_packets + CACHE_PACKETS_PER_BYTE - 1) /
+            CACHE_PACKETS_PER_BYTE;
+
     if (rcode < 0) {
         ctx->running = false;
         return -1;
@@ -122,13 +330,22 @@ replay_file(tcpreplay_t *ctx, int idx)
 
     path = ctx->options->sources[idx].filename;
 
+#ifdef HAVE_LIBPTHREAD
+    /* the --preload-window reader opens the files itself */
+    if (ctx->options->preload_window) {
+        ctx->stats.active_pcap = path;
+        send_packets(ctx, NULL, idx);
+        return 0;
+    }
+#endif
+
     /* close stdin if reading from it (needed for some OS's) */
     if (strncmp(path, "-", 1) == 0)
         close(1);
 
     /* read from pcap file if we haven't cached things yet */
     if (!ctx->options->preload_pcap) {
-        if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
+        if ((pcap = replay_reader_open(ctx, idx, ebuf)) == NULL) {
             tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
             return -1;
         }
@@ -143,7 +360,7 @@ replay_file(tcpreplay_t *ctx, int idx)
 
     } else {
         if (!ctx->options->file_cache[idx].cached) {
-            if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
+            if ((pcap = replay_reader_open(ctx, idx, ebuf)) == NULL) {
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
                 return -1;
             }
@@ -160,14 +377,15 @@ replay_file(tcpreplay_t *ctx, int idx)
     if (ctx->options->verbose) {
         /* in cache mode, we may not have opened the file */
         if (pcap == NULL)
-            if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
+            if ((pcap = tcpr_pcap_open_offline_nsec(path, ebuf)) == NULL) {
                tcpreplay_seterr("Error opening pcap file: %s", ebuf);
                return -1;
             }
 
         ctx->options->file_cache[idx].dlt = pcap_datalink(pcap);
-        /* init tcpdump */
+        /* init tcpdump, decodes are printed off the send path */
         tcpdump_open(ctx->options->tcpdump, pcap);
+        tcpdump_async(ctx->options->tcpdump);
     }
 #endif
 #endif
@@ -187,11 +405,25 @@ replay_file(tcpreplay_t *ctx, int idx)
                 ctx->intf1->device, pcap_datalink_val_to_name(ctx->intf1dlt));
     }
 
+    if (pcap != NULL && ctx->options->mmap_pcap)
+        replay_mmap_open(ctx, idx);
+
+    reset_read_window(ctx, pcap, idx);
+
     ctx->stats.active_pcap = ctx->options->sources[idx].filename;
-    send_packets(ctx, pcap, idx);
+#ifdef HAVE_LIBPTHREAD
+    /* the first pass builds the cache, so it's always single threaded */
+    if (ctx->worker_intf != NULL && ctx->options->file_cache[idx].cached &&
+            !ctx->partition_cnt)
+        send_packets_workers(ctx, idx);
+    else
+#endif
+        send_packets(ctx, pcap, idx);
+
+    replay_mmap_close(ctx, idx);
 
     if (pcap != NULL)
-        pcap_close(pcap);
+        replay_reader_close(ctx, idx, pcap);
 
 #if 0
 #ifdef ENABLE_VERBOSE
@@ -232,26 +464,26 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
 
     /* read from first pcap file if we haven't cached things yet */
     if (!ctx->options->preload_pcap) {
-        if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
+        if ((pcap1 = replay_reader_open(ctx, idx1, ebuf)) == NULL) {
             tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
             return -1;
         }
         ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
-        if ((pcap2 = pcap_open_offline(path2, ebuf)) == NULL) {
+        if ((pcap2 = replay_reader_open(ctx, idx2, ebuf)) == NULL) {
             tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
             return -1;
         }
         ctx->options->file_cache[idx2].dlt = pcap_datalink(pcap2);
     } else {
         if (!ctx->options->file_cache[idx1].cached) {
-            if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
+            if ((pcap1 = replay_reader_open(ctx, idx1, ebuf)) == NULL) {
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
                 return -1;
             }
             ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
         }
         if (!ctx->options->file_cache[idx2].cached) {
-            if ((pcap2 = pcap_open_offline(path2, ebuf)) == NULL) {
+            if ((pcap2 = replay_reader_open(ctx, idx2, ebuf)) == NULL) {
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
                 return -1;
             }
@@ -303,25 +535,39 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
 
         /* in cache mode, we may not have opened the file */
         if (pcap1 == NULL) {
-            if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
+            if ((pcap1 = tcpr_pcap_open_offline_nsec(path1, ebuf)) == NULL) {
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
                 return -1;
             }
             ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
         }
-        /* init tcpdump */
+        /* init tcpdump, decodes are printed off the send path */
         tcpdump_open(ctx->options->tcpdump, pcap1);
+        tcpdump_async(ctx->options->tcpdump);
     }
 #endif
 
 
+    if (ctx->options->mmap_pcap) {
+        if (pcap1 != NULL)
+            replay_mmap_open(ctx, idx1);
+        if (pcap2 != NULL)
+            replay_mmap_open(ctx, idx2);
+    }
+
+    reset_read_window(ctx, pcap1, idx1);
+    reset_read_window(ctx, pcap2, idx2);
+
     send_dual_packets(ctx, pcap1, idx1, pcap2, idx2);
 
+    replay_mmap_close(ctx, idx1);
+    replay_mmap_close(ctx, idx2);
+
     if (pcap1 != NULL)
-        pcap_close(pcap1);
+        replay_reader_close(ctx, idx1, pcap1);
 
     if (pcap2 != NULL)
-        pcap_close(pcap2);
+        replay_reader_close(ctx, idx2, pcap2);
 
 #ifdef ENABLE_VERBOSE
     tcpdump_close(ctx->options->tcpdump);
@@ -331,60 +577,706 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
 }
 
 
+/**
+ * \brief replay every pcap file at once, merged by timestamp
+ *
+ * Internal to tcpreplay, does the heavy lifting for --merge
+ */
+static int
+replay_merged_files(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    pcap_t **pcaps;
+    sendpacket_t *sp;
+    char *path;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    int i, dlt, rcode = 0;
+
+    assert(ctx);
+
+    pcaps = safe_malloc(sizeof(pcap_t *) * options->source_cnt);
+
+    for (i = 0; i < options->source_cnt; i++) {
+        if (options->sources[i].type != source_filename) {
+            tcpreplay_seterr(ctx, "Source index %d must be a file in merge mode", i);
+            rcode = -1;
+            goto done;
+        }
+
+        path = options->sources[i].filename;
+
+        /* can't use stdin in merge mode */
+        if (strcmp(path, "-") == 0) {
+            tcpreplay_seterr(ctx, "%s", "Invalid use of STDIN '-' in merge mode");
+            rcode = -1;
+            goto done;
+        }
+
+        /* read from the file if we haven't cached it yet */
+        if (!options->preload_pcap || !options->file_cache[i].cached) {
+            if ((pcaps[i] = replay_reader_open(ctx, i, ebuf)) == NULL) {
+                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+                rcode = -1;
+                goto done;
+            }
+            options->file_cache[i].dlt = pcap_datalink(pcaps[i]);
+
+#ifdef HAVE_PCAP_SNAPSHOT
+            if (pcap_snapshot(pcaps[i]) < 65535) {
+                tcpreplay_setwarn(ctx, "%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
+                        path, pcap_snapshot(pcaps[i]));
+                rcode = -2;
+            }
+#endif
+
+            sp = i < options->merge_intf_cnt ? ctx->merge_map[i] : ctx->intf1;
+            dlt = sendpacket_get_dlt(sp);
+            if (dlt >= 0 && dlt != options->file_cache[i].dlt) {
+                tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)",
+                    path, pcap_datalink_val_to_name(options->file_cache[i].dlt),
+                    sp->device, pcap_datalink_val_to_name(dlt));
+                rcode = -2;
+            }
+
+            if (options->mmap_pcap)
+                replay_mmap_open(ctx, i);
+        }
+
+        reset_read_window(ctx, pcaps[i], i);
+    }
+
+    send_merged_packets(ctx, pcaps, options->source_cnt);
+
+done:
+    for (i = 0; i < options->source_cnt; i++) {
+        replay_mmap_close(ctx, i);
+        if (pcaps[i] != NULL)
+            replay_reader_close(ctx, i, pcaps[i]);
+    }
+
+    safe_free(pcaps);
+    return rcode;
+}
+
+/**
+ * \brief Checks the DLT of a source_cache index against its interface,
+ * loading its packets into the cache on the first pass
+ */
+static void
+replay_cache_load(tcpreplay_t *ctx, int idx, sendpacket_t *sp, int *spdlt)
+{
+    file_cache_t *fc = &ctx->options->file_cache[idx];
+
+    if (fc->cached)
+        return;
+
+    if (*spdlt == -1)
+        *spdlt = sendpacket_get_dlt(sp);
+    if (*spdlt >= 0 && *spdlt != fc->dlt)
+        tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)",
+            ctx->options->sources[idx].filename, pcap_datalink_val_to_name(fc->dlt),
+            sp->device, pcap_datalink_val_to_name(*spdlt));
+
+    packet_cache_load(ctx, idx);
+}
+
 /**
  * \brief Replay index using existing memory cache 
  *
- * FIXME
+ * The packets tcpreplay_add_cache() was given are sent straight from
+ * the caller's memory, the way a preloaded file is sent from its cache.
  */
 static int
 replay_cache(tcpreplay_t *ctx, int idx)
 {
-
     assert(ctx);
-    assert(ctx->options->sources[idx].type = source_cache);
+    assert(ctx->options->sources[idx].type == source_cache);
+
+    replay_cache_load(ctx, idx, ctx->intf1, &ctx->intf1dlt);
+    reset_read_window(ctx, NULL, idx);
+
+    ctx->stats.active_pcap = ctx->options->sources[idx].filename;
+#ifdef HAVE_LIBPTHREAD
+    if (ctx->worker_intf != NULL && !ctx->partition_cnt)
+        send_packets_workers(ctx, idx);
+    else
+#endif
+        send_packets(ctx, NULL, idx);
+
     return 0;
 }
 
 /**
  * \brief Replay two indexes using existing memory cache 
  *
- * FIXME
+ * --dualfile for two tcpreplay_add_cache() sources
  */
 static int
 replay_two_caches(tcpreplay_t *ctx, int idx1, int idx2)
 {
-
     assert(ctx);
-    assert(ctx->options->sources[idx1].type = source_cache);
-    assert(ctx->options->sources[idx2].type = source_cache);
+    assert(ctx->options->sources[idx1].type == source_cache);
+    assert(ctx->options->sources[idx2].type == source_cache);
+
+    replay_cache_load(ctx, idx1, ctx->intf1, &ctx->intf1dlt);
+    replay_cache_load(ctx, idx2, ctx->intf2, &ctx->intf2dlt);
+    reset_read_window(ctx, NULL, idx1);
+    reset_read_window(ctx, NULL, idx2);
+
+    send_dual_packets(ctx, NULL, idx1, NULL, idx2);
+
+    return 0;
+}
+
+/**
+ * \brief Opens the stream of a source_fd index, unless it is cached
+ *
+ * A stream can only be read once, so later passes need the cache
+ * --preload-pcap builds on the first.  Returns -1 on error, else 0 and
+ * the pcap, NULL when cached.
+ */
+static int
+replay_fd_open(tcpreplay_t *ctx, int idx, sendpacket_t *sp, int *spdlt, pcap_t **pcap)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+    file_cache_t *fc = &ctx->options->file_cache[idx];
+    char ebuf[PCAP_ERRBUF_SIZE];
+
+    *pcap = NULL;
+    if (fc->cached)
+        return 0;
+
+    if (src->fd_read) {
+        tcpreplay_seterr(ctx, "%s was read already, use --preload-pcap to replay it again",
+                src->filename);
+        return -1;
+    }
+
+    if ((*pcap = tcpr_pcap_fdopen_offline_nsec(src->fd, &src->fd_buf, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "Error opening pcap stream %s: %s", src->filename, ebuf);
+        return -1;
+    }
+
+    src->fd_read = true;
+    fc->dlt = pcap_datalink(*pcap);
+
+    if (*spdlt == -1)
+        *spdlt = sendpacket_get_dlt(sp);
+    if (*spdlt >= 0 && *spdlt != fc->dlt)
+        tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)",
+            src->filename, pcap_datalink_val_to_name(fc->dlt),
+            sp->device, pcap_datalink_val_to_name(*spdlt));
+
     return 0;
 }
 
+static void
+replay_fd_close(tcpreplay_t *ctx, int idx, pcap_t *pcap)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+
+    if (pcap == NULL)
+        return;
+
+    pcap_close(pcap);
+    safe_free(src->fd_buf);
+    src->fd_buf = NULL;
+}
+
 /**
  * \brief Replay index which is a file descriptor 
  *
- * FIXME
+ * Streams a pcap arriving on a pipe or socket, such as STDIN, see
+ * tcpreplay_add_pcapfd().
  */
 static int
 replay_fd(tcpreplay_t *ctx, int idx)
 {
+    pcap_t *pcap;
 
     assert(ctx);
-    assert(ctx->options->sources[idx].type = source_fd);
+    assert(ctx->options->sources[idx].type == source_fd);
+
+#ifdef HAVE_LIBPTHREAD
+    /* the --preload-window reader opens the stream itself */
+    if (ctx->options->preload_window) {
+        ctx->stats.active_pcap = ctx->options->sources[idx].filename;
+        send_packets(ctx, NULL, idx);
+        return 0;
+    }
+#endif
+
+    if (replay_fd_open(ctx, idx, ctx->intf1, &ctx->intf1dlt, &pcap) < 0)
+        return -1;
+
+    reset_read_window(ctx, pcap, idx);
+
+    ctx->stats.active_pcap = ctx->options->sources[idx].filename;
+#ifdef HAVE_LIBPTHREAD
+    /* the first pass builds the cache, so it's always single threaded */
+    if (ctx->worker_intf != NULL && ctx->options->file_cache[idx].cached &&
+            !ctx->partition_cnt)
+        send_packets_workers(ctx, idx);
+    else
+#endif
+        send_packets(ctx, pcap, idx);
+
+    replay_fd_close(ctx, idx, pcap);
     return 0;
 }
 
 /**
  * \brief Replay two indexes which are a file descriptor 
  *
- * FIXME
+ * --dualfile for two tcpreplay_add_pcapfd() streams
  */
 static int
 replay_two_fds(tcpreplay_t *ctx, int idx1, int idx2)
 {
+    pcap_t *pcap1, *pcap2;
+
+    assert(ctx);
+    assert(ctx->options->sources[idx1].type == source_fd);
+    assert(ctx->options->sources[idx2].type == source_fd);
+
+    if (replay_fd_open(ctx, idx1, ctx->intf1, &ctx->intf1dlt, &pcap1) < 0)
+        return -1;
+
+    if (replay_fd_open(ctx, idx2, ctx->intf2, &ctx->intf2dlt, &pcap2) < 0) {
+        replay_fd_close(ctx, idx1, pcap1);
+        return -1;
+    }
+
+    reset_read_window(ctx, pcap1, idx1);
+    reset_read_window(ctx, pcap2, idx2);
+
+    send_dual_packets(ctx, pcap1, idx1, pcap2, idx2);
+
+    replay_fd_close(ctx, idx1, pcap1);
+    replay_fd_close(ctx, idx2, pcap2);
+    return 0;
+}
+
+/**
+ * \brief Replay index which is a shared memory ring
+ *
+ * Sends what external generators write into the ring until they finish,
+ * see tcpreplay_add_shm().  Packets go out of the ring itself.
+ */
+static int
+replay_shm(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+    file_cache_t *fc = &ctx->options->file_cache[idx];
+
+    assert(ctx);
+    assert(src->type == source_shm);
+
+    ctx->stats.active_pcap = src->filename;
+#ifdef HAVE_LIBPTHREAD
+    /* the --preload-window reader reads the ring itself */
+    if (ctx->options->preload_window) {
+        send_packets(ctx, NULL, idx);
+        return 0;
+    }
+#endif
+
+    if (!fc->cached && src->shm->done) {
+        tcpreplay_seterr(ctx, "%s was read already, use --preload-pcap to replay it again",
+                src->filename);
+        return -1;
+    }
+
+    if (ctx->intf1dlt == -1)
+        ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
+    if (ctx->intf1dlt >= 0 && ctx->intf1dlt != fc->dlt)
+        tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)",
+            src->filename, pcap_datalink_val_to_name(fc->dlt),
+            ctx->intf1->device, pcap_datalink_val_to_name(ctx->intf1dlt));
+
+    reset_read_window(ctx, NULL, idx);
+
+#ifdef HAVE_LIBPTHREAD
+    if (ctx->worker_intf != NULL && fc->cached && !ctx->partition_cnt)
+        send_packets_workers(ctx, idx);
+    else
+#endif
+        send_packets(ctx, NULL, idx);
+
+    return 0;
+}
+
+/**
+ * \brief Map the source file for --mmap-pcap
+ *
+ * Falls back to reading via libpcap if the file can't be mapped
+ */
+static void
+replay_mmap_open(tcpreplay_t *ctx, int idx)
+{
+    char *path = ctx->options->sources[idx].filename;
+    char ebuf[PCAP_ERRBUF_SIZE];
+
+    assert(ctx);
+
+    if (strncmp(path, "-", 1) == 0)
+        return;
+
+    if ((ctx->options->sources[idx].mmap = pcap_mmap_open(path, ebuf)) == NULL)
+        dbgx(1, "Reading %s via libpcap: %s", path, ebuf);
+}
+
+/**
+ * \brief Unmap the source file, if it was mapped and the file cache
+ * doesn't still point into it
+ */
+static void
+replay_mmap_close(tcpreplay_t *ctx, int idx)
+{
+    assert(ctx);
+
+    if (ctx->options->file_cache[idx].mmap != ctx->options->sources[idx].mmap)
+        pcap_mmap_close(ctx->options->sources[idx].mmap);
+    ctx->options->sources[idx].mmap = NULL;
+}
+
+/**
+ * \brief Open the source file, or rewind the reader the last pass kept
+ *
+ * Only classic pcap in a regular file can be rewound: pcapng interleaves
+ * blocks libpcap has to have seen, and compressed files are pipes.
+ */
+static pcap_t *
+replay_reader_open(tcpreplay_t *ctx, int idx, char *ebuf)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+    struct stat st;
+    uint32_t magic;
+    pcap_t *pcap;
+    FILE *fp;
 
     assert(ctx);
-    assert(ctx->options->sources[idx1].type = source_fd);
-    assert(ctx->options->sources[idx2].type = source_fd);
+
+    if ((pcap = src->reader) != NULL) {
+        src->reader = NULL;
+        if (fseeko(pcap_file(pcap), src->reader_off, SEEK_SET) == 0) {
+            dbgx(2, "Rewound %s for the next loop", src->filename);
+            return pcap;
+        }
+
+        pcap_close(pcap);
+    }
+
+    if ((pcap = tcpr_pcap_open_offline_nsec(src->filename, ebuf)) == NULL)
+        return NULL;
+
+    src->reader_off = -1;
+    fp = pcap_file(pcap);
+    if (fp != NULL && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+            pread(fileno(fp), &magic, sizeof(magic), 0) == sizeof(magic) &&
+            magic != PCAPNG_MAGIC) {
+        src->reader_off = ftello(fp);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    return pcap;
+}
+
+/**
+ * \brief Done with a pass over the source file
+ *
+ * The reader stays open for the next --loop pass, and the kernel is told
+ * to read the start of the file back in while the last packets of this
+ * pass are still going out.  tcpreplay_close() closes the last one.
+ */
+static void
+replay_reader_close(tcpreplay_t *ctx, int idx, pcap_t *pcap)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+
+    assert(ctx);
+
+    if (src->reader_off < 0 || ctx->options->source_cnt > REPLAY_KEEP_FILES ||
+            ctx->abort) {
+        pcap_close(pcap);
+        return;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fileno(pcap_file(pcap)), src->reader_off, REPLAY_WILLNEED,
+            POSIX_FADV_WILLNEED);
+#endif
+    src->reader = pcap;
+}
+
+/**
+ * Adds a packet of bytes captured at ts_usec to the plan, at the time the
+ * speed mode would send it
+ */
+static void
+plan_add(const tcpreplay_t *ctx, plan_t *plan, COUNTER ts_usec, COUNTER bytes)
+{
+    const tcpreplay_speed_t *speed = &ctx->options->speed;
+    uint64_t nsec = plan->last_nsec;
+    COUNTER bucket, n;
+
+    switch (speed->mode) {
+    case speed_multiplier:
+        if (!plan->file_started) {
+            plan->first_usec = ts_usec;
+            plan->file_nsec = plan->last_nsec;
+        }
+
+        /* a packet older than the last is sent right away */
+        if (ts_usec > plan->first_usec)
+            nsec = plan->file_nsec + (uint64_t)((double)(ts_usec - plan->first_usec) *
+                    1000.0 / speed->multiplier);
+        nsec = max(nsec, plan->last_nsec);
+        break;
+
+    case speed_packetrate:
+        if (speed->speed > 0)
+            nsec = (uint64_t)((double)(plan->packets / max(speed->pps_multi, 1) *
+                    max(speed->pps_multi, 1)) * 1000000000.0 / (double)speed->speed);
+        break;
+
+    case speed_mbpsrate:
+        if (speed->speed > 0)
+            nsec = (uint64_t)((double)plan->total_bytes * 8.0 * 1000000000.0 /
+                    (double)speed->speed);
+        break;
+
+    default:
+        /* --topspeed asks for whatever the backend can do */
+        nsec = 0;
+    }
+
+    plan->file_started = true;
+    plan->last_nsec = nsec;
+
+    bucket = nsec / PLAN_BUCKET_NSEC;
+    if (bucket >= plan->bucket_alloc) {
+        n = max(bucket + 1, plan->bucket_alloc * 2);
+        plan->pkts = safe_realloc(plan->pkts, n * sizeof(COUNTER));
+        plan->bytes = safe_realloc(plan->bytes, n * sizeof(COUNTER));
+        memset(&plan->pkts[plan->bucket_alloc], 0, (n - plan->bucket_alloc) * sizeof(COUNTER));
+        memset(&plan->bytes[plan->bucket_alloc], 0, (n - plan->bucket_alloc) * sizeof(COUNTER));
+        plan->bucket_alloc = n;
+    }
+
+    plan->pkts[bucket]++;
+    plan->bytes[bucket] += bytes;
+    plan->bucket_cnt = max(plan->bucket_cnt, bucket + 1);
+    plan->packets++;
+    plan->total_bytes += bytes;
+}
+
+/**
+ * Adds the packets of a file to the plan from the preload cache, its
+ * tcpcapinfo --meta sidecar or else the pcap itself
+ */
+static int
+plan_file(tcpreplay_t *ctx, plan_t *plan, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    const char *path = options->sources[idx].filename;
+    const pcap_meta_group_t *g;
+    struct pcap_pkthdr *pkthdr;
+    const u_char *pktdata;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_meta_t *pm;
+    pcap_t *pcap;
+    COUNTER i;
+    int rcode;
+
+    plan->file_started = false;
+
+    if (options->preload_pcap && fc->cached) {
+        for (i = 0; i < fc->packet_cnt; i++) {
+            pkthdr = &fc->packet_cache[i]->pkthdr;
+            plan_add(ctx, plan, TIMEVAL_TO_MICROSEC(&pkthdr->ts),
+                    options->use_pkthdr_len ? pkthdr->len : pkthdr->caplen);
+        }
+
+        return 0;
+    }
+
+    if ((pm = pcap_meta_open(path, ebuf)) != NULL) {
+        while ((g = pcap_meta_next(pm, ebuf)) != NULL) {
+            for (i = 0; i < g->rows; i++)
+                plan_add(ctx, plan, g->ts_usec[i],
+                        options->use_pkthdr_len ? g->len[i] : g->caplen[i]);
+        }
+
+        pcap_meta_close(pm);
+        if (ebuf[0] == '\0')
+            return 0;
+
+        tcpreplay_seterr(ctx, "%s%s: %s", path, PCAP_META_SUFFIX, ebuf);
+        return -1;
+    }
+
+    if (ebuf[0] != '\0')
+        warnx("%s, reading the pcap instead", ebuf);
+
+    if ((pcap = tcpr_pcap_open_offline(path, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+        return -1;
+    }
+
+    while ((rcode = pcap_next_ex(pcap, &pkthdr, &pktdata)) == 1)
+        plan_add(ctx, plan, TIMEVAL_TO_MICROSEC(&pkthdr->ts),
+                options->use_pkthdr_len ? pkthdr->len : pkthdr->caplen);
+
+    if (rcode == -1)
+        warnx("%s: planned the first " COUNTER_SPEC " packets only: %s",
+                path, plan->packets, pcap_geterr(pcap));
+
+    pcap_close(pcap);
+    return 0;
+}
+
+/**
+ * Times how fast intf1 takes copies of the first packet of the first
+ * file.  Returns 0 and the packets and bytes per second, or -1.
+ */
+static int
+plan_calibrate(tcpreplay_t *ctx, double *pps, double *bps, uint32_t *pktlen)
+{
+    struct pcap_pkthdr *pkthdr;
+    struct pcap_pkthdr hdr;
+    const u_char *pktdata;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct timespec start, now;
+    uint64_t elapsed = 0;
+    COUNTER sent = 0;
+    u_char *data;
+    pcap_t *pcap;
+
+    if ((pcap = tcpr_pcap_open_offline(ctx->options->sources[0].filename, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+        return -1;
+    }
+
+    if (pcap_next_ex(pcap, &pkthdr, &pktdata) != 1) {
+        tcpreplay_seterr(ctx, "%s has no packet to calibrate with",
+                ctx->options->sources[0].filename);
+        pcap_close(pcap);
+        return -1;
+    }
+
+    memcpy(&hdr, pkthdr, sizeof(hdr));
+    data = safe_malloc(hdr.caplen);
+    memcpy(data, pktdata, hdr.caplen);
+    pcap_close(pcap);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed < PLAN_CALIBRATE_NSEC) {
+        if (sendpacket(ctx->intf1, data, hdr.caplen, &hdr) < 0) {
+            tcpreplay_seterr(ctx, "Unable to send calibration packets: %s",
+                    sendpacket_geterr(ctx->intf1));
+            safe_free(data);
+            return -1;
+        }
+
+        /* the clock is read once every 64 packets so it costs next to nothing */
+        if (++sent % 64 == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ULL +
+                    now.tv_nsec - start.tv_nsec;
+        }
+    }
+
+    safe_free(data);
+    *pps = (double)sent * 1000000000.0 / (double)elapsed;
+    *bps = *pps * hdr.caplen * 8.0;
+    *pktlen = hdr.caplen;
     return 0;
 }
+
+/**
+ * \brief --plan: reports whether the backend can keep up before sending
+ *
+ * Works out how many packets and bytes each millisecond of one pass of
+ * the files asks for at the chosen speed, times how fast the backend can
+ * really send, and reports the milliseconds it can't keep up with.
+ * Returns 0 if every millisecond is within reach, 1 if not, -1 on error.
+ */
+int
+tcpr_replay_plan(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    COUNTER i, peak_pkts = 0, peak_bytes = 0, peak_pkts_at = 0, peak_bytes_at = 0;
+    COUNTER over = 0, first_over = 0;
+    double pps, bps, secs;
+    uint32_t pktlen;
+    plan_t plan;
+    bool topspeed;
+    int idx, rcode = 0;
+
+    assert(ctx);
+
+    /* --mbps=0 and --pps=0 are --topspeed too */
+    topspeed = options->speed.mode == speed_topspeed ||
+            (options->speed.mode != speed_multiplier && options->speed.speed == 0);
+
+    memset(&plan, 0, sizeof(plan));
+    for (idx = 0; idx < options->source_cnt; idx++) {
+        if ((rcode = plan_file(ctx, &plan, idx)) < 0)
+            goto out;
+    }
+
+    if ((rcode = plan_calibrate(ctx, &pps, &bps, &pktlen)) < 0)
+        goto out;
+
+    for (i = 0; i < plan.bucket_cnt; i++) {
+        if (plan.pkts[i] > peak_pkts) {
+            peak_pkts = plan.pkts[i];
+            peak_pkts_at = i;
+        }
+
+        if (plan.bytes[i] > peak_bytes) {
+            peak_bytes = plan.bytes[i];
+            peak_bytes_at = i;
+        }
+
+        if ((double)plan.pkts[i] * 1000.0 > pps || (double)plan.bytes[i] * 8000.0 > bps) {
+            if (over++ == 0)
+                first_over = i;
+        }
+    }
+
+    secs = topspeed ? (double)plan.packets / pps :
+            (double)plan.last_nsec / 1000000000.0;
+    printf("Plan: " COUNTER_SPEC " packets, " COUNTER_SPEC " bytes, %.6f sec per pass\n",
+            plan.packets, plan.total_bytes, secs);
+    printf("Backend: %.0f pps, %.2f Mbps sending %u byte packets on %s\n",
+            pps, bps / 1000000.0, pktlen, options->intf1_name);
+
+    if (topspeed) {
+        printf("Plan: --topspeed goes as fast as the backend\n");
+        goto out;
+    }
+
+    printf("Plan: busiest msec " COUNTER_SPEC " packets (%.0f pps) at %.3f sec, "
+            COUNTER_SPEC " bytes (%.2f Mbps) at %.3f sec\n",
+            peak_pkts, peak_pkts * 1000.0, peak_pkts_at / 1000.0,
+            peak_bytes, peak_bytes * 8000.0 / 1000000.0, peak_bytes_at / 1000.0);
+
+    if (over == 0) {
+        printf("Plan: every msec is within what the backend can send\n");
+    } else {
+        printf("Plan: " COUNTER_SPEC " of " COUNTER_SPEC " msec ask for more than the backend "
+                "can send, the first at %.3f sec; their packets will go out late\n",
+                over, plan.bucket_cnt, first_over / 1000.0);
+        rcode = 1;
+    }
+
+out:
+    safe_free(plan.pkts);
+    safe_free(plan.bytes);
+    return rcode;
+}
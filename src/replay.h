@@ -22,5 +22,6 @@
 #define _REPLAY_H_
 
 int tcpr_replay_index(tcpreplay_t *ctx, int idx);
+int tcpr_replay_plan(tcpreplay_t *ctx);
 
 #endif /* _REPLAY_H_ */
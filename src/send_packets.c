@@ -32,6 +32,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef linux
+#include <sys/syscall.h>
+#endif
 
 #include "tcpreplay_api.h"
 #include "timestamp_trace.h"
@@ -42,7 +52,6 @@
 #ifdef TCPREPLAY_EDIT
 #include "tcpreplay_edit_opts.h"
 #include "tcpedit/tcpedit.h"
-extern tcpedit_t *tcpedit;
 #else
 #include "tcpreplay_opts.h"
 #endif /* TCPREPLAY_EDIT */
@@ -51,127 +60,168 @@ extern tcpedit_t *tcpedit;
 
 #include "send_packets.h"
 #include "sleep.h"
+#include "common/probes.h"
+#ifdef ENABLE_FRAGROUTE
+#include "fragroute/fragroute.h"
+#endif
 
 #ifdef DEBUG
 extern int debug;
 #endif
 
-static void do_sleep(tcpreplay_t *ctx, struct timeval *time, 
-        struct timeval *last, int len, tcpreplay_accurate accurate, 
-        sendpacket_t *sp, COUNTER counter, timestamp_t *sent_timestamp,
-        COUNTER *start_us, COUNTER *skip_length);
-static u_char *get_next_packet(tcpreplay_t *ctx, pcap_t *pcap,
-        struct pcap_pkthdr *pkthdr,
-        int file_idx,
-        packet_cache_t **prev_packet);
-static uint32_t get_user_count(tcpreplay_t *ctx, sendpacket_t *sp, COUNTER counter);
+/* capture time of a packet in nsec, nsec is what pkthdr->ts.tv_usec drops */
+#define PACKET_TS_NS(pkthdr, nsec) (TIMEVAL_TO_NANOSEC(&(pkthdr)->ts) + (nsec))
 
-/**
- * Fast flow packet edit
- *
- * Attempts to alter the packet IP addresses without
- * changing CRC, which will avoid overhead of tcpreplay-edit
- *
- * This code is a bit bloated but it is the result of
- * optimizing. Test performance on 10GigE+ networks if
- * modifying.
+/* --stage-profile: the packet a send loop is timing, if any */
+typedef struct stage_clock_s {
+    bool sampling;
+    uint64_t last;                  /* CLOCK_MONOTONIC nsec of the last mark */
+} stage_clock_t;
+
+/*
+ * Starts timing the next packet when it is 1 in --stage-profile.  For the
+ * other packets the countdown is all the profile costs.
  */
-static void
-fast_edit_packet_dl(struct pcap_pkthdr *pkthdr, u_char **pktdata,
-        uint32_t iteration, bool cached, int datalink)
+static inline void
+stage_begin(tcpreplay_t *ctx, stage_clock_t *clk)
 {
-    u_char *packet;
-    int l2_len = 0;
-    ipv4_hdr_t *ip_hdr;
-    ipv6_hdr_t *ip6_hdr;
-    hdlc_hdr_t *hdlc_hdr;
-    sll_hdr_t *sll_hdr;
-    struct tcpr_pppserial_hdr *ppp;
-    uint32_t *src_ptr = NULL, *dst_ptr = NULL;
-    uint32_t src_ip, dst_ip;
-    uint32_t src_ip_orig, dst_ip_orig;
-    uint16_t ether_type = 0;
+    struct timespec now;
 
-    if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H) {
-        dbgx(1, "Packet too short for Unique IP feature: %u", pkthdr->caplen);
+    if (!ctx->options->stage_profile)
         return;
-    }
-    packet = *pktdata;
-
-    switch (datalink) {
-    case DLT_LINUX_SLL:
-        l2_len = 16;
-        sll_hdr = (sll_hdr_t *)*pktdata;
-        ether_type = sll_hdr->sll_protocol;
-        break;
 
-    case DLT_PPP_SERIAL:
-        l2_len = 4;
-        ppp = (struct tcpr_pppserial_hdr *)*pktdata;
-        if (ntohs(ppp->protocol) == 0x0021)
-            ether_type = htons(ETHERTYPE_IP);
-        else
-            ether_type = ppp->protocol;
-        break;
-
-    case DLT_C_HDLC:
-        l2_len = 4;
-        hdlc_hdr = (hdlc_hdr_t *)*pktdata;
-        ether_type = hdlc_hdr->protocol;
-        break;
-
-    case DLT_RAW:
-        if ((*pktdata[0] >> 4) == 4)
-            ether_type = ETHERTYPE_IP;
-        else if ((*pktdata[0] >> 4) == 6)
-            ether_type = ETHERTYPE_IP6;
-        break;
-
-    default:
-        warnx("Unable to process unsupported DLT type: %s (0x%x)",
-             pcap_datalink_val_to_description(datalink), datalink);
-            return;
+    if (ctx->stage_countdown > 1) {
+        ctx->stage_countdown--;
+        return;
     }
 
-    switch (ether_type) {
-    case ETHERTYPE_IP:
-        ip_hdr = (ipv4_hdr_t *)(*pktdata + l2_len);
-
-        if (ip_hdr->ip_v != 4) {
-            dbgx(2, "expected IPv4 but got: %u", ip_hdr->ip_v);
-            return;
-        }
+    ctx->stage_countdown = ctx->options->stage_profile;
+    ctx->stats.stage_samples++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clk->last = TIMESPEC_TO_NANOSEC(&now);
+    clk->sampling = true;
+}
 
-        if (pkthdr->caplen < (bpf_u_int32)sizeof(*ip_hdr)) {
-            dbgx(2, "Packet too short for Unique IP feature: %u", pkthdr->caplen);
-            return;
-        }
+/* charges the time since the last mark to stage */
+static inline void
+stage_mark(tcpreplay_t *ctx, stage_clock_t *clk, replay_stage_t stage)
+{
+    struct timespec now;
+    uint64_t now_ns;
 
-        ip_hdr = (ipv4_hdr_t *)(*pktdata + l2_len);
-        src_ip_orig = src_ip = ntohl(ip_hdr->ip_src.s_addr);
-        dst_ip_orig = dst_ip = ntohl(ip_hdr->ip_dst.s_addr);
-        break;
+    if (clk == NULL || !clk->sampling)
+        return;
 
-    case ETHERTYPE_IP6:
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+    ctx->stats.stage_ns[stage] += now_ns - clk->last;
+    clk->last = now_ns;
+}
 
-        if ((*pktdata[0] >> 4) != 6) {
-            dbgx(2, "expected IPv6 but got: %u", *pktdata[0] >> 4);
-            return;
-        }
+/* the last mark of a packet */
+static inline void
+stage_end(tcpreplay_t *ctx, stage_clock_t *clk, replay_stage_t stage)
+{
+    stage_mark(ctx, clk, stage);
+    clk->sampling = false;
+}
 
-        if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H) {
-            dbgx(2, "Packet too short for Unique IPv6 feature: %u", pkthdr->caplen);
-            return;
-        }
+static bool do_sleep(tcpreplay_t *ctx, COUNTER ts_ns, int len, tcpreplay_accurate accurate, 
+        sendpacket_t *sp, COUNTER counter, timestamp_t *sent_timestamp);
+static inline void late_skip(tcpreplay_t *ctx, COUNTER ts_ns);
+static u_char *get_next_packet(tcpreplay_t *ctx, pcap_t *pcap,
+        struct pcap_pkthdr *pkthdr,
+        int file_idx,
+        packet_cache_t **prev_packet);
+static u_char *get_next_packet_ref(tcpreplay_t *ctx, pcap_t *pcap,
+        struct pcap_pkthdr *buf, const struct pcap_pkthdr **pkthdr,
+        int file_idx, packet_cache_t **prev_packet);
+static uint32_t get_user_count(tcpreplay_t *ctx, sendpacket_t *sp, COUNTER counter);
+static u_char *packet_arena_alloc(tcpreplay_t *ctx, file_cache_t *fc, size_t len);
+static size_t packet_room(tcpreplay_t *ctx, const struct pcap_pkthdr *pkthdr);
+static void dedup_store(tcpreplay_t *ctx, file_cache_t *fc, COUNTER idx, const u_char *data,
+        uint32_t len);
+static u_char *dedup_copy(tcpreplay_t *ctx, const packet_cache_t *packet);
+static u_char *scratch_copy(tcpreplay_t *ctx, const u_char *pktdata, bpf_u_int32 caplen);
+static u_char *prepare_next_packet(tcpreplay_t *ctx, pcap_t *pcap, int idx,
+        packet_cache_t **prev_packet, struct pcap_pkthdr *pkthdr,
+        COUNTER *packetnum, sendpacket_t **sp, uint32_t *pktlen,
+        uint32_t iteration, stage_clock_t *clk);
+#ifdef HAVE_LIBPTHREAD
+/* --pipeline: packets the reader thread has prepared for the sender */
+#define PIPELINE_SLOTS      4096                /* must be a power of 2 */
+#define PIPELINE_DATA_SIZE  (16 * 1024 * 1024)
+#define PIPELINE_NAP_NSEC   50000               /* reader nap when full */
+
+typedef struct pipeline_desc_s {
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata;                /* in pipeline_t.data */
+    uint32_t pktlen;
+    COUNTER ts_ns;                  /* capture time, nsec */
+    COUNTER packetnum;
+    sendpacket_t *sp;
+    bool eof;                       /* --preload-window: not a packet, the file ended */
+} pipeline_desc_t;
+
+typedef struct pipeline_s {
+    pipeline_desc_t *desc;
+    uint32_t slots;                 /* power of 2 */
+    uint32_t head;                  /* next slot the reader fills */
+    uint32_t tail;                  /* next slot the sender takes */
+    bool popped;                    /* sender still holds desc[tail] */
+    bool done;                      /* reader has nothing more */
+    bool stop;                      /* sender wants the reader gone */
+    u_char *data;
+    size_t data_size;
+    size_t offset;                  /* reader side, next write into data */
+    tcpreplay_t *ctx;
+    pcap_t *pcap;                   /* NULL for the window, it opens its own */
+    int idx;
+    uint32_t iteration;             /* reader side, --unique-ip pass */
+    COUNTER packetnum;              /* reader side */
+    sendpacket_t *sp;               /* reader side */
+    pthread_t thread;
+} pipeline_t;
+
+static pipeline_t *pipeline_start(tcpreplay_t *ctx, pcap_t *pcap, int idx, COUNTER packetnum,
+        size_t data_size);
+static void pipeline_stop(pipeline_t *pipeline);
+static void *pipeline_reader(void *arg);
+static u_char *pipeline_pop(pipeline_t *pipeline, struct pcap_pkthdr *pkthdr,
+        COUNTER *ts_ns, COUNTER *packetnum, sendpacket_t **sp, uint32_t *pktlen);
+#endif
+static inline void timing_record(tcpreplay_t *ctx);
+static bool preload_image_load(tcpreplay_t *ctx, int idx);
+static void preload_image_write(tcpreplay_t *ctx, int idx);
+static inline void stats_export_tick(tcpreplay_t *ctx, COUNTER stride);
+static inline void stats_print_tick(tcpreplay_t *ctx);
+static inline void timeline_tick(tcpreplay_t *ctx);
+static inline void progress_tick(tcpreplay_t *ctx);
+static void rate_profile_tick(tcpreplay_t *ctx);
+static inline bool rate_tick(tcpreplay_t *ctx);
+static void send_packet_batch(tcpreplay_t *ctx, sendpacket_t *sp,
+        const struct iovec *iov, struct pcap_pkthdr *pkthdrs,
+        unsigned int *cnt);
+
+/* packet_cache_t.ip_ver when get_pkt_meta() doesn't know the datalink */
+#define IP_VER_UNLOCATED 0xff
 
-        ip6_hdr = (ipv6_hdr_t *)(*pktdata + l2_len);
-        src_ip_orig = src_ip = ntohl(ip6_hdr->ip_src.__u6_addr.__u6_addr32[3]);
-        dst_ip_orig = dst_ip = ntohl(ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3]);
-        break;
+/**
+ * --unique-ip: shift the last 32 bits of the src/dst IP addresses by the
+ * loop iteration.  Cached packets were shifted by the passes before this
+ * one, so they move by one.
+ */
+static inline void
+unique_ip_shift(u_char *src_ptr, u_char *dst_ptr, uint32_t iteration, bool cached)
+{
+    uint32_t src_ip, dst_ip;
+    uint32_t src_ip_orig, dst_ip_orig;
 
-    default:
-        return; /* non-IP */
-    }
+    /* the addresses are only 16 bit aligned behind an Ethernet header */
+    memcpy(&src_ip, src_ptr, sizeof(src_ip));
+    memcpy(&dst_ip, dst_ptr, sizeof(dst_ip));
+    src_ip_orig = src_ip = ntohl(src_ip);
+    dst_ip_orig = dst_ip = ntohl(dst_ip);
 
     /* swap src/dst IP's in a manner that does not affect CRC */
     if ((!cached && dst_ip > src_ip) ||
@@ -217,616 +267,4966 @@ fast_edit_packet_dl(struct pcap_pkthdr *pkthdr, u_char **pktdata,
 
     dbgx(1, "(%u): final src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
 
-    *src_ptr = htonl(src_ip);
-    *dst_ptr = htonl(dst_ip);
+    src_ip = htonl(src_ip);
+    dst_ip = htonl(dst_ip);
+    memcpy(src_ptr, &src_ip, sizeof(src_ip));
+    memcpy(dst_ptr, &dst_ip, sizeof(dst_ip));
 }
 
-static inline void
-fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata,
-        uint32_t iteration, bool cached, int datalink)
+/**
+ * Finds the addresses fast_edit_packet() shifts in a packet whose headers
+ * get_pkt_meta() found.  Returns packet_cache_t.ip_ver and sets *addr_off
+ * to the last 32 bits of the source address.
+ */
+static uint8_t
+unique_ip_locate(const struct pcap_pkthdr *pkthdr, const pkt_meta_t *meta,
+        uint16_t *addr_off)
 {
-    uint16_t ether_type;
-    vlan_hdr_t *vlan_hdr;
-    ipv4_hdr_t *ip_hdr = NULL;
-    ipv6_hdr_t *ip6_hdr = NULL;
-    uint32_t src_ip, dst_ip;
-    uint32_t src_ip_orig, dst_ip_orig;
-    int l2_len;
-    u_char *packet = *pktdata;
+    if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H)
+        return 0;
 
-    if (datalink != DLT_EN10MB && datalink != DLT_JUNIPER_ETHER)
-        fast_edit_packet_dl(pkthdr, pktdata, iteration, cached, datalink);
-
-    if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H) {
-        dbgx(2, "Packet too short for Unique IP feature: %u", pkthdr->caplen);
-        return;
-    }
+    switch (meta->ip_ver) {
+    case 4:
+        *addr_off = meta->l2len + offsetof(ipv4_hdr_t, ip_src);
+        return 4;
 
-    l2_len = 0;
-    if (datalink == DLT_JUNIPER_ETHER) {
-        if (memcmp(packet, "MGC", 3))
-            warnx("No Magic Number found: %s (0x%x)",
-                 pcap_datalink_val_to_description(datalink), datalink);
+    case 6:
+        *addr_off = meta->l2len + offsetof(ipv6_hdr_t, ip_src) + 12;
+        return 6;
 
-        if ((packet[3] & 0x80) == 0x80) {
-            l2_len = ntohs(*((uint16_t*)&packet[4]));
-            l2_len += 6;
-        } else
-            l2_len = 4; /* no header extensions */
+    default:
+        return 0; /* non-IP */
     }
+}
+
+/**
+ * --unique-ip: shift the IP addresses of the packet by the loop iteration
+ *
+ * Attempts to alter the packet IP addresses without
+ * changing CRC, which will avoid overhead of tcpreplay-edit
+ */
+void
+fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata,
+        uint32_t iteration, bool cached, int datalink)
+{
+    pkt_meta_t meta;
+    uint16_t addr_off = 0;
+    u_char *addr;
 
-    /* assume Ethernet, IPv4 for now */
-    ether_type = ntohs(((eth_hdr_t*)(packet + l2_len))->ether_type);
-    while (ether_type == ETHERTYPE_VLAN) {
-        vlan_hdr = (vlan_hdr_t *)(packet + l2_len);
-        ether_type = ntohs(vlan_hdr->vlan_len);
-        l2_len += 4;
+    if (get_pkt_meta(*pktdata, pkthdr->caplen, datalink, &meta) < 0) {
+        warnx("Unable to process unsupported DLT type: %s (0x%x)",
+             pcap_datalink_val_to_description(datalink), datalink);
+        return;
     }
-    l2_len += sizeof(eth_hdr_t);
 
-    switch (ether_type) {
-    case ETHERTYPE_IP:
-        ip_hdr = (ipv4_hdr_t *)(packet + l2_len);
-        src_ip_orig = src_ip = ntohl(ip_hdr->ip_src.s_addr);
-        dst_ip_orig = dst_ip = ntohl(ip_hdr->ip_dst.s_addr);
+    switch (unique_ip_locate(pkthdr, &meta, &addr_off)) {
+    case 4:
+        addr = *pktdata + addr_off;
+        unique_ip_shift(addr, addr + 4, iteration, cached);
         break;
 
-    case ETHERTYPE_IP6:
-        ip6_hdr = (ipv6_hdr_t *)(packet + l2_len);
-        src_ip_orig = src_ip = ntohl(ip6_hdr->ip_src.__u6_addr.__u6_addr32[3]);
-        dst_ip_orig = dst_ip = ntohl(ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3]);
+    case 6:
+        addr = *pktdata + addr_off;
+        unique_ip_shift(addr, addr + 16, iteration, cached);
         break;
 
     default:
-        return; /* non-IP */
+        dbgx(2, "Packet not IP or too short for Unique IP feature: %u", pkthdr->caplen);
     }
+}
 
-    dbgx(2, "Layer 3 protocol type is: 0x%04x", ether_type);
+/**
+ * --unique-ip for a preloaded packet.  Its addresses were located when it
+ * was cached, so every later pass is just the shift.  tcpreplay-edit may
+ * have moved them since, so it always takes the long way.
+ */
+static inline void
+unique_ip_cached(packet_cache_t *packet, struct pcap_pkthdr *pkthdr,
+        u_char **pktdata, uint32_t iteration, int datalink)
+{
+#ifndef TCPREPLAY_EDIT
+    u_char *addr;
+
+    if (packet->ip_ver != IP_VER_UNLOCATED && *pktdata == packet->pktdata) {
+        addr = packet->pktdata + packet->ip_addr_off;
+        if (packet->ip_ver == 4)
+            unique_ip_shift(addr, addr + 4, iteration, true);
+        else if (packet->ip_ver == 6)
+            unique_ip_shift(addr, addr + 16, iteration, true);
+        return;
+    }
+#endif
 
-    /* swap src/dst IP's in a manner that does not affect CRC */
-    if ((!cached && dst_ip > src_ip) ||
-            (cached && (dst_ip - iteration) > (src_ip - 1 - iteration))) {
-        if (cached) {
-            --src_ip;
-            ++dst_ip;
-        } else {
-            src_ip -= iteration;
-            dst_ip += iteration;
-        }
+    fast_edit_packet(pkthdr, pktdata, iteration, true, datalink);
+}
 
-        /* CRC compensations  for wrap conditions */
-        if (src_ip > src_ip_orig && dst_ip > dst_ip_orig) {
-            dbgx(1, "dst_ip > src_ip(%u): before(1) src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-            --src_ip;
-            dbgx(1, "dst_ip > src_ip(%u): after(1)  src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-        } else if (dst_ip < dst_ip_orig && src_ip < src_ip_orig) {
-            dbgx(1, "dst_ip > src_ip(%u): before(2) src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-            ++dst_ip;
-            dbgx(1, "dst_ip > src_ip(%u): after(2)  src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-        }
-    } else {
-        if (cached) {
-            ++src_ip;
-            --dst_ip;
-        } else {
-            src_ip += iteration;
-            dst_ip -= iteration;
-        }
+/**
+ * \brief Shifts a copy of a cached packet by a whole --unique-ip shift
+ *
+ * The cache keeps the original addresses, so the copy moves by the full
+ * shift rather than one pass.  Used for --clients and for the copies the
+ * dual and merge loops edit, so the checksums stay valid and both
+ * directions of a flow map to the same pair of addresses.
+ */
+static inline void
+client_shift(const packet_cache_t *packet, struct pcap_pkthdr *pkthdr,
+        u_char *pktdata, uint32_t shift, int datalink)
+{
+    u_char *addr = pktdata + packet->ip_addr_off;
+
+    if (packet->ip_ver == 4)
+        unique_ip_shift(addr, addr + 4, shift, false);
+    else if (packet->ip_ver == 6)
+        unique_ip_shift(addr, addr + 16, shift, false);
+    else if (packet->ip_ver == IP_VER_UNLOCATED)
+        fast_edit_packet(pkthdr, &pktdata, shift, false, datalink);
+}
 
-        /* CRC compensations  for wrap conditions */
-        if (dst_ip > dst_ip_orig && src_ip > src_ip_orig) {
-            dbgx(1, "src_ip > dst_ip(%u): before(1) dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-            --dst_ip;
-            dbgx(1, "src_ip > dst_ip(%u): after(1)  dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-        } else if (src_ip < src_ip_orig && dst_ip < dst_ip_orig) {
-            dbgx(1, "src_ip > dst_ip(%u): before(2) dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-            ++src_ip;
-            dbgx(1, "src_ip > dst_ip(%u): after(2)  dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-        }
-    }
+#ifdef __GNUC__
+#define PRELOAD_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PRELOAD_PREFETCH(p)
+#endif
 
-    dbgx(1, "(%u): final src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
+/**
+ * --prefetch: starts loading the data of the preloaded packet that many
+ * after packet, so it is in cache by the time it is sent.  The headers
+ * are in a dense array the hardware prefetcher keeps up with.
+ */
+static inline void
+preload_prefetch(const tcpreplay_t *ctx, const file_cache_t *fc, const packet_cache_t *packet)
+{
+    COUNTER ahead = (COUNTER)ctx->options->prefetch;
 
-    switch (ether_type) {
-    case ETHERTYPE_IP:
-        ip_hdr->ip_src.s_addr = htonl(src_ip);
-        ip_hdr->ip_dst.s_addr = htonl(dst_ip);
-        break;
+    if (ahead && (COUNTER)(fc->packet_cache + fc->packet_cnt - packet) > ahead)
+        PRELOAD_PREFETCH(packet[ahead].pktdata);
+}
 
-    case ETHERTYPE_IP6:
-        ip6_hdr->ip_src.__u6_addr.__u6_addr32[3] = htonl(src_ip);
-        ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3] = htonl(dst_ip);
-        break;
+/* a writable copy of a preloaded packet, for edits the cache mustn't see */
+typedef struct edit_scratch_s {
+    struct pcap_pkthdr pkthdr;
+    u_char *data;
+    size_t len;
+} edit_scratch_t;
+
+/* room left in front of a scratch copy for tcpedit to push the L2 header into */
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+#define EDIT_SCRATCH_HEADROOM TCPEDIT_HEADROOM
+#else
+#define EDIT_SCRATCH_HEADROOM 0
+#endif
+
+/* --preload-dedup: open addressing table of the unique packet data of a file */
+typedef struct dedup_slot_s {
+    const u_char *data;     /* NULL if the slot is free */
+    COUNTER owner;          /* packet_cache index of the first packet using data */
+    uint32_t hash;
+    uint32_t len;
+} dedup_slot_t;
+
+typedef struct dedup_table_s {
+    dedup_slot_t *slots;
+    size_t size;            /* power of 2 */
+    size_t used;
+} dedup_table_t;
+
+#define DEDUP_TABLE_MIN 4096
+
+/**
+ * Copies a packet into scratch so it can be edited, leaving
+ * the cache read-only.  The buffer keeps room for tcpedit to grow the
+ * Layer 2 header in front of the copy and to pad it out behind.
+ */
+static u_char *
+edit_scratch_copy_data(edit_scratch_t *scratch, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata)
+{
+    size_t need = max((size_t)MAXPACKET, (size_t)pkthdr->caplen + 64) +
+            EDIT_SCRATCH_HEADROOM;
+
+    if (scratch->len < need) {
+        scratch->data = safe_realloc(scratch->data, need);
+        scratch->len = need;
     }
+
+    memcpy(&scratch->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+    memcpy(scratch->data + EDIT_SCRATCH_HEADROOM, pktdata, pkthdr->caplen);
+    return scratch->data + EDIT_SCRATCH_HEADROOM;
+}
+
+static inline u_char *
+edit_scratch_copy(edit_scratch_t *scratch, const packet_cache_t *packet)
+{
+    return edit_scratch_copy_data(scratch, &packet->pkthdr, packet->pktdata);
+}
+
+/*
+ * Whether a packet read straight from source idx has to be copied before
+ * it is edited.  tcpedit may write past caplen, padding or pushing the L2
+ * header out, and in a --mmap-pcap mapping that is the header of the next
+ * record or beyond the end of the mapping.  A shm: ring belongs to its
+ * producer, which may still be reading the packet, so nothing at all is
+ * changed in place there.  edit is any edit, tcpedit or --unique-ip.
+ */
+static inline bool
+source_edit_copy(const tcpreplay_t *ctx, int idx, bool tcpedit, bool edit)
+{
+    const tcpreplay_source_t *src = &ctx->options->sources[idx];
+
+    return (tcpedit && src->mmap != NULL) || (edit && src->shm != NULL);
 }
 
 /**
- * \brief Update flow stats
- *
- * Finds out if flow is unique and updates stats.
+ * --unique-ip for a packet the dual and merge loops are about to send.
+ * packet is its cache entry, in which case pktdata is an edit_scratch_t
+ * copy, or NULL when it was read from the file.
  */
-static inline void update_flow_stats(tcpreplay_t *ctx, sendpacket_t *sp,
-        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int datalink)
+static inline void
+unique_ip_copy(tcpreplay_t *ctx, const packet_cache_t *packet,
+        struct pcap_pkthdr *pkthdr, u_char **pktdata, int datalink)
 {
-    flow_entry_type_t res = flow_decode(ctx->flow_hash_table,
-            pkthdr, pktdata, datalink, ctx->options->flow_expiry);
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    /* tcpedit may have moved the addresses located at preload */
+    if (ctx->tcpedit != NULL)
+        packet = NULL;
+#endif
+
+    if (packet != NULL)
+        client_shift(packet, pkthdr, *pktdata, ctx->iteration, datalink);
+    else
+        fast_edit_packet(pkthdr, pktdata, ctx->iteration, false, datalink);
+}
 
+/**
+ * \brief Adds a packet of the given flow type to the flow stats
+ */
+static inline void
+count_flow_stats(tcpreplay_t *ctx, flow_entry_type_t res)
+{
     switch (res) {
     case FLOW_ENTRY_NEW:
         ++ctx->stats.flows;
         ++ctx->stats.flows_unique;
         ++ctx->stats.flow_packets;
-        if (sp) {
-            ++sp->flows;
-            ++sp->flows_unique;
-            ++sp->flow_packets;
-        }
         break;
 
     case FLOW_ENTRY_EXISTING:
         ++ctx->stats.flow_packets;
-        if (sp)
-            ++sp->flow_packets;
         break;
 
     case FLOW_ENTRY_EXPIRED:
         ++ctx->stats.flows_expired;
         ++ctx->stats.flows;
         ++ctx->stats.flow_packets;
-        if (sp) {
-            ++sp->flows_expired;
-            ++sp->flows;
-            ++sp->flow_packets;
-        }
-         break;
+        break;
 
     case FLOW_ENTRY_NON_IP:
         ++ctx->stats.flow_non_flow_packets;
-        if (sp)
-            ++sp->flow_non_flow_packets;
         break;
 
     case FLOW_ENTRY_INVALID:
         ++ctx->stats.flows_invalid_packets;
-        if (sp)
-            ++sp->flows_invalid_packets;
         break;
     }
 }
+
 /**
- * \brief Preloads the memory cache for the given pcap file_idx 
+ * \brief Update the flow stats of one interface
+ */
+static inline void update_sp_flow_stats(sendpacket_t *sp, flow_entry_type_t res)
+{
+    switch (res) {
+    case FLOW_ENTRY_NEW:
+        ++sp->flows;
+        ++sp->flows_unique;
+        ++sp->flow_packets;
+        break;
+
+    case FLOW_ENTRY_EXISTING:
+        ++sp->flow_packets;
+        break;
+
+    case FLOW_ENTRY_EXPIRED:
+        ++sp->flows_expired;
+        ++sp->flows;
+        ++sp->flow_packets;
+        break;
+
+    case FLOW_ENTRY_NON_IP:
+        ++sp->flow_non_flow_packets;
+        break;
+
+    case FLOW_ENTRY_INVALID:
+        ++sp->flows_invalid_packets;
+        break;
+    }
+}
+
+/**
+ * flow_decode() of a cached packet, from the headers found as it was read
+ */
+static inline flow_entry_type_t
+cached_flow_decode(flow_hash_table_t *fht, const packet_cache_t *packet,
+        int datalink, int expiry, uint32_t *hash)
+{
+    if (packet->ip_ver == IP_VER_UNLOCATED)
+        return flow_decode(fht, &packet->pkthdr, packet->pktdata, datalink, expiry, hash);
+
+    return flow_decode_meta(fht, &packet->pkthdr, packet->pktdata, &packet->meta,
+            expiry, hash);
+}
+
+/**
+ * \brief Update flow stats
  *
- * Preloading can be used with or without --loop
+ * Finds out if flow is unique and updates stats.  The packet's flow_hash()
+ * is left in ctx->flow_hash so TX queue selection needn't hash it again.
+ * packet is the packet's cache entry while preloading, else NULL.
  */
-void
-preload_pcap_file(tcpreplay_t *ctx, int idx)
+static inline flow_entry_type_t update_flow_stats(tcpreplay_t *ctx, sendpacket_t *sp,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int datalink,
+        const packet_cache_t *packet)
+{
+    flow_entry_type_t res = packet != NULL ?
+            cached_flow_decode(ctx->flow_hash_table, packet, datalink,
+                    ctx->options->flow_expiry, &ctx->flow_hash) :
+            flow_decode(ctx->flow_hash_table, pkthdr, pktdata, datalink,
+                    ctx->options->flow_expiry, &ctx->flow_hash);
+
+    count_flow_stats(ctx, res);
+
+    if (sp)
+        update_sp_flow_stats(sp, res);
+
+    return res;
+}
+
+/**
+ * \brief Reads a file into its memory cache
+ *
+ * With flow stats, each packet's flow is counted as it is read when
+ * count is set.  Otherwise, if fht is given, the flows are only looked
+ * up in it, a table of this file alone, and preload_merge_flows() sorts
+ * out the rest.
+ */
+static void
+preload_read(tcpreplay_t *ctx, int idx, flow_hash_table_t *fht, bool count)
 {
     tcpreplay_opt_t *options = ctx->options;
-    char *path = options->sources[idx].filename;
+    tcpreplay_source_t *src = &options->sources[idx];
+    char *path = src->filename;
     pcap_t *pcap = NULL;
     char ebuf[PCAP_ERRBUF_SIZE];
     const u_char *pktdata = NULL;
     struct pcap_pkthdr pkthdr;
     packet_cache_t *cached_packet = NULL;
     packet_cache_t **prev_packet = &cached_packet;
-    COUNTER packetnum = 0;
+    file_cache_t *fc = &options->file_cache[idx];
+    bool image = options->preload_image && src->type == source_filename &&
+            strcmp(path, "-") != 0;
+    COUNTER i;
     int dlt;
 
-    /* close stdin if reading from it (needed for some OS's) */
-    if (strncmp(path, "-", 1) == 0)
-        if (close(1) == -1)
-            warnx("unable to close stdin: %s", strerror(errno));
+    if (image && preload_image_load(ctx, idx)) {
+        /* count the flows as reading the file would */
+        for (i = 0; i < fc->packet_cnt && options->flow_stats; i++) {
+            cached_packet = &fc->packet_cache[i];
+            if (count)
+                cached_packet->flow_type = update_flow_stats(ctx, NULL, &cached_packet->pkthdr,
+                        cached_packet->pktdata, fc->dlt, cached_packet);
+            else if (fht != NULL)
+                cached_packet->flow_type = cached_flow_decode(fht, cached_packet, fc->dlt, 0, NULL);
+        }
+
+        fc->cached = TRUE;
+        return;
+    }
 
-    if ((pcap = pcap_open_offline(path, ebuf)) == NULL)
+    if (src->type == source_shm) {
+        /* read until the producers finish */
+        dlt = options->file_cache[idx].dlt;
+    } else if (src->type == source_fd) {
+        if ((pcap = tcpr_pcap_fdopen_offline_nsec(src->fd, &src->fd_buf, ebuf)) == NULL)
+            errx(-1, "Error opening pcap stream %s: %s", path, ebuf);
+        src->fd_read = true;
+    } else if ((pcap = tcpr_pcap_open_offline_nsec(path, ebuf)) == NULL) {
         errx(-1, "Error opening pcap file: %s", ebuf);
+    }
+
+    if (pcap != NULL)
+        dlt = pcap_datalink(pcap);
+
+    if (options->mmap_pcap && src->type == source_filename && strncmp(path, "-", 1) != 0 &&
+            (options->sources[idx].mmap = pcap_mmap_open(path, ebuf)) == NULL)
+        dbgx(1, "Reading %s via libpcap: %s", path, ebuf);
+
+    reset_read_window(ctx, pcap, idx);
 
-    dlt = pcap_datalink(pcap);
     /* loop through the pcap.  get_next_packet() builds the cache for us! */
     while ((pktdata = get_next_packet(ctx, pcap, &pkthdr, idx, prev_packet)) != NULL) {
-        packetnum++;
-        if (options->flow_stats)
-            update_flow_stats(ctx, NULL, &pkthdr, pktdata, dlt);
+        /* --max-memory: preload_pcap_files() falls back to reading from disk */
+        if (options->max_memory && (ctx->preload_over ||
+                __atomic_load_n(&ctx->preload_bytes, __ATOMIC_RELAXED) > options->max_memory)) {
+            ctx->preload_over = true;
+            break;
+        }
+
+        /* remember the flow so replays needn't decode the packet again */
+        if (!options->flow_stats)
+            continue;
+
+        if (count)
+            cached_packet->flow_type = update_flow_stats(ctx, NULL, &pkthdr, pktdata, dlt,
+                    cached_packet);
+        else if (fht != NULL)
+            cached_packet->flow_type = cached_flow_decode(fht, cached_packet, dlt, 0, NULL);
     }
 
     /* mark this file as cached */
     options->file_cache[idx].cached = TRUE;
     options->file_cache[idx].dlt = dlt;
-    pcap_close(pcap);
+    if (options->file_cache[idx].dedup != NULL)
+        dbgx(1, "Preloaded " COUNTER_SPEC " packets of file #%d, " COUNTER_SPEC " unique",
+                options->file_cache[idx].packet_cnt, idx,
+                (COUNTER)options->file_cache[idx].dedup->used);
+    if (options->file_cache[idx].mmap == NULL)
+        pcap_mmap_close(options->sources[idx].mmap);
+    options->sources[idx].mmap = NULL;
+    if (pcap != NULL)
+        pcap_close(pcap);
+    safe_free(src->fd_buf);
+    src->fd_buf = NULL;
+
+    /* --max-memory cut the cache short, it goes back to disk */
+    if (image && !ctx->preload_over)
+        preload_image_write(ctx, idx);
 }
 
 /**
- * the main loop function for tcpreplay.  This is where we figure out
- * what to do with each packet
+ * \brief Preloads the memory cache for the given pcap file_idx 
+ *
+ * Preloading can be used with or without --loop
  */
 void
-send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+preload_pcap_file(tcpreplay_t *ctx, int idx)
+{
+    preload_read(ctx, idx, NULL, true);
+}
+
+/**
+ * \brief Moves the calling sending thread onto its --cpu and --rt-priority
+ *
+ * Sender id runs on the id'th CPU of the list; the main thread is 0.
+ */
+void
+send_packets_sched_sender(tcpreplay_t *ctx, int id)
 {
-    struct timeval print_delta, now;
     tcpreplay_opt_t *options = ctx->options;
-    COUNTER packetnum = ctx->stats.pkts_sent;
-    int limit_send = options->limit_send;
-    struct pcap_pkthdr pkthdr;
-    u_char *pktdata = NULL;
-    sendpacket_t *sp = ctx->intf1;
-    uint32_t pktlen;
-    packet_cache_t *cached_packet = NULL;
-    packet_cache_t **prev_packet = NULL;
+    cpu_list_t *cpus = options->sender_cpus;
+
+    if (cpus != NULL && cpu_sched_pin(cpus, id) < 0)
+        warnx("Unable to pin sender %d to CPU %d: %s", id,
+                cpus->cpus[id % cpus->cnt], strerror(errno));
+
+    if (options->rt_priority > 0 && cpu_sched_fifo(options->rt_priority) < 0)
+        warnx("Unable to run sender %d SCHED_FIFO: %s", id, strerror(errno));
+}
+
+/**
+ * \brief Moves the calling reader or preload thread onto --helper-cpu
+ *
+ * Threads start with the CPUs and scheduler of their creator, which may
+ * be a sender, so this also drops any SCHED_FIFO.
+ */
+void
+send_packets_sched_helper(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    if (options->helper_cpus != NULL && cpu_sched_pin(options->helper_cpus, -1) < 0)
+        warnx("Unable to pin helper thread: %s", strerror(errno));
+
+    if (options->rt_priority > 0 && cpu_sched_fifo(0) < 0)
+        warnx("Unable to drop SCHED_FIFO for helper thread: %s", strerror(errno));
+}
+
+#ifdef HAVE_LIBPTHREAD
+#define PRELOAD_THREADS_MAX 16
+
+/* files preload_pcap_files() hands out to its threads */
+typedef struct preload_pool_s {
+    tcpreplay_t *ctx;
+    int next;                       /* next file to claim */
+    int cnt;
+    flow_hash_table_t **fht;        /* per file, or NULL to count flows later */
+} preload_pool_t;
+
+static void *
+preload_thread(void *arg)
+{
+    preload_pool_t *pool = (preload_pool_t *)arg;
+    int idx;
+
+    send_packets_sched_helper(pool->ctx);
+
+    while ((idx = __sync_fetch_and_add(&pool->next, 1)) < pool->cnt)
+        preload_read(pool->ctx, idx, pool->fht ? pool->fht[idx] : NULL, false);
+
+    return NULL;
+}
+
+/**
+ * \brief Counts the flows of files preloaded side by side
+ *
+ * Each file's flows were looked up in a table of that file alone, so
+ * only the first packet of each of its flows may be wrong: the flow may
+ * have been seen in an earlier file.  Those are looked up again in the
+ * shared table, in file order, which also leaves every flow in it.
+ *
+ * --flow-expiry depends on the time of every earlier packet, and
+ * --flow-records on every packet of the flow, so then the files come
+ * without flow types and each packet is counted here, in order, just as
+ * a sequential preload would.
+ */
+static void
+preload_merge_flows(tcpreplay_t *ctx, int cnt, flow_hash_table_t **fht)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc;
+    packet_cache_t *packet;
+    COUNTER i;
+    int idx;
+
+    for (idx = 0; idx < cnt; idx++) {
+        fc = &options->file_cache[idx];
+
+        for (i = 0; i < fc->packet_cnt; i++) {
+            packet = &fc->packet_cache[i];
+
+            if (fht == NULL) {
+                packet->flow_type = update_flow_stats(ctx, NULL, &packet->pkthdr,
+                        packet->pktdata, fc->dlt, packet);
+                continue;
+            }
+
+            if (packet->flow_type == FLOW_ENTRY_NEW)
+                packet->flow_type = cached_flow_decode(ctx->flow_hash_table, packet,
+                        fc->dlt, 0, NULL);
+            count_flow_stats(ctx, packet->flow_type);
+        }
+
+        if (fht != NULL)
+            flow_hash_table_release(fht[idx]);
+    }
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/**
+ * \brief Reads the first cnt files into their caches
+ *
+ * Files are read side by side on up to one thread per CPU, each into its
+ * own packet arenas.  The flows are counted once all of them are in, so
+ * the flow stats come out the same as loading them one after another.
+ */
+static void
+preload_files(tcpreplay_t *ctx, int cnt)
+{
+#ifdef HAVE_LIBPTHREAD
+    tcpreplay_opt_t *options = ctx->options;
+    preload_pool_t pool;
+    pthread_t *threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, rcode, thread_cnt;
+
+    thread_cnt = cpus > PRELOAD_THREADS_MAX ? PRELOAD_THREADS_MAX : (int)cpus;
+    thread_cnt = min(thread_cnt, cnt);
+
+    /* STDIN can't be read alongside anything */
+    for (i = 0; i < cnt; i++) {
+        if (strncmp(options->sources[i].filename, "-", 1) == 0)
+            thread_cnt = 1;
+    }
+
+    if (thread_cnt > 1) {
+        memset(&pool, 0, sizeof(pool));
+        pool.ctx = ctx;
+        pool.cnt = cnt;
+        /* --flow-records needs every packet counted in the shared table */
+        if (options->flow_stats && !options->flow_expiry && !options->flow_records) {
+            pool.fht = safe_malloc(sizeof(flow_hash_table_t *) * cnt);
+            for (i = 0; i < cnt; i++)
+                pool.fht[i] = flow_hash_table_init(DEFAULT_FLOW_HASH_BUCKET_SIZE);
+        }
+
+        dbgx(1, "Preloading %d files on %d threads", cnt, thread_cnt);
+        threads = safe_malloc(sizeof(pthread_t) * thread_cnt);
+        for (i = 0; i < thread_cnt; i++) {
+            if ((rcode = pthread_create(&threads[i], NULL, preload_thread, &pool)) != 0)
+                errx(-1, "Unable to start preload thread: %s", strerror(rcode));
+        }
+
+        for (i = 0; i < thread_cnt; i++) {
+            if ((rcode = pthread_join(threads[i], NULL)) != 0)
+                errx(-1, "Unable to join preload thread: %s", strerror(rcode));
+        }
+
+        if (options->flow_stats && !ctx->preload_over) {
+            preload_merge_flows(ctx, cnt, pool.fht);
+        } else if (pool.fht != NULL) {
+            for (i = 0; i < cnt; i++)
+                flow_hash_table_release(pool.fht[i]);
+        }
+
+        safe_free(pool.fht);
+        safe_free(threads);
+        return;
+    }
+#endif
+
+    for (i = 0; i < cnt && !ctx->preload_over; i++)
+        preload_pcap_file(ctx, i);
+}
+
+/**
+ * \brief Preloads the first cnt files
+ *
+ * If the cache grows past --max-memory the preload is abandoned: the
+ * caches are freed and the files are replayed from disk, through a
+ * --preload-window of the budget where the replay allows one.  Options
+ * that need the cache make that an error instead.
+ */
+void
+preload_pcap_files(tcpreplay_t *ctx, int cnt)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    const char *needs = NULL;
+    int i;
+
+    preload_files(ctx, cnt);
+    if (!ctx->preload_over)
+        return;
+
+    for (i = 0; i < cnt; i++) {
+        if (strncmp(options->sources[i].filename, "-", 1) == 0)
+            needs = "reading STDIN";
+    }
+
+    if (options->control)
+        needs = "--control";
+    else if (options->prep_cidr != NULL || options->prep_services != NULL)
+        needs = "--prep";
+    else if (options->preload_dedup)
+        needs = "--preload-dedup";
+    else if (options->preload_snaplen > 0)
+        needs = "--preload-snaplen";
+    else if (options->queue_map != NULL)
+        needs = "--queue-map";
+    else if (options->workers > 1 || options->clients > 1)
+        needs = "--workers and --clients";
+    else if (options->flow_timing)
+        needs = "--flow-timing";
+
+    if (needs != NULL)
+        errx(-1, "Preload cache exceeded --max-memory of %zuMB and %s requires it",
+                options->max_memory / (1024 * 1024), needs);
+
+    for (i = 0; i < cnt; i++) {
+        packet_cache_free(&options->file_cache[i]);
+        options->file_cache[i].cached = FALSE;
+    }
+
+    options->preload_pcap = false;
+    options->preload_edit = false;
+    options->hugepage_size = 0;
+    ctx->preload_bytes = 0;
+    ctx->preload_over = false;
+
+    /* the flows are counted again as they are read from disk */
+    if (options->flow_stats) {
+        flow_hash_table_records(ctx->flow_hash_table, NULL);
+        flow_hash_table_reset(ctx->flow_hash_table);
+        flow_hash_table_records(ctx->flow_hash_table, ctx->flow_records);
+        ctx->stats.flows = 0;
+        ctx->stats.flows_unique = 0;
+        ctx->stats.flow_packets = 0;
+        ctx->stats.flows_expired = 0;
+        ctx->stats.flows_invalid_packets = 0;
+        ctx->stats.flow_non_flow_packets = 0;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    /* the window reader walks the files one after another */
+    if (!options->dualfile && !options->merge) {
+        options->preload_window = options->max_memory;
+        options->pipeline = true;
+        warnx("Preload cache exceeded --max-memory of %zuMB, replaying through a preload window",
+                options->max_memory / (1024 * 1024));
+        return;
+    }
+#endif
+
+    warnx("Preload cache exceeded --max-memory of %zuMB, replaying from disk",
+            options->max_memory / (1024 * 1024));
+}
+
+/**
+ * Bytes held by the preload caches of every file
+ */
+COUNTER
+preload_memory(const tcpreplay_t *ctx)
+{
+    COUNTER bytes = 0;
+    int i;
+
+    for (i = 0; i < ctx->options->source_cnt; i++)
+        bytes += packet_cache_bytes(&ctx->options->file_cache[i]);
+
+    return bytes;
+}
+
+/**
+ * Whether prepare_next_packet() edits a preloaded packet of file idx in
+ * place in the given --loop pass
+ */
+static inline bool
+packet_edited_in_place(tcpreplay_t *ctx, int idx, uint32_t iteration)
+{
 #if defined TCPREPLAY && defined TCPREPLAY_EDIT
-    struct pcap_pkthdr *pkthdr_ptr;
+    if (ctx->tcpedit != NULL && !ctx->options->file_cache[idx].edited)
+        return true;
+#else
+    (void)idx;
+#endif
+
+    return ctx->options->unique_ip && iteration;
+}
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+/**
+ * The netmap slot or TX ring frame sp sends its next packet from, if
+ * tcpedit should edit a preloaded packet of file idx there (see
+ * sendpacket_slot()).  Copying the packet in is then the only copy made
+ * to edit and send it, and the cache is never edited.  The slot needs
+ * room for the packet to grow by a Layer 2 header or --fixlen padding.
+ */
+static inline u_char *
+edit_slot(tcpreplay_t *ctx, int idx, sendpacket_t *sp, const struct pcap_pkthdr *pkthdr)
+{
+    u_char *slot;
+    size_t room;
+
+    if (ctx->tcpedit == NULL || ctx->options->file_cache[idx].edited)
+        return NULL;
+
+#ifdef ENABLE_FRAGROUTE
+    /* the fragments would go out through the slot they're cut from */
+    if (ctx->frag_ctx != NULL)
+        return NULL;
 #endif
+
+    slot = sendpacket_slot(sp, &room);
+    if (slot == NULL || room < (size_t)max(pkthdr->caplen, pkthdr->len) + TCPEDIT_HEADROOM)
+        return NULL;
+
+    return slot;
+}
+#endif
+
+/**
+ * \brief Fetches the next packet send_packets() should send
+ *
+ * Reads the packet, honours --limit, picks the interface for it and
+ * applies every edit.  Packets the tcpprep cache says not to send are
+ * skipped.  Returns the packet data, or NULL once there is nothing left
+ * to send.  iteration is the --loop pass the packet is sent in.  Each
+ * step is charged to clk when it is timing this packet; the --pipeline
+ * reader passes NULL.
+ */
+static u_char *
+prepare_next_packet(tcpreplay_t *ctx, pcap_t *pcap, int idx,
+        packet_cache_t **prev_packet, struct pcap_pkthdr *pkthdr,
+        COUNTER *packetnum, sendpacket_t **sp, uint32_t *pktlen,
+        uint32_t iteration, stage_clock_t *clk)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int limit_send = options->limit_send;
     int datalink = options->file_cache[idx].dlt;
-    COUNTER skip_length = 0;
-    COUNTER start_us;
-    uint32_t iteration = ctx->iteration;
-    bool unique_ip = options->unique_ip;
     bool preload = options->file_cache[idx].cached;
-    bool do_not_timestamp = options->speed.mode == speed_topspeed ||
-            (options->speed.mode == speed_mbpsrate && !options->speed.speed);
-
-    init_timestamp(&ctx->stats.end_time);
-    start_us = TIMEVAL_TO_MICROSEC(&ctx->stats.start_time);
+    const packet_desc_t *desc = NULL, *d = NULL;
+    u_char *pktdata;
+    bool copied;
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    struct pcap_pkthdr *pkthdr_ptr;
+    u_char *slot;
+    bool tcpedit = ctx->tcpedit != NULL;
+#else
+    bool tcpedit = false;
+#endif
 
-    if (options->preload_pcap) {
-        prev_packet = &cached_packet;
-    } else {
-        prev_packet = NULL;
-    }
+    if (preload && prev_packet != NULL)
+        desc = options->file_cache[idx].desc;
 
-    /* MAIN LOOP 
-     * Keep sending while we have packets or until
-     * we've sent enough packets
-     */
-    while ((pktdata = get_next_packet(ctx, pcap, &pkthdr, idx, prev_packet)) != NULL) {
-        /* die? */
-        if (ctx->abort)
-            return;
+    while ((pktdata = get_next_packet(ctx, pcap, pkthdr, idx, prev_packet)) != NULL) {
+        stage_mark(ctx, clk, STAGE_READ);
 
         /* stop sending based on the limit -L? */
-        packetnum++;
-        if (limit_send > 0 && packetnum > (COUNTER)limit_send)
-            break;
+        (*packetnum)++;
+        if (limit_send > 0 && *packetnum > (COUNTER)limit_send)
+            return NULL;
+
+        if (desc != NULL) {
+            /* --control partition: the other flows go out of other nodes */
+            if (ctx->partition_cnt &&
+                    (*prev_packet)->flow_hash % ctx->partition_cnt != ctx->partition_idx)
+                continue;
 
+            /* preloaded: desc_compile() has the length and interface */
+            d = &desc[*prev_packet - options->file_cache[idx].packet_cache];
+            *pktlen = d->len;
+        } else {
 #if defined TCPREPLAY || defined TCPREPLAY_EDIT
-        /* do we use the snaplen (caplen) or the "actual" packet len? */
-        pktlen = options->use_pkthdr_len ? pkthdr.len : pkthdr.caplen;
+            /* do we use the snaplen (caplen) or the "actual" packet len? */
+            *pktlen = options->use_pkthdr_len ? pkthdr->len : pkthdr->caplen;
 #elif TCPBRIDGE
-        pktlen = pkthdr.caplen;
+            *pktlen = pkthdr->caplen;
 #else
 #error WTF???  We should not be here!
 #endif
+        }
 
-        dbgx(2, "packet " COUNTER_SPEC " caplen %d", packetnum, pktlen);
+        dbgx(2, "packet " COUNTER_SPEC " caplen %d", *packetnum, *pktlen);
+        TCPR_PROBE2(packet_read, *packetnum, *pktlen);
 
         /* Dual nic processing */
-        if (ctx->intf2 != NULL) {
+        if (d != NULL && ctx->intf2 != NULL) {
+            if (d->skip)
+                continue;
+            *sp = d->intf ? ctx->intf2 : ctx->intf1;
+        } else if (ctx->intf2 != NULL && options->pcapng_intf) {
+            *sp = options->sources[idx].pkt_iface == 0 ? ctx->intf1 : ctx->intf2;
+        } else if (ctx->intf2 != NULL) {
 
-            sp = (sendpacket_t *) cache_mode(ctx, options->cachedata, packetnum);
+            *sp = (sendpacket_t *) cache_mode(ctx, options->cachedata, *packetnum);
 
             /* sometimes we should not send the packet */
-            if (sp == TCPR_DIR_NOSEND)
+            if (*sp == TCPR_DIR_NOSEND)
                 continue;
         }
 
+        /* --preload-dedup: other packets use this data, edit a copy */
+        copied = preload && prev_packet != NULL && (*prev_packet)->shared &&
+                packet_edited_in_place(ctx, idx, iteration);
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        /* edit a copy in the TX slot, which sendpacket() then needn't copy */
+        if (preload && prev_packet != NULL &&
+                (slot = edit_slot(ctx, idx, *sp, pkthdr)) != NULL) {
+            memcpy(slot, pktdata, pkthdr->caplen);
+            pktdata = slot;
+            copied = true;
+        } else
+#endif
+        if (copied)
+            pktdata = dedup_copy(ctx, *prev_packet);
+        else if (!preload && source_edit_copy(ctx, idx, tcpedit, tcpedit ||
+                    (options->unique_ip && iteration)))
+            pktdata = scratch_copy(ctx, pktdata, pkthdr->caplen);
+
 #if defined TCPREPLAY && defined TCPREPLAY_EDIT
-        pkthdr_ptr = &pkthdr;
-        if (tcpedit_packet(tcpedit, &pkthdr_ptr, &pktdata, sp->cache_dir) == -1) {
-            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
+        pkthdr_ptr = pkthdr;
+        if (ctx->tcpedit != NULL && !options->file_cache[idx].edited &&
+                !tcpedit_packet_unchanged(ctx->tcpedit, pkthdr, pktdata, (*sp)->cache_dir) &&
+                tcpedit_packet(ctx->tcpedit, &pkthdr_ptr, &pktdata, (*sp)->cache_dir) == -1) {
+            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", *packetnum, tcpedit_geterr(ctx->tcpedit));
         }
-        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
+        *pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
+        stage_mark(ctx, clk, STAGE_EDIT);
 #endif
 
         /* do we need to print the packet via tcpdump? */
 #ifdef ENABLE_VERBOSE
         if (options->verbose)
-            tcpdump_print(options->tcpdump, &pkthdr, pktdata);
+            tcpdump_print(options->tcpdump, pkthdr, pktdata);
 #endif
 
-        if (unique_ip && iteration)
+        if (options->unique_ip && iteration) {
             /* edit packet to ensure every pass is unique */
-            fast_edit_packet(&pkthdr, &pktdata, iteration,
-                    preload, datalink);
+            if (copied)
+                unique_ip_copy(ctx, *prev_packet, pkthdr, &pktdata, datalink);
+            else if (preload && prev_packet != NULL)
+                unique_ip_cached(*prev_packet, pkthdr, &pktdata, iteration, datalink);
+            else
+                fast_edit_packet(pkthdr, &pktdata, iteration, preload, datalink);
+            stage_mark(ctx, clk, STAGE_UNIQUE_IP);
+        }
 
         /* update flow stats */
         if (options->flow_stats && !preload)
             update_flow_stats(ctx,
-                    options->cache_packets ? sp : NULL, &pkthdr, pktdata, datalink);
+                    options->cache_packets ? *sp : NULL, pkthdr, pktdata, datalink, NULL);
+        else if (options->flow_stats && options->cache_packets && prev_packet &&
+                !options->file_cache[idx].replayed)
+            /* preloading counted the flows, the interfaces weren't known yet */
+            update_sp_flow_stats(*sp, (*prev_packet)->flow_type);
 
-        /*
-         * we have to cast the ts, since OpenBSD sucks
-         * had to be special and use bpf_timeval.
-         * Only sleep if we're not in top speed mode (-t)
-         */
+        if (options->flow_stats)
+            stage_mark(ctx, clk, STAGE_FLOW);
 
-        if (!do_not_timestamp) {
-            /*
-             * this accelerator improves performance by avoiding expensive
-             * time stamps during periods where we have fallen behind in our
-             * sending
-             */
-            if (skip_length) {
-                if ((COUNTER)pktlen < skip_length &&
-                        !((options->limit_send > 0 &&
-                                (ctx->stats.pkts_sent + skip_length) >= options->limit_send))) {
-                    skip_length -= pktlen;
-                    goto SEND_NOW;
-                }
+        TCPR_PROBE2(packet_edited, *packetnum, *pktlen);
+        return pktdata;
+    }
 
-                get_packet_timestamp(&ctx->stats.end_time);
-                skip_length = 0;
-            }
+    return NULL;
+}
 
-            do_sleep(ctx, (struct timeval *)&pkthdr.ts, &ctx->stats.last_time, pktlen, options->accurate, sp, packetnum,
-                    &ctx->stats.end_time, &start_us, &skip_length);
-        }
+#ifdef HAVE_LIBPTHREAD
+/**
+ * \brief Starts a --pipeline reader thread for send_packets()
+ *
+ * The reader runs prepare_next_packet() and copies every packet into the
+ * data ring, so disk I/O, decompression and tcpedit never hold up the
+ * sender.  packetnum is the packet count the reader starts from.  With
+ * a NULL pcap it is the --preload-window reader, which opens the files
+ * itself starting at idx and keeps going through every --loop pass.
+ */
+static pipeline_t *
+pipeline_start(tcpreplay_t *ctx, pcap_t *pcap, int idx, COUNTER packetnum,
+        size_t data_size)
+{
+    pipeline_t *pipeline;
+    int rcode;
+
+    pipeline = safe_malloc(sizeof(pipeline_t));
+    pipeline->ctx = ctx;
+    pipeline->pcap = pcap;
+    pipeline->idx = idx;
+    pipeline->iteration = ctx->iteration;
+    pipeline->packetnum = packetnum;
+    pipeline->sp = ctx->intf1;
+    pipeline->data_size = data_size;
+    pipeline->data = safe_malloc(data_size);
+
+    /* enough slots for the ring to hold 512 byte packets */
+    pipeline->slots = PIPELINE_SLOTS;
+    while ((size_t)pipeline->slots * 512 < data_size && pipeline->slots < (1U << 24))
+        pipeline->slots <<= 1;
+    pipeline->desc = safe_malloc(sizeof(pipeline_desc_t) * pipeline->slots);
+
+    if ((rcode = pthread_create(&pipeline->thread, NULL, pipeline_reader, pipeline)) != 0)
+        errx(-1, "Unable to start --pipeline reader: %s", strerror(rcode));
+
+    return pipeline;
+}
 
-SEND_NOW:
-        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+/**
+ * \brief Stops the reader thread and frees the pipeline
+ */
+static void
+pipeline_stop(pipeline_t *pipeline)
+{
+    int rcode;
 
-        /* write packet out on network */
-        if (sendpacket(sp, pktdata, pktlen, &pkthdr) < (int)pktlen)
-            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+    __atomic_store_n(&pipeline->stop, true, __ATOMIC_RELEASE);
+    if ((rcode = pthread_join(pipeline->thread, NULL)) != 0)
+        errx(-1, "Unable to join --pipeline reader: %s", strerror(rcode));
 
-        /* mark the time when we sent the last packet */
-        if (!do_not_timestamp && !skip_length)
-            get_packet_timestamp(&ctx->stats.end_time);
+    safe_free(pipeline->desc);
+    safe_free(pipeline->data);
+    safe_free(pipeline);
+}
 
-#ifdef TIMESTAMP_TRACE
-        add_timestamp_trace_entry(pktlen, &ctx->stats.end_time, skip_length);
-#endif
-        /*
-         * track the time of the "last packet sent".  Again, because of OpenBSD
-         * we have to do a memcpy rather then assignment.
-         *
-         * A number of 3rd party tools generate bad timestamps which go backwards
-         * in time.  Hence, don't update the "last" unless pkthdr.ts > last
-         */
-        if (!do_not_timestamp && timercmp(&ctx->stats.last_time, &pkthdr.ts, <)) 
-            memcpy(&ctx->stats.last_time, &pkthdr.ts, sizeof(struct timeval));
-        ctx->stats.pkts_sent ++;
-        ctx->stats.bytes_sent += pktlen;
+/**
+ * \brief Stops the --preload-window reader, if it was started
+ */
+void
+send_packets_window_stop(tcpreplay_t *ctx)
+{
+    if (ctx->window == NULL)
+        return;
 
-        /* print stats during the run? */
-        if (!skip_length && options->stats > 0) {
-            if (gettimeofday(&now, NULL) < 0)
-                errx(-1, "gettimeofday() failed: %s",  strerror(errno));
+    pipeline_stop(ctx->window);
+    ctx->window = NULL;
+}
 
-            if (! timerisset(&ctx->stats.last_print)) {
-                memcpy(&ctx->stats.last_print, &now, sizeof(ctx->stats.last_print));
-            } else {
-                timersub(&now, &ctx->stats.last_print, &print_delta);
-                if (print_delta.tv_sec >= options->stats) {
-                    memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
-                    packet_stats(&ctx->stats);
-                    memcpy(&ctx->stats.last_print, &now, sizeof(ctx->stats.last_print));
+/**
+ * \brief Queues one packet, or the end of a file, for the sender
+ *
+ * Packet data lives in a byte ring.  The oldest packet in flight marks
+ * where the sender still needs data; the reader only writes in front of
+ * it, wrapping to the start of the ring when a packet doesn't fit at the
+ * end.  The reader naps while the ring is full, it isn't timing critical.
+ * Returns false if the reader should give up.
+ */
+static bool
+pipeline_push(pipeline_t *pipeline, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t pktlen, bool eof)
+{
+    tcpreplay_t *ctx = pipeline->ctx;
+    struct timespec nap = { 0, PIPELINE_NAP_NSEC };
+    pipeline_desc_t *desc;
+    uint32_t head, tail;
+    size_t len, busy;
+
+    /* packets sent by their length need room beyond the capture */
+    len = eof ? 0 : (max(pktlen, pkthdr->caplen) + 7) & ~(size_t)7;
+    head = pipeline->head;
+
+    for (;;) {
+        if (ctx->abort || __atomic_load_n(&pipeline->stop, __ATOMIC_ACQUIRE))
+            return false;
+
+        tail = __atomic_load_n(&pipeline->tail, __ATOMIC_ACQUIRE);
+        if (head - tail < pipeline->slots) {
+            if (head == tail) {
+                /* ring is empty */
+                pipeline->offset = 0;
+                break;
+            }
+
+            busy = pipeline->desc[tail & (pipeline->slots - 1)].pktdata - pipeline->data;
+            if (pipeline->offset >= busy) {
+                if (pipeline->offset + len <= pipeline->data_size)
+                    break;
+                if (len < busy) {
+                    pipeline->offset = 0;
+                    break;
                 }
+            } else if (pipeline->offset + len < busy) {
+                break;
             }
         }
-    } /* while */
 
-    ++ctx->iteration;
+        nanosleep(&nap, NULL);
+    }
+
+    desc = &pipeline->desc[head & (pipeline->slots - 1)];
+    desc->pktdata = pipeline->data + pipeline->offset;
+    desc->eof = eof;
+    if (!eof) {
+        memcpy(&desc->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+        desc->pktlen = pktlen;
+        desc->ts_ns = PACKET_TS_NS(pkthdr, ctx->options->sources[pipeline->idx].pkt_nsec);
+        desc->packetnum = pipeline->packetnum;
+        desc->sp = pipeline->sp;
+        memcpy(desc->pktdata, pktdata, pkthdr->caplen);
+        pipeline->offset += len;
+    }
+
+    __atomic_store_n(&pipeline->head, head + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
 /**
- * the alternate main loop function for tcpreplay.  This is where we figure out
- * what to do with each packet when processing two files a the same time
+ * \brief Reads every file, then wraps for the next --loop pass
+ *
+ * The --preload-window reader owns the files it reads: each is opened
+ * here, read through the usual read window and mmap reader, and closed
+ * once its end is queued.  It runs until the sender stops it, --limit
+ * is reached or a file can't be opened again.
  */
-void
-send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int cache_file_idx1, pcap_t *pcap2, int cache_file_idx2)
+static void
+pipeline_window_read(pipeline_t *pipeline)
 {
-    struct timeval print_delta, now;
+    tcpreplay_t *ctx = pipeline->ctx;
     tcpreplay_opt_t *options = ctx->options;
-    COUNTER packetnum = ctx->stats.pkts_sent;
-    int limit_send = options->limit_send;
-    int cache_file_idx;
-    pcap_t *pcap;
-    struct pcap_pkthdr pkthdr1, pkthdr2;
-    u_char *pktdata1 = NULL, *pktdata2 = NULL, *pktdata = NULL;
-    sendpacket_t *sp = ctx->intf1;
+    tcpreplay_source_t *src;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata;
     uint32_t pktlen;
-    uint32_t iteration = ctx->iteration;
-    bool unique_ip = options->unique_ip;
-    packet_cache_t *cached_packet1 = NULL, *cached_packet2 = NULL;
-    packet_cache_t **prev_packet1 = NULL, **prev_packet2 = NULL, **prev_packet = NULL;
-    struct pcap_pkthdr *pkthdr_ptr;
-    int datalink = options->file_cache[cache_file_idx1].dlt;
-    COUNTER start_us;
-    COUNTER skip_length = 0;
-    bool do_not_timestamp = options->speed.mode == speed_topspeed ||
-            (options->speed.mode == speed_mbpsrate && !options->speed.speed);
+    pcap_t *pcap;
+    bool more;
+
+    for (;;) {
+        for (; pipeline->idx < options->source_cnt; pipeline->idx++) {
+            src = &options->sources[pipeline->idx];
+
+            /* STDIN, other streams and rings can only be read once */
+            if (src->type == source_shm) {
+                if (src->shm->done)
+                    return;
+                pcap = NULL;
+            } else if (src->type == source_fd) {
+                if (src->fd_read)
+                    return;
+                if ((pcap = tcpr_pcap_fdopen_offline_nsec(src->fd, &src->fd_buf, ebuf)) == NULL) {
+                    warnx("Error opening pcap stream %s: %s", src->filename, ebuf);
+                    return;
+                }
+                src->fd_read = true;
+            } else if ((pcap = tcpr_pcap_open_offline_nsec(src->filename, ebuf)) == NULL) {
+                warnx("Error opening pcap file: %s", ebuf);
+                return;
+            }
 
-    init_timestamp(&ctx->stats.end_time);
-    start_us = TIMEVAL_TO_MICROSEC(&ctx->stats.start_time);
+            if (pcap != NULL)
+                options->file_cache[pipeline->idx].dlt = pcap_datalink(pcap);
+            if (options->mmap_pcap && src->type == source_filename &&
+                    (src->mmap = pcap_mmap_open(src->filename, ebuf)) == NULL)
+                dbgx(1, "Reading %s via libpcap: %s", src->filename, ebuf);
+            reset_read_window(ctx, pcap, pipeline->idx);
+
+            more = true;
+            while (more && (pktdata = prepare_next_packet(ctx, pcap, pipeline->idx, NULL,
+                    &pkthdr, &pipeline->packetnum, &pipeline->sp, &pktlen,
+                    pipeline->iteration, NULL)) != NULL)
+                more = pipeline_push(pipeline, &pkthdr, pktdata, pktlen, false);
+
+            pcap_mmap_close(src->mmap);
+            src->mmap = NULL;
+            if (pcap != NULL)
+                pcap_close(pcap);
+            safe_free(src->fd_buf);
+            src->fd_buf = NULL;
+
+            if (!more || !pipeline_push(pipeline, NULL, NULL, 0, true))
+                return;
+
+            if (options->limit_send > 0 && pipeline->packetnum > (COUNTER)options->limit_send)
+                return;
+        }
 
-    if (options->preload_pcap) {
-        prev_packet1 = &cached_packet1;
-        prev_packet2 = &cached_packet2;
+        pipeline->idx = 0;
+        pipeline->iteration++;
+    }
+}
+
+/**
+ * \brief Main loop of the --pipeline reader thread
+ */
+static void *
+pipeline_reader(void *arg)
+{
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata;
+    uint32_t pktlen;
+
+    send_packets_sched_helper(pipeline->ctx);
+
+    if (pipeline->pcap == NULL) {
+        pipeline_window_read(pipeline);
     } else {
-        prev_packet1 = NULL;
-        prev_packet2 = NULL;
+        while ((pktdata = prepare_next_packet(pipeline->ctx, pipeline->pcap, pipeline->idx,
+                NULL, &pkthdr, &pipeline->packetnum, &pipeline->sp, &pktlen,
+                pipeline->iteration, NULL)) != NULL) {
+            if (!pipeline_push(pipeline, &pkthdr, pktdata, pktlen, false))
+                break;
+        }
     }
 
+    __atomic_store_n(&pipeline->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    pktdata1 = get_next_packet(ctx, pcap1, &pkthdr1, cache_file_idx1, prev_packet1);
-    pktdata2 = get_next_packet(ctx, pcap2, &pkthdr2, cache_file_idx2, prev_packet2);
+/**
+ * \brief Takes the next packet off the pipeline
+ *
+ * The packet returned by the previous call is given back to the reader,
+ * so its data must no longer be in use.  Spins while the reader is
+ * behind, there's no time to sleep when a packet is already due.
+ * Returns NULL once the reader is done, or when the --preload-window
+ * reader reached the end of the file being sent.
+ */
+static u_char *
+pipeline_pop(pipeline_t *pipeline, struct pcap_pkthdr *pkthdr,
+        COUNTER *ts_ns, COUNTER *packetnum, sendpacket_t **sp, uint32_t *pktlen)
+{
+    pipeline_desc_t *desc;
+    uint32_t tail = pipeline->tail;
 
-    /* MAIN LOOP 
-     * Keep sending while we have packets or until
-     * we've sent enough packets
-     */
-    while (! (pktdata1 == NULL && pktdata2 == NULL)) {
-        /* die? */
+    if (pipeline->popped) {
+        __atomic_store_n(&pipeline->tail, ++tail, __ATOMIC_RELEASE);
+        pipeline->popped = false;
+    }
+
+    while (__atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE) == tail) {
+        if (__atomic_load_n(&pipeline->done, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE) == tail)
+            return NULL;
+        if (pipeline->ctx->abort)
+            return NULL;
+        sched_yield();
+    }
+
+    desc = &pipeline->desc[tail & (pipeline->slots - 1)];
+    pipeline->popped = true;
+    if (desc->eof)
+        return NULL;
+
+    memcpy(pkthdr, &desc->pkthdr, sizeof(struct pcap_pkthdr));
+    *ts_ns = desc->ts_ns;
+    *packetnum = desc->packetnum;
+    *sp = desc->sp;
+    *pktlen = desc->pktlen;
+
+    return desc->pktdata;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/**
+ * \brief --prep: works out which interface a preloaded packet goes out
+ *
+ * The same tests as tcpprep's --cidr and --port modes.  Returns true for
+ * intf1, false for intf2, where anything that isn't IP (or TCP or UDP in
+ * port mode) goes.
+ */
+static bool
+prep_is_primary(tcpreplay_opt_t *options, const packet_cache_t *packet, int dlt)
+{
+    const u_char *pktdata = packet->pktdata;
+    const ipv4_hdr_t *ip_hdr;
+    const ipv6_hdr_t *ip6_hdr;
+    const tcp_hdr_t *tcp_hdr;
+    const udp_hdr_t *udp_hdr;
+    pkt_meta_t meta;
+    uint32_t caplen = packet->pkthdr.caplen;
+
+    if (get_pkt_meta(pktdata, caplen, dlt, &meta) < 0)
+        return false;
+
+    if (options->prep_cidr != NULL) {
+        if (meta.ip_ver == 4) {
+            ip_hdr = (const ipv4_hdr_t *)(pktdata + meta.l2len);
+            return check_ip_cidr(options->prep_cidr, ip_hdr->ip_src.s_addr);
+        }
+        if (meta.ip_ver == 6) {
+            ip6_hdr = (const ipv6_hdr_t *)(pktdata + meta.l2len);
+            return check_ip6_cidr(options->prep_cidr, &ip6_hdr->ip_src);
+        }
+        return false;
+    }
+
+    /* the destination port is in the first 4 bytes of TCP and UDP */
+    if (meta.l4off == 0 || meta.l4off + 4 > caplen)
+        return false;
+
+    switch (meta.proto) {
+    case IPPROTO_TCP:
+        tcp_hdr = (const tcp_hdr_t *)(pktdata + meta.l4off);
+        return options->prep_services->tcp[ntohs(tcp_hdr->th_dport)] != 0;
+
+    case IPPROTO_UDP:
+        udp_hdr = (const udp_hdr_t *)(pktdata + meta.l4off);
+        return options->prep_services->udp[ntohs(udp_hdr->uh_dport)] != 0;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * \brief Resolves how each packet of a cached file is sent
+ *
+ * The send length, the interface, whether the tcpprep cache drops the
+ * packet and its capture delta don't change from one pass to the next,
+ * so prepare_next_packet() reads them here instead of working them out
+ * per packet.  Deltas are taken against the newest timestamp seen so
+ * far, the same way do_sleep() treats packets that go back in time.
+ * The interface follows the packet's place in its own file.
+ */
+static void
+desc_compile(tcpreplay_t *ctx, file_cache_t *fc)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    packet_cache_t *packet;
+    packet_desc_t *desc;
+    sendpacket_t *sp;
+    COUNTER i, ts, last = 0;
+
+    if (fc->desc != NULL)
+        return;
+
+    fc->desc = safe_malloc(sizeof(packet_desc_t) * (fc->packet_cnt + 1));
+
+    for (i = 0; i < fc->packet_cnt; i++) {
+        packet = &fc->packet_cache[i];
+        desc = &fc->desc[i];
+
+        desc->len = options->use_pkthdr_len ? packet->pkthdr.len : packet->pkthdr.caplen;
+
+        ts = PACKET_TS_NS(&packet->pkthdr, packet->ts_nsec);
+        if (i > 0 && ts > last)
+            desc->delta_ns = ts - last;
+        else if (i > 0 && ts < last)
+            warnx("Packet #" COUNTER_SPEC " has gone back in time!", i + 1);
+
+        if (last < ts)
+            last = ts;
+
+        if (ctx->intf2 == NULL)
+            continue;
+
+        if (options->pcapng_intf) {
+            desc->intf = packet->iface != 0;
+            continue;
+        }
+
+        if (options->prep_cidr != NULL || options->prep_services != NULL) {
+            desc->intf = !prep_is_primary(options, packet, fc->dlt);
+            continue;
+        }
+
+        sp = (sendpacket_t *)cache_mode(ctx, options->cachedata, i + 1);
+        if (sp == NULL)
+            errx(-1, "Packet #" COUNTER_SPEC ": %s", i + 1, tcpreplay_geterr(ctx));
+
+        if (sp == TCPR_DIR_NOSEND)
+            desc->skip = 1;
+        else
+            desc->intf = sp == ctx->intf2;
+    }
+
+    dbgx(1, "Compiled " COUNTER_SPEC " send descriptors for file #%d", fc->packet_cnt, fc->index);
+}
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+/**
+ * \brief --preload-edit: runs tcpedit over a cached file once
+ *
+ * Each packet is edited for the interface desc_compile() picked, and the
+ * result replaces it in the cache, in place unless the edit made it
+ * longer than the space it had.  The send lengths and the addresses
+ * --unique-ip moves follow the edited packets.
+ */
+static void
+cache_edit(tcpreplay_t *ctx, file_cache_t *fc)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int dlt = tcpedit_get_output_dlt(ctx->tcpedit);
+    struct pcap_pkthdr *pkthdr;
+    packet_cache_t *packet;
+    packet_desc_t *desc;
+    edit_scratch_t scratch;
+    sendpacket_t *sp;
+    u_char *pktdata;
+    COUNTER i;
+
+    memset(&scratch, 0, sizeof(scratch));
+
+    for (i = 0; i < fc->packet_cnt; i++) {
+        packet = &fc->packet_cache[i];
+        desc = &fc->desc[i];
+        if (desc->skip)
+            continue;
+
+        sp = desc->intf ? ctx->intf2 : ctx->intf1;
+        pktdata = edit_scratch_copy(&scratch, packet);
+        pkthdr = &scratch.pkthdr;
+        if (tcpedit_packet_headroom(ctx->tcpedit, &pkthdr, &pktdata, sp->cache_dir,
+                EDIT_SCRATCH_HEADROOM) == -1)
+            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", i + 1,
+                    tcpedit_geterr(ctx->tcpedit));
+
+        if (options->preload_dedup) {
+            /* identical packets usually edit alike, share them again */
+            packet->shared = 0;
+            dedup_store(ctx, fc, i, pktdata, pkthdr->caplen);
+        } else {
+            /* packet_cache_add() left packet_room() */
+            if (pkthdr->caplen > packet_room(ctx, &packet->pkthdr))
+                packet->pktdata = packet_arena_alloc(ctx, fc, pkthdr->caplen);
+
+            memcpy(packet->pktdata, pktdata, pkthdr->caplen);
+        }
+        memcpy(&packet->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+        desc->len = options->use_pkthdr_len ? pkthdr->len : pkthdr->caplen;
+
+        packet->ip_addr_off = 0;
+        if (get_pkt_meta(packet->pktdata, pkthdr->caplen, dlt, &packet->meta) < 0)
+            packet->ip_ver = IP_VER_UNLOCATED;
+        else
+            packet->ip_ver = unique_ip_locate(pkthdr, &packet->meta, &packet->ip_addr_off);
+    }
+
+    safe_free(scratch.data);
+    fc->edited = true;
+    dbgx(1, "Edited " COUNTER_SPEC " cached packets of file #%d", fc->packet_cnt, fc->index);
+}
+#endif
+
+/**
+ * \brief Precomputes the --multiplier nap before each packet of a cached file
+ *
+ * Walking the array replaces a float divide per packet.  Each nap is the
+ * difference of two scaled offsets from the first packet, so rounding
+ * doesn't add up over the file however large the multiplier.  The first
+ * nap is the loop gap, taken when the file follows a pass before it.
+ */
+static void
+schedule_compile(tcpreplay_t *ctx, file_cache_t *fc)
+{
+    float multiplier = ctx->options->speed.multiplier;
+    int64_t loop_gap_ns = ctx->options->loop_gap_ns;
+    uint64_t ts = 0, scaled, last = 0;
+    COUNTER i;
+
+    if (fc->schedule != NULL && fc->schedule_multiplier == multiplier)
+        return;
+
+    safe_free(fc->schedule);
+    fc->schedule = safe_malloc(sizeof(uint64_t) * (fc->packet_cnt + 1));
+    fc->schedule_multiplier = multiplier;
+
+    for (i = 0; i < fc->packet_cnt; i++) {
+        ts += fc->desc[i].delta_ns;
+        scaled = (uint64_t)((double)ts / multiplier);
+        fc->schedule[i] = scaled - last;
+        last = scaled;
+    }
+
+    if (loop_gap_ns < 0)
+        loop_gap_ns = fc->packet_cnt > 1 ? ts / (fc->packet_cnt - 1) : 0;
+    fc->schedule[0] = (uint64_t)((double)loop_gap_ns / multiplier);
+
+    dbgx(1, "Compiled " COUNTER_SPEC " entry send schedule for file #%d", fc->packet_cnt, fc->index);
+}
+
+/**
+ * \brief Starts the timeline of a file or --loop pass
+ *
+ * After a complete pass the pacers carry on where they were, so the first
+ * packet goes out the loop gap after the last one rather than right away
+ * or a whole capture later, see pass_end().
+ */
+static void
+pass_begin(tcpreplay_t *ctx)
+{
+    init_timestamp(&ctx->stats.end_time);
+    ctx->pass_pkts = 0;
+    if (ctx->loop_wrap)
+        return;
+
+    ctx->abs_deadline = 0;
+    ctx->mult_start_ns = 0;
+    memset(&ctx->pacer, 0, sizeof(ctx->pacer));
+    ctx->timing_last_ns = 0;
+    ctx->timing_due_ns = 0;
+    ctx->wire_restart = true;
+}
+
+/**
+ * \brief Ends a file or --loop pass
+ *
+ * The capture time between its last packet and the first of the next pass
+ * is --loop-gap, or by default the mean gap between the packets of this one.
+ */
+static void
+pass_end(tcpreplay_t *ctx)
+{
+    int64_t loop_gap_ns = ctx->options->loop_gap_ns;
+    COUNTER pkts = ctx->pass_pkts;
+
+    ctx->loop_wrap = !ctx->abort && pkts > 0;
+    if (loop_gap_ns < 0)
+        loop_gap_ns = pkts > 1 ? (ctx->stats.last_ts_ns - ctx->pass_first_ns) / (pkts - 1) : 0;
+    ctx->loop_gap_ns = loop_gap_ns;
+}
+
+#ifdef ENABLE_FRAGROUTE
+/* --fragroute: a fragment that is sent once it is due */
+typedef struct frag_delayed_s {
+    uint64_t due_ns;            /* CLOCK_MONOTONIC */
+    sendpacket_t *sp;
+    struct pcap_pkthdr pkthdr;
+    u_char *data;
+} frag_delayed_t;
+
+/**
+ * Whether --fragroute applies to a packet going out sp: IPv4 and IPv6
+ * packets in the --fragdir direction.  Fills in meta for fragroute.
+ */
+static inline bool
+fragroute_wanted(tcpreplay_t *ctx, sendpacket_t *sp, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, pkt_meta_t *meta)
+{
+    int dir = ctx->options->fragroute_dir;
+
+    if ((dir == FRAGROUTE_DIR_C2S && sp != ctx->intf1) ||
+            (dir == FRAGROUTE_DIR_S2C && sp != ctx->intf2))
+        return false;
+
+    if (get_pkt_meta(pktdata, pkthdr->caplen, DLT_EN10MB, meta) < 0)
+        return false;
+
+    return meta->ip_ver == 4 || meta->ip_ver == 6;
+}
+
+/**
+ * Sends the fragments which are due, or all of them when wait is set,
+ * sleeping until each one is.
+ */
+static void
+fragroute_flush(tcpreplay_t *ctx, bool wait)
+{
+    frag_delayed_t *frag;
+    struct timespec now;
+    struct iovec iov;
+    unsigned int cnt;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < ctx->frag_delayed_cnt; i++) {
+        frag = &ctx->frag_delayed[i];
+        if (frag->due_ns > TIMESPEC_TO_NANOSEC(&now)) {
+            if (!wait)
+                break;
+            absolute_sleep(frag->due_ns, &ctx->sleep_spin_nsec);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        }
+
+        iov.iov_base = frag->data;
+        iov.iov_len = frag->pkthdr.caplen;
+        cnt = 1;
+        send_packet_batch(ctx, frag->sp, &iov, &frag->pkthdr, &cnt);
+        safe_free(frag->data);
+    }
+
+    ctx->frag_delayed_cnt -= i;
+    memmove(ctx->frag_delayed, ctx->frag_delayed + i,
+            sizeof(frag_delayed_t) * ctx->frag_delayed_cnt);
+}
+
+/* drops the fragments that weren't sent, after an abort */
+static void
+fragroute_discard(tcpreplay_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->frag_delayed_cnt; i++)
+        safe_free(ctx->frag_delayed[i].data);
+    ctx->frag_delayed_cnt = 0;
+}
+
+/* keeps a copy of a fragment to send delay_ns from now */
+static void
+fragroute_delay(tcpreplay_t *ctx, sendpacket_t *sp, const struct pcap_pkthdr *pkthdr,
+        const fragroute_frag_t *frag, uint64_t due_ns)
+{
+    frag_delayed_t *delayed;
+    int i;
+
+    if (ctx->frag_delayed_cnt == ctx->frag_delayed_alloc) {
+        ctx->frag_delayed_alloc = ctx->frag_delayed_alloc ? ctx->frag_delayed_alloc * 2 : 64;
+        ctx->frag_delayed = safe_realloc(ctx->frag_delayed,
+                sizeof(frag_delayed_t) * ctx->frag_delayed_alloc);
+    }
+
+    /* soonest first, in the order fragroute made them when due together */
+    for (i = ctx->frag_delayed_cnt; i > 0 && ctx->frag_delayed[i - 1].due_ns > due_ns; i--)
+        ;
+    memmove(ctx->frag_delayed + i + 1, ctx->frag_delayed + i,
+            sizeof(frag_delayed_t) * (ctx->frag_delayed_cnt - i));
+    ctx->frag_delayed_cnt++;
+
+    delayed = &ctx->frag_delayed[i];
+    delayed->due_ns = due_ns;
+    delayed->sp = sp;
+    memcpy(&delayed->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+    delayed->pkthdr.caplen = delayed->pkthdr.len = frag->len;
+    delayed->data = safe_malloc(frag->len);
+    memcpy(delayed->data, frag->data, frag->len);
+}
+
+/**
+ * \brief Sends a packet as the fragments the --fragroute rules make of it
+ *
+ * Fragments without a delay go out in one sendpacket_batch() call, the
+ * others are queued for fragroute_flush().  Each fragment keeps the
+ * timestamp of the packet.  A packet fragroute can't handle is sent as
+ * it is.
+ */
+static void
+fragroute_send(tcpreplay_t *ctx, sendpacket_t *sp, const struct pcap_pkthdr *pkthdr,
+        u_char *pktdata, uint32_t pktlen, const pkt_meta_t *meta)
+{
+    struct iovec iov[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr hdrs[SENDPACKET_BATCH_MAX];
+    fragroute_frag_t *frags;
+    size_t len = pkthdr->caplen;
+    struct timespec now;
+    unsigned int cnt = 0;
+    int nfrags, i;
+
+    if ((nfrags = fragroute_process_batch(ctx->frag_ctx, &pktdata, &len, meta, 1, &frags)) < 0) {
+        warnx("Unable to fragroute packet, sending it as is: %s", ctx->frag_ctx->errbuf);
+        iov[0].iov_base = pktdata;
+        iov[0].iov_len = pktlen;
+        memcpy(&hdrs[0], pkthdr, sizeof(struct pcap_pkthdr));
+        cnt = 1;
+        send_packet_batch(ctx, sp, iov, hdrs, &cnt);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < nfrags; i++) {
+        if (timerisset(&frags[i].delay)) {
+            fragroute_delay(ctx, sp, pkthdr, &frags[i], TIMESPEC_TO_NANOSEC(&now) +
+                    TIMEVAL_TO_NANOSEC(&frags[i].delay));
+            continue;
+        }
+
+        iov[cnt].iov_base = frags[i].data;
+        iov[cnt].iov_len = frags[i].len;
+        memcpy(&hdrs[cnt], pkthdr, sizeof(struct pcap_pkthdr));
+        hdrs[cnt].caplen = hdrs[cnt].len = frags[i].len;
+        if (++cnt == SENDPACKET_BATCH_MAX)
+            send_packet_batch(ctx, sp, iov, hdrs, &cnt);
+    }
+
+    if (cnt)
+        send_packet_batch(ctx, sp, iov, hdrs, &cnt);
+
+    /* the ones ordered after the rest are due already */
+    if (ctx->frag_delayed_cnt)
+        fragroute_flush(ctx, false);
+}
+#endif /* ENABLE_FRAGROUTE */
+
+/**
+ * --segment: sends the segments tcp_segment() split the last packet into,
+ * each with the timestamp of the packet
+ */
+static void
+segment_send(tcpreplay_t *ctx, sendpacket_t *sp, const struct pcap_pkthdr *pkthdr)
+{
+    struct iovec iov[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr hdrs[SENDPACKET_BATCH_MAX];
+    tcp_segment_t *seg = &ctx->segs;
+    unsigned int cnt = 0;
+    int i;
+
+    for (i = 0; i < seg->cnt; i++) {
+        iov[cnt].iov_base = seg->data[i];
+        iov[cnt].iov_len = seg->len[i];
+        memcpy(&hdrs[cnt], pkthdr, sizeof(struct pcap_pkthdr));
+        hdrs[cnt].caplen = hdrs[cnt].len = seg->len[i];
+        if (++cnt == SENDPACKET_BATCH_MAX)
+            send_packet_batch(ctx, sp, iov, hdrs, &cnt);
+    }
+
+    if (cnt)
+        send_packet_batch(ctx, sp, iov, hdrs, &cnt);
+}
+
+/*
+ * Preloaded top speed replays without any option that needs a look at
+ * every packet are sent by a send_loop() made for the options in use.
+ */
+#define SEND_LOOP_BATCH     0x1     /* --batch-size */
+#define SEND_LOOP_UNIQUE_IP 0x2     /* --unique-ip, after the first pass */
+#define SEND_LOOP_TICKS     0x4     /* --stats, --timeline, progress and the like */
+#define SEND_LOOP_LIMIT     0x8     /* --limit */
+#define SEND_LOOP_VARIANTS  16
+
+/* what send_packets() does between sends, at top speed */
+static inline void
+send_loop_ticks(tcpreplay_t *ctx)
+{
+    if (ctx->stats_export != NULL)
+        stats_export_tick(ctx, STATS_EXPORT_STRIDE);
+
+    if (ctx->options->stats > 0)
+        stats_print_tick(ctx);
+
+    if (ctx->timeline != NULL)
+        timeline_tick(ctx);
+
+    if (ctx->progress_cb != NULL)
+        progress_tick(ctx);
+
+    if (ctx->rate_profile != NULL)
+        rate_profile_tick(ctx);
+
+    /* a top speed replay has no rate, but can still be paused or switched */
+    if (ctx->ctl != NULL || ctx->suspend)
+        rate_tick(ctx);
+}
+
+/**
+ * \brief Sends the preloaded packets of file idx after last, or from the
+ * first if it is NULL, at top speed out intf1
+ *
+ * flags is a constant in each send_loop_N() below, so every variant keeps
+ * just the steps its options need.  Stops at the end of the cache, at
+ * --limit or on abort and returns the last packet it took, for
+ * send_packets() to carry on from.
+ */
+static inline __attribute__((always_inline)) packet_cache_t *
+send_loop(tcpreplay_t *ctx, int idx, packet_cache_t *last, struct iovec *iov,
+        struct pcap_pkthdr *hdrs, unsigned int batch_size, const unsigned int flags)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    packet_cache_t *packet = last == NULL ? fc->packet_cache : last + 1;
+    packet_cache_t *end = fc->packet_cache + fc->packet_cnt;
+    const packet_desc_t *desc = fc->desc;
+    sendpacket_t *sp = ctx->intf1;
+    COUNTER limit = options->limit_send;
+    struct pcap_pkthdr pkthdr, *hdr;
+    unsigned int cnt = 0;
+    u_char *pktdata;
+    uint32_t pktlen;
+
+    for (; packet < end; packet++) {
         if (ctx->abort)
-            return;
+            break;
 
-        /* stop sending based on the limit -L? */
-        packetnum++;
-        if (limit_send > 0 && packetnum > (COUNTER)limit_send)
+        if ((flags & SEND_LOOP_LIMIT) && ctx->stats.pkts_sent + cnt >= limit)
             break;
 
-        /* figure out which pcap file we need to process next 
-         * when get_next_packet() returns null for pktdata, the pkthdr 
-         * will still have the old values from the previous call.  This
-         * means we can't always trust the timestamps to tell us which
-         * file to process.
-         */
-        if (pktdata1 == NULL) {
-            /* file 2 is next */
-            sp = ctx->intf2;
-            datalink = options->file_cache[cache_file_idx2].dlt;
-            pcap = pcap2;
-            pkthdr_ptr = &pkthdr2;
-            prev_packet = prev_packet2;
-            cache_file_idx = cache_file_idx2;
-            pktdata = pktdata2;
-        } else if (pktdata2 == NULL) {
-            /* file 1 is next */
-            sp = ctx->intf1;
-            datalink = options->file_cache[cache_file_idx1].dlt;
-            pcap = pcap1;
-            pkthdr_ptr = &pkthdr1;
-            prev_packet = prev_packet1;
-            cache_file_idx = cache_file_idx1;
-            pktdata = pktdata1;
-        } else if (timercmp(&pkthdr1.ts, &pkthdr2.ts, <=)) {
-            /* file 1 is next */
-            sp = ctx->intf1;
-            datalink = options->file_cache[cache_file_idx1].dlt;
-            pcap = pcap1;
-            pkthdr_ptr = &pkthdr1;
-            prev_packet = prev_packet1;
-            cache_file_idx = cache_file_idx1;
-            pktdata = pktdata1;
+        preload_prefetch(ctx, fc, packet);
+        pktdata = packet->pktdata;
+        pktlen = desc[packet - fc->packet_cache].len;
+        hdr = &packet->pkthdr;
+        if (flags & SEND_LOOP_BATCH) {
+            memcpy(&hdrs[cnt], hdr, sizeof(struct pcap_pkthdr));
+            hdr = &hdrs[cnt];
+        } else if (flags & SEND_LOOP_UNIQUE_IP) {
+            memcpy(&pkthdr, hdr, sizeof(struct pcap_pkthdr));
+            hdr = &pkthdr;
+        }
+
+        if (flags & SEND_LOOP_UNIQUE_IP)
+            unique_ip_cached(packet, hdr, &pktdata, ctx->iteration, fc->dlt);
+
+        if (flags & SEND_LOOP_BATCH) {
+            iov[cnt].iov_base = pktdata;
+            iov[cnt].iov_len = pktlen;
+            if (++cnt < batch_size)
+                continue;
+
+            send_packet_batch(ctx, sp, iov, hdrs, &cnt);
         } else {
-            /* file 2 is next */
-            sp = ctx->intf2;
-            datalink = options->file_cache[cache_file_idx2].dlt;
-            pcap = pcap2;
-            pkthdr_ptr = &pkthdr2;
-            prev_packet = prev_packet2;
-            cache_file_idx = cache_file_idx2;
-            pktdata = pktdata2;
+            if (sendpacket(sp, pktdata, pktlen, hdr) < (int)pktlen)
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+
+            ctx->stats.pkts_sent ++;
+            ctx->stats.bytes_sent += pktlen;
+            TCPR_PROBE3(post_send, ctx->stats.pkts_sent, pktlen, 1);
         }
 
-#if defined TCPREPLAY || defined TCPREPLAY_EDIT
-        /* do we use the snaplen (caplen) or the "actual" packet len? */
-        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
-#elif TCPBRIDGE
-        pktlen = pkthdr_ptr->caplen;
+        if (flags & SEND_LOOP_TICKS)
+            send_loop_ticks(ctx);
+    }
+
+    if ((flags & SEND_LOOP_BATCH) && cnt && !ctx->abort)
+        send_packet_batch(ctx, sp, iov, hdrs, &cnt);
+
+    return packet == fc->packet_cache ? NULL : packet - 1;
+}
+
+typedef packet_cache_t *(*send_loop_fn)(tcpreplay_t *ctx, int idx, packet_cache_t *last,
+        struct iovec *iov, struct pcap_pkthdr *hdrs, unsigned int batch_size);
+
+#define SEND_LOOP_VARIANT(flags) \
+static packet_cache_t * \
+send_loop_##flags(tcpreplay_t *ctx, int idx, packet_cache_t *last, struct iovec *iov, \
+        struct pcap_pkthdr *hdrs, unsigned int batch_size) \
+{ \
+    return send_loop(ctx, idx, last, iov, hdrs, batch_size, flags); \
+}
+
+SEND_LOOP_VARIANT(0)
+SEND_LOOP_VARIANT(1)
+SEND_LOOP_VARIANT(2)
+SEND_LOOP_VARIANT(3)
+SEND_LOOP_VARIANT(4)
+SEND_LOOP_VARIANT(5)
+SEND_LOOP_VARIANT(6)
+SEND_LOOP_VARIANT(7)
+SEND_LOOP_VARIANT(8)
+SEND_LOOP_VARIANT(9)
+SEND_LOOP_VARIANT(10)
+SEND_LOOP_VARIANT(11)
+SEND_LOOP_VARIANT(12)
+SEND_LOOP_VARIANT(13)
+SEND_LOOP_VARIANT(14)
+SEND_LOOP_VARIANT(15)
+
+/* indexed by SEND_LOOP_* flags */
+static const send_loop_fn send_loops[SEND_LOOP_VARIANTS] = {
+    send_loop_0, send_loop_1, send_loop_2, send_loop_3,
+    send_loop_4, send_loop_5, send_loop_6, send_loop_7,
+    send_loop_8, send_loop_9, send_loop_10, send_loop_11,
+    send_loop_12, send_loop_13, send_loop_14, send_loop_15,
+};
+
+/**
+ * \brief Picks the send_loop() variant of a replay, or -1 for the general
+ * loop in send_packets()
+ *
+ * Only looks at what holds for every file, send_packets() checks the
+ * rest file by file.
+ */
+void
+send_loop_select(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int flags = 0;
+
+    ctx->send_loop = -1;
+
+    if (options->speed.mode != speed_topspeed &&
+            !(options->speed.mode == speed_mbpsrate && !options->speed.speed))
+        return;
+
+    if (ctx->intf2 != NULL || ctx->partition_cnt || ctx->fanout_intf_cnt ||
+            options->segment_mtu || options->stage_profile || ctx->measure != NULL)
+        return;
+
+#ifdef ENABLE_VERBOSE
+    if (options->verbose)
+        return;
+#endif
+#ifdef ENABLE_FRAGROUTE
+    if (ctx->frag_ctx != NULL)
+        return;
+#endif
+#ifdef HAVE_NETMAP
+    if (options->netmap_multiqueue)
+        return;
+#endif
+#ifdef TIMESTAMP_TRACE
+    /* every send is traced */
+    return;
+#endif
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    if (ctx->tcpedit != NULL)
+        return;
+#else
+    if (options->batch_size > 1)
+        flags |= SEND_LOOP_BATCH;
+#endif
+
+    if (options->limit_send > 0)
+        flags |= SEND_LOOP_LIMIT;
+
+    if (ctx->stats_export != NULL || options->stats > 0 || ctx->timeline != NULL ||
+            ctx->progress_cb != NULL || ctx->rate_profile != NULL || ctx->ctl != NULL)
+        flags |= SEND_LOOP_TICKS;
+
+    dbgx(1, "Using send loop variant %d", flags);
+    ctx->send_loop = flags;
+}
+
+/**
+ * the main loop function for tcpreplay.  This is where we figure out
+ * what to do with each packet
+ */
+void
+send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    COUNTER packetnum = ctx->stats.pkts_sent;
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata = NULL;
+    sendpacket_t *sp = ctx->intf1;
+    uint32_t pktlen;
+    packet_cache_t *cached_packet = NULL;
+    packet_cache_t **prev_packet = NULL;
+#ifdef HAVE_NETMAP
+    int datalink = options->file_cache[idx].dlt;
+    bool reuse_flow_hash = options->flow_stats && !options->file_cache[idx].cached;
+#endif
+    bool preload = options->file_cache[idx].cached;
+    file_cache_t *fc = &options->file_cache[idx];
+    const uint64_t *schedule = NULL;
+#ifdef HAVE_LIBPTHREAD
+    pipeline_t *pipeline = NULL;
+#endif
+    bool do_not_timestamp = options->speed.mode == speed_topspeed ||
+            (options->speed.mode == speed_mbpsrate && !options->speed.speed);
+    bool timing = !do_not_timestamp && options->speed.mode != speed_oneatatime;
+    struct iovec *batch_iov = NULL;
+    struct pcap_pkthdr *batch_pkthdr = NULL;
+    unsigned int batch_size = 0, batch_cnt = 0;
+    sendpacket_t *batch_sp = NULL;     /* interface the queued packets go out */
+    COUNTER ts_ns = 0;
+    stage_clock_t clk = { false, 0 };
+    int fan;
+    int seg_dlt = fc->dlt;
+#ifdef ENABLE_FRAGROUTE
+    bool fragroute = ctx->frag_ctx != NULL;
+    int frag_dlt = fc->dlt;
+    pkt_meta_t frag_meta;
+#endif
+
+    pass_begin(ctx);
+
+    if (options->preload_pcap || preload) {
+        prev_packet = &cached_packet;
+    } else {
+        prev_packet = NULL;
+    }
+
+    if (preload)
+        desc_compile(ctx, fc);
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    if (preload && ctx->tcpedit != NULL && options->preload_edit && !fc->edited)
+        cache_edit(ctx, fc);
+#endif
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    if (ctx->tcpedit != NULL)
+        seg_dlt = tcpedit_get_output_dlt(ctx->tcpedit);
+#endif
+
+#ifdef ENABLE_FRAGROUTE
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    if (ctx->tcpedit != NULL)
+        frag_dlt = tcpedit_get_output_dlt(ctx->tcpedit);
+#endif
+    if (fragroute && frag_dlt != DLT_EN10MB) {
+        warnx("fragroute only supports Ethernet, sending %s as is",
+                options->sources[idx].filename);
+        fragroute = false;
+    }
+#endif
+
+    /* cached timestamps don't change, so work out every nap up front */
+    if (preload && options->speed.mode == speed_multiplier && ctx->intf2 == NULL &&
+            !ctx->partition_cnt) {
+        schedule_compile(ctx, fc);
+        schedule = fc->schedule;
+    }
+
+#if !(defined TCPREPLAY && defined TCPREPLAY_EDIT)
+    /*
+     * packets can only be queued if their data stays put until the
+     * batch is sent, which is only true for the preload cache
+     */
+    if (preload) {
+        if (options->batch_size > 1 && do_not_timestamp)
+            batch_size = options->batch_size;
+        else if (options->speed.mode == speed_packetrate && options->speed.pps_multi > 1 &&
+                options->accurate != accurate_txtime)
+            /* every --pps-multi burst goes out together after one sleep */
+            batch_size = min(options->speed.pps_multi, SENDPACKET_BATCH_MAX);
+    }
+
+    if (batch_size) {
+        batch_iov = safe_malloc(sizeof(struct iovec) * batch_size);
+        batch_pkthdr = safe_malloc(sizeof(struct pcap_pkthdr) * batch_size);
+    }
+#endif
+
+#ifdef HAVE_LIBPTHREAD
+    /* read and edit packets on their own thread */
+    if (options->preload_window && !preload) {
+        /* the window carries on from the previous file or pass */
+        if (ctx->window == NULL)
+            ctx->window = pipeline_start(ctx, NULL, idx, packetnum, options->preload_window);
+        pipeline = ctx->window;
+    } else if (options->pipeline && !options->preload_pcap && !preload && pcap != NULL) {
+        /* a ring is a pipeline already */
+        pipeline = pipeline_start(ctx, pcap, idx, packetnum, PIPELINE_DATA_SIZE);
+    }
+#ifdef HAVE_NETMAP
+    /* flow stats run on the reader thread, so ctx->flow_hash isn't ours */
+    if (pipeline != NULL)
+        reuse_flow_hash = false;
+#endif
+#endif
+
+    /*
+     * the specialised loop sends what it can, this one picks up after it
+     * and ends the file.  --preload-dedup copies shared packets before
+     * --unique-ip edits them and the first pass counts the flows of each
+     * interface, which only this one does.
+     */
+    if (preload && do_not_timestamp && ctx->send_loop >= 0 &&
+            !(options->preload_dedup && options->unique_ip && ctx->iteration) &&
+            !(options->flow_stats && options->cache_packets && !fc->replayed)) {
+        int variant = ctx->send_loop;
+
+        if (options->unique_ip && ctx->iteration)
+            variant |= SEND_LOOP_UNIQUE_IP;
+
+        cached_packet = send_loops[variant](ctx, idx, cached_packet, batch_iov,
+                batch_pkthdr, batch_size);
+        packetnum = ctx->stats.pkts_sent;
+    }
+
+    /* MAIN LOOP 
+     * Keep sending while we have packets or until
+     * we've sent enough packets
+     */
+    while (true) {
+        stage_begin(ctx, &clk);
+#ifdef HAVE_LIBPTHREAD
+        if (pipeline != NULL) {
+            pktdata = pipeline_pop(pipeline, &pkthdr, &ts_ns, &packetnum, &sp, &pktlen);
+            stage_mark(ctx, &clk, STAGE_READ);
+        } else
+#endif
+        {
+            pktdata = prepare_next_packet(ctx, pcap, idx, prev_packet,
+                    &pkthdr, &packetnum, &sp, &pktlen, ctx->iteration, &clk);
+            if (pktdata != NULL && !do_not_timestamp)
+                ts_ns = PACKET_TS_NS(&pkthdr, options->sources[idx].pkt_nsec);
+        }
+
+        if (pktdata == NULL)
+            break;
+
+        /* die? */
+        if (ctx->abort)
+            break;
+
+        /* Only sleep if we're not in top speed mode (-t) */
+        if (!do_not_timestamp) {
+            /* the last burst is complete, send what's left of it before sleeping */
+            if (batch_cnt && ctx->skip_packets == 0)
+                send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+
+            /* the first packet's nap is the loop gap, unless it starts the replay */
+            if (schedule != NULL && (cached_packet != fc->packet_cache || ctx->loop_wrap))
+                ctx->schedule_nap = &schedule[cached_packet - fc->packet_cache];
+            else
+                ctx->schedule_nap = NULL;
+
+            TCPR_PROBE2(pre_sleep, packetnum, ts_ns);
+            if (!do_sleep(ctx, ts_ns, pktlen, options->accurate, sp, packetnum, &ctx->stats.end_time)) {
+                late_skip(ctx, ts_ns);
+                stage_end(ctx, &clk, STAGE_SLEEP);
+                continue;
+            }
+            stage_mark(ctx, &clk, STAGE_SLEEP);
+        }
+
+        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+
+#ifdef HAVE_NETMAP
+        /* pin each flow to one TX ring; a batch never spans two rings */
+        if (options->netmap_multiqueue) {
+            uint32_t hash = preload ? cached_packet->flow_hash :
+                    reuse_flow_hash ? ctx->flow_hash : flow_hash(&pkthdr, pktdata, datalink);
+
+            if (batch_cnt && hash % sp->nm_tx_rings != sp->nm_tx_ring)
+                send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+
+            sendpacket_select_tx_ring(sp, hash);
+        }
+#endif
+
+#ifdef ENABLE_FRAGROUTE
+        /* fragments held back for this long are due by now */
+        if (ctx->frag_delayed_cnt) {
+            if (batch_cnt)
+                send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+            fragroute_flush(ctx, false);
+        }
+#endif
+
+        /* --measure: send a tagged copy, stamped as late as possible */
+        if (ctx->measure != NULL) {
+            pktdata = measure_tag(ctx->measure, pktdata, &pktlen);
+            pkthdr.caplen = pktlen;
+            if (pkthdr.len < pktlen)
+                pkthdr.len = pktlen;
+        }
+
+        if (options->segment_mtu && pktlen > options->segment_mtu &&
+                tcp_segment(&ctx->segs, pktdata, pktlen, seg_dlt, options->segment_mtu) > 0) {
+            /* keep the segments behind the packets queued before them */
+            if (batch_cnt)
+                send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+            segment_send(ctx, sp, &pkthdr);
+        } else
+#ifdef ENABLE_FRAGROUTE
+        if (fragroute && fragroute_wanted(ctx, sp, &pkthdr, pktdata, &frag_meta)) {
+            /* keep the fragments behind the packets queued before them */
+            if (batch_cnt)
+                send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+            fragroute_send(ctx, sp, &pkthdr, pktdata, pktlen, &frag_meta);
+        } else
+#endif
+        if (batch_size) {
+            /* with a cache file, a batch is a run of packets for one interface */
+            if (batch_cnt && sp != batch_sp)
+                send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+
+            /* queue packet and only hit the wire once the batch is full */
+            batch_sp = sp;
+            batch_iov[batch_cnt].iov_base = pktdata;
+            batch_iov[batch_cnt].iov_len = pktlen;
+            memcpy(&batch_pkthdr[batch_cnt], &pkthdr, sizeof(struct pcap_pkthdr));
+            if (++batch_cnt < batch_size) {
+                stage_end(ctx, &clk, STAGE_SEND);
+                continue;
+            }
+
+            send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+        } else {
+            /* write packet out on network */
+            if (sendpacket(sp, pktdata, pktlen, &pkthdr) < (int)pktlen)
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+
+            for (fan = 0; fan < ctx->fanout_intf_cnt; fan++) {
+                if (sendpacket(ctx->fanout_intf[fan], pktdata, pktlen, &pkthdr) < (int)pktlen)
+                    warnx("Unable to send packet: %s", sendpacket_geterr(ctx->fanout_intf[fan]));
+            }
+
+            ctx->stats.pkts_sent ++;
+            ctx->stats.bytes_sent += pktlen;
+            TCPR_PROBE3(post_send, ctx->stats.pkts_sent, pktlen, 1);
+        }
+        stage_end(ctx, &clk, STAGE_SEND);
+
+        /* mark the time when we sent the last packet */
+        if (!do_not_timestamp)
+            get_packet_timestamp(&ctx->stats.end_time);
+
+        if (timing)
+            timing_record(ctx);
+
+#ifdef TIMESTAMP_TRACE
+        add_timestamp_trace_entry(ctx->trace, pktlen, &ctx->stats.end_time);
+#endif
+        /*
+         * track the time of the "last packet sent".
+         *
+         * A number of 3rd party tools generate bad timestamps which go backwards
+         * in time.  Hence, don't update the "last" unless pkthdr.ts > last
+         */
+        if (!do_not_timestamp && ctx->stats.last_ts_ns < ts_ns)
+            ctx->stats.last_ts_ns = ts_ns;
+
+        if (ctx->stats_export != NULL)
+            stats_export_tick(ctx, do_not_timestamp ? STATS_EXPORT_STRIDE : 1);
+
+        /* print stats during the run? */
+        if (options->stats > 0)
+            stats_print_tick(ctx);
+
+        if (ctx->timeline != NULL)
+            timeline_tick(ctx);
+
+        if (ctx->progress_cb != NULL)
+            progress_tick(ctx);
+
+        if (ctx->rate_profile != NULL)
+            rate_profile_tick(ctx);
+
+        if (rate_tick(ctx))
+            schedule = NULL;    /* compiled for the old --multiplier */
+    } /* while */
+
+    /* flush anything left in a partial batch */
+    if (batch_cnt && !ctx->abort)
+        send_packet_batch(ctx, batch_sp, batch_iov, batch_pkthdr, &batch_cnt);
+
+#ifdef ENABLE_FRAGROUTE
+    /* the file ends with the last delayed fragment */
+    if (ctx->frag_delayed_cnt && !ctx->abort)
+        fragroute_flush(ctx, true);
+    else if (ctx->frag_delayed_cnt)
+        fragroute_discard(ctx);
+#endif
+
+    if (ctx->stats_export != NULL)
+        stats_export_tick(ctx, 1);
+
+    safe_free(batch_iov);
+    safe_free(batch_pkthdr);
+    ctx->schedule_nap = NULL;
+    pass_end(ctx);
+
+#ifdef HAVE_LIBPTHREAD
+    if (pipeline != NULL && pipeline != ctx->window)
+        pipeline_stop(pipeline);
+#endif
+
+    if (!ctx->abort) {
+        fc->replayed = preload;
+        ++ctx->iteration;
+    }
+}
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define STATS_CLOCK     CLOCK_MONOTONIC_COARSE  /* tick resolution, never a syscall */
+#else
+#define STATS_CLOCK     CLOCK_MONOTONIC
+#endif
+
+/*
+ * Prints the --stats line every options->stats seconds.  This runs for
+ * every packet, even with --topspeed, so the cadence comes from a coarse
+ * clock and the time of day is only read when it is time to print.
+ */
+static inline void
+stats_print_tick(tcpreplay_t *ctx)
+{
+    struct timespec now;
+    uint64_t now_ns, interval = (uint64_t)ctx->options->stats * 1000000000;
+
+    clock_gettime(STATS_CLOCK, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+
+    if (!ctx->stats_next_print) {
+        ctx->stats_next_print = now_ns + interval;
+        return;
+    }
+
+    if (now_ns < ctx->stats_next_print)
+        return;
+
+    ctx->stats_next_print = now_ns + interval;
+    if (gettimeofday(&ctx->stats.end_time, NULL) < 0)
+        errx(-1, "gettimeofday() failed: %s",  strerror(errno));
+    memcpy(&ctx->stats.last_print, &ctx->stats.end_time, sizeof(ctx->stats.last_print));
+    packet_stats(&ctx->stats);
+}
+
+/* the rate --timeline rows are measured against */
+static void
+timeline_target(tcpreplay_t *ctx)
+{
+    tcpreplay_speed_t *speed = &ctx->options->speed;
+
+    timeline_set_target(ctx->timeline,
+            speed->mode == speed_mbpsrate ? speed->speed / 1000000.0 : 0.0,
+            speed->mode == speed_packetrate ? (double)speed->speed : 0.0,
+            speed->mode == speed_multiplier ? speed->multiplier : 0.0);
+}
+
+/*
+ * Writes a --timeline row once its interval is up.  The first call, right
+ * after the first packet, sets the target rate and starts the timeline.
+ */
+static inline void
+timeline_tick(tcpreplay_t *ctx)
+{
+    struct timespec now;
+    uint64_t now_ns;
+
+    clock_gettime(STATS_CLOCK, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+
+    if (now_ns < ctx->timeline_next)
+        return;
+
+    if (!ctx->timeline_next)
+        timeline_target(ctx);
+
+    ctx->timeline_next = now_ns + ctx->timeline->interval_ns;
+    timeline_sample(ctx->timeline, &ctx->stats, ctx->intf1, ctx->intf2);
+}
+
+/*
+ * Hands the --stats-export thread a fresh snapshot once stride packets
+ * have gone out since the last one
+ */
+static inline void
+stats_export_tick(tcpreplay_t *ctx, COUNTER stride)
+{
+    if (ctx->stats.pkts_sent - ctx->stats_published >= stride) {
+        ctx->stats_published = ctx->stats.pkts_sent;
+        stats_export_publish(ctx->stats_export, &ctx->stats, ctx->intf1, ctx->intf2, true);
+    }
+}
+
+/*
+ * Calls the tcpreplay_set_progress_callback() callback once progress_pkts
+ * packets have gone out or progress_ns has passed since the last call
+ */
+static inline void
+progress_tick(tcpreplay_t *ctx)
+{
+    tcpreplay_stats_t snapshot;
+    struct timespec now;
+    uint64_t now_ns = 0;
+    bool due = ctx->progress_pkts &&
+            ctx->stats.pkts_sent - ctx->progress_last >= ctx->progress_pkts;
+
+    if (ctx->progress_ns) {
+        clock_gettime(STATS_CLOCK, &now);
+        now_ns = TIMESPEC_TO_NANOSEC(&now);
+        if (!ctx->progress_next)
+            ctx->progress_next = now_ns + ctx->progress_ns;
+        if (now_ns >= ctx->progress_next)
+            due = true;
+    }
+
+    if (!due)
+        return;
+
+    if (ctx->progress_ns)
+        ctx->progress_next = now_ns + ctx->progress_ns;
+    ctx->progress_last = ctx->stats.pkts_sent;
+
+    /* end_time is only kept up to date when pacing */
+    memcpy(&snapshot, &ctx->stats, sizeof(snapshot));
+    gettimeofday(&snapshot.end_time, NULL);
+    ctx->progress_cb(ctx, &snapshot, ctx->progress_user);
+}
+
+/* how often the --rate-profile rate is looked up */
+#define RATE_PROFILE_TICK_NS    10000000
+
+/*
+ * Hands the send loop the --rate-profile rate every RATE_PROFILE_TICK_NS,
+ * through the same path as tcpreplay_change_rate().  The profile's clock
+ * starts at the first call.  After a SIGHUP the profile is parsed again
+ * and starts over; if that fails the old one carries on.
+ */
+static void
+rate_profile_tick(tcpreplay_t *ctx)
+{
+    rate_profile_t *profile;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    struct timespec now;
+    uint64_t now_ns;
+    double rate;
+
+    if (ctx->rate_profile_reload) {
+        ctx->rate_profile_reload = false;
+        if ((profile = rate_profile_parse(ctx->options->rate_profile, ebuf, sizeof(ebuf))) != NULL) {
+            notice("Reloaded rate profile %s", ctx->options->rate_profile);
+            rate_profile_free(ctx->rate_profile);
+            ctx->rate_profile = profile;
+            ctx->rate_profile_start = 0;
+            ctx->rate_profile_next = 0;
+        } else {
+            warnx("Keeping the current rate profile: %s", ebuf);
+        }
+    }
+
+    clock_gettime(STATS_CLOCK, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+    if (now_ns < ctx->rate_profile_next)
+        return;
+
+    if (!ctx->rate_profile_start)
+        ctx->rate_profile_start = now_ns;
+    ctx->rate_profile_next = now_ns + RATE_PROFILE_TICK_NS;
+
+    rate = rate_profile_rate(ctx->rate_profile, now_ns - ctx->rate_profile_start) *
+            ctx->rate_profile_scale;
+    if (ctx->options->speed.mode != speed_multiplier && rate < 1.0)
+        rate = 1.0;
+
+    if (rate == ctx->rate_profile_last)
+        return;
+
+    ctx->rate_profile_last = rate;
+    ctx->rate_pending = rate;
+    __sync_synchronize();
+    ctx->rate_gen++;
+}
+
+/*
+ * Adds a gap between two sends to the timing histograms, along with how
+ * far it was from the gap the capture or the rate asked for.
+ */
+static inline void
+timing_add(tcpreplay_stats_t *stats, uint64_t gap, uint64_t due)
+{
+    timing_hist_add(&stats->send_gap, gap);
+    if (gap < due) {
+        timing_hist_add(&stats->send_error, due - gap);
+        stats->send_early++;
+    } else {
+        timing_hist_add(&stats->send_error, gap - due);
+    }
+}
+
+/*
+ * --tx-timestamps: reads back the departure times of packets which have
+ * left, waiting up to timeout_ms if none have, and times the gaps between
+ * them.  A gap is only timed between two packets whose timestamps both
+ * came back.  Returns how many were read.
+ */
+static int
+wire_drain(tcpreplay_t *ctx, int timeout_ms)
+{
+    tcpreplay_stats_t *stats = &ctx->stats;
+    sendpacket_tstamp_t ts[TX_TSTAMP_DRAIN];
+    const wire_due_t *slot;
+    uint64_t due;
+    int i, cnt, total = 0;
+
+    while ((cnt = sendpacket_tx_timestamps(ctx->intf1, ts, TX_TSTAMP_DRAIN, timeout_ms)) > 0) {
+        for (i = 0; i < cnt; i++) {
+            /* reported out of order, or twice */
+            if ((int32_t)(ts[i].id - ctx->wire_seen) < 0)
+                continue;
+
+            /* packets queued behind another get no gap of their own */
+            slot = &ctx->wire_due[ts[i].id & (TX_TSTAMP_PENDING - 1)];
+            due = slot->id == ts[i].id ? slot->due_ns : 0;
+
+            if (ts[i].id != ctx->wire_seen)
+                stats->wire_missed += ts[i].id - ctx->wire_seen;
+            else if (ctx->wire_last_ns && due != TX_TSTAMP_NO_GAP && ts[i].ns >= ctx->wire_last_ns) {
+                timing_add(stats, ts[i].ns - ctx->wire_last_ns, due);
+                stats->wire_gaps++;
+            }
+
+            ctx->wire_seen = ts[i].id + 1;
+            ctx->wire_last_ns = ts[i].ns;
+        }
+
+        total += cnt;
+        timeout_ms = 0;
+    }
+
+    if (cnt < 0)
+        warnx("Unable to read transmit timestamps: %s", sendpacket_geterr(ctx->intf1));
+
+    return total;
+}
+
+/*
+ * --tx-timestamps: files the gap asked for under the first packet sent
+ * since the last call, to be timed once its departure time comes back
+ */
+static void
+wire_record(tcpreplay_t *ctx)
+{
+    uint32_t id = ctx->wire_next_id;
+    wire_due_t *slot = &ctx->wire_due[id & (TX_TSTAMP_PENDING - 1)];
+    uint64_t due = ctx->wire_restart ? TX_TSTAMP_NO_GAP : ctx->timing_due_ns;
+
+    ctx->wire_next_id = sendpacket_tx_timestamp_next(ctx->intf1);
+    if (ctx->wire_next_id == id)
+        return;     /* nothing went out, the gap carries on */
+
+    ctx->timing_due_ns = 0;
+    slot->id = id;
+    slot->due_ns = due;
+    ctx->wire_restart = false;
+
+    if (--ctx->wire_countdown == 0) {
+        ctx->wire_countdown = TX_TSTAMP_DRAIN;
+        wire_drain(ctx, 0);
+    }
+}
+
+/**
+ * \brief Waits for the departure times of the packets still in flight
+ *
+ * Anything not back within TX_TSTAMP_WAIT_MS of the last one counts as
+ * missing.
+ */
+void
+wire_flush(tcpreplay_t *ctx)
+{
+    if (ctx->wire_due == NULL)
+        return;
+
+    while (ctx->wire_seen != ctx->wire_next_id && wire_drain(ctx, TX_TSTAMP_WAIT_MS) > 0)
+        ;
+
+    ctx->stats.wire_missed += ctx->wire_next_id - ctx->wire_seen;
+    ctx->wire_seen = ctx->wire_next_id;
+}
+
+/*
+ * Records the packet (or batch) just sent in the timing histograms: the
+ * gap since the previous send, and how far that was from the gap the
+ * capture or the rate asked for.  With --tx-timestamps the gap is timed
+ * later, between the departures of the packets, see wire_drain().
+ */
+static inline void
+timing_record(tcpreplay_t *ctx)
+{
+    struct timespec now;
+    uint64_t now_ns, due = ctx->timing_due_ns;
+
+    if (ctx->wire_due != NULL) {
+        wire_record(ctx);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+    ctx->timing_due_ns = 0;
+
+    if (ctx->timing_last_ns)
+        timing_add(&ctx->stats, now_ns - ctx->timing_last_ns, due);
+    ctx->timing_last_ns = now_ns;
+}
+
+/**
+ * \brief Sends the queued packets with a single sendpacket_batch() call
+ *
+ * Updates the run statistics for every packet in the batch and
+ * resets *cnt so the caller can start queuing again.
+ */
+static void
+send_packet_batch(tcpreplay_t *ctx, sendpacket_t *sp,
+        const struct iovec *iov, struct pcap_pkthdr *pkthdrs,
+        unsigned int *cnt)
+{
+    COUNTER bytes = 0;
+    unsigned int i;
+    int j;
+
+    if (sendpacket_batch(sp, iov, pkthdrs, *cnt) < (int)*cnt)
+        warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+
+    /* --fanout-intf: the same batch out every other port */
+    for (j = 0; j < ctx->fanout_intf_cnt; j++) {
+        if (sendpacket_batch(ctx->fanout_intf[j], iov, pkthdrs, *cnt) < (int)*cnt)
+            warnx("Unable to send packet: %s", sendpacket_geterr(ctx->fanout_intf[j]));
+    }
+
+    for (i = 0; i < *cnt; i++)
+        bytes += iov[i].iov_len;
+
+    ctx->stats.bytes_sent += bytes;
+    ctx->stats.pkts_sent += *cnt;
+    TCPR_PROBE3(post_send, ctx->stats.pkts_sent, bytes, *cnt);
+    *cnt = 0;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/* max # of packets a worker sends between syncs with the other workers */
+#define WORKER_CHUNK 32
+
+/* state shared by all workers replaying the same file */
+typedef struct replay_workers_shared_s {
+    COUNTER start_us;           /* when the workers were started */
+    COUNTER first_ts_us;        /* pcap timestamp of the first packet */
+    /* --flow-timing: copies of the file each pass, every one looping it this often */
+    uint32_t copies;
+    COUNTER period_us;
+    /* rate budget consumed so far, every chunk claims some of it */
+    COUNTER bytes __attribute__((aligned(WORKER_COUNTERS_ALIGN)));
+    COUNTER packets;
+} replay_workers_shared_t;
+
+/* --flow-timing: where one copy of the file is in this pass */
+typedef struct flow_copy_s {
+    COUNTER due_us;             /* of packet next, from the start of the pass */
+    COUNTER offset_us;          /* of the copy's start in the period */
+    COUNTER next;               /* index in the cache */
+    COUNTER left;               /* packets still to send */
+    uint32_t client;
+} flow_copy_t;
+
+typedef struct replay_worker_s {
+    pthread_t thread;
+    int id;
+    tcpreplay_t *ctx;
+    sendpacket_t *sp;
+    packet_cache_t **packets;
+    COUNTER packet_cnt;
+    int datalink;
+    replay_workers_shared_t *shared;
+    worker_counters_t *counters;    /* only this worker writes them */
+
+    /* --clients: the whole file, as clients id, id + workers, ... */
+    packet_cache_t *cache;
+    uint32_t client_cnt;
+    u_char *scratch;            /* a copy of each packet of a chunk */
+    bpf_u_int32 scratch_len;    /* per packet */
+
+    /* --flow-timing: min-heap of the copies, on their next packet's due time */
+    flow_copy_t *flows;
+    uint32_t flow_cnt;
+} replay_worker_t;
+
+/**
+ * \brief Splits the preloaded packets of a file between the workers
+ *
+ * All packets of a flow (in either direction) go to the same worker
+ * so that each flow is sent in order.
+ */
+static void
+partition_file_cache(tcpreplay_t *ctx, int idx)
+{
+    file_cache_t *fc = &ctx->options->file_cache[idx];
+    int workers = ctx->options->workers;
+    packet_cache_t *packet;
+    COUNTER *allocated;
+    COUNTER i;
+    int w;
+
+    fc->worker_cache = safe_malloc(sizeof(packet_cache_t **) * workers);
+    fc->worker_cache_cnt = safe_malloc(sizeof(COUNTER) * workers);
+    allocated = safe_malloc(sizeof(COUNTER) * workers);
+
+    for (i = 0; i < fc->packet_cnt; i++) {
+        packet = &fc->packet_cache[i];
+        w = packet->flow_hash % workers;
+        if (fc->worker_cache_cnt[w] == allocated[w]) {
+            allocated[w] = allocated[w] ? allocated[w] * 2 : 1024;
+            fc->worker_cache[w] = safe_realloc(fc->worker_cache[w],
+                    sizeof(packet_cache_t *) * allocated[w]);
+        }
+        fc->worker_cache[w][fc->worker_cache_cnt[w]++] = packet;
+    }
+
+    for (w = 0; w < workers; w++)
+        dbgx(1, "worker %d: " COUNTER_SPEC " packets", w, fc->worker_cache_cnt[w]);
+
+    safe_free(allocated);
+}
+
+/**
+ * \brief Waits until the given absolute time in microseconds
+ */
+static void
+worker_wait(tcpreplay_t *ctx, COUNTER target_us)
+{
+    struct timeval now;
+    struct timespec nap;
+    COUNTER now_us;
+
+    while (!ctx->abort) {
+        gettimeofday(&now, NULL);
+        now_us = TIMEVAL_TO_MICROSEC(&now);
+        if (now_us >= target_us)
+            return;
+
+        /* sleep through most of long gaps, spin on short ones */
+        if (target_us - now_us > 1000) {
+            NANOSEC_TO_TIMESPEC((target_us - now_us - 500) * 1000, &nap);
+            nanosleep(&nap, NULL);
+        }
+    }
+}
+
+/*
+ * --flow-timing: spreads the copies of a file over a period so that their
+ * sum is the --mbps or --pps rate while each keeps the file's own timing.
+ * One copy alone fills span / per_copy of the rate, so that many copies
+ * are needed, rounded up; the period then stretches past the span of the
+ * file to take the rounding up.
+ */
+static void
+flow_timing_period(tcpreplay_t *ctx, const file_cache_t *fc, replay_workers_shared_t *shared)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    const packet_cache_t *packet;
+    double units = 0.0, span, per_copy, copies;
+    COUNTER i;
+
+    span = 1.0;
+    if (fc->packet_cnt > 1)
+        span = max(1.0, (double)(TIMEVAL_TO_MICROSEC(&fc->packet_cache[fc->packet_cnt - 1].pkthdr.ts) -
+                shared->first_ts_us));
+
+    if (options->speed.mode == speed_mbpsrate) {
+        for (i = 0; i < fc->packet_cnt; i++) {
+            packet = &fc->packet_cache[i];
+            units += (double)(options->use_pkthdr_len ? packet->pkthdr.len :
+                    packet->pkthdr.caplen) * 8000000.0;
+        }
+    } else {
+        units = (double)fc->packet_cnt * 1000000.0;
+    }
+
+    /* usec of the target rate one copy's packets take up */
+    per_copy = units / (double)options->speed.speed;
+    copies = span / per_copy;
+    if (copies > MAX_CLIENTS) {
+        if (ctx->iteration == 0)
+            warnx("--flow-timing needs %.0f copies of %s for that rate, sending %d",
+                    copies, options->sources[fc->index].filename, MAX_CLIENTS);
+        copies = MAX_CLIENTS;
+    } else if (copies > (double)(uint32_t)copies) {
+        copies = (double)(uint32_t)copies + 1.0;
+    }
+
+    shared->copies = (uint32_t)max(copies, 1.0);
+    shared->period_us = (COUNTER)max(span, (double)shared->copies * per_copy);
+    dbgx(1, "--flow-timing: %u copies, period " COUNTER_SPEC " usec", shared->copies,
+            shared->period_us);
+}
+
+/* earlier packet first, ties go to the lower client */
+static inline bool
+flow_copy_before(const flow_copy_t *a, const flow_copy_t *b)
+{
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->client < b->client);
+}
+
+static void
+flow_copy_sift_down(flow_copy_t *heap, uint32_t cnt, uint32_t i)
+{
+    flow_copy_t top = heap[i];
+    uint32_t child;
+
+    while ((child = 2 * i + 1) < cnt) {
+        if (child + 1 < cnt && flow_copy_before(&heap[child + 1], &heap[child]))
+            child++;
+
+        if (!flow_copy_before(&heap[child], &top))
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = top;
+}
+
+/* a packet of the copy is due its pcap time plus the copy's offset, wrapped to the period */
+static inline COUNTER
+flow_copy_due(const replay_worker_t *worker, const flow_copy_t *flow)
+{
+    COUNTER ts_us = TIMEVAL_TO_MICROSEC(&worker->cache[flow->next].pkthdr.ts);
+    COUNTER rel = ts_us > worker->shared->first_ts_us ? ts_us - worker->shared->first_ts_us : 0;
+
+    return (rel + flow->offset_us) % worker->shared->period_us;
+}
+
+/**
+ * \brief Places the --flow-timing copies of a worker in the period
+ *
+ * Copy c starts c / copies of the way into the period.  The packets its
+ * offset pushes past the end of the period wrap around to the start, so
+ * each copy plays the file as if it had been looping all along.
+ */
+static void
+flow_copies_init(replay_worker_t *worker)
+{
+    const replay_workers_shared_t *shared = worker->shared;
+    flow_copy_t *flow;
+    COUNTER lo, hi, mid, wrap_us;
+    uint32_t k;
+
+    worker->flows = safe_malloc(sizeof(flow_copy_t) * max(worker->client_cnt, 1U));
+    worker->flow_cnt = worker->client_cnt;
+    for (k = 0; k < worker->flow_cnt; k++) {
+        flow = &worker->flows[k];
+        flow->client = worker->id + k * worker->ctx->options->workers;
+        flow->offset_us = flow->client * shared->period_us / shared->copies;
+        flow->left = worker->packet_cnt;
+
+        /* first packet to wrap */
+        wrap_us = shared->first_ts_us + shared->period_us - flow->offset_us;
+        lo = 0;
+        hi = worker->packet_cnt;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (TIMEVAL_TO_MICROSEC(&worker->cache[mid].pkthdr.ts) < wrap_us)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        flow->next = lo < worker->packet_cnt ? lo : 0;
+        flow->due_us = flow_copy_due(worker, flow);
+    }
+
+    for (k = worker->flow_cnt / 2; k-- > 0; )
+        flow_copy_sift_down(worker->flows, worker->flow_cnt, k);
+}
+
+/*
+ * Moves the first copy of the heap on to its next packet, or drops it once
+ * it has sent the whole file
+ */
+static void
+flow_copy_next(replay_worker_t *worker)
+{
+    flow_copy_t *flow = &worker->flows[0];
+
+    if (--flow->left == 0) {
+        *flow = worker->flows[--worker->flow_cnt];
+    } else {
+        if (++flow->next == worker->packet_cnt)
+            flow->next = 0;
+        flow->due_us = flow_copy_due(worker, flow);
+    }
+
+    if (worker->flow_cnt > 0)
+        flow_copy_sift_down(worker->flows, worker->flow_cnt, 0);
+}
+
+/*
+ * Applies a tcpreplay_change_rate() for the workers.  Their deadlines are
+ * start_us plus the budget used so far at the rate, so start_us moves to
+ * keep the current deadline where it is and only what follows speeds up
+ * or slows down.  ts_us is the pcap time of the last packet sent.
+ */
+static void
+workers_rate_tick(tcpreplay_t *ctx, replay_workers_shared_t *shared, COUNTER ts_us)
+{
+    tcpreplay_speed_t *speed = &ctx->options->speed;
+    double used, old_rate, new_rate;
+
+    /* --flow-timing works the copies out again next pass */
+    if (shared->period_us) {
+        rate_tick(ctx);
+        return;
+    }
+
+    switch (speed->mode) {
+    case speed_mbpsrate:
+        used = (double)shared->bytes * 8000000.0;
+        old_rate = (double)speed->speed;
+        break;
+    case speed_packetrate:
+        used = (double)shared->packets * 1000000.0;
+        old_rate = (double)speed->speed;
+        break;
+    case speed_multiplier:
+        used = ts_us > shared->first_ts_us ? (double)(ts_us - shared->first_ts_us) : 0.0;
+        old_rate = speed->multiplier;
+        break;
+    default:
+        rate_tick(ctx);
+        return;
+    }
+
+    rate_tick(ctx);
+    new_rate = speed->mode == speed_multiplier ? speed->multiplier : (double)speed->speed;
+    shared->start_us = (COUNTER)((double)shared->start_us + used / old_rate - used / new_rate);
+}
+
+/**
+ * \brief Main loop of a single --workers thread
+ *
+ * Sends this worker's partition of the file in chunks.  Before each chunk
+ * the worker claims its share of the common rate budget and sleeps until
+ * the chunk is due; afterwards it adds the chunk to the global statistics.
+ *
+ * With --clients the worker walks the whole file instead and sends each
+ * packet once per client it serves, back to back, out of a scratch copy.
+ * The cache itself is never edited: --unique-ip moves client c of pass i
+ * by i * clients + c, so no two clients of any pass share addresses.
+ * --flow-timing sends the copies the same way, but each packet when its
+ * copy has it due rather than at the rate.
+ */
+static void *
+replay_worker(void *arg)
+{
+    replay_worker_t *worker = (replay_worker_t *)arg;
+    tcpreplay_t *ctx = worker->ctx;
+    tcpreplay_opt_t *options = ctx->options;
+    replay_workers_shared_t *shared = worker->shared;
+    worker_counters_t *counters = worker->counters;
+    sendpacket_t *sp = worker->sp;
+    struct iovec iov[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr pkthdr[SENDPACKET_BATCH_MAX];
+    packet_cache_t *packet;
+    u_char *pktdata;
+    COUNTER i, bytes, total, entries, due_us = 0;
+    unsigned int j, n, chunk;
+    uint32_t iteration = ctx->iteration;
+    uint32_t copies = worker->client_cnt;
+    uint32_t shift;
+    bool unique_ip = options->unique_ip;
+    bool ticks = worker->id == 0 && (ctx->stats_export != NULL || options->stats > 0 ||
+            ctx->timeline != NULL || ctx->progress_cb != NULL || ctx->rate_profile != NULL);
+
+    /* worker 0 is the main thread, already placed by tcpreplay_replay() */
+    if (worker->id > 0)
+        send_packets_sched_sender(ctx, worker->id);
+
+    if (options->speed.mode == speed_multiplier)
+        chunk = 1;  /* every packet has its own deadline */
+    else if (options->batch_size > 1)
+        chunk = options->batch_size;
+    else if (worker->flows != NULL)
+        chunk = 1;  /* every packet keeps its place in its flow */
+    else
+        chunk = WORKER_CHUNK;
+
+    /* one entry per packet, or per packet and client */
+    entries = copies ? worker->packet_cnt * copies : worker->packet_cnt;
+
+    for (i = 0; i < entries && !ctx->abort; i += n) {
+        n = min(chunk, entries - i);
+        bytes = 0;
+        for (j = 0; j < n; j++) {
+            if (copies) {
+                if (worker->flows != NULL) {
+                    /* the copy with the earliest packet due */
+                    packet = &worker->cache[worker->flows[0].next];
+                    shift = worker->flows[0].client;
+                    if (j == 0)
+                        due_us = worker->flows[0].due_us;
+                    flow_copy_next(worker);
+                } else {
+                    packet = &worker->cache[(i + j) / copies];
+                    /* this entry's client: id + k * workers */
+                    shift = worker->id + (uint32_t)((i + j) % copies) * options->workers;
+                }
+                pktdata = packet->pktdata;
+                memcpy(&pkthdr[j], &packet->pkthdr, sizeof(struct pcap_pkthdr));
+
+                if (unique_ip)
+                    shift += iteration * (worker->flows != NULL ? shared->copies : options->clients);
+
+                if (shift) {
+                    u_char *copy = worker->scratch + (size_t)j * worker->scratch_len;
+
+                    memcpy(copy, pktdata, pkthdr[j].caplen);
+                    pktdata = copy;
+                    client_shift(packet, &pkthdr[j], pktdata, shift, worker->datalink);
+                }
+            } else {
+                packet = worker->packets[i + j];
+                pktdata = packet->pktdata;
+                memcpy(&pkthdr[j], &packet->pkthdr, sizeof(struct pcap_pkthdr));
+                if (unique_ip && iteration && packet->shared) {
+                    /* --preload-dedup: shift a copy, other packets use this data */
+                    u_char *copy = worker->scratch + (size_t)j * worker->scratch_len;
+
+                    memcpy(copy, pktdata, pkthdr[j].caplen);
+                    pktdata = copy;
+                    client_shift(packet, &pkthdr[j], pktdata, iteration, worker->datalink);
+                } else if (unique_ip && iteration) {
+                    unique_ip_cached(packet, &pkthdr[j], &pktdata, iteration,
+                            worker->datalink);
+                }
+            }
+
+            iov[j].iov_base = pktdata;
+            iov[j].iov_len = options->use_pkthdr_len ? pkthdr[j].len :
+                    pkthdr[j].caplen;
+            bytes += iov[j].iov_len;
+        }
+
+        if (worker->flows != NULL) {
+            worker_wait(ctx, shared->start_us + due_us);
+        } else {
+            switch (options->speed.mode) {
+            case speed_mbpsrate:
+                if (!options->speed.speed)
+                    break;
+
+                total = __sync_fetch_and_add(&shared->bytes, bytes);
+                worker_wait(ctx, shared->start_us +
+                        (COUNTER)((double)total * 8000000.0 / options->speed.speed));
+                break;
+
+            case speed_packetrate:
+                total = __sync_fetch_and_add(&shared->packets, n);
+                worker_wait(ctx, shared->start_us +
+                        (COUNTER)((double)total * 1000000.0 / options->speed.speed));
+                break;
+
+            case speed_multiplier:
+                total = TIMEVAL_TO_MICROSEC(&pkthdr[0].ts);
+                if (total > shared->first_ts_us)
+                    worker_wait(ctx, shared->start_us + (COUNTER)
+                            ((double)(total - shared->first_ts_us) / options->speed.multiplier));
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        if (n > 1) {
+            if (sendpacket_batch(sp, iov, pkthdr, n) < (int)n)
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+        } else if (sendpacket(sp, iov[0].iov_base, iov[0].iov_len, &pkthdr[0]) < (int)iov[0].iov_len) {
+            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+        }
+
+        /* readers add the counters of every worker up */
+        __atomic_store_n(&counters->pkts_sent, counters->pkts_sent + n, __ATOMIC_RELAXED);
+        __atomic_store_n(&counters->bytes_sent, counters->bytes_sent + bytes, __ATOMIC_RELAXED);
+
+        /* the ticks below read ctx->stats, which only this thread writes */
+        if (ticks)
+            tcpreplay_workers_stats(ctx, &ctx->stats);
+
+        if (worker->id == 0 && ctx->stats_export != NULL)
+            stats_export_tick(ctx, STATS_EXPORT_STRIDE);
+
+        /* the first worker prints stats during the run */
+        if (worker->id == 0 && options->stats > 0)
+            stats_print_tick(ctx);
+
+        if (worker->id == 0 && ctx->timeline != NULL)
+            timeline_tick(ctx);
+
+        if (worker->id == 0 && ctx->progress_cb != NULL)
+            progress_tick(ctx);
+
+        if (worker->id == 0 && ctx->rate_profile != NULL)
+            rate_profile_tick(ctx);
+
+        if (worker->id == 0 && ctx->rate_gen != ctx->rate_seen)
+            workers_rate_tick(ctx, shared, TIMEVAL_TO_MICROSEC(&pkthdr[n - 1].ts));
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief Replays a preloaded file with --workers threads
+ *
+ * The calling thread acts as worker 0.  Returns once every worker is
+ * done, after which the counters of all workers and their sendpacket
+ * counters are folded into ctx->stats and ctx->intf1 so that the usual
+ * statistics cover the whole run.
+ */
+void
+send_packets_workers(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    replay_workers_shared_t shared;
+    replay_worker_t *workers;
+    sendpacket_t *sp;
+    struct timeval now;
+    int i, rcode;
+
+    assert(fc->cached);
+
+    if (options->clients <= 1 && !options->flow_timing && fc->worker_cache == NULL)
+        partition_file_cache(ctx, idx);
+
+    memset(&shared, 0, sizeof(shared));
+    if (fc->packet_cnt > 0)
+        shared.first_ts_us = TIMEVAL_TO_MICROSEC(&fc->packet_cache->pkthdr.ts);
+    if (options->flow_timing)
+        flow_timing_period(ctx, fc, &shared);
+    gettimeofday(&now, NULL);
+    shared.start_us = TIMEVAL_TO_MICROSEC(&now);
+
+    /* the counts so far, which the counters of the workers add to */
+    memset(ctx->worker_counters, 0, sizeof(worker_counters_t) * options->workers);
+    ctx->workers_base.pkts_sent = ctx->stats.pkts_sent;
+    ctx->workers_base.bytes_sent = ctx->stats.bytes_sent;
+    __atomic_store_n(&ctx->workers_running, options->workers, __ATOMIC_RELEASE);
+
+    workers = safe_malloc(sizeof(replay_worker_t) * options->workers);
+    for (i = 0; i < options->workers; i++) {
+        workers[i].id = i;
+        workers[i].ctx = ctx;
+        workers[i].sp = ctx->worker_intf[i];
+        workers[i].counters = &ctx->worker_counters[i];
+        workers[i].datalink = fc->dlt;
+        workers[i].shared = &shared;
+
+        if (options->clients > 1 || options->flow_timing) {
+            /* clients i, i + workers, ... */
+            uint32_t clients = options->flow_timing ? shared.copies : options->clients;
+
+            workers[i].cache = fc->packet_cache;
+            workers[i].packet_cnt = fc->packet_cnt;
+            workers[i].client_cnt = clients / options->workers +
+                    ((uint32_t)i < clients % options->workers);
+            workers[i].scratch_len = (fc->max_caplen + PACKET_ARENA_ALIGN - 1) &
+                    ~(PACKET_ARENA_ALIGN - 1);
+            workers[i].scratch = safe_malloc((size_t)SENDPACKET_BATCH_MAX *
+                    workers[i].scratch_len);
+            if (workers[i].client_cnt == 0)
+                workers[i].packet_cnt = 0;  /* more workers than clients */
+            if (options->flow_timing)
+                flow_copies_init(&workers[i]);
+        } else {
+            workers[i].packets = fc->worker_cache[i];
+            workers[i].packet_cnt = fc->worker_cache_cnt[i];
+            if (options->preload_dedup && options->unique_ip) {
+                /* shared packets are shifted on a copy */
+                workers[i].scratch_len = (fc->max_caplen + PACKET_ARENA_ALIGN - 1) &
+                        ~(PACKET_ARENA_ALIGN - 1);
+                workers[i].scratch = safe_malloc((size_t)SENDPACKET_BATCH_MAX *
+                        workers[i].scratch_len);
+            }
+        }
+    }
+
+    for (i = 1; i < options->workers; i++) {
+        if ((rcode = pthread_create(&workers[i].thread, NULL, replay_worker, &workers[i])) != 0)
+            errx(-1, "Unable to start worker thread %d: %s", i, strerror(rcode));
+    }
+
+    replay_worker(&workers[0]);
+
+    for (i = 1; i < options->workers; i++) {
+        if ((rcode = pthread_join(workers[i].thread, NULL)) != 0)
+            errx(-1, "Unable to join worker thread %d: %s", i, strerror(rcode));
+
+        sp = ctx->worker_intf[i];
+        ctx->intf1->retry_enobufs += sp->retry_enobufs;
+        ctx->intf1->retry_eagain += sp->retry_eagain;
+        ctx->intf1->failed += sp->failed;
+        ctx->intf1->trunc_packets += sp->trunc_packets;
+        ctx->intf1->sent += sp->sent;
+        ctx->intf1->bytes_sent += sp->bytes_sent;
+        ctx->intf1->attempt += sp->attempt;
+        ctx->intf1->blocked_ns += sp->blocked_ns;
+        sp->retry_enobufs = sp->retry_eagain = sp->failed = 0;
+        sp->trunc_packets = sp->sent = sp->bytes_sent = sp->attempt = 0;
+        sp->blocked_ns = 0;
+    }
+
+    /* --flow-timing: the copies loop again once the period is over */
+    if (shared.period_us)
+        worker_wait(ctx, shared.start_us + shared.period_us);
+
+    tcpreplay_workers_stats(ctx, &ctx->stats);
+    __atomic_store_n(&ctx->workers_running, 0, __ATOMIC_RELEASE);
+
+    get_packet_timestamp(&ctx->stats.end_time);
+    for (i = 0; i < options->workers; i++) {
+        safe_free(workers[i].scratch);
+        safe_free(workers[i].flows);
+    }
+    safe_free(workers);
+
+    if (!ctx->abort)
+        ++ctx->iteration;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+#ifdef HAVE_LIBPTHREAD
+/* --dual-queues: packets waiting for the sending thread of one interface */
+#define DUALQ_SLOTS         4096                /* must be a power of 2 */
+
+typedef struct dualq_slot_s {
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata;          /* the cache entry, or buf */
+    u_char *buf;                    /* copy of a packet that won't stay put */
+    size_t buf_size;
+    uint32_t pktlen;
+    uint64_t due_ns;                /* CLOCK_MONOTONIC, 0 for right away */
+#ifdef HAVE_NETMAP
+    uint32_t flow_hash;
+#endif
+} dualq_slot_t;
+
+typedef struct dualq_s {
+    dualq_slot_t slots[DUALQ_SLOTS];
+    uint32_t head;                  /* next slot the main thread fills */
+    uint32_t tail;                  /* next slot the sender takes */
+    bool done;                      /* no more packets coming */
+    tcpreplay_t *ctx;
+    sendpacket_t *sp;
+    uint64_t sleep_spin_nsec;       /* this thread's absolute_sleep() spin */
+    pthread_t thread;
+} dualq_t;
+
+/**
+ * \brief Sending thread of one --dual-queues interface
+ *
+ * Sleeps until the deadline of each packet and sends it.  Only this
+ * thread waits out sendpacket() backing off from a full TX queue, the
+ * other interface carries on with its own packets.
+ */
+static void *
+dualq_sender(void *arg)
+{
+    dualq_t *q = (dualq_t *)arg;
+    tcpreplay_t *ctx = q->ctx;
+    dualq_slot_t *slot;
+    uint32_t tail = q->tail;
+
+    for (;;) {
+        while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) {
+            if (__atomic_load_n(&q->done, __ATOMIC_ACQUIRE) &&
+                    __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+                return NULL;
+            if (ctx->abort)
+                return NULL;
+            sched_yield();
+        }
+
+        slot = &q->slots[tail & (DUALQ_SLOTS - 1)];
+        if (slot->due_ns)
+            absolute_sleep(slot->due_ns, &q->sleep_spin_nsec);
+
+        if (ctx->abort)
+            return NULL;
+
+#ifdef HAVE_NETMAP
+        if (ctx->options->netmap_multiqueue)
+            sendpacket_select_tx_ring(q->sp, slot->flow_hash);
+#endif
+        if (sendpacket(q->sp, slot->pktdata, slot->pktlen, &slot->pkthdr) < (int)slot->pktlen)
+            warnx("Unable to send packet: %s", sendpacket_geterr(q->sp));
+
+        __atomic_store_n(&q->tail, ++tail, __ATOMIC_RELEASE);
+    }
+}
+
+static dualq_t *
+dualq_start(tcpreplay_t *ctx, sendpacket_t *sp)
+{
+    dualq_t *q;
+    int rcode;
+
+    q = safe_malloc(sizeof(dualq_t));
+    q->ctx = ctx;
+    q->sp = sp;
+    q->sleep_spin_nsec = ctx->sleep_spin_nsec;
+
+    if ((rcode = pthread_create(&q->thread, NULL, dualq_sender, q)) != 0)
+        errx(-1, "Unable to start --dual-queues sender: %s", strerror(rcode));
+
+    return q;
+}
+
+/**
+ * \brief Waits for the sender to finish the queue (or abort) and frees it
+ */
+static void
+dualq_stop(dualq_t *q)
+{
+    int i, rcode;
+
+    __atomic_store_n(&q->done, true, __ATOMIC_RELEASE);
+    if ((rcode = pthread_join(q->thread, NULL)) != 0)
+        errx(-1, "Unable to join --dual-queues sender: %s", strerror(rcode));
+
+    for (i = 0; i < DUALQ_SLOTS; i++)
+        safe_free(q->slots[i].buf);
+    safe_free(q);
+}
+
+/**
+ * \brief Queues a packet to go out at due_ns
+ *
+ * Packets still in the preload cache are sent from there, anything else
+ * is copied since the caller reuses its buffers.  Waits while the queue
+ * is full, returns false on abort.
+ */
+static bool
+dualq_push(dualq_t *q, const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        uint32_t pktlen, bool stable, uint64_t due_ns, uint32_t hash)
+{
+    dualq_slot_t *slot;
+    uint32_t head = q->head;
+    size_t len;
+
+    while (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == DUALQ_SLOTS) {
+        if (q->ctx->abort)
+            return false;
+        sched_yield();
+    }
+
+    slot = &q->slots[head & (DUALQ_SLOTS - 1)];
+    memcpy(&slot->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+    slot->pktlen = pktlen;
+    slot->due_ns = due_ns;
+#ifdef HAVE_NETMAP
+    slot->flow_hash = hash;
+#else
+    (void)hash;
+#endif
+
+    if (stable) {
+        slot->pktdata = pktdata;
+    } else {
+        /* packets sent by their length need room beyond the capture */
+        len = max(pktlen, pkthdr->caplen);
+        if (slot->buf_size < len) {
+            slot->buf = safe_realloc(slot->buf, len);
+            slot->buf_size = len;
+        }
+        memcpy(slot->buf, pktdata, pkthdr->caplen);
+        if (len > pkthdr->caplen)
+            memset(slot->buf + pkthdr->caplen, 0, len - pkthdr->caplen);
+        slot->pktdata = slot->buf;
+    }
+
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/**
+ * the alternate main loop function for tcpreplay.  This is where we figure out
+ * what to do with each packet when processing two files a the same time
+ *
+ * With --dual-queues this thread only reads, edits and times the packets:
+ * every packet gets an absolute deadline on the one shared timeline and
+ * goes to the sending thread of its interface.
+ */
+void
+send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int cache_file_idx1, pcap_t *pcap2, int cache_file_idx2)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    COUNTER packetnum = ctx->stats.pkts_sent;
+    int limit_send = options->limit_send;
+    int cache_file_idx;
+    pcap_t *pcap;
+    struct pcap_pkthdr pkthdr1, pkthdr2;
+    u_char *pktdata1 = NULL, *pktdata2 = NULL, *pktdata = NULL;
+    sendpacket_t *sp = ctx->intf1;
+    uint32_t pktlen;
+    uint32_t iteration = ctx->iteration;
+    bool unique_ip = options->unique_ip;
+    packet_cache_t *cached_packet1 = NULL, *cached_packet2 = NULL;
+    packet_cache_t **prev_packet1 = NULL, **prev_packet2 = NULL, **prev_packet = NULL;
+    const struct pcap_pkthdr *hdr1 = NULL, *hdr2 = NULL, *pkthdr_ptr;
+    struct pcap_pkthdr *pkthdr_buf, *edit_hdr;
+    edit_scratch_t scratch;
+    bool cached, edit;
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    bool run_tcpedit;
+#endif
+    COUNTER ts_ns1 = 0, ts_ns2 = 0, ts_ns;
+    int datalink = options->file_cache[cache_file_idx1].dlt;
+    bool do_not_timestamp = options->speed.mode == speed_topspeed ||
+            (options->speed.mode == speed_mbpsrate && !options->speed.speed);
+    bool timing = !do_not_timestamp && options->speed.mode != speed_oneatatime;
+    stage_clock_t clk = { false, 0 };
+    tcpreplay_accurate accurate = options->accurate;
+#ifdef HAVE_LIBPTHREAD
+    dualq_t *q1 = NULL, *q2 = NULL, *q;
+    uint32_t hash = 0;
+#endif
+
+    pass_begin(ctx);
+    memset(&scratch, 0, sizeof(scratch));
+
+#ifdef HAVE_LIBPTHREAD
+    /* txtime stamps each packet as it's handed over, it can't be queued */
+    if (options->dual_queues && options->speed.mode != speed_oneatatime &&
+            accurate != accurate_txtime) {
+        q1 = dualq_start(ctx, ctx->intf1);
+        q2 = dualq_start(ctx, ctx->intf2);
+        accurate = accurate_abs_time;
+        ctx->deadline_only = true;
+        timing = false;
+    }
+#endif
+
+    if (options->preload_pcap || (options->file_cache[cache_file_idx1].cached &&
+            options->file_cache[cache_file_idx2].cached)) {
+        prev_packet1 = &cached_packet1;
+        prev_packet2 = &cached_packet2;
+    } else {
+        prev_packet1 = NULL;
+        prev_packet2 = NULL;
+    }
+
+
+    pktdata1 = get_next_packet_ref(ctx, pcap1, &pkthdr1, &hdr1, cache_file_idx1, prev_packet1);
+    if (pktdata1 != NULL)
+        ts_ns1 = PACKET_TS_NS(hdr1, options->sources[cache_file_idx1].pkt_nsec);
+    pktdata2 = get_next_packet_ref(ctx, pcap2, &pkthdr2, &hdr2, cache_file_idx2, prev_packet2);
+    if (pktdata2 != NULL)
+        ts_ns2 = PACKET_TS_NS(hdr2, options->sources[cache_file_idx2].pkt_nsec);
+
+    /* MAIN LOOP 
+     * Keep sending while we have packets or until
+     * we've sent enough packets
+     */
+    while (! (pktdata1 == NULL && pktdata2 == NULL)) {
+        /* die? */
+        if (ctx->abort)
+            break;
+
+        /* the packet is already read, its read is timed at the bottom */
+        stage_begin(ctx, &clk);
+
+        /* stop sending based on the limit -L? */
+        packetnum++;
+        if (limit_send > 0 && packetnum > (COUNTER)limit_send)
+            break;
+
+        /* figure out which pcap file we need to process next 
+         * when get_next_packet() returns null for pktdata, the pkthdr 
+         * will still have the old values from the previous call.  This
+         * means we can't always trust the timestamps to tell us which
+         * file to process.
+         */
+        if (pktdata1 == NULL) {
+            /* file 2 is next */
+            sp = ctx->intf2;
+            datalink = options->file_cache[cache_file_idx2].dlt;
+            pcap = pcap2;
+            pkthdr_ptr = hdr2;
+            pkthdr_buf = &pkthdr2;
+            prev_packet = prev_packet2;
+            cache_file_idx = cache_file_idx2;
+            pktdata = pktdata2;
+            ts_ns = ts_ns2;
+        } else if (pktdata2 == NULL) {
+            /* file 1 is next */
+            sp = ctx->intf1;
+            datalink = options->file_cache[cache_file_idx1].dlt;
+            pcap = pcap1;
+            pkthdr_ptr = hdr1;
+            pkthdr_buf = &pkthdr1;
+            prev_packet = prev_packet1;
+            cache_file_idx = cache_file_idx1;
+            pktdata = pktdata1;
+            ts_ns = ts_ns1;
+        } else if (ts_ns1 <= ts_ns2) {
+            /* file 1 is next */
+            sp = ctx->intf1;
+            datalink = options->file_cache[cache_file_idx1].dlt;
+            pcap = pcap1;
+            pkthdr_ptr = hdr1;
+            pkthdr_buf = &pkthdr1;
+            prev_packet = prev_packet1;
+            cache_file_idx = cache_file_idx1;
+            pktdata = pktdata1;
+            ts_ns = ts_ns1;
+        } else {
+            /* file 2 is next */
+            sp = ctx->intf2;
+            datalink = options->file_cache[cache_file_idx2].dlt;
+            pcap = pcap2;
+            pkthdr_ptr = hdr2;
+            pkthdr_buf = &pkthdr2;
+            prev_packet = prev_packet2;
+            cache_file_idx = cache_file_idx2;
+            pktdata = pktdata2;
+            ts_ns = ts_ns2;
+        }
+
+#if defined TCPREPLAY || defined TCPREPLAY_EDIT
+        /* do we use the snaplen (caplen) or the "actual" packet len? */
+        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
+#elif TCPBRIDGE
+        pktlen = pkthdr_ptr->caplen;
+#else
+#error WTF???  We should not be here!
+#endif
+
+        dbgx(2, "packet " COUNTER_SPEC " caplen %d", packetnum, pktlen);
+        TCPR_PROBE2(packet_read, packetnum, pktlen);
+
+        /* edits go to a copy, the cache is shared by every pass */
+        cached = options->file_cache[cache_file_idx].cached && prev_packet != NULL;
+        edit = unique_ip && iteration;
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        /* packets the edits would leave alone are sent from the cache as they are */
+        run_tcpedit = ctx->tcpedit != NULL &&
+                !tcpedit_packet_unchanged(ctx->tcpedit, pkthdr_ptr, pktdata, sp->cache_dir);
+        edit = edit || run_tcpedit;
+#endif
+        edit_hdr = pkthdr_buf;
+        if (edit && cached) {
+            pktdata = edit_scratch_copy(&scratch, *prev_packet);
+            edit_hdr = &scratch.pkthdr;
+            pkthdr_ptr = edit_hdr;
+        }
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        else if (source_edit_copy(ctx, cache_file_idx, run_tcpedit, edit)) {
+            pktdata = edit_scratch_copy_data(&scratch, pkthdr_ptr, pktdata);
+            edit_hdr = &scratch.pkthdr;
+            pkthdr_ptr = edit_hdr;
+        }
+#endif
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        if (run_tcpedit) {
+            if (tcpedit_packet_headroom(ctx->tcpedit, &edit_hdr, &pktdata, sp->cache_dir,
+                    edit_hdr == &scratch.pkthdr ? EDIT_SCRATCH_HEADROOM : 0) == -1)
+                errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(ctx->tcpedit));
+            pkthdr_ptr = edit_hdr;
+        }
+        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
+        stage_mark(ctx, &clk, STAGE_EDIT);
+#endif
+
+        /* do we need to print the packet via tcpdump? */
+#ifdef ENABLE_VERBOSE
+        if (options->verbose)
+            tcpdump_print(options->tcpdump, pkthdr_ptr, pktdata);
+#endif
+
+        if (unique_ip && iteration) {
+            /* edit packet to ensure every pass is unique */
+            unique_ip_copy(ctx, cached ? *prev_packet : NULL, edit_hdr, &pktdata, datalink);
+            stage_mark(ctx, &clk, STAGE_UNIQUE_IP);
+        }
+
+        /* update flow stats */
+        if (options->flow_stats && !options->file_cache[cache_file_idx].cached)
+            update_flow_stats(ctx, sp, pkthdr_ptr, pktdata, datalink, NULL);
+        else if (options->flow_stats && prev_packet && !options->file_cache[cache_file_idx].replayed)
+            update_sp_flow_stats(sp, (*prev_packet)->flow_type);
+
+        if (options->flow_stats)
+            stage_mark(ctx, &clk, STAGE_FLOW);
+
+        TCPR_PROBE2(packet_edited, packetnum, pktlen);
+
+        /* Only sleep if we're not in top speed mode (-t) */
+        if (!do_not_timestamp) {
+            TCPR_PROBE2(pre_sleep, packetnum, ts_ns);
+            if (!do_sleep(ctx, ts_ns, pktlen, accurate, sp, packetnum, &ctx->stats.end_time)) {
+                /* on to the next packet of the file this one came from */
+                late_skip(ctx, ts_ns);
+                if (sp == ctx->intf2) {
+                    pktdata2 = get_next_packet_ref(ctx, pcap2, &pkthdr2, &hdr2, cache_file_idx2, prev_packet2);
+                    if (pktdata2 != NULL)
+                        ts_ns2 = PACKET_TS_NS(hdr2, options->sources[cache_file_idx2].pkt_nsec);
+                } else {
+                    pktdata1 = get_next_packet_ref(ctx, pcap1, &pkthdr1, &hdr1, cache_file_idx1, prev_packet1);
+                    if (pktdata1 != NULL)
+                        ts_ns1 = PACKET_TS_NS(hdr1, options->sources[cache_file_idx1].pkt_nsec);
+                }
+                stage_end(ctx, &clk, STAGE_SLEEP);
+                continue;
+            }
+            stage_mark(ctx, &clk, STAGE_SLEEP);
+        }
+
+#ifdef HAVE_NETMAP
+        if (options->netmap_multiqueue) {
+            uint32_t pkt_hash = prev_packet ? (*prev_packet)->flow_hash :
+                    options->flow_stats && !options->file_cache[cache_file_idx].cached ?
+                    ctx->flow_hash : flow_hash(pkthdr_ptr, pktdata, datalink);
+#ifdef HAVE_LIBPTHREAD
+            hash = pkt_hash;
+            if (q1 == NULL)
+#endif
+                sendpacket_select_tx_ring(sp, pkt_hash);
+        }
+#endif
+
+#ifdef HAVE_LIBPTHREAD
+        if (q1 != NULL) {
+            /* the sending thread of the interface waits for the deadline */
+            dbgx(2, "Queueing packet #" COUNTER_SPEC, packetnum);
+            q = sp == ctx->intf2 ? q2 : q1;
+            if (!dualq_push(q, pkthdr_ptr, pktdata, pktlen, cached && !edit,
+                    do_not_timestamp ? 0 : ctx->abs_deadline, hash))
+                break;
+            stage_mark(ctx, &clk, STAGE_SEND);
+        } else
+#endif
+        {
+            dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+
+            /* write packet out on network */
+            if (sendpacket(sp, pktdata, pktlen, pkthdr_ptr) < (int)pktlen)
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+            stage_mark(ctx, &clk, STAGE_SEND);
+
+            /* mark the time when we sent the last packet */
+            if (!do_not_timestamp)
+                get_packet_timestamp(&ctx->stats.end_time);
+        }
+
+        if (timing)
+            timing_record(ctx);
+
+        /*
+         * track the time of the "last packet sent".
+         *
+         * A number of 3rd party tools generate bad timestamps which go backwards
+         * in time.  Hence, don't update the "last" unless pkthdr.ts > last
+         */
+        if (!do_not_timestamp && ctx->stats.last_ts_ns < ts_ns)
+            ctx->stats.last_ts_ns = ts_ns;
+
+        ctx->stats.pkts_sent ++;
+        ctx->stats.bytes_sent += pktlen;
+        TCPR_PROBE3(post_send, ctx->stats.pkts_sent, pktlen, 1);
+
+        if (ctx->stats_export != NULL)
+            stats_export_tick(ctx, do_not_timestamp ? STATS_EXPORT_STRIDE : 1);
+
+        /* print stats during the run? */
+        if (options->stats > 0)
+            stats_print_tick(ctx);
+
+        if (ctx->timeline != NULL)
+            timeline_tick(ctx);
+
+        if (ctx->progress_cb != NULL)
+            progress_tick(ctx);
+
+        if (ctx->rate_profile != NULL)
+            rate_profile_tick(ctx);
+
+        rate_tick(ctx);
+
+        /* get the next packet for this file handle depending on which we last used */
+        if (sp == ctx->intf2) {
+            pktdata2 = get_next_packet_ref(ctx, pcap2, &pkthdr2, &hdr2, cache_file_idx2, prev_packet2);
+            if (pktdata2 != NULL)
+                ts_ns2 = PACKET_TS_NS(hdr2, options->sources[cache_file_idx2].pkt_nsec);
+        } else {
+            pktdata1 = get_next_packet_ref(ctx, pcap1, &pkthdr1, &hdr1, cache_file_idx1, prev_packet1);
+            if (pktdata1 != NULL)
+                ts_ns1 = PACKET_TS_NS(hdr1, options->sources[cache_file_idx1].pkt_nsec);
+        }
+        stage_end(ctx, &clk, STAGE_READ);
+    } /* while */
+
+#ifdef HAVE_LIBPTHREAD
+    if (q1 != NULL) {
+        /* the run ends once both interfaces have sent everything queued */
+        dualq_stop(q1);
+        dualq_stop(q2);
+        ctx->deadline_only = false;
+        if (!do_not_timestamp)
+            get_packet_timestamp(&ctx->stats.end_time);
+    }
+#endif
+
+    safe_free(scratch.data);
+    pass_end(ctx);
+    if (ctx->abort)
+        return;
+
+    options->file_cache[cache_file_idx1].replayed = options->file_cache[cache_file_idx1].cached;
+    options->file_cache[cache_file_idx2].replayed = options->file_cache[cache_file_idx2].cached;
+    ++ctx->iteration;
+}
+
+/* --merge: the next packet of one source */
+typedef struct merge_source_s {
+    pcap_t *pcap;
+    int idx;
+    sendpacket_t *sp;
+    struct pcap_pkthdr pkthdr_buf;
+    const struct pcap_pkthdr *pkthdr;   /* pkthdr_buf, or the cache entry */
+    u_char *pktdata;
+    COUNTER ts_ns;
+    packet_cache_t *cached_packet;
+    packet_cache_t **prev_packet;
+} merge_source_t;
+
+/* earlier timestamp first, ties go to the lower source like --dualfile */
+static inline bool
+merge_before(const merge_source_t *a, const merge_source_t *b)
+{
+    return a->ts_ns < b->ts_ns || (a->ts_ns == b->ts_ns && a->idx < b->idx);
+}
+
+/**
+ * Restores the min-heap of source indexes below slot i
+ */
+static void
+merge_sift_down(const merge_source_t *src, int *heap, int cnt, int i)
+{
+    int top = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < cnt) {
+        if (child + 1 < cnt && merge_before(&src[heap[child + 1]], &src[heap[child]]))
+            child++;
+
+        if (!merge_before(&src[heap[child]], &src[top]))
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = top;
+}
+
+/**
+ * Reads the next packet of a --merge source.  Returns false once it has
+ * no more.
+ */
+static bool
+merge_next_packet(tcpreplay_t *ctx, merge_source_t *src)
+{
+    src->pktdata = get_next_packet_ref(ctx, src->pcap, &src->pkthdr_buf, &src->pkthdr,
+            src->idx, src->prev_packet);
+    if (src->pktdata == NULL)
+        return false;
+
+    src->ts_ns = PACKET_TS_NS(src->pkthdr, ctx->options->sources[src->idx].pkt_nsec);
+    return true;
+}
+
+/**
+ * the --merge main loop.  Like send_dual_packets(), but for any number
+ * of sources: a min-heap keyed on the timestamp of the next packet of
+ * each source picks what to send, out the interface of that source.
+ * Each packet costs O(log cnt) to pick rather than a scan of every file.
+ */
+void
+send_merged_packets(tcpreplay_t *ctx, pcap_t **pcaps, int cnt)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    COUNTER packetnum = ctx->stats.pkts_sent;
+    int limit_send = options->limit_send;
+    merge_source_t *sources, *src;
+    tcpreplay_source_stats_t *srcstats;
+    COUNTER retries;
+    int *heap;
+    int heap_cnt = 0;
+    int i, datalink;
+    const struct pcap_pkthdr *pkthdr_ptr;
+    struct pcap_pkthdr *edit_hdr;
+    edit_scratch_t scratch;
+    u_char *pktdata;
+    sendpacket_t *sp;
+    uint32_t pktlen;
+    uint32_t iteration = ctx->iteration;
+    bool unique_ip = options->unique_ip;
+    bool cached, edit;
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    bool run_tcpedit;
+#endif
+    COUNTER ts_ns;
+    bool do_not_timestamp = options->speed.mode == speed_topspeed ||
+            (options->speed.mode == speed_mbpsrate && !options->speed.speed);
+    bool timing = !do_not_timestamp && options->speed.mode != speed_oneatatime;
+    stage_clock_t clk = { false, 0 };
+
+    pass_begin(ctx);
+    memset(&scratch, 0, sizeof(scratch));
+
+    sources = safe_malloc(sizeof(merge_source_t) * cnt);
+    heap = safe_malloc(sizeof(int) * cnt);
+
+    for (i = 0; i < cnt; i++) {
+        src = &sources[i];
+        src->pcap = pcaps[i];
+        src->idx = i;
+        src->sp = i < options->merge_intf_cnt ? ctx->merge_map[i] : ctx->intf1;
+        src->prev_packet = options->preload_pcap ? &src->cached_packet : NULL;
+
+        if (merge_next_packet(ctx, src))
+            heap[heap_cnt++] = i;
+    }
+
+    for (i = heap_cnt / 2 - 1; i >= 0; i--)
+        merge_sift_down(sources, heap, heap_cnt, i);
+
+    /* MAIN LOOP 
+     * Keep sending while we have packets or until
+     * we've sent enough packets
+     */
+    while (heap_cnt > 0) {
+        /* die? */
+        if (ctx->abort)
+            break;
+
+        /* the packet is already read, its read is timed at the bottom */
+        stage_begin(ctx, &clk);
+
+        /* stop sending based on the limit -L? */
+        packetnum++;
+        if (limit_send > 0 && packetnum > (COUNTER)limit_send)
+            break;
+
+        src = &sources[heap[0]];
+        sp = src->sp;
+        datalink = options->file_cache[src->idx].dlt;
+        pkthdr_ptr = src->pkthdr;
+        pktdata = src->pktdata;
+        ts_ns = src->ts_ns;
+
+#if defined TCPREPLAY || defined TCPREPLAY_EDIT
+        /* do we use the snaplen (caplen) or the "actual" packet len? */
+        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
+#elif TCPBRIDGE
+        pktlen = pkthdr_ptr->caplen;
+#else
+#error WTF???  We should not be here!
+#endif
+
+        dbgx(2, "packet " COUNTER_SPEC " caplen %d", packetnum, pktlen);
+        TCPR_PROBE2(packet_read, packetnum, pktlen);
+
+        /* edits go to a copy, the cache is shared by every pass */
+        cached = options->file_cache[src->idx].cached && src->prev_packet != NULL;
+        edit = unique_ip && iteration;
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        /* packets the edits would leave alone are sent from the cache as they are */
+        run_tcpedit = ctx->tcpedit != NULL &&
+                !tcpedit_packet_unchanged(ctx->tcpedit, pkthdr_ptr, pktdata, sp->cache_dir);
+        edit = edit || run_tcpedit;
+#endif
+        edit_hdr = &src->pkthdr_buf;
+        if (edit && cached) {
+            pktdata = edit_scratch_copy(&scratch, *src->prev_packet);
+            edit_hdr = &scratch.pkthdr;
+            pkthdr_ptr = edit_hdr;
+        }
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        else if (source_edit_copy(ctx, src->idx, run_tcpedit, edit)) {
+            pktdata = edit_scratch_copy_data(&scratch, pkthdr_ptr, pktdata);
+            edit_hdr = &scratch.pkthdr;
+            pkthdr_ptr = edit_hdr;
+        }
+#endif
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        if (run_tcpedit) {
+            if (tcpedit_packet_headroom(ctx->tcpedit, &edit_hdr, &pktdata, sp->cache_dir,
+                    edit_hdr == &scratch.pkthdr ? EDIT_SCRATCH_HEADROOM : 0) == -1)
+                errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(ctx->tcpedit));
+            pkthdr_ptr = edit_hdr;
+        }
+        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
+        stage_mark(ctx, &clk, STAGE_EDIT);
+#endif
+
+        /* do we need to print the packet via tcpdump? */
+#ifdef ENABLE_VERBOSE
+        if (options->verbose)
+            tcpdump_print(options->tcpdump, pkthdr_ptr, pktdata);
+#endif
+
+        if (unique_ip && iteration) {
+            /* edit packet to ensure every pass is unique */
+            unique_ip_copy(ctx, cached ? *src->prev_packet : NULL, edit_hdr, &pktdata, datalink);
+            stage_mark(ctx, &clk, STAGE_UNIQUE_IP);
+        }
+
+        /* update flow stats */
+        if (options->flow_stats && !options->file_cache[src->idx].cached)
+            update_flow_stats(ctx, sp, pkthdr_ptr, pktdata, datalink, NULL);
+        else if (options->flow_stats && src->prev_packet && !options->file_cache[src->idx].replayed)
+            update_sp_flow_stats(sp, (*src->prev_packet)->flow_type);
+
+        if (options->flow_stats)
+            stage_mark(ctx, &clk, STAGE_FLOW);
+
+        TCPR_PROBE2(packet_edited, packetnum, pktlen);
+
+        /* Only sleep if we're not in top speed mode (-t) */
+        srcstats = &options->sources[src->idx].stats;
+        if (!do_not_timestamp) {
+            COUNTER late = ctx->stats.late_packets, dropped = ctx->stats.late_dropped;
+            bool send_it;
+
+            TCPR_PROBE2(pre_sleep, packetnum, ts_ns);
+            send_it = do_sleep(ctx, ts_ns, pktlen, options->accurate, sp, packetnum, &ctx->stats.end_time);
+            srcstats->late_packets += ctx->stats.late_packets - late;
+            srcstats->late_dropped += ctx->stats.late_dropped - dropped;
+            if (!send_it) {
+                /* on to the next packet of its source */
+                late_skip(ctx, ts_ns);
+                if (!merge_next_packet(ctx, src))
+                    heap[0] = heap[--heap_cnt];
+                if (heap_cnt > 1)
+                    merge_sift_down(sources, heap, heap_cnt, 0);
+                stage_end(ctx, &clk, STAGE_SLEEP);
+                continue;
+            }
+            stage_mark(ctx, &clk, STAGE_SLEEP);
+        }
+
+        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+
+#ifdef HAVE_NETMAP
+        if (options->netmap_multiqueue)
+            sendpacket_select_tx_ring(sp, src->prev_packet ? (*src->prev_packet)->flow_hash :
+                    options->flow_stats && !options->file_cache[src->idx].cached ?
+                    ctx->flow_hash : flow_hash(pkthdr_ptr, pktdata, datalink));
+#endif
+
+        /* write packet out on network */
+        retries = SENDPACKET_RETRIES(sp);
+        if (sendpacket(sp, pktdata, pktlen, pkthdr_ptr) < (int)pktlen)
+            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+        stage_mark(ctx, &clk, STAGE_SEND);
+
+        /* mark the time when we sent the last packet */
+        if (!do_not_timestamp)
+            get_packet_timestamp(&ctx->stats.end_time);
+
+        if (timing)
+            timing_record(ctx);
+
+        /* timestamps going backwards in one file don't move "last" back */
+        if (!do_not_timestamp && ctx->stats.last_ts_ns < ts_ns)
+            ctx->stats.last_ts_ns = ts_ns;
+
+        ctx->stats.pkts_sent ++;
+        ctx->stats.bytes_sent += pktlen;
+
+        /* the files are interleaved, so each packet is counted to its own */
+        srcstats->pkts_sent++;
+        srcstats->bytes_sent += pktlen;
+        srcstats->retries += SENDPACKET_RETRIES(sp) - retries;
+        TCPR_PROBE3(post_send, ctx->stats.pkts_sent, pktlen, 1);
+
+        if (ctx->stats_export != NULL)
+            stats_export_tick(ctx, do_not_timestamp ? STATS_EXPORT_STRIDE : 1);
+
+        /* print stats during the run? */
+        if (options->stats > 0)
+            stats_print_tick(ctx);
+
+        if (ctx->timeline != NULL)
+            timeline_tick(ctx);
+
+        if (ctx->progress_cb != NULL)
+            progress_tick(ctx);
+
+        if (ctx->rate_profile != NULL)
+            rate_profile_tick(ctx);
+
+        rate_tick(ctx);
+
+        /* refill from the source just sent, dropping it once it runs dry */
+        if (!merge_next_packet(ctx, src))
+            heap[0] = heap[--heap_cnt];
+        if (heap_cnt > 1)
+            merge_sift_down(sources, heap, heap_cnt, 0);
+        stage_end(ctx, &clk, STAGE_READ);
+    } /* while */
+
+    for (i = 0; i < cnt; i++)
+        options->file_cache[i].replayed = options->file_cache[i].cached;
+
+    pass_end(ctx);
+    safe_free(scratch.data);
+    safe_free(heap);
+    safe_free(sources);
+    ++ctx->iteration;
+}
+
+
+
+#ifdef MAP_HUGETLB
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/**
+ * Maps an arena block of at least size bytes out of hugepages, preferring
+ * the NUMA node of the output interface.  Returns NULL if the system has
+ * no hugepages of the requested size available.
+ */
+static packet_arena_t *
+packet_arena_map(tcpreplay_t *ctx, size_t size)
+{
+    size_t page = ctx->options->hugepage_size;
+    size_t map_len;
+    packet_arena_t *arena;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef SYS_mbind
+    int node;
+#endif
+
+    map_len = (sizeof(packet_arena_t) + PACKET_ARENA_ALIGN + size + page - 1) & ~(page - 1);
+    flags |= (page == 1024 * 1024 * 1024 ? 30 : 21) << MAP_HUGE_SHIFT;
+
+    arena = mmap(NULL, map_len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (arena == MAP_FAILED)
+        return NULL;
+
+#ifdef SYS_mbind
+    /* pages are not faulted in yet, so the policy applies to all of them */
+    node = sendpacket_get_numa_node(ctx->intf1);
+    if (node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+        unsigned long nodemask = 1UL << node;
+
+        if (syscall(SYS_mbind, arena, map_len, MPOL_PREFERRED, &nodemask,
+                    sizeof(nodemask) * 8, 0) < 0)
+            dbgx(1, "Unable to bind preload cache to NUMA node %d: %s",
+                    node, strerror(errno));
+        else
+            dbgx(1, "Preload cache bound to NUMA node %d", node);
+    }
+#endif
+
+    arena->map_len = map_len;
+    arena->data = (u_char *)(((uintptr_t)(arena + 1) + PACKET_ARENA_ALIGN - 1) &
+            ~((uintptr_t)PACKET_ARENA_ALIGN - 1));
+    arena->size = map_len - (arena->data - (u_char *)arena);
+
+    return arena;
+}
+#endif /* MAP_HUGETLB */
+
+/**
+ * Counts bytes newly allocated for a file cache against --max-memory.
+ * Preload threads share the count.
+ */
+static inline void
+preload_charge(tcpreplay_t *ctx, size_t bytes)
+{
+    if (ctx->options->max_memory)
+        __atomic_add_fetch(&ctx->preload_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reserves len bytes of packet data in the file cache arena, starting on
+ * a cache line boundary.  A new block is started when the current one is full.
+ */
+static u_char *
+packet_arena_alloc(tcpreplay_t *ctx, file_cache_t *fc, size_t len)
+{
+    packet_arena_t *arena = fc->arena;
+    size_t size;
+    u_char *data;
+
+    len = (len + PACKET_ARENA_ALIGN - 1) & ~((size_t)PACKET_ARENA_ALIGN - 1);
+
+    if (arena == NULL || arena->used + len > arena->size) {
+        size = max(len, (size_t)PACKET_ARENA_SIZE);
+        arena = NULL;
+#ifdef MAP_HUGETLB
+        if (ctx->options->hugepage_size > 0 &&
+                (arena = packet_arena_map(ctx, size)) == NULL) {
+            warnx("Unable to allocate %zuMB hugepages for preload cache, using regular pages: %s",
+                    ctx->options->hugepage_size / (1024 * 1024), strerror(errno));
+            ctx->options->hugepage_size = 0;
+        }
+#endif
+        if (arena == NULL) {
+            arena = safe_malloc(sizeof(packet_arena_t) + size + PACKET_ARENA_ALIGN);
+            arena->data = (u_char *)(((uintptr_t)(arena + 1) + PACKET_ARENA_ALIGN - 1) &
+                    ~((uintptr_t)PACKET_ARENA_ALIGN - 1));
+            arena->size = size;
+        }
+        arena->next = fc->arena;
+        fc->arena = arena;
+        preload_charge(ctx, arena->map_len ? arena->map_len :
+                sizeof(packet_arena_t) + size + PACKET_ARENA_ALIGN);
+    }
+
+    data = arena->data + arena->used;
+    arena->used += len;
+
+    return data;
+}
+
+/**
+ * Whether preloaded packets need room for their wire length.  --pktlen
+ * sends len bytes, and tcpedit edits the cache in place unless
+ * --preload-edit copies it first, which may grow the packet back up to
+ * wire size.
+ */
+static bool
+packet_room_grows(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    if (options->use_pkthdr_len)
+        return true;
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    if (ctx->tcpedit != NULL && !options->preload_edit)
+        return true;
+#endif
+
+    return false;
+}
+
+/**
+ * Bytes a preloaded packet takes up in the cache, see packet_room_grows()
+ */
+static size_t
+packet_room(tcpreplay_t *ctx, const struct pcap_pkthdr *pkthdr)
+{
+    if (packet_room_grows(ctx))
+        return max(pkthdr->len, pkthdr->caplen);
+
+    return pkthdr->caplen;
+}
+
+/* whether preloading works out the flow_hash of each packet */
+static bool
+packet_wants_hash(const tcpreplay_opt_t *options)
+{
+    bool want_hash = options->flow_stats || options->workers > 1 || options->control;
+
+#ifdef HAVE_NETMAP
+    want_hash = want_hash || options->netmap_multiqueue;
+#endif
+
+    return want_hash;
+}
+
+/*
+ * Hash of the packet bytes, eight at a time, using the multiply and fold
+ * of the word flow hash.
+ */
+static uint32_t
+dedup_hash(const u_char *data, uint32_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t w;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+
+    if (i < len) {
+        w = 0;
+        memcpy(&w, data + i, len - i);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (uint32_t)h;
+}
+
+static void
+dedup_grow(dedup_table_t *dt)
+{
+    dedup_slot_t *old = dt->slots;
+    size_t old_size = dt->size, i, j;
+
+    dt->size = old_size ? old_size * 2 : DEDUP_TABLE_MIN;
+    dt->slots = safe_malloc(sizeof(dedup_slot_t) * dt->size);
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].data == NULL)
+            continue;
+
+        for (j = old[i].hash & (dt->size - 1); dt->slots[j].data != NULL;
+                j = (j + 1) & (dt->size - 1))
+            ;
+        dt->slots[j] = old[i];
+    }
+
+    safe_free(old);
+}
+
+/**
+ * Points packet idx of the file cache at a stored copy of the len bytes
+ * of data, the one an identical packet already uses if there is one, in
+ * which case both are marked shared.  Packets that share data are never
+ * edited in place.
+ */
+static void
+dedup_store(tcpreplay_t *ctx, file_cache_t *fc, COUNTER idx, const u_char *data,
+        uint32_t len)
+{
+    dedup_table_t *dt = fc->dedup;
+    packet_cache_t *packet = &fc->packet_cache[idx];
+    dedup_slot_t *slot;
+    uint32_t hash;
+    size_t i;
+
+    if (dt == NULL)
+        dt = fc->dedup = safe_malloc(sizeof(dedup_table_t));
+
+    /* keep the load factor under one half */
+    if ((dt->used + 1) * 2 > dt->size)
+        dedup_grow(dt);
+
+    hash = dedup_hash(data, len);
+    for (i = hash & (dt->size - 1); dt->slots[i].data != NULL; i = (i + 1) & (dt->size - 1)) {
+        slot = &dt->slots[i];
+        if (slot->hash == hash && slot->len == len && memcmp(slot->data, data, len) == 0) {
+            /* the owner may have been moved to other data since, marking it is harmless */
+            packet->pktdata = (u_char *)slot->data;
+            packet->shared = 1;
+            fc->packet_cache[slot->owner].shared = 1;
+            return;
+        }
+    }
+
+    packet->pktdata = packet_arena_alloc(ctx, fc, len);
+    memcpy(packet->pktdata, data, len);
+
+    slot = &dt->slots[i];
+    slot->data = packet->pktdata;
+    slot->owner = idx;
+    slot->hash = hash;
+    slot->len = len;
+    dt->used++;
+}
+
+static void
+dedup_free(file_cache_t *fc)
+{
+    if (fc->dedup == NULL)
+        return;
+
+    safe_free(fc->dedup->slots);
+    safe_free(fc->dedup);
+    fc->dedup = NULL;
+}
+
+/**
+ * Copies a packet into the ctx scratch buffer for editing, with room for
+ * tcpedit in front and behind
+ */
+static u_char *
+scratch_copy(tcpreplay_t *ctx, const u_char *pktdata, bpf_u_int32 caplen)
+{
+    size_t need = max((size_t)MAXPACKET, (size_t)caplen + 64) + EDIT_SCRATCH_HEADROOM;
+
+    if (ctx->scratch_len < need) {
+        ctx->scratch = safe_realloc(ctx->scratch, need);
+        ctx->scratch_len = need;
+    }
+
+    memcpy(ctx->scratch + EDIT_SCRATCH_HEADROOM, pktdata, caplen);
+    return ctx->scratch + EDIT_SCRATCH_HEADROOM;
+}
+
+/**
+ * --preload-dedup: copies a shared preloaded packet into the ctx scratch
+ * buffer, so tcpedit and --unique-ip can edit it without touching the
+ * other packets that share its data.  Leaves tcpedit room in front.
+ */
+static u_char *
+dedup_copy(tcpreplay_t *ctx, const packet_cache_t *packet)
+{
+    return scratch_copy(ctx, packet->pktdata, packet->pkthdr.caplen);
+}
+
+/**
+ * Appends the packet to the end of the file cache and returns the new
+ * entry.  The packet is copied, unless pm is the mapping pktdata points
+ * into and the packet doesn't need room beyond it, in which case the
+ * cache keeps pointing there and holds on to the mapping.  borrow does
+ * the same for memory the caller owns.
+ */
+static packet_cache_t *
+packet_cache_add(tcpreplay_t *ctx, file_cache_t *fc, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, int datalink, pcap_mmap_t *pm, bool borrow)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    packet_cache_t *packet;
+    COUNTER idx = fc->packet_cnt;
+    size_t room;
+    /* only decode what flow stats or queue selection will look at */
+    bool want_hash = packet_wants_hash(options);
+
+    /* --queue-map already has the queue of every packet */
+    if (options->queue_map != NULL)
+        want_hash = false;
+
+    if (fc->packet_cnt == fc->packet_alloc) {
+        preload_charge(ctx, sizeof(packet_cache_t) *
+                (fc->packet_alloc ? fc->packet_alloc : 1024));
+        fc->packet_alloc = fc->packet_alloc ? fc->packet_alloc * 2 : 1024;
+        fc->packet_cache = safe_realloc(fc->packet_cache,
+                sizeof(packet_cache_t) * fc->packet_alloc);
+    }
+
+    packet = &fc->packet_cache[fc->packet_cnt++];
+    memcpy(&packet->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+    if (options->preload_snaplen > 0 && packet->pkthdr.caplen > options->preload_snaplen)
+        packet->pkthdr.caplen = options->preload_snaplen;
+
+    packet->shared = 0;
+    room = packet_room(ctx, &packet->pkthdr);
+    if (options->preload_dedup && room == packet->pkthdr.caplen) {
+        dedup_store(ctx, fc, idx, pktdata, packet->pkthdr.caplen);
+    } else if (pm != NULL && room == packet->pkthdr.caplen) {
+        packet->pktdata = (u_char *)pktdata;
+        fc->mmap = pm;
+    } else if (borrow && room == packet->pkthdr.caplen) {
+        packet->pktdata = (u_char *)pktdata;
+    } else {
+        packet->pktdata = packet_arena_alloc(ctx, fc, room);
+        memcpy(packet->pktdata, pktdata, packet->pkthdr.caplen);
+    }
+
+    fc->max_caplen = max(fc->max_caplen, packet->pkthdr.caplen);
+    packet->flow_type = FLOW_ENTRY_INVALID;
+    packet->ip_addr_off = 0;
+
+    /* walk the headers once for the flow hash, flow stats and --unique-ip */
+    if (fc->meta_fn == NULL)
+        fc->meta_fn = get_pkt_meta_fn(datalink);
+
+    if (fc->meta_fn(packet->pktdata, packet->pkthdr.caplen, &packet->meta) < 0) {
+        packet->flow_hash = want_hash ? flow_hash(&packet->pkthdr, packet->pktdata, datalink) : 0;
+        packet->ip_ver = IP_VER_UNLOCATED;
+    } else {
+        packet->flow_hash = want_hash ? flow_hash_meta(packet->pktdata, &packet->meta) : 0;
+        packet->ip_ver = unique_ip_locate(&packet->pkthdr, &packet->meta, &packet->ip_addr_off);
+    }
+
+    if (options->queue_map != NULL)
+        packet->flow_hash = idx < options->queue_map_packets ? options->queue_map[idx] : 0;
+
+    return packet;
+}
+
+/**
+ * \brief Fills the cache of a source_cache index with the caller's packets
+ *
+ * The headers are copied into the cache, the packet data is sent from
+ * where it is unless a packet needs room to grow, see packet_room().
+ * Flows are counted as preloading a file would.
+ */
+void
+packet_cache_load(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_source_t *src = &options->sources[idx];
+    file_cache_t *fc = &options->file_cache[idx];
+    packet_cache_t *packet;
+    COUNTER i;
+
+    assert(src->type == source_cache);
+
+    for (i = 0; i < src->cache_cnt; i++) {
+        packet = packet_cache_add(ctx, fc, &src->cache_pkthdrs[i], src->cache_pktdata[i],
+                fc->dlt, NULL, true);
+        packet->ts_nsec = 0;
+        packet->iface = 0;
+
+        if (options->flow_stats)
+            packet->flow_type = update_flow_stats(ctx, NULL, &packet->pkthdr,
+                    packet->pktdata, fc->dlt, packet);
+    }
+
+    fc->cached = TRUE;
+    dbgx(1, "Loaded " COUNTER_SPEC " packets of %s", fc->packet_cnt, src->filename);
+}
+
+/**
+ * Frees the packet headers and data arena of a file cache
+ */
+void
+packet_cache_free(file_cache_t *fc)
+{
+    packet_arena_t *arena, *next;
+
+    assert(fc);
+
+    for (arena = fc->arena; arena != NULL; arena = next) {
+        next = arena->next;
+#ifdef MAP_HUGETLB
+        if (arena->map_len > 0) {
+            munmap(arena, arena->map_len);
+            continue;
+        }
+#endif
+        safe_free(arena);
+    }
+
+    pcap_mmap_close(fc->mmap);
+    fc->mmap = NULL;
+#ifdef HAVE_SYS_MMAN_H
+    if (fc->image != NULL)
+        munmap(fc->image, fc->image_len);
+#endif
+    fc->image = NULL;
+    fc->image_len = 0;
+    dedup_free(fc);
+    safe_free(fc->packet_cache);
+    safe_free(fc->schedule);
+    fc->schedule = NULL;
+    safe_free(fc->desc);
+    fc->desc = NULL;
+    fc->arena = NULL;
+    fc->packet_cnt = 0;
+    fc->packet_alloc = 0;
+    fc->max_caplen = 0;
+}
+
+/**
+ * Bytes held by a file cache: its packet headers, packet data arenas and
+ * per packet tables.  Shared --preload-dedup data isn't included.
+ */
+COUNTER
+packet_cache_bytes(const file_cache_t *fc)
+{
+    const packet_arena_t *arena;
+    COUNTER bytes;
+
+    assert(fc);
+
+    bytes = sizeof(packet_cache_t) * fc->packet_alloc;
+    for (arena = fc->arena; arena != NULL; arena = arena->next)
+        bytes += arena->map_len ? arena->map_len :
+                sizeof(packet_arena_t) + arena->size + PACKET_ARENA_ALIGN;
+
+    if (fc->desc != NULL)
+        bytes += sizeof(packet_desc_t) * (fc->packet_cnt + 1);
+    if (fc->schedule != NULL)
+        bytes += sizeof(uint64_t) * (fc->packet_cnt + 1);
+    bytes += fc->image_len;
+
+    return bytes;
+}
+
+/*
+ * --preload-image: the cache of a file as preloading left it, stored as
+ * <pcap>.tcprimg so later runs map it rather than read and decode the
+ * file again.  The header is followed by the packet_cache_t of every
+ * packet, its pktdata an offset into the packet data, which starts on a
+ * page boundary and keeps every packet cache line aligned.  It is all
+ * laid out as this build lays the cache out in memory, so the header
+ * names the build and the layout, and any other build writes it again.
+ */
+#define PRELOAD_IMAGE_MAGIC     "tcprimg"   /* includes the \0 */
+#define PRELOAD_IMAGE_VERSION   2
+#define PRELOAD_IMAGE_SUFFIX    ".tcprimg"
+#define PRELOAD_IMAGE_ALIGN     4096
+
+typedef struct preload_image_hdr_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;        /* sizeof(packet_cache_t) */
+    uint32_t layout;            /* see preload_image_layout() */
+    uint32_t reserved1;
+    char build[64];             /* VERSION and git_version() of the writer */
+
+    /* what the cache was made from, the image is stale if any of it changed */
+    uint64_t pcap_size;
+    uint64_t pcap_mtime;
+    uint64_t pcap_ino;
+    uint64_t start_packet;
+    uint64_t start_time_us;
+    uint64_t end_time_us;
+    uint32_t preload_snaplen;
+    uint8_t grow;               /* see packet_room_grows() */
+    uint8_t dedup;
+    uint8_t flow_hash;          /* see packet_wants_hash() */
+    uint8_t reserved2;
+
+    /* the cache */
+    int32_t datalink;
+    uint32_t max_caplen;
+    uint64_t packet_cnt;
+    uint64_t data_off;
+    uint64_t size;              /* of the whole image */
+} preload_image_hdr_t;
+
+#define PRELOAD_IMAGE_KEY_OFF   offsetof(preload_image_hdr_t, pcap_size)
+#define PRELOAD_IMAGE_KEY_LEN   (offsetof(preload_image_hdr_t, datalink) - PRELOAD_IMAGE_KEY_OFF)
+
+static char *
+preload_image_path(const char *pcapfile)
+{
+    size_t len = strlen(pcapfile) + strlen(PRELOAD_IMAGE_SUFFIX) + 1;
+    char *path = safe_malloc(len);
+
+    snprintf(path, len, "%s%s", pcapfile, PRELOAD_IMAGE_SUFFIX);
+    return path;
+}
+
+/*
+ * a fingerprint of how this build lays out packet_cache_t, for builds
+ * of the same version compiled differently
+ */
+static uint32_t
+preload_image_layout(void)
+{
+    static const size_t layout[] = {
+        sizeof(struct pcap_pkthdr),
+        sizeof(u_char *),
+        sizeof(pkt_meta_t),
+        offsetof(packet_cache_t, pktdata),
+        offsetof(packet_cache_t, flow_hash),
+        offsetof(packet_cache_t, flow_type),
+        offsetof(packet_cache_t, ts_nsec),
+        offsetof(packet_cache_t, iface),
+        offsetof(packet_cache_t, ip_addr_off),
+        offsetof(packet_cache_t, ip_ver),
+        offsetof(packet_cache_t, shared),
+        offsetof(packet_cache_t, meta),
+    };
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < sizeof(layout) / sizeof(layout[0]); i++)
+        hash = (hash ^ (uint32_t)layout[i]) * 16777619U;
+
+    return hash;
+}
+
+/* fills in what an image of file idx, with st from stat(), has to match */
+static void
+preload_image_key(tcpreplay_t *ctx, int idx, const struct stat *st, preload_image_hdr_t *hdr)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    memset(hdr, 0, sizeof(preload_image_hdr_t));
+    memcpy(hdr->magic, PRELOAD_IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->version = PRELOAD_IMAGE_VERSION;
+    hdr->entry_size = sizeof(packet_cache_t);
+    hdr->layout = preload_image_layout();
+    snprintf(hdr->build, sizeof(hdr->build), "%s %s", VERSION, git_version());
+    hdr->pcap_size = (uint64_t)st->st_size;
+    hdr->pcap_mtime = (uint64_t)st->st_mtime;
+    hdr->pcap_ino = (uint64_t)st->st_ino;
+    if (options->read_window) {
+        hdr->start_packet = options->start_packet;
+        hdr->start_time_us = options->start_time_us;
+        hdr->end_time_us = options->end_time_us;
+    }
+    hdr->preload_snaplen = options->preload_snaplen;
+    hdr->grow = packet_room_grows(ctx);
+    hdr->dedup = options->preload_dedup;
+    hdr->flow_hash = packet_wants_hash(options);
+    hdr->datalink = options->file_cache[idx].dlt;
+}
+
+/**
+ * \brief Maps the --preload-image of file idx in as its cache
+ *
+ * Returns false, leaving the cache alone, if there is no image or it
+ * doesn't match the file and the options any more.  The mapping is
+ * private, so --unique-ip and tcpedit edit copies of the pages they
+ * touch and the image itself never changes.
+ */
+static bool
+preload_image_load(tcpreplay_t *ctx, int idx)
+{
+#ifdef HAVE_SYS_MMAN_H
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    const char *pcapfile = options->sources[idx].filename;
+    const preload_image_hdr_t *hdr;
+    preload_image_hdr_t key;
+    packet_cache_t *packet;
+    struct stat st;
+    u_char *base = MAP_FAILED;
+    uint64_t off, data_len;
+    size_t len = 0;
+    char *path;
+    COUNTER i;
+    int fd;
+
+    if (stat(pcapfile, &st) < 0)
+        return false;
+    preload_image_key(ctx, idx, &st, &key);
+
+    path = preload_image_path(pcapfile);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        dbgx(1, "No preload image %s: %s", path, strerror(errno));
+        goto stale;
+    }
+
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(preload_image_hdr_t)) {
+        len = st.st_size;
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED)
+        goto stale;
+
+    hdr = (const preload_image_hdr_t *)base;
+    if (memcmp(hdr, &key, PRELOAD_IMAGE_KEY_OFF + PRELOAD_IMAGE_KEY_LEN) != 0 ||
+            hdr->size != len || hdr->data_off < sizeof(preload_image_hdr_t) ||
+            hdr->data_off > len ||
+            hdr->packet_cnt > (hdr->data_off - sizeof(preload_image_hdr_t)) / sizeof(packet_cache_t)) {
+        dbgx(1, "Preload image %s is stale", path);
+        goto stale;
+    }
+
+    if (options->max_memory && __atomic_load_n(&ctx->preload_bytes, __ATOMIC_RELAXED) + len +
+            sizeof(packet_cache_t) * hdr->packet_cnt > options->max_memory) {
+        dbgx(1, "Preload image %s would exceed --max-memory", path);
+        goto stale;
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise(base, len, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_WILLNEED
+    madvise(base, len, MADV_WILLNEED);
+#endif
+
+    /* the headers are rebased on a copy, the packet data stays mapped */
+    fc->packet_cache = safe_malloc(sizeof(packet_cache_t) * max(hdr->packet_cnt, 1));
+    memcpy(fc->packet_cache, hdr + 1, sizeof(packet_cache_t) * hdr->packet_cnt);
+    data_len = len - hdr->data_off;
+    for (i = 0; i < hdr->packet_cnt; i++) {
+        packet = &fc->packet_cache[i];
+        off = (uint64_t)(uintptr_t)packet->pktdata;
+        if (off > data_len || packet_room(ctx, &packet->pkthdr) > data_len - off) {
+            warnx("Preload image %s is corrupt, preloading %s", path, pcapfile);
+            safe_free(fc->packet_cache);
+            fc->packet_cache = NULL;
+            goto stale;
+        }
+        packet->pktdata = base + hdr->data_off + off;
+
+        if (options->queue_map != NULL)
+            packet->flow_hash = i < options->queue_map_packets ? options->queue_map[i] : 0;
+    }
+
+    fc->packet_cnt = fc->packet_alloc = hdr->packet_cnt;
+    fc->max_caplen = hdr->max_caplen;
+    fc->dlt = hdr->datalink;
+    fc->meta_fn = get_pkt_meta_fn(fc->dlt);
+    fc->image = base;
+    fc->image_len = len;
+    preload_charge(ctx, len + sizeof(packet_cache_t) * fc->packet_alloc);
+
+    dbgx(1, "Mapped " COUNTER_SPEC " packets of file #%d from %s", fc->packet_cnt, idx, path);
+    safe_free(path);
+    return true;
+
+stale:
+    if (base != MAP_FAILED)
+        munmap(base, len);
+    safe_free(path);
 #else
-#error WTF???  We should not be here!
+    (void)ctx;
+    (void)idx;
+#endif
+    return false;
+}
+
+/* the index of the first packet using the --preload-dedup data of packet i */
+static COUNTER
+preload_image_owner(const file_cache_t *fc, COUNTER i)
+{
+    const packet_cache_t *packet = &fc->packet_cache[i];
+    const dedup_table_t *dt = fc->dedup;
+    size_t j;
+
+    if (!packet->shared || dt == NULL)
+        return i;
+
+    for (j = dedup_hash(packet->pktdata, packet->pkthdr.caplen) & (dt->size - 1);
+            dt->slots[j].data != NULL; j = (j + 1) & (dt->size - 1)) {
+        if (dt->slots[j].data == packet->pktdata)
+            return fc->packet_cache[dt->slots[j].owner].pktdata == packet->pktdata ?
+                    dt->slots[j].owner : i;
+    }
+
+    return i;
+}
+
+/* writes len bytes of zeros to fp */
+static int
+preload_image_pad(FILE *fp, size_t len)
+{
+    static const u_char zeros[PRELOAD_IMAGE_ALIGN];
+    size_t n;
+
+    for (; len > 0; len -= n) {
+        n = min(len, sizeof(zeros));
+        if (fwrite(zeros, 1, n, fp) != n)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Writes the cache of file idx out as its --preload-image
+ *
+ * Packet data is written packet after packet, whichever arena block or
+ * mapping it is in, with the room the options give it.  --preload-dedup
+ * packets keep sharing their data.  The image is written next to it and
+ * then renamed over it, so a reader never maps half an image.
+ */
+static void
+preload_image_write(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    const char *pcapfile = options->sources[idx].filename;
+    preload_image_hdr_t hdr;
+    packet_cache_t entry;
+    const packet_cache_t *packet;
+    struct stat st;
+    uint64_t *offs, data_len = 0, room, written = 0;
+    char *path, *tmp;
+    size_t tmp_len;
+    FILE *fp = NULL;
+    COUNTER i, owner;
+    int fd;
+
+    if (stat(pcapfile, &st) < 0)
+        return;
+
+    preload_image_key(ctx, idx, &st, &hdr);
+    offs = safe_malloc(sizeof(uint64_t) * max(fc->packet_cnt, 1));
+    for (i = 0; i < fc->packet_cnt; i++) {
+        if ((owner = preload_image_owner(fc, i)) != i) {
+            offs[i] = offs[owner];
+            continue;
+        }
+
+        offs[i] = data_len;
+        room = packet_room(ctx, &fc->packet_cache[i].pkthdr);
+        data_len += (room + PACKET_ARENA_ALIGN - 1) & ~(uint64_t)(PACKET_ARENA_ALIGN - 1);
+    }
+
+    hdr.max_caplen = fc->max_caplen;
+    hdr.packet_cnt = fc->packet_cnt;
+    hdr.data_off = (sizeof(preload_image_hdr_t) + sizeof(packet_cache_t) * fc->packet_cnt +
+            PRELOAD_IMAGE_ALIGN - 1) & ~(uint64_t)(PRELOAD_IMAGE_ALIGN - 1);
+    hdr.size = hdr.data_off + data_len;
+
+    path = preload_image_path(pcapfile);
+    tmp_len = strlen(path) + 8;
+    tmp = safe_malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        warnx("Unable to write preload image %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        goto done;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto fail;
+
+    for (i = 0; i < fc->packet_cnt; i++) {
+        memcpy(&entry, &fc->packet_cache[i], sizeof(entry));
+        entry.pktdata = (u_char *)(uintptr_t)offs[i];
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+            goto fail;
+    }
+
+    if (preload_image_pad(fp, hdr.data_off - sizeof(hdr) - sizeof(entry) * fc->packet_cnt) < 0)
+        goto fail;
+
+    for (i = 0; i < fc->packet_cnt; i++) {
+        if (offs[i] != written)
+            continue;   /* data of an earlier packet */
+
+        packet = &fc->packet_cache[i];
+        room = packet_room(ctx, &packet->pkthdr);
+        room = (room + PACKET_ARENA_ALIGN - 1) & ~(uint64_t)(PACKET_ARENA_ALIGN - 1);
+        if (fwrite(packet->pktdata, 1, packet->pkthdr.caplen, fp) != packet->pkthdr.caplen ||
+                preload_image_pad(fp, room - packet->pkthdr.caplen) < 0)
+            goto fail;
+        written += room;
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto fail;
+    }
+    fp = NULL;
+
+    if (rename(tmp, path) < 0)
+        goto fail;
+
+    dbgx(1, "Wrote " COUNTER_SPEC " packets of file #%d to %s", fc->packet_cnt, idx, path);
+    goto done;
+
+fail:
+    warnx("Unable to write preload image %s: %s", path, strerror(errno));
+    if (fp != NULL)
+        fclose(fp);
+    unlink(tmp);
+
+done:
+    safe_free(tmp);
+    safe_free(path);
+    safe_free(offs);
+}
+
+/**
+ * Reads the next packet from the file, via the memory mapped reader if
+ * the source has one, or from the source's shared memory ring
+ */
+static inline u_char *
+read_file_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int idx)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+    u_char *pktdata;
+
+    if (src->shm != NULL)
+        return shm_ring_next(src->shm, pkthdr, &src->pkt_nsec, &ctx->abort);
+
+    if (src->mmap != NULL) {
+        pktdata = pcap_mmap_next(src->mmap, pkthdr);
+        src->pkt_nsec = src->mmap->pkt_nsec;
+        src->pkt_iface = src->mmap->pkt_iface;
+        return pktdata;
+    }
+
+    pktdata = (u_char *)pcap_next(pcap, pkthdr);
+#ifdef HAVE_PCAP_TSTAMP_PRECISION
+    /* everything past the reader expects tv_usec to be microseconds */
+    if (pktdata != NULL && src->nsec_pcap) {
+        src->pkt_nsec = pkthdr->ts.tv_usec % 1000;
+        pkthdr->ts.tv_usec /= 1000;
+    }
+#endif
+    return pktdata;
+}
+
+/**
+ * \brief Forgets the read window position of a file
+ *
+ * Call whenever the file is (re)opened, before the first packet is read.
+ * pcap is the libpcap handle of the file, NULL if it's cached.
+ */
+void
+reset_read_window(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+{
+    tcpreplay_source_t *src = &ctx->options->sources[idx];
+
+    src->positioned = false;
+    src->in_window = false;
+    src->window_end = false;
+    src->read_packets = 0;
+    src->first_usec = 0;
+    src->pkt_nsec = 0;
+    src->pkt_iface = 0;
+#ifdef HAVE_PCAP_TSTAMP_PRECISION
+    src->nsec_pcap = pcap != NULL && pcap_get_tstamp_precision(pcap) == PCAP_TSTAMP_PRECISION_NANO;
+#else
+    (void)pcap;
 #endif
+}
+
+/**
+ * Without an index, bisects a classic pcap file on its timestamps for
+ * --start-time.  Files read through libpcap are mapped just for the
+ * search.
+ */
+static void
+seek_read_window_time(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_source_t *src = &options->sources[idx];
+    pcap_mmap_t *pm = src->mmap;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    FILE *fp = NULL;
+    int rcode;
+
+    /* packet numbers are unknown past a bisection */
+    if (options->start_time_us == 0 || options->start_packet > 1 ||
+            src->filename == NULL || strncmp(src->filename, "-", 1) == 0)
+        return;
+
+    if (pm == NULL) {
+        if (pcap == NULL || (fp = pcap_file(pcap)) == NULL)
+            return;
+
+        if ((pm = pcap_mmap_open(src->filename, ebuf)) == NULL) {
+            dbgx(1, "Unable to bisect %s: %s", src->filename, ebuf);
+            return;
+        }
+    }
+
+    rcode = pcap_mmap_seek_time(pm, options->start_time_us, &src->first_usec);
+    if (rcode == 0 && fp != NULL && fseeko(fp, (off_t)pm->offset, SEEK_SET) < 0)
+        rcode = -1;
+
+    if (pm != src->mmap)
+        pcap_mmap_close(pm);
+
+    if (rcode < 0) {
+        dbgx(1, "Unable to seek in %s, reading it from the start", src->filename);
+        src->first_usec = 0;
+        return;
+    }
 
-        dbgx(2, "packet " COUNTER_SPEC " caplen %d", packetnum, pktlen);
+    /* anything but 0 keeps read_window_packet() off first_usec */
+    src->read_packets = 1;
+}
 
+/**
+ * Seeks a freshly opened file to the last indexed packet before the
+ * start of the read window.  Without an index, or if the reader can't
+ * seek, the file is read from the start.
+ */
+static void
+seek_read_window(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_source_t *src = &options->sources[idx];
+    const pcap_index_entry_t *entry;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    COUNTER ts_usec = 0;
+    int rcode;
 
-#if defined TCPREPLAY && defined TCPREPLAY_EDIT
-        if (tcpedit_packet(tcpedit, &pkthdr_ptr, &pktdata, sp->cache_dir) == -1) {
-            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
-        }
-        pktlen = options->use_pkthdr_len ? pkthdr_ptr->len : pkthdr_ptr->caplen;
-#endif
+    src->positioned = true;
 
-        /* do we need to print the packet via tcpdump? */
-#ifdef ENABLE_VERBOSE
-        if (options->verbose)
-            tcpdump_print(options->tcpdump, pkthdr_ptr, pktdata);
-#endif
+    if (!src->index_loaded && src->filename != NULL) {
+        src->index_loaded = true;
+        if ((src->index = pcap_index_load(src->filename, ebuf)) == NULL && ebuf[0] != '\0')
+            warnx("%s", ebuf);
+    }
 
-        if (unique_ip && iteration)
-            /* edit packet to ensure every pass is unique */
-            fast_edit_packet(pkthdr_ptr, &pktdata, ctx->iteration,
-                    options->file_cache[cache_file_idx].cached, datalink);
+    if (src->index == NULL || src->index->entry_cnt == 0) {
+        seek_read_window_time(ctx, pcap, idx);
+        return;
+    }
 
-        /* update flow stats */
-        if (options->flow_stats && !options->file_cache[cache_file_idx].cached)
-            update_flow_stats(ctx, sp, pkthdr_ptr, pktdata, datalink);
+    /* the first entry is always packet 1 */
+    src->first_usec = src->index->entries[0].ts_usec;
+    if (options->start_packet <= 1 && options->start_time_us == 0)
+        return;
 
-        /*
-         * we have to cast the ts, since OpenBSD sucks
-         * had to be special and use bpf_timeval.
-         * Only sleep if we're not in top speed mode (-t)
-         */
-        if (!do_not_timestamp) {
-            /*
-             * this accelerator improves performance by avoiding expensive
-             * time stamps during periods where we have fallen behind in our
-             * sending
-             */
-            if (skip_length) {
-                if ((COUNTER)pktlen < skip_length &&
-                        !((options->limit_send > 0 && (ctx->stats.pkts_sent + skip_length) >= options->limit_send))) {
-                    skip_length -= pktlen;
-                    goto SEND_NOW;
-                }
+    if (options->start_time_us > 0)
+        ts_usec = src->first_usec + options->start_time_us;
 
-                get_packet_timestamp(&ctx->stats.end_time);
-                skip_length = 0;
-            }
+    entry = pcap_index_find(src->index, options->start_packet, ts_usec);
+    if (entry == NULL || entry->packet == 1)
+        return;
 
-            do_sleep(ctx, (struct timeval *)&pkthdr_ptr->ts, &ctx->stats.last_time, pktlen, options->accurate, sp, packetnum,
-                    &ctx->stats.end_time, &start_us, &skip_length);
-        }
+    if (src->mmap != NULL)
+        rcode = pcap_mmap_seek(src->mmap, (size_t)entry->offset);
+    else
+        rcode = pcap_index_seek(pcap, entry);
 
-SEND_NOW:
-        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+    if (rcode < 0) {
+        dbgx(1, "Unable to seek in %s, reading it from the start", src->filename);
+        return;
+    }
 
-        /* write packet out on network */
-        if (sendpacket(sp, pktdata, pktlen, pkthdr_ptr) < (int)pktlen)
-            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+    src->read_packets = entry->packet - 1;
+    dbgx(1, "Seeked %s to packet " COUNTER_SPEC " at offset " COUNTER_SPEC,
+            src->filename, (COUNTER)entry->packet, (COUNTER)entry->offset);
+}
 
-        /* mark the time when we sent the last packet */
-        if (!do_not_timestamp && !skip_length)
-            get_packet_timestamp(&ctx->stats.end_time);
+/**
+ * Reads the next packet of the file inside the --start-packet,
+ * --start-time and --end-time window
+ */
+static u_char *
+read_window_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_source_t *src = &options->sources[idx];
+    u_char *pktdata;
+    COUNTER ts_usec, offset_us;
 
-        /*
-         * track the time of the "last packet sent".  Again, because of OpenBSD
-         * we have to do a memcpy rather then assignment.
-         *
-         * A number of 3rd party tools generate bad timestamps which go backwards
-         * in time.  Hence, don't update the "last" unless pkthdr.ts > last
-         */
-        if (!do_not_timestamp && timercmp(&ctx->stats.last_time, &pkthdr_ptr->ts, <))
-            memcpy(&ctx->stats.last_time, &pkthdr_ptr->ts, sizeof(struct timeval));
+    if (src->window_end)
+        return NULL;
 
-        ctx->stats.pkts_sent ++;
-        ctx->stats.bytes_sent += pktlen;
+    /* a ring can't be seeked, the window is read up to */
+    if (!src->positioned && src->type != source_shm)
+        seek_read_window(ctx, pcap, idx);
 
-        /* print stats during the run? */
-        if (options->stats > 0) {
-            if (gettimeofday(&now, NULL) < 0)
-                errx(-1, "gettimeofday() failed: %s",  strerror(errno));
+    while ((pktdata = read_file_packet(ctx, pcap, pkthdr, idx)) != NULL) {
+        ts_usec = TIMEVAL_TO_MICROSEC(&pkthdr->ts);
+        if (++src->read_packets == 1)
+            src->first_usec = ts_usec;
+        offset_us = ts_usec > src->first_usec ? ts_usec - src->first_usec : 0;
 
-            if (! timerisset(&ctx->stats.last_print)) {
-                memcpy(&ctx->stats.last_print, &now, sizeof(struct timeval));
-            } else {
-                timersub(&now, &ctx->stats.last_print, &print_delta);
-                if (print_delta.tv_sec >= options->stats) {
-                    packet_stats(&ctx->stats);
-                    memcpy(&ctx->stats.last_print, &now, sizeof(struct timeval));
-                }
-            }
+        if (options->end_time_us > 0 && offset_us > options->end_time_us) {
+            src->window_end = true;
+            return NULL;
         }
 
-        /* get the next packet for this file handle depending on which we last used */
-        if (sp == ctx->intf2) {
-            pktdata2 = get_next_packet(ctx, pcap2, &pkthdr2, cache_file_idx2, prev_packet2);
-        } else {
-            pktdata1 = get_next_packet(ctx, pcap1, &pkthdr1, cache_file_idx1, prev_packet1);
+        if (!src->in_window) {
+            if (src->read_packets < options->start_packet || offset_us < options->start_time_us)
+                continue;
+            src->in_window = true;
         }
-    } /* while */
 
-    ++ctx->iteration;
+        return pktdata;
+    }
+
+    return NULL;
 }
 
+/**
+ * Reads the next packet from the file, skipping whatever is outside the
+ * read window
+ */
+static inline u_char *
+read_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int idx)
+{
+    if (ctx->options->read_window)
+        return read_window_packet(ctx, pcap, pkthdr, idx);
 
+    return read_file_packet(ctx, pcap, pkthdr, idx);
+}
 
 /**
  * Gets the next packet to be sent out. This will either read from the pcap file
  * or will retrieve the packet from the internal cache.
  *
- * The parameter prev_packet is used as the parent of the new entry in the cache list.
+ * The parameter prev_packet points at the most recent entry in the cache.
  * This should be NULL on the first call to this function for each file and
- * will be updated as new entries are added (or retrieved) from the cache list.
+ * will be updated as new entries are added (or retrieved) from the cache.
  */
 u_char *
 get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int idx, 
@@ -834,77 +5234,95 @@ get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int
 {
     tcpreplay_opt_t *options = ctx->options;
     u_char *pktdata = NULL;
-    uint32_t pktlen;
 
     /* pcap may be null in cache mode! */
     /* packet_cache_t may be null in file read mode! */
     assert(pkthdr);
 
     /*
-     * Check if we're caching files
+     * Check if we're caching files, or replaying a source_cache
      */
-    if (options->preload_pcap && (prev_packet != NULL)) {
+    if (prev_packet != NULL) {
         /*
          * Yes we are caching files - has this one been cached?
          */
         if (options->file_cache[idx].cached) {
             if (*prev_packet == NULL) {
                 /*
-                 * Get the first packet in the cache list directly from the file
+                 * Get the first packet in the cache
                  */
                 *prev_packet = options->file_cache[idx].packet_cache;
-            } else {
+            } else if (*prev_packet < options->file_cache[idx].packet_cache +
+                    options->file_cache[idx].packet_cnt) {
                 /*
-                 * Get the next packet in the cache list
+                 * Get the next packet in the cache
                  */
-                *prev_packet = (*prev_packet)->next;
+                ++(*prev_packet);
             }
 
-            if (*prev_packet != NULL) {
+            if (*prev_packet != NULL && *prev_packet < options->file_cache[idx].packet_cache +
+                    options->file_cache[idx].packet_cnt) {
+                preload_prefetch(ctx, &options->file_cache[idx], *prev_packet);
                 pktdata = (*prev_packet)->pktdata;
                 memcpy(pkthdr, &((*prev_packet)->pkthdr), sizeof(struct pcap_pkthdr));
+                options->sources[idx].pkt_nsec = (*prev_packet)->ts_nsec;
+                options->sources[idx].pkt_iface = (*prev_packet)->iface;
             }
         } else {
             /*
              * We should read the pcap file, and cache the results
              */
-            pktdata = (u_char *)pcap_next(pcap, pkthdr);
+            pktdata = read_next_packet(ctx, pcap, pkthdr, idx);
             if (pktdata != NULL) {
-                if (*prev_packet == NULL) {
-                    /*
-                     * Create the first packet in the list
-                     */
-                    *prev_packet = safe_malloc(sizeof(packet_cache_t));
-                    options->file_cache[idx].packet_cache = *prev_packet;
-                } else {
-                    /*
-                     * Add a packet to the end of the list
-                     */
-                    (*prev_packet)->next = safe_malloc(sizeof(packet_cache_t));
-                    *prev_packet = (*prev_packet)->next;
-                }
-
-                if (*prev_packet != NULL) {
-                    (*prev_packet)->next = NULL;
-                    pktlen = pkthdr->len;
-
-                    (*prev_packet)->pktdata = safe_malloc(pktlen);
-                    memcpy((*prev_packet)->pktdata, pktdata, pktlen);
-                    memcpy(&((*prev_packet)->pkthdr), pkthdr, sizeof(struct pcap_pkthdr));
-                }
+                *prev_packet = packet_cache_add(ctx, &options->file_cache[idx], pkthdr, pktdata,
+                        pcap != NULL ? pcap_datalink(pcap) : options->file_cache[idx].dlt,
+                        options->sources[idx].mmap, false);
+                (*prev_packet)->ts_nsec = options->sources[idx].pkt_nsec;
+                (*prev_packet)->iface = options->sources[idx].pkt_iface;
             }
         }
     } else {
         /*
          * Read pcap file as normal
          */
-        pktdata = (u_char *)pcap_next(pcap, pkthdr);
+        pktdata = read_next_packet(ctx, pcap, pkthdr, idx);
     }
 
     /* this get's casted to a const on the way out */
     return pktdata;
 }
 
+/**
+ * Like get_next_packet(), but a packet already in the cache is returned
+ * in place: *pkthdr points at its entry instead of a copy in buf.  Both
+ * belong to the cache, so anything that edits the packet works on an
+ * edit_scratch_t copy.
+ */
+static u_char *
+get_next_packet_ref(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *buf,
+        const struct pcap_pkthdr **pkthdr, int idx, packet_cache_t **prev_packet)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    packet_cache_t *next;
+
+    if (prev_packet == NULL || !fc->cached) {
+        *pkthdr = buf;
+        return get_next_packet(ctx, pcap, buf, idx, prev_packet);
+    }
+
+    next = *prev_packet == NULL ? fc->packet_cache : *prev_packet + 1;
+    if (next == NULL || next >= fc->packet_cache + fc->packet_cnt)
+        return NULL;
+
+    *prev_packet = next;
+    preload_prefetch(ctx, fc, next);
+    *pkthdr = &next->pkthdr;
+    options->sources[idx].pkt_nsec = next->ts_nsec;
+    options->sources[idx].pkt_iface = next->iface;
+    return next->pktdata;
+}
+
 /**
  * determines based upon the cachedata which interface the given packet 
  * should go out.  Also rewrites any layer 2 data we might need to adjust.
@@ -923,7 +5341,15 @@ cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
         return NULL;
     }
 
-    result = check_cache(cachedata, packet_num);
+    /* decode the cache a batch at a time rather than bit by bit */
+    if (packet_num < ctx->cache_dir_first ||
+            packet_num >= ctx->cache_dir_first + ctx->cache_dir_cnt) {
+        ctx->cache_dir_first = ((packet_num - 1) & ~(COUNTER)(CACHE_DIR_BATCH - 1)) + 1;
+        ctx->cache_dir_cnt = check_cache_batch(cachedata, options->cache_packets,
+                ctx->cache_dir_first, CACHE_DIR_BATCH, ctx->cache_dirs);
+    }
+
+    result = ctx->cache_dirs[packet_num - ctx->cache_dir_first];
     if (result == TCPR_DIR_NOSEND) {
         dbgx(2, "Cache: Not sending packet " COUNTER_SPEC ".", packet_num);
         return TCPR_DIR_NOSEND;
@@ -945,25 +5371,363 @@ cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
 }
 
 
+/*
+ * --late-policy: accounts for packet counter being late_ns behind its
+ * time and returns false if it is not to be sent.  The timers themselves
+ * catch up or stretch the timeline.
+ */
+static bool
+late_packet(tcpreplay_t *ctx, uint64_t late_ns, COUNTER counter)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    timing_hist_add(&ctx->stats.late, late_ns);
+    if (late_ns <= options->late_threshold_ns)
+        return true;
+
+    ctx->stats.late_packets++;
+    switch (options->late_policy) {
+    case late_drop:
+        ctx->stats.late_dropped++;
+        return false;
+
+    case late_fail:
+        tcpreplay_seterr(ctx, "Packet #" COUNTER_SPEC " was %" PRIu64 " usec late, more than --late-threshold",
+                counter, late_ns / 1000);
+        ctx->late_failed = true;
+        ctx->abort = true;
+        return false;
+
+    default:
+        return true;
+    }
+}
+
+/*
+ * A packet dropped by --late-policy still moves the capture time on, so
+ * the next nap isn't measured from an older packet
+ */
+static inline void
+late_skip(tcpreplay_t *ctx, COUNTER ts_ns)
+{
+    if (ctx->stats.last_ts_ns < ts_ns)
+        ctx->stats.last_ts_ns = ts_ns;
+}
+
+/* whether the timeline moves back for a packet late_ns late */
+static inline bool
+late_stretches(const tcpreplay_t *ctx, uint64_t late_ns)
+{
+    return ctx->options->late_policy == late_stretch && late_ns > ctx->options->late_threshold_ns;
+}
+
+/*
+ * --mbps and --pps pacing is a token bucket, see common/pacer.h
+ */
+
+/*
+ * take cost tokens and return how many nsec to wait before sending,
+ * clearing *send if --late-policy drops the packet
+ */
+static inline uint64_t
+pacer_delay(tcpreplay_t *ctx, uint64_t cost, COUNTER counter, bool *send)
+{
+    pacer_t *pacer = &ctx->pacer;
+    struct timespec now;
+    uint64_t now_ns, wait = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+
+    /* tat is when the packet was due at the latest, 0 before the first one */
+    if (pacer->tat && pacer->tat < now_ns) {
+        *send = late_packet(ctx, now_ns - pacer->tat, counter);
+
+        /* keep the schedule rather than let pacer_wait() restart it from now */
+        if (ctx->options->late_policy == late_catchup || ctx->options->late_policy == late_drop) {
+            pacer_take(pacer, cost);
+            return 0;
+        }
+    }
+
+    wait = pacer_wait(pacer, now_ns);
+
+    update_current_timestamp_trace_entry(ctx->trace, cost, now_ns / 1000,
+            (now_ns + wait) / 1000, pacer->tat / 1000);
+    pacer_take(pacer, cost);
+    return wait;
+}
+
+/*
+ * Sets ctx->nap for a packet worth cost tokens.  Deadline based timers
+ * add up the naps themselves, so they get the cost itself rather than
+ * the wait.  Returns false if --late-policy drops the packet.
+ */
+static inline bool
+pacer_nap(tcpreplay_t *ctx, tcpreplay_accurate accurate, uint64_t cost, COUNTER counter)
+{
+    uint64_t nsec;
+    bool send = true;
+
+    ctx->timing_due_ns += pacer_cost(&ctx->pacer, cost);
+
+    if (accurate == accurate_abs_time || accurate == accurate_txtime)
+        nsec = pacer_cost(&ctx->pacer, cost);
+    else
+        nsec = pacer_delay(ctx, cost, counter, &send);
+
+    NANOSEC_TO_TIMESPEC(nsec, &ctx->nap);
+    return send;
+}
+
+/*
+ * Starts the --multiplier timeline over from now, for the first packet
+ * and after the multiplier changes.
+ */
+static void
+multiplier_restart(tcpreplay_t *ctx)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ctx->mult_start_ns = TIMESPEC_TO_NANOSEC(&now);
+    ctx->mult_now_ns = ctx->mult_start_ns;
+    ctx->mult_due_ns = 0;
+    ctx->mult_ts_ns = 0;
+    ctx->mult_scaled_ns = 0;
+}
+
+/*
+ * Switches to rate, in the unit of the speed mode.  A running pacer keeps
+ * tat, so the new rate takes over from the next packet without a pause
+ * or a burst.
+ */
+static void
+rate_apply(tcpreplay_t *ctx, double rate)
+{
+    tcpreplay_speed_t *speed = &ctx->options->speed;
+    uint64_t tat = ctx->pacer.tat;
+
+    dbgx(1, "rate changed to %f", rate);
+
+    switch (speed->mode) {
+    case speed_mbpsrate:
+        speed->speed = (COUNTER)rate;
+        if (ctx->pacer.nsec_per_token) {
+            pacer_init(&ctx->pacer, 8000000000.0 / rate,
+                    speed->burst ? speed->burst : PACER_BURST_BYTES);
+            ctx->pacer.tat = tat;
+        }
+        break;
+
+    case speed_packetrate:
+        speed->speed = (COUNTER)rate;
+        if (ctx->pacer.nsec_per_token) {
+            pacer_init(&ctx->pacer, 1000000000.0 / rate,
+                    speed->burst ? speed->burst : PACER_BURST_PACKETS);
+            ctx->pacer.tat = tat;
+        }
+        break;
+
+    case speed_multiplier:
+        speed->multiplier = (float)rate;
+        if (ctx->mult_start_ns)
+            multiplier_restart(ctx);
+        break;
+
+    default:
+        break;
+    }
+
+    if (ctx->timeline != NULL && ctx->timeline_next)
+        timeline_target(ctx);
+}
+
+/*
+ * Waits out a --control-shm pause, or a tcpreplay_suspend() if ctl is
+ * false.  A --control-shm pause also ends early on any other change, for
+ * ctl_apply() to look at.  The pacer doesn't save up for the time paused,
+ * but --multiplier would try to catch up with it, so its timeline starts
+ * over.
+ */
+static void
+replay_pause(tcpreplay_t *ctx, bool ctl)
+{
+    struct timespec nap = { 0, CTL_BLOCK_NAP_NSEC };
+
+    dbg(1, "paused");
+    while (!ctx->abort) {
+        if (ctl ? !__atomic_load_n(&ctx->ctl->paused, __ATOMIC_ACQUIRE) ||
+                __atomic_load_n(&ctx->ctl->gen, __ATOMIC_ACQUIRE) != ctx->ctl_seen :
+                !ctx->suspend)
+            break;
+        nanosleep(&nap, NULL);
+    }
+
+    if (ctx->mult_start_ns)
+        multiplier_restart(ctx);
+    dbg(1, "resumed");
+}
+
+/*
+ * Applies what a --control-shm controller changed since the last packet
+ * or batch, returns true if the rate changed.  A switch to another file
+ * stops this one like tcpreplay_abort() does, tcpr_replay_index() then
+ * carries on with the file asked for.
+ */
+static bool
+ctl_apply(tcpreplay_t *ctx)
+{
+    ctl_block_t *ctl = ctx->ctl;
+    tcpreplay_opt_t *options = ctx->options;
+    bool changed = false;
+    struct timespec now;
+    uint32_t gen, rate_gen, source_gen;
+    int32_t source;
+    double rate;
+
+    do {
+        gen = __atomic_load_n(&ctl->gen, __ATOMIC_ACQUIRE);
+        ctx->ctl_seen = gen;
+
+        rate_gen = __atomic_load_n(&ctl->rate_gen, __ATOMIC_ACQUIRE);
+        if (rate_gen != ctx->ctl_rate_seen) {
+            ctx->ctl_rate_seen = rate_gen;
+            rate = ctl->rate;
+            if (rate > 0.0 && (options->speed.mode == speed_multiplier || rate >= 1.0)) {
+                rate_apply(ctx, rate);
+                changed = true;
+            } else {
+                warnx("--control-shm: ignoring invalid rate %f", rate);
+            }
+        }
+
+        source_gen = __atomic_load_n(&ctl->source_gen, __ATOMIC_ACQUIRE);
+        if (source_gen != ctx->ctl_source_seen) {
+            ctx->ctl_source_seen = source_gen;
+            source = ctl->source;
+            if (options->merge || options->dualfile || source < 0 ||
+                    source >= options->source_cnt) {
+                warnx("--control-shm: can't switch to source %d", source);
+            } else {
+                ctx->ctl_switch = source;
+                ctx->abort = true;
+            }
+        }
+
+        __atomic_store_n(&ctl->is_paused, __atomic_load_n(&ctl->paused, __ATOMIC_ACQUIRE),
+                __ATOMIC_RELAXED);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ctl->applied_ns = TIMESPEC_TO_NANOSEC(&now);
+        ctl->pkts_sent = ctx->stats.pkts_sent;
+        ctl->bytes_sent = ctx->stats.bytes_sent;
+        __atomic_store_n(&ctl->seen, gen, __ATOMIC_RELEASE);
+
+        if (ctl->is_paused && !ctx->abort)
+            replay_pause(ctx, true);
+
+        /* replay_pause() comes back early for any other change */
+    } while (!ctx->abort && __atomic_load_n(&ctl->gen, __ATOMIC_ACQUIRE) != ctx->ctl_seen);
+
+    if (!ctx->abort)
+        __atomic_store_n(&ctl->is_paused, 0, __ATOMIC_RELEASE);
+
+    return changed;
+}
+
+/*
+ * Applies a tcpreplay_change_rate() or --control-shm change made since
+ * the last packet, and waits out a pause.  Returns true if the rate
+ * changed.
+ */
+static inline bool
+rate_tick(tcpreplay_t *ctx)
+{
+    uint32_t gen = ctx->rate_gen;
+    bool changed = false;
+
+    if (ctx->ctl != NULL &&
+            __atomic_load_n(&ctx->ctl->gen, __ATOMIC_ACQUIRE) != ctx->ctl_seen)
+        changed = ctl_apply(ctx);
+
+    if (ctx->suspend)
+        replay_pause(ctx, false);
+
+    if (gen == ctx->rate_seen)
+        return changed;
+
+    __sync_synchronize();
+    ctx->rate_seen = gen;
+    rate_apply(ctx, ctx->rate_pending);
+    return true;
+}
+
+#ifdef HAVE_SO_TXTIME
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+
+/* how far ahead of its launch time a packet is handed to the kernel */
+#define TXTIME_LEAD_NSEC 2000000
+
+/**
+ * \brief The accurate_txtime "sleep"
+ *
+ * Rather than waiting out the gap, add it to the launch time of the
+ * previous packet and stamp the next packet with the result.  We only
+ * sleep to keep the queue no more than TXTIME_LEAD_NSEC deep.  Whenever
+ * we've fallen behind (and on the first packet) the schedule restarts
+ * TXTIME_LEAD_NSEC from now, since the ETF qdisc drops packets whose
+ * launch time has already passed, whatever the --late-policy.  Returns
+ * false if --late-policy drops the packet.
+ */
+static bool
+txtime_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec nap, COUNTER counter)
+{
+    struct timespec now;
+    uint64_t now_ns;
+
+    clock_gettime(CLOCK_TAI, &now);
+    now_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    ctx->txtime_next += (uint64_t)nap.tv_sec * 1000000000 + nap.tv_nsec;
+    if (ctx->txtime_next <= now_ns) {
+        dbgx(2, "txtime: restarting schedule %" PRIu64 " nsec late",
+                now_ns - ctx->txtime_next);
+
+        /* the first packet starts the schedule rather than being late */
+        if (ctx->txtime_next > (uint64_t)nap.tv_sec * 1000000000 + nap.tv_nsec &&
+                !late_packet(ctx, now_ns - ctx->txtime_next, counter))
+            return false;
+
+        ctx->txtime_next = now_ns + TXTIME_LEAD_NSEC;
+    } else if (ctx->txtime_next > now_ns + TXTIME_LEAD_NSEC) {
+        NANOSEC_TO_TIMESPEC(ctx->txtime_next - now_ns - TXTIME_LEAD_NSEC, &nap);
+        nanosleep_sleep(nap);
+    }
+
+    sendpacket_set_txtime(sp, ctx->txtime_next);
+    return true;
+}
+#endif /* HAVE_SO_TXTIME */
+
 /**
- * Given the timestamp on the current packet and the last packet sent,
- * calculate the appropriate amount of time to sleep and do so.
+ * Sleeps until the packet captured at ts_ns is due.  The nap is measured
+ * from stats.last_ts_ns, the newest packet sent so far.  Returns false if
+ * the packet is too late to send under --late-policy.
  */
-static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
-        struct timeval *last, int len, tcpreplay_accurate accurate,
-        sendpacket_t *sp, COUNTER counter, timestamp_t *sent_timestamp,
-        COUNTER *start_us, COUNTER *skip_length)
+static bool do_sleep(tcpreplay_t *ctx, COUNTER ts_ns, int len, tcpreplay_accurate accurate,
+        sendpacket_t *sp, COUNTER counter, timestamp_t *sent_timestamp)
 {
     tcpreplay_opt_t *options = ctx->options;
-    struct timeval nap_for;
     struct timespec nap_this_time;
-    uint64_t ppnsec;                /* packets per nsec */
-    COUNTER now_us;
+    COUNTER last_ns = ctx->stats.last_ts_ns;
+    bool send = true;
 
     /* accelerator time? */
     if (ctx->skip_packets > 0) {
         (ctx->skip_packets)--;
-        return;
+        return true;
     }
 
     /* 
@@ -974,12 +5738,15 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
         ctx->skip_packets = options->speed.pps_multi - 1;
         if (ctx->first_time) {
             ctx->first_time = 0;
-            return;
+            return true;
         }
     }
 
-    dbgx(4, "This packet time: " TIMEVAL_FORMAT, time->tv_sec, time->tv_usec);
-    dbgx(4, "Last packet time: " TIMEVAL_FORMAT, last->tv_sec, last->tv_usec);
+    dbgx(4, "This packet time: " COUNTER_SPEC " nsec", ts_ns);
+    dbgx(4, "Last packet time: " COUNTER_SPEC " nsec", last_ns);
+
+    if (!ctx->pass_pkts++)
+        ctx->pass_first_ns = ts_ns;
 
     /* If top speed, you shouldn't even be here */
     assert(options->speed.mode != speed_topspeed);
@@ -988,21 +5755,33 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
     case speed_multiplier:
         /* 
          * Replay packets a factor of the time they were originally sent.
+         * The capture time since the start of the timeline is scaled as a
+         * whole, so the naps don't drift however large the multiplier.
          */
-        if (timerisset(last)) {
-            if (timercmp(time, last, <)) {
+        if (!ctx->mult_start_ns)
+            multiplier_restart(ctx);
+
+        if (ctx->schedule_nap != NULL) {
+            NANOSEC_TO_TIMESPEC(*ctx->schedule_nap, &ctx->nap);
+        } else if (last_ns != 0 || ctx->loop_wrap) {
+            if (ts_ns < last_ns && !ctx->loop_wrap) {
                 /* Packet has gone back in time!  Don't sleep and warn user */
                 warnx("Packet #" COUNTER_SPEC " has gone back in time!", counter);
                 timesclear(&ctx->nap);
             } else {
                 /* time has increased or is the same, so handle normally */
-                timersub(time, last, &nap_for);
-                dbgx(3, "original packet delta time: " TIMEVAL_FORMAT, nap_for.tv_sec, nap_for.tv_usec);
-
-                TIMEVAL_TO_TIMESPEC(&nap_for, &ctx->nap);
-                dbgx(3, "original packet delta timv: " TIMESPEC_FORMAT, ctx->nap.tv_sec, ctx->nap.tv_nsec);
-                timesdiv_float(&ctx->nap, options->speed.multiplier);
-                dbgx(3, "original packet delta/div: " TIMESPEC_FORMAT, ctx->nap.tv_sec, ctx->nap.tv_nsec);
+                uint64_t scaled;
+
+                /* the capture starts over, the loop gap after the last pass */
+                if (ctx->loop_wrap)
+                    last_ns = ts_ns - ctx->loop_gap_ns;
+
+                ctx->mult_ts_ns += ts_ns - last_ns;
+                scaled = (uint64_t)((double)ctx->mult_ts_ns / options->speed.multiplier);
+                NANOSEC_TO_TIMESPEC(scaled - ctx->mult_scaled_ns, &ctx->nap);
+                ctx->mult_scaled_ns = scaled;
+                dbgx(3, "original packet delta: " COUNTER_SPEC " nsec, scaled nap: " TIMESPEC_FORMAT,
+                        ts_ns - last_ns, ctx->nap.tv_sec, ctx->nap.tv_nsec);
             }
         } else {
             /* Don't sleep if this is our first packet */
@@ -1013,36 +5792,28 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
     case speed_mbpsrate:
         /* 
          * Ignore the time supplied by the capture file and send data at
-         * a constant 'rate' (bytes per second).
+         * a constant 'rate' (bits per second).  Tokens are bytes.
          */
-        now_us = TIMSTAMP_TO_MICROSEC(sent_timestamp);
-        if (now_us) {
-            COUNTER bps = (COUNTER)options->speed.speed;
-            COUNTER bits_sent = ((ctx->stats.bytes_sent + (COUNTER)len) * 8LL);
-            /* bits * 1000000 divided by bps = microseconds */
-            COUNTER next_tx_us = (bits_sent * 1000000) / bps;
-            COUNTER tx_us = now_us - *start_us;
-            if (next_tx_us > tx_us)
-                NANOSEC_TO_TIMESPEC((next_tx_us - tx_us) * 1000LL, &ctx->nap);
-            else if (tx_us > next_tx_us) {
-                tx_us = now_us - *start_us;
-                *skip_length = ((tx_us - next_tx_us) * bps) / 8000000;
-            }
-            update_current_timestamp_trace_entry(ctx->stats.bytes_sent + (COUNTER)len, now_us, tx_us, next_tx_us);
-        }
+        if (!ctx->pacer.nsec_per_token)
+            pacer_init(&ctx->pacer, 8000000000.0 / options->speed.speed,
+                    options->speed.burst ? options->speed.burst : PACER_BURST_BYTES);
 
+        send = pacer_nap(ctx, accurate, len, counter);
         dbgx(3, "packet size %d\t\tequals\tnap " TIMESPEC_FORMAT, len,
                 ctx->nap.tv_sec, ctx->nap.tv_nsec);
         break;
 
     case speed_packetrate:
-        /* only need to calculate this the first time */
-        if (! timesisset(&ctx->nap)) {
-            /* run in packets/sec */
-            ppnsec = 1000000000 / options->speed.speed * (options->speed.pps_multi > 0 ? options->speed.pps_multi : 1);
-            NANOSEC_TO_TIMESPEC(ppnsec, &ctx->nap);
-            dbgx(1, "sending %d packet(s) per %lu nsec", (options->speed.pps_multi > 0 ? options->speed.pps_multi : 1), ctx->nap.tv_nsec);
+        /* run in packets/sec, tokens are packets */
+        if (!ctx->pacer.nsec_per_token) {
+            pacer_init(&ctx->pacer, 1000000000.0 / options->speed.speed,
+                    options->speed.burst ? options->speed.burst : PACER_BURST_PACKETS);
+            dbgx(1, "sending %d packet(s) per interval",
+                    (options->speed.pps_multi > 0 ? options->speed.pps_multi : 1));
         }
+
+        send = pacer_nap(ctx, accurate, options->speed.pps_multi > 0 ? options->speed.pps_multi : 1,
+                counter);
         break;
 
     case speed_oneatatime:
@@ -1057,7 +5828,7 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
         ctx->skip_packets--;
 
         /* leave do_sleep() */
-        return;
+        return true;
 
         break;
 
@@ -1068,9 +5839,19 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
 
     memcpy(&nap_this_time, &ctx->nap, sizeof(nap_this_time));
 
-    /* don't sleep if nap = {0, 0} */
-    if (!timesisset(&nap_this_time))
-        return;
+    /* the newest packet is the first of the pass now, not the last of the one before */
+    if (ctx->loop_wrap) {
+        ctx->loop_wrap = false;
+        ctx->stats.last_ts_ns = ts_ns;
+    }
+
+    /*
+     * don't sleep if nap = {0, 0}, but txtime still has to stamp the
+     * packet and abstime has to start its schedule
+     */
+    if (!timesisset(&nap_this_time) && accurate != accurate_txtime &&
+            accurate != accurate_abs_time)
+        return send;
 
     /* do we need to limit the total time we sleep? */
     if (timesisset(&(options->maxsleep)) && (timescmp(&nap_this_time, &(options->maxsleep), >))) {
@@ -1080,6 +5861,37 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
         memcpy(&nap_this_time, &(options->maxsleep), sizeof(struct timespec));
     }
 
+    if (options->speed.mode == speed_multiplier) {
+        ctx->timing_due_ns += TIMESPEC_TO_NANOSEC(&nap_this_time);
+
+        /*
+         * the relative timers sleep until start + due rather than for the
+         * nap, so time spent sending doesn't add up.  Behind schedule,
+         * every packet already due goes out without a sleep or even a
+         * clock read until we catch up with the last reading, so their
+         * lateness is measured against that reading.
+         */
+        if (accurate != accurate_abs_time && accurate != accurate_txtime) {
+            struct timespec now;
+            uint64_t due;
+
+            ctx->mult_due_ns += TIMESPEC_TO_NANOSEC(&nap_this_time);
+            due = ctx->mult_start_ns + ctx->mult_due_ns;
+            if (due > ctx->mult_now_ns) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                ctx->mult_now_ns = TIMESPEC_TO_NANOSEC(&now);
+            }
+
+            if (due <= ctx->mult_now_ns) {
+                if (late_stretches(ctx, ctx->mult_now_ns - due))
+                    ctx->mult_start_ns += ctx->mult_now_ns - due;
+                return late_packet(ctx, ctx->mult_now_ns - due, counter);
+            }
+
+            NANOSEC_TO_TIMESPEC(due - ctx->mult_now_ns, &nap_this_time);
+        }
+    }
+
     dbgx(2, "Sleeping:                   " TIMESPEC_FORMAT, nap_this_time.tv_sec, nap_this_time.tv_nsec);
 
     /*
@@ -1108,12 +5920,63 @@ static void do_sleep(tcpreplay_t *ctx, struct timeval *time,
         nanosleep_sleep(nap_this_time);
         break;
 
+    case accurate_hybrid:
+        hybrid_sleep(nap_this_time, &ctx->sleep_spin_nsec);
+        break;
+
+#if defined(__i386__) || defined(__x86_64__)
+    case accurate_rdtsc:
+        rdtsc_sleep(nap_this_time);
+        break;
+#endif
+
+    case accurate_abs_time:
+        /*
+         * every deadline is an offset from the first packet, so unlike the
+         * relative timers the time spent sending doesn't add up as drift
+         */
+        if (!ctx->abs_deadline && ctx->start_deadline) {
+            /* --start-at: the timeline starts at the agreed instant */
+            ctx->abs_deadline = ctx->start_deadline;
+            ctx->start_deadline = 0;
+        } else if (!ctx->abs_deadline) {
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ctx->abs_deadline = TIMESPEC_TO_NANOSEC(&now);
+        }
+        ctx->abs_deadline += TIMESPEC_TO_NANOSEC(&nap_this_time);
+        if (!ctx->deadline_only) {
+            struct timespec now;
+            uint64_t now_ns;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            now_ns = TIMESPEC_TO_NANOSEC(&now);
+            if (ctx->abs_deadline < now_ns) {
+                uint64_t late_ns = now_ns - ctx->abs_deadline;
+
+                if (late_stretches(ctx, late_ns))
+                    ctx->abs_deadline = now_ns;
+                send = late_packet(ctx, late_ns, counter);
+            } else {
+                absolute_sleep(ctx->abs_deadline, &ctx->sleep_spin_nsec);
+            }
+        }
+        break;
+
+#ifdef HAVE_SO_TXTIME
+    case accurate_txtime:
+        send = txtime_sleep(ctx, sp, nap_this_time, counter);
+        break;
+#endif
+
     default:
         errx(-1, "Unknown timer mode %d", accurate);
     }
 
     dbgx(2, "sleep delta: " TIMEVAL_FORMAT, sent_timestamp->tv_sec, sent_timestamp->tv_usec);
 
+    return send;
 }
 
 /**
@@ -25,9 +25,26 @@
 #define __SEND_PACKETS_H__
 
 void send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx);
+void send_loop_select(tcpreplay_t *ctx);
+void wire_flush(tcpreplay_t *ctx);
 void send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int idx1, pcap_t *pcap2, int idx2);
+void send_merged_packets(tcpreplay_t *ctx, pcap_t **pcaps, int cnt);
 void *cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num);
 void preload_pcap_file(tcpreplay_t *ctx, int idx);
+void preload_pcap_files(tcpreplay_t *ctx, int cnt);
+void reset_read_window(tcpreplay_t *ctx, pcap_t *pcap, int idx);
+void packet_cache_load(tcpreplay_t *ctx, int idx);
+void packet_cache_free(file_cache_t *fc);
+COUNTER packet_cache_bytes(const file_cache_t *fc);
+COUNTER preload_memory(const tcpreplay_t *ctx);
+void fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata,
+        uint32_t iteration, bool cached, int datalink);
+#ifdef HAVE_LIBPTHREAD
+void send_packets_workers(tcpreplay_t *ctx, int idx);
+void send_packets_window_stop(tcpreplay_t *ctx);
+void send_packets_sched_sender(tcpreplay_t *ctx, int id);
+void send_packets_sched_helper(tcpreplay_t *ctx);
+#endif
 //const u_char * get_next_packet(pcap_t *pcap, struct pcap_pkthdr *pkthdr, 
 // todo delete       int file_idx, packet_cache_t **prev_packet);
 
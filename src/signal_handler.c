@@ -42,6 +42,7 @@ static struct timeval suspend_end;
 static void suspend_handler(int signo);
 static void continue_handler(int signo);
 static void abort_handler(int signo);
+static void rate_profile_handler(int signo);
 
 extern tcpreplay_t *ctx;
 
@@ -62,6 +63,10 @@ init_signal_handlers()
     signal(SIGCONT, continue_handler);
     signal(SIGINT, abort_handler);
 
+    /* otherwise SIGHUP keeps its default of ending tcpreplay */
+    if (ctx && ctx->rate_profile != NULL)
+        signal(SIGHUP, rate_profile_handler);
+
     reset_suspend_time();
 }
 
@@ -134,3 +139,14 @@ abort_handler(int signo)
     }
 }
 
+/**
+ * \brief rate profile handler
+ *
+ * Signal handler for SIGHUP, the send loop reloads --rate-profile
+ */
+static void
+rate_profile_handler(int signo)
+{
+    if (signo == SIGHUP && ctx)
+        ctx->rate_profile_reload = true;
+}
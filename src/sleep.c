@@ -41,8 +41,72 @@
 #include <architecture/i386/pio.h>
 #endif
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
 float gettimeofday_sleep_value;
 int ioport_sleep_value;
+uint64_t rdtsc_ticks_per_msec;
+
+/*
+ * Learn how late clock_nanosleep() wakes us up on this box, which is
+ * anything from a few usec on a PREEMPT_RT kernel to 50-100usec with the
+ * default timer slack.  Takes the worst of a few short sleeps plus 25%.
+ */
+uint64_t
+sleep_spin_calibrate(void)
+{
+    struct timespec now, wake;
+    uint64_t target, late, worst = 0, spin;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        target = TIMESPEC_TO_NANOSEC(&now) + 50000;
+        NANOSEC_TO_TIMESPEC(target, &wake);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = TIMESPEC_TO_NANOSEC(&now) - target;
+        if (late > worst)
+            worst = late;
+    }
+
+    spin = min(worst + worst / 4, ABSOLUTE_SLEEP_SPIN_MAX_NSEC);
+    dbgx(1, "sleep: wakeup latency %" PRIu64 " nsec, spinning for the last %" PRIu64 " nsec",
+            worst, spin);
+    return spin;
+}
+
+/*
+ * Measure the rate of the time stamp counter against CLOCK_MONOTONIC.
+ * Takes about 20ms.
+ */
+void
+rdtsc_sleep_init(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    struct timespec start, end, nap = { 0, 20000000 };
+    uint64_t tsc_start, tsc_end, nsec;
+    unsigned int eax, ebx, ecx, edx;
+
+    /* CPUID.80000007H:EDX[8] is set for an invariant TSC */
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        warnx("%s", "CPU does not report an invariant TSC, rdtsc timing may drift");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tsc_start = rdtsc();
+    nanosleep(&nap, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tsc_end = rdtsc();
+
+    nsec = TIMESPEC_TO_NANOSEC(&end) - TIMESPEC_TO_NANOSEC(&start);
+    rdtsc_ticks_per_msec = (tsc_end - tsc_start) * 1000000 / nsec;
+    dbgx(1, "rdtsc: %" PRIu64 " ticks per msec", rdtsc_ticks_per_msec);
+#else
+    err(-1, "Platform does not support rdtsc for timing");
+#endif
+}
 
 
 void 
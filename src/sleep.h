@@ -43,6 +43,8 @@
 #endif
 
 
+#include <time.h>
+
 #ifndef __SLEEP_H__
 #define __SLEEP_H__
 
@@ -70,6 +72,101 @@ gettimeofday_sleep(struct timespec nap)
     } while (timercmp(&now, &sleep_until, <));
 }
 
+/*
+ * How early absolute_sleep() wakes up to spin out the rest of the wait, ie.
+ * how late the kernel wakes us from clock_nanosleep().  Starts out at
+ * ABSOLUTE_SLEEP_SPIN_NSEC, sleep_spin_calibrate() measures it and it then
+ * tracks the observed wakeup latency, rising fast and decaying slowly,
+ * capped at ABSOLUTE_SLEEP_SPIN_MAX_NSEC.
+ */
+#define ABSOLUTE_SLEEP_SPIN_NSEC        100000
+#define ABSOLUTE_SLEEP_SPIN_MAX_NSEC    2000000
+
+uint64_t sleep_spin_calibrate(void);
+
+/*
+ * Sleep until an absolute CLOCK_MONOTONIC deadline in nsec.  Long waits are
+ * left to clock_nanosleep(), but the last *spin_nsec are spun out since
+ * the kernel's wakeup latency is much coarser than packet gaps on a fast
+ * link.  Deadlines already in the past return immediately.  *spin_nsec
+ * adapts to the wakeups seen, each context keeps its own.
+ */
+static inline void
+absolute_sleep(uint64_t deadline, uint64_t *spin_nsec)
+{
+    uint64_t sleep_spin_nsec = *spin_nsec;
+    struct timespec now, wake;
+    uint64_t now_ns, wake_ns, late;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = TIMESPEC_TO_NANOSEC(&now);
+    if (deadline > now_ns + sleep_spin_nsec) {
+        wake_ns = deadline - sleep_spin_nsec;
+        NANOSEC_TO_TIMESPEC(wake_ns, &wake);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+
+        /* back off quickly after a late wakeup, creep back afterwards */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_ns = TIMESPEC_TO_NANOSEC(&now);
+        late = min((now_ns - wake_ns) * 5 / 4, (uint64_t)ABSOLUTE_SLEEP_SPIN_MAX_NSEC);
+        if (late > sleep_spin_nsec)
+            *spin_nsec = (sleep_spin_nsec + late) / 2;
+        else
+            *spin_nsec = (sleep_spin_nsec * 15 + late) / 16;
+    }
+
+    while (now_ns < deadline) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_ns = TIMESPEC_TO_NANOSEC(&now);
+    }
+}
+
+/*
+ * Relative version of absolute_sleep(): the CPU only spins for the tail
+ * of the gap, so multi-second gaps cost next to nothing but short ones
+ * stay as accurate as gettimeofday_sleep().
+ */
+static inline void
+hybrid_sleep(const struct timespec nap, uint64_t *spin_nsec)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    absolute_sleep(TIMESPEC_TO_NANOSEC(&now) + TIMESPEC_TO_NANOSEC(&nap), spin_nsec);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * rdtsc_sleep() spins on the CPU's time stamp counter, which costs a
+ * couple of dozen cycles per read and resolves well under a nanosecond.
+ * It assumes an invariant TSC (constant rate, synchronized across cores)
+ * which every x86 CPU of the last decade has.
+ */
+extern uint64_t rdtsc_ticks_per_msec;
+
+/* before calling rdtsc_sleep(), you have to call rdtsc_sleep_init() */
+void rdtsc_sleep_init(void);
+
+static inline uint64_t
+rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+rdtsc_sleep(const struct timespec nap)
+{
+    uint64_t until;
+
+    until = rdtsc() + TIMESPEC_TO_NANOSEC(&nap) * rdtsc_ticks_per_msec / 1000000;
+    while (rdtsc() < until)
+        __asm__ __volatile__ ("pause");
+}
+#endif /* __i386__ || __x86_64__ */
+
 #ifdef HAVE_SELECT
 /* 
  * sleep for some time using the select() call timeout method.   This is 
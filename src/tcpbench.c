@@ -0,0 +1,870 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro-benchmarks for the per packet code paths of tcpreplay and
+ * tcprewrite.  Every input is generated from a fixed seed, so two runs on
+ * the same machine measure exactly the same work.  Run via `make bench`.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "tcpreplay_api.h"
+#include "tcpreplay_edit_opts.h"
+#include "tcpedit/tcpedit.h"
+#include "tcpedit/checksum.h"
+#include "tcpedit/plugins/dlt_utils.h"
+#include "tcpedit/plugins/dlt_en10mb/en10mb.h"
+#include "send_packets.h"
+#include "common/pcap_writer.h"
+
+/* send_packets.c and friends expect these from the program */
+int debug = 0;
+tcpreplay_t *ctx;
+
+#define BENCH_PKTS          1024        /* distinct generated packets */
+#define BENCH_PKT_STRIDE    2048        /* room for any L2 header + 1500 */
+#define BENCH_ITERATIONS    2000000
+#define BENCH_PREFETCH_REPS 256         /* copies of the packets, to outgrow the CPU caches */
+
+typedef struct bench_s {
+    const char *name;
+    void (*run)(COUNTER iterations);
+} bench_t;
+
+static volatile uint32_t bench_sink;    /* keeps results from being optimised away */
+static char *bench_intf;                /* -i: also replay to this interface */
+static uint32_t bench_rand_state;
+
+/* xorshift32, seeded the same for every case */
+static inline uint32_t
+bench_rand(void)
+{
+    uint32_t x = bench_rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return bench_rand_state = x;
+}
+
+static void
+bench_srand(void)
+{
+    bench_rand_state = 0x2545f491;
+}
+
+static inline uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void
+bench_report(const char *name, COUNTER iterations, uint64_t nsec)
+{
+    double ns = (double)nsec / (double)iterations;
+
+    printf("%-40s %10.1f ns/pkt %10.2f Mpps\n", name, ns,
+            ns > 0.0 ? 1000.0 / ns : 0.0);
+}
+
+/* like bench_report() for cases which move whole frames */
+static void
+bench_report_rate(const char *name, COUNTER pkts, COUNTER bytes, uint64_t nsec)
+{
+    double secs = (double)nsec / 1000000000.0;
+
+    if (secs <= 0.0)
+        secs = 1e-9;
+    printf("%-40s %10.2f Mpps %10.2f Gbps\n", name,
+            (double)pkts / secs / 1000000.0,
+            (double)bytes * 8.0 / secs / 1000000000.0);
+}
+
+/*
+ * write an IPv4/TCP packet of len bytes (from the IP header on) to buf,
+ * addressed by the flow number; returns len
+ */
+static int
+bench_ipv4_tcp(u_char *buf, int len, uint32_t flow)
+{
+    uint16_t port = (uint16_t)(1024 + (flow & 0x7fff));
+
+    memset(buf, 0x5a, len);
+    buf[0] = 0x45;
+    buf[1] = 0;
+    buf[2] = (u_char)(len >> 8);
+    buf[3] = (u_char)len;
+    buf[4] = buf[5] = 0;
+    buf[6] = 0x40;                  /* DF */
+    buf[7] = 0;
+    buf[8] = 64;
+    buf[9] = IPPROTO_TCP;
+    buf[10] = buf[11] = 0;
+    buf[12] = 10; buf[13] = (u_char)(flow >> 16); buf[14] = (u_char)(flow >> 8); buf[15] = (u_char)flow;
+    buf[16] = 192; buf[17] = 168; buf[18] = (u_char)(flow >> 8); buf[19] = 1;
+
+    /* TCP */
+    buf[20] = (u_char)(port >> 8);
+    buf[21] = (u_char)port;
+    buf[22] = 0;
+    buf[23] = 80;
+    buf[32] = 0x50;                 /* 20 byte header */
+    buf[33] = 0x18;                 /* PSH ACK */
+    buf[34] = 0xff;
+    buf[35] = 0xff;
+    buf[36] = buf[37] = buf[38] = buf[39] = 0;
+
+    return len;
+}
+
+/* Ethernet header + IPv4/TCP, len is the frame length */
+static int
+bench_ether_tcp(u_char *buf, int len, uint32_t flow)
+{
+    static const u_char hdr[TCPR_ETH_H] = {
+        0x00, 0x1b, 0x21, 0x00, 0x00, 0x02,
+        0x00, 0x1b, 0x21, 0x00, 0x00, 0x01,
+        0x08, 0x00
+    };
+
+    memcpy(buf, hdr, TCPR_ETH_H);
+    return TCPR_ETH_H + bench_ipv4_tcp(buf + TCPR_ETH_H, len - TCPR_ETH_H, flow);
+}
+
+/* a pool of BENCH_PKTS Ethernet frames, one flow each */
+static u_char *
+bench_ether_pool(int len, struct pcap_pkthdr *pkthdrs)
+{
+    u_char *pool = safe_malloc(BENCH_PKTS * BENCH_PKT_STRIDE);
+    int i;
+
+    for (i = 0; i < BENCH_PKTS; i++) {
+        bench_ether_tcp(pool + i * BENCH_PKT_STRIDE, len, (uint32_t)i);
+        pkthdrs[i].caplen = pkthdrs[i].len = len;
+        pkthdrs[i].ts.tv_sec = 1000000000 + i / 100;
+        pkthdrs[i].ts.tv_usec = (i % 100) * 10000;
+    }
+
+    return pool;
+}
+
+/*
+ * do_checksum(): the IP header and the L4 checksum of one packet, like
+ * --fixcsum does
+ */
+static void
+bench_checksum(COUNTER iterations)
+{
+    static const int sizes[] = { 64, 512, 1500 };
+    tcpedit_t *te;
+    u_char *buf = safe_malloc(BENCH_PKT_STRIDE);
+    char name[64];
+    uint64_t start;
+    COUNTER i;
+    size_t s;
+    int l4len;
+
+    if (tcpedit_init(&te, DLT_EN10MB) < 0)
+        errx(-1, "tcpedit_init: %s", tcpedit_geterr(te));
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bench_ipv4_tcp(buf, sizes[s] - TCPR_ETH_H, 1);
+        l4len = sizes[s] - TCPR_ETH_H - TCPR_IPV4_H;
+        start = bench_now();
+        for (i = 0; i < iterations; i++) {
+            do_checksum(te, buf, IPPROTO_TCP, l4len);
+            do_checksum(te, buf, IPPROTO_IP, TCPR_IPV4_H);
+        }
+        snprintf(name, sizeof(name), "do_checksum ipv4/tcp %d", sizes[s]);
+        bench_report(name, iterations, bench_now() - start);
+
+        /* same addresses, so only the protocol field and the header move */
+        buf[9] = IPPROTO_UDP;
+        buf[24] = (u_char)(l4len >> 8);
+        buf[25] = (u_char)l4len;
+        buf[26] = buf[27] = 0xff;   /* UDP checksums of 0 are left alone */
+        start = bench_now();
+        for (i = 0; i < iterations; i++)
+            do_checksum(te, buf, IPPROTO_UDP, l4len);
+        snprintf(name, sizeof(name), "do_checksum ipv4/udp %d", sizes[s]);
+        bench_report(name, iterations, bench_now() - start);
+    }
+
+    bench_sink = buf[26];
+    tcpedit_close(te);
+    safe_free(buf);
+}
+
+/* flow_decode() against a table which already knows all the flows */
+static void
+bench_flow(COUNTER iterations)
+{
+    struct pcap_pkthdr pkthdrs[BENCH_PKTS];
+    flow_hash_table_t *fht;
+    u_char *pool = bench_ether_pool(64, pkthdrs);
+    uint64_t start;
+    uint32_t sum = 0;
+    COUNTER i;
+    int p;
+
+    fht = flow_hash_table_init(BENCH_PKTS);
+    for (p = 0; p < BENCH_PKTS; p++)
+        flow_decode(fht, &pkthdrs[p], pool + p * BENCH_PKT_STRIDE, DLT_EN10MB, 0, NULL);
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        p = (int)(i & (BENCH_PKTS - 1));
+        sum += flow_decode(fht, &pkthdrs[p], pool + p * BENCH_PKT_STRIDE,
+                DLT_EN10MB, 0, NULL);
+    }
+    bench_report("flow_decode 1024 flows", iterations, bench_now() - start);
+
+    /* every packet a new flow, in a table which has to keep growing */
+    flow_hash_table_release(fht);
+    fht = flow_hash_table_init(BENCH_PKTS);
+    bench_srand();
+    for (p = 0; p < BENCH_PKTS; p++)
+        pool[p * BENCH_PKT_STRIDE + TCPR_ETH_H + 19] = 2;
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        u_char *pkt;
+
+        p = (int)(i & (BENCH_PKTS - 1));
+        pkt = pool + p * BENCH_PKT_STRIDE + TCPR_ETH_H;
+        *(uint32_t *)(pkt + 16) = bench_rand();
+        sum += flow_decode(fht, &pkthdrs[p], pkt - TCPR_ETH_H, DLT_EN10MB, 0, NULL);
+    }
+    bench_report("flow_decode new flows", iterations, bench_now() - start);
+
+    bench_sink = sum;
+    flow_hash_table_release(fht);
+    safe_free(pool);
+}
+
+/* the 5-tuple hash behind flow_decode(), for each implementation */
+static void
+bench_hash(COUNTER iterations)
+{
+    static const struct {
+        flow_hash_impl_t impl;
+        const char *name;
+    } impls[] = {
+        { FLOW_HASH_PERL, "hash_func perl" },
+        { FLOW_HASH_WORD, "hash_func word" },
+        { FLOW_HASH_CRC32C, "hash_func crc32c" },
+    };
+    struct pcap_pkthdr pkthdrs[BENCH_PKTS];
+    u_char *pool = bench_ether_pool(64, pkthdrs);
+    uint64_t start;
+    uint32_t sum = 0;
+    COUNTER i;
+    size_t n;
+
+    for (n = 0; n < sizeof(impls) / sizeof(impls[0]); n++) {
+        if (flow_hash_select(impls[n].impl) < 0) {
+            printf("%-40s %10s\n", impls[n].name, "n/a");
+            continue;
+        }
+
+        start = bench_now();
+        for (i = 0; i < iterations; i++)
+            sum += flow_hash(&pkthdrs[i & (BENCH_PKTS - 1)],
+                    pool + (i & (BENCH_PKTS - 1)) * BENCH_PKT_STRIDE, DLT_EN10MB);
+        bench_report(impls[n].name, iterations, bench_now() - start);
+    }
+
+    flow_hash_select(FLOW_HASH_AUTO);
+    bench_sink = sum;
+    safe_free(pool);
+}
+
+/* tcpprep cache lookups, one packet at a time and in batches */
+static void
+bench_cache(COUNTER iterations)
+{
+    const COUNTER num_packets = 1 << 20;
+    u_int8_t dirs[CACHE_DIR_BATCH];
+    char *cachedata;
+    uint64_t start;
+    uint32_t sum = 0;
+    COUNTER i, j;
+    int n;
+
+    cachedata = safe_malloc(num_packets / CACHE_PACKETS_PER_BYTE + 8);
+    bench_srand();
+    for (i = 0; i < num_packets / CACHE_PACKETS_PER_BYTE; i++)
+        cachedata[i] = (char)bench_rand();
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++)
+        sum += check_cache(cachedata, (i & (num_packets - 1)) + 1);
+    bench_report("check_cache", iterations, bench_now() - start);
+
+    start = bench_now();
+    for (i = 0; i < iterations; i += CACHE_DIR_BATCH) {
+        n = check_cache_batch(cachedata, num_packets, (i & (num_packets - 1)) + 1,
+                CACHE_DIR_BATCH, dirs);
+        for (j = 0; j < (COUNTER)n; j++)
+            sum += dirs[j];
+    }
+    bench_report("check_cache_batch", i, bench_now() - start);
+
+    bench_sink = sum;
+    safe_free(cachedata);
+}
+
+/* --unique-ip rewriting, as done on every loop iteration */
+static void
+bench_fast_edit(COUNTER iterations)
+{
+    struct pcap_pkthdr pkthdrs[BENCH_PKTS];
+    u_char *pool = bench_ether_pool(64, pkthdrs);
+    u_char *pkt;
+    uint64_t start;
+    COUNTER i;
+    int p;
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        p = (int)(i & (BENCH_PKTS - 1));
+        pkt = pool + p * BENCH_PKT_STRIDE;
+        fast_edit_packet(&pkthdrs[p], &pkt, (uint32_t)(i / BENCH_PKTS) + 1, false, DLT_EN10MB);
+    }
+    bench_report("fast_edit_packet", iterations, bench_now() - start);
+
+    bench_sink = pool[TCPR_ETH_H + 15];
+    safe_free(pool);
+}
+
+/*
+ * tcpedit_packet() decoding each supported DLT and writing Ethernet.  The
+ * input frame has to be restored before every call since the plugins
+ * rewrite the L2 header in place, so the cost of that copy is measured on
+ * its own and taken out.
+ */
+static void
+bench_tcpedit(COUNTER iterations)
+{
+    static const struct {
+        int dlt;
+        const char *name;
+        int l2len;
+        u_char l2[16];
+    } dlts[] = {
+        { DLT_EN10MB, "en10mb", TCPR_ETH_H,
+            { 0x00, 0x1b, 0x21, 0x00, 0x00, 0x02, 0x00, 0x1b, 0x21, 0x00, 0x00, 0x01, 0x08, 0x00 } },
+        { DLT_RAW, "raw", 0, { 0 } },
+        { DLT_LINUX_SLL, "linuxsll", 16,
+            { 0x00, 0x00, 0x00, 0x01, 0x00, 0x06, 0x00, 0x1b, 0x21, 0x00, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00 } },
+        { DLT_NULL, "null", 4, { PF_INET, 0, 0, 0 } },
+        { DLT_LOOP, "loop", 4, { 0, 0, 0, PF_INET } },
+        { DLT_C_HDLC, "hdlc", 4, { 0x0f, 0x00, 0x08, 0x00 } },
+        { DLT_PPP_SERIAL, "pppserial", 4, { 0xff, 0x03, 0x00, 0x21 } },
+    };
+    static const tcpr_macaddr_t smac = { 0x00, 0x1b, 0x21, 0x00, 0x00, 0x01 };
+    static const tcpr_macaddr_t dmac = { 0x00, 0x1b, 0x21, 0x00, 0x00, 0x02 };
+    struct pcap_pkthdr hdr, *hdr_ptr;
+    u_char *orig = safe_malloc(BENCH_PKT_STRIDE);
+    u_char *buf = safe_malloc(MAXPACKET);
+    u_char *pkt;
+    uint64_t start, copy, elapsed;
+    char name[64];
+    COUNTER i;
+    size_t d;
+    int len, rcode;
+
+    for (d = 0; d < sizeof(dlts) / sizeof(dlts[0]); d++) {
+        tcpedit_t *te;
+        tcpeditdlt_plugin_t *enc;
+
+        memcpy(orig, dlts[d].l2, dlts[d].l2len);
+        len = dlts[d].l2len + bench_ipv4_tcp(orig + dlts[d].l2len, 64 - TCPR_ETH_H, 1);
+
+        if (tcpedit_init(&te, dlts[d].dlt) < 0 ||
+                tcpedit_set_encoder_dltplugin_byid(te, DLT_EN10MB) < 0) {
+            printf("%-40s %s\n", dlts[d].name, tcpedit_geterr(te));
+            tcpedit_close(te);
+            continue;
+        }
+
+        /* most of these DLTs have no MAC addresses to carry over */
+        enc = tcpedit_dlt_getplugin(te->dlt_ctx, DLT_EN10MB);
+        if (dlts[d].dlt != DLT_EN10MB) {
+            en10mb_config_t *config = (en10mb_config_t *)enc->config;
+
+            memcpy(config->intf1_smac, smac, ETHER_ADDR_LEN);
+            memcpy(config->intf1_dmac, dmac, ETHER_ADDR_LEN);
+            config->mac_mask = TCPEDIT_MAC_MASK_SMAC1 | TCPEDIT_MAC_MASK_DMAC1;
+        }
+        tcpedit_dlt_post_init(te->dlt_ctx);
+        tcpedit_validate(te);
+
+        start = bench_now();
+        for (i = 0; i < iterations; i++) {
+            memcpy(buf, orig, len);
+            bench_sink += buf[len - 1];
+        }
+        copy = bench_now() - start;
+
+        rcode = 0;
+        start = bench_now();
+        for (i = 0; i < iterations && rcode >= 0; i++) {
+            memcpy(buf, orig, len);
+            hdr.caplen = hdr.len = len;
+            hdr_ptr = &hdr;
+            pkt = buf;
+            rcode = tcpedit_packet(te, &hdr_ptr, &pkt, TCPR_DIR_C2S);
+        }
+
+        elapsed = bench_now() - start;
+
+        snprintf(name, sizeof(name), "tcpedit_packet %s -> en10mb", dlts[d].name);
+        if (rcode < 0)
+            printf("%-40s %s\n", name, tcpedit_geterr(te));
+        else
+            bench_report(name, iterations, elapsed > copy ? elapsed - copy : 0);
+
+        tcpedit_close(te);
+    }
+
+    safe_free(orig);
+    safe_free(buf);
+}
+
+/* CIDR membership tests, below and above the size we index at */
+static void
+bench_cidr(COUNTER iterations)
+{
+    static const int counts[] = { 8, 256 };
+    tcpr_cidr_t *cidr;
+    struct tcpr_in6_addr addr6;
+    char *list, name[64];
+    size_t c, off;
+    uint64_t start;
+    uint32_t sum = 0;
+    COUNTER i;
+    int n;
+
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        list = safe_malloc(counts[c] * 24);
+        for (n = 0, off = 0; n < counts[c]; n++)
+            off += sprintf(list + off, "%s10.%d.%d.0/24", n ? "," : "", n & 0xff, n >> 8);
+
+        if (!parse_cidr(&cidr, list, ","))
+            errx(-1, "Unable to parse %d CIDRs", counts[c]);
+
+        /* roughly half of the addresses are in the list */
+        bench_srand();
+        start = bench_now();
+        for (i = 0; i < iterations; i++) {
+            uint32_t r = bench_rand();
+            uint32_t x = r % (counts[c] * 2);
+
+            sum += check_ip_cidr(cidr, htonl(0x0a000000 | (x & 0xff) << 16 | (x >> 8) << 8 | r >> 24));
+        }
+        snprintf(name, sizeof(name), "check_ip_cidr %d entries", counts[c]);
+        bench_report(name, iterations, bench_now() - start);
+
+        destroy_cidr(cidr);
+        safe_free(list);
+    }
+
+    list = safe_malloc(8 * 32);
+    for (n = 0, off = 0; n < 8; n++)
+        off += sprintf(list + off, "%s[2001:db8:%x::]/48", n ? "," : "", n);
+    if (!parse_cidr(&cidr, list, ","))
+        errx(-1, "%s", "Unable to parse IPv6 CIDRs");
+
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.tcpr_s6_addr[0] = 0x20;
+    addr6.tcpr_s6_addr[1] = 0x01;
+    addr6.tcpr_s6_addr[2] = 0x0d;
+    addr6.tcpr_s6_addr[3] = 0xb8;
+    bench_srand();
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+        addr6.tcpr_s6_addr[5] = (u_char)(bench_rand() & 0x0f);
+        sum += check_ip6_cidr(cidr, &addr6);
+    }
+    bench_report("check_ip6_cidr 8 entries", iterations, bench_now() - start);
+
+    destroy_cidr(cidr);
+    safe_free(list);
+    bench_sink = sum;
+}
+
+/*
+ * write BENCH_PKTS frames of len bytes, reps times over, to a new temporary
+ * pcap file.  When ngaps > 0 the timestamps are spaced by gaps_us[],
+ * repeated in turn.
+ */
+static void
+bench_write_pcap(char *path, size_t pathlen, int len, const uint32_t *gaps_us, int ngaps,
+        int reps)
+{
+    struct pcap_pkthdr pkthdrs[BENCH_PKTS];
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_writer_t *pw;
+    u_char *pool;
+    const char *tmpdir;
+    int fd, i, rep;
+
+    if ((tmpdir = getenv("TMPDIR")) == NULL)
+        tmpdir = "/tmp";
+    snprintf(path, pathlen, "%s/tcpbench.XXXXXX", tmpdir);
+    if ((fd = mkstemp(path)) < 0)
+        errx(-1, "Unable to create %s: %s", path, strerror(errno));
+    close(fd);
+
+    pool = bench_ether_pool(len, pkthdrs);
+    for (i = 1; i < BENCH_PKTS && ngaps > 0; i++) {
+        uint64_t usec = (uint64_t)pkthdrs[i - 1].ts.tv_usec + gaps_us[(i - 1) % ngaps];
+
+        pkthdrs[i].ts.tv_sec = pkthdrs[i - 1].ts.tv_sec + usec / 1000000;
+        pkthdrs[i].ts.tv_usec = usec % 1000000;
+    }
+
+    if ((pw = pcap_writer_open(path, PCAP_WRITER_PCAP, DLT_EN10MB, 65535,
+            PCAP_WRITER_BUFSIZE, false, TCPR_COMPRESS_NONE, ebuf)) == NULL)
+        errx(-1, "Unable to open %s: %s", path, ebuf);
+
+    for (rep = 0; rep < reps; rep++) {
+        for (i = 0; i < BENCH_PKTS; i++) {
+            if (pcap_writer_write(pw, &pkthdrs[i], pool + i * BENCH_PKT_STRIDE) < 0)
+                errx(-1, "Unable to write %s: %s", path, pcap_writer_geterr(pw));
+        }
+    }
+
+    if (pcap_writer_close(pw, ebuf) < 0)
+        errx(-1, "Unable to write %s: %s", path, ebuf);
+
+    safe_free(pool);
+}
+
+/* a context which replays pcap to intf, or to the null sink when NULL */
+static tcpreplay_t *
+bench_replay_open(const char *name, char *pcap, char *intf)
+{
+    tcpreplay_t *r;
+
+    r = tcpreplay_init();
+    if (intf == NULL)
+        tcpreplay_set_null_sink(r, true);
+
+    if (tcpreplay_add_pcapfile(r, pcap) < 0 ||
+            tcpreplay_set_interface(r, intf1, intf ? intf : "null") < 0)
+        errx(-1, "%s: %s", name, tcpreplay_geterr(r));
+
+    return r;
+}
+
+/*
+ * one full tcpreplay_replay() of the pcap, looped until about iterations
+ * packets were sent, to intf or to the null sink when intf is NULL
+ */
+static void
+bench_replay_run(const char *name, char *pcap, char *intf, COUNTER iterations,
+        tcpreplay_speed_mode mode, COUNTER speed, bool preload)
+{
+    tcpreplay_t *r;
+    uint64_t start, elapsed;
+
+    r = bench_replay_open(name, pcap, intf);
+    tcpreplay_set_speed_mode(r, mode);
+    tcpreplay_set_speed_speed(r, speed);
+    tcpreplay_set_speed_pps_multi(r, 1);
+    tcpreplay_set_preload_pcap(r, preload);
+    tcpreplay_set_loop(r, (u_int32_t)max(iterations / BENCH_PKTS, 1));
+
+    if (tcpreplay_prepare(r) < 0)
+        errx(-1, "%s: %s", name, tcpreplay_geterr(r));
+
+    start = bench_now();
+    if (tcpreplay_replay(r, 0) < 0)
+        errx(-1, "%s: %s", name, tcpreplay_geterr(r));
+    elapsed = bench_now() - start;
+
+    bench_report_rate(name, tcpreplay_get_pkts_sent(r), tcpreplay_get_bytes_sent(r), elapsed);
+    tcpreplay_close(r);
+}
+
+/*
+ * send_packets() end to end for each speed mode, with and without
+ * --preload-pcap.  The null sink has no syscalls, so it shows the cost
+ * of the replay loop itself; -i adds the same runs on a real interface
+ * such as lo or one end of a veth pair.  The rate modes ask for more
+ * than a 64 byte null sink run can do, so they measure pacing overhead.
+ */
+static void
+bench_replay(COUNTER iterations)
+{
+    static const int sizes[] = { 64, 1500 };
+    static const struct {
+        const char *name;
+        tcpreplay_speed_mode mode;
+        COUNTER speed;
+    } modes[] = {
+        { "topspeed",           speed_topspeed,     0 },
+        { "mbpsrate 10000",     speed_mbpsrate,     10000ULL * 1000000 },
+        { "packetrate 2M",      speed_packetrate,   2000000 },
+    };
+    char pcap[PATH_MAX], name[64];
+    size_t s, m;
+    int preload, t;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bench_write_pcap(pcap, sizeof(pcap), sizes[s], NULL, 0, 1);
+
+        for (t = 0; t < (bench_intf ? 2 : 1); t++) {
+            for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                for (preload = 0; preload < 2; preload++) {
+                    snprintf(name, sizeof(name), "replay %s %s%s %d",
+                            t ? bench_intf : "null", modes[m].name,
+                            preload ? " preload" : "", sizes[s]);
+                    bench_replay_run(name, pcap, t ? bench_intf : NULL, iterations,
+                            modes[m].mode, modes[m].speed, preload);
+                }
+            }
+        }
+
+        unlink(pcap);
+    }
+}
+
+/*
+ * --prefetch distances on a preloaded top speed replay whose cache is far
+ * larger than the CPU caches, to the null sink and to -i if given
+ */
+static void
+bench_prefetch(COUNTER iterations)
+{
+    static const int sizes[] = { 64, 1500 };
+    static const int distances[] = { 0, 2, 4, 8, 16 };
+    char pcap[PATH_MAX], name[64];
+    COUNTER pkts = (COUNTER)BENCH_PKTS * BENCH_PREFETCH_REPS;
+    uint64_t start, elapsed;
+    tcpreplay_t *r;
+    char *intf;
+    size_t s, d;
+    int t;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bench_write_pcap(pcap, sizeof(pcap), sizes[s], NULL, 0, BENCH_PREFETCH_REPS);
+
+        for (t = 0; t < (bench_intf ? 2 : 1); t++) {
+            intf = t ? bench_intf : NULL;
+
+            for (d = 0; d < sizeof(distances) / sizeof(distances[0]); d++) {
+                snprintf(name, sizeof(name), "prefetch %s %d %d", intf ? intf : "null",
+                        distances[d], sizes[s]);
+
+                r = bench_replay_open(name, pcap, intf);
+                tcpreplay_set_speed_mode(r, speed_topspeed);
+                tcpreplay_set_preload_pcap(r, true);
+                tcpreplay_set_loop(r, (u_int32_t)max(iterations / pkts, 1));
+                if (tcpreplay_set_prefetch(r, distances[d]) < 0 ||
+                        tcpreplay_prepare(r) < 0)
+                    errx(-1, "%s: %s", name, tcpreplay_geterr(r));
+
+                /* time sending from the cache, not filling it */
+                preload_pcap_files(r, 1);
+
+                start = bench_now();
+                if (tcpreplay_replay(r, 0) < 0)
+                    errx(-1, "%s: %s", name, tcpreplay_geterr(r));
+                elapsed = bench_now() - start;
+
+                bench_report_rate(name, tcpreplay_get_pkts_sent(r),
+                        tcpreplay_get_bytes_sent(r), elapsed);
+                tcpreplay_close(r);
+            }
+        }
+
+        unlink(pcap);
+    }
+}
+
+static uint64_t
+bench_cpu_now(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return TIMEVAL_TO_NANOSEC(&ru.ru_utime) + TIMEVAL_TO_NANOSEC(&ru.ru_stime);
+}
+
+/*
+ * timing fidelity of every --timer mode: replay a capture with known gaps
+ * in real time and report how far each gap between sends was from the
+ * capture, plus the CPU used while doing so.  The gaps are measured
+ * where send_packets() hands the packet to the sink, so txtime (which
+ * leaves the wait to the qdisc) is only run on an -i interface.
+ */
+static void
+bench_timing(COUNTER UNUSED(iterations))
+{
+    static const uint32_t gaps_us[] = { 5, 20, 100, 500 };
+    static const struct {
+        const char *name;
+        tcpreplay_accurate accurate;
+    } timers[] = {
+        { "gtod",       accurate_gtod },
+        { "nanosleep",  accurate_nanosleep },
+        { "select",     accurate_select },
+        { "ioport",     accurate_ioport },
+        { "rdtsc",      accurate_rdtsc },
+        { "abstime",    accurate_abs_time },
+        { "hybrid",     accurate_hybrid },
+        { "txtime",     accurate_txtime },
+    };
+    const tcpreplay_stats_t *stats;
+    char pcap[PATH_MAX], name[64], mean[32], p99[32], max[32];
+    uint64_t start, cpu, elapsed;
+    tcpreplay_t *r;
+    char *intf;
+    size_t m;
+    int t;
+
+    bench_write_pcap(pcap, sizeof(pcap), 64, gaps_us, sizeof(gaps_us) / sizeof(gaps_us[0]), 1);
+
+    for (t = 0; t < (bench_intf ? 2 : 1); t++) {
+        intf = t ? bench_intf : NULL;
+
+        for (m = 0; m < sizeof(timers) / sizeof(timers[0]); m++) {
+            snprintf(name, sizeof(name), "timer %s %s", intf ? intf : "null", timers[m].name);
+
+            /* inb() on port 0x80 faults unless ioperm() succeeded */
+            if ((timers[m].accurate == accurate_ioport && geteuid() != 0) ||
+                    (timers[m].accurate == accurate_txtime && intf == NULL)) {
+                printf("%-40s skipped\n", name);
+                continue;
+            }
+
+            r = bench_replay_open(name, pcap, intf);
+            if (tcpreplay_set_accurate(r, timers[m].accurate) < 0 ||
+                    tcpreplay_prepare(r) < 0) {
+                printf("%-40s %s\n", name, tcpreplay_geterr(r));
+                tcpreplay_close(r);
+                continue;
+            }
+
+            cpu = bench_cpu_now();
+            start = bench_now();
+            if (tcpreplay_replay(r, 0) < 0)
+                errx(-1, "%s: %s", name, tcpreplay_geterr(r));
+            elapsed = bench_now() - start;
+            cpu = bench_cpu_now() - cpu;
+
+            stats = tcpreplay_get_stats(r);
+            printf("%-40s error mean %s, p99 %s, max %s, early " COUNTER_SPEC ", cpu %.0f%%\n",
+                    name,
+                    timing_hist_fmt(mean, sizeof(mean), timing_hist_mean(&stats->send_error)),
+                    timing_hist_fmt(p99, sizeof(p99), timing_hist_percentile(&stats->send_error, 99.0)),
+                    timing_hist_fmt(max, sizeof(max), stats->send_error.max),
+                    stats->send_early,
+                    elapsed ? 100.0 * (double)cpu / (double)elapsed : 0.0);
+            tcpreplay_close(r);
+        }
+    }
+
+    unlink(pcap);
+}
+
+static const bench_t benches[] = {
+    { "checksum",   bench_checksum },
+    { "flow",       bench_flow },
+    { "hash",       bench_hash },
+    { "cache",      bench_cache },
+    { "fast_edit",  bench_fast_edit },
+    { "tcpedit",    bench_tcpedit },
+    { "cidr",       bench_cidr },
+    { "replay",     bench_replay },
+    { "prefetch",   bench_prefetch },
+    { "timing",     bench_timing },
+};
+
+static void
+usage(void)
+{
+    size_t b;
+
+    fprintf(stderr, "Usage: tcpbench [-n iterations] [-i interface] [benchmark ...]\n"
+            "Benchmarks:");
+    for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+        fprintf(stderr, " %s", benches[b].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    COUNTER iterations = BENCH_ITERATIONS;
+    size_t b;
+    int ch, a;
+
+    while ((ch = getopt(argc, argv, "n:i:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                iterations = strtoull(optarg, NULL, 0);
+                if (iterations == 0)
+                    usage();
+                break;
+            case 'i':
+                bench_intf = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    printf("tcpbench: " COUNTER_SPEC " iterations per case, version %s (build %s)\n",
+            iterations, VERSION, git_version());
+
+    for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        if (optind < argc) {
+            for (a = optind; a < argc; a++)
+                if (strcmp(argv[a], benches[b].name) == 0)
+                    break;
+            if (a == argc)
+                continue;
+        }
+
+        benches[b].run(iterations);
+    }
+
+    return 0;
+}
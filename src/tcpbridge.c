@@ -35,6 +35,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_PACKET_FANOUT
+#include <netpacket/packet.h>
+#ifndef PACKET_FANOUT_HASH
+#define PACKET_FANOUT_HASH 0    /* not exported by older libc headers */
+#endif
+#endif
 #include <unistd.h>
 #include <errno.h>
 
@@ -56,6 +63,11 @@ tcpedit_t *tcpedit;
 /* local functions */
 void init(void);
 void post_args(int argc, char *argv[]);
+static pcap_t *open_bridge_intf(const char *intf, char *ebuf);
+static tcpedit_t *open_tcpedit(int warn);
+#ifdef HAVE_PACKET_FANOUT
+static void join_fanout(const char *intf, pcap_t **queue, int side);
+#endif
 
 int 
 main(int argc, char *argv[])
@@ -71,29 +83,21 @@ main(int argc, char *argv[])
 
     post_args(argc, argv);
 
-    /* init tcpedit context */
-    if (tcpedit_init(&tcpedit, pcap_datalink(options.pcap1)) < 0) {
-        errx(-1, "Error initializing tcpedit: %s", tcpedit_geterr(tcpedit));
-    }
+    tcpedit = open_tcpedit(1);
 
-    /* parse the tcpedit args */
-    rcode = tcpedit_post_args(tcpedit);
-    if (rcode < 0) {
-        errx(-1, "Unable to parse args: %s", tcpedit_geterr(tcpedit));
-    } else if (rcode == 1) {
-        warnx("%s", tcpedit_geterr(tcpedit));
-    }
+    /* every worker edits with its own context, the first one is ours */
+    if (options.workers > 0) {
+        int i, count = options.workers * (options.unidir ? 1 : 2);
 
-    if (tcpedit_validate(tcpedit) < 0) {
-        errx(-1, "Unable to edit packets given options:\n%s",
-                tcpedit_geterr(tcpedit));
+        options.worker_tcpedit = (tcpedit_t **)safe_malloc(sizeof(tcpedit_t *) * count);
+        options.worker_tcpedit[0] = tcpedit;
+        for (i = 1; i < count; i++)
+            options.worker_tcpedit[i] = open_tcpedit(0);
     }
 
 #ifdef ENABLE_VERBOSE
-    if (options.verbose) {
-        options.tcpdump = (tcpdump_t*)safe_malloc(sizeof(tcpdump_t));
+    if (options.verbose)
         tcpdump_open(options.tcpdump, options.pcap1);
-    }
 #endif
 
     if (gettimeofday(&stats.start_time, NULL) < 0)
@@ -110,6 +114,22 @@ main(int argc, char *argv[])
         pcap_close(options.pcap2);
     }
 
+    if (options.workers > 0) {
+        int i, count = options.workers * (options.unidir ? 1 : 2);
+
+        for (i = 1; i < options.workers; i++) {
+            pcap_close(options.queue1[i]);
+            if (!options.unidir)
+                pcap_close(options.queue2[i]);
+        }
+        for (i = 1; i < count; i++)
+            tcpedit_close(options.worker_tcpedit[i]);
+
+        safe_free(options.queue1);
+        safe_free(options.queue2);
+        safe_free(options.worker_tcpedit);
+    }
+
 #ifdef ENABLE_VERBOSE
     tcpdump_close(options.tcpdump);
 #endif
@@ -117,6 +137,35 @@ main(int argc, char *argv[])
     return 0;
 }
 
+/**
+ * init a tcpedit context from the command line options
+ */
+static tcpedit_t *
+open_tcpedit(int warn)
+{
+    tcpedit_t *ctx;
+    int rcode;
+
+    if (tcpedit_init(&ctx, pcap_datalink(options.pcap1)) < 0) {
+        errx(-1, "Error initializing tcpedit: %s", tcpedit_geterr(ctx));
+    }
+
+    /* parse the tcpedit args */
+    rcode = tcpedit_post_args(ctx);
+    if (rcode < 0) {
+        errx(-1, "Unable to parse args: %s", tcpedit_geterr(ctx));
+    } else if (rcode == 1 && warn) {
+        warnx("%s", tcpedit_geterr(ctx));
+    }
+
+    if (tcpedit_validate(ctx) < 0) {
+        errx(-1, "Unable to edit packets given options:\n%s",
+                tcpedit_geterr(ctx));
+    }
+
+    return ctx;
+}
+
 void 
 init(void)
 {
@@ -127,6 +176,7 @@ init(void)
     options.snaplen = 65535;
     options.promisc = 1;
     options.to_ms = 1;
+    options.mac_age = 300;
 
     if (fcntl(STDERR_FILENO, F_SETFL, O_NONBLOCK) < 0)
         warnx("Unable to set STDERR to non-blocking: %s", strerror(errno));
@@ -141,11 +191,7 @@ post_args(_U_ int argc, _U_ char *argv[])
     struct tcpr_ether_addr *eth_buff;
     char *intname;
     sendpacket_t *sp;
-#ifdef ENABLE_PCAP_FINDALLDEVS
-    interface_list_t *intlist = get_interface_list();
-#else
-    interface_list_t *intlist = NULL;
-#endif
+    interface_list_t *intlist = NULL;   /* only built for aliases */
 
 #ifdef DEBUG
     if (HAVE_OPT(DBUG))
@@ -157,11 +203,19 @@ post_args(_U_ int argc, _U_ char *argv[])
 
 
 #ifdef ENABLE_VERBOSE
-    if (HAVE_OPT(VERBOSE))
+    if (HAVE_OPT(VERBOSE)) {
         options.verbose = 1;
+        options.tcpdump = (tcpdump_t *)safe_malloc(sizeof(tcpdump_t));
+    }
 
     if (HAVE_OPT(DECODE))
         options.tcpdump->args = safe_strdup(OPT_ARG(DECODE));
+
+    if (HAVE_OPT(VERBOSE_SAMPLE))
+        options.tcpdump->sample_every = OPT_VALUE_VERBOSE_SAMPLE;
+
+    if (HAVE_OPT(VERBOSE_RATE))
+        options.tcpdump->sample_rate = OPT_VALUE_VERBOSE_RATE;
 #endif
 
     if (HAVE_OPT(UNIDIR))
@@ -170,14 +224,52 @@ post_args(_U_ int argc, _U_ char *argv[])
     if (HAVE_OPT(LIMIT))
         options.limit_send = OPT_VALUE_LIMIT; /* default is -1 */
 
+#ifdef HAVE_LIBPTHREAD
+    if (HAVE_OPT(WORKERS)) {
+        options.workers = OPT_VALUE_WORKERS;
+#ifndef HAVE_PACKET_FANOUT
+        if (options.workers > 1)
+            err(-1, "--workers greater than 1 requires Linux PACKET_FANOUT support");
+#endif
+#ifdef ENABLE_VERBOSE
+        if (options.verbose)
+            err(-1, "--workers can not be used with --verbose");
+#endif
+    }
+#endif
+
+    if (HAVE_OPT(MAC_AGE))
+        options.mac_age = OPT_VALUE_MAC_AGE;
 
-    if ((intname = get_interface(intlist, OPT_ARG(INTF1))) == NULL)
+    if (HAVE_OPT(SPIN)) {
+#ifdef HAVE_PCAP_SETNONBLOCK
+        options.spin = 1;
+#else
+        err(-1, "--spin requires a libpcap with pcap_setnonblock()");
+#endif
+    }
+
+#ifdef HAVE_SO_BUSY_POLL
+    if (HAVE_OPT(BUSY_POLL))
+        options.busy_poll = OPT_VALUE_BUSY_POLL;
+#endif
+
+    if (HAVE_OPT(RX_BUFFER)) {
+#ifdef HAVE_PCAP_SET_IMMEDIATE_MODE
+        options.rx_buffer = OPT_VALUE_RX_BUFFER * 1024;
+#else
+        warn("--rx-buffer requires libpcap 1.5 or later, ignoring");
+#endif
+    }
+
+
+    if ((intname = get_interface_lazy(&intlist, OPT_ARG(INTF1))) == NULL)
         errx(-1, "Invalid interface name/alias: %s", OPT_ARG(INTF1));
 
     options.intf1 = safe_strdup(intname);
 
     if (HAVE_OPT(INTF2)) {
-        if ((intname = get_interface(intlist, OPT_ARG(INTF2))) == NULL)
+        if ((intname = get_interface_lazy(&intlist, OPT_ARG(INTF2))) == NULL)
             errx(-1, "Invalid interface name/alias: %s", OPT_ARG(INTF2));
 
         options.intf2 = safe_strdup(intname);
@@ -228,8 +320,7 @@ post_args(_U_ int argc, _U_ char *argv[])
     /* 
      * Open interfaces for sending & receiving 
      */
-    if ((options.pcap1 = pcap_open_live(options.intf1, options.snaplen, 
-                                          options.promisc, options.to_ms, ebuf)) == NULL)
+    if ((options.pcap1 = open_bridge_intf(options.intf1, ebuf)) == NULL)
         errx(-1, "Unable to open interface %s: %s", options.intf1, ebuf);
 
 
@@ -238,10 +329,110 @@ post_args(_U_ int argc, _U_ char *argv[])
 
 
     /* we always have to open the other pcap handle to send, but we may not listen */
-    if ((options.pcap2 = pcap_open_live(options.intf2, options.snaplen,
-                                          options.promisc, options.to_ms, ebuf)) == NULL)
+    if ((options.pcap2 = open_bridge_intf(options.intf2, ebuf)) == NULL)
         errx(-1, "Unable to open interface %s: %s", options.intf2, ebuf);
 
+    /* the extra receive queues share each interface's traffic by flow */
+    if (options.workers > 0) {
+        int i;
+
+        options.queue1 = (pcap_t **)safe_malloc(sizeof(pcap_t *) * options.workers);
+        options.queue2 = (pcap_t **)safe_malloc(sizeof(pcap_t *) * options.workers);
+        options.queue1[0] = options.pcap1;
+        options.queue2[0] = options.pcap2;
+
+        for (i = 1; i < options.workers; i++) {
+            if ((options.queue1[i] = open_bridge_intf(options.intf1, ebuf)) == NULL)
+                errx(-1, "Unable to open interface %s: %s", options.intf1, ebuf);
+
+            if (!options.unidir &&
+                    (options.queue2[i] = open_bridge_intf(options.intf2, ebuf)) == NULL)
+                errx(-1, "Unable to open interface %s: %s", options.intf2, ebuf);
+        }
+
+#ifdef HAVE_PACKET_FANOUT
+        if (options.workers > 1) {
+            join_fanout(options.intf1, options.queue1, PCAP_INT1);
+            if (!options.unidir)
+                join_fanout(options.intf2, options.queue2, PCAP_INT2);
+        }
+#endif
+    }
+
     /* poll should be -1 to wait indefinitely */
     options.poll_timeout = -1;
 }
+
+#ifdef HAVE_PACKET_FANOUT
+/**
+ * Put the receive handles of an interface in one PACKET_FANOUT group, so
+ * the kernel spreads the packets over them by flow hash like RSS does
+ */
+static void
+join_fanout(const char *intf, pcap_t **queue, int side)
+{
+    int i, fanout;
+
+    fanout = ((getpid() * 2 + side) & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    for (i = 0; i < options.workers; i++) {
+        if (setsockopt(pcap_fileno(queue[i]), SOL_PACKET, PACKET_FANOUT,
+                    &fanout, sizeof(fanout)) < 0)
+            errx(-1, "Unable to join PACKET_FANOUT group on %s: %s", intf, strerror(errno));
+    }
+}
+#endif
+
+/**
+ * Open an interface for bridging.  With libpcap 1.5+ we build the handle
+ * ourselves so we can size the receive ring and ask for immediate mode:
+ * otherwise the Linux TPACKET_V3 ring only hands us packets a block at a
+ * time, when the block fills up or the to_ms timer fires.
+ */
+static pcap_t *
+open_bridge_intf(const char *intf, char *ebuf)
+{
+    pcap_t *pcap;
+#ifdef HAVE_PCAP_SET_IMMEDIATE_MODE
+    int rcode;
+
+    if ((pcap = pcap_create(intf, ebuf)) == NULL)
+        return NULL;
+
+    pcap_set_snaplen(pcap, options.snaplen);
+    pcap_set_promisc(pcap, options.promisc);
+    pcap_set_timeout(pcap, options.to_ms);
+    pcap_set_immediate_mode(pcap, 1);
+    if (options.rx_buffer > 0)
+        pcap_set_buffer_size(pcap, options.rx_buffer);
+
+    if ((rcode = pcap_activate(pcap)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", rcode == PCAP_ERROR ?
+                pcap_geterr(pcap) : pcap_statustostr(rcode));
+        pcap_close(pcap);
+        return NULL;
+    } else if (rcode > 0) {
+        warnx("%s: %s", intf, rcode == PCAP_WARNING ?
+                pcap_geterr(pcap) : pcap_statustostr(rcode));
+    }
+#else
+    if ((pcap = pcap_open_live(intf, options.snaplen, options.promisc,
+                    options.to_ms, ebuf)) == NULL)
+        return NULL;
+#endif
+
+#ifdef HAVE_SO_BUSY_POLL
+    if (options.busy_poll > 0 &&
+            setsockopt(pcap_fileno(pcap), SOL_SOCKET, SO_BUSY_POLL,
+                    &options.busy_poll, sizeof(options.busy_poll)) < 0)
+        warnx("Unable to set SO_BUSY_POLL on %s: %s", intf, strerror(errno));
+#endif
+
+#ifdef HAVE_PCAP_SETNONBLOCK
+    if (options.spin && pcap_setnonblock(pcap, 1, ebuf) < 0) {
+        pcap_close(pcap);
+        return NULL;
+    }
+#endif
+
+    return pcap;
+}
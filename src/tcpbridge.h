@@ -60,6 +60,16 @@ typedef struct {
     int to_ms;
     int promisc;
     int poll_timeout;
+    int spin;
+    int busy_poll;          /* SO_BUSY_POLL usec, 0 to leave it alone */
+    int rx_buffer;          /* receive ring size in bytes, 0 for default */
+    int mac_age;            /* seconds before a MAC may move, 0 for never */
+
+    /* --workers: receive queues per interface, each bridged by a thread */
+    int workers;
+    pcap_t **queue1;        /* queue1[0] is pcap1 */
+    pcap_t **queue2;        /* queue2[0] is pcap2 */
+    tcpedit_t **worker_tcpedit;
 
 #ifdef ENABLE_VERBOSE
     /* tcpdump verbose printing */
@@ -28,17 +28,88 @@
 #include <unistd.h>
 #include <pcap.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #define __STDC_FORMAT_MACROS 1
 #include <inttypes.h>
 
 #include "tcpcapinfo_opts.h"
 
-static int do_checksum_math(u_int16_t *data, int len);
+#define CAPINFO_BUFSIZE     (4 * 1024 * 1024)   /* bytes read at a time when not mapped */
+#define CAPINFO_MAX_RECORD  (64 * 1024 * 1024)  /* largest caplen we buffer */
+#define CAPINFO_HIST_BUCKETS 10                 /* 0-63 ... 16384+ */
+#define CAPINFO_CHUNK_PKTS  65536               /* records per --workers chunk */
+#define LINKTYPE_RAW        101                 /* DLT_RAW as stored in files */
+
+/* the file being dissected: mapped, or a window of it in buf */
+typedef struct capinfo_file_s {
+    int fd;
+    u_char *map;
+    u_char *buf;
+    size_t buf_size;
+    size_t start;           /* next unread byte of map or buf */
+    size_t end;             /* end of the data in map or buf */
+    bool eof;
+} capinfo_file_t;
+
+/* how the records of a file are laid out */
+typedef struct capinfo_fmt_s {
+    int pkthdrlen;
+    bool swapped;
+    uint32_t snaplen;
+    uint32_t linktype;
+} capinfo_fmt_t;
+
+/* --stats totals of a file */
+typedef struct capinfo_stats_s {
+    bool nsec;              /* timestamp fractions are nanoseconds */
+    uint64_t packets;
+    uint64_t bytes_cap;
+    uint64_t bytes_wire;
+    uint32_t min_caplen;
+    uint32_t max_caplen;
+    uint64_t sizes[CAPINFO_HIST_BUCKETS];
+    uint64_t truncated;     /* caplen < len */
+    uint64_t toobig;        /* caplen > snaplen */
+    uint64_t bad_frac;      /* fraction of a second out of range */
+    uint64_t ipv4;          /* IPv4 headers checked */
+    uint64_t bad_ipcsum;
+    uint64_t backwards;
+    uint64_t max_backwards; /* usec */
+    uint64_t first_usec;
+    uint64_t last_usec;
+    uint64_t max_usec;
+} capinfo_stats_t;
+
+static int do_checksum_math(const u_char *data, int len);
+static ssize_t read_full(int fd, void *buf, size_t len);
+static void build_index(const char *pcapfile, long interval);
+static void build_meta(const char *pcapfile);
+static int capinfo_open(capinfo_file_t *cf, const char *path, char *ebuf);
+static ssize_t capinfo_get(capinfo_file_t *cf, size_t len, u_char **data);
+static void capinfo_close(capinfo_file_t *cf);
+static void capinfo_parse_hdr(const capinfo_fmt_t *fmt, const u_char *rec,
+        struct pcap_pkthdr *pkthdr);
+static int capinfo_backwards(int32_t last_sec, int32_t last_usec, 
+        const struct pcap_pkthdr *pkthdr);
+static void capinfo_stats_add(capinfo_stats_t *stats, const capinfo_fmt_t *fmt,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int backwards, 
+        int caplentoobig);
+static void capinfo_stats_print(const capinfo_stats_t *stats);
+static void capinfo_pcapng(const char *path, bool stats_only);
+#ifdef HAVE_LIBPTHREAD
+static bool capinfo_stats_parallel(capinfo_file_t *cf, const capinfo_fmt_t *fmt,
+        int workers, capinfo_stats_t *stats);
+#endif
 
 #ifdef DEBUG
 int debug = 0;
@@ -94,19 +165,31 @@ struct pcap_sf_patched_pkthdr {
  */
 #define NSEC_TCPDUMP_MAGIC      0xa1b23c4d
 
+/*
+ * pcapng section header block type, the same in either byte order.
+ */
+#define PCAPNG_MAGIC            0x0a0d0d0a
+
 
 int
 main(int argc, char *argv[])
 {
-    int i, fd, swapped, pkthdrlen, ret, optct, backwards, caplentoobig;
+    int i, swapped, pkthdrlen, optct, backwards, caplentoobig;
     struct pcap_file_header pcap_fh;
     struct pcap_pkthdr pcap_ph;
     struct pcap_sf_patched_pkthdr pcap_patched_ph; /* Kuznetzov */
-    char buf[10000];
+    char ebuf[PCAP_ERRBUF_SIZE];
     struct stat statinfo;
+    capinfo_file_t cf;
+    capinfo_fmt_t fmt;
+    capinfo_stats_t stats;
+    u_char *buf;
+    ssize_t ret;
     uint64_t pktcnt;
     uint32_t readword;
     int32_t last_sec, last_usec, caplen;
+    bool stats_only;
+    int workers = 1;
 
     optct = optionProcess(&tcpcapinfoOptions, argc, argv);
     argc -= optct;
@@ -117,24 +200,50 @@ main(int argc, char *argv[])
         debug = OPT_VALUE_DBUG;
 #endif
 
+    if (HAVE_OPT(INDEX)) {
+        for (i = 0; i < argc; i++)
+            build_index(argv[i], OPT_VALUE_INDEX);
+
+        exit(0);
+    }
+
+    if (HAVE_OPT(META)) {
+        for (i = 0; i < argc; i++)
+            build_meta(argv[i]);
+
+        exit(0);
+    }
+
+    stats_only = HAVE_OPT(STATS);
+
+    if (HAVE_OPT(WORKERS)) {
+#ifdef HAVE_LIBPTHREAD
+        workers = OPT_VALUE_WORKERS;
+#else
+        if (OPT_VALUE_WORKERS > 1)
+            errx(-1, "%s", "--workers requires tcpcapinfo to be built with pthread support");
+#endif
+    }
+
     for (i = 0; i < argc; i++) {
         dbgx(1, "processing:  %s\n", argv[i]);
-        if ((fd = open(argv[i], O_RDONLY)) < 0)
-            errx(-1, "Error opening file %s: %s", argv[i], strerror(errno));
+        /* compressed files are decompressed behind the reader */
+        if (capinfo_open(&cf, argv[i], ebuf) < 0)
+            errx(-1, "Error opening file %s", ebuf);
 
-        if (fstat(fd, &statinfo) < 0)
+        if (stat(argv[i], &statinfo) < 0)
             errx(-1, "Error getting file stat info %s: %s", argv[i], strerror(errno));
 
         printf("file size   = %"PRIu64" bytes\n", (uint64_t)statinfo.st_size);
 
-        if ((ret = read(fd, &buf, sizeof(pcap_fh))) != sizeof(pcap_fh))
+        if ((ret = capinfo_get(&cf, sizeof(pcap_fh), &buf)) != sizeof(pcap_fh))
             errx(-1, "File too small.  Unable to read pcap_file_header from %s", argv[i]);
 
-        dbgx(3, "Read %d bytes for file header", ret);
+        dbgx(3, "Read %zd bytes for file header", ret);
 
         swapped = 0;
 
-        memcpy(&pcap_fh, &buf, sizeof(pcap_fh));
+        memcpy(&pcap_fh, buf, sizeof(pcap_fh));
 
         pkthdrlen = 16; /* pcap_pkthdr isn't the actual on-disk format for 64bit systems! */
 
@@ -186,6 +295,13 @@ main(int argc, char *argv[])
             swapped = 1;
             break;
 
+            case PCAPNG_MAGIC:
+            printf("magic       = 0x%08"PRIx32" (pcapng)\n", pcap_fh.magic);
+            /* blocks, not records: let the mapped reader walk them */
+            capinfo_close(&cf);
+            capinfo_pcapng(argv[i], stats_only);
+            continue;
+
             default:
             printf("magic       = 0x%08"PRIx32" (unknown)\n", pcap_fh.magic);
         }
@@ -207,13 +323,33 @@ main(int argc, char *argv[])
 
         if (pcap_fh.version_major != 2 && pcap_fh.version_minor != 4) {
             printf("Sorry, we only support file format version 2.4\n");
-            close(fd);
+            capinfo_close(&cf);
             continue;
         }
 
         dbgx(5, "Packet header len: %d", pkthdrlen);
 
-        if (pkthdrlen == 24) {
+        fmt.pkthdrlen = pkthdrlen;
+        fmt.swapped = swapped;
+        fmt.snaplen = pcap_fh.snaplen;
+        fmt.linktype = pcap_fh.linktype;
+
+        if (stats_only) {
+            memset(&stats, 0, sizeof(stats));
+            stats.nsec = pcap_fh.magic == NSEC_TCPDUMP_MAGIC || 
+                    pcap_fh.magic == SWAPLONG(NSEC_TCPDUMP_MAGIC);
+#ifdef HAVE_LIBPTHREAD
+            /* records can only be handed out by offset when the file is mapped */
+            if (workers > 1 && cf.map != NULL) {
+                if (capinfo_stats_parallel(&cf, &fmt, workers, &stats))
+                    printf("File truncated!  Unable to jump to next packet.\n");
+
+                capinfo_stats_print(&stats);
+                capinfo_close(&cf);
+                continue;
+            }
+#endif
+        } else if (pkthdrlen == 24) {
             printf("Packet\tOrigLen\t\tCaplen\t\tTimestamp\t\tIndex\tProto\tPktType\tPktCsum\tNote\n");
         } else {
             printf("Packet\tOrigLen\t\tCaplen\t\tTimestamp\tCsum\tNote\n");
@@ -222,17 +358,17 @@ main(int argc, char *argv[])
         pktcnt = 0;
         last_sec = 0;
         last_usec = 0;
-        while ((ret = read(fd, &buf, pkthdrlen)) == pkthdrlen) {
+        while ((ret = capinfo_get(&cf, pkthdrlen, &buf)) == pkthdrlen) {
             pktcnt ++;
             backwards = 0;
             caplentoobig = 0;
-            dbgx(3, "Read %d bytes for packet %"PRIu64" header", ret, pktcnt);
+            dbgx(3, "Read %zd bytes for packet %"PRIu64" header", ret, pktcnt);
 
             memset(&pcap_ph, 0, sizeof(pcap_ph));
 
             /* see what packet header we're using */
             if (pkthdrlen == sizeof(pcap_patched_ph)) {
-                memcpy(&pcap_patched_ph, &buf, sizeof(pcap_patched_ph));
+                memcpy(&pcap_patched_ph, buf, sizeof(pcap_patched_ph));
 
                 if (swapped == 1) {
                     dbg(3, "Swapping packet header bytes...");
@@ -243,11 +379,12 @@ main(int argc, char *argv[])
                     pcap_patched_ph.index = SWAPLONG(pcap_patched_ph.index);
                     pcap_patched_ph.protocol = SWAPSHORT(pcap_patched_ph.protocol);
                 }
-                printf("%"PRIu64"\t%4"PRIu32"\t\t%4"PRIu32"\t\t%"
-                        PRIx32".%"PRIx32"\t\t%4"PRIu32"\t%4hu\t%4hhu", 
-                        pktcnt, pcap_patched_ph.len, pcap_patched_ph.caplen, 
-                        pcap_patched_ph.ts.tv_sec, pcap_patched_ph.ts.tv_usec,
-                        pcap_patched_ph.index, pcap_patched_ph.protocol, pcap_patched_ph.pkt_type);
+                if (!stats_only)
+                    printf("%"PRIu64"\t%4"PRIu32"\t\t%4"PRIu32"\t\t%"
+                            PRIx32".%"PRIx32"\t\t%4"PRIu32"\t%4hu\t%4hhu", 
+                            pktcnt, pcap_patched_ph.len, pcap_patched_ph.caplen, 
+                            pcap_patched_ph.ts.tv_sec, pcap_patched_ph.ts.tv_usec,
+                            pcap_patched_ph.index, pcap_patched_ph.protocol, pcap_patched_ph.pkt_type);
 
                 if (pcap_fh.snaplen < pcap_patched_ph.caplen) {
                     caplentoobig = 1;
@@ -255,6 +392,12 @@ main(int argc, char *argv[])
 
                 caplen = pcap_patched_ph.caplen;
 
+                /* the checks below only look at pcap_ph */
+                pcap_ph.ts.tv_sec = pcap_patched_ph.ts.tv_sec;
+                pcap_ph.ts.tv_usec = pcap_patched_ph.ts.tv_usec;
+                pcap_ph.caplen = pcap_patched_ph.caplen;
+                pcap_ph.len = pcap_patched_ph.len;
+
             } else {
                 /* manually map on-disk bytes to our memory structure */
                 memcpy(&readword, buf, 4);
@@ -271,10 +414,11 @@ main(int argc, char *argv[])
                     pcap_ph.ts.tv_sec = SWAPLONG(pcap_ph.ts.tv_sec);
                     pcap_ph.ts.tv_usec = SWAPLONG(pcap_ph.ts.tv_usec);
                 }
-                printf("%"PRIu64"\t%4"PRIu32"\t\t%4"PRIu32"\t\t%"
-                        PRIx32".%"PRIx32,
-                        pktcnt, pcap_ph.len, pcap_ph.caplen, 
-                        (unsigned int)pcap_ph.ts.tv_sec, (unsigned int)pcap_ph.ts.tv_usec);
+                if (!stats_only)
+                    printf("%"PRIu64"\t%4"PRIu32"\t\t%4"PRIu32"\t\t%"
+                            PRIx32".%"PRIx32,
+                            pktcnt, pcap_ph.len, pcap_ph.caplen, 
+                            (unsigned int)pcap_ph.ts.tv_sec, (unsigned int)pcap_ph.ts.tv_usec);
                 if (pcap_fh.snaplen < pcap_ph.caplen) {
                     caplentoobig = 1;
                 }
@@ -282,35 +426,28 @@ main(int argc, char *argv[])
             }
 
             /* check to make sure timestamps don't go backwards */
-            if (last_sec > 0 && last_usec > 0) {
-                if ((pcap_ph.ts.tv_sec == last_sec) ? 
-                        (pcap_ph.ts.tv_usec < last_usec) : 
-                        (pcap_ph.ts.tv_sec < last_sec)) {
-                    backwards = 1;
-                }
-            }
-            if (pkthdrlen == sizeof(pcap_patched_ph)) {
-                last_sec = pcap_patched_ph.ts.tv_sec;
-                last_usec = pcap_patched_ph.ts.tv_usec;
-            } else {
-                last_sec = pcap_ph.ts.tv_sec;
-                last_usec = pcap_ph.ts.tv_usec;
-            }
+            backwards = capinfo_backwards(last_sec, last_usec, &pcap_ph);
+            last_sec = pcap_ph.ts.tv_sec;
+            last_usec = pcap_ph.ts.tv_usec;
 
-            /* read the frame */
-            if ((ret = read(fd, &buf, caplen)) != caplen) {
+            /* the frame stays in the reader, nothing is copied */
+            if ((ret = capinfo_get(&cf, caplen, &buf)) != caplen) {
                 if (ret < 0) {
                     printf("Error reading file: %s: %s\n", argv[i], strerror(errno));
                 } else {
                     printf("File truncated!  Unable to jump to next packet.\n");
                 }
 
-                close(fd);
+                break;
+            }
+
+            if (stats_only) {
+                capinfo_stats_add(&stats, &fmt, &pcap_ph, buf, backwards, caplentoobig);
                 continue;
             }
 
             /* print the frame checksum */
-            printf("\t%x\t", do_checksum_math((u_int16_t *)buf, caplen));
+            printf("\t%x\t", do_checksum_math(buf, caplen));
 
             /* print the Note */
             if (! backwards && ! caplentoobig) {
@@ -325,17 +462,602 @@ main(int argc, char *argv[])
 
         }
 
+        if (stats_only)
+            capinfo_stats_print(&stats);
+
+        capinfo_close(&cf);
     }
 
     exit(0);
 
 }
 
+/**
+ * dissects a pcapng file.  Packets come from the mapped reader, so
+ * compressed pcapng files can't be read.
+ */
+static void
+capinfo_pcapng(const char *path, bool stats_only)
+{
+    pcap_mmap_t *pm;
+    struct pcap_pkthdr pkthdr;
+    const pcap_mmap_if_t *ifp;
+    capinfo_fmt_t fmt;
+    capinfo_stats_t stats;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    u_char *pktdata;
+    uint64_t pktcnt = 0, ts_nsec, last_nsec = 0;
+    int backwards, caplentoobig;
+
+    if ((pm = pcap_mmap_open(path, ebuf)) == NULL) {
+        printf("Unable to read pcapng file: %s\n", ebuf);
+        return;
+    }
+
+    printf("snaplen     = %"PRIu32"\n", pm->snaplen);
+    printf("linktype    = 0x%08"PRIx32"\n", (uint32_t)pm->linktype);
+
+    memset(&fmt, 0, sizeof(fmt));
+    memset(&stats, 0, sizeof(stats));
+    if (!stats_only)
+        printf("Packet\tOrigLen\t\tCaplen\t\tTimestamp(ns)\t\tIface\tCsum\tNote\n");
+
+    while ((pktdata = pcap_mmap_next(pm, &pkthdr)) != NULL) {
+        pktcnt++;
+
+        /* each packet can come from an interface of its own */
+        ifp = &pm->ifs[pm->pkt_iface];
+        fmt.linktype = (uint32_t)ifp->linktype;
+        fmt.snaplen = ifp->snaplen;
+
+        /* a snaplen of 0 is no limit */
+        caplentoobig = fmt.snaplen > 0 && fmt.snaplen < pkthdr.caplen;
+
+        /* interfaces can have timestamps finer than pkthdr holds */
+        ts_nsec = (uint64_t)(uint32_t)pkthdr.ts.tv_sec * 1000000000 +
+                (uint64_t)(uint32_t)pkthdr.ts.tv_usec * 1000 + pm->pkt_nsec;
+        backwards = ts_nsec < last_nsec;
+        last_nsec = ts_nsec;
+
+        if (stats_only) {
+            capinfo_stats_add(&stats, &fmt, &pkthdr, pktdata, backwards, caplentoobig);
+            continue;
+        }
+
+        printf("%"PRIu64"\t%4"PRIu32"\t\t%4"PRIu32"\t\t%"PRIu64".%09"PRIu64"\t\t%4"PRIu32"\t%x\t", 
+                pktcnt, pkthdr.len, pkthdr.caplen, ts_nsec / 1000000000,
+                ts_nsec % 1000000000, pm->pkt_iface,
+                do_checksum_math(pktdata, pkthdr.caplen));
+
+        if (backwards && caplentoobig)
+            printf("BAD_TS|TOOBIG\n");
+        else if (backwards)
+            printf("BAD_TS\n");
+        else if (caplentoobig)
+            printf("TOOBIG\n");
+        else
+            printf("OK\n");
+    }
+
+    if (stats_only)
+        capinfo_stats_print(&stats);
+
+    pcap_mmap_close(pm);
+}
+
+/**
+ * opens path for dissecting.  Plain files are mapped, anything else
+ * (compressed files, pipes) is read CAPINFO_BUFSIZE bytes at a time.
+ * Returns 0 or -1 and fills ebuf.
+ */
+static int
+capinfo_open(capinfo_file_t *cf, const char *path, char *ebuf)
+{
+#ifdef HAVE_SYS_MMAN_H
+    struct stat statinfo;
+    void *map;
+    int fd;
+#endif
+
+    memset(cf, 0, sizeof(*cf));
+
+#ifdef HAVE_SYS_MMAN_H
+    if (compress_from_path(path) == TCPR_COMPRESS_NONE && (fd = open(path, O_RDONLY)) >= 0) {
+        if (fstat(fd, &statinfo) == 0 && S_ISREG(statinfo.st_mode) && statinfo.st_size > 0 &&
+                (map = mmap(NULL, statinfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+            /* a compressed file without a suffix has to go through the decoder */
+            if (compress_detect(map, statinfo.st_size) == TCPR_COMPRESS_NONE) {
+#ifdef MADV_SEQUENTIAL
+                madvise(map, statinfo.st_size, MADV_SEQUENTIAL);
+#endif
+                cf->fd = fd;
+                cf->map = map;
+                cf->end = statinfo.st_size;
+                return 0;
+            }
+            munmap(map, statinfo.st_size);
+        }
+        close(fd);
+    }
+#endif
+
+    if ((cf->fd = compress_open_read(path, ebuf)) < 0)
+        return -1;
+
+    cf->buf_size = CAPINFO_BUFSIZE;
+    cf->buf = safe_malloc(cf->buf_size);
+    return 0;
+}
+
+/**
+ * points *data at the next len bytes of the file.  Returns how many there
+ * are, which is less than len at the end of the file, or -1 on error.
+ */
+static ssize_t
+capinfo_get(capinfo_file_t *cf, size_t len, u_char **data)
+{
+    ssize_t ret;
+    size_t got;
+
+    if (cf->map == NULL && cf->end - cf->start < len && !cf->eof) {
+        /* keep what's left and fill the rest of the buffer */
+        memmove(cf->buf, cf->buf + cf->start, cf->end - cf->start);
+        cf->end -= cf->start;
+        cf->start = 0;
+
+        /* a bogus caplen in a broken file shouldn't eat all our memory */
+        if (len > cf->buf_size && len <= CAPINFO_MAX_RECORD) {
+            cf->buf_size = len;
+            cf->buf = safe_realloc(cf->buf, cf->buf_size);
+        }
+
+        if ((ret = read_full(cf->fd, cf->buf + cf->end, cf->buf_size - cf->end)) < 0)
+            return -1;
+
+        if ((size_t)ret < cf->buf_size - cf->end)
+            cf->eof = true;
+        cf->end += ret;
+    }
+
+    got = min(len, cf->end - cf->start);
+    *data = (cf->map != NULL ? cf->map : cf->buf) + cf->start;
+    cf->start += got;
+    return got;
+}
+
+/**
+ * closes a file opened with capinfo_open()
+ */
+static void
+capinfo_close(capinfo_file_t *cf)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (cf->map != NULL)
+        munmap(cf->map, cf->end);
+#endif
+    safe_free(cf->buf);
+    close(cf->fd);
+}
+
+/**
+ * fills pkthdr from the record at rec.  Kuznetzov records start with the
+ * same four fields, so only their length differs.
+ */
+static void
+capinfo_parse_hdr(const capinfo_fmt_t *fmt, const u_char *rec, struct pcap_pkthdr *pkthdr)
+{
+    uint32_t word[4];
+
+    memcpy(word, rec, sizeof(word));
+    if (fmt->swapped) {
+        word[0] = SWAPLONG(word[0]);
+        word[1] = SWAPLONG(word[1]);
+        word[2] = SWAPLONG(word[2]);
+        word[3] = SWAPLONG(word[3]);
+    }
+
+    pkthdr->ts.tv_sec = word[0];
+    pkthdr->ts.tv_usec = word[1];
+    pkthdr->caplen = word[2];
+    pkthdr->len = word[3];
+}
+
+/**
+ * returns 1 if pkthdr is older than the packet before it
+ */
+static int
+capinfo_backwards(int32_t last_sec, int32_t last_usec, const struct pcap_pkthdr *pkthdr)
+{
+    if (last_sec > 0 && last_usec > 0) {
+        if ((pkthdr->ts.tv_sec == last_sec) ? 
+                (pkthdr->ts.tv_usec < last_usec) : 
+                (pkthdr->ts.tv_sec < last_sec)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * returns 1 if the packet is IPv4 with a bad header checksum, 0 if the
+ * checksum is good and -1 if it isn't IPv4 we can find
+ */
+static int
+capinfo_ipv4_csum(const u_char *pktdata, uint32_t caplen, uint32_t linktype)
+{
+    uint32_t l3, hlen, i, sum = 0;
+    uint16_t word;
+    pkt_meta_t meta;
+
+    if (linktype == LINKTYPE_RAW)
+        linktype = DLT_RAW;
+
+    if (get_pkt_meta(pktdata, caplen, linktype, &meta) < 0 || meta.ip_ver != 4)
+        return -1;
+
+    l3 = meta.l2len;
+
+    hlen = (pktdata[l3] & 0x0f) * 4;
+    if (hlen < 20 || hlen > caplen - l3)
+        return -1;
+
+    /* a header with a correct checksum sums to 0xffff in either byte order */
+    for (i = 0; i < hlen; i += 2) {
+        memcpy(&word, pktdata + l3 + i, sizeof(word));
+        sum += word;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return sum != 0xffff;
+}
+
+/**
+ * adds a packet to the --stats totals
+ */
+static void
+capinfo_stats_add(capinfo_stats_t *stats, const capinfo_fmt_t *fmt,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int backwards, 
+        int caplentoobig)
+{
+    uint64_t ts_usec;
+    int bucket, csum;
+
+    ts_usec = (uint64_t)(uint32_t)pkthdr->ts.tv_sec * 1000000 +
+            (stats->nsec ? (uint32_t)pkthdr->ts.tv_usec / 1000 : (uint32_t)pkthdr->ts.tv_usec);
+
+    if (stats->packets == 0) {
+        stats->min_caplen = pkthdr->caplen;
+        stats->first_usec = ts_usec;
+    }
+
+    stats->packets++;
+    stats->bytes_cap += pkthdr->caplen;
+    stats->bytes_wire += pkthdr->len;
+    stats->min_caplen = min(stats->min_caplen, pkthdr->caplen);
+    stats->max_caplen = max(stats->max_caplen, pkthdr->caplen);
+
+    /* 0-63, 64-127, 128-255 ... */
+    for (bucket = 0; bucket < CAPINFO_HIST_BUCKETS - 1 &&
+            pkthdr->caplen >= (64U << bucket); bucket++)
+        ;
+    stats->sizes[bucket]++;
+
+    if (pkthdr->caplen < pkthdr->len)
+        stats->truncated++;
+
+    if (caplentoobig)
+        stats->toobig++;
+
+    if ((uint32_t)pkthdr->ts.tv_usec >= (stats->nsec ? 1000000000U : 1000000U))
+        stats->bad_frac++;
+
+    if (backwards) {
+        stats->backwards++;
+        stats->max_backwards = max(stats->max_backwards, stats->last_usec - ts_usec);
+    }
+
+    stats->max_usec = max(stats->max_usec, ts_usec);
+    stats->last_usec = ts_usec;
+
+    if ((csum = capinfo_ipv4_csum(pktdata, pkthdr->caplen, fmt->linktype)) >= 0) {
+        stats->ipv4++;
+        stats->bad_ipcsum += csum;
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+/* a run of whole records for a --workers thread */
+typedef struct capinfo_chunk_s {
+    size_t start;
+    size_t end;
+    struct pcap_pkthdr prev;    /* header of the record before start */
+} capinfo_chunk_t;
+
+/* chunks found by the main thread, checked by the workers */
+typedef struct capinfo_pool_s {
+    const capinfo_file_t *cf;
+    const capinfo_fmt_t *fmt;
+    bool nsec;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    capinfo_chunk_t *chunks;
+    size_t chunk_cnt;
+    size_t chunk_alloc;
+    size_t next;                /* first chunk nobody has claimed */
+    bool done;                  /* every chunk has been found */
+} capinfo_pool_t;
+
+typedef struct capinfo_worker_s {
+    pthread_t thread;
+    capinfo_pool_t *pool;
+    capinfo_stats_t stats;
+} capinfo_worker_t;
+
+/**
+ * checks every record of a chunk
+ */
+static void
+capinfo_scan_chunk(const capinfo_pool_t *pool, const capinfo_chunk_t *chunk,
+        capinfo_stats_t *stats)
+{
+    const u_char *rec = pool->cf->map + chunk->start;
+    const u_char *end = pool->cf->map + chunk->end;
+    struct pcap_pkthdr pkthdr, prev = chunk->prev;
+
+    /* so the first record's step back is measured from the right place */
+    stats->last_usec = (uint64_t)(uint32_t)prev.ts.tv_sec * 1000000 +
+            (stats->nsec ? (uint32_t)prev.ts.tv_usec / 1000 : (uint32_t)prev.ts.tv_usec);
+
+    while (rec < end) {
+        capinfo_parse_hdr(pool->fmt, rec, &pkthdr);
+        capinfo_stats_add(stats, pool->fmt, &pkthdr, rec + pool->fmt->pkthdrlen,
+                capinfo_backwards((int32_t)prev.ts.tv_sec, (int32_t)prev.ts.tv_usec, &pkthdr),
+                pool->fmt->snaplen < pkthdr.caplen);
+        prev = pkthdr;
+        rec += pool->fmt->pkthdrlen + pkthdr.caplen;
+    }
+}
+
+/**
+ * main loop of a --workers thread: check chunks until there are no more
+ */
+static void *
+capinfo_worker(void *arg)
+{
+    capinfo_worker_t *worker = (capinfo_worker_t *)arg;
+    capinfo_pool_t *pool = worker->pool;
+    capinfo_chunk_t chunk;
+
+    worker->stats.nsec = pool->nsec;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next == pool->chunk_cnt && !pool->done)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        if (pool->next == pool->chunk_cnt) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        chunk = pool->chunks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        capinfo_scan_chunk(pool, &chunk, &worker->stats);
+    }
+
+    return NULL;
+}
+
+/**
+ * hands a chunk to the workers
+ */
+static void
+capinfo_pool_add(capinfo_pool_t *pool, size_t start, size_t end, const struct pcap_pkthdr *prev)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->chunk_cnt == pool->chunk_alloc) {
+        pool->chunk_alloc = pool->chunk_alloc ? pool->chunk_alloc * 2 : 1024;
+        pool->chunks = safe_realloc(pool->chunks, sizeof(capinfo_chunk_t) * pool->chunk_alloc);
+    }
+
+    pool->chunks[pool->chunk_cnt].start = start;
+    pool->chunks[pool->chunk_cnt].end = end;
+    pool->chunks[pool->chunk_cnt].prev = *prev;
+    pool->chunk_cnt++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * --stats of a mapped file on several threads.  This thread only walks
+ * the record headers to cut the file into chunks of CAPINFO_CHUNK_PKTS
+ * records; the workers check them and their totals are summed up at the
+ * end.  Returns true if the last record is truncated.
+ */
+static bool
+capinfo_stats_parallel(capinfo_file_t *cf, const capinfo_fmt_t *fmt, int workers,
+        capinfo_stats_t *stats)
+{
+    capinfo_pool_t pool;
+    capinfo_worker_t *worker;
+    struct pcap_pkthdr pkthdr, prev;
+    size_t offset, start;
+    uint64_t first_usec = 0;
+    uint32_t n = 0;
+    bool truncated = false;
+    int i, j, rcode;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.cf = cf;
+    pool.fmt = fmt;
+    pool.nsec = stats->nsec;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    worker = safe_malloc(sizeof(capinfo_worker_t) * workers);
+    for (i = 0; i < workers; i++) {
+        worker[i].pool = &pool;
+        if ((rcode = pthread_create(&worker[i].thread, NULL, capinfo_worker, &worker[i])) != 0)
+            errx(-1, "Unable to start --workers thread: %s", strerror(rcode));
+    }
+
+    memset(&prev, 0, sizeof(prev));
+    offset = start = cf->start;
+    while (cf->end - offset >= (size_t)fmt->pkthdrlen) {
+        capinfo_parse_hdr(fmt, cf->map + offset, &pkthdr);
+        if (pkthdr.caplen > cf->end - offset - fmt->pkthdrlen) {
+            truncated = true;
+            break;
+        }
+
+        if (offset == cf->start)
+            first_usec = (uint64_t)(uint32_t)pkthdr.ts.tv_sec * 1000000 + (stats->nsec ?
+                    (uint32_t)pkthdr.ts.tv_usec / 1000 : (uint32_t)pkthdr.ts.tv_usec);
+
+        offset += fmt->pkthdrlen + pkthdr.caplen;
+        if (++n == CAPINFO_CHUNK_PKTS) {
+            capinfo_pool_add(&pool, start, offset, &prev);
+            start = offset;
+            prev = pkthdr;
+            n = 0;
+        }
+    }
+
+    if (n > 0)
+        capinfo_pool_add(&pool, start, offset, &prev);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.done = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < workers; i++) {
+        capinfo_stats_t *ws = &worker[i].stats;
+
+        if ((rcode = pthread_join(worker[i].thread, NULL)) != 0)
+            errx(-1, "Unable to join --workers thread: %s", strerror(rcode));
+
+        if (ws->packets == 0)
+            continue;
+
+        stats->min_caplen = stats->packets ? min(stats->min_caplen, ws->min_caplen) : ws->min_caplen;
+        stats->packets += ws->packets;
+        stats->bytes_cap += ws->bytes_cap;
+        stats->bytes_wire += ws->bytes_wire;
+        stats->max_caplen = max(stats->max_caplen, ws->max_caplen);
+        for (j = 0; j < CAPINFO_HIST_BUCKETS; j++)
+            stats->sizes[j] += ws->sizes[j];
+        stats->truncated += ws->truncated;
+        stats->toobig += ws->toobig;
+        stats->bad_frac += ws->bad_frac;
+        stats->ipv4 += ws->ipv4;
+        stats->bad_ipcsum += ws->bad_ipcsum;
+        stats->backwards += ws->backwards;
+        stats->max_backwards = max(stats->max_backwards, ws->max_backwards);
+        stats->max_usec = max(stats->max_usec, ws->max_usec);
+    }
+
+    /* workers only know the first packet of their own chunks */
+    stats->first_usec = first_usec;
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    safe_free(pool.chunks);
+    safe_free(worker);
+    return truncated;
+}
+#endif /* HAVE_LIBPTHREAD */
+
+/**
+ * prints the --stats totals of a file
+ */
+static void
+capinfo_stats_print(const capinfo_stats_t *stats)
+{
+    int bucket;
+
+    printf("packets     = %"PRIu64"\n", stats->packets);
+    if (stats->packets == 0)
+        return;
+
+    printf("bytes       = %"PRIu64" captured, %"PRIu64" on the wire\n",
+            stats->bytes_cap, stats->bytes_wire);
+    printf("caplen      = %"PRIu32" min, %"PRIu32" max, %"PRIu64" avg\n",
+            stats->min_caplen, stats->max_caplen, stats->bytes_cap / stats->packets);
+    printf("duration    = %"PRIu64".%06"PRIu64" sec\n",
+            (stats->max_usec - stats->first_usec) / 1000000,
+            (stats->max_usec - stats->first_usec) % 1000000);
+
+    printf("Caplen\t\tPackets\n");
+    for (bucket = 0; bucket < CAPINFO_HIST_BUCKETS; bucket++) {
+        if (bucket < CAPINFO_HIST_BUCKETS - 1)
+            printf("%5u-%-5u\t%"PRIu64"\n", bucket ? 64U << (bucket - 1) : 0,
+                    (64U << bucket) - 1, stats->sizes[bucket]);
+        else
+            printf("%5u+\t\t%"PRIu64"\n", 64U << (bucket - 1), stats->sizes[bucket]);
+    }
+
+    printf("BAD_TS      = %"PRIu64" (largest step back %"PRIu64" usec)\n",
+            stats->backwards, stats->max_backwards);
+    printf("bad usec    = %"PRIu64"\n", stats->bad_frac);
+    printf("TOOBIG      = %"PRIu64"\n", stats->toobig);
+    printf("bad IP csum = %"PRIu64" of %"PRIu64" IPv4 headers\n", stats->bad_ipcsum, stats->ipv4);
+    printf("truncated   = %"PRIu64" (caplen < len)\n", stats->truncated);
+}
+
+/**
+ * writes the seek index of pcapfile
+ */
+static void
+build_index(const char *pcapfile, long interval)
+{
+    pcap_index_t *idx;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    char *indexfile;
+
+    indexfile = pcap_index_path(pcapfile);
+    if ((idx = pcap_index_build(pcapfile, indexfile, (u_int32_t)interval, ebuf)) == NULL)
+        errx(-1, "Unable to index %s", ebuf);
+
+    printf("%s: indexed %" PRIu64 " packets, %" PRIu64 " entries in %s\n", pcapfile,
+            (uint64_t)idx->packets, (uint64_t)idx->entry_cnt, indexfile);
+    if (!idx->ts_sorted)
+        printf("%s: timestamps go backwards, --start-time will read from the start\n",
+                pcapfile);
+
+    pcap_index_free(idx);
+    safe_free(indexfile);
+}
+
+/**
+ * writes the metadata sidecar of pcapfile
+ */
+static void
+build_meta(const char *pcapfile)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    char *metafile;
+    COUNTER packets;
+
+    metafile = pcap_meta_path(pcapfile);
+    if (pcap_meta_build(pcapfile, metafile, &packets, ebuf) < 0)
+        errx(-1, "Unable to write metadata %s", ebuf);
+
+    printf("%s: wrote the metadata of %" PRIu64 " packets to %s\n", pcapfile,
+            (uint64_t)packets, metafile);
+
+    safe_free(metafile);
+}
+
 /**
  * code to do a ones-compliment checksum
  */
 static int
-do_checksum_math(u_int16_t *data, int len)
+do_checksum_math(const u_char *data, int len)
 {
     int sum = 0;
     union {
@@ -343,13 +1065,16 @@ do_checksum_math(u_int16_t *data, int len)
         u_int8_t b[2];
     } pad;
 
+    /* packets in a mapped file needn't be 16 bit aligned */
     while (len > 1) {
-        sum += *data++;
+        memcpy(&pad.s, data, sizeof(pad.s));
+        sum += pad.s;
+        data += 2;
         len -= 2;
     }
 
     if (len == 1) {
-        pad.b[0] = *(u_int8_t *)data;
+        pad.b[0] = *data;
         pad.b[1] = 0;
         sum += pad.s;
     }
@@ -357,3 +1082,28 @@ do_checksum_math(u_int16_t *data, int len)
     return (sum);
 }
 
+/**
+ * read() which only comes up short at the end of the file, since a
+ * decompressed file arrives in whatever pieces the decoder produced
+ */
+static ssize_t
+read_full(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        if ((n = read(fd, (u_char *)buf + got, len - got)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (n == 0)
+            break;
+
+        got += n;
+    }
+
+    return got;
+}
@@ -27,8 +27,8 @@
 #include "tcpedit.h"
 #include "checksum.h"
 
-static int do_checksum_math(uint16_t *, int);
-
+#include <stddef.h>
+#include <string.h>
 
 /**
  * Returns -1 on error and 0 on success, 1 on warn
@@ -154,28 +154,58 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len) {
 }
 
 /**
- * code to do a ones-compliment checksum
+ * Store the folded, uncomplemented pseudo-header sum in the TCP/UDP
+ * checksum field, which is what a NIC completing the checksum from the L4
+ * header onwards expects to find there.  len is the L4 length.  For IPv6 the
+ * L4 header must directly follow the IPv6 header.  Returns 0 if the field was
+ * seeded and 1 if the packet needs a full checksum instead.
  */
-static int
-do_checksum_math(uint16_t *data, int len)
+int
+do_checksum_seed(uint8_t *data, int proto, int len)
 {
-    int sum = 0;
-    union {
-        uint16_t s;
-        uint8_t b[2];
-    } pad;
-
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
+    ipv4_hdr_t *ipv4;
+    ipv6_hdr_t *ipv6;
+    u_char *field;
+    uint16_t seed;
+    int ip_hl;
+    int sum;
+
+    assert(data);
+
+    ipv4 = (ipv4_hdr_t *)data;
+    if (ipv4->ip_v == 6) {
+        ipv6 = (ipv6_hdr_t *)data;
+        if (ipv6->ip_nh != proto)
+            return 1;
+
+        ip_hl = TCPR_IPV6_H;
+        sum = do_checksum_math((uint16_t *)&ipv6->ip_src, 32);
+    } else {
+        ip_hl = ipv4->ip_hl << 2;
+        sum = do_checksum_math((uint16_t *)&ipv4->ip_src, 8);
     }
 
-    if (len == 1) {
-        pad.b[0] = *(uint8_t *)data;
-        pad.b[1] = 0;
-        sum += pad.s;
+    switch (proto) {
+        case IPPROTO_TCP:
+            if (len < TCPR_TCP_H)
+                return 1;
+            field = data + ip_hl + offsetof(tcp_hdr_t, th_sum);
+            break;
+
+        case IPPROTO_UDP:
+            if (len < TCPR_UDP_H)
+                return 1;
+            field = data + ip_hl + offsetof(udp_hdr_t, uh_sum);
+            break;
+
+        default:
+            return 1;
     }
 
-    return (sum);
-}
+    sum += ntohs(proto + len);
+    sum = (sum >> 16) + (sum & 0xffff);
+    seed = (uint16_t)((sum + (sum >> 16)) & 0xffff);
+    memcpy(field, &seed, sizeof(seed));     /* L4 may be oddly aligned */
 
+    return 0;
+}
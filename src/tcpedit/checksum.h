@@ -21,9 +21,9 @@
 #ifndef _CHECKSUM_H_
 #define _CHECKSUM_H_
 
-#define CHECKSUM_CARRY(x) \
-    (x = (x >> 16) + (x & 0xffff), (~(x + (x >> 16)) & 0xffff))
+#include "common/checksum_math.h"
 
 int do_checksum(tcpedit_t *, u_int8_t *, int, int);
+int do_checksum_seed(u_int8_t *, int, int);
 
 #endif
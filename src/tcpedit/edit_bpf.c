@@ -0,0 +1,269 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * --edit-bpf: runs a user eBPF program over each packet with uBPF, JIT
+ * compiled where uBPF can, see edit_bpf.h for what the program sees
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tcpedit.h"
+#include "checksum.h"
+#include "edit_bpf.h"
+
+#ifdef HAVE_UBPF
+#include <ubpf.h>
+#endif
+
+struct tcpedit_bpf_s {
+    char *path;
+#ifdef HAVE_UBPF
+    struct ubpf_vm *vm;
+    ubpf_jit_fn jit;            /* NULL if the program is interpreted */
+#endif
+};
+
+#ifdef HAVE_UBPF
+static uint64_t
+helper_csum_replace(uint64_t csum, uint64_t old, uint64_t new, uint64_t len,
+        uint64_t UNUSED(unused))
+{
+    uint16_t sum;
+
+    memcpy(&sum, (void *)(uintptr_t)csum, sizeof(sum));
+    sum = do_checksum_adjust(sum, (const uint8_t *)(uintptr_t)old,
+            (const uint8_t *)(uintptr_t)new, (int)len);
+    memcpy((void *)(uintptr_t)csum, &sum, sizeof(sum));
+    return 0;
+}
+
+static uint64_t
+helper_csum_replace_val(uint64_t csum, uint64_t old, uint64_t new, uint64_t size,
+        uint64_t UNUSED(unused))
+{
+    uint32_t old32 = (uint32_t)old, new32 = (uint32_t)new;
+    uint16_t old16 = (uint16_t)old, new16 = (uint16_t)new;
+
+    /* the values are in the byte order they had in the packet */
+    if (size == 4)
+        return helper_csum_replace(csum, (uintptr_t)&old32, (uintptr_t)&new32, 4, 0);
+    if (size == 2)
+        return helper_csum_replace(csum, (uintptr_t)&old16, (uintptr_t)&new16, 2, 0);
+
+    return (uint64_t)-1;
+}
+
+/* reads the whole ELF object at path, NULL and errno on error */
+static void *
+bpf_read_file(const char *path, size_t *len)
+{
+    struct stat st;
+    void *buf;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+
+    if (fstat(fileno(fp), &st) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if (st.st_size <= 0) {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    buf = safe_malloc(st.st_size);
+    if (fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+        fclose(fp);
+        safe_free(buf);
+        errno = EIO;
+        return NULL;
+    }
+
+    fclose(fp);
+    *len = st.st_size;
+    return buf;
+}
+#endif /* HAVE_UBPF */
+
+/**
+ * \brief Loads the --edit-bpf program at path
+ *
+ * Replaces any program loaded before.  The program is JIT compiled, or
+ * interpreted if uBPF has no JIT for this CPU.  Returns TCPEDIT_ERROR if
+ * it can't be loaded or tcpedit was built without uBPF.
+ */
+int
+tcpedit_bpf_load(tcpedit_t *tcpedit, const char *path)
+{
+#ifdef HAVE_UBPF
+    tcpedit_bpf_t *bpf;
+    char *errmsg = NULL;
+    size_t len = 0;
+    void *elf;
+
+    assert(tcpedit);
+    assert(path);
+
+    tcpedit_bpf_free(tcpedit);
+
+    if ((elf = bpf_read_file(path, &len)) == NULL) {
+        tcpedit_seterr(tcpedit, "Unable to read --edit-bpf program %s: %s", path,
+                strerror(errno));
+        return TCPEDIT_ERROR;
+    }
+
+    bpf = safe_malloc(sizeof(tcpedit_bpf_t));
+    if ((bpf->vm = ubpf_create()) == NULL) {
+        tcpedit_seterr(tcpedit, "%s", "Unable to create a uBPF VM");
+        safe_free(elf);
+        safe_free(bpf);
+        return TCPEDIT_ERROR;
+    }
+
+    ubpf_register(bpf->vm, TCPEDIT_BPF_HELPER_CSUM_REPLACE, "csum_replace",
+            helper_csum_replace);
+    ubpf_register(bpf->vm, TCPEDIT_BPF_HELPER_CSUM_REPLACE_VAL, "csum_replace_val",
+            helper_csum_replace_val);
+
+    if (ubpf_load_elf(bpf->vm, elf, len, &errmsg) < 0) {
+        tcpedit_seterr(tcpedit, "Unable to load --edit-bpf program %s: %s", path,
+                errmsg ? errmsg : "invalid program");
+        free(errmsg);
+        safe_free(elf);
+        ubpf_destroy(bpf->vm);
+        safe_free(bpf);
+        return TCPEDIT_ERROR;
+    }
+    safe_free(elf);
+
+    if ((bpf->jit = ubpf_compile(bpf->vm, &errmsg)) == NULL) {
+        warnx("--edit-bpf: no JIT for %s, interpreting it: %s", path,
+                errmsg ? errmsg : "unknown error");
+        free(errmsg);
+        /* the interpreter only allows the md and the stack, not the packet */
+        ubpf_toggle_bounds_check(bpf->vm, false);
+    }
+
+    bpf->path = safe_strdup(path);
+    tcpedit->bpf = bpf;
+    dbgx(1, "--edit-bpf: loaded %s, %s", path, bpf->jit ? "JIT compiled" : "interpreted");
+    return TCPEDIT_OK;
+#else
+    (void)path;
+    tcpedit_seterr(tcpedit, "%s", "--edit-bpf requires uBPF, see configure --with-ubpf");
+    return TCPEDIT_ERROR;
+#endif
+}
+
+/**
+ * \brief Runs the --edit-bpf program over the packet of a compiled edit
+ *
+ * Returns the number of changes which need the checksums fixed, like the
+ * other edits, TCPEDIT_SOFT_ERROR to drop the packet or TCPEDIT_ERROR.
+ */
+int
+tcpedit_bpf_run(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+#ifdef HAVE_UBPF
+    tcpedit_bpf_t *bpf = tcpedit->bpf;
+    struct tcpedit_bpf_md md;
+    const u_char *l3 = NULL;
+    uint64_t ret;
+
+    if (pkt->ip_hdr != NULL) {
+        l3 = (const u_char *)pkt->ip_hdr;
+        md.l3_proto = ETHERTYPE_IP;
+    } else if (pkt->ip6_hdr != NULL) {
+        l3 = (const u_char *)pkt->ip6_hdr;
+        md.l3_proto = ETHERTYPE_IP6;
+    } else if (pkt->arp_hdr != NULL) {
+        l3 = (const u_char *)pkt->arp_hdr;
+        md.l3_proto = ETHERTYPE_ARP;
+    } else {
+        md.l3_proto = 0;
+    }
+
+    md.data = (uintptr_t)pkt->packet;
+    md.data_end = (uintptr_t)(pkt->packet + pkt->pkthdr->caplen);
+    md.l3_off = l3 != NULL ? (uint32_t)(l3 - pkt->packet) : 0;
+    md.direction = (uint8_t)pkt->direction;
+    md.pad = 0;
+    md.packetnum = tcpedit->runtime.packetnum;
+
+    if (bpf->jit != NULL) {
+        ret = bpf->jit(&md, sizeof(md));
+    } else if (ubpf_exec(bpf->vm, &md, sizeof(md), &ret) < 0) {
+        tcpedit_seterr(tcpedit, "--edit-bpf program %s failed on packet " COUNTER_SPEC,
+                bpf->path, tcpedit->runtime.packetnum);
+        return TCPEDIT_ERROR;
+    }
+
+    switch (ret) {
+    case TCPEDIT_BPF_PASS:
+    case TCPEDIT_BPF_CSUM_DONE:
+        return 0;
+
+    case TCPEDIT_BPF_CHANGED:
+        /* the program may have changed anything, so sum it all */
+        pkt->fullcsum = true;
+        return 1;
+
+    case TCPEDIT_BPF_DROP:
+        return TCPEDIT_SOFT_ERROR;
+
+    default:
+        tcpedit_seterr(tcpedit, "--edit-bpf program %s returned %" PRIu64 " for packet "
+                COUNTER_SPEC, bpf->path, ret, tcpedit->runtime.packetnum);
+        return TCPEDIT_ERROR;
+    }
+#else
+    (void)pkt;
+    tcpedit_seterr(tcpedit, "%s", "--edit-bpf requires uBPF, see configure --with-ubpf");
+    return TCPEDIT_ERROR;
+#endif
+}
+
+void
+tcpedit_bpf_free(tcpedit_t *tcpedit)
+{
+    tcpedit_bpf_t *bpf = tcpedit->bpf;
+
+    if (bpf == NULL)
+        return;
+
+#ifdef HAVE_UBPF
+    ubpf_destroy(bpf->vm);
+#endif
+    safe_free(bpf->path);
+    safe_free(bpf);
+    tcpedit->bpf = NULL;
+}
@@ -0,0 +1,74 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2014 Fred Klassen <tcpreplay at appneta dot com> - AppNeta Inc.
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EDIT_BPF_H_
+#define _EDIT_BPF_H_
+
+#include "tcpedit_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * --edit-bpf: a user eBPF program, an ELF object built with
+ * clang -target bpf, runs over every packet after the other edits and
+ * before the checksums are fixed.  It gets a pointer to this in r1, like
+ * an XDP program gets its xdp_md, and has to check its accesses against
+ * data_end itself: nothing else stops it.  The frame can be changed in
+ * place but not grow or shrink.
+ */
+struct tcpedit_bpf_md {
+    uint64_t data;          /* first byte of the frame */
+    uint64_t data_end;      /* one past the last byte captured */
+    uint32_t l3_off;        /* of the IPv4, IPv6 or ARP header, 0 if none */
+    uint16_t l3_proto;      /* its ethertype in host byte order, 0 if none */
+    uint8_t direction;      /* 1 client to server, 2 server to client */
+    uint8_t pad;
+    uint64_t packetnum;     /* from 1 */
+};
+
+/* what the program returns */
+#define TCPEDIT_BPF_PASS        0   /* unchanged */
+#define TCPEDIT_BPF_CHANGED     1   /* changed, tcpedit fixes the checksums */
+#define TCPEDIT_BPF_CSUM_DONE   2   /* changed, the checksums were patched with the helpers */
+#define TCPEDIT_BPF_DROP        3   /* don't send or write it */
+
+/*
+ * Helpers, called by number.  Both patch the 16 bit Internet checksum at
+ * csum for bytes that changed, as RFC 1624 does, so a program can fix the
+ * checksums of the fields it rewrites without summing the packet:
+ *
+ * 1: long csum_replace(void *csum, const void *old, const void *new, int len)
+ *    len bytes, an even number, went from old to new
+ * 2: long csum_replace_val(void *csum, u64 old, u64 new, int size)
+ *    a 2 or 4 byte field went from old to new, both as loaded from and
+ *    stored to the packet
+ */
+#define TCPEDIT_BPF_HELPER_CSUM_REPLACE      1
+#define TCPEDIT_BPF_HELPER_CSUM_REPLACE_VAL  2
+
+int tcpedit_bpf_load(tcpedit_t *tcpedit, const char *path);
+int tcpedit_bpf_run(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt);
+void tcpedit_bpf_free(tcpedit_t *tcpedit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -35,11 +35,18 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 static uint32_t randomize_ipv4_addr(tcpedit_t *tcpedit, uint32_t ip);
 static uint32_t remap_ipv4(tcpedit_t *tcpedit, tcpr_cidr_t *cidr, const uint32_t original);
 static int is_unicast_ipv4(tcpedit_t *tcpedit, uint32_t ip);
 
-static void randomize_ipv6_addr(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
 static int remap_ipv6(tcpedit_t *tcpedit, tcpr_cidr_t *cidr, struct tcpr_in6_addr *addr);
 static int is_multicast_ipv6(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
 
@@ -63,8 +70,14 @@ fix_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv4_hdr_t *i
 
     /* calc the L4 checksum if we have the whole packet && not a frag or first frag */
     if (pkthdr->caplen == pkthdr->len && (htons(ip_hdr->ip_off) & IP_OFFMASK) == 0) {
-        ret1 = do_checksum(tcpedit, (u_char *) ip_hdr, 
-                ip_hdr->ip_p, ntohs(ip_hdr->ip_len) - (ip_hdr->ip_hl << 2));
+        /* sendpacket won't offload the first fragment, so sum it here */
+        if (tcpedit->csum_offload && (htons(ip_hdr->ip_off) & IP_MF) == 0 &&
+                do_checksum_seed((u_char *) ip_hdr, ip_hdr->ip_p,
+                    ntohs(ip_hdr->ip_len) - (ip_hdr->ip_hl << 2)) == 0)
+            ret1 = TCPEDIT_OK;
+        else
+            ret1 = do_checksum(tcpedit, (u_char *) ip_hdr, 
+                    ip_hdr->ip_p, ntohs(ip_hdr->ip_len) - (ip_hdr->ip_hl << 2));
         if (ret1 < 0)
             return TCPEDIT_ERROR;
     }
@@ -92,8 +105,13 @@ fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *i
 
     /* calc the L4 checksum if we have the whole packet && not a frag or first frag */
     if (pkthdr->caplen == pkthdr->len) {
-        ret = do_checksum(tcpedit, (u_char *) ip6_hdr, ip6_hdr->ip_nh,
-            htons(ip6_hdr->ip_len));
+        if (tcpedit->csum_offload &&
+                do_checksum_seed((u_char *) ip6_hdr, ip6_hdr->ip_nh,
+                    htons(ip6_hdr->ip_len)) == 0)
+            ret = TCPEDIT_OK;
+        else
+            ret = do_checksum(tcpedit, (u_char *) ip6_hdr, ip6_hdr->ip_nh,
+                htons(ip6_hdr->ip_len));
         if (ret < 0)
             return TCPEDIT_ERROR;
     }
@@ -105,6 +123,165 @@ fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *i
     return TCPEDIT_OK;
 }
 
+/**
+ * Returns the offset of the checksum in a TCP or UDP header, or -1 for
+ * other protocols.  min_len is set to the size of the fixed header.
+ */
+static int
+l4_csum_offset(int proto, int *min_len)
+{
+    switch (proto) {
+    case IPPROTO_TCP:
+        *min_len = TCPR_TCP_H;
+        return 16;
+    case IPPROTO_UDP:
+        *min_len = TCPR_UDP_H;
+        return 6;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Save what adjust_ipv4_checksums() needs to patch the L4 checksum.
+ * Only whole, unfragmented TCP/UDP packets qualify; a UDP checksum of 0
+ * is left for the full recompute to fill in.
+ */
+void
+csum_snapshot_ipv4(csum_snapshot_t *snap, const struct pcap_pkthdr *pkthdr,
+        const ipv4_hdr_t *ip_hdr)
+{
+    const u_char *l4;
+    int hl, off, min_len;
+    uint16_t sum;
+
+    assert(snap);
+    assert(pkthdr);
+    assert(ip_hdr);
+
+    snap->proto = 0;
+    hl = ip_hdr->ip_hl << 2;
+
+    if (pkthdr->caplen != pkthdr->len || (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)))
+        return;
+
+    if ((off = l4_csum_offset(ip_hdr->ip_p, &min_len)) < 0 ||
+            ntohs(ip_hdr->ip_len) < hl + min_len)
+        return;
+
+    l4 = (const u_char *)ip_hdr + hl;
+    memcpy(&sum, l4 + off, sizeof(sum));
+    if (ip_hdr->ip_p == IPPROTO_UDP && sum == 0)
+        return;
+
+    snap->hl = hl;
+    snap->len = ip_hdr->ip_len;
+    snap->addrs_len = 8;
+    memcpy(snap->addrs, &ip_hdr->ip_src, 8);
+    memcpy(snap->ports, l4, sizeof(snap->ports));
+    snap->proto = ip_hdr->ip_p;
+}
+
+/**
+ * IPv6 version of csum_snapshot_ipv4(), for TCP/UDP right after the
+ * fixed header
+ */
+void
+csum_snapshot_ipv6(csum_snapshot_t *snap, const struct pcap_pkthdr *pkthdr,
+        const ipv6_hdr_t *ip6_hdr)
+{
+    const u_char *l4;
+    int off, min_len;
+    uint16_t sum;
+
+    assert(snap);
+    assert(pkthdr);
+    assert(ip6_hdr);
+
+    snap->proto = 0;
+
+    if (pkthdr->caplen != pkthdr->len)
+        return;
+
+    if ((off = l4_csum_offset(ip6_hdr->ip_nh, &min_len)) < 0 ||
+            ntohs(ip6_hdr->ip_len) < min_len)
+        return;
+
+    l4 = (const u_char *)(ip6_hdr + 1);
+    memcpy(&sum, l4 + off, sizeof(sum));
+    if (ip6_hdr->ip_nh == IPPROTO_UDP && sum == 0)
+        return;
+
+    snap->hl = 0;
+    snap->len = ip6_hdr->ip_len;
+    snap->addrs_len = 32;
+    memcpy(snap->addrs, &ip6_hdr->ip_src, 32);
+    memcpy(snap->ports, l4, sizeof(snap->ports));
+    snap->proto = ip6_hdr->ip_nh;
+}
+
+/**
+ * Patch the L4 checksum at l4 for the address and port changes since
+ * the snapshot was taken
+ */
+static void
+adjust_l4_checksum(const csum_snapshot_t *snap, const u_char *addrs, u_char *l4)
+{
+    int min_len, off = l4_csum_offset(snap->proto, &min_len);
+    uint16_t sum;
+
+    memcpy(&sum, l4 + off, sizeof(sum));
+    sum = do_checksum_adjust(sum, snap->addrs, addrs, snap->addrs_len);
+    sum = do_checksum_adjust(sum, snap->ports, l4, sizeof(snap->ports));
+    memcpy(l4 + off, &sum, sizeof(sum));
+}
+
+/**
+ * Same result as fix_ipv4_checksums() for packets whose checksums were
+ * valid, but only header edits are summed (RFC 1624) instead of the
+ * whole payload.  Falls back to fix_ipv4_checksums() if the packet
+ * doesn't match the snapshot any more.
+ */
+int
+adjust_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
+        ipv4_hdr_t *ip_hdr, const csum_snapshot_t *snap)
+{
+    assert(tcpedit);
+    assert(pkthdr);
+    assert(ip_hdr);
+    assert(snap);
+
+    if (snap->proto == 0 || snap->proto != ip_hdr->ip_p || snap->hl != (ip_hdr->ip_hl << 2) ||
+            snap->len != ip_hdr->ip_len || pkthdr->caplen != pkthdr->len)
+        return fix_ipv4_checksums(tcpedit, pkthdr, ip_hdr);
+
+    adjust_l4_checksum(snap, (u_char *)&ip_hdr->ip_src, (u_char *)ip_hdr + snap->hl);
+
+    /* calc IP checksum */
+    return do_checksum(tcpedit, (u_char *) ip_hdr, IPPROTO_IP, ntohs(ip_hdr->ip_len));
+}
+
+/**
+ * IPv6 version of adjust_ipv4_checksums()
+ */
+int
+adjust_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
+        ipv6_hdr_t *ip6_hdr, const csum_snapshot_t *snap)
+{
+    assert(tcpedit);
+    assert(pkthdr);
+    assert(ip6_hdr);
+    assert(snap);
+
+    if (snap->proto == 0 || snap->proto != ip6_hdr->ip_nh ||
+            snap->len != ip6_hdr->ip_len || pkthdr->caplen != pkthdr->len)
+        return fix_ipv6_checksums(tcpedit, pkthdr, ip6_hdr);
+
+    adjust_l4_checksum(snap, (u_char *)&ip6_hdr->ip_src, (u_char *)(ip6_hdr + 1));
+
+    return TCPEDIT_OK;
+}
+
 /**
  * returns a new 32bit integer which is the randomized IP 
  * based upon the user specified seed
@@ -121,23 +298,46 @@ randomize_ipv4_addr(tcpedit_t *tcpedit, uint32_t ip)
     return ((ip ^ htonl(tcpedit->seed)) - (ip & htonl(tcpedit->seed)));
 }
 
+/**
+ * Randomizes n consecutive 32 bit words in network byte order the same
+ * way as randomize_ipv4_addr(), minus the broadcast check.  Four words go
+ * at a time where there's SSE2 or NEON, so a packet's IPv6 source and
+ * destination take two steps.  p needn't be aligned.
+ */
 static void
-randomize_ipv6_addr(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr)
+randomize_words(u_char *p, int n, uint32_t seed)
 {
-    uint32_t *p;
-    int i;
-    u_char was_multicast;
+    uint32_t w;
 
-    assert(tcpedit);
+#if defined __SSE2__
+    const __m128i s = _mm_set1_epi32((int)seed);
 
-    p = &addr->__u6_addr.__u6_addr32[0];
+    for (; n >= 4; n -= 4, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        v = _mm_sub_epi32(_mm_xor_si128(v, s), _mm_and_si128(v, s));
+        _mm_storeu_si128((__m128i *)p, v);
+    }
+#elif defined __ARM_NEON
+    const uint32x4_t s = vdupq_n_u32(seed);
 
-    was_multicast = is_multicast_ipv6(tcpedit, addr);
+    for (; n >= 4; n -= 4, p += 16) {
+        uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(p));
+        v = vsubq_u32(veorq_u32(v, s), vandq_u32(v, s));
+        vst1q_u8(p, vreinterpretq_u8_u32(v));
+    }
+#endif
 
-    for (i = 0; i < 4; ++i) {
-        p[i] = ((p[i] ^ htonl(tcpedit->seed)) - (p[i] & htonl(tcpedit->seed)));
+    for (; n > 0; n--, p += 4) {
+        memcpy(&w, p, sizeof(w));
+        w = (w ^ seed) - (w & seed);
+        memcpy(p, &w, sizeof(w));
     }
+}
 
+/* keeps a randomized IPv6 address multicast only if it was before */
+static void
+randomize_ipv6_fixup(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr, u_char was_multicast)
+{
     if (was_multicast) {
         addr->tcpr_s6_addr[0] = 0xff;
     } else if (is_multicast_ipv6(tcpedit, addr)) {
@@ -145,7 +345,6 @@ randomize_ipv6_addr(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr)
     }
 }
 
-
 /**
  * randomizes the source and destination IP addresses based on a 
  * pseudo-random number which is generated via the seed.
@@ -158,6 +357,8 @@ randomize_ipv4(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
 #ifdef DEBUG
     char srcip[16], dstip[16];
 #endif
+    bool src, dst;
+
     assert(tcpedit);
     assert(pkthdr);
     assert(pktdata);
@@ -172,15 +373,14 @@ randomize_ipv4(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
     dbgx(1, "Old Src IP: %s\tOld Dst IP: %s", srcip, dstip);
 
     /* don't rewrite broadcast addresses */
-    if ((tcpedit->skip_broadcast && is_unicast_ipv4(tcpedit, (u_int32_t)ip_hdr->ip_dst.s_addr)) 
-        || !tcpedit->skip_broadcast) {
-        ip_hdr->ip_dst.s_addr = randomize_ipv4_addr(tcpedit, ip_hdr->ip_dst.s_addr);
-    }
-    
-    if ((tcpedit->skip_broadcast && is_unicast_ipv4(tcpedit, (u_int32_t)ip_hdr->ip_src.s_addr))
-        || !tcpedit->skip_broadcast) {
-        ip_hdr->ip_src.s_addr = randomize_ipv4_addr(tcpedit, ip_hdr->ip_src.s_addr);
-    }
+    dst = !tcpedit->skip_broadcast || is_unicast_ipv4(tcpedit, (u_int32_t)ip_hdr->ip_dst.s_addr);
+    src = !tcpedit->skip_broadcast || is_unicast_ipv4(tcpedit, (u_int32_t)ip_hdr->ip_src.s_addr);
+
+    /* the source is followed by the destination, so usually one go does both */
+    if (src)
+        randomize_words((u_char *)&ip_hdr->ip_src, dst ? 2 : 1, htonl(tcpedit->seed));
+    else if (dst)
+        randomize_words((u_char *)&ip_hdr->ip_dst, 1, htonl(tcpedit->seed));
 
 #ifdef DEBUG    
     strlcpy(srcip, get_addr2name4(ip_hdr->ip_src.s_addr, RESOLVE), 16);
@@ -199,6 +399,9 @@ randomize_ipv6(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
 #ifdef DEBUG
     char srcip[INET6_ADDRSTRLEN], dstip[INET6_ADDRSTRLEN];
 #endif
+    u_char src_multicast, dst_multicast;
+    bool src, dst;
+
     assert(tcpedit);
     assert(pkthdr);
     assert(pktdata);
@@ -212,16 +415,23 @@ randomize_ipv6(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
     /* randomize IP addresses based on the value of random */
     dbgx(1, "Old Src IP: %s\tOld Dst IP: %s", srcip, dstip);
 
+    src_multicast = is_multicast_ipv6(tcpedit, &ip6_hdr->ip_src);
+    dst_multicast = is_multicast_ipv6(tcpedit, &ip6_hdr->ip_dst);
+
     /* don't rewrite broadcast addresses */
-    if ((tcpedit->skip_broadcast && !is_multicast_ipv6(tcpedit, &ip6_hdr->ip_dst))
-        || !tcpedit->skip_broadcast) {
-        randomize_ipv6_addr(tcpedit, &ip6_hdr->ip_dst);
-    }
+    dst = !tcpedit->skip_broadcast || !dst_multicast;
+    src = !tcpedit->skip_broadcast || !src_multicast;
 
-    if ((tcpedit->skip_broadcast && !is_multicast_ipv6(tcpedit, &ip6_hdr->ip_src))
-        || !tcpedit->skip_broadcast) {
-        randomize_ipv6_addr(tcpedit, &ip6_hdr->ip_src);
-    }
+    /* as for IPv4, the destination follows the source */
+    if (src)
+        randomize_words(ip6_hdr->ip_src.tcpr_s6_addr, dst ? 8 : 4, htonl(tcpedit->seed));
+    else if (dst)
+        randomize_words(ip6_hdr->ip_dst.tcpr_s6_addr, 4, htonl(tcpedit->seed));
+
+    if (src)
+        randomize_ipv6_fixup(tcpedit, &ip6_hdr->ip_src, src_multicast);
+    if (dst)
+        randomize_ipv6_fixup(tcpedit, &ip6_hdr->ip_dst, dst_multicast);
 
 #ifdef DEBUG
     strlcpy(srcip, get_addr2name6(&ip6_hdr->ip_src, RESOLVE), INET6_ADDRSTRLEN);
@@ -319,7 +529,6 @@ extract_data(tcpedit_t *tcpedit, const u_char *pktdata, int caplen,
     ipv4_hdr_t *ip_hdr = NULL;
     tcp_hdr_t *tcp_hdr = NULL;
     udp_hdr_t *udp_hdr = NULL;
-    u_char ipbuff[MAXPACKET];
     u_char *dataptr = NULL;
     
     assert(tcpedit);
@@ -327,11 +536,12 @@ extract_data(tcpedit_t *tcpedit, const u_char *pktdata, int caplen,
     assert(l7data);
 
     /* grab our IPv4 header */
-    dataptr = ipbuff;
     if ((ip_hdr = (ipv4_hdr_t*)get_ipv4(pktdata, caplen, 
-                    tcpedit->runtime.dlt1, &dataptr)) == NULL)
+                    tcpedit->runtime.dlt1)) == NULL)
         return 0;
 
+    dataptr = (u_char *)ip_hdr;
+
     /* 
      * figure out the actual datalen which might be < the caplen
      * due to ethernet padding 
@@ -390,81 +600,103 @@ extract_data(tcpedit_t *tcpedit, const u_char *pktdata, int caplen,
 }
 
 /**
- * rewrites an IPv4 packet's TTL based on the rules
- * return 0 if no change, 1 if changed 
+ * Works out the --ttl, --tos, --tclass and --flowlabel edits once: the new
+ * TTL (or hop limit) for every old one, and which bits of the first IPv6
+ * word change
  */
-int
-rewrite_ipv4_ttl(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr)
+void
+compile_l3patch(tcpedit_t *tcpedit, tcpedit_l3patch_t *patch)
 {
-    assert(tcpedit);
+    int ttl;
 
-    /* make sure there's something to edit */
-    if (ip_hdr == NULL || tcpedit->ttl_mode == false)
-        return(0);
-        
-    switch(tcpedit->ttl_mode) {
-    case TCPEDIT_TTL_MODE_SET:
-        if (ip_hdr->ip_ttl == tcpedit->ttl_value)
-            return(0);           /* no change required */
-        ip_hdr->ip_ttl = tcpedit->ttl_value;
-        break;
-    case TCPEDIT_TTL_MODE_ADD:
-        if (((int)ip_hdr->ip_ttl + tcpedit->ttl_value) > 255) {
-            ip_hdr->ip_ttl = 255;
-        } else {
-            ip_hdr->ip_ttl += tcpedit->ttl_value;
-        }
-        break;
-    case TCPEDIT_TTL_MODE_SUB:
-        if (ip_hdr->ip_ttl <= tcpedit->ttl_value) {
-            ip_hdr->ip_ttl = 1;
-        } else {
-            ip_hdr->ip_ttl -= tcpedit->ttl_value;
+    assert(tcpedit);
+    assert(patch);
+
+    for (ttl = 0; ttl < 256; ttl++) {
+        switch (tcpedit->ttl_mode) {
+        case TCPEDIT_TTL_MODE_OFF:
+            patch->ttl[ttl] = ttl;
+            break;
+        case TCPEDIT_TTL_MODE_SET:
+            patch->ttl[ttl] = tcpedit->ttl_value;
+            break;
+        case TCPEDIT_TTL_MODE_ADD:
+            patch->ttl[ttl] = min(ttl + tcpedit->ttl_value, 255);
+            break;
+        case TCPEDIT_TTL_MODE_SUB:
+            patch->ttl[ttl] = ttl <= tcpedit->ttl_value ? 1 : ttl - tcpedit->ttl_value;
+            break;
+        default:
+            errx(1, "invalid ttl_mode: %d", tcpedit->ttl_mode);
         }
-        break;
-    default:
-        errx(1, "invalid ttl_mode: %d", tcpedit->ttl_mode);
     }
-    return(1);
+
+    patch->tos = tcpedit->tos;
+
+    patch->v6_keep = 0xffffffff;
+    patch->v6_set = 0;
+    if (tcpedit->tclass > -1) {
+        patch->v6_keep &= 0xf00fffff;
+        patch->v6_set |= (uint32_t)tcpedit->tclass << 20;
+    }
+    if (tcpedit->flowlabel > -1) {
+        patch->v6_keep &= 0xfff00000;
+        patch->v6_set |= (uint32_t)tcpedit->flowlabel;
+    }
 }
 
 /**
- * rewrites an IPv6 packet's hop limit based on the rules
- * return 0 if no change, 1 if changed
+ * Applies the TOS and TTL edits to an IPv4 header and patches its
+ * checksum for them (RFC 1624).  Neither is in the TCP/UDP pseudo-header,
+ * so returns 0: no other checksum needs fixing.
  */
 int
-rewrite_ipv6_hlim(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr)
+patch_ipv4(const tcpedit_l3patch_t *patch, ipv4_hdr_t *ip_hdr)
 {
-    assert(tcpedit);
+    u_char *hdr = (u_char *)ip_hdr;
+    u_char old_tos[2], old_ttl[2];      /* the 16 bit words holding them */
+    uint16_t sum;
 
-    /* make sure there's something to edit */
-    if (ip6_hdr == NULL || tcpedit->ttl_mode == TCPEDIT_TTL_MODE_OFF)
-        return(0);
+    assert(patch);
+    assert(ip_hdr);
 
-    switch(tcpedit->ttl_mode) {
-    case TCPEDIT_TTL_MODE_SET:
-        if (ip6_hdr->ip_hl == tcpedit->ttl_value)
-            return(0);           /* no change required */
-        ip6_hdr->ip_hl = tcpedit->ttl_value;
-        break;
-    case TCPEDIT_TTL_MODE_ADD:
-        if (((int)ip6_hdr->ip_hl + tcpedit->ttl_value) > 255) {
-            ip6_hdr->ip_hl = 255;
-        } else {
-            ip6_hdr->ip_hl += tcpedit->ttl_value;
-        }
-        break;
-    case TCPEDIT_TTL_MODE_SUB:
-        if (ip6_hdr->ip_hl <= tcpedit->ttl_value) {
-            ip6_hdr->ip_hl = 1;
-        } else {
-            ip6_hdr->ip_hl -= tcpedit->ttl_value;
-        }
-        break;
-    default:
-        errx(1, "invalid ttl_mode: %d", tcpedit->ttl_mode);
+    memcpy(old_tos, hdr, 2);
+    memcpy(old_ttl, hdr + 8, 2);
+
+    if (patch->tos > -1)
+        ip_hdr->ip_tos = patch->tos;
+    ip_hdr->ip_ttl = patch->ttl[ip_hdr->ip_ttl];
+
+    if (memcmp(old_tos, hdr, 2) != 0 || memcmp(old_ttl, hdr + 8, 2) != 0) {
+        memcpy(&sum, &ip_hdr->ip_sum, sizeof(sum));
+        sum = do_checksum_adjust(sum, old_tos, hdr, 2);
+        sum = do_checksum_adjust(sum, old_ttl, hdr + 8, 2);
+        memcpy(&ip_hdr->ip_sum, &sum, sizeof(sum));
     }
-    return(1);
+
+    return 0;
+}
+
+/**
+ * Applies the hop limit, traffic class and flow label edits to an IPv6
+ * header.  No checksum covers them, so always returns 0.
+ */
+int
+patch_ipv6(const tcpedit_l3patch_t *patch, ipv6_hdr_t *ip6_hdr)
+{
+    uint32_t ipflags;
+
+    assert(patch);
+    assert(ip6_hdr);
+
+    if (patch->v6_keep != 0xffffffff) {
+        memcpy(&ipflags, &ip6_hdr->ip_flags, 4);
+        ipflags = htonl((ntohl(ipflags) & patch->v6_keep) | patch->v6_set);
+        memcpy(&ip6_hdr->ip_flags, &ipflags, 4);
+    }
+
+    ip6_hdr->ip_hl = patch->ttl[ip6_hdr->ip_hl];
+    return 0;
 }
 
 /**
@@ -540,87 +772,159 @@ remap_ipv6(tcpedit_t *tcpedit, tcpr_cidr_t *cidr, struct tcpr_in6_addr *addr)
     return 1;
 }
 
+/* which way an address was going, for the address cache */
+#define ADDRCACHE_KEY(dst, direction) \
+    (1 | ((dst) ? 2 : 0) | ((direction) == TCPR_DIR_C2S ? 0 : 4))
+#define ADDRCACHE_HASH(x, bits) (((uint32_t)(x) * 0x9e3779b1) >> (32 - (bits)))
+
+/*
+ * --srcipmap and --dstipmap only ever test their first entry, unlike the
+ * -N and --endpoints maps which take the first entry that matches
+ */
+static inline tcpr_cidrmap_t *
+ipmap_find_ip(tcpr_cidrmap_t *ipmap, uint32_t ip)
+{
+    return ipmap != NULL && ip_in_cidr(ipmap->from, ip) ? ipmap : NULL;
+}
+
+static inline tcpr_cidrmap_t *
+ipmap_find_ip6(tcpr_cidrmap_t *ipmap, const struct tcpr_in6_addr *addr)
+{
+    return ipmap != NULL && ip6_in_cidr(ipmap->from, addr) ? ipmap : NULL;
+}
+
 /**
- * rewrite IP address (layer3)
- * uses -N to rewrite (map) one subnet onto another subnet
- * also support --srcipmap and --dstipmap
- * return 0 if no change, 1 or 2 if changed
+ * Maps one IPv4 address through ipmap (--srcipmap or --dstipmap) and then
+ * cidrmap (-N or --endpoints).  Captures keep reusing a few addresses, so
+ * the result is cached per address, end and direction.  Sets mapped if
+ * cidrmap matched.
  */
-int
-rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction)
+static uint32_t
+rewrite_ipv4_addr(tcpedit_t *tcpedit, tcpr_cidrmap_t *ipmap, tcpr_cidrmap_t *cidrmap,
+        uint32_t ip, int key, int *mapped)
 {
-    tcpr_cidrmap_t *cidrmap1 = NULL, *cidrmap2 = NULL;
-    int didsrc = 0, diddst = 0, loop = 1;
+    tcpedit_addr4_entry_t *entry;
+    tcpr_cidrmap_t *map;
+    uint32_t addr = ip;
+
+    entry = &tcpedit->runtime.addr4[ADDRCACHE_HASH(ip ^ key, TCPEDIT_ADDRCACHE_BITS)];
+    if (entry->key == key && entry->orig == ip) {
+        *mapped = entry->mapped;
+        return entry->addr;
+    }
 
-    assert(tcpedit);
-    assert(ip_hdr);
+    *mapped = 0;
+    if ((map = ipmap_find_ip(ipmap, addr)) != NULL)
+        addr = remap_ipv4(tcpedit, map->to, addr);
 
-    /* first check the src/dst IP maps */
-    if (tcpedit->srcipmap != NULL) {
-        if (ip_in_cidr(tcpedit->srcipmap->from, ip_hdr->ip_src.s_addr)) {
-            ip_hdr->ip_src.s_addr = remap_ipv4(tcpedit, tcpedit->srcipmap->to, ip_hdr->ip_src.s_addr);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name4(ip_hdr->ip_src.s_addr, RESOLVE));
-        }
+    if ((map = cidrmap_find_ip(cidrmap, addr)) != NULL) {
+        addr = remap_ipv4(tcpedit, map->to, addr);
+        *mapped = 1;
     }
 
-    if (tcpedit->dstipmap != NULL) {
-        if (ip_in_cidr(tcpedit->dstipmap->from, ip_hdr->ip_dst.s_addr)) {
-            ip_hdr->ip_dst.s_addr = remap_ipv4(tcpedit, tcpedit->dstipmap->to, ip_hdr->ip_dst.s_addr);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name4(ip_hdr->ip_dst.s_addr, RESOLVE));
-        }
+    if (addr != ip)
+        dbgx(2, "Remapped %s addr to: %s", (key & 2) ? "dst" : "src",
+                get_addr2name4(addr, RESOLVE));
+
+    entry->orig = ip;
+    entry->addr = addr;
+    entry->key = key;
+    entry->mapped = *mapped;
+    return addr;
+}
+
+/**
+ * IPv6 version of rewrite_ipv4_addr(), rewrites addr in place
+ */
+static void
+rewrite_ipv6_addr(tcpedit_t *tcpedit, tcpr_cidrmap_t *ipmap, tcpr_cidrmap_t *cidrmap,
+        struct tcpr_in6_addr *addr, int key, int *mapped)
+{
+    tcpedit_addr6_entry_t *entry;
+    tcpr_cidrmap_t *map;
+    uint32_t words[4];
+
+    memcpy(words, addr, sizeof(words));
+    entry = &tcpedit->runtime.addr6[ADDRCACHE_HASH(words[0] ^ words[1] ^ words[2] ^ words[3] ^ key,
+            TCPEDIT_ADDRCACHE_BITS - 2)];
+    if (entry->key == key && memcmp(&entry->orig, addr, sizeof(*addr)) == 0) {
+        memcpy(addr, &entry->addr, sizeof(*addr));
+        *mapped = entry->mapped;
+        return;
     }
 
-    /* anything else to rewrite? */
-    if (tcpedit->cidrmap1 == NULL)
-        return(0);
+    memcpy(&entry->orig, addr, sizeof(*addr));
 
-    /* don't play with the main pointers */
-    if (direction == TCPR_DIR_C2S) {
-        cidrmap1 = tcpedit->cidrmap1;
-        cidrmap2 = tcpedit->cidrmap2;
-    } else {
-        cidrmap1 = tcpedit->cidrmap2;
-        cidrmap2 = tcpedit->cidrmap1;
+    *mapped = 0;
+    if ((map = ipmap_find_ip6(ipmap, addr)) != NULL)
+        remap_ipv6(tcpedit, map->to, addr);
+
+    if ((map = cidrmap_find_ip6(cidrmap, addr)) != NULL) {
+        remap_ipv6(tcpedit, map->to, addr);
+        *mapped = 1;
     }
-    
 
-    /* loop through the cidrmap to rewrite */
-    do {
-        if ((! diddst) && ip_in_cidr(cidrmap2->from, ip_hdr->ip_dst.s_addr)) {
-            ip_hdr->ip_dst.s_addr = remap_ipv4(tcpedit, cidrmap2->to, ip_hdr->ip_dst.s_addr);
-            dbgx(2, "Remapped dst addr to: %s", get_addr2name4(ip_hdr->ip_dst.s_addr, RESOLVE));
-            diddst = 1;
-        }
-        if ((! didsrc) && ip_in_cidr(cidrmap1->from, ip_hdr->ip_src.s_addr)) {
-            ip_hdr->ip_src.s_addr = remap_ipv4(tcpedit, cidrmap1->to, ip_hdr->ip_src.s_addr);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name4(ip_hdr->ip_src.s_addr, RESOLVE));
-            didsrc = 1;
-        }
+    if (memcmp(&entry->orig, addr, sizeof(*addr)) != 0)
+        dbgx(2, "Remapped %s addr to: %s", (key & 2) ? "dst" : "src",
+                get_addr2name6(addr, RESOLVE));
 
-        /*
-         * loop while we haven't modified both src/dst AND
-         * at least one of the cidr maps have a next pointer
-         */
-        if ((! (diddst && didsrc)) &&
-            (! ((cidrmap1->next == NULL) && (cidrmap2->next == NULL)))) {
+    memcpy(&entry->addr, addr, sizeof(*addr));
+    entry->key = key;
+    entry->mapped = *mapped;
+}
 
-            /* increment our ptr's if possible */
-            if (cidrmap1->next != NULL)
-                cidrmap1 = cidrmap1->next;
+/**
+ * rewrite IP address (layer3)
+ * uses -N to rewrite (map) one subnet onto another subnet
+ * also support --srcipmap and --dstipmap
+ * return 0 if no change, 1 or 2 if changed
+ */
+/**
+ * Picks the -N or endpoint maps for the src (cidrmap1) and dst (cidrmap2)
+ * of a packet going in direction
+ */
+static inline void
+select_cidrmaps(tcpedit_t *tcpedit, tcpr_dir_t direction,
+        tcpr_cidrmap_t **cidrmap1, tcpr_cidrmap_t **cidrmap2)
+{
+    /* don't play with the main pointers */
+    if (tcpedit->cidrmap1 == NULL) {
+        /* only the src/dst IP maps */
+        *cidrmap1 = NULL;
+        *cidrmap2 = NULL;
+    } else if (direction == TCPR_DIR_C2S) {
+        *cidrmap1 = tcpedit->cidrmap1;
+        *cidrmap2 = tcpedit->cidrmap2;
+    } else {
+        *cidrmap1 = tcpedit->cidrmap2;
+        *cidrmap2 = tcpedit->cidrmap1;
+    }
+}
 
-            if (cidrmap2->next != NULL)
-                cidrmap2 = cidrmap2->next;
+int
+rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction)
+{
+    tcpr_cidrmap_t *cidrmap1, *cidrmap2;
+    int didsrc = 0, diddst = 0;
 
-        } else {
-            loop = 0;
-        }
+    assert(tcpedit);
+    assert(ip_hdr);
 
-        /* Later on we should support various IP protocols which embed
-         * the IP address in the application layer.  Things like
-         * DNS and FTP.
-         */
+    select_cidrmaps(tcpedit, direction, &cidrmap1, &cidrmap2);
 
-    } while (loop);
+    /*
+     * the src/dst IP maps apply first, then the first matching -N or
+     * endpoint map for each of dst and src
+     */
+    ip_hdr->ip_src.s_addr = rewrite_ipv4_addr(tcpedit, tcpedit->srcipmap, cidrmap1,
+            ip_hdr->ip_src.s_addr, ADDRCACHE_KEY(0, direction), &didsrc);
+    ip_hdr->ip_dst.s_addr = rewrite_ipv4_addr(tcpedit, tcpedit->dstipmap, cidrmap2,
+            ip_hdr->ip_dst.s_addr, ADDRCACHE_KEY(1, direction), &diddst);
+
+    /* Later on we should support various IP protocols which embed
+     * the IP address in the application layer.  Things like
+     * DNS and FTP.
+     */
 
     /* return how many changes we made */
     return (diddst + didsrc);
@@ -629,81 +933,69 @@ rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction)
 int
 rewrite_ipv6l3(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr, tcpr_dir_t direction)
 {
-    tcpr_cidrmap_t *cidrmap1 = NULL, *cidrmap2 = NULL;
-    int didsrc = 0, diddst = 0, loop = 1;
+    tcpr_cidrmap_t *cidrmap1, *cidrmap2;
+    int didsrc = 0, diddst = 0;
 
     assert(tcpedit);
     assert(ip6_hdr);
 
-    /* first check the src/dst IP maps */
-    if (tcpedit->srcipmap != NULL) {
-        if (ip6_in_cidr(tcpedit->srcipmap->from, &ip6_hdr->ip_src)) {
-            remap_ipv6(tcpedit, tcpedit->srcipmap->to, &ip6_hdr->ip_src);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name6(&ip6_hdr->ip_src, RESOLVE));
-        }
-    }
-
-    if (tcpedit->dstipmap != NULL) {
-        if (ip6_in_cidr(tcpedit->dstipmap->from, &ip6_hdr->ip_dst)) {
-            remap_ipv6(tcpedit, tcpedit->dstipmap->to, &ip6_hdr->ip_dst);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name6(&ip6_hdr->ip_dst, RESOLVE));
-        }
-    }
+    select_cidrmaps(tcpedit, direction, &cidrmap1, &cidrmap2);
 
-    /* anything else to rewrite? */
-    if (tcpedit->cidrmap1 == NULL)
-        return(0);
+    rewrite_ipv6_addr(tcpedit, tcpedit->srcipmap, cidrmap1, &ip6_hdr->ip_src,
+            ADDRCACHE_KEY(0, direction), &didsrc);
+    rewrite_ipv6_addr(tcpedit, tcpedit->dstipmap, cidrmap2, &ip6_hdr->ip_dst,
+            ADDRCACHE_KEY(1, direction), &diddst);
 
-    /* don't play with the main pointers */
-    if (direction == TCPR_DIR_C2S) {
-        cidrmap1 = tcpedit->cidrmap1;
-        cidrmap2 = tcpedit->cidrmap2;
-    } else {
-        cidrmap1 = tcpedit->cidrmap2;
-        cidrmap2 = tcpedit->cidrmap1;
-    }
+    /* return how many changes we made */
+    return (diddst + didsrc);
+}
 
+/**
+ * Returns true if rewrite_ipv4l3() would leave the addresses of ip_hdr as
+ * they are.  The answer is cached like an edit, so one that follows is cheap.
+ */
+bool
+ipv4l3_unchanged(tcpedit_t *tcpedit, const ipv4_hdr_t *ip_hdr, tcpr_dir_t direction)
+{
+    tcpr_cidrmap_t *cidrmap1, *cidrmap2;
+    int mapped;
 
-    /* loop through the cidrmap to rewrite */
-    do {
-        if ((! diddst) && ip6_in_cidr(cidrmap2->from, &ip6_hdr->ip_dst)) {
-            remap_ipv6(tcpedit, cidrmap2->to, &ip6_hdr->ip_dst);
-            dbgx(2, "Remapped dst addr to: %s", get_addr2name6(&ip6_hdr->ip_dst, RESOLVE));
-            diddst = 1;
-        }
-        if ((! didsrc) && ip6_in_cidr(cidrmap1->from, &ip6_hdr->ip_src)) {
-            remap_ipv6(tcpedit, cidrmap1->to, &ip6_hdr->ip_src);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name6(&ip6_hdr->ip_src, RESOLVE));
-            didsrc = 1;
-        }
+    assert(tcpedit);
+    assert(ip_hdr);
 
-        /*
-         * loop while we haven't modified both src/dst AND
-         * at least one of the cidr maps have a next pointer
-         */
-        if ((! (diddst && didsrc)) &&
-            (! ((cidrmap1->next == NULL) && (cidrmap2->next == NULL)))) {
+    select_cidrmaps(tcpedit, direction, &cidrmap1, &cidrmap2);
 
-            /* increment our ptr's if possible */
-            if (cidrmap1->next != NULL)
-                cidrmap1 = cidrmap1->next;
+    return rewrite_ipv4_addr(tcpedit, tcpedit->srcipmap, cidrmap1, ip_hdr->ip_src.s_addr,
+                    ADDRCACHE_KEY(0, direction), &mapped) == ip_hdr->ip_src.s_addr &&
+            rewrite_ipv4_addr(tcpedit, tcpedit->dstipmap, cidrmap2, ip_hdr->ip_dst.s_addr,
+                    ADDRCACHE_KEY(1, direction), &mapped) == ip_hdr->ip_dst.s_addr;
+}
 
-            if (cidrmap2->next != NULL)
-                cidrmap2 = cidrmap2->next;
+/**
+ * IPv6 version of ipv4l3_unchanged()
+ */
+bool
+ipv6l3_unchanged(tcpedit_t *tcpedit, const ipv6_hdr_t *ip6_hdr, tcpr_dir_t direction)
+{
+    tcpr_cidrmap_t *cidrmap1, *cidrmap2;
+    struct tcpr_in6_addr addr;
+    int mapped;
 
-        } else {
-            loop = 0;
-        }
+    assert(tcpedit);
+    assert(ip6_hdr);
 
-        /* Later on we should support various IP protocols which embed
-         * the IP address in the application layer.  Things like
-         * DNS and FTP.
-         */
+    select_cidrmaps(tcpedit, direction, &cidrmap1, &cidrmap2);
 
-    } while (loop);
+    memcpy(&addr, &ip6_hdr->ip_src, sizeof(addr));
+    rewrite_ipv6_addr(tcpedit, tcpedit->srcipmap, cidrmap1, &addr,
+            ADDRCACHE_KEY(0, direction), &mapped);
+    if (memcmp(&addr, &ip6_hdr->ip_src, sizeof(addr)) != 0)
+        return false;
 
-    /* return how many changes we made */
-    return (diddst + didsrc);
+    memcpy(&addr, &ip6_hdr->ip_dst, sizeof(addr));
+    rewrite_ipv6_addr(tcpedit, tcpedit->dstipmap, cidrmap2, &addr,
+            ADDRCACHE_KEY(1, direction), &mapped);
+    return memcmp(&addr, &ip6_hdr->ip_dst, sizeof(addr)) == 0;
 }
 
 /**
@@ -716,7 +1008,7 @@ randomize_iparp(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
 {
     arp_hdr_t *arp_hdr = NULL;
     int l2len = 0;
-    uint32_t *ip, tempip;
+    uint32_t ip;
     u_char *add_hdr;
 
     assert(tcpedit);
@@ -736,14 +1028,14 @@ randomize_iparp(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
         /* jump to the addresses */
         add_hdr = (u_char *)arp_hdr;
         add_hdr += sizeof(arp_hdr_t) + arp_hdr->ar_hln;
-        ip = (uint32_t *)add_hdr;
-        tempip = randomize_ipv4_addr(tcpedit, *ip);
-        memcpy(ip, &tempip, sizeof(uint32_t));
+        memcpy(&ip, add_hdr, sizeof(ip));
+        ip = randomize_ipv4_addr(tcpedit, ip);
+        memcpy(add_hdr, &ip, sizeof(ip));
 
         add_hdr += arp_hdr->ar_pln + arp_hdr->ar_hln;
-        ip = (uint32_t *)add_hdr;
-        tempip = randomize_ipv4_addr(tcpedit, *ip);
-        memcpy(ip, &tempip, sizeof(uint32_t));
+        memcpy(&ip, add_hdr, sizeof(ip));
+        ip = randomize_ipv4_addr(tcpedit, ip);
+        memcpy(add_hdr, &ip, sizeof(ip));
     }
 
     return 1; /* yes we changed the packet */
@@ -760,14 +1052,10 @@ randomize_iparp(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
 int
 rewrite_iparp(tcpedit_t *tcpedit, arp_hdr_t *arp_hdr, int cache_mode)
 {
-    u_char *add_hdr = NULL;
-    uint32_t *ip1 = NULL, *ip2 = NULL;
-    uint32_t newip = 0;
+    u_char *add_hdr = NULL, *ip1_ptr = NULL, *ip2_ptr = NULL;
+    uint32_t ip1, ip2;
     tcpr_cidrmap_t *cidrmap1 = NULL, *cidrmap2 = NULL;
     int didsrc = 0, diddst = 0, loop = 1;
-#ifdef FORCE_ALIGN
-    uint32_t iptemp;
-#endif
 
     assert(tcpedit);
     assert(arp_hdr);
@@ -797,51 +1085,43 @@ rewrite_iparp(tcpedit_t *tcpedit, arp_hdr_t *arp_hdr, int cache_mode)
         /* jump to the addresses */
         add_hdr = (u_char *)arp_hdr;
         add_hdr += sizeof(arp_hdr_t) + arp_hdr->ar_hln;
-        ip1 = (uint32_t *)add_hdr;
+        ip1_ptr = add_hdr;
         add_hdr += arp_hdr->ar_pln + arp_hdr->ar_hln;
-#ifdef FORCE_ALIGN
-        /* copy IP2 to a temporary buffer for processing */
-        memcpy(&iptemp, add_hdr, sizeof(uint32_t));
-        ip2 = &iptemp;
-#else
-        ip2 = (uint32_t *)add_hdr;
-#endif
-        
+        ip2_ptr = add_hdr;
+
+        /* the addresses are rarely aligned, so work on copies */
+        memcpy(&ip1, ip1_ptr, sizeof(ip1));
+        memcpy(&ip2, ip2_ptr, sizeof(ip2));
 
         /* loop through the cidrmap to rewrite */
         do {
             /* arp request ? */
             if (ntohs(arp_hdr->ar_op) == ARPOP_REQUEST) {
-                if ((!diddst) && ip_in_cidr(cidrmap2->from, *ip1)) {
-                    newip = remap_ipv4(tcpedit, cidrmap2->to, *ip1);
-                    memcpy(ip1, &newip, 4);
+                if ((!diddst) && ip_in_cidr(cidrmap2->from, ip1)) {
+                    ip1 = remap_ipv4(tcpedit, cidrmap2->to, ip1);
+                    memcpy(ip1_ptr, &ip1, sizeof(ip1));
                     diddst = 1;
                 }
-                if ((!didsrc) && ip_in_cidr(cidrmap1->from, *ip2)) {
-                    newip = remap_ipv4(tcpedit, cidrmap1->to, *ip2);
-                    memcpy(ip2, &newip, 4);
+                if ((!didsrc) && ip_in_cidr(cidrmap1->from, ip2)) {
+                    ip2 = remap_ipv4(tcpedit, cidrmap1->to, ip2);
+                    memcpy(ip2_ptr, &ip2, sizeof(ip2));
                     didsrc = 1;
                 }
             } 
             /* else it's an arp reply */
             else {
-                if ((!diddst) && ip_in_cidr(cidrmap2->from, *ip2)) {
-                    newip = remap_ipv4(tcpedit, cidrmap2->to, *ip2);
-                    memcpy(ip2, &newip, 4);
+                if ((!diddst) && ip_in_cidr(cidrmap2->from, ip2)) {
+                    ip2 = remap_ipv4(tcpedit, cidrmap2->to, ip2);
+                    memcpy(ip2_ptr, &ip2, sizeof(ip2));
                     diddst = 1;
                 }
-                if ((!didsrc) && ip_in_cidr(cidrmap1->from, *ip1)) {
-                    newip = remap_ipv4(tcpedit, cidrmap1->to, *ip1);
-                    memcpy(ip1, &newip, 4);
+                if ((!didsrc) && ip_in_cidr(cidrmap1->from, ip1)) {
+                    ip1 = remap_ipv4(tcpedit, cidrmap1->to, ip1);
+                    memcpy(ip1_ptr, &ip1, sizeof(ip1));
                     didsrc = 1;
                 }
             }
 
-#ifdef FORCE_ALIGN
-            /* copy temporary IP to IP2 location in buffer */
-            memcpy(add_hdr, &iptemp, sizeof(uint32_t));
-#endif
-
             /*
              * loop while we haven't modified both src/dst AND
              * at least one of the cidr maps have a next pointer
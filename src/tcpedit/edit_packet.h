@@ -24,6 +24,20 @@
 #include "tcpedit.h"
 #include "common.h"
 
+/*
+ * The header fields a TCP/UDP checksum covers which header edits may
+ * change, saved before editing.  proto is 0 if the checksum has to be
+ * recomputed in full.
+ */
+typedef struct csum_snapshot_s {
+    uint8_t proto;          /* IPPROTO_TCP or IPPROTO_UDP */
+    uint8_t hl;             /* IPv4 header length */
+    uint16_t len;           /* IP length field, network order */
+    uint8_t addrs[32];      /* source and destination address */
+    int addrs_len;
+    uint8_t ports[4];
+} csum_snapshot_t;
+
 int untrunc_packet(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, 
         u_char *pktdata, ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr);
 
@@ -42,6 +56,18 @@ int fix_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkdhdr,
 int fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkdhdr,
         ipv6_hdr_t *ip_hdr);
 
+void csum_snapshot_ipv4(csum_snapshot_t *snap, const struct pcap_pkthdr *pkthdr,
+        const ipv4_hdr_t *ip_hdr);
+
+void csum_snapshot_ipv6(csum_snapshot_t *snap, const struct pcap_pkthdr *pkthdr,
+        const ipv6_hdr_t *ip6_hdr);
+
+int adjust_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
+        ipv4_hdr_t *ip_hdr, const csum_snapshot_t *snap);
+
+int adjust_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr,
+        ipv6_hdr_t *ip6_hdr, const csum_snapshot_t *snap);
+
 int extract_data(tcpedit_t *tcpedit, const u_char *pktdata, 
         int caplen, char *l7data[]);
 
@@ -49,11 +75,17 @@ int rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction)
 
 int rewrite_ipv6l3(tcpedit_t *tcpedit, ipv6_hdr_t *ip_hdr, tcpr_dir_t direction);
 
+bool ipv4l3_unchanged(tcpedit_t *tcpedit, const ipv4_hdr_t *ip_hdr, tcpr_dir_t direction);
+
+bool ipv6l3_unchanged(tcpedit_t *tcpedit, const ipv6_hdr_t *ip6_hdr, tcpr_dir_t direction);
+
 int rewrite_iparp(tcpedit_t *tcpedit, arp_hdr_t *arp_hdr, int direction);
 
-int rewrite_ipv4_ttl(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr);
+void compile_l3patch(tcpedit_t *tcpedit, tcpedit_l3patch_t *patch);
+
+int patch_ipv4(const tcpedit_l3patch_t *patch, ipv4_hdr_t *ip_hdr);
 
-int rewrite_ipv6_hlim(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr);
+int patch_ipv6(const tcpedit_l3patch_t *patch, ipv6_hdr_t *ip6_hdr);
 
 #define BROADCAST_IP 4294967295
 
@@ -25,6 +25,7 @@
 #include "tcpedit_stub.h"
 #include "parse_args.h"
 #include "portmap.h"
+#include "edit_bpf.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -102,6 +103,10 @@ tcpedit_post_args(tcpedit_t *tcpedit) {
     if (HAVE_OPT(FIXCSUM))
         tcpedit->fixcsum = true;
 
+    /* --csum-incremental */
+    if (HAVE_OPT(CSUM_INCREMENTAL))
+        tcpedit->csum_incremental = true;
+
     /* --efcs */
     if (HAVE_OPT(EFCS)) 
         tcpedit->efcs = true;
@@ -191,7 +196,7 @@ tcpedit_post_args(tcpedit_t *tcpedit) {
                 while (portmap_head->next != NULL)
                     portmap_head = portmap_head->next;
                 portmap_head->next = portmap;
-
+                index_portmap(tcpedit->portmap);
             }
             first = 0;
         } while (--ct > 0);
@@ -219,6 +224,9 @@ tcpedit_post_args(tcpedit_t *tcpedit) {
         }
     }
 
+    if (HAVE_OPT(EDIT_BPF) && tcpedit_bpf_load(tcpedit, OPT_ARG(EDIT_BPF)) < 0)
+        return -1;
+
     /* 
      * figure out the max packet len
     if (tcpedit->l2.enabled) {
@@ -112,6 +112,8 @@ dlt_en10mb_init(tcpeditdlt_t *ctx)
     config->vlan_tag = 65535;
     config->vlan_pri = 255;
     config->vlan_cfi = 255;
+    config->outer_tpid = ETHERTYPE_QINQ;
+    config->outer_tag = 65535;
     
     
     return TCPEDIT_OK; /* success */
@@ -227,6 +229,8 @@ dlt_en10mb_parse_opts(tcpeditdlt_t *ctx)
             config->vlan = TCPEDIT_VLAN_ADD;
         } else if (strcmp(OPT_ARG(ENET_VLAN), "del") == 0) {
             config->vlan = TCPEDIT_VLAN_DEL;
+        } else if (strcmp(OPT_ARG(ENET_VLAN), "qinq") == 0) {
+            config->vlan = TCPEDIT_VLAN_QINQ;
         } else {
             tcpedit_seterr(ctx->tcpedit, "Invalid --enet-vlan=%s", OPT_ARG(ENET_VLAN));
             return -1;
@@ -254,6 +258,29 @@ dlt_en10mb_parse_opts(tcpeditdlt_t *ctx)
 
             if (HAVE_OPT(ENET_VLAN_CFI))
                 config->vlan_cfi = OPT_VALUE_ENET_VLAN_CFI;
+            } else if (config->vlan == TCPEDIT_VLAN_QINQ) {
+                if (! HAVE_OPT(ENET_VLAN_OUTER_TAG)) {
+                    tcpedit_seterr(ctx->tcpedit, "%s",
+                            "Must specify an outer VLAN tag if vlan "
+                            "mode is qinq");
+                    return TCPEDIT_ERROR;
+                }
+
+                config->outer_tag = OPT_VALUE_ENET_VLAN_OUTER_TAG;
+                if (HAVE_OPT(ENET_VLAN_OUTER_PRI))
+                    config->outer_pri = OPT_VALUE_ENET_VLAN_OUTER_PRI;
+
+                /* the inner tag is kept unless given */
+                if (HAVE_OPT(ENET_VLAN_TAG))
+                    config->vlan_tag = OPT_VALUE_ENET_VLAN_TAG;
+
+                if (HAVE_OPT(ENET_VLAN_PRI))
+                    config->vlan_pri = OPT_VALUE_ENET_VLAN_PRI;
+
+                if (HAVE_OPT(ENET_VLAN_CFI))
+                    config->vlan_cfi = OPT_VALUE_ENET_VLAN_CFI;
+
+                dbg(1, "We will add/modify 802.1ad QinQ headers");
             }
         }
     }
@@ -262,6 +289,10 @@ dlt_en10mb_parse_opts(tcpeditdlt_t *ctx)
     return TCPEDIT_OK; /* success */
 }
 
+static int en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen);
+static int en10mb_encode(tcpeditdlt_t *ctx, en10mb_config_t *config,
+        u_char *packet, int pktlen, tcpr_dir_t dir, int *l2len);
+
 /*
  * Function to decode the layer 2 header in the packet
  * Returns: TCPEDIT_ERROR | TCPEDIT_OK | TCPEDIT_WARN
@@ -269,18 +300,47 @@ dlt_en10mb_parse_opts(tcpeditdlt_t *ctx)
 int 
 dlt_en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 {
-    tcpeditdlt_plugin_t *plugin = NULL;
-    struct tcpr_ethernet_hdr *eth = NULL;
-    struct tcpr_802_1q_hdr *vlan = NULL;
-    en10mb_extra_t *extra = NULL;
-    en10mb_config_t *config = NULL;
-    
     assert(ctx);
     assert(packet);
     assert(pktlen >= 14);
 
-    plugin = tcpedit_dlt_getplugin(ctx, dlt_value);
-    config = plugin->config;
+    return en10mb_decode(ctx, packet, pktlen);
+}
+
+/*
+ * How many VLAN tags the frame has: 0, 1 or 2 for QinQ.  A QinQ header
+ * is an 802.1q header with the outer tag in front of the inner one, so
+ * the inner tag and the ether type are at the same offsets in the
+ * tcpr_802_1q_hdr 4 bytes further on.
+ */
+static inline int
+en10mb_tags(const u_char *packet, const int pktlen)
+{
+    const struct tcpr_ethernet_hdr *eth = (const struct tcpr_ethernet_hdr *)packet;
+    const struct tcpr_802_1q_hdr *inner;
+
+    switch (ntohs(eth->ether_type)) {
+        case ETHERTYPE_VLAN:
+        case ETHERTYPE_QINQ:
+            inner = (const struct tcpr_802_1q_hdr *)(packet + 4);
+            if (pktlen >= TCPR_802_1AD_H && ntohs(inner->vlan_tpi) == ETHERTYPE_VLAN)
+                return 2;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Decode the Ethernet/802.1Q header into ctx
+ */
+static inline int
+en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
+{
+    struct tcpr_ethernet_hdr *eth = NULL;
+    struct tcpr_802_1q_hdr *vlan = NULL;
+    en10mb_extra_t *extra = NULL;
 
     /* get our src & dst address */
     eth = (struct tcpr_ethernet_hdr *)packet;
@@ -289,19 +349,22 @@ dlt_en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 
     extra = (en10mb_extra_t *)ctx->decoded_extra;
     extra->vlan = 0;
+    extra->qinq = 0;
     
     /* get the L3 protocol type  & L2 len*/
-    switch (ntohs(eth->ether_type)) {
-        case ETHERTYPE_VLAN:
+    switch (en10mb_tags(packet, pktlen)) {
+        case 2:
+            vlan = (struct tcpr_802_1q_hdr *)packet;
+            extra->qinq = 1;
+            extra->outer_tpid = vlan->vlan_tpi;
+            extra->outer_tci = vlan->vlan_priority_c_vid;
+
+            vlan = (struct tcpr_802_1q_hdr *)(packet + 4);
+            ctx->l2len = TCPR_802_1AD_H;
+            break;
+
+        case 1:
             vlan = (struct tcpr_802_1q_hdr *)packet;
-            ctx->proto = vlan->vlan_len;
-            
-            /* Get VLAN tag info */
-            extra->vlan = 1;
-            /* must use these mask values, rather then what's in the tcpr.h since it assumes you're shifting */
-            extra->vlan_tag = vlan->vlan_priority_c_vid & 0x0FFF;
-            extra->vlan_pri = vlan->vlan_priority_c_vid & 0xE000;
-            extra->vlan_cfi = vlan->vlan_priority_c_vid & 0x1000;
             ctx->l2len = TCPR_802_1Q_H;
             break;
         
@@ -309,9 +372,18 @@ dlt_en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
         default:
             ctx->proto = eth->ether_type;
             ctx->l2len = TCPR_802_3_H;
-            break;
+            return TCPEDIT_OK;
     }
 
+    ctx->proto = vlan->vlan_len;
+            
+    /* Get VLAN tag info */
+    extra->vlan = 1;
+    /* must use these mask values, rather then what's in the tcpr.h since it assumes you're shifting */
+    extra->vlan_tag = vlan->vlan_priority_c_vid & 0x0FFF;
+    extra->vlan_pri = vlan->vlan_priority_c_vid & 0xE000;
+    extra->vlan_cfi = vlan->vlan_priority_c_vid & 0x1000;
+
     return TCPEDIT_OK; /* success */
 }
 
@@ -323,12 +395,7 @@ int
 dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
 {
     tcpeditdlt_plugin_t *plugin = NULL;
-    struct tcpr_ethernet_hdr *eth = NULL;
-    struct tcpr_802_1q_hdr *vlan = NULL;
-    en10mb_config_t *config = NULL;
-    en10mb_extra_t *extra = NULL;
-    
-    int newl2len = 0;
+    int newl2len;
 
     assert(ctx);
     assert(packet);
@@ -341,29 +408,152 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
     }
 
     plugin = tcpedit_dlt_getplugin(ctx, dlt_value);
-    config = plugin->config;
+    return en10mb_encode(ctx, plugin->config, packet, pktlen, dir, &newl2len);
+}
+
+/*
+ * Ethernet -> Ethernet fast path used by tcpedit_packet(): decodes and
+ * re-encodes the layer 2 header in one call, given the plugin looked up
+ * once in tcpedit_validate().  Stores the new layer 2 length in l2len.
+ * Returns the same as tcpedit_dlt_process(): the new packet length,
+ * TCPEDIT_SOFT_ERROR or TCPEDIT_ERROR, and warns like it does.
+ */
+int
+dlt_en10mb_rewrite(tcpeditdlt_t *ctx, tcpeditdlt_plugin_t *plugin, u_char *packet,
+        int pktlen, tcpr_dir_t dir, int *l2len)
+{
+    int rcode;
+
+    assert(ctx);
+    assert(plugin);
+    assert(packet);
+    assert(l2len);
+
+    if (pktlen < 14) {
+        tcpedit_seterr(ctx->tcpedit, 
+                "Unable to process packet #" COUNTER_SPEC " since it is less then 14 bytes.", 
+                ctx->tcpedit->runtime.packetnum);
+        return TCPEDIT_ERROR;
+    }
+
+    if ((rcode = en10mb_decode(ctx, packet, pktlen)) == TCPEDIT_ERROR) {
+        return TCPEDIT_ERROR;
+    } else if (rcode == TCPEDIT_WARN) {
+        warnx("Warning decoding packet: %s", tcpedit_getwarn(ctx->tcpedit));
+    } else if (rcode == TCPEDIT_SOFT_ERROR) {
+        return rcode; /* can't edit the packet */
+    }
+
+    if ((rcode = en10mb_encode(ctx, plugin->config, packet, pktlen, dir, l2len)) == TCPEDIT_ERROR) {
+        return TCPEDIT_ERROR;
+    } else if (rcode == TCPEDIT_WARN) {
+        warnx("Warning encoding packet: %s", tcpedit_getwarn(ctx->tcpedit));
+    }
+
+    return rcode;
+}
+
+/*
+ * The L2 header length --enet-vlan gives a packet with an l2len byte header
+ */
+static inline int
+en10mb_newl2len(en10mb_config_t *config, int l2len)
+{
+    switch (config->vlan) {
+        case TCPEDIT_VLAN_ADD:
+            return TCPR_802_1Q_H;
+
+        case TCPEDIT_VLAN_QINQ:
+            return TCPR_802_1AD_H;
+
+        case TCPEDIT_VLAN_DEL:
+            return TCPR_802_3_H;
+
+        default:
+            return l2len;
+    }
+}
+
+/*
+ * The 802.1q tag control info (priority, CFI, VLAN ID) for the packet
+ * decoded into ctx, in network byte order.  Returns TCPEDIT_ERROR if the
+ * options leave part of it to a packet which wasn't tagged.
+ */
+static inline int
+en10mb_vlan_tci(tcpeditdlt_t *ctx, en10mb_config_t *config, en10mb_extra_t *extra,
+        u_int16_t *tci)
+{
+    /* are we changing VLAN info? */
+    if (config->vlan_tag < 65535) {
+        *tci = htons((uint16_t)config->vlan_tag & TCPR_802_1Q_VIDMASK);
+    } else if (extra->vlan) {
+        *tci = extra->vlan_tag;
+    } else {
+        tcpedit_seterr(ctx->tcpedit, "%s", "Non-VLAN tagged packet requires --enet-vlan-tag");
+        return TCPEDIT_ERROR;
+    }
+    
+    if (config->vlan_pri < 255) {
+        *tci += htons((uint16_t)config->vlan_pri << 13);
+    } else if (extra->vlan) {
+        *tci += extra->vlan_pri;
+    } else {
+        tcpedit_seterr(ctx->tcpedit, "%s", "Non-VLAN tagged packet requires --enet-vlan-pri");
+        return TCPEDIT_ERROR;
+    }
+        
+    if (config->vlan_cfi < 255) {
+        *tci += htons((uint16_t)config->vlan_cfi << 12);
+    } else if (extra->vlan) {
+        *tci += extra->vlan_cfi;
+    } else {
+        tcpedit_seterr(ctx->tcpedit, "%s", "Non-VLAN tagged packet requires --enet-vlan-cfi");
+        return TCPEDIT_ERROR;            
+    }        
+
+    return TCPEDIT_OK;
+}
+
+/*
+ * Write the new Ethernet/802.1Q header for the packet decoded into ctx
+ */
+static inline int
+en10mb_encode(tcpeditdlt_t *ctx, en10mb_config_t *config, u_char *packet,
+        int pktlen, tcpr_dir_t dir, int *l2len)
+{
+    struct tcpr_ethernet_hdr *eth = NULL;
+    struct tcpr_802_1q_hdr *vlan = NULL;
+    en10mb_extra_t *extra = NULL;
+    u_int16_t tci;
+    
+    int newl2len = 0;
+    int d;
+    bool fixed;
+
     extra = (en10mb_extra_t *)ctx->decoded_extra;
+
+    /* the whole header but the ether type was built by dlt_en10mb_prepare() */
+    d = dir == TCPR_DIR_S2C;
+    fixed = (dir == TCPR_DIR_C2S || dir == TCPR_DIR_S2C) && !ctx->skip_broadcast;
+    if (fixed && config->l2hdr_len[d] > 0) {
+        newl2len = config->l2hdr_len[d];
+        packet = tcpedit_dlt_l2resize(ctx, packet, pktlen, newl2len);
+        memcpy(packet, config->l2hdr[d], newl2len - 2);
+        memcpy(packet + newl2len - 2, &ctx->proto, 2);
+
+        *l2len = newl2len;
+        return pktlen + newl2len - ctx->l2len;
+    }
     
-    /* figure out the new layer2 length, first for the case: ethernet -> ethernet? */
+    /* figure out the new layer2 length: other DLTs come without tags */
     if (ctx->decoder->dlt == dlt_value) {
-        if ((ctx->l2len == TCPR_802_1Q_H && config->vlan == TCPEDIT_VLAN_OFF) ||
-            (config->vlan == TCPEDIT_VLAN_ADD)) {
-            newl2len = TCPR_802_1Q_H;
-        } else if ((ctx->l2len == TCPR_802_3_H && config->vlan == TCPEDIT_VLAN_OFF) ||
-            (config->vlan == TCPEDIT_VLAN_DEL)) {
-            newl2len = TCPR_802_3_H;
-        }
-    } 
-    
-    /* newl2len for some other DLT -> ethernet */
-    else {
-        /* if add a vlan then 18, else 14 bytes */
-        newl2len = config->vlan == TCPEDIT_VLAN_ADD ? TCPR_802_1Q_H : TCPR_802_3_H;
+        newl2len = en10mb_newl2len(config, ctx->l2len);
+    } else {
+        newl2len = en10mb_newl2len(config, TCPR_802_3_H);
     }
 
     /* Make space for our new L2 header */
-    if (newl2len != ctx->l2len)
-        memmove(packet + newl2len, packet + ctx->l2len, pktlen - ctx->l2len);
+    packet = tcpedit_dlt_l2resize(ctx, packet, pktlen, newl2len);
 
     /* update the total packet length */
     pktlen += newl2len - ctx->l2len;
@@ -371,7 +561,9 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
     /* always set the src & dst address as the first 12 bytes */
     eth = (struct tcpr_ethernet_hdr *)packet;
     
-    if (dir == TCPR_DIR_C2S) {
+    if (fixed && config->l2hdr_macs[d]) {
+        memcpy(packet, config->l2hdr[d], 2 * ETHER_ADDR_LEN);
+    } else if (dir == TCPR_DIR_C2S) {
         /* copy user supplied SRC MAC if provided or from original packet */
         if (config->mac_mask & TCPEDIT_MAC_MASK_SMAC1) {
             if ((ctx->addr_type == ETHERNET && 
@@ -449,49 +641,119 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
         /* all we need for 802.3 is the proto */
         eth->ether_type = ctx->proto;
         
-    } else if (newl2len == TCPR_802_1Q_H) {
+    } else if (newl2len == TCPR_802_1Q_H || newl2len == TCPR_802_1AD_H) {
         /* VLAN tags need a bit more */
-        vlan = (struct tcpr_802_1q_hdr *)packet;
-        vlan->vlan_len = ctx->proto;
-        vlan->vlan_tpi = htons(ETHERTYPE_VLAN);
-        
-        /* are we changing VLAN info? */
-        if (config->vlan_tag < 65535) {
-            vlan->vlan_priority_c_vid = 
-                htons((uint16_t)config->vlan_tag & TCPR_802_1Q_VIDMASK);
-        } else if (extra->vlan) {
-            vlan->vlan_priority_c_vid = extra->vlan_tag;
-        } else {
-            tcpedit_seterr(ctx->tcpedit, "%s", "Non-VLAN tagged packet requires --enet-vlan-tag");
+        if (en10mb_vlan_tci(ctx, config, extra, &tci) != TCPEDIT_OK)
             return TCPEDIT_ERROR;
-        }
-        
-        if (config->vlan_pri < 255) {
-            vlan->vlan_priority_c_vid += htons((uint16_t)config->vlan_pri << 13);
-        } else if (extra->vlan) {
-            vlan->vlan_priority_c_vid += extra->vlan_pri;
+
+        if (newl2len == TCPR_802_1AD_H) {
+            /* outer tag, then the inner one at the same offsets 4 bytes on */
+            vlan = (struct tcpr_802_1q_hdr *)packet;
+            if (config->vlan == TCPEDIT_VLAN_QINQ && config->outer_tag < 65535) {
+                vlan->vlan_tpi = htons(config->outer_tpid);
+                vlan->vlan_priority_c_vid =
+                    htons(((uint16_t)config->outer_tag & TCPR_802_1Q_VIDMASK) |
+                            ((uint16_t)config->outer_pri << 13));
+            } else if (extra->qinq) {
+                vlan->vlan_tpi = extra->outer_tpid;
+                vlan->vlan_priority_c_vid = extra->outer_tci;
+            } else {
+                tcpedit_seterr(ctx->tcpedit, "%s", "Non-QinQ tagged packet requires --enet-vlan-outer-tag");
+                return TCPEDIT_ERROR;
+            }
+
+            vlan = (struct tcpr_802_1q_hdr *)(packet + 4);
         } else {
-            tcpedit_seterr(ctx->tcpedit, "%s", "Non-VLAN tagged packet requires --enet-vlan-pri");
-            return TCPEDIT_ERROR;
+            vlan = (struct tcpr_802_1q_hdr *)packet;
         }
-            
-        if (config->vlan_cfi < 255) {
-            vlan->vlan_priority_c_vid += htons((uint16_t)config->vlan_cfi << 12);
-        } else if (extra->vlan) {
-            vlan->vlan_priority_c_vid += extra->vlan_cfi;
-        } else {
-            tcpedit_seterr(ctx->tcpedit, "%s", "Non-VLAN tagged packet requires --enet-vlan-cfi");
-            return TCPEDIT_ERROR;            
-        }        
+
+        vlan->vlan_len = ctx->proto;
+        vlan->vlan_tpi = htons(ETHERTYPE_VLAN);
+        vlan->vlan_priority_c_vid = tci;
         
     } else {
         tcpedit_seterr(ctx->tcpedit, "Unsupported new layer 2 length: %d", newl2len);
         return TCPEDIT_ERROR;
     }
 
+    *l2len = newl2len;
     return pktlen;
 }
 
+/*
+ * Builds the L2 header templates of each direction up front: the MACs if
+ * both are given and there's no --skip-broadcast, and the whole header if
+ * --enet-vlan also gives every tag field.  Called by tcpedit_validate()
+ * once the options are final.
+ */
+void
+dlt_en10mb_prepare(tcpeditdlt_t *ctx)
+{
+    tcpeditdlt_plugin_t *plugin;
+    en10mb_config_t *config;
+    en10mb_extra_t notag;
+    struct tcpr_802_1q_hdr *vlan;
+    u_int16_t tci;
+    int d, len;
+
+    assert(ctx);
+
+    if ((plugin = tcpedit_dlt_getplugin(ctx, dlt_value)) == NULL || plugin->config == NULL)
+        return;
+
+    config = (en10mb_config_t *)plugin->config;
+    for (d = 0; d < 2; d++) {
+        const u_char *smac = d ? config->intf2_smac : config->intf1_smac;
+        const u_char *dmac = d ? config->intf2_dmac : config->intf1_dmac;
+        int mask = d ? TCPEDIT_MAC_MASK_SMAC2 | TCPEDIT_MAC_MASK_DMAC2 :
+                TCPEDIT_MAC_MASK_SMAC1 | TCPEDIT_MAC_MASK_DMAC1;
+
+        config->l2hdr_len[d] = 0;
+        config->l2hdr_macs[d] = (config->mac_mask & mask) == mask && !ctx->skip_broadcast;
+        memset(config->l2hdr[d], 0, sizeof(config->l2hdr[d]));
+        if (config->l2hdr_macs[d]) {
+            vlan = (struct tcpr_802_1q_hdr *)config->l2hdr[d];
+            memcpy(vlan->vlan_dhost, dmac, ETHER_ADDR_LEN);
+            memcpy(vlan->vlan_shost, smac, ETHER_ADDR_LEN);
+        }
+    }
+
+    /* otherwise the packets fill in what the options leave out */
+    if (config->vlan == TCPEDIT_VLAN_OFF ||
+            (config->vlan != TCPEDIT_VLAN_DEL &&
+             (config->vlan_tag == 65535 || config->vlan_pri == 255 || config->vlan_cfi == 255 ||
+              (config->vlan == TCPEDIT_VLAN_QINQ && config->outer_tag == 65535))))
+        return;
+
+    memset(&notag, 0, sizeof(notag));
+    tci = 0;
+    if (config->vlan != TCPEDIT_VLAN_DEL)
+        en10mb_vlan_tci(ctx, config, &notag, &tci);
+
+    len = en10mb_newl2len(config, TCPR_802_3_H);
+    for (d = 0; d < 2; d++) {
+        if (! config->l2hdr_macs[d])
+            continue;
+
+        vlan = (struct tcpr_802_1q_hdr *)config->l2hdr[d];
+        if (len == TCPR_802_1AD_H) {
+            vlan->vlan_tpi = htons(config->outer_tpid);
+            vlan->vlan_priority_c_vid =
+                htons(((uint16_t)config->outer_tag & TCPR_802_1Q_VIDMASK) |
+                        ((uint16_t)config->outer_pri << 13));
+            vlan = (struct tcpr_802_1q_hdr *)(config->l2hdr[d] + 4);
+        }
+
+        if (len != TCPR_802_3_H) {
+            vlan->vlan_tpi = htons(ETHERTYPE_VLAN);
+            vlan->vlan_priority_c_vid = tci;
+        }
+
+        config->l2hdr_len[d] = len;
+        dbgx(1, "Prebuilt the %d byte L2 header for %s", len, d ? "S2C" : "C2S");
+    }
+}
+
 
 /*
  * Function returns the Layer 3 protocol type of the given packet, or TCPEDIT_ERROR on error
@@ -507,8 +769,13 @@ dlt_en10mb_proto(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
     assert(pktlen);
     
     eth = (struct tcpr_ethernet_hdr *)packet;
-    switch (ntohs(eth->ether_type)) {
-        case ETHERTYPE_VLAN:
+    switch (en10mb_tags(packet, pktlen)) {
+        case 2:
+            vlan = (struct tcpr_802_1q_hdr *)(packet + 4);
+            return vlan->vlan_len;
+            break;
+
+        case 1:
             vlan = (struct tcpr_802_1q_hdr *)packet;
             return vlan->vlan_len;
             break;
@@ -591,20 +858,21 @@ dlt_en10mb_get_mac(tcpeditdlt_t *ctx, tcpeditdlt_mac_type_t mac, const u_char *p
 int
 dlt_en10mb_l2len(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 {
-    struct tcpr_ethernet_hdr *eth = NULL;
-    
     assert(ctx);
     assert(packet);
     assert(pktlen);
     
-    eth = (struct tcpr_ethernet_hdr *)packet;
-    switch (ntohs(eth->ether_type)) {
-        case ETHERTYPE_VLAN:
-            return 18;
+    switch (en10mb_tags(packet, pktlen)) {
+        case 2:
+            return TCPR_802_1AD_H;
+            break;
+
+        case 1:
+            return TCPR_802_1Q_H;
             break;
         
         default:
-            return 14;
+            return TCPR_802_3_H;
             break;
     }
     tcpedit_seterr(ctx->tcpedit, "%s", "Whoops!  Bug in my code!");
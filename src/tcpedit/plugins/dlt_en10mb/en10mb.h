@@ -35,6 +35,9 @@ int dlt_en10mb_cleanup(tcpeditdlt_t *ctx);
 int dlt_en10mb_parse_opts(tcpeditdlt_t *ctx);
 int dlt_en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen);
 int dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir);
+int dlt_en10mb_rewrite(tcpeditdlt_t *ctx, tcpeditdlt_plugin_t *plugin, u_char *packet,
+        int pktlen, tcpr_dir_t dir, int *l2len);
+void dlt_en10mb_prepare(tcpeditdlt_t *ctx);
 int dlt_en10mb_proto(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen);
 u_char *dlt_en10mb_get_layer3(tcpeditdlt_t *ctx, u_char *packet, const int pktlen);
 u_char *dlt_en10mb_merge_layer3(tcpeditdlt_t *ctx, u_char *packet, const int pktlen, u_char *l3data);
@@ -185,3 +185,49 @@ tcpedit_en10mb_set_vlan_cfi(tcpedit_t *tcpedit, uint8_t cfi)
     
     return TCPEDIT_OK;
 }
+
+/**
+ * Sets the outer VLAN tag value in qinq mode
+ */
+int
+tcpedit_en10mb_set_vlan_outer_tag(tcpedit_t *tcpedit, uint16_t tag)
+{
+    tcpeditdlt_t *ctx;
+    tcpeditdlt_plugin_t *plugin;
+    en10mb_config_t *config;
+
+    assert(tcpedit);
+
+    ctx = tcpedit->dlt_ctx;
+    assert(ctx);
+    plugin = ctx->decoder;
+    assert(plugin);
+    config = (en10mb_config_t *)plugin->config;
+
+    config->outer_tag = tag;
+
+    return TCPEDIT_OK;
+}
+
+/**
+ * Sets the outer VLAN priority field in qinq mode
+ */
+int
+tcpedit_en10mb_set_vlan_outer_priority(tcpedit_t *tcpedit, uint8_t priority)
+{
+    tcpeditdlt_t *ctx;
+    tcpeditdlt_plugin_t *plugin;
+    en10mb_config_t *config;
+
+    assert(tcpedit);
+
+    ctx = tcpedit->dlt_ctx;
+    assert(ctx);
+    plugin = ctx->decoder;
+    assert(plugin);
+    config = (en10mb_config_t *)plugin->config;
+
+    config->outer_pri = priority;
+
+    return TCPEDIT_OK;
+}
@@ -42,6 +42,8 @@ int tcpedit_en10mb_set_vlan_mode(tcpedit_t *tcpedit, tcpedit_vlan vlan);
 int tcpedit_en10mb_set_vlan_tag(tcpedit_t *tcpedit, u_int16_t tag);
 int tcpedit_en10mb_set_vlan_priority(tcpedit_t *tcpedit, u_int8_t priority);
 int tcpedit_en10mb_set_vlan_cfi(tcpedit_t *tcpedit, u_int8_t cfi);
+int tcpedit_en10mb_set_vlan_outer_tag(tcpedit_t *tcpedit, u_int16_t tag);
+int tcpedit_en10mb_set_vlan_outer_priority(tcpedit_t *tcpedit, u_int8_t priority);
 
 #ifdef __cplusplus
 }
@@ -33,6 +33,11 @@ typedef struct {
     u_int16_t vlan_tag;
     u_int16_t vlan_pri;
     u_int16_t vlan_cfi;
+
+    /* QinQ: the vlan_ fields are the inner tag, these the outer one */
+    int qinq; /* set to 1 for outer_ fields being filled out */
+    u_int16_t outer_tpid;   /* network byte order */
+    u_int16_t outer_tci;
 } en10mb_extra_t;
 
 typedef enum {
@@ -45,7 +50,8 @@ typedef enum {
 typedef enum {
     TCPEDIT_VLAN_OFF = 0,
     TCPEDIT_VLAN_DEL,  /* strip 802.1q and rewrite as standard 802.3 Ethernet */
-    TCPEDIT_VLAN_ADD   /* add/replace 802.1q vlan tag */
+    TCPEDIT_VLAN_ADD,  /* add/replace 802.1q vlan tag */
+    TCPEDIT_VLAN_QINQ  /* add/replace an 802.1ad outer tag over the 802.1q tag */
 } tcpedit_vlan;
     
 typedef struct {
@@ -65,6 +71,21 @@ typedef struct {
     u_int16_t vlan_tag;
     u_int8_t  vlan_pri;
     u_int8_t  vlan_cfi;
+
+    /* outer tag for TCPEDIT_VLAN_QINQ, vlan_tag & co are the inner one */
+    u_int16_t outer_tpid;
+    u_int16_t outer_tag;
+    u_int8_t  outer_pri;
+
+    /*
+     * L2 header for each direction (C2S, S2C) built by dlt_en10mb_prepare()
+     * when the options leave nothing in it to the packet but the ether
+     * type, so encoding is a copy.  Length 0 if it must be built per packet.
+     * Without fixed tags there may still be fixed MACs, the first 12 bytes.
+     */
+    u_char l2hdr[2][TCPR_802_1AD_H];
+    int l2hdr_len[2];
+    bool l2hdr_macs[2];
 } en10mb_config_t;
 
 
@@ -215,7 +215,6 @@ dlt_hdlc_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, _U_ tcpr_dir_t di
     hdlc_config_t *config = NULL;
     hdlc_extra_t *extra = NULL;
     tcpeditdlt_plugin_t *plugin = NULL;
-    u_char tmpbuff[MAXPACKET];
     int newpktlen;
 
     assert(ctx);
@@ -223,12 +222,7 @@ dlt_hdlc_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, _U_ tcpr_dir_t di
     assert(packet);
 
     /* Make room for our new l2 header if old l2len != 4 */
-    if (ctx->l2len > 4) {
-        memmove(packet + 4, packet + ctx->l2len, pktlen - ctx->l2len);
-    } else if (ctx->l2len < 4) {
-        memcpy(tmpbuff, packet, pktlen);
-        memcpy(packet + 4, (tmpbuff + ctx->l2len), pktlen - ctx->l2len);
-    }
+    packet = tcpedit_dlt_l2resize(ctx, packet, pktlen, 4);
     
     /* update the total packet length */
     newpktlen = pktlen + 4 - ctx->l2len;
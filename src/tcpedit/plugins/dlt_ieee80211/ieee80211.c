@@ -182,27 +182,31 @@ dlt_ieee80211_parse_opts(tcpeditdlt_t *ctx)
 int 
 dlt_ieee80211_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 {
+    struct tcpr_802_2snap_hdr *snap;
+    int l2len;
+
     assert(ctx);
     assert(packet);
-    assert(pktlen >= dlt_ieee80211_l2len(ctx, packet, pktlen));
 
     dbgx(3, "Decoding 802.11 packet " COUNTER_SPEC, ctx->tcpedit->runtime.packetnum);
-    if (! ieee80211_is_data(ctx, packet, pktlen)) {
-        tcpedit_seterr(ctx->tcpedit, "Packet " COUNTER_SPEC " is not a normal 802.11 data frame",
-            ctx->tcpedit->runtime.packetnum);
-        return TCPEDIT_SOFT_ERROR;
-    }
-    
-    if (ieee80211_is_encrypted(ctx, packet, pktlen)) {
-        tcpedit_seterr(ctx->tcpedit, "Packet " COUNTER_SPEC " is encrypted.  Unable to decode frame.",
-            ctx->tcpedit->runtime.packetnum);
+
+    /* wireless captures are mostly frames we can't rewrite, so turn those away first */
+    if ((l2len = ieee80211_data_l2len(packet, pktlen)) == 0) {
+        if (pktlen >= (int)sizeof(ieee80211_hdr_t) && ieee80211_is_encrypted(ctx, packet, pktlen)) {
+            tcpedit_seterr(ctx->tcpedit, "Packet " COUNTER_SPEC " is encrypted.  Unable to decode frame.",
+                ctx->tcpedit->runtime.packetnum);
+        } else {
+            tcpedit_seterr(ctx->tcpedit, "Packet " COUNTER_SPEC " is not a normal 802.11 data frame",
+                ctx->tcpedit->runtime.packetnum);
+        }
         return TCPEDIT_SOFT_ERROR;
     }
 
-    ctx->l2len = dlt_ieee80211_l2len(ctx, packet, pktlen);
+    ctx->l2len = l2len;
     memcpy(&(ctx->srcaddr), ieee80211_get_src((ieee80211_hdr_t *)packet), ETHER_ADDR_LEN);
     memcpy(&(ctx->dstaddr), ieee80211_get_dst((ieee80211_hdr_t *)packet), ETHER_ADDR_LEN);
-    ctx->proto = dlt_ieee80211_proto(ctx, packet, pktlen);
+    snap = (struct tcpr_802_2snap_hdr *)&packet[l2len - sizeof(struct tcpr_802_2snap_hdr)];
+    ctx->proto = snap->snap_type;
 
     return TCPEDIT_OK; /* success */
 }
@@ -229,47 +233,17 @@ int
 dlt_ieee80211_proto(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 {
     int l2len;
-    int hdrlen = 0;
-    uint16_t *frame_control, fc;
     struct tcpr_802_2snap_hdr *hdr;
 
     assert(ctx);
     assert(packet);
 
-    l2len = dlt_ieee80211_l2len(ctx, packet, pktlen);
-    assert(pktlen >= l2len);
-
-    /* check 802.11 frame control field */
-    frame_control = (uint16_t *)packet;
-    fc = ntohs(*frame_control);
-
-    /* Not all 802.11 frames have data */
-    if ((fc & ieee80211_FC_TYPE_MASK) != ieee80211_FC_TYPE_DATA)
-        return TCPEDIT_SOFT_ERROR;
-    
-    /* Some data frames are QoS and have no data 
-        if (((fc & ieee80211_FC_SUBTYPE_MASK) & ieee80211_FC_SUBTYPE_QOS) == ieee80211_FC_SUBTYPE_QOS)
+    /* Not all 802.11 frames have data, and 802.2 has no type field */
+    if ((l2len = ieee80211_data_l2len(packet, pktlen)) == 0)
         return TCPEDIT_SOFT_ERROR;
-    */
-    if ((fc & ieee80211_FC_SUBTYPE_QOS) == ieee80211_FC_SUBTYPE_QOS) {
-        hdrlen += 2;
-    }
-    
-    /* figure out the actual header length */
-    if (ieee80211_USE_4(fc)) {
-        hdrlen += sizeof(ieee80211_addr4_hdr_t);
-    } else {
-        hdrlen += sizeof(ieee80211_hdr_t);
-    }
-    
-    hdr = (struct tcpr_802_2snap_hdr *)&packet[hdrlen];
 
-    /* verify the header is 802.2SNAP (8 bytes) not 802.2 (3 bytes) */
-    if (hdr->snap_dsap == 0xAA && hdr->snap_ssap == 0xAA)
-        return hdr->snap_type;
-    
-
-    return TCPEDIT_SOFT_ERROR; /* 802.2 has no type field */
+    hdr = (struct tcpr_802_2snap_hdr *)&packet[l2len - sizeof(struct tcpr_802_2snap_hdr)];
+    return hdr->snap_type;
 }
 
 /*
@@ -327,6 +301,10 @@ dlt_ieee80211_l2len(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
     assert(ctx);
     assert(packet);
     assert(pktlen);
+
+    /* the frames we rewrite */
+    if ((hdrlen = ieee80211_data_l2len(packet, pktlen)) > 0)
+        return hdrlen;
     
     dbgx(2, "packet = %p\t\tplen = %d", packet, pktlen);
 
@@ -29,88 +29,6 @@
 #include "ieee80211.h"
 #include "ieee80211_hdr.h"
 
-/*
- * Does the given 802.11 header have data?
- * returns 1 for true & 0 for false
- */
-int
-ieee80211_is_data(tcpeditdlt_t *ctx, const void *packet, const int pktlen) 
-{
-    uint16_t *frame_control, fc;
-    struct tcpr_802_2snap_hdr *snap;
-    int hdrlen = 0;
-
-    assert(ctx);
-    assert(packet);
-
-    /* Ack, Auth, NULL packets often are very small (10-30 bytes) */
-    if (pktlen <= (int)sizeof(ieee80211_hdr_t)) {
-        dbgx(1, "**** packet " COUNTER_SPEC " is too small (%d)", ctx->tcpedit->runtime.packetnum, pktlen);
-        return 0;
-    }
-
-    /* 
-     * Fields: Version|Type|Subtype|Flags
-     * Bytes: 2|2|4|8
-     * Types: 00 = Management, 01 = Control, 10 = Data
-     * Data Subtypes (in binary): 
-     * 0000 - Data
-     * 0001 - Data + Ack
-     * 0010 - Data + Poll
-     * 0011 - Data + Ack + Poll
-     * 01?? - Data + Null (no data)
-     * 1000 - QoS (w/ data)
-     * 1100 - QoS (no data)
-     * 1??? - Reserved (beacon, etc)
-     * FIXME:
-     * So right now, we only look for pure data frames, since I'm not sure what to do with ACK/Poll
-     */
-
-    frame_control = (uint16_t *)packet;
-    fc = ntohs(*frame_control);
-
-    /* reserved == no data */
-    if ((fc & ieee80211_FC_SUBTYPE_MASK) == ieee80211_FC_SUBTYPE_NULL) {
-        dbg(2, "packet is NULL");
-        return 1;
-    }
-
-    /* check for data */
-    if ((fc & ieee80211_FC_TYPE_MASK) == ieee80211_FC_TYPE_DATA) {
-        dbg(2, "packet has data bit set");
-        return 1;
-    }
-
-    /* QoS is set by the high bit, all the lower bits are QoS sub-types 
-       QoS seems to add 2 bytes of data at the end of the 802.11 hdr */
-    if ((fc & ieee80211_FC_SUBTYPE_MASK) >= ieee80211_FC_SUBTYPE_QOS) {
-        hdrlen += 2;
-    }
-
-    /* frame must also have a 802.2 SNAP header */
-    if (ieee80211_USE_4(fc)) {
-        hdrlen += sizeof(ieee80211_addr4_hdr_t);
-    } else {
-        hdrlen += sizeof(ieee80211_hdr_t);
-    }
-
-    if (pktlen < hdrlen + (int)sizeof(struct tcpr_802_2snap_hdr)) {
-        return 0; /* not long enough for SNAP */
-    }
-
-    snap = (struct tcpr_802_2snap_hdr *)&((u_char *)packet)[hdrlen];
-
-    /* verify the header is 802.2SNAP (8 bytes) not 802.2 (3 bytes) */
-    if (snap->snap_dsap == 0xAA && snap->snap_ssap == 0xAA) {
-        dbg(2, "packet is 802.2SNAP which I think always has data");
-        return 1;
-    } 
-
-    warnx("Packet " COUNTER_SPEC " is unknown reason for non-data", ctx->tcpedit->runtime.packetnum);
-
-    return 0;
-}
-
 /* 
  * returns 1 if WEP is enabled, 0 if not
  */
@@ -28,12 +28,44 @@
 extern "C" {
 #endif
 
-int ieee80211_is_data(tcpeditdlt_t *ctx, const void *packet, const int pktlen);
 int ieee80211_is_encrypted(tcpeditdlt_t *ctx, const void *packet, const int pktlen);
 
 u_char *ieee80211_get_src(const void *header);
 u_char *ieee80211_get_dst(const void *header);
 
+/*
+ * Classifies a frame for rewriting in one pass over the frame control and
+ * 802.2 header: returns the length of the 802.11 + 802.2 SNAP headers of
+ * an unencrypted data frame which carries an ether type, 0 for anything
+ * else (management, control, null data, encrypted, plain 802.2, short).
+ * The SNAP ether type is then the last 2 bytes of those headers.
+ */
+static inline int
+ieee80211_data_l2len(const u_char *packet, const int pktlen)
+{
+    uint16_t fc;
+    int hdrlen;
+
+    if (pktlen < (int)sizeof(ieee80211_hdr_t))
+        return 0;
+
+    /* same as ntohs() of the frame control, which the ieee80211_FC_* masks assume */
+    fc = (uint16_t)(packet[0] << 8 | packet[1]);
+    if ((fc & (ieee80211_FC_TYPE_MASK | ieee80211_FC_SUBTYPE_NODATA | ieee80211_FC_WEP_MASK)) !=
+            ieee80211_FC_TYPE_DATA)
+        return 0;
+
+    hdrlen = ieee80211_USE_4(fc) ? (int)sizeof(ieee80211_addr4_hdr_t) : (int)sizeof(ieee80211_hdr_t);
+    if (fc & ieee80211_FC_SUBTYPE_QOS)
+        hdrlen += 2;
+
+    if (pktlen < hdrlen + (int)sizeof(struct tcpr_802_2snap_hdr) ||
+            packet[hdrlen] != 0xAA || packet[hdrlen + 1] != 0xAA)
+        return 0;
+
+    return hdrlen + (int)sizeof(struct tcpr_802_2snap_hdr);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +44,7 @@ typedef struct {
 #define ieee80211_FC_SUBTYPE_MASK   0xF000
 #define ieee80211_FC_SUBTYPE_QOS    0x8000 /* high bit is QoS, but there are sub-sub types for QoS */
 #define ieee80211_FC_SUBTYPE_NULL   0xC000 /* no data */
+#define ieee80211_FC_SUBTYPE_NODATA 0x4000 /* data frames without data, QoS or not */
 
 /* Direction */
 #define ieee80211_FC_TO_DS_MASK     0x0001
@@ -129,11 +129,6 @@ tcpedit_dlt_init(tcpedit_t *tcpedit, const int srcdlt)
 
     ctx = (tcpeditdlt_t *)safe_malloc(sizeof(tcpeditdlt_t));
 
-    /* do we need a side buffer for L3 data? */
-#ifdef FORCE_ALIGN
-    ctx->l3buff = (u_char *)safe_malloc(MAXPACKET);
-#endif
-
     /* copy our tcpedit context */
     ctx->tcpedit = tcpedit;
 
@@ -217,7 +212,8 @@ tcpedit_dlt_post_args(tcpedit_t *tcpedit)
 } 
 
 /**
- * This is the recommended method to edit a packet.  Returns (new) total packet length
+ * This is the recommended method to edit a packet.  Returns (new) total packet length.
+ * *packet may move if the caller gave ctx->headroom.
  */
 int
 tcpedit_dlt_process(tcpeditdlt_t *ctx, u_char **packet, int pktlen, tcpr_dir_t direction)
@@ -242,13 +238,15 @@ tcpedit_dlt_process(tcpeditdlt_t *ctx, u_char **packet, int pktlen, tcpr_dir_t d
         return rcode; /* can't edit the packet */
     }
     
-    /* encode packet */
+    /* encode packet, which may move the start of it into the headroom */
+    ctx->l2shift = 0;
     if ((rcode = tcpedit_dlt_encode(ctx, *packet, pktlen, direction)) == TCPEDIT_ERROR) {
         return TCPEDIT_ERROR;
     } else if (rcode == TCPEDIT_WARN) {
         warnx("Warning encoding packet: %s", tcpedit_getwarn(ctx->tcpedit));
     }
-       
+
+    *packet += ctx->l2shift;
     return rcode;
 }
 
@@ -442,10 +440,6 @@ tcpedit_dlt_cleanup(tcpeditdlt_t *ctx)
     if (ctx->decoder != NULL)
         ctx->decoder->plugin_cleanup(ctx);
 
-#ifdef FORCE_ALIGN
-    safe_free(ctx->l3buff);
-#endif
-
     if (ctx->decoded_extra != NULL)
         safe_free(ctx->decoded_extra);
         
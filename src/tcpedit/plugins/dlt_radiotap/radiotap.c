@@ -189,13 +189,17 @@ dlt_radiotap_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
     assert(pktlen >= (int)sizeof(radiotap_hdr_t));
     
     radiolen = dlt_radiotap_l2len(ctx, packet, pktlen);
+    if (radiolen > pktlen) {
+        tcpedit_seterr(ctx->tcpedit, "Packet " COUNTER_SPEC " is shorter than its radiotap header",
+            ctx->tcpedit->runtime.packetnum);
+        return TCPEDIT_SOFT_ERROR;
+    }
     data = dlt_radiotap_get_80211(ctx, packet, pktlen, radiolen);
     
-    /* ieee80211 decoder fills out everything */
-    rcode = dlt_ieee80211_decode(ctx, data, pktlen - radiolen);
-    
-    /* need to override the ieee802.11 l2 length result */
-    ctx->l2len = dlt_radiotap_80211_l2len(ctx, packet, pktlen);
+    /* ieee80211 decoder fills out everything but the radiotap header length */
+    if ((rcode = dlt_ieee80211_decode(ctx, data, pktlen - radiolen)) == TCPEDIT_OK)
+        ctx->l2len += radiolen;
+
     return rcode;
 }
 
@@ -229,6 +233,9 @@ dlt_radiotap_proto(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
     assert(pktlen > (int)sizeof(radiotap_hdr_t));
 
     radiolen = dlt_radiotap_l2len(ctx, packet, pktlen);
+    if (radiolen > pktlen)
+        return TCPEDIT_SOFT_ERROR;
+
     data = dlt_radiotap_get_80211(ctx, packet, pktlen, radiolen);
     return dlt_ieee80211_proto(ctx, data, pktlen - radiolen);
 }
@@ -300,13 +307,12 @@ dlt_radiotap_get_mac(tcpeditdlt_t *ctx, tcpeditdlt_mac_type_t mac, const u_char
 int
 dlt_radiotap_l2len(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 {
-    uint16_t radiolen;
     assert(ctx);
     assert(packet);
     assert(pktlen);
 
-    memcpy(&radiolen, &packet[2], 2);
-    return (int)radiolen;
+    /* it_len is little endian */
+    return (int)(packet[2] | packet[3] << 8);
 }
 
 /* 
@@ -332,20 +338,15 @@ dlt_radiotap_l2addr_type(void)
 }
 
 /* 
- * returns a buffer to the 802.11 header in the packet.
- * This does an optimization of only doing a memcpy() once per packet
- * since we track which was the last packet # we copied.
+ * returns a pointer to the 802.11 header in the packet.  The frame is
+ * decoded where it is rather than copied, so nothing is kept between
+ * packets and any number of contexts can decode at once.
  */
 static u_char *
 dlt_radiotap_get_80211(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen, const int radiolen)
 {
-    radiotap_extra_t *extra;
-    static COUNTER lastpacket = 0;
+    assert(ctx);
+    assert(pktlen >= radiolen);
 
-    extra = (radiotap_extra_t *)(ctx->decoded_extra);
-    if (lastpacket != ctx->tcpedit->runtime.packetnum) {
-        memcpy(extra->packet, &packet[radiolen], pktlen - radiolen);
-        lastpacket = ctx->tcpedit->runtime.packetnum;
-    }
-    return extra->packet;
+    return (u_char *)&packet[radiolen];
 }
@@ -43,7 +43,8 @@ u_char *dlt_radiotap_get_mac(tcpeditdlt_t *ctx, tcpeditdlt_mac_type_t mac, const
  * Example: Ethernet VLAN tag info
  */
 struct radiotap_extra_s {
-    u_char packet[MAXPACKET];
+    /* dummy entry for SunPro compiler which doesn't like empty structs */    
+    int dummy;
 };
 typedef struct radiotap_extra_s radiotap_extra_t;
 
@@ -219,7 +219,6 @@ dlt_user_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
 {
     user_config_t *config;
     tcpeditdlt_plugin_t *plugin;
-    u_char tmpbuff[MAXPACKET];
 
     assert(ctx);
     assert(pktlen > 0);
@@ -229,12 +228,7 @@ dlt_user_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
     config = plugin->config;
 
     /* Make room for our new l2 header if l2len != config->length */
-    if (ctx->l2len > config->length) {
-        memmove(packet + config->length, packet + ctx->l2len, pktlen - ctx->l2len);
-    } else if (ctx->l2len < config->length) {
-        memcpy(tmpbuff, packet, pktlen);
-        memcpy(packet + config->length, (tmpbuff + ctx->l2len), pktlen - ctx->l2len);
-    }
+    packet = tcpedit_dlt_l2resize(ctx, packet, pktlen, config->length);
 
     /* update the total packet length */
     pktlen += config->length - ctx->l2len;
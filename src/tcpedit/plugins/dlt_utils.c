@@ -48,7 +48,8 @@ tcpedit_dlt_parse_opts(tcpeditdlt_t *ctx)
 }
  
 /*
- * find a given plugin struct in the context for a given DLT.  Returns NULL on failure
+ * find a given plugin struct in the context for a given DLT.  Returns NULL on failure.
+ * Called for every packet, so the common DLTs come straight out of plugin_by_dlt
  */
 tcpeditdlt_plugin_t *
 tcpedit_dlt_getplugin(tcpeditdlt_t *ctx, int dlt)
@@ -57,6 +58,9 @@ tcpedit_dlt_getplugin(tcpeditdlt_t *ctx, int dlt)
     
     assert(ctx);
 
+    if (dlt >= 0 && dlt < DLT_PLUGIN_TABLE)
+        return ctx->plugin_by_dlt[dlt];
+
     ptr = ctx->plugins;
     if (ptr == NULL)
         return NULL;
@@ -157,6 +161,9 @@ tcpedit_dlt_addplugin(tcpeditdlt_t *ctx, tcpeditdlt_plugin_t *new)
         
         ptr->next = new;
     }
+
+    if (new->dlt < DLT_PLUGIN_TABLE)
+        ctx->plugin_by_dlt[new->dlt] = new;
     
     /* we're done */
     return 0;
@@ -190,47 +197,26 @@ tcpedit_dlt_validate(tcpeditdlt_t *ctx)
 
 
 /*
- * Utility function to extract the Layer 3 header and beyond in a single buffer
- * Since some CPU's like UltraSPARC are strictly aligned, they really don't like
- * it when you jump to an offset which isn't on a word boundry (like ethernet)
+ * Utility function to find the Layer 3 header and beyond.  The L3 and L4
+ * header structs are packed on strictly aligned systems (see TCPR_UNALIGNED),
+ * so the packet is edited in place however the L2 header leaves it aligned
  */
 u_char *
 tcpedit_dlt_l3data_copy(tcpeditdlt_t *ctx, u_char *packet, int pktlen, int l2len)
 {
-    u_char *ptr;
     assert(ctx);
     assert(packet);
     assert(pktlen);
 
     if (pktlen <= l2len)
         return NULL;
-    
-#ifdef FORCE_ALIGN
-    /* 
-     * copy layer 3 and up to our temp packet buffer
-     * for now on, we have to edit the packetbuff because
-     * just before we send the packet, we copy the packetbuff 
-     * back onto the pkt.data + l2len buffer
-     * we do all this work to prevent byte alignment issues
-     */
-    if (l2len % 4 == 0) {
-        ptr = (&(packet)[l2len]);
-    } else {
-        ptr = ctx->l3buff;
-        memcpy(ptr, (&(packet)[l2len]), pktlen - l2len);
-    }
-#else
-    /*
-     * on non-strict byte align systems, don't need to memcpy(), 
-     * just point to 14 bytes into the existing buffer
-     */
-    ptr = (&(packet)[l2len]);
-#endif
-    return ptr;
+
+    return packet + l2len;
 }
 
 /*
- * reverse of tcpedit_dlt_l3data_copy
+ * reverse of tcpedit_dlt_l3data_copy: the edits were made in place, so
+ * there is nothing to put back
  */
 u_char *
 tcpedit_dlt_l3data_merge(tcpeditdlt_t *ctx, u_char *packet, int pktlen, const u_char *l3data, const int l2len)
@@ -240,14 +226,36 @@ tcpedit_dlt_l3data_merge(tcpeditdlt_t *ctx, u_char *packet, int pktlen, const u_
     assert(pktlen >= 0);
     assert(l3data);
     assert(l2len >= 0);
-#ifdef FORCE_ALIGN
-    /* 
-     * put back the layer 3 and above back in the pkt.data buffer 
-     * we can't edit the packet at layer 3 or above beyond this point
-     */
-     if (l2len % 4 != 0)
-         memcpy((&(packet)[l2len]), l3data, pktlen - l2len);
-#endif
+
+    return packet;
+}
+
+/**
+ * Makes room for an encoder's newl2len byte layer 2 header in place of the
+ * ctx->l2len bytes decoded and returns where the packet now starts.  If the
+ * caller left headroom (see tcpedit_packet_headroom()) the start of the
+ * packet just moves and ctx->l2shift says by how much, else the layer 3
+ * data is moved to follow the new header.
+ */
+u_char *
+tcpedit_dlt_l2resize(tcpeditdlt_t *ctx, u_char *packet, int pktlen, int newl2len)
+{
+    int grow;
+
+    assert(ctx);
+    assert(packet);
+    assert(pktlen >= ctx->l2len);
+
+    grow = newl2len - ctx->l2len;
+    if (grow == 0)
+        return packet;
+
+    if (ctx->headroom > 0 && grow <= ctx->headroom) {
+        ctx->l2shift = -grow;
+        return packet - grow;
+    }
+
+    memmove(packet + newl2len, packet + ctx->l2len, pktlen - ctx->l2len);
     return packet;
 }
 
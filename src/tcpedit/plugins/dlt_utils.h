@@ -26,6 +26,7 @@
 
 u_char *tcpedit_dlt_l3data_copy(tcpeditdlt_t *ctx, u_char *packet, int ptklen, int l2len);
 u_char *tcpedit_dlt_l3data_merge(tcpeditdlt_t *ctx, u_char *packet, int pktlen, const u_char *l3data, const int l2len);
+u_char *tcpedit_dlt_l2resize(tcpeditdlt_t *ctx, u_char *packet, int pktlen, int newl2len);
 
 int tcpedit_dlt_parse_opts(tcpeditdlt_t *ctx);
 int tcpedit_dlt_validate(tcpeditdlt_t *ctx);
@@ -96,16 +96,15 @@ struct tcpeditdlt_plugin_s {
 
 
 #define L2EXTRA_LEN 255 /* size of buffer to hold any extra L2 data parsed from the decoder */
+#define DLT_PLUGIN_TABLE 256 /* plugins for DLTs below this are looked up by table */
 
 /*
  * internal DLT plugin context
  */
 struct tcpeditdlt_s {
     tcpedit_t *tcpedit;                 /* pointer to our tcpedit context */
-#ifdef FORCE_ALIGN
-    u_char *l3buff;                     /* pointer for L3 buffer on strictly aligned systems */
-#endif
     tcpeditdlt_plugin_t *plugins;       /* registered plugins */
+    tcpeditdlt_plugin_t *plugin_by_dlt[DLT_PLUGIN_TABLE];  /* the same, indexed by DLT */
     tcpeditdlt_plugin_t *decoder;       /* Encoder plugin */
     tcpeditdlt_plugin_t *encoder;       /* Decoder plugin */      
 
@@ -124,6 +123,8 @@ struct tcpeditdlt_s {
     tcpeditdlt_l2address_t srcaddr;         /* filled out source address */
     tcpeditdlt_l2address_t dstaddr;         /* filled out dst address */
     int l2len;                              /* set by decoder and updated by encoder */
+    int headroom;                           /* writable bytes the caller left before the packet */
+    int l2shift;                            /* bytes the encoder moved the packet start by */
     u_int16_t proto;                        /* layer 3 proto type?? */
     void *decoded_extra;                    /* any extra L2 data from decoder like VLAN tags */
     u_char srcmac[MAX_MAC_LEN];             /* buffers to store the src & dst MAC */
@@ -206,9 +206,43 @@ parse_portmap(tcpedit_portmap_t ** portmap, const char *ourstr)
             portmap_ptr = portmap_ptr->next;
     }
 
+    index_portmap(*portmap);
     return 1;
 }
 
+/**
+ * \brief (re)builds the lookup table map_port() uses for the given chain
+ *
+ * Ranges like 1-65535:80 expand into one node per port, so rather than
+ * walk the chain for every port we look up, flatten it into a table with
+ * one entry per port.  Must be called again if the chain is modified.
+ */
+void
+index_portmap(tcpedit_portmap_t *portmap)
+{
+    tcpedit_portmap_t *portmap_ptr;
+    long i;
+
+    assert(portmap);
+
+    if (portmap->table == NULL)
+        portmap->table = (uint16_t *)safe_malloc(65536 * sizeof(uint16_t));
+
+    for (i = 0; i < 65536; i++)
+        portmap->table[i] = (uint16_t)i;
+
+    /* later nodes override earlier ones, same as walking the chain */
+    for (portmap_ptr = portmap; portmap_ptr != NULL; portmap_ptr = portmap_ptr->next) {
+        portmap->table[portmap_ptr->from & 0xffff] = (uint16_t)portmap_ptr->to;
+
+        /* a chain appended to this one is no longer a head */
+        if (portmap_ptr != portmap && portmap_ptr->table != NULL) {
+            safe_free(portmap_ptr->table);
+            portmap_ptr->table = NULL;
+        }
+    }
+}
+
 
 /**
  * Free's all the memory associated with the given portmap chain
@@ -223,6 +257,9 @@ free_portmap(tcpedit_portmap_t * portmap)
     if (portmap->next != NULL)
         free_portmap(portmap->next);
 
+    if (portmap->table != NULL)
+        safe_free(portmap->table);
+
     safe_free(portmap);
 }
 
@@ -258,6 +295,9 @@ map_port(tcpedit_portmap_t *portmap_data, long port)
 
     assert(portmap_data);
 
+    if (portmap_data->table != NULL && port >= 0 && port <= 65535)
+        return portmap_data->table[port];
+
     portmap_ptr = portmap_data;
     newport = port;
 
@@ -272,6 +312,27 @@ map_port(tcpedit_portmap_t *portmap_data, long port)
     return(newport);
 }
 
+/**
+ * Returns true if the portmap leaves the TCP or UDP ports at layer4 as
+ * they are, see rewrite_ports()
+ */
+bool
+ports_unchanged(tcpedit_t *tcpedit, u_char protocol, const u_char *layer4)
+{
+    uint16_t ports[2];
+
+    assert(tcpedit);
+    assert(tcpedit->portmap);
+
+    if (protocol != IPPROTO_TCP && protocol != IPPROTO_UDP)
+        return true;
+
+    /* both headers start with the source and destination port */
+    memcpy(ports, layer4, sizeof(ports));
+    return (uint16_t)map_port(tcpedit->portmap, ports[0]) == ports[0] &&
+            (uint16_t)map_port(tcpedit->portmap, ports[1]) == ports[1];
+}
+
 /**
  * rewrites the TCP or UDP ports based on a portmap
  * returns 1 for changes made or 0 for none
@@ -25,10 +25,12 @@
 
 tcpedit_portmap_t *new_portmap();
 int parse_portmap(tcpedit_portmap_t **portmapdata, const char *ourstr);
+void index_portmap(tcpedit_portmap_t *portmap);
 void free_portmap(tcpedit_portmap_t *portmap);
 void print_portmap(tcpedit_portmap_t *portmap);
 long map_port(tcpedit_portmap_t *portmap , long port);
 int rewrite_ipv4_ports(tcpedit_t *tcpedit, ipv4_hdr_t **ip_hdr);
 int rewrite_ipv6_ports(tcpedit_t *tcpedit, ipv6_hdr_t **ip_hdr);
+bool ports_unchanged(tcpedit_t *tcpedit, u_char protocol, const u_char *layer4);
 
 #endif
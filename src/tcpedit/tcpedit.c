@@ -34,11 +34,22 @@
 #include "portmap.h"
 #include "common.h"
 #include "edit_packet.h"
+#include "edit_bpf.h"
 #include "parse_args.h"
 
 
 #include "lib/sll.h"
 #include "dlt.h"
+#include "dlt_utils.h"
+#include "plugins/dlt_en10mb/en10mb.h"
+
+/* the plugins every packet of a call is decoded/encoded with */
+typedef struct tcpedit_plugins_s {
+    tcpeditdlt_plugin_t *src;
+    tcpeditdlt_plugin_t *dst;
+    int src_dlt;
+    int dst_dlt;
+} tcpedit_plugins_t;
 
 tOptDesc *const tcpedit_tcpedit_optDesc_p;
 
@@ -69,38 +80,28 @@ tcpedit_checkdir(tcpedit_t *tcpedit, tcpr_dir_t direction)
 
 
 /**
- * \brief Edit the given packet
- *
- * Processs a given packet and edit the pkthdr/pktdata structures
- * according to the rules in tcpedit
- * Returns: TCPEDIT_ERROR on error
- *          TCPEDIT_SOFT_ERROR on remove packet
- *          0 on no change
- *          1 on change
+ * Look up the decoder and encoder plugins by DLT, as tcpedit_dlt_proto() and
+ * friends would for every call
  */
-int
-tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
-        u_char **pktdata, tcpr_dir_t direction)
+static void
+tcpedit_get_plugins(tcpedit_t *tcpedit, tcpedit_plugins_t *plugins)
 {
-    ipv4_hdr_t *ip_hdr = NULL;
-    ipv6_hdr_t *ip6_hdr = NULL;
-    arp_hdr_t *arp_hdr = NULL;
-    int l2len = 0, l2proto, retval = 0, dst_dlt, src_dlt, pktlen, lendiff;
-    int ipflags = 0, tclass = 0;
-    int needtorecalc = 0;           /* did the packet change? if so, checksum */
-    u_char *packet = *pktdata;
-    assert(tcpedit);
-    assert(pkthdr);
-    assert(*pkthdr);
-    assert(pktdata);
-    assert(packet);
-    assert(tcpedit->validated);
-
-
-    tcpedit->runtime.packetnum++;
-    dbgx(3, "packet " COUNTER_SPEC " caplen %d", 
-            tcpedit->runtime.packetnum, (*pkthdr)->caplen);
+    plugins->src_dlt = tcpedit_dlt_src(tcpedit->dlt_ctx);
+    plugins->dst_dlt = tcpedit_dlt_dst(tcpedit->dlt_ctx);
+    plugins->src = tcpedit_dlt_getplugin(tcpedit->dlt_ctx, plugins->src_dlt);
+    plugins->dst = tcpedit_dlt_getplugin(tcpedit->dlt_ctx, plugins->dst_dlt);
+}
 
+/**
+ * First stage of editing a packet: strip the FCS and return the L3
+ * protocol in network byte order, or -1 if there is no L3 header.
+ * runtime.packetnum must already be set to the packet's number.
+ */
+static int
+tcpedit_packet_l3proto(tcpedit_t *tcpedit, const tcpedit_plugins_t *plugins,
+        struct pcap_pkthdr *pkthdr, const u_char *packet)
+{
+    int l2proto;
 
     /*
      * remove the Ethernet FCS (checksum)?
@@ -109,22 +110,271 @@ tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
      * just removed 2 bytes of ACTUAL PACKET DATA.  Sucks to be them.
      */
     if (tcpedit->efcs > 0) {
-        (*pkthdr)->caplen -= 4;
-        (*pkthdr)->len -= 4;
+        pkthdr->caplen -= 4;
+        pkthdr->len -= 4;
     }
 
-    src_dlt = tcpedit_dlt_src(tcpedit->dlt_ctx);
-    
     /* not everything has a L3 header, so check for errors.  returns proto in network byte order */
-    if ((l2proto = tcpedit_dlt_proto(tcpedit->dlt_ctx, src_dlt, packet, (*pkthdr)->caplen)) < 0) {
+    if (tcpedit->runtime.en10mb != NULL) {
+        l2proto = dlt_en10mb_proto(tcpedit->dlt_ctx, packet, pkthdr->caplen);
+    } else if (plugins->src == NULL) {
+        tcpedit_seterr(tcpedit, "Unable to find plugin for DLT 0x%04x", plugins->src_dlt);
+        l2proto = -1;
+    } else {
+        l2proto = plugins->src->plugin_proto(tcpedit->dlt_ctx, packet, pkthdr->caplen);
+    }
+
+    if (l2proto < 0) {
         dbg(2, "Packet has no L3+ header");
     } else {
         dbgx(2, "Layer 3 protocol type is: 0x%04x", ntohs(l2proto));
     }
-        
+
+    return l2proto;
+}
+
+/**
+ * Returns a pointer to the L3 header of the encoded packet, which is l2len
+ * bytes in when on the Ethernet -> Ethernet fast path
+ */
+static inline u_char *
+tcpedit_packet_l3data(tcpedit_t *tcpedit, const tcpedit_plugins_t *plugins,
+        u_char *packet, int pktlen, int l2len)
+{
+    if (tcpedit->runtime.en10mb != NULL)
+        return pktlen > l2len ? packet + l2len : NULL;
+
+    return plugins->dst->plugin_get_layer3(tcpedit->dlt_ctx, packet, pktlen);
+}
+
+/*
+ * The edits tcpedit_compile() chooses from.  Each runs unconditionally, the
+ * options it depends on were checked once when the program was compiled.
+ * The header patches fix any checksum they touch themselves.
+ */
+static int
+op_ipv4_patch(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return patch_ipv4(&tcpedit->runtime.l3patch, pkt->ip_hdr);
+}
+
+static int
+op_ipv4_ports(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return rewrite_ipv4_ports(tcpedit, &pkt->ip_hdr);
+}
+
+static int
+op_ipv4_rewrite(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return rewrite_ipv4l3(tcpedit, pkt->ip_hdr, pkt->direction);
+}
+
+static int
+op_ipv4_seed(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return randomize_ipv4(tcpedit, pkt->pkthdr, pkt->packet, pkt->ip_hdr);
+}
+
+static int
+op_ipv6_patch(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return patch_ipv6(&tcpedit->runtime.l3patch, pkt->ip6_hdr);
+}
+
+static int
+op_ipv6_ports(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return rewrite_ipv6_ports(tcpedit, &pkt->ip6_hdr);
+}
+
+static int
+op_ipv6_rewrite(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return rewrite_ipv6l3(tcpedit, pkt->ip6_hdr, pkt->direction);
+}
+
+static int
+op_ipv6_seed(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return randomize_ipv6(tcpedit, pkt->pkthdr, pkt->packet, pkt->ip6_hdr);
+}
+
+/* ARP has no checksums, so its edits never ask for them to be fixed */
+static int
+op_arp_rewrite(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return rewrite_iparp(tcpedit, pkt->arp_hdr, pkt->direction) < 0 ? TCPEDIT_ERROR : 0;
+}
+
+static int
+op_arp_seed(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    int dlt = pkt->direction == TCPR_DIR_C2S ? tcpedit->runtime.dlt1 : tcpedit->runtime.dlt2;
+
+    return randomize_iparp(tcpedit, pkt->pkthdr, pkt->packet, dlt) < 0 ? TCPEDIT_ERROR : 0;
+}
+
+/* (un)truncating changes the length, so the checksums need the full sum */
+static int
+op_untrunc(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    int retval;
+
+    retval = untrunc_packet(tcpedit, pkt->pkthdr, pkt->packet, pkt->ip_hdr, pkt->ip6_hdr);
+    if (retval > 0)
+        pkt->fullcsum = true;
+
+    return retval;
+}
+
+/* --edit-bpf runs last, so the program sees every other edit */
+static int
+op_bpf(tcpedit_t *tcpedit, tcpedit_op_pkt_t *pkt)
+{
+    return tcpedit_bpf_run(tcpedit, pkt);
+}
+
+/*
+ * Does the Ethernet fast path write back the same Layer 2 header it read?
+ */
+static bool
+tcpedit_l2_passthru(tcpedit_t *tcpedit)
+{
+    en10mb_config_t *config = (en10mb_config_t *)tcpedit->runtime.en10mb->config;
+
+    return config->mac_mask == 0 && config->vlan == TCPEDIT_VLAN_OFF &&
+            config->vlan_tag == 65535 && config->vlan_pri == 255 && config->vlan_cfi == 255;
+}
+
+static void
+program_add(tcpedit_program_t *program, tcpedit_op_t op)
+{
+    assert(program->cnt < TCPEDIT_OPS_MAX);
+    program->ops[program->cnt++] = op;
+}
+
+/**
+ * Compiles the edits the options select into a program for each kind of
+ * packet, in the order tcpedit_packet() has always applied them.  Editing
+ * a packet then runs just those edits rather than checking every option,
+ * so changing an option afterwards needs another tcpedit_validate().
+ */
+static void
+tcpedit_compile(tcpedit_t *tcpedit)
+{
+    tcpedit_runtime_t *rt = &tcpedit->runtime;
+    bool untrunc = tcpedit->fixlen || tcpedit->mtu_truncate;
+
+    memset(&rt->ipv4, 0, sizeof(rt->ipv4));
+    memset(&rt->ipv6, 0, sizeof(rt->ipv6));
+    memset(&rt->arp, 0, sizeof(rt->arp));
+    memset(&rt->other, 0, sizeof(rt->other));
+
+    /* the address maps may have changed too */
+    memset(rt->addr4, 0, sizeof(rt->addr4));
+    memset(rt->addr6, 0, sizeof(rt->addr6));
+
+    /* the fixed header edits are one patch, looked up rather than branched on */
+    compile_l3patch(tcpedit, &rt->l3patch);
+    if (tcpedit->tos > -1 || tcpedit->ttl_mode != TCPEDIT_TTL_MODE_OFF)
+        program_add(&rt->ipv4, op_ipv4_patch);
+    if (tcpedit->portmap != NULL)
+        program_add(&rt->ipv4, op_ipv4_ports);
+
+    if (tcpedit->ttl_mode != TCPEDIT_TTL_MODE_OFF || tcpedit->tclass > -1 ||
+            tcpedit->flowlabel > -1)
+        program_add(&rt->ipv6, op_ipv6_patch);
+    if (tcpedit->portmap != NULL)
+        program_add(&rt->ipv6, op_ipv6_ports);
+
+    if (untrunc) {
+        program_add(&rt->ipv4, op_untrunc);
+        program_add(&rt->ipv6, op_untrunc);
+        program_add(&rt->arp, op_untrunc);
+        program_add(&rt->other, op_untrunc);
+    }
+
+    if (tcpedit->rewrite_ip) {
+        program_add(&rt->ipv4, op_ipv4_rewrite);
+        program_add(&rt->ipv6, op_ipv6_rewrite);
+        program_add(&rt->arp, op_arp_rewrite);
+    }
+
+    if (tcpedit->seed) {
+        program_add(&rt->ipv4, op_ipv4_seed);
+        program_add(&rt->ipv6, op_ipv6_seed);
+        program_add(&rt->arp, op_arp_seed);
+    }
+
+    if (tcpedit->bpf != NULL) {
+        program_add(&rt->ipv4, op_bpf);
+        program_add(&rt->ipv6, op_bpf);
+        program_add(&rt->arp, op_bpf);
+        program_add(&rt->other, op_bpf);
+    }
+
+    /*
+     * When Layer 2 is passed through and the only edits are the address and
+     * port maps, most packets usually match neither and can skip editing
+     */
+    rt->prefilter = rt->en10mb != NULL && tcpedit_l2_passthru(tcpedit) &&
+            !tcpedit->efcs && !tcpedit->fixcsum && !tcpedit->csum_offload && !untrunc &&
+            tcpedit->tos == -1 && tcpedit->tclass == -1 && tcpedit->flowlabel == -1 &&
+            tcpedit->ttl_mode == TCPEDIT_TTL_MODE_OFF && !tcpedit->seed &&
+            tcpedit->bpf == NULL;
+
+    dbgx(1, "Compiled edits: %d IPv4, %d IPv6, %d ARP, %d other%s",
+            rt->ipv4.cnt, rt->ipv6.cnt, rt->arp.cnt, rt->other.cnt,
+            rt->prefilter ? ", prefiltered" : "");
+}
+
+/**
+ * Second stage of editing a packet: everything from rewriting Layer 2 to
+ * fixing the checksums.  Returns the same as tcpedit_packet().
+ */
+static int
+tcpedit_packet_edit(tcpedit_t *tcpedit, const tcpedit_plugins_t *plugins,
+        struct pcap_pkthdr **pkthdr, u_char **pktdata, tcpr_dir_t direction,
+        int l2proto)
+{
+    ipv4_hdr_t *ip_hdr = NULL;
+    ipv6_hdr_t *ip6_hdr = NULL;
+    const tcpedit_program_t *program;
+    tcpedit_op_pkt_t op;
+    int l2len = 0, retval = 0, dst_dlt, src_dlt, pktlen, lendiff, i;
+    int needtorecalc = 0;           /* did the packet change? if so, checksum */
+    bool fullcsum = tcpedit->fixcsum || tcpedit->csum_offload ||   /* sum (or seed) it all */
+            !tcpedit->csum_incremental;
+    csum_snapshot_t csum_snap;
+    u_char *packet = *pktdata;
+
+    dbgx(3, "packet " COUNTER_SPEC " caplen %d", 
+            tcpedit->runtime.packetnum, (*pkthdr)->caplen);
+
+    src_dlt = plugins->src_dlt;
+    dst_dlt = plugins->dst_dlt;
+
     /* rewrite Layer 2 */
-    if ((pktlen = tcpedit_dlt_process(tcpedit->dlt_ctx, pktdata, (*pkthdr)->caplen, direction)) == TCPEDIT_ERROR)
+    if (tcpedit->runtime.en10mb != NULL) {
+        /* Ethernet -> Ethernet: no plugin dispatch, the rewrite knows the new L2 length */
+        if (direction == TCPR_DIR_NOSEND) {
+            pktlen = (*pkthdr)->caplen;
+            l2len = dlt_en10mb_l2len(tcpedit->dlt_ctx, packet, pktlen);
+        } else {
+            tcpedit->dlt_ctx->l2shift = 0;
+            if ((pktlen = dlt_en10mb_rewrite(tcpedit->dlt_ctx, tcpedit->runtime.en10mb,
+                    packet, (*pkthdr)->caplen, direction, &l2len)) == TCPEDIT_ERROR) {
+                errx(-1, "%s", tcpedit_geterr(tcpedit));
+            }
+            *pktdata = packet += tcpedit->dlt_ctx->l2shift;
+        }
+    } else if ((pktlen = tcpedit_dlt_process(tcpedit->dlt_ctx, pktdata, (*pkthdr)->caplen, direction)) == TCPEDIT_ERROR) {
         errx(-1, "%s", tcpedit_geterr(tcpedit));
+    } else {
+        /* the encoder may have pushed or popped the L2 header into the headroom */
+        packet = *pktdata;
+    }
 
     /* unable to edit packet, most likely 802.11 management or data QoS frame */
     if (pktlen == TCPEDIT_SOFT_ERROR) {
@@ -137,20 +387,26 @@ tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
     (*pkthdr)->caplen += lendiff;
     (*pkthdr)->len += lendiff;
     
-    dst_dlt = tcpedit_dlt_dst(tcpedit->dlt_ctx);
-    l2len = tcpedit_dlt_l2len(tcpedit->dlt_ctx, dst_dlt, packet, (*pkthdr)->caplen);
+    if (tcpedit->runtime.en10mb != NULL) {
+        ;   /* l2len is already known */
+    } else if (plugins->dst == NULL) {
+        tcpedit_seterr(tcpedit, "Unable to find plugin for DLT 0x%04x", dst_dlt);
+        return TCPEDIT_ERROR;
+    } else {
+        l2len = plugins->dst->plugin_l2len(tcpedit->dlt_ctx, packet, (*pkthdr)->caplen);
+    }
 
     dbgx(2, "dst_dlt = %04x\tsrc_dlt = %04x\tproto = %04x\tl2len = %d", dst_dlt, src_dlt, ntohs(l2proto), l2len);
 
     /* does packet have an IP header?  if so set our pointer to it */
     if (l2proto == htons(ETHERTYPE_IP)) {
-        ip_hdr = (ipv4_hdr_t *)tcpedit_dlt_l3data(tcpedit->dlt_ctx, dst_dlt, packet, (*pkthdr)->caplen);
+        ip_hdr = (ipv4_hdr_t *)tcpedit_packet_l3data(tcpedit, plugins, packet, (*pkthdr)->caplen, l2len);
         if (ip_hdr == NULL) {
             return TCPEDIT_ERROR;
         }        
         dbgx(3, "Packet has an IPv4 header: %p...", ip_hdr);
     } else if (l2proto == htons(ETHERTYPE_IP6)) {
-        ip6_hdr = (ipv6_hdr_t *)tcpedit_dlt_l3data(tcpedit->dlt_ctx, dst_dlt, packet, (*pkthdr)->caplen);
+        ip6_hdr = (ipv6_hdr_t *)tcpedit_packet_l3data(tcpedit, plugins, packet, (*pkthdr)->caplen, l2len);
         if (ip6_hdr == NULL) {
             return TCPEDIT_ERROR;
         }
@@ -161,136 +417,62 @@ tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
         ip_hdr = NULL;
     }
 
-    /* The following edits only apply for IPv4 */
+    /* with --csum-incremental header only edits patch the checksums */
+    if (fullcsum)
+        csum_snap.proto = 0;
+    else if (ip_hdr != NULL)
+        csum_snapshot_ipv4(&csum_snap, *pkthdr, ip_hdr);
+    else if (ip6_hdr != NULL)
+        csum_snapshot_ipv6(&csum_snap, *pkthdr, ip6_hdr);
+
+    /* run the edits compiled for this kind of packet */
+    op.arp_hdr = NULL;
     if (ip_hdr != NULL) {
-        
-        /* set TOS ? */
-        if (tcpedit->tos > -1) {
-            ip_hdr->ip_tos = tcpedit->tos;
-            needtorecalc += 1;
-        }
-            
-        /* rewrite the TTL */
-        needtorecalc += rewrite_ipv4_ttl(tcpedit, ip_hdr);
-
-        /* rewrite TCP/UDP ports */
-        if (tcpedit->portmap != NULL) {
-            if ((retval = rewrite_ipv4_ports(tcpedit, &ip_hdr)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        }
+        program = &tcpedit->runtime.ipv4;
+    } else if (ip6_hdr != NULL) {
+        program = &tcpedit->runtime.ipv6;
+    } else if (l2proto == htons(ETHERTYPE_ARP)) {
+        program = &tcpedit->runtime.arp;
+        op.arp_hdr = (arp_hdr_t *)&(packet[l2len]);
+    } else {
+        program = &tcpedit->runtime.other;
     }
-    /* IPv6 edits */
-    else if (ip6_hdr != NULL) {
-        /* rewrite the hop limit */
-        needtorecalc += rewrite_ipv6_hlim(tcpedit, ip6_hdr);
-
-        /* set traffic class? */
-        if (tcpedit->tclass > -1) {
-            /* calculate the bits */
-            tclass = tcpedit->tclass << 20;
-            
-            /* convert our 4 bytes to an int */
-            memcpy(&ipflags, &ip6_hdr->ip_flags, 4);
-            
-            /* strip out the old tclass bits */
-            ipflags = ntohl(ipflags) & 0xf00fffff;
-
-            /* add the tclass bits back */
-            ipflags += tclass; 
-            ipflags = htonl(ipflags);
-            memcpy(&ip6_hdr->ip_flags, &ipflags, 4);
-            needtorecalc ++;
-        }
 
-        /* set the flow label? */
-        if (tcpedit->flowlabel > -1) {
-            memcpy(&ipflags, &ip6_hdr->ip_flags, 4);
-            ipflags = ntohl(ipflags) & 0xfff00000;
-            ipflags += tcpedit->flowlabel;
-            ipflags = htonl(ipflags);
-            memcpy(&ip6_hdr->ip_flags, &ipflags, 4);
-            needtorecalc ++;
-        }
+    op.pkthdr = *pkthdr;
+    op.packet = packet;
+    op.ip_hdr = ip_hdr;
+    op.ip6_hdr = ip6_hdr;
+    op.direction = direction;
+    op.fullcsum = fullcsum;
 
-        /* rewrite TCP/UDP ports */
-        if (tcpedit->portmap != NULL) {
-            if ((retval = rewrite_ipv6_ports(tcpedit, &ip6_hdr)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        }
-    }
-
-    /* (Un)truncate or MTU truncate packet? */
-    if (tcpedit->fixlen || tcpedit->mtu_truncate) {
-        if ((retval = untrunc_packet(tcpedit, *pkthdr, packet, ip_hdr, ip6_hdr)) < 0)
-            return TCPEDIT_ERROR;
+    for (i = 0; i < program->cnt; i++) {
+        if ((retval = program->ops[i](tcpedit, &op)) < 0)
+            return retval == TCPEDIT_SOFT_ERROR ? TCPEDIT_SOFT_ERROR : TCPEDIT_ERROR;
         needtorecalc += retval;
     }
-    
-    /* rewrite IP addresses in IPv4/IPv6 or ARP */
-    if (tcpedit->rewrite_ip) {
-        /* IP packets */
-        if (ip_hdr != NULL) {
-            if ((retval = rewrite_ipv4l3(tcpedit, ip_hdr, direction)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        } else if (ip6_hdr != NULL) {
-            if ((retval = rewrite_ipv6l3(tcpedit, ip6_hdr, direction)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        }
-
-        /* ARP packets */
-        else if (l2proto == htons(ETHERTYPE_ARP)) {
-            arp_hdr = (arp_hdr_t *)&(packet[l2len]);
-            /* unlike, rewrite_ipl3, we don't care if the packet changed
-             * because we never need to recalc the checksums for an ARP
-             * packet.  So ignore the return value
-             */
-            if (rewrite_iparp(tcpedit, arp_hdr, direction) < 0)
-                return TCPEDIT_ERROR;
-        }
-    }
-
 
-    /* do we need to spoof the src/dst IP address in IPv4 or ARP? */
-    if (tcpedit->seed) {
-        /* IPv4 Packets */
-        if (ip_hdr != NULL) {
-            if ((retval = randomize_ipv4(tcpedit, *pkthdr, packet, 
-                    ip_hdr)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
+    ip_hdr = op.ip_hdr;
+    ip6_hdr = op.ip6_hdr;
+    fullcsum = op.fullcsum;
 
-        } else if (ip6_hdr != NULL) {
-            if ((retval = randomize_ipv6(tcpedit, *pkthdr, packet,
-                    ip6_hdr)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-
-        /* ARP packets */
-        } else if (l2proto == htons(ETHERTYPE_ARP)) {
-            if (direction == TCPR_DIR_C2S) {
-                if (randomize_iparp(tcpedit, *pkthdr, packet, 
-                        tcpedit->runtime.dlt1) < 0)
-                    return TCPEDIT_ERROR;
-            } else {
-                if (randomize_iparp(tcpedit, *pkthdr, packet, 
-                        tcpedit->runtime.dlt2) < 0)
-                    return TCPEDIT_ERROR;
-            }
-        }
-    }
-
-    /* do we need to fix checksums? -- must always do this last! */
-    if ((tcpedit->fixcsum || needtorecalc)) {
+    /*
+     * do we need to fix checksums? -- must always do this last!
+     * With checksum offload every packet is seeded, as sendpacket asks the
+     * NIC to finish the checksum of every TCP/UDP packet it can.
+     */
+    if ((tcpedit->fixcsum || tcpedit->csum_offload || needtorecalc)) {
         if (ip_hdr != NULL) {
             dbgx(3, "doing IPv4 checksum: needtorecalc=%d", needtorecalc);
-            retval = fix_ipv4_checksums(tcpedit, *pkthdr, ip_hdr);
+            if (fullcsum)
+                retval = fix_ipv4_checksums(tcpedit, *pkthdr, ip_hdr);
+            else
+                retval = adjust_ipv4_checksums(tcpedit, *pkthdr, ip_hdr, &csum_snap);
         } else if (ip6_hdr != NULL) {
             dbgx(3, "doing IPv6 checksum: needtorecalc=%d", needtorecalc);
-            retval = fix_ipv6_checksums(tcpedit, *pkthdr, ip6_hdr);
+            if (fullcsum)
+                retval = fix_ipv6_checksums(tcpedit, *pkthdr, ip6_hdr);
+            else
+                retval = adjust_ipv6_checksums(tcpedit, *pkthdr, ip6_hdr, &csum_snap);
         } else {
             dbgx(3, "checksum not performed: needtorecalc=%d", needtorecalc);
             retval = TCPEDIT_OK;
@@ -302,13 +484,137 @@ tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
         }
     }
 
-    tcpedit_dlt_merge_l3data(tcpedit->dlt_ctx, dst_dlt, packet, (*pkthdr)->caplen, (u_char *)ip_hdr);
+    /* the Ethernet fast path edits L3 in place, other plugins may need to merge it */
+    if (ip_hdr != NULL && tcpedit->runtime.en10mb == NULL)
+        plugins->dst->plugin_merge_layer3(tcpedit->dlt_ctx, packet, (*pkthdr)->caplen, (u_char *)ip_hdr);
 
     tcpedit->runtime.total_bytes += (*pkthdr)->caplen;
     tcpedit->runtime.pkts_edited ++;
     return retval;
 }
 
+/**
+ * \brief Returns true if editing the packet would leave it as it is
+ *
+ * Only knows when Ethernet is passed through and the only edits are the
+ * IP address and port maps, otherwise always returns false.  A packet it
+ * returns true for is counted as edited and can be sent as it is, without
+ * a copy or tcpedit_packet().  Only valid after tcpedit_validate()
+ */
+bool
+tcpedit_packet_unchanged(tcpedit_t *tcpedit, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, tcpr_dir_t direction)
+{
+    tcpedit_runtime_t *rt;
+    const ipv4_hdr_t *ip_hdr;
+    const ipv6_hdr_t *ip6_hdr;
+    int l2proto, l2len, l4off;
+    bool unchanged;
+
+    assert(tcpedit);
+    assert(pkthdr);
+    assert(pktdata);
+    assert(tcpedit->validated);
+
+    rt = &tcpedit->runtime;
+    if (!rt->prefilter || pkthdr->caplen < TCPR_ETH_H ||
+            (direction != TCPR_DIR_C2S && direction != TCPR_DIR_S2C))
+        return false;
+
+    l2proto = dlt_en10mb_proto(tcpedit->dlt_ctx, pktdata, pkthdr->caplen);
+    l2len = dlt_en10mb_l2len(tcpedit->dlt_ctx, pktdata, pkthdr->caplen);
+    if (l2len < 0)
+        return false;
+
+    if (l2proto == htons(ETHERTYPE_IP)) {
+        if (pkthdr->caplen < (bpf_u_int32)l2len + TCPR_IPV4_H)
+            return false;
+
+        ip_hdr = (const ipv4_hdr_t *)(pktdata + l2len);
+        l4off = l2len + (ip_hdr->ip_hl << 2);
+        unchanged = !tcpedit->rewrite_ip || ipv4l3_unchanged(tcpedit, ip_hdr, direction);
+        if (unchanged && tcpedit->portmap != NULL) {
+            if (pkthdr->caplen < (bpf_u_int32)l4off + 4)
+                return false;
+            unchanged = ports_unchanged(tcpedit, ip_hdr->ip_p, pktdata + l4off);
+        }
+    } else if (l2proto == htons(ETHERTYPE_IP6)) {
+        if (pkthdr->caplen < (bpf_u_int32)l2len + TCPR_IPV6_H)
+            return false;
+
+        /* like rewrite_ipv6_ports(), ports only right after the IPv6 header */
+        ip6_hdr = (const ipv6_hdr_t *)(pktdata + l2len);
+        l4off = l2len + TCPR_IPV6_H;
+        unchanged = !tcpedit->rewrite_ip || ipv6l3_unchanged(tcpedit, ip6_hdr, direction);
+        if (unchanged && tcpedit->portmap != NULL) {
+            if (pkthdr->caplen < (bpf_u_int32)l4off + 4)
+                return false;
+            unchanged = ports_unchanged(tcpedit, ip6_hdr->ip_nh, pktdata + l4off);
+        }
+    } else {
+        /* the maps rewrite ARP too, other packets are left alone */
+        unchanged = !(l2proto == htons(ETHERTYPE_ARP) && tcpedit->rewrite_ip);
+    }
+
+    if (!unchanged)
+        return false;
+
+    rt->packetnum++;
+    rt->total_bytes += pkthdr->caplen;
+    rt->pkts_edited++;
+    return true;
+}
+
+/**
+ * \brief Edit the given packet
+ *
+ * Processs a given packet and edit the pkthdr/pktdata structures
+ * according to the rules in tcpedit
+ * Returns: TCPEDIT_ERROR on error
+ *          TCPEDIT_SOFT_ERROR on remove packet
+ *          0 on no change
+ *          1 on change
+ */
+int
+tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
+        u_char **pktdata, tcpr_dir_t direction)
+{
+    return tcpedit_packet_headroom(tcpedit, pkthdr, pktdata, direction, 0);
+}
+
+/**
+ * \brief Edit the given packet, which has headroom bytes in front of it
+ *
+ * Same as tcpedit_packet(), but the caller promises headroom writable
+ * bytes before *pktdata (TCPEDIT_HEADROOM is plenty for any L2 header).
+ * Growing or shrinking the Layer 2 header then moves *pktdata back or
+ * forward instead of moving the rest of the packet, so the caller must
+ * keep its own pointer to the buffer.  Headroom of 0 is tcpedit_packet().
+ */
+int
+tcpedit_packet_headroom(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
+        u_char **pktdata, tcpr_dir_t direction, int headroom)
+{
+    tcpedit_plugins_t plugins;
+    int l2proto;
+
+    assert(tcpedit);
+    assert(pkthdr);
+    assert(*pkthdr);
+    assert(pktdata);
+    assert(*pktdata);
+    assert(headroom >= 0);
+    assert(tcpedit->validated);
+
+    tcpedit_get_plugins(tcpedit, &plugins);
+    tcpedit->dlt_ctx->headroom = headroom;
+
+    tcpedit->runtime.packetnum++;
+    l2proto = tcpedit_packet_l3proto(tcpedit, &plugins, *pkthdr, *pktdata);
+
+    return tcpedit_packet_edit(tcpedit, &plugins, pkthdr, pktdata, direction, l2proto);
+}
+
 /**
  * initializes the tcpedit library.  returns 0 on success, -1 on error.
  */
@@ -338,10 +644,6 @@ tcpedit_init(tcpedit_t **tcpedit_ex, int dlt)
     dbgx(1, "Input file (1) datalink type is %s\n",
             pcap_datalink_val_to_name(dlt));
 
-#ifdef FORCE_ALIGN
-    tcpedit->runtime.l3buff = (u_char *)safe_malloc(MAXPACKET);
-#endif
-
     return TCPEDIT_OK;
 }
 
@@ -355,6 +657,31 @@ tcpedit_get_output_dlt(tcpedit_t *tcpedit)
     return tcpedit_dlt_output_dlt(tcpedit->dlt_ctx);
 }
 
+/**
+ * Returns true if editing the given packet could make it longer than it
+ * was captured, in which case the caller must hand tcpedit_packet() a
+ * buffer with room to spare (MAXPACKET) rather than the capture buffer.
+ * Only valid after tcpedit_validate()
+ */
+bool
+tcpedit_may_grow(tcpedit_t *tcpedit, const struct pcap_pkthdr *pkthdr)
+{
+    en10mb_config_t *config;
+
+    assert(tcpedit);
+    assert(pkthdr);
+
+    if (tcpedit->fixlen == TCPEDIT_FIXLEN_PAD && pkthdr->len > pkthdr->caplen)
+        return true;
+
+    /* other DLT plugins are free to build a longer L2 header */
+    if (tcpedit->runtime.en10mb == NULL)
+        return true;
+
+    config = (en10mb_config_t *)tcpedit->runtime.en10mb->config;
+    return config->vlan == TCPEDIT_VLAN_ADD || config->vlan == TCPEDIT_VLAN_QINQ;
+}
+
 /**
  * \brief tcpedit option validator.  Call after tcpedit_init()
  *
@@ -367,12 +694,29 @@ tcpedit_get_output_dlt(tcpedit_t *tcpedit)
 int
 tcpedit_validate(tcpedit_t *tcpedit)
 {
+    tcpeditdlt_t *ctx;
+
     assert(tcpedit);
     tcpedit->validated = 1;
 
-    /* we used to do a bunch of things here, but not anymore...
-     * maybe I should find something to do or just get ride of it
+    /*
+     * Ethernet in and out is by far the most common case, so it gets its
+     * own path through tcpedit_packet() without the plugin dispatch
      */
+    ctx = tcpedit->dlt_ctx;
+    tcpedit->runtime.en10mb = NULL;
+    if (ctx != NULL && ctx->decoder != NULL && ctx->decoder == ctx->encoder &&
+            ctx->decoder->dlt == DLT_EN10MB &&
+            tcpedit_dlt_getplugin(ctx, DLT_EN10MB) == ctx->decoder) {
+        tcpedit->runtime.en10mb = ctx->decoder;
+        dbg(1, "Using the Ethernet -> Ethernet fast path");
+    }
+
+    if (ctx != NULL && ctx->encoder != NULL && ctx->encoder->dlt == DLT_EN10MB)
+        dlt_en10mb_prepare(ctx);
+
+    tcpedit_compile(tcpedit);
+
     return 0;
 }
 
@@ -502,10 +846,7 @@ tcpedit_close(tcpedit_t *tcpedit)
             " packets.\n", tcpedit->runtime.total_bytes, 
             tcpedit->runtime.pkts_edited);
 
-    /* free buffer if required */
-#ifdef FORCE_ALIGN
-    safe_free(tcpedit->runtime.l3buff);
-#endif
+    tcpedit_bpf_free(tcpedit);
 
     return 0;
 }
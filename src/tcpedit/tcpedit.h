@@ -48,8 +48,16 @@ int tcpedit_validate(tcpedit_t *tcpedit);
 int tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr, 
         u_char **pktdata, tcpr_dir_t direction);
 
+bool tcpedit_packet_unchanged(tcpedit_t *tcpedit, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, tcpr_dir_t direction);
+
+#define TCPEDIT_HEADROOM 64     /* room to leave before packets for tcpedit_packet_headroom() */
+int tcpedit_packet_headroom(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr,
+        u_char **pktdata, tcpr_dir_t direction, int headroom);
+
 int tcpedit_close(tcpedit_t *tcpedit);
 int tcpedit_get_output_dlt(tcpedit_t *tcpedit);
+bool tcpedit_may_grow(tcpedit_t *tcpedit, const struct pcap_pkthdr *pkthdr);
 
 int tcpedit_l2len(tcpedit_t *tcpedit, tcpedit_coder code, u_char *packet, const int pktlen);
 const u_char *tcpedit_l3data(tcpedit_t *tcpedit, tcpedit_coder code, u_char *packet, const int pktlen);
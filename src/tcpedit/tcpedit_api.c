@@ -26,6 +26,7 @@
 #include "defines.h"
 #include "tcpedit.h"
 #include "portmap.h"
+#include "edit_bpf.h"
 #include "dlt_utils.h"
 
 /**
@@ -140,6 +141,35 @@ tcpedit_set_fixcsum(tcpedit_t *tcpedit, bool value)
     return TCPEDIT_OK;
 }
 
+/**
+ * \brief should TCP/UDP checksums be completed by the sending NIC?
+ *
+ * Only store the pseudo-header sum in the TCP/UDP checksum field of each
+ * packet sendpacket_set_csum_offload() will mark for offload, and fully
+ * checksum the rest.
+ */
+int
+tcpedit_set_csum_offload(tcpedit_t *tcpedit, bool value)
+{
+    assert(tcpedit);
+    tcpedit->csum_offload = value;
+    return TCPEDIT_OK;
+}
+
+/**
+ * \brief should header only edits patch the TCP/UDP checksums?
+ *
+ * The checksums are updated for the changed fields rather than summed
+ * again, so a bad input checksum is carried forward.
+ */
+int
+tcpedit_set_csum_incremental(tcpedit_t *tcpedit, bool value)
+{
+    assert(tcpedit);
+    tcpedit->csum_incremental = value;
+    return TCPEDIT_OK;
+}
+
 /**
  * \brief should we remove the EFCS from the frame?
  */
@@ -344,3 +374,15 @@ tcpedit_set_port_map(tcpedit_t *tcpedit, char *value)
     }
     return TCPEDIT_OK;
 }
+
+/**
+ * \brief Loads an eBPF program to run over every packet, see edit_bpf.h
+ */
+int
+tcpedit_set_edit_bpf(tcpedit_t *tcpedit, const char *path)
+{
+    assert(tcpedit);
+    assert(path);
+
+    return tcpedit_bpf_load(tcpedit, path);
+}
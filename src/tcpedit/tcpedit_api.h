@@ -42,6 +42,8 @@ int tcpedit_set_encoder_dltplugin_byname(tcpedit_t *, const char *);
 int tcpedit_set_skip_broadcast(tcpedit_t *, bool);
 int tcpedit_set_fixlen(tcpedit_t *, tcpedit_fixlen);
 int tcpedit_set_fixcsum(tcpedit_t *, bool);
+int tcpedit_set_csum_offload(tcpedit_t *, bool);
+int tcpedit_set_csum_incremental(tcpedit_t *, bool);
 int tcpedit_set_efcs(tcpedit_t *, bool);
 int tcpedit_set_ttl_mode(tcpedit_t *, tcpedit_ttl_mode);
 int tcpedit_set_ttl_value(tcpedit_t *, uint8_t);
@@ -57,6 +59,7 @@ int tcpedit_set_cidrmap_c2s(tcpedit_t *, char *);
 int tcpedit_set_srcip_map(tcpedit_t *, char *);
 int tcpedit_set_dstip_map(tcpedit_t *, char *);
 int tcpedit_set_port_map(tcpedit_t *, char *);
+int tcpedit_set_edit_bpf(tcpedit_t *, const char *);
 
 
 #ifdef __cplusplus
@@ -60,6 +60,62 @@ typedef enum {
 } tcpedit_coder;
 
 
+struct tcpedit_s;
+
+/* a packet going through a compiled edit program */
+typedef struct tcpedit_op_pkt_s {
+    struct pcap_pkthdr *pkthdr;
+    u_char *packet;
+    ipv4_hdr_t *ip_hdr;
+    ipv6_hdr_t *ip6_hdr;
+    arp_hdr_t *arp_hdr;
+    tcpr_dir_t direction;
+    bool fullcsum;                      /* set once the checksums can't just be patched */
+} tcpedit_op_pkt_t;
+
+/*
+ * one edit: returns TCPEDIT_ERROR, TCPEDIT_SOFT_ERROR to drop the packet, or
+ * how many changes need a checksum fix
+ */
+typedef int (*tcpedit_op_t)(struct tcpedit_s *, tcpedit_op_pkt_t *);
+
+#define TCPEDIT_OPS_MAX 8
+/* the edits the options select for one kind of packet, in the order they run */
+typedef struct {
+    tcpedit_op_t ops[TCPEDIT_OPS_MAX];
+    int cnt;
+} tcpedit_program_t;
+
+/*
+ * The fixed IP header edits (--tos, --ttl, --tclass, --flowlabel) as
+ * tcpedit_validate() works them out, see patch_ipv4() and patch_ipv6()
+ */
+typedef struct {
+    uint8_t ttl[256];                   /* new TTL or hop limit, by the old one */
+    int tos;                            /* -1 to keep it */
+    uint32_t v6_keep;                   /* bits of the first IPv6 word to keep, host order */
+    uint32_t v6_set;                    /* bits to set in it after that */
+} tcpedit_l3patch_t;
+
+/*
+ * What the IP maps last did to an address, see rewrite_ipv4l3().  key is
+ * 0 for an empty slot, else says which way the address was going.
+ */
+#define TCPEDIT_ADDRCACHE_BITS 10
+typedef struct {
+    uint32_t orig;
+    uint32_t addr;
+    uint8_t key;
+    uint8_t mapped;                     /* the endpoint maps matched */
+} tcpedit_addr4_entry_t;
+
+typedef struct {
+    struct tcpr_in6_addr orig;
+    struct tcpr_in6_addr addr;
+    uint8_t key;
+    uint8_t mapped;
+} tcpedit_addr6_entry_t;
+
 #define TCPEDIT_ERRSTR_LEN 1024
 typedef struct {
     COUNTER packetnum;
@@ -69,9 +125,15 @@ typedef struct {
     int dlt2;
     char errstr[TCPEDIT_ERRSTR_LEN];
     char warnstr[TCPEDIT_ERRSTR_LEN];
-#ifdef FORCE_ALIGN    
-    u_char *l3buff;
-#endif
+    struct tcpeditdlt_plugin_s *en10mb;  /* set for Ethernet -> Ethernet edits */
+    tcpedit_program_t ipv4;             /* compiled by tcpedit_validate() */
+    tcpedit_program_t ipv6;
+    tcpedit_program_t arp;
+    tcpedit_program_t other;            /* neither IP nor ARP */
+    tcpedit_l3patch_t l3patch;
+    bool prefilter;                     /* only address/port maps, see tcpedit_packet_unchanged() */
+    tcpedit_addr4_entry_t addr4[1 << TCPEDIT_ADDRCACHE_BITS];
+    tcpedit_addr6_entry_t addr6[1 << (TCPEDIT_ADDRCACHE_BITS - 2)];
 } tcpedit_runtime_t;
 
 /*
@@ -97,12 +159,16 @@ typedef struct tcpedit_portmap_s {
     long from;
     long to;
     struct tcpedit_portmap_s *next;
+    uint16_t *table;            /* head only: to port, indexed by from port */
 } tcpedit_portmap_t;
 
+/* --edit-bpf: a loaded program, see edit_bpf.c */
+typedef struct tcpedit_bpf_s tcpedit_bpf_t;
+
 /*
  * all the arguments that the packet editing library supports
  */
-typedef struct {
+typedef struct tcpedit_s {
     bool validated;  /* have we run tcpedit_validate()? */
     struct tcpeditdlt_s *dlt_ctx;
     tcpedit_packet_t *packet;
@@ -123,6 +189,12 @@ typedef struct {
     /* fix IP/TCP/UDP checksums */
     bool fixcsum;
 
+    /* leave TCP/UDP checksums to the NIC, only seed the pseudo-header */
+    bool csum_offload;
+
+    /* patch TCP/UDP checksums after header only edits instead of summing */
+    bool csum_incremental;
+
     /* remove ethernet FCS */
     bool efcs;
 
@@ -155,6 +227,9 @@ typedef struct {
     int mtu;                /* Deal with different MTU's */
     bool mtu_truncate;       /* Should we truncate frames > MTU? */
     int maxpacket;          /* L2 header + MTU */
+
+    /* user eBPF program run over every packet, or NULL */
+    tcpedit_bpf_t *bpf;
 } tcpedit_t;
 
 
@@ -85,10 +85,18 @@
 #include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <net/if.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "tcpliveplay.h"
 #include "tcpliveplay_opts.h"
 #include "common/sendpacket.h"
+#include "common/pacer.h"
+#include "common/checksum_math.h"
+#include "common/rxring.h"
 #include "send_packets.h"
 
 volatile int didsig;
@@ -97,40 +105,55 @@ volatile int didsig;
 int debug = 0;
 #endif
 
-pcap_t *set_live_filter(char *dev, in_addr* hostip, unsigned int port);
+pcap_t *set_live_filter(char *dev, in_addr* hostip, unsigned int port, unsigned int nports);
 pcap_t *set_offline_filter(char* file);
-pcap_t *live_handle; 
-u_char *recvd_pkt_data = NULL;
-unsigned int buf_write_index = 0; 
-unsigned int sched_index = 0; 
-unsigned int initial_rseq=0; 
+void live_filter_exp(char *buf, size_t len, in_addr *hostip, unsigned int port, unsigned int nports);
+int live_dispatch(void);
+pcap_t *live_handle = NULL;
+#ifdef HAVE_TX_RING
+rxring_t *set_live_ring(char *dev, in_addr *hostip, unsigned int port, unsigned int nports);
+rxring_t *live_ring = NULL;     /* replaces live_handle when the kernel gives us one */
+#endif
 sendpacket_t *sp;
 
-const u_char *packet_keeper_rprev = NULL;
-ether_hdr *etherhdr_rprev = NULL; /*g for Global header pointers used in pcap_loop callback*/
-tcp_hdr *tcphdr_rprev = NULL;
-ipv4_hdr *iphdr_rprev = NULL;
-unsigned int size_payload_prev = 0; 
-unsigned int finack_rindex = 0; 
-unsigned int acked_index = 0;
-unsigned int diff_payload_index = 0; 
-bool different_payload = false;  
-volatile sig_atomic_t keep_going = 1;
-int random_port();
-unsigned int pkts_scheduled=0;   /* packet counter */ 
-struct tcp_sched* sched = NULL; 
+struct tcp_conn *conns = NULL;  /* one per TCP connection in the capture */
+unsigned int num_conns = 0;
+unsigned int first_lport = 0;   /* local port of conns[0], the rest follow it */
+unsigned int active_conns = 0;  /* connections still being replayed */
+unsigned int next_conn = 0;     /* next connection conns_start() looks at */
+unsigned int running_conns = 0; /* started connections still being replayed */
+unsigned int max_running = 0;   /* --max-concurrent, 0 is no limit */
+pacer_t conn_pacer;             /* --conn-rate, one token per SYN */
+bool conn_paced = false;
+
+/* connection timeouts, one slot per LIVEPLAY_TICK_ms */
+struct tcp_conn *timer_wheel[TIMER_WHEEL_SLOTS];
+u_int64_t wheel_tick = 0;       /* every slot up to this tick has expired */
+u_int64_t tick_now = 0;         /* tick of the current main loop pass */
+
+int random_port(unsigned int num_ports);
 void got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet);
-void catch_alarm (int sig);
+void conn_expect(struct tcp_conn *conn, tcp_hdr *tcphdr, unsigned int size_payload);
+void conn_step(struct tcp_conn *conn);
+void conns_start(void);
+void conn_fail(struct tcp_conn *conn, enum conn_error error);
+u_int64_t liveplay_tick(void);
+void timer_arm(struct tcp_conn *conn);
+void timer_cancel(struct tcp_conn *conn);
+void timer_advance(u_int64_t now);
 void iface_addrs(char* iface, in_addr* ip, struct mac_addr* mac);
 int extmac(char* new_rmac_ptr, struct mac_addr* new_remotemac);
 int extip(char *ip_string, in_addr* new_remoteip);
 int rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, struct mac_addr* mymac, char* file, unsigned int new_src_port); 
-int setup_sched(struct tcp_sched* sched);
+int pick_lports(unsigned int new_src_port, char *file);
+int sched_cache_load(const char *cache, struct sched_cache_hdr *key);
+void sched_cache_save(const char *cache, struct sched_cache_hdr *key, unsigned int num_packets);
+void sched_cache_set_lports(unsigned int cache_lport);
+int setup_sched(struct tcp_conn *conns, in_addr *myip);
 int relative_sched(struct tcp_sched* sched, u_int32_t first_rseq, int num_packets);
 int fix_all_checksum_liveplay(ipv4_hdr *iphdr);
 int compip(in_addr* lip, in_addr* rip, in_addr* pkgip);
-int do_checksum_liveplay(u_int8_t *data, int proto, int len);
-int do_checksum_math_liveplay(u_int16_t *data, int len);
+void set_tcp_field_liveplay(tcp_hdr *tcphdr, void *field, const void *value, int len);
 
 /**
  * This is the main function of the program that handles calling other 
@@ -140,12 +163,22 @@ int
 main(int argc, char **argv) 
 {
     unsigned int k;
-    unsigned int num_packets=0;	           
+    int pkts_scheduled = 0, cached_pkts;
+    unsigned int pkts_done = 0;
+    int fd, n;
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+    struct epoll_event ev;
+#else
+    struct pollfd pfd;
+#endif
+    unsigned int conns_done = 0, conns_failed = 0;
 
     char port_mode[10];    /* does user specify random port generation?*/
     char random_strg[7] = "random";
  
-    char* iface = argv[1];
+    char* iface;
+    char* pcap_file;
     char* new_rmac_ptr; 
     char* new_rip_ptr; 
     in_addr new_remoteip; 
@@ -153,87 +186,112 @@ main(int argc, char **argv)
     in_addr myip;
     struct mac_addr mymac;
 
-
-    /*temporary packet buffers*/
-
-
     unsigned int new_src_port = 0; 
     unsigned int retransmissions = 0; 
-    
-    pcap_t *local_handle;
-    char errbuf[PCAP_ERRBUF_SIZE];
-
-
+    int num_packets, optct;
+    COUNTER conn_rate, conn_burst;
+    bool cached = false;
+    struct sched_cache_hdr cache_key;
+    struct stat pcap_stat;
      
     char ebuf[SENDPACKET_ERRBUF_SIZE];
     
 
-    optionProcess(&tcpliveplayOptions, argc, argv); /*Process AutoOpts for manpage options*/
+    optct = optionProcess(&tcpliveplayOptions, argc, argv); /*Process AutoOpts for manpage options*/
+    argc -= optct;
+    argv += optct;
 
-    if((argc < 5) || (argv[1]==NULL) || (argv[2]==NULL) || (argv[3]==NULL) || (argv[4]==NULL) || (argv[5]==NULL)){
+    if((argc < 5) || (argv[0]==NULL) || (argv[1]==NULL) || (argv[2]==NULL) || (argv[3]==NULL) || (argv[4]==NULL)){
         printf("ERROR: Incorrect Usage!\n"); 
         printf("Usage: tcpliveplay <eth0/eth1> <file.pcap> <Destinatin IP [1.2.3.4]> <Destination mac [0a:1b:2c:3d:4e:5f]> <specify 'random' or specific port#>\n");
         printf("Example:\n    yhsiam@yhsiam-VirtualBox:~$ sudo tcpliveplay eth0 test1.pcap 192.168.1.4 52:57:01:11:31:92 random\n\n"); 
         exit(0);
     }
 
+    iface = argv[0];
+    pcap_file = argv[1];
+
+    srand(time(NULL));
     iface_addrs(iface, &myip, &mymac);	/* Extract MAC of interface replay is being request on */
 
     /* open send function socket*/
     if ((sp = sendpacket_open(iface, ebuf, TCPR_DIR_C2S, SP_TYPE_NONE)) == NULL)
-        errx(-1, "Can't open %s: %s", argv[1], ebuf);
+        errx(-1, "Can't open %s: %s", iface, ebuf);
 
-    /* random dport vs. specified dport operation*/
-    strcpy(port_mode, argv[5]);
-    /*for(int i = 0; i<10; i++) tolower(port_mode[i]);*/
+    /* random port vs. specified port operation, 0 means pick one per connection count */
+    strlcpy(port_mode, argv[4], sizeof(port_mode));
     if(strcmp(port_mode, random_strg)==0){
-         new_src_port = random_port();
-    } else new_src_port = atoi(argv[5]);
-     /*else {
-	 printf("Port specification error. Please specify 'random' for random source port generation between 49152 and 65535 OR specifiy a specific source port number.\n");
-         return; 
-    }*/
-    printf("new source port:: %d\n", new_src_port);
-
-    /* Establish a handler for SIGALRM signals. */
-    /* This is used as timeout for unresponsive remote hosts */
-    signal (SIGALRM, catch_alarm);
-
+         new_src_port = 0;
+    } else new_src_port = atoi(argv[4]);
 
     /* Extract new Remote MAC & IP inputted at command line */
-    new_rmac_ptr= argv[4];
-    new_rip_ptr = argv[3]; 
+    new_rmac_ptr= argv[3];
+    new_rip_ptr = argv[2]; 
 
     /* These function setup the MAC & IP addresses in the mac_addr & in_addr structs */
     extmac(new_rmac_ptr, &new_remotemac);
     extip(new_rip_ptr, &new_remoteip);
 
-    /* Rewrites the given "*.pcap" file with all the new parameters and returns the number of packets */
-    /* that need to be replayed */
-    num_packets = rewrite(&new_remoteip, &new_remotemac, &myip, &mymac, argv[2], new_src_port); 
-    
-    /* create schedule & set it up */
-    sched = (struct tcp_sched*) malloc(num_packets*sizeof(struct tcp_sched));  
-    pkts_scheduled = setup_sched(sched);    /* Returns number of packets in schedule*/
+    /* A schedule cache prepared for the same pcap file & addresses saves us the rewrite */
+    if (HAVE_OPT(CACHE)) {
+        if (stat(pcap_file, &pcap_stat) < 0)
+            errx(-1, "Unable to stat %s: %s", pcap_file, strerror(errno));
+        memset(&cache_key, 0, sizeof(cache_key));
+        cache_key.magic = SCHED_CACHE_MAGIC;
+        cache_key.version = SCHED_CACHE_VERSION;
+        cache_key.pcap_size = pcap_stat.st_size;
+        cache_key.pcap_mtime = pcap_stat.st_mtime;
+        cache_key.myip = myip;
+        cache_key.remoteip = new_remoteip;
+        cache_key.mymac = mymac;
+        cache_key.remotemac = new_remotemac;
+        /* a missing or stale cache returns -1 and falls back to the rewrite */
+        if ((cached_pkts = sched_cache_load(OPT_ARG(CACHE), &cache_key)) > 0) {
+            pkts_scheduled = cached_pkts;
+            if (pick_lports(new_src_port, pcap_file) < 0)
+                return ERROR;
+            sched_cache_set_lports(cache_key.lport);
+            printf("Loaded schedule cache %s\n", OPT_ARG(CACHE));
+            cached = true;
+        }
+    }
 
-    /* Set up the schedule struct to be relative numbers rather than absolute*/
-    relative_sched(sched, sched[1].exp_rseq, num_packets);
-    printf("Packets Scheduled %d\n", pkts_scheduled);
+    if (!cached) {
+        /* Rewrites the given "*.pcap" file with all the new parameters, one local port per connection */
+        num_packets = rewrite(&new_remoteip, &new_remotemac, &myip, &mymac, pcap_file, new_src_port); 
+        if (num_packets < 0)
+            return ERROR;
+
+        /* create the schedule of each connection & set it up */
+        if (num_conns > 0) {
+            conns = (struct tcp_conn *)safe_malloc(num_conns * sizeof(struct tcp_conn));
+            for (k = 0; k < num_conns; k++)
+                conns[k].lport = first_lport + k;
+            pkts_scheduled = setup_sched(conns, &myip);    /* Returns number of packets in all schedules */
+        }
 
-    /* Open socket for savedfile traffic to be sent*/
-    local_handle = pcap_open_offline("newfile.pcap", errbuf);   /*call pcap library function*/
-    if (local_handle == NULL) {
-        fprintf(stderr,"Couldn't open pcap file %s: %s\n", "newfile.pcap", errbuf);
-        return(2);
+        /* Save the schedule before relative_sched() makes it specific to this run */
+        if (HAVE_OPT(CACHE) && pkts_scheduled > 0)
+            sched_cache_save(OPT_ARG(CACHE), &cache_key, pkts_scheduled);
     }
-
-    /* Open socket for live traffic to be listed to*/
-    live_handle = set_live_filter(iface, &myip, new_src_port);  /* returns a pcap_t that filters out traffic other than TCP*/
-    if (live_handle == NULL) {
-        fprintf(stderr,"Error occured while listing on traffic: %s\n", errbuf);
-        return(2);
+    active_conns = num_conns;
+
+    printf("new source port:: %d", first_lport);
+    if (num_conns > 1)
+        printf(" - %d", first_lport + num_conns - 1);
+    printf("\n");
+
+    /* Set up the schedule structs to be relative numbers rather than absolute*/
+    for (k = 0; k < num_conns; k++) {
+        if (conns[k].pkts_scheduled < 2) {
+            conn_fail(&conns[k], CONN_ERR_SCHED);
+            continue;
+        }
+        relative_sched(conns[k].sched, conns[k].sched[1].exp_rseq, conns[k].pkts_scheduled);
     }
-    
+    printf("Packets Scheduled %d\n", pkts_scheduled);
+    if (num_conns > 1)
+        printf("Connections Scheduled %d\n", num_conns);
 
     /* Printout when no packets are scheduled */
     if(pkts_scheduled==0){
@@ -245,127 +303,134 @@ main(int argc, char **argv)
         return ERROR;
     }
 
-    /* Start replay by sending the first packet, the SYN, from the schedule */
-    else if(sched[0].local){  /* Send first packet*/
-        sendpacket(sp, sched[sched_index].packet_ptr, sched[sched_index].pkthdr.len, &sched[sched_index].pkthdr);
-        printf("Sending Local Packet...............	[%d]\n",sched_index+1);
-        sched_index++; /* Proceed in the schedule */
-    }
-    
-    /* Main while loop that handles the decision making and the replay oprations */
-    while(sched_index<pkts_scheduled){
-        if(!keep_going) { /*Check the timeout variable */
-            printf("\n======================================================================\n");
-            printf("= TIMEOUT:: Remote host is not responding. You may have crashed      =\n"); 
-            printf("= the host you replayed these packets against OR the packet sequence =\n");
-            printf("= changed since the capture was taken resulting in differing         =\n");
-            printf("= expectations. Closing replay...                                    =\n");
-            printf("======================================================================\n\n"); 
-            break; 
-        } 
-        /* tcphdr_rprev carries the last remote tcp header */
-        if(tcphdr_rprev == NULL) {
-	    //printf("FIRST PASS!\n");
-        } 
-        /* Check if received RST or RST-ACK flagged packets*/
-        else if((tcphdr_rprev->th_flags==TH_RST) || (tcphdr_rprev->th_flags==(TH_RST|TH_ACK))){
-            printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-            printf("+ ERROR:: Remote host has requested to RESET the connection.   +\n"); 
-            printf("+ Closing replay...                                            +\n");
-            printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n"); 
-            break; 
-        }
-        /*Check if received earlier FIN-ACK than expected 
-        else if((sched_index-1 < finack_rindex) && (tcphdr_rprev->th_flags==(TH_FIN|TH_ACK))){
-            printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-            printf("+ ERROR:: Remote host sent an earlier FIN-ACK than expected.   +\n"); 
-            printf("+ Closing replay...                                            +\n");
-            printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
-            return; 
-        } */
-        /* Do the following if we receive a packet that ACKs for the same ACKing of next packet */
-        else if((tcphdr_rprev->th_seq==htonl(sched[sched_index].exp_rseq)) && (tcphdr_rprev->th_ack==htonl(sched[sched_index].exp_rack)) && (size_payload_prev>0)){
-            printf("Received Remote Packet...............	[%d]\n",sched_index+1);
-            printf("Skipping Packet......................	[%d] to Packet [%d]\n",sched_index+1, sched_index+2);
-            printf("Next Remote Packet Expectation met.\nProceeding in replay...\n");
-            sched_index++;   
-        } 
-        /* Do the following if payload does not meet expectation and re-attempt with the remote host for 3 tries*/
-        else if(different_payload){
-            printf("\n+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-            printf("+ WARNING: Remote host is not meeting packet size expectations.               +\n"); 
-            printf("+ for packet %-d. Application layer data differs from capture being replayed.  +\n", diff_payload_index+1);
-            printf("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n"); 
-            printf("Requesting retransmission.\n Proceeding...\n");
-            different_payload = false;  
+    /* One socket for the live traffic of every connection, demuxed on our port */
+#ifdef HAVE_TX_RING
+    live_ring = set_live_ring(iface, &myip, first_lport, num_conns);
+    if (live_ring != NULL) {
+        fd = rxring_fd(live_ring);
+    } else
+#endif
+    {
+        live_handle = set_live_filter(iface, &myip, first_lport, num_conns);  /* returns a pcap_t that filters out traffic other than TCP*/
+        if (live_handle == NULL) {
+            fprintf(stderr,"Error occured while listing on traffic\n");
+            return(2);
         }
 
-        /* Local Packets */
-        if(sched[sched_index].local) {
-            /*Reset alarm timeout*/
-            alarm (ALARM_TIMEOUT);
-            printf("Sending Local Packet...............	[%d]\n",sched_index+1); 
-          
-            /* edit each packet tcphdr before sending based on the schedule*/  
-            if(sched_index>0){ 
-                sched[sched_index].tcphdr->th_ack = htonl(sched[sched_index].curr_lack); 
-                fix_all_checksum_liveplay(sched[sched_index].iphdr);
-            }
-            
-            /* If 3 attempts of resending was made, then error out to the user */
-            if(sched[sched_index].sent_counter==3){
-                printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-                printf("+ ERROR: Re-sent packet [%-d] 3 times, but remote host is not  +\n", sched_index+1); 
-                printf("+ responding as expected. 3 resend attempts are a maximum.     +\n");
-                printf("+ Closing replay...                                            +\n");
-                printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
-                break; 
-            }
+#ifdef HAVE_PCAP_GET_SELECTABLE_FD
+        fd = pcap_get_selectable_fd(live_handle);
+#else
+        fd = pcap_fileno(live_handle);
+#endif
+    }
+
+    /* Wake up when remote packets arrive, or at the next timer tick */
+#ifdef HAVE_SYS_EPOLL_H
+    if ((epfd = epoll_create(1)) < 0)
+        errx(-1, "Unable to create epoll instance: %s", strerror(errno));
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        errx(-1, "Unable to watch %s for traffic: %s", iface, strerror(errno));
+#else
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+#endif
 
-            /* If nothing goes wrong, then send the packet scheduled to be sent, then proceed in the schedule */
-            sendpacket(sp, sched[sched_index].packet_ptr, sched[sched_index].pkthdr.len, &sched[sched_index].pkthdr);
-            sched[sched_index].sent_counter++; /* Keep track of how many times this specific packet was attempted */
-            sched_index++;   /* proceed */
+    /*
+     * SYNs go out at --conn-rate and no more than --max-concurrent
+     * connections run at once.  The loop only comes around every tick,
+     * so the bucket holds a tick worth of SYNs.
+     */
+    if (HAVE_OPT(MAX_CONCURRENT))
+        max_running = OPT_VALUE_MAX_CONCURRENT;
+    if (HAVE_OPT(CONN_RATE)) {
+        conn_rate = OPT_VALUE_CONN_RATE;
+        conn_burst = max(conn_rate * LIVEPLAY_TICK_ms / 1000, 1);
+        pacer_init(&conn_pacer, 1000000000.0 / conn_rate, conn_burst);
+        conn_paced = true;
+    }
+
+    /* Start replay by sending the first packet, the SYN, of the first connections */
+    wheel_tick = tick_now = liveplay_tick();
+    conns_start();
+
+    /* Main event loop: got_packet() answers each response as it arrives */
+    while(active_conns > 0 && !didsig){
+#ifdef HAVE_SYS_EPOLL_H
+        n = epoll_wait(epfd, &ev, 1, LIVEPLAY_TICK_ms);
+#else
+        n = poll(&pfd, 1, LIVEPLAY_TICK_ms);
+#endif
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Error waiting for live traffic: %s\n", strerror(errno));
+            break;
         }
 
-        /* Remote Packets */
-        else if(sched[sched_index].remote){
-            
-            alarm (ALARM_TIMEOUT);
-            printf("Receiving Packets from remote host...\n");
-            pcap_dispatch(live_handle, 1, got_packet, NULL); /* Listen in on NIC for tcp packets */
-            //printf("pcap_loop returned\n");
+        tick_now = liveplay_tick();
+        if (n > 0) {
+            /* Drain everything the kernel has queued for us */
+            if ((n = live_dispatch()) < 0) {
+                fprintf(stderr, "Error reading live traffic: %s\n", pcap_geterr(live_handle));
+                break;
+            }
         }
+
+        /* Fail the connections whose remote host stopped answering */
+        timer_advance(tick_now);
+
+        /* Then fill the room that left with new connections */
+        conns_start();
     } /* end of main while loop*/
 
-    
-    pcap_breakloop(live_handle); 
+#ifdef HAVE_SYS_EPOLL_H
+    close(epfd);
+#endif
 
-    pcap_close(live_handle);
+#ifdef HAVE_TX_RING
+    rxring_close(live_ring);
+#endif
+    if (live_handle != NULL) {
+        pcap_breakloop(live_handle); 
+        pcap_close(live_handle);
+    }
     sendpacket_close(sp);  /* Close Send socket*/
     remove("newfile.pcap"); /* Remote the rewritten file that was created*/
 
-    for(k=0; k<pkts_scheduled; k++){
-        retransmissions+=sched[k].sent_counter; 
+    for (k = 0; k < num_conns; k++) {
+        unsigned int j;
+
+        for (j = 0; j < conns[k].pkts_scheduled; j++)
+            retransmissions += conns[k].sched[j].sent_counter; 
+        pkts_done += conns[k].sched_index;
+        if (conns[k].state == CONN_DONE)
+            conns_done++;
+        else
+            conns_failed++;
     }
 
 
     /* User Debug Result Printouts*/
-    if(sched_index==pkts_scheduled){
+    if(conns_done == num_conns){
         printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"); 
-        printf("~ CONGRATS!!! You have successfully Replayed your pcap file '%s'  \n", argv[2]);
+        printf("~ CONGRATS!!! You have successfully Replayed your pcap file '%s'  \n", pcap_file);
         printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n\n");
     }
     else {
         printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"); 
         printf("~ Unfortunately an error has occurred  halting the replay of  \n");
-        printf("~ the pcap file '%s'. Please see error above for details...   \n", argv[2]);
+        printf("~ the pcap file '%s'. Please see error above for details...   \n", pcap_file);
         printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n\n");
     }
 
         printf("----------------TCP Live Play Summary----------------\n"); 
+        if (num_conns > 1) {
+            printf("- Connections Replayed:                             %-d   \n", num_conns);
+            printf("- Connections Completed / Failed:                   %-d / %-d   \n", conns_done, conns_failed);
+        }
         printf("- Packets Scheduled to be Sent & Received: 	    %-d   \n", pkts_scheduled);
-        printf("- Actual Packets Sent & Received:                   %-d   \n", sched_index); 
+        printf("- Actual Packets Sent & Received:                   %-d   \n", pkts_done); 
         printf("- Total Local Packet Re-Transmissions due to packet       \n");
         printf("- loss and/or differing payload size than expected: %-d   \n", retransmissions);
         printf("- Thank you for Playing, Play again!                      \n");
@@ -377,22 +442,299 @@ return 0;
 
 
 /**
- * This function serves as a timer alarm 
+ * This function stops replaying a connection and tells the user why.
+ * A single connection gets the full explanation, with many connections
+ * each failure is one line.
  */
 void
-catch_alarm (int sig){
-    keep_going = 0;
-    signal (sig, catch_alarm);
+conn_fail(struct tcp_conn *conn, enum conn_error error)
+{
+    if (conn->state == CONN_ACTIVE) {
+        active_conns--;
+        if (conn->started)
+            running_conns--;
+    }
+    timer_cancel(conn);
+    conn->state = CONN_FAILED;
+    conn->error = error;
+
+    if (num_conns > 1) {
+        printf("Connection %u (port %u): ", (unsigned int)(conn - conns) + 1, conn->lport);
+        switch (error) {
+        case CONN_ERR_TIMEOUT:
+            printf("ERROR: remote host is not responding\n");
+            break;
+        case CONN_ERR_RESET:
+            printf("ERROR: remote host reset the connection\n");
+            break;
+        case CONN_ERR_RESEND:
+            printf("ERROR: re-sent packet [%d] 3 times without the expected response\n", conn->sched_index + 1);
+            break;
+        case CONN_ERR_SCHED:
+            printf("ERROR: capture does not hold a complete handshake\n");
+            break;
+        default:
+            printf("ERROR\n");
+        }
+        return;
+    }
+
+    switch (error) {
+    case CONN_ERR_TIMEOUT:
+        printf("\n======================================================================\n");
+        printf("= TIMEOUT:: Remote host is not responding. You may have crashed      =\n"); 
+        printf("= the host you replayed these packets against OR the packet sequence =\n");
+        printf("= changed since the capture was taken resulting in differing         =\n");
+        printf("= expectations. Closing replay...                                    =\n");
+        printf("======================================================================\n\n"); 
+        break;
+    case CONN_ERR_RESET:
+        printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+        printf("+ ERROR:: Remote host has requested to RESET the connection.   +\n"); 
+        printf("+ Closing replay...                                            +\n");
+        printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n"); 
+        break;
+    case CONN_ERR_RESEND:
+        printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+        printf("+ ERROR: Re-sent packet [%-d] 3 times, but remote host is not  +\n", conn->sched_index+1); 
+        printf("+ responding as expected. 3 resend attempts are a maximum.     +\n");
+        printf("+ Closing replay...                                            +\n");
+        printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
+        break;
+    case CONN_ERR_SCHED:
+        printf("\n+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+        printf("+ ERROR:: The capture does not hold a complete TCP handshake    +\n"); 
+        printf("+ Closing replay...                                             +\n");
+        printf("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
+        break;
+    default:
+        break;
+    }
 }
 
 /**
- * This function returns a random number between 49152 and 65535
+ * This function moves one connection along its schedule: it sends local
+ * packets until the next event is a remote packet we have to wait for,
+ * then checks that the remote host answers in time.  Progress logging is
+ * only printed when a single connection is replayed.
+ */
+void
+conn_step(struct tcp_conn *conn)
+{
+    struct tcp_sched *sched = conn->sched;
+    bool chatty = (num_conns == 1);
+
+    while (conn->state == CONN_ACTIVE && conn->sched_index < conn->pkts_scheduled) {
+        /* Check the last remote packet we received */
+        if (!conn->rseen) {
+            /* FIRST PASS */
+        }
+        /* Check if received RST or RST-ACK flagged packets*/
+        else if ((conn->rflags == TH_RST) || (conn->rflags == (TH_RST|TH_ACK))) {
+            conn_fail(conn, CONN_ERR_RESET);
+            return;
+        }
+        /* Do the following if we receive a packet that ACKs for the same ACKing of next packet */
+        else if ((conn->rseq == htonl(sched[conn->sched_index].exp_rseq)) &&
+                (conn->rack == htonl(sched[conn->sched_index].exp_rack)) && (conn->size_payload_prev > 0)) {
+            if (chatty) {
+                printf("Received Remote Packet...............	[%d]\n", conn->sched_index+1);
+                printf("Skipping Packet......................	[%d] to Packet [%d]\n", conn->sched_index+1, conn->sched_index+2);
+                printf("Next Remote Packet Expectation met.\nProceeding in replay...\n");
+            }
+            conn->sched_index++;
+            continue;
+        }
+        /* Do the following if payload does not meet expectation and re-attempt with the remote host for 3 tries*/
+        else if (conn->different_payload) {
+            if (chatty) {
+                printf("\n+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+                printf("+ WARNING: Remote host is not meeting packet size expectations.               +\n"); 
+                printf("+ for packet %-d. Application layer data differs from capture being replayed.  +\n", conn->diff_payload_index+1);
+                printf("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n"); 
+                printf("Requesting retransmission.\n Proceeding...\n");
+            }
+            conn->different_payload = false;  
+        }
+
+        /* Remote Packets: wait for got_packet() to see it, the timer wheel fails us if it never comes */
+        if (sched[conn->sched_index].remote)
+            return;
+
+        /* Local Packets */
+        if (chatty)
+            printf("Sending Local Packet...............	[%d]\n", conn->sched_index+1); 
+      
+        /* edit each packet tcphdr before sending based on the schedule*/  
+        if (conn->sched_index > 0) { 
+            u_int32_t ack = htonl(sched[conn->sched_index].curr_lack);
+
+            set_tcp_field_liveplay(sched[conn->sched_index].tcphdr, &sched[conn->sched_index].tcphdr->th_ack, &ack, sizeof(ack));
+        }
+        
+        /* If 3 attempts of resending was made, then error out to the user */
+        if (sched[conn->sched_index].sent_counter == 3) {
+            conn_fail(conn, CONN_ERR_RESEND);
+            return;
+        }
+
+        /* If nothing goes wrong, then send the packet scheduled to be sent, then proceed in the schedule */
+        sendpacket(sp, sched[conn->sched_index].packet_ptr, sched[conn->sched_index].pkthdr.len, &sched[conn->sched_index].pkthdr);
+        sched[conn->sched_index].sent_counter++; /* Keep track of how many times this specific packet was attempted */
+        conn->sched_index++;   /* proceed */
+        timer_arm(conn);
+    }
+
+    if (conn->state == CONN_ACTIVE) {
+        active_conns--;
+        running_conns--;
+        timer_cancel(conn);
+        conn->state = CONN_DONE;
+    }
+}
+
+
+/**
+ * This function starts the connections that haven't been yet, in capture
+ * order, as long as --max-concurrent leaves room for them and --conn-rate
+ * has a SYN to spare
+ */
+void
+conns_start(void)
+{
+    struct tcp_conn *conn;
+    struct timespec now;
+    u_int64_t now_ns = 0;
+
+    if (conn_paced) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_ns = TIMESPEC_TO_NANOSEC(&now);
+    }
+
+    while (next_conn < num_conns && (max_running == 0 || running_conns < max_running)) {
+        conn = &conns[next_conn];
+        if (conn->state != CONN_ACTIVE) {
+            next_conn++;
+            continue;
+        }
+
+        if (conn_paced) {
+            if (pacer_wait(&conn_pacer, now_ns) > 0)
+                return;
+            pacer_take(&conn_pacer, 1);
+        }
+
+        next_conn++;
+        running_conns++;
+        conn->started = true;
+        conn_step(conn);
+    }
+}
+
+
+/**
+ * This function returns the monotonic time in LIVEPLAY_TICK_ms ticks
+ */
+u_int64_t
+liveplay_tick(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((u_int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / LIVEPLAY_TICK_ms;
+}
+
+
+/**
+ * This function (re)starts the timeout of a connection.  The wheel has
+ * more slots than the timeout has ticks, so a connection is always due
+ * the first time its slot comes around.
+ */
+void
+timer_arm(struct tcp_conn *conn)
+{
+    struct tcp_conn **slot;
+
+    timer_cancel(conn);
+    conn->tw_expire = tick_now + (ALARM_TIMEOUT * 1000) / LIVEPLAY_TICK_ms;
+    slot = &timer_wheel[conn->tw_expire & (TIMER_WHEEL_SLOTS - 1)];
+    conn->tw_prev = NULL;
+    conn->tw_next = *slot;
+    if (*slot != NULL)
+        (*slot)->tw_prev = conn;
+    *slot = conn;
+    conn->tw_armed = true;
+}
+
+
+/**
+ * This function takes a connection off the timer wheel
+ */
+void
+timer_cancel(struct tcp_conn *conn)
+{
+    if (!conn->tw_armed)
+        return;
+
+    if (conn->tw_prev != NULL)
+        conn->tw_prev->tw_next = conn->tw_next;
+    else
+        timer_wheel[conn->tw_expire & (TIMER_WHEEL_SLOTS - 1)] = conn->tw_next;
+    if (conn->tw_next != NULL)
+        conn->tw_next->tw_prev = conn->tw_prev;
+    conn->tw_armed = false;
+}
+
+
+/**
+ * This function expires every slot of the timer wheel up to tick now,
+ * timing out the connections that are due
+ */
+void
+timer_advance(u_int64_t now)
+{
+    struct tcp_conn *conn, *next;
+
+    /* after a long stall one turn of the wheel visits every slot */
+    if (now - wheel_tick > TIMER_WHEEL_SLOTS)
+        wheel_tick = now - TIMER_WHEEL_SLOTS;
+
+    while (wheel_tick < now) {
+        wheel_tick++;
+        for (conn = timer_wheel[wheel_tick & (TIMER_WHEEL_SLOTS - 1)]; conn != NULL; conn = next) {
+            next = conn->tw_next;
+            if (conn->tw_expire <= wheel_tick)
+                conn_fail(conn, CONN_ERR_TIMEOUT);
+        }
+    }
+}
+
+
+/**
+ * This function returns a random port that leaves room for num_ports
+ * consecutive ports.  They come from outside the kernel's own ephemeral
+ * range when it leaves enough room, above it first, so the replayed
+ * connections never share a port with the host's own connections to the
+ * server.  Otherwise they come from 49152 to 65535.
  */
 int
-random_port() {
-    srand(time(NULL));
-    int port_num = 49152 + (rand() % 16383);
-    return port_num;
+random_port(unsigned int num_ports) {
+    FILE *fp;
+    unsigned int lo, hi, first = 49152, last = 65535;
+
+    if ((fp = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r")) != NULL) {
+        if (fscanf(fp, "%u %u", &lo, &hi) == 2 && lo <= hi && hi <= 65535) {
+            if (65535 - hi >= num_ports) {
+                first = hi + 1;
+            } else if (lo > 1024 && lo - 1024 >= num_ports) {
+                first = 1024;
+                last = lo - 1;
+            }
+        }
+        fclose(fp);
+    }
+
+    return first + (rand() % (last - first + 2 - num_ports));
 }
 
 
@@ -404,10 +746,10 @@ random_port() {
 int
 relative_sched(struct tcp_sched* sched, u_int32_t first_rseq, int num_packets){
     int i;
-    u_int32_t lseq_adjust; 
-    srand(time(NULL));
+    u_int32_t lseq_adjust, seq; 
     lseq_adjust = rand();  /*Local SEQ number for SYN packet*/
-    printf("Random Local SEQ: %u\n",lseq_adjust);
+    if (num_conns == 1)
+        printf("Random Local SEQ: %u\n",lseq_adjust);
    
 
    u_int32_t first_lseq = sched[0].curr_lseq;   /* SYN Packet SEQ number */
@@ -417,8 +759,8 @@ relative_sched(struct tcp_sched* sched, u_int32_t first_rseq, int num_packets){
             sched[i].curr_lseq = sched[i].curr_lseq - first_lseq; /* Fix current local SEQ to relative */
             sched[i].curr_lseq = sched[i].curr_lseq + lseq_adjust; /* Make absolute. lseq_adjust is the locally generated random number */
             sched[i].curr_lack = sched[i].curr_lack - first_rseq; /* Fix current local ACK to relative */
-            sched[i].tcphdr->th_seq = htonl(sched[i].curr_lseq); /* Edit the actual packet header data */
-            fix_all_checksum_liveplay(sched[i].iphdr); /* Fix the checksum */
+            seq = htonl(sched[i].curr_lseq);
+            set_tcp_field_liveplay(sched[i].tcphdr, &sched[i].tcphdr->th_seq, &seq, sizeof(seq)); /* Edit the actual packet header data & its checksum */
 	    sched[i].exp_rseq = sched[i].exp_rseq - first_rseq; 
             sched[i].exp_rack = sched[i].exp_rack - first_lseq;
             sched[i].exp_rack = sched[i].exp_rack + lseq_adjust;  
@@ -444,10 +786,8 @@ return SUCCESS;
  */
 
 int
-setup_sched(struct tcp_sched* sched){
+setup_sched(struct tcp_conn *conns, in_addr *myip){
 
-    in_addr sip, dip;  /* Source & Destination IP */ 
-    in_addr local_ip, remote_ip;	/* ip address of client and server*/
     /*temporary packet buffers*/
     struct pcap_pkthdr header; 	// The header that pcap gives us
     const u_char *packet; 		// The actual packet
@@ -456,50 +796,57 @@ setup_sched(struct tcp_sched* sched){
     ether_hdr *etherhdr = NULL; 
     tcp_hdr *tcphdr = NULL;
     ipv4_hdr *iphdr = NULL;
-    local_ip.byte1=0; 
-    local_ip.byte2=0; 
-    local_ip.byte3=0; 
-    local_ip.byte4=0; 
-
-    remote_ip.byte1=0; 
-    remote_ip.byte2=0; 
-    remote_ip.byte3=0; 
-    remote_ip.byte4=0; 
+    struct tcp_conn *conn;
+    struct tcp_sched *sched;
 
     unsigned int size_ip, i = 0; 
     unsigned int size_tcp; 
     unsigned int size_payload; 
+    unsigned int port;
     char errbuf[PCAP_ERRBUF_SIZE];
     unsigned int flags=0; 
-    bool remote = false; 	/* flags to test if data is from 'cleint'=local or 'server'=remote */
-    bool local = false; 
+    bool local = false; 	/* flag to test if data is from 'cleint'=local or 'server'=remote */
 
 
     local_handle = pcap_open_offline("newfile.pcap", errbuf);   /*call pcap library function*/
 
     if (local_handle == NULL) {
         fprintf(stderr,"Couldn't open pcap file %s: %s\n", "newfile.pcap", errbuf);
-        return(2);
+        return 0;
     }
 	
-    /*Before sending any packet, setup the schedule with the proper parameters*/
+    /*Before sending any packet, setup the schedules with the proper parameters*/
     while((packet = pcap_next(local_handle,&header))) {
+        /* extract necessary data */
+        iphdr = (ipv4_hdr *)(packet + SIZE_ETHERNET);
+        size_ip = iphdr->ip_hl << 2;
+        if (size_ip < 20) {
+		printf("ERROR: Invalid IP header length: %u bytes\n", size_ip);
+                return 0;
+        }
+        tcphdr = (tcp_hdr *)(packet + SIZE_ETHERNET + size_ip);
+
+        /* rewrite() gave every connection its own local port, which tells them apart */
+        local = (memcmp(&iphdr->ip_src, myip, sizeof(in_addr)) == 0);
+        port = ntohs(local ? tcphdr->th_sport : tcphdr->th_dport);
+        if (port < first_lport || port - first_lport >= num_conns)
+            continue;
+        conn = &conns[port - first_lport];
+
+        if (conn->pkts_scheduled == conn->sched_alloc) {
+            conn->sched_alloc = conn->sched_alloc ? conn->sched_alloc * 2 : 16;
+            conn->sched = safe_realloc(conn->sched, conn->sched_alloc * sizeof(struct tcp_sched));
+        }
+        sched = conn->sched;
+        i = conn->pkts_scheduled;
         pkt_counter++; /*increment number of packets seen*/
         
         memcpy(&sched[i].pkthdr, &header, sizeof(struct pcap_pkthdr));
-        //sched[i].len = header.len; 
-        //sched[i].caplen = header.caplen; 
 	sched[i].packet_ptr = safe_malloc(sched[i].pkthdr.len);
 	memcpy(sched[i].packet_ptr, packet, sched[i].pkthdr.len);  
         
-	/* extract necessary data */
         etherhdr = (ether_hdr*)(sched[i].packet_ptr);
         iphdr = (ipv4_hdr *)(sched[i].packet_ptr + SIZE_ETHERNET);
-        size_ip = iphdr->ip_hl << 2;
-        if (size_ip < 20) {
-		printf("ERROR: Invalid IP header length: %u bytes\n", size_ip);
-                return 0;
-        }
         tcphdr = (tcp_hdr *)(sched[i].packet_ptr + SIZE_ETHERNET + size_ip);
         size_tcp = tcphdr->th_off*4; 
         if (size_tcp < 20) {
@@ -509,27 +856,7 @@ setup_sched(struct tcp_sched* sched){
         /* payload = (u_char *)(sched[i].packet_ptr + SIZE_ETHERNET + size_ip + size_tcp); */
         size_payload = ntohs(iphdr->ip_len) - (size_ip + (size_tcp));
 
-        
- 	/* Source IP and Destination IP */
-        sip = iphdr->ip_src;
-        dip = iphdr->ip_dst;
-
         flags = tcphdr->th_flags;
-		
-        if (flags == TH_SYN){	/* set IPs who's local and who's remote based on the SYN flag */
-            local_ip = sip;  
-            remote_ip = dip;   
-	}
-
-        /*Compare IPs to see which packet is this comming from*/
-        if(compip(&local_ip, &remote_ip, &sip)==LOCAL_IP_MATCH){
-            local = true;
-            remote = false;   
-	}
-        if(compip(&local_ip, &remote_ip, &sip)==REMOTE_IP_MATCH){
-            local = false;
-            remote = true;     
-	}
 
         /* Setup rest of Schedule, parameter by parameter */
         /* Refer to header file for details on each of the parameters */
@@ -573,7 +900,7 @@ setup_sched(struct tcp_sched* sched){
         }
 
         /* Remote Packet operations */
-        else if(remote){
+        else {
             sched[i].length_last_ldata = sched[i-1].length_curr_ldata;
             sched[i].length_curr_ldata = 0; 
             sched[i].length_last_rdata = sched[i-1].length_curr_rdata;
@@ -584,13 +911,12 @@ setup_sched(struct tcp_sched* sched){
             sched[i].curr_lack = sched[i-1].curr_lack;
             sched[i].exp_rseq = ntohl(sched[i].tcphdr->th_seq); 	/* Keep track of previous remote seq & ack #s*/
             sched[i].exp_rack = ntohl(sched[i].tcphdr->th_ack);
-            /* Setup global variable where remote FIN-ACK exists*/
-	    if(flags == (TH_FIN|TH_ACK)) finack_rindex = i; 
-            //printf("REMOTE --------%d\n",i+1);
+            /* Remember where the remote FIN-ACK exists*/
+	    if(flags == (TH_FIN|TH_ACK)) conn->finack_rindex = i; 
         }
         
 
-        i++; /* increment schedule index */
+        conn->pkts_scheduled++; /* increment schedule index */
 
     } /*end internal loop for reading packets (all in one file)*/
 
@@ -600,6 +926,78 @@ return pkt_counter; /* Return number of packets scheduled */
 }
 
 
+/**
+ * This function writes the filter expression for the remote packets of
+ * the nports connections replayed from port on
+ */
+void
+live_filter_exp(char *buf, size_t len, in_addr *hostip, unsigned int port, unsigned int nports)
+{
+    snprintf(buf, len, "tcp and dst host %d.%d.%d.%d and dst portrange %u-%u",
+        hostip->byte1, hostip->byte2, hostip->byte3, hostip->byte4, port, port + nports - 1);
+}
+
+
+/**
+ * This function hands every remote packet that has arrived to
+ * got_packet(), from the receive ring or from libpcap
+ */
+int
+live_dispatch(void)
+{
+    int n;
+
+#ifdef HAVE_TX_RING
+    if (live_ring != NULL)
+        return rxring_dispatch(live_ring, got_packet, NULL);
+#endif
+
+#ifdef HAVE_PCAP_SETNONBLOCK
+    while ((n = pcap_dispatch(live_handle, -1, got_packet, NULL)) > 0)
+        ;
+#else
+    n = pcap_dispatch(live_handle, -1, got_packet, NULL);
+#endif
+
+    return n;
+}
+
+
+#ifdef HAVE_TX_RING
+/**
+ * This function opens a PACKET_MMAP receive ring for the live traffic,
+ * with the same filter as set_live_filter().  got_packet() then reads
+ * each remote packet where the kernel put it, without libpcap's own
+ * buffering in between.  Returns NULL when the kernel has no ring for
+ * us, libpcap is used then.
+ */
+rxring_t *
+set_live_ring(char *dev, in_addr *hostip, unsigned int port, unsigned int nports)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    char filter_exp[80];
+    struct bpf_program fp;
+    pcap_t *dead;
+    rxring_t *rx = NULL;
+
+    live_filter_exp(filter_exp, sizeof(filter_exp), hostip, port, nports);
+    if ((dead = pcap_open_dead(DLT_EN10MB, BUFSIZ_PLUS)) == NULL)
+        return NULL;
+
+    if (pcap_compile(dead, &fp, filter_exp, 0, 0) == -1) {
+        dbgx(1, "Couldn't parse filter %s: %s", filter_exp, pcap_geterr(dead));
+    } else {
+        if ((rx = rxring_open(dev, &fp, LIVEPLAY_RX_BUFFER, errbuf, sizeof(errbuf))) == NULL)
+            dbgx(1, "No receive ring on %s, using libpcap: %s", dev, errbuf);
+        pcap_freecode(&fp);
+    }
+
+    pcap_close(dead);
+    return rx;
+}
+#endif
+
+
 /**
  * This function returns a pcap_t for the live traffic handler which 
  * filters out traffic other than TCP
@@ -607,14 +1005,13 @@ return pkt_counter; /* Return number of packets scheduled */
  */
 
 pcap_t* 
-set_live_filter(char *dev, in_addr* hostip, unsigned int port)
+set_live_filter(char *dev, in_addr* hostip, unsigned int port, unsigned int nports)
 {
     pcap_t *handle = NULL;			/* Session handle */
     char errbuf[PCAP_ERRBUF_SIZE];	/* Error string buffer */
     struct bpf_program fp;		/* The compiled filter */
-    char filter_exp[50]; 
-    sprintf(filter_exp,"tcp and dst host %d.%d.%d.%d and dst port %u",
-        hostip->byte1, hostip->byte2, hostip->byte3, hostip->byte4, port); 	/* The filter expression */    
+    char filter_exp[80]; 
+    live_filter_exp(filter_exp, sizeof(filter_exp), hostip, port, nports); 	/* The filter expression */    
     bpf_u_int32 mask;		        /* Our network mask */
     bpf_u_int32 net;		 	/* Our IP */
 
@@ -630,12 +1027,40 @@ set_live_filter(char *dev, in_addr* hostip, unsigned int port)
 	mask = 0;
     }
 
-    /* Open the session in promiscuous mode */
-    handle = pcap_open_live(dev, BUFSIZ_PLUS, PROMISC_OFF, TIMEOUT_ms, errbuf);
+    /* Open the session with a large ring, handing us each packet as it arrives */
+#ifdef HAVE_PCAP_SET_IMMEDIATE_MODE
+    int rcode;
+
+    if ((handle = pcap_create(dev, errbuf)) == NULL) {
+        fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
+        return handle;
+    }
+    pcap_set_snaplen(handle, BUFSIZ_PLUS);
+    pcap_set_promisc(handle, PROMISC_OFF);
+    pcap_set_timeout(handle, LIVEPLAY_TICK_ms);
+    pcap_set_immediate_mode(handle, 1);
+    pcap_set_buffer_size(handle, LIVEPLAY_RX_BUFFER);
+    if ((rcode = pcap_activate(handle)) < 0) {
+        fprintf(stderr, "Couldn't open device %s: %s\n", dev, rcode == PCAP_ERROR ?
+                pcap_geterr(handle) : pcap_statustostr(rcode));
+        pcap_close(handle);
+        return NULL;
+    }
+#else
+    handle = pcap_open_live(dev, BUFSIZ_PLUS, PROMISC_OFF, LIVEPLAY_TICK_ms, errbuf);
     if (handle == NULL) {
         fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
         return handle;
     }
+#endif
+#ifdef HAVE_PCAP_SETNONBLOCK
+    /* the event loop waits for us, libpcap must not */
+    if (pcap_setnonblock(handle, 1, errbuf) < 0) {
+        fprintf(stderr, "Couldn't make device %s non-blocking: %s\n", dev, errbuf);
+        pcap_close(handle);
+        return NULL;
+    }
+#endif
     /* Compile and apply the filter */
     if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) {
         fprintf(stderr, "Couldn't parse filter %s: %s\n", filter_exp, pcap_geterr(handle));
@@ -666,7 +1091,7 @@ set_offline_filter(char* file)
 
     
     /* Open savedfile  */
-    handle = pcap_open_offline(file, errbuf); 
+    handle = tcpr_pcap_open_offline(file, errbuf); 
     if (handle == NULL) {
         fprintf(stderr, "Couldn't open file %s\n", errbuf);
         return handle;
@@ -692,12 +1117,11 @@ return handle;
 void 
 got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet){
 
-    ether_hdr *etherhdr = NULL; 
     tcp_hdr *tcphdr = NULL;
     ipv4_hdr *iphdr = NULL;
+    struct tcp_conn *conn;
 
-    unsigned int size_ip, size_tcp, size_payload;
-    unsigned int flags = 0;
+    unsigned int size_ip, size_tcp, size_payload, port;
 
     /* This is to get rid of the warning */
     args = NULL;
@@ -705,7 +1129,6 @@ got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
     if(header == NULL) args = NULL; 
 
     /* Extract and examine recieved packet headers */
-    etherhdr = (ether_hdr*)(packet);
     iphdr = (ipv4_hdr *)(packet + SIZE_ETHERNET);
     size_ip = iphdr->ip_hl << 2;
     if (size_ip < 20) {
@@ -720,56 +1143,80 @@ got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
     }
     size_payload = ntohs(iphdr->ip_len) - (size_ip + (size_tcp));    
 
+    /* Our port says which connection this packet belongs to */
+    port = ntohs(tcphdr->th_dport);
+    if (port < first_lport || port - first_lport >= num_conns)
+        return;
+    conn = &conns[port - first_lport];
+    if (conn->state != CONN_ACTIVE || !conn->started || conn->sched_index >= conn->pkts_scheduled)
+        return;
+    timer_arm(conn);
+
+    /* Check the packet against the schedule, then answer right away */
+    conn_expect(conn, tcphdr, size_payload);
+    conn_step(conn);
+}
+
+
+/**
+ * This function checks a remote packet against what the schedule of its
+ * connection expects, and moves the schedule along or back accordingly
+ */
+void
+conn_expect(struct tcp_conn *conn, tcp_hdr *tcphdr, unsigned int size_payload)
+{
+    struct tcp_sched *sched = conn->sched;
+    unsigned int flags = 0;
+    bool chatty = (num_conns == 1);
 
     flags = tcphdr->th_flags;
     /* Check correct SYN-ACK expecation, if so then proceed in fixing entire schedule from relative to absolute SEQs+ACKs */
-    if((flags == (TH_SYN|TH_ACK)) && (sched_index==1) && (tcphdr->th_ack==htonl(sched[sched_index-1].curr_lseq + 1))){
+    if((flags == (TH_SYN|TH_ACK)) && (conn->sched_index==1) && (tcphdr->th_ack==htonl(sched[conn->sched_index-1].curr_lseq + 1))){
         unsigned int j;
-        printf("Received Remote Packet...............	[%d]\n",sched_index+1);
-        printf("Remote Pakcet Expectation met.\nProceeding in replay....\n");
-        //printf("SYN-ACKed Random SEQ set!\n");
-        initial_rseq = ntohl(tcphdr->th_seq); 
-        //printf("initial_rseq: %u\n", initial_rseq);
+        if (chatty) {
+            printf("Received Remote Packet...............	[%d]\n",conn->sched_index+1);
+            printf("Remote Pakcet Expectation met.\nProceeding in replay....\n");
+        }
+        conn->initial_rseq = ntohl(tcphdr->th_seq); 
         /* After we receiving the first SYN-ACK, then adjust the entire sched to be absolute rather than relative #s*/
-        sched[1].exp_rseq = sched[1].exp_rseq + initial_rseq;
-        for(j = 2; j<pkts_scheduled; j++){ /* Based on correctly recieving the random SEQ from the SYN-ACK packet, do the following:*/
+        sched[1].exp_rseq = sched[1].exp_rseq + conn->initial_rseq;
+        for(j = 2; j<conn->pkts_scheduled; j++){ /* Based on correctly recieving the random SEQ from the SYN-ACK packet, do the following:*/
             if(sched[j].local){ /* Set local ACKs for entire sched to be absolute #s*/
-                sched[j].curr_lack = sched[j].curr_lack + initial_rseq; 
+                sched[j].curr_lack = sched[j].curr_lack + conn->initial_rseq; 
             }
             else if(sched[j].remote){ /* Set remote SEQs for entire sched to be absolute #s*/
-                sched[j].exp_rseq = sched[j].exp_rseq + initial_rseq;
+                sched[j].exp_rseq = sched[j].exp_rseq + conn->initial_rseq;
                 
            }
         }
-    sched_index++; /* Proceed in the schedule*/
+    conn->sched_index++; /* Proceed in the schedule*/
     return; 
     }
 
 
-    printf(">Received a Remote Packet\n");
-    printf(">>Checking Expectations\n");
+    if (chatty) {
+        printf(">Received a Remote Packet\n");
+        printf(">>Checking Expectations\n");
+    }
    
 
     /* Handle Remote Packet Loss */
-    if(sched[sched_index].exp_rack > ntohl(tcphdr->th_ack)) { 
-        //printf("Remote Packet Loss! Resending Lost packet\n");
-        sched_index=acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
-        //printf("ACKED Index = %d\n", acked_index); 
-        while(!sched[sched_index].local){
-            sched_index++; 
+    if(sched[conn->sched_index].exp_rack > ntohl(tcphdr->th_ack)) { 
+        conn->sched_index=conn->acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
+        while(conn->sched_index < conn->pkts_scheduled && !sched[conn->sched_index].local){
+            conn->sched_index++; 
         }
         return; 
     } 
 
     /* Handle Local Packet Loss <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<COME BACK TO THIS<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< */
-    else if((sched[sched_index].exp_rseq  < ntohl(tcphdr->th_seq)) && sched[sched_index].remote){ 
+    else if((sched[conn->sched_index].exp_rseq  < ntohl(tcphdr->th_seq)) && sched[conn->sched_index].remote){ 
         /* Resend immediate previous LOCAL packet */
-        printf("Local Packet Loss! Resending Lost packet >> DupACK Issued!\n");
-        sched_index=acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
-        /*sched[sched_index].sent_counter=0; Reset the re-transmission counter for this ACKed packet?*/
-        //printf("ACKED Index = %d\n", acked_index); 
-        while(!sched[sched_index].local){
-            sched_index++; 
+        if (chatty)
+            printf("Local Packet Loss! Resending Lost packet >> DupACK Issued!\n");
+        conn->sched_index=conn->acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
+        while(conn->sched_index < conn->pkts_scheduled && !sched[conn->sched_index].local){
+            conn->sched_index++; 
         }
         return; 
     } 
@@ -778,37 +1225,39 @@ got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
         
 
     /* No Packet Loss... Proceed Normally (if expectations are met!) */
-    else if((tcphdr->th_seq==htonl(sched[sched_index].exp_rseq)) && 
-	(tcphdr->th_ack==htonl(sched[sched_index].exp_rack))){
-            printf("Received Remote Packet...............	[%d]\n",sched_index+1);
+    else if((tcphdr->th_seq==htonl(sched[conn->sched_index].exp_rseq)) && 
+	(tcphdr->th_ack==htonl(sched[conn->sched_index].exp_rack))){
+            if (chatty)
+                printf("Received Remote Packet...............	[%d]\n",conn->sched_index+1);
             /* Handles differing payload size and does not trigger on unnecessary ACK + window update issues*/
-            if((sched[sched_index].size_payload!=size_payload) && (size_payload!=0)){
-                printf("Payload size of received packet does not meet expectations\n");
+            if((sched[conn->sched_index].size_payload!=size_payload) && (size_payload!=0)){
+                if (chatty)
+                    printf("Payload size of received packet does not meet expectations\n");
                 /* Resent last local packet, maybe remote host behaves this time*/
-                different_payload=true; 
-                /* Set global variable of where differing payload size is not meeting expectations*/
-                diff_payload_index = sched_index; 
+                conn->different_payload=true; 
+                /* Remember where differing payload size is not meeting expectations*/
+                conn->diff_payload_index = conn->sched_index; 
 
                 /*Treat this as packet loss, and attempt resetting index to resend packets where*/
                 /* packets were received matching expectation*/
-                sched_index=acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
-                //printf("ACKED Index = %d\n", acked_index); 
-                while(!sched[sched_index].local){
-                    sched_index++; 
+                conn->sched_index=conn->acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
+                while(conn->sched_index < conn->pkts_scheduled && !sched[conn->sched_index].local){
+                    conn->sched_index++; 
                 }
                 return; 
             }
-            printf("Remote Packet Expectation met.\nProceeding in replay....\n");
-            sched_index++;
-            acked_index = sched_index; /*Keep track correctly ACKed packet index*/
+            if (chatty)
+                printf("Remote Packet Expectation met.\nProceeding in replay....\n");
+            conn->sched_index++;
+            conn->acked_index = conn->sched_index; /*Keep track correctly ACKed packet index*/
     } 
 
-    /* Global variable to keep tack of last recieved packet info */
-    packet_keeper_rprev = packet;  
-    etherhdr_rprev = etherhdr; 
-    tcphdr_rprev = tcphdr;
-    iphdr_rprev = iphdr; 
-    size_payload_prev = size_payload;
+    /* Keep what we need of the last recieved packet, libpcap reuses its buffer */
+    conn->rseen = true;
+    conn->rflags = tcphdr->th_flags;
+    conn->rseq = tcphdr->th_seq;
+    conn->rack = tcphdr->th_ack;
+    conn->size_payload_prev = size_payload;
 
  
 return; 
@@ -896,12 +1345,94 @@ return;
 }
 
 
+/**
+ * This function picks the local ports of the num_conns connections:
+ * new_src_port for the first one and the ports right after it for the
+ * others, or a random range when new_src_port is 0.
+ */
+int
+pick_lports(unsigned int new_src_port, char *file)
+{
+    if (num_conns == 0) {
+        /* nothing to replay, keep the requested port for the printout */
+        first_lport = new_src_port;
+    } else if (new_src_port == 0) {
+        first_lport = random_port(num_conns);
+    } else if (new_src_port + num_conns - 1 > 65535) {
+        fprintf(stderr, "Port %u leaves no room for the %u connections in '%s'\n",
+                new_src_port, num_conns, file);
+        return ERROR;
+    } else {
+        first_lport = new_src_port;
+    }
+
+    return SUCCESS;
+}
+
+
+
+/* The original addresses of one connection as seen in the capture */
+struct conn_key {
+    in_addr lip, rip;
+    u_int16_t lport, rport;     /* network order */
+};
+
+/**
+ * This function finds the connection a packet of the capture belongs to
+ * and whether it was sent by the local side.  A pure SYN of a connection
+ * we have not seen yet starts a new one when add is set.  Returns the
+ * connection index, or -1 if the packet belongs to no connection.
+ */
+static int
+conn_lookup(struct conn_key *keys, u_int32_t *hash, ipv4_hdr *iphdr, tcp_hdr *tcphdr, bool add, bool *local)
+{
+    u_int32_t h = 0;
+    unsigned int k;
+    struct conn_key *key;
+
+    /* both directions of a connection have to land in the same bucket */
+    for (k = 0; k < sizeof(in_addr); k++)
+        h = h * 31 + (((u_char *)&iphdr->ip_src)[k] ^ ((u_char *)&iphdr->ip_dst)[k]);
+    h = (h * 31 + (tcphdr->th_sport ^ tcphdr->th_dport)) * 2654435761U;
+
+    for (h &= CONN_HASH_SIZE - 1; hash[h] != 0; h = (h + 1) & (CONN_HASH_SIZE - 1)) {
+        key = &keys[hash[h] - 1];
+        if (tcphdr->th_sport == key->lport && tcphdr->th_dport == key->rport &&
+                memcmp(&iphdr->ip_src, &key->lip, sizeof(in_addr)) == 0 &&
+                memcmp(&iphdr->ip_dst, &key->rip, sizeof(in_addr)) == 0) {
+            *local = true;
+            return hash[h] - 1;
+        }
+        if (tcphdr->th_sport == key->rport && tcphdr->th_dport == key->lport &&
+                memcmp(&iphdr->ip_src, &key->rip, sizeof(in_addr)) == 0 &&
+                memcmp(&iphdr->ip_dst, &key->lip, sizeof(in_addr)) == 0) {
+            *local = false;
+            return hash[h] - 1;
+        }
+    }
+
+    if (!add || tcphdr->th_flags != TH_SYN || num_conns == MAX_CONNS)
+        return -1;
+
+    key = &keys[num_conns];
+    key->lip = iphdr->ip_src;
+    key->rip = iphdr->ip_dst;
+    key->lport = tcphdr->th_sport;
+    key->rport = tcphdr->th_dport;
+    hash[h] = ++num_conns;
+    *local = true;
+    return num_conns - 1;
+}
+
 /**
  * This function rewrites the IPs and MACs of a given packet, 
  * creates a newfile.pcap. It returns the number of packets of the newfile. 
- * This function only starts rewriting the newfile once it sees the first
- * SYN packet. This is so that the first packet in the newfile is always 
- * the first packet to be sent. 
+ * Every TCP connection in the capture starts with its SYN packet and is
+ * given its own local port: new_src_port for the first one and the ports
+ * right after it for the others.  A new_src_port of 0 picks a random
+ * range.  Packets before a connection's SYN are left out, so the first
+ * packet of each connection in the newfile is always its first packet
+ * to be sent. 
  */
 int
 rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, struct mac_addr* mymac, char* file, unsigned int new_src_port)
@@ -910,40 +1441,61 @@ rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, st
     ether_hdr* etherhdr; 
     ipv4_hdr *iphdr;
     tcp_hdr *tcphdr;
-    in_addr local_ip; 
-    in_addr remote_ip; 
     unsigned int size_ip;
     unsigned int size_tcp; 
     char* newfile = "newfile.pcap";
-    char ErrBuff [1024];
-    int pkt_counter, len; 
+    int pkt_counter, len, idx; 
     const u_char *packet;
     struct pcap_pkthdr *header;
-    in_addr sip;  /* Source IP */ 
-    unsigned int flags; 
     int local_packets = 0; 
-    bool initstep1 = false;  /* keep track of successful handshake step */
+    bool local;
+    struct conn_key *keys;
+    u_int32_t *hash;
+    pcap_t *pcap;
+    int fp_for_header, fp = -1;
+    u_int8_t data[sizeof(struct pcap_file_header)];
+    int ret;
 
-    local_ip.byte1=0; 
-    local_ip.byte2=0; 
-    local_ip.byte3=0; 
-    local_ip.byte4=0; 
+    keys = safe_malloc(MAX_CONNS * sizeof(struct conn_key));
+    hash = safe_malloc(CONN_HASH_SIZE * sizeof(u_int32_t));
+
+    /* First pass: find the connections so we know how many ports we need */
+    pcap = set_offline_filter(file); 
+    if (!pcap){
+        fprintf (stderr, "Cannot open PCAP file '%s'\n", file);
+        ret = PCAP_OPEN_ERROR;
+        goto out;
+    }
+    while (pcap_next_ex(pcap, &header, &packet) > 0) {
+        iphdr = (ipv4_hdr *)(packet + SIZE_ETHERNET);
+        size_ip = iphdr->ip_hl << 2; 
+        if (size_ip < 20) {
+	    printf("ERROR: Invalid IP header length: %u bytes\n", size_ip);
+            ret = ERROR;
+            goto out;
+        }
+        tcphdr = (tcp_hdr *)(packet + SIZE_ETHERNET + size_ip);
+        conn_lookup(keys, hash, iphdr, tcphdr, true, &local);
+    }
+    pcap_close(pcap);
+    pcap = NULL;
 
-    remote_ip.byte1=0; 
-    remote_ip.byte2=0; 
-    remote_ip.byte3=0; 
-    remote_ip.byte4=0;  
+    if (num_conns == MAX_CONNS)
+        printf("WARNING: only the first %d connections of '%s' are replayed\n", MAX_CONNS, file);
 
+    if (pick_lports(new_src_port, file) < 0) {
+        ret = ERROR;
+        goto out;
+    }
 
     /*Read the header of the PCAP*/
-    int fp_for_header = open(file,O_RDONLY);
+    fp_for_header = open(file,O_RDONLY);
     if(fp_for_header < 0){
         fprintf(stderr, "Cannot open PCAP file to get file header.\n");
-        return PCAP_OPEN_ERROR;
+        ret = PCAP_OPEN_ERROR;
+        goto out;
     }
  
-    u_int8_t data[sizeof(struct pcap_file_header)];
- 
     len = read(fp_for_header, data, sizeof(struct pcap_file_header));
     if(len == 0){
         fprintf(stderr, "Could not read from file.\n");
@@ -951,22 +1503,23 @@ rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, st
     close(fp_for_header);
 
     /*Open file for reading each packet*/
-    int fp = open(newfile,O_CREAT|O_WRONLY,S_IRWXU);
+    fp = open(newfile,O_CREAT|O_WRONLY,S_IRWXU);
     if(fp < 0){
         fprintf(stderr, "Cannot open file: %s for writing.\n",newfile);
-        return PCAP_OPEN_ERROR;
+        ret = PCAP_OPEN_ERROR;
+        goto out;
     }		
  
     /* Write the header to new file */
     len = write(fp, data,sizeof(struct pcap_file_header));
  
     
-    pcap_t *pcap = set_offline_filter(file); 
+    pcap = set_offline_filter(file); 
 
     if (!pcap){
         fprintf (stderr, "Cannot open PCAP file '%s'\n", file);
-                fprintf(stderr, "%s\n",ErrBuff);
-                return PCAP_OPEN_ERROR;
+        ret = PCAP_OPEN_ERROR;
+        goto out;
     }
  
     /*Modify each packet's IP & MAC based on the passed args then do a checksum of each packet*/
@@ -977,30 +1530,24 @@ rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, st
         size_ip = iphdr->ip_hl << 2; 
         if (size_ip < 20) {
 	    printf("ERROR: Invalid IP header length: %u bytes\n", size_ip);
-        return ERROR;
+            ret = ERROR;
+            goto out;
         }
         tcphdr = (tcp_hdr *)(packet + SIZE_ETHERNET + size_ip);
         size_tcp = tcphdr->th_off*4;
         if (size_tcp < 20) {
             printf("ERROR: Invalid TCP header length: %u bytes\n", size_tcp);
-        return ERROR;
+            ret = ERROR;
+            goto out;
 	}
         /* payload = (u_char *)(packet + SIZE_ETHERNET + size_ip + size_tcp); */
 
+        /* only rewrite packets from a connection's SYN packet on wards */
+        idx = conn_lookup(keys, hash, iphdr, tcphdr, false, &local);
+        if (idx < 0)
+            continue;
 
-        sip = iphdr->ip_src;
-
-        flags = tcphdr->th_flags;
-
-
-	/* set IPs who's local and who's remote based on the SYN flag */
-	if(flags == TH_SYN){
-            local_ip = iphdr->ip_src; 
-            remote_ip = iphdr->ip_dst; 
-            initstep1 = true; /* This flag is set to signify the first encounter of the SYN within the pacp*/ 						
-	}
-
-	if(compip(&local_ip, &remote_ip, &sip)==LOCAL_IP_MATCH){
+	if(local){
                 /* Set the source MAC */
 		etherhdr->ether_shost[0] = mymac->byte1;	
 		etherhdr->ether_shost[1] = mymac->byte2;
@@ -1023,10 +1570,10 @@ rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, st
 		etherhdr->ether_dhost[5] = new_remotemac->byte6;
 
 
-                /* This is to change the source port, whether it is specified as random or as a port # by the user */
-		tcphdr->th_sport = htons(new_src_port);
+                /* This is to change the source port to the one of this connection */
+		tcphdr->th_sport = htons(first_lport + idx);
 	}
-	else if(compip(&local_ip, &remote_ip, &sip)==REMOTE_IP_MATCH){
+	else {
 
                 /* Set the destination MAC */
                 etherhdr->ether_dhost[0] = mymac->byte1;	
@@ -1047,39 +1594,252 @@ rewrite(in_addr* new_remoteip, struct mac_addr* new_remotemac, in_addr* myip, st
 		etherhdr->ether_shost[4] = new_remotemac->byte5;
 		etherhdr->ether_shost[5] = new_remotemac->byte6; 
 
-                /* This is to change the source port, whether it is specified as random or as a port # by the user */
-                tcphdr->th_dport = htons(new_src_port);
+                /* This is to change the destination port to the one of this connection */
+                tcphdr->th_dport = htons(first_lport + idx);
 	}
  
         /*Calculate & fix checksum for newly edited-packet*/
         fix_all_checksum_liveplay(iphdr);
 
-        if(initstep1){ /*only start rewriting new pcap with SYN packets on wards*/
-            local_packets ++; 
-            len = write(fp,header,16);
-            if(len == 0){
-                fprintf(stderr, "Error occurred writing pcap_header.\n");
-                pcap_close(pcap);
-                close(fp);
-                return REWRITE_ERROR;
-            }
- 
-            len = write(fp,packet,header->caplen);
-            if(len == 0){
-                fprintf(stderr, "Error occurred writing pcap data.\n");
-                pcap_close(pcap);
-                close(fp);
-                return REWRITE_ERROR;
-            }	
+        local_packets ++; 
+        len = write(fp,header,16);
+        if(len == 0){
+            fprintf(stderr, "Error occurred writing pcap_header.\n");
+            ret = REWRITE_ERROR;
+            goto out;
         }
+ 
+        len = write(fp,packet,header->caplen);
+        if(len == 0){
+            fprintf(stderr, "Error occurred writing pcap data.\n");
+            ret = REWRITE_ERROR;
+            goto out;
+        }	
         
   
 
     } /* end of while loop */
- 
-    pcap_close (pcap);
-    close(fp);
-    return local_packets;
+
+    ret = local_packets;
+
+out:
+    if (pcap)
+        pcap_close(pcap);
+    if (fp >= 0)
+        close(fp);
+    safe_free(keys);
+    safe_free(hash);
+    return ret;
+}
+
+
+#define SCHED_CACHE_PAD(x) (((x) + SCHED_CACHE_ALIGN - 1) & ~(size_t)(SCHED_CACHE_ALIGN - 1))
+
+/**
+ * This function maps a schedule cache written by sched_cache_save() and
+ * sets up the connections and their schedules from it, the packets stay
+ * in the (private) mapping.  The cache is only used if it was built from
+ * the pcap file & addresses in key; key->lport is set to the port it was
+ * built for.  Returns the number of packets scheduled, or -1 if the cache
+ * is missing, stale or damaged.
+ */
+int
+sched_cache_load(const char *cache, struct sched_cache_hdr *key)
+{
+    struct sched_cache_hdr *hdr;
+    struct sched_cache_conn *cc;
+    struct sched_cache_pkt *pkt;
+    struct tcp_sched *sched;
+    struct stat st;
+    u_char *map;
+    size_t off, size;
+    unsigned int k, i;
+    int fd;
+
+    if ((fd = open(cache, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+
+    /* private & writable: the replay edits SEQs, ACKs & ports in place */
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    hdr = (struct sched_cache_hdr *)map;
+    if (hdr->magic != key->magic || hdr->version != key->version ||
+            hdr->pcap_size != key->pcap_size || hdr->pcap_mtime != key->pcap_mtime ||
+            memcmp(&hdr->myip, &key->myip, sizeof(in_addr)) != 0 ||
+            memcmp(&hdr->remoteip, &key->remoteip, sizeof(in_addr)) != 0 ||
+            memcmp(&hdr->mymac, &key->mymac, sizeof(struct mac_addr)) != 0 ||
+            memcmp(&hdr->remotemac, &key->remotemac, sizeof(struct mac_addr)) != 0 ||
+            hdr->num_conns == 0 || hdr->num_conns > MAX_CONNS ||
+            SCHED_CACHE_PAD(sizeof(*hdr)) + hdr->num_conns * sizeof(*cc) > size) {
+        munmap(map, size);
+        return -1;
+    }
+
+    cc = (struct sched_cache_conn *)(map + SCHED_CACHE_PAD(sizeof(*hdr)));
+    off = SCHED_CACHE_PAD(sizeof(*hdr)) + SCHED_CACHE_PAD(hdr->num_conns * sizeof(*cc));
+
+    num_conns = hdr->num_conns;
+    conns = (struct tcp_conn *)safe_malloc(num_conns * sizeof(struct tcp_conn));
+    for (k = 0; k < num_conns; k++) {
+        if (cc[k].pkts_scheduled > hdr->num_packets)
+            goto damaged;
+        conns[k].pkts_scheduled = conns[k].sched_alloc = cc[k].pkts_scheduled;
+        conns[k].finack_rindex = cc[k].finack_rindex;
+        if (conns[k].pkts_scheduled == 0)
+            continue;
+        sched = conns[k].sched = safe_malloc(conns[k].pkts_scheduled * sizeof(struct tcp_sched));
+
+        for (i = 0; i < conns[k].pkts_scheduled; i++) {
+            if (off + sizeof(*pkt) > size)
+                goto damaged;
+            pkt = (struct sched_cache_pkt *)(map + off);
+            off += sizeof(*pkt);
+            if (off + pkt->len > size || pkt->size_ip < 20 || pkt->size_tcp < 20 ||
+                    pkt->len < SIZE_ETHERNET + pkt->size_ip + pkt->size_tcp)
+                goto damaged;
+
+            sched[i].exp_rseq = pkt->exp_rseq;
+            sched[i].exp_rack = pkt->exp_rack;
+            sched[i].curr_lseq = pkt->curr_lseq;
+            sched[i].curr_lack = pkt->curr_lack;
+            sched[i].length_curr_ldata = pkt->length_curr_ldata;
+            sched[i].length_last_ldata = pkt->length_last_ldata;
+            sched[i].length_curr_rdata = pkt->length_curr_rdata;
+            sched[i].length_last_rdata = pkt->length_last_rdata;
+            sched[i].pkthdr.ts.tv_sec = pkt->ts_sec;
+            sched[i].pkthdr.ts.tv_usec = pkt->ts_usec;
+            sched[i].pkthdr.caplen = pkt->caplen;
+            sched[i].pkthdr.len = pkt->len;
+            sched[i].size_ip = pkt->size_ip;
+            sched[i].size_tcp = pkt->size_tcp;
+            sched[i].size_payload = pkt->size_payload;
+            sched[i].local = pkt->local;
+            sched[i].remote = pkt->remote;
+            sched[i].packet_ptr = map + off;
+            sched[i].etherhdr = (ether_hdr *)sched[i].packet_ptr;
+            sched[i].iphdr = (ipv4_hdr *)(sched[i].packet_ptr + SIZE_ETHERNET);
+            sched[i].tcphdr = (tcp_hdr *)(sched[i].packet_ptr + SIZE_ETHERNET + pkt->size_ip);
+            off += SCHED_CACHE_PAD(pkt->len);
+        }
+    }
+
+    key->lport = hdr->lport;
+    return hdr->num_packets;
+
+damaged:
+    fprintf(stderr, "Schedule cache %s is damaged, preparing the pcap file again\n", cache);
+    for (k = 0; k < num_conns; k++)
+        safe_free(conns[k].sched);
+    safe_free(conns);
+    num_conns = 0;
+    munmap(map, size);
+    return -1;
+}
+
+
+/**
+ * This function saves the schedules setup_sched() built, before
+ * relative_sched() applies this run's random SEQs, for sched_cache_load().
+ * A cache which can't be written is not an error, the next run simply
+ * prepares the pcap file again.
+ */
+void
+sched_cache_save(const char *cache, struct sched_cache_hdr *key, unsigned int num_packets)
+{
+    static const u_char zero[SCHED_CACHE_ALIGN];
+    struct sched_cache_hdr hdr;
+    struct sched_cache_conn cc;
+    struct sched_cache_pkt pkt;
+    struct tcp_sched *sched;
+    unsigned int k, i;
+    size_t len;
+    FILE *f;
+
+    if ((f = fopen(cache, "wb")) == NULL) {
+        fprintf(stderr, "Unable to write schedule cache %s: %s\n", cache, strerror(errno));
+        return;
+    }
+
+    hdr = *key;
+    hdr.num_conns = num_conns;
+    hdr.num_packets = num_packets;
+    hdr.lport = first_lport;
+    len = sizeof(hdr);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(zero, SCHED_CACHE_PAD(len) - len, 1, f);
+
+    for (k = 0; k < num_conns; k++) {
+        cc.pkts_scheduled = conns[k].pkts_scheduled;
+        cc.finack_rindex = conns[k].finack_rindex;
+        fwrite(&cc, sizeof(cc), 1, f);
+    }
+    len = num_conns * sizeof(cc);
+    fwrite(zero, SCHED_CACHE_PAD(len) - len, 1, f);
+
+    for (k = 0; k < num_conns; k++) {
+        sched = conns[k].sched;
+        for (i = 0; i < conns[k].pkts_scheduled; i++) {
+            memset(&pkt, 0, sizeof(pkt));
+            pkt.exp_rseq = sched[i].exp_rseq;
+            pkt.exp_rack = sched[i].exp_rack;
+            pkt.curr_lseq = sched[i].curr_lseq;
+            pkt.curr_lack = sched[i].curr_lack;
+            pkt.length_curr_ldata = sched[i].length_curr_ldata;
+            pkt.length_last_ldata = sched[i].length_last_ldata;
+            pkt.length_curr_rdata = sched[i].length_curr_rdata;
+            pkt.length_last_rdata = sched[i].length_last_rdata;
+            pkt.ts_sec = sched[i].pkthdr.ts.tv_sec;
+            pkt.ts_usec = sched[i].pkthdr.ts.tv_usec;
+            pkt.caplen = sched[i].pkthdr.caplen;
+            pkt.len = sched[i].pkthdr.len;
+            pkt.size_ip = sched[i].size_ip;
+            pkt.size_tcp = sched[i].size_tcp;
+            pkt.size_payload = sched[i].size_payload;
+            pkt.local = sched[i].local;
+            pkt.remote = sched[i].remote;
+            fwrite(&pkt, sizeof(pkt), 1, f);
+            fwrite(sched[i].packet_ptr, pkt.len, 1, f);
+            fwrite(zero, SCHED_CACHE_PAD(pkt.len) - pkt.len, 1, f);
+        }
+    }
+
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "Unable to write schedule cache %s\n", cache);
+        unlink(cache);
+    }
+}
+
+
+/**
+ * This function moves the local packets of a loaded schedule cache from
+ * the ports it was built for to the ones picked for this run
+ */
+void
+sched_cache_set_lports(unsigned int cache_lport)
+{
+    unsigned int k, i;
+    u_int16_t port;
+
+    for (k = 0; k < num_conns; k++) {
+        conns[k].lport = first_lport + k;
+        if (first_lport == cache_lport)
+            continue;
+
+        /* remote packets are only used for their SEQs & ACKs, leave them be */
+        port = htons(conns[k].lport);
+        for (i = 0; i < conns[k].pkts_scheduled; i++) {
+            if (conns[k].sched[i].local)
+                set_tcp_field_liveplay(conns[k].sched[i].tcphdr, &conns[k].sched[i].tcphdr->th_sport, &port, sizeof(port));
+        }
+    }
 }
 
 /**
@@ -1139,124 +1899,50 @@ return SUCCESS;
 
 
 /**
- * This function calls all the checksum function given the IP Header
- * and edits the checksums fixing them appropriately 
- *
+ * This function recomputes the TCP and IP checksums of a rewritten
+ * packet with the shared checksum kernels
  */
 int
 fix_all_checksum_liveplay(ipv4_hdr *iphdr){
 
-    int ret1 = 0, ret2 = 0; 
+    tcp_hdr *tcphdr;
+    int ip_hl = iphdr->ip_hl << 2;
+    int len = ntohs(iphdr->ip_len) - ip_hl;
+    int sum;
 
-    /*Calculate TCP Checksum*/
-    ret2 = do_checksum_liveplay((u_char *) iphdr,iphdr->ip_p, ntohs(iphdr->ip_len) - (iphdr->ip_hl << 2));
-    if(ret2==-1){
+    if (iphdr->ip_p != IPPROTO_TCP || len <= 0) {
         printf("*******An Error Occured calculating TCP Checksum*******\n");
-    return -1; 
-    }
-
-    /*Calculate IP Checksum*/
-    ret1 = do_checksum_liveplay((u_char *) iphdr, IPPROTO_IP, ntohs(iphdr->ip_len));
-    if(ret1==-1){
-        printf("*******An Error Occured calculating IP Checksum*******\n");
-    return -1; 
+        return -1;
     }
 
- 
-return 0; 
-}
-
-/************************************************************************************/
-
-/*[copied from Aaron Turnor's checksum.c, but ommitting tcpedit_t structs] */
-/*[The following functions have been slightly modified to be integrated with tcpliveplay code structure] */
-
-/** 
- * This code re-calcs the IP and Layer 4 checksums
- * the IMPORTANT THING is that the Layer 4 header 
- * is contiguious in memory after *ip_hdr we're actually
- * writing to the layer 4 header via the ip_hdr ptr.
- * (Yes, this sucks, but that's the way libnet works, and
- * I was too lazy to re-invent the wheel.
- * Returns 0 on sucess, -1 on error
- */
-
-
-/**
- * Returns -1 on error and 0 on success, 1 on warn
- */
-int
-do_checksum_liveplay(u_int8_t *data, int proto, int len) {
-    ipv4_hdr *ipv4;
-    tcp_hdr *tcp;
-    int ip_hl;
-    int sum;
-    
-    sum = 0;
-    ipv4 = NULL;
-        
-    ipv4 = (ipv4_hdr *)data;
-    ip_hl = ipv4->ip_hl << 2;
-
-    switch (proto) {
-        case IPPROTO_TCP:
-            tcp = (tcp_hdr *)(data + ip_hl);
+    /*Calculate TCP Checksum, both IPs of the pseudo header at once*/
+    tcphdr = (tcp_hdr *)((u_char *)iphdr + ip_hl);
 #ifdef STUPID_SOLARIS_CHECKSUM_BUG
-            tcp->th_sum = tcp->th_off << 2;
-            return (TCPEDIT_OK);
+    tcphdr->th_sum = tcphdr->th_off << 2;
+#else
+    tcphdr->th_sum = 0;
+    sum = do_checksum_math((u_int16_t *)&iphdr->ip_src, 8);
+    sum += ntohs(IPPROTO_TCP + len);
+    sum += do_checksum_math((u_int16_t *)tcphdr, len);
+    tcphdr->th_sum = CHECKSUM_CARRY(sum);
 #endif
-            tcp->th_sum = 0;
-            
-            /* Note, we do both src & dst IP's at the same time, that's why the
-             * length is 2x a single IP
-             */
-
-            sum = do_checksum_math_liveplay((u_int16_t *)&ipv4->ip_src, 8);
-            
-            sum += ntohs(IPPROTO_TCP + len);
-            sum += do_checksum_math_liveplay((u_int16_t *)tcp, len);
-            tcp->th_sum = CHECKSUM_CARRY(sum);
-            break;      
-    
-        case IPPROTO_IP:
-            ipv4->ip_sum = 0;
-            sum = do_checksum_math_liveplay((u_int16_t *)data, ip_hl);
-            ipv4->ip_sum = CHECKSUM_CARRY(sum);
-            break;
-       
 
-        default:
-            printf("Unsupported protocol for checksum:\n");
-            return TCPEDIT_WARN;
-    }
-    
-    return TCPEDIT_OK;
+    /*Calculate IP Checksum*/
+    iphdr->ip_sum = 0;
+    sum = do_checksum_math((u_int16_t *)iphdr, ip_hl);
+    iphdr->ip_sum = CHECKSUM_CARRY(sum);
+
+return 0; 
 }
 
 /**
- * code to do a ones-compliment checksum
+ * This function sets a TCP header field of len bytes (an even number)
+ * and updates the TCP checksum for the change incrementally, see RFC 1624
+ * eqn. 3:  HC' = ~(~HC + ~m + m'), instead of summing the whole packet
  */
-int
-do_checksum_math_liveplay(u_int16_t *data, int len)
+void
+set_tcp_field_liveplay(tcp_hdr *tcphdr, void *field, const void *value, int len)
 {
-    int sum = 0;
-    union {
-        u_int16_t s;
-        u_int8_t b[2];
-    } pad;
-    
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
-    }
-    
-    if (len == 1) {
-        pad.b[0] = *(u_int8_t *)data;
-        pad.b[1] = 0;
-        sum += pad.s;
-    }
-    
-    return (sum);
+    tcphdr->th_sum = do_checksum_adjust(tcphdr->th_sum, field, value, len);
+    memcpy(field, value, len);
 }
-
-
@@ -31,20 +31,15 @@
 #define PROMISC_OFF		0
 #define BUFSIZ_PLUS 		BUFSIZ
 #define ALARM_TIMEOUT		10
+#define LIVEPLAY_TICK_ms	10	/* resolution of the connection timeouts */
+#define TIMER_WHEEL_SLOTS	1024	/* power of 2, more ticks than ALARM_TIMEOUT spans */
+#define LIVEPLAY_RX_BUFFER	(8 * 1024 * 1024)	/* kernel receive ring for remote packets */
+#define MAX_CONNS		16384	/* one local port per connection */
+#define CONN_HASH_SIZE		32768	/* must be a power of 2 larger than MAX_CONNS */
 #define SUCCESS			1 
 #define ERROR			-1
 #define manpage_cmds	        (strcmp(argv[1], "-V")==0) || (strcmp(argv[1], "-v")==0) || (strcmp(argv[1], "-H")==0) || (strcmp(argv[1], "-h")==0)
 
-/***********From tcpedit.h*****/
-#define TCPEDIT_SOFT_ERROR -2
-#define TCPEDIT_ERROR  -1
-#define TCPEDIT_OK      0
-#define TCPEDIT_WARN    1
-
-/************From checksum.h******/
-#define CHECKSUM_CARRY(x) \
-    (x = (x >> 16) + (x & 0xffff), (~(x + (x >> 16)) & 0xffff))
-
 #include <stdbool.h>
 
 
@@ -146,5 +141,96 @@ struct tcp_sched{
     bool local; /* Flag to signify this is a local packet */
 };
 
+#define SCHED_CACHE_MAGIC	0x4c505343	/* "LPSC" */
+#define SCHED_CACHE_VERSION	1
+#define SCHED_CACHE_ALIGN	8	/* every record starts on this boundary */
+
+/*
+ * Header of a schedule cache file.  It is followed by one sched_cache_conn
+ * per connection, then by the packets of every connection in turn, each
+ * one a sched_cache_pkt and the packet data.  Everything is in host byte
+ * order, the file is only meant for the machine that wrote it.
+ */
+struct sched_cache_hdr {
+    u_int32_t magic;
+    u_int32_t version;
+    u_int64_t pcap_size; /* Identity of the pcap file the cache was built from */
+    int64_t pcap_mtime;
+    in_addr myip; /* Addresses the packets were rewritten for */
+    in_addr remoteip;
+    struct mac_addr mymac;
+    struct mac_addr remotemac;
+    u_int32_t num_conns;
+    u_int32_t num_packets;
+    u_int32_t lport; /* Local port the first connection was rewritten for */
+};
+
+struct sched_cache_conn {
+    u_int32_t pkts_scheduled;
+    u_int32_t finack_rindex;
+};
+
+/* The parts of a tcp_sched setup_sched() computes, for one packet */
+struct sched_cache_pkt {
+    u_int32_t exp_rseq;
+    u_int32_t exp_rack;
+    u_int32_t curr_lseq;
+    u_int32_t curr_lack;
+    u_int32_t length_curr_ldata;
+    u_int32_t length_last_ldata;
+    u_int32_t length_curr_rdata;
+    u_int32_t length_last_rdata;
+    int64_t ts_sec;
+    int64_t ts_usec;
+    u_int32_t caplen;
+    u_int32_t len; /* Bytes of packet data following this record */
+    u_int32_t size_ip;
+    u_int32_t size_tcp;
+    u_int32_t size_payload;
+    u_int8_t local;
+    u_int8_t remote;
+    u_int8_t pad[2];
+};
+
+enum conn_state {
+    CONN_ACTIVE,
+    CONN_DONE,
+    CONN_FAILED,
+};
+
+enum conn_error {
+    CONN_ERR_NONE,
+    CONN_ERR_TIMEOUT,   /* remote host stopped answering */
+    CONN_ERR_RESET,     /* remote host sent a RST */
+    CONN_ERR_RESEND,    /* 3 resends of a packet went unanswered */
+    CONN_ERR_SCHED,     /* capture holds no usable handshake */
+};
+
+/* Replay state of one TCP connection from the capture */
+struct tcp_conn {
+    struct tcp_sched *sched; /* This connection's packets, in capture order */
+    unsigned int pkts_scheduled; /* Number of packets in sched */
+    unsigned int sched_alloc; /* Number of entries allocated for sched */
+    unsigned int sched_index; /* Next packet to send or expect */
+    unsigned int acked_index; /* Last packet the remote host ACKed correctly */
+    unsigned int finack_rindex; /* Where the remote FIN-ACK is in sched */
+    unsigned int diff_payload_index; /* Where the payload size was not as expected */
+    bool different_payload; /* Remote payload size did not meet expectations */
+    u_int32_t initial_rseq; /* Remote ISN learned from the SYN-ACK */
+    unsigned int lport; /* Local port this connection is replayed from */
+    bool rseen; /* Have we received a remote packet yet? */
+    u_int8_t rflags; /* TCP flags of the last remote packet */
+    u_int32_t rseq; /* SEQ of the last remote packet, network order */
+    u_int32_t rack; /* ACK of the last remote packet, network order */
+    unsigned int size_payload_prev; /* Payload size of the last remote packet */
+    struct tcp_conn *tw_next; /* Timer wheel slot this connection is in */
+    struct tcp_conn *tw_prev;
+    u_int64_t tw_expire; /* Tick this connection times out at */
+    bool tw_armed; /* Is this connection on the timer wheel? */
+    bool started; /* Has conns_start() sent our SYN yet? */
+    enum conn_state state;
+    enum conn_error error;
+};
+
 
 #endif /* _TCPLIVEPLAY_H_ */
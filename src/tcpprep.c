@@ -42,11 +42,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <arpa/inet.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "tcpprep.h"
 #include "tcpprep_api.h"
 #include "tcpprep_opts.h"
-#include "lib/tree.h"
 #include "tree.h"
 #include "lib/sll.h"
 #ifndef HAVE_STRLCPY
@@ -69,10 +72,49 @@ tcpr_data_tree_t treeroot;
 void print_comment(const char *);
 void print_info(const char *);
 void print_stats(const char *);
+
+/* --regex verdicts by source address, one table per classifying thread */
+typedef struct regex_memo_entry_s {
+    u_char addr[16];
+    uint8_t family;         /* 0 for an empty slot */
+    uint8_t verdict;
+} regex_memo_entry_t;
+
+typedef struct regex_memo_s {
+    regex_memo_entry_t *slots;
+    uint32_t size;          /* a power of 2 */
+    uint32_t cnt;
+} regex_memo_t;
+
+#define REGEX_MEMO_MIN_SLOTS 1024
+
+/* what classify_packet() keeps for the thread calling it */
+typedef struct prep_state_s {
+    regex_memo_t memo;          /* --regex verdicts */
+    tcpr_data_tree_t *tree;     /* first pass of auto mode adds hosts here */
+    u_char rec_type;            /* --single-pass record, PREP_REC_NONE for none */
+    u_char rec_addr[16];
+    pkt_meta_fn_t meta_fn;      /* get_pkt_meta_fn() of the file */
+    const pkt_meta_t *meta;     /* headers of this packet found ahead, or NULL */
+} prep_state_t;
+
 static int check_ipv4_regex(const unsigned long ip);
 static int check_ipv6_regex(const struct tcpr_in6_addr *addr);
+static int check_regex_memo(regex_memo_t *memo, int family, const void *addr);
+static void regex_memo_free(regex_memo_t *memo);
 static COUNTER process_raw_packets(pcap_t * pcap);
+static COUNTER process_records(void);
+static bool classify_packet(const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int dlt,
+        COUNTER packetnum, int *send, tcpr_dir_t *direction, bool *print,
+        prep_state_t *state);
+#ifdef HAVE_LIBPTHREAD
+static bool use_workers(void);
+static COUNTER process_raw_packets_workers(pcap_t *pcap);
+#endif
 static int check_dst_port(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len);
+static bool queue_map_pass(void);
+static u_int8_t prep_queue(const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int dlt,
+        const pkt_meta_t *meta);
 
 
 /*
@@ -102,9 +144,15 @@ main(int argc, char *argv[])
         errx(-1, "Unable to open cache file %s for writing: %s", 
             OPT_ARG(CACHEFILE), strerror(errno));
 
+    /* the cache goes out as it is built, write_cache() finishes it */
+    options->cachedata = open_cache(out_file, options->comment, options->cache_version);
+
+    if (HAVE_OPT(QUEUE_MAP))
+        options->qmap = qmap_open(OPT_ARG(QUEUE_MAP), options->queues);
+
   readpcap:
     /* open the pcap file */
-    if ((options->pcap = pcap_open_offline(OPT_ARG(PCAP), errbuf)) == NULL)
+    if ((options->pcap = tcpr_pcap_open_offline(OPT_ARG(PCAP), errbuf)) == NULL)
         errx(-1, "Error opening file: %s", errbuf);
 
 #ifdef HAVE_PCAP_SNAPSHOT
@@ -114,17 +162,8 @@ main(int argc, char *argv[])
 #endif
 
     /* make sure we support the DLT type */
-    switch(pcap_datalink(options->pcap)) {
-        case DLT_EN10MB:
-        case DLT_LINUX_SLL:
-        case DLT_RAW:
-        case DLT_C_HDLC:
-        case DLT_JUNIPER_ETHER:
-        case DLT_PPP_SERIAL:
-            break; /* do nothing because all is good */
-        default:
-            errx(-1, "Unsupported pcap DLT type: 0x%x", pcap_datalink(options->pcap));
-    }
+    if (! get_pkt_meta_supported(pcap_datalink(options->pcap)))
+        errx(-1, "Unsupported pcap DLT type: 0x%x", pcap_datalink(options->pcap));
 
     /* Can only split based on MAC address for ethernet */
     if ((pcap_datalink(options->pcap) != DLT_EN10MB) &&
@@ -144,7 +183,17 @@ main(int argc, char *argv[])
                          options->bpf.optimize, 0) != 0) {
             errx(-1, "Error compiling BPF filter: %s", pcap_geterr(options->pcap));
         }
-        pcap_setfilter(options->pcap, &options->bpf.program);
+
+        /* run it JIT compiled if we can, rather than in libpcap */
+        tcpr_bpf_jit_close(options->bpf_jit);
+        options->bpf_jit = tcpr_bpf_jit_open(&options->bpf.program);
+#ifdef HAVE_LIBPTHREAD
+        /* --workers run the filter themselves, side by side */
+        if (options->bpf_jit == NULL && !use_workers())
+#else
+        if (options->bpf_jit == NULL)
+#endif
+            pcap_setfilter(options->pcap, &options->bpf.program);
     }
 
     if ((totpackets = process_raw_packets(options->pcap)) == 0) {
@@ -176,25 +225,41 @@ main(int argc, char *argv[])
             tree_calculate(&treeroot);
         }
 
-        if (info)
-            notice("Buliding cache file...\n");
-        /* 
-         * re-process files, but this time generate
-         * cache 
-         */
-        goto readpcap;
+        if (options->single_pass) {
+            if (info)
+                notice("Buliding cache file from the first pass...\n");
+            process_records();
+        } else {
+            if (info)
+                notice("Buliding cache file...\n");
+            /* 
+             * re-process files, but this time generate
+             * cache 
+             */
+            goto readpcap;
+        }
     }
 #ifdef DEBUG
     if (debug && (options->cidrdata != NULL))
         print_cidr(options->cidrdata);
 #endif
 
+    if (info)
+        notice("Memory: %zu bytes host table, %zu bytes cache bitmap\n",
+                tree_bytes(&treeroot), options->cachedata ? options->cachedata->size : 0);
+
     /* write cache data */
     totpackets = write_cache(options->cachedata, out_file, totpackets, 
-        options->comment);
+        options->comment, options->cache_version);
     if (info)
         notice("Done.\nCached " COUNTER_SPEC " packets.\n", totpackets);
 
+    if (options->qmap != NULL) {
+        if (qmap_close(options->qmap) != totpackets)
+            errx(-1, "%s", "Queue map and cache file packet counts differ");
+        options->qmap = NULL;
+    }
+
     /* close cache file */
     close(out_file);
     return 0;
@@ -283,13 +348,14 @@ check_ipv4_regex(const unsigned long ip)
 {
     int eflags = 0;
     u_char src_ip[16];
+    uint32_t ip32 = (uint32_t)ip;
     size_t nmatch = 0;
     regmatch_t *pmatch = NULL;
     tcpprep_opt_t *options = tcpprep->options;
 
+    /* not get_addr2name4(), its buffer is shared between --workers */
     memset(src_ip, '\0', 16);
-    strlcpy((char *)src_ip, (char *)get_addr2name4(ip, RESOLVE),
-            sizeof(src_ip));
+    inet_ntop(AF_INET, &ip32, (char *)src_ip, sizeof(src_ip));
     if (regexec(&options->preg, (char *)src_ip, nmatch, pmatch, eflags) == 0) {
         return 1;
     } else {
@@ -307,8 +373,8 @@ check_ipv6_regex(const struct tcpr_in6_addr *addr)
     regmatch_t *pmatch = NULL;
     tcpprep_opt_t *options = tcpprep->options;
 
-    memset(src_ip, '\0', 16);
-    strlcpy((char *)src_ip, (char *)get_addr2name6(addr, RESOLVE), sizeof(src_ip));
+    memset(src_ip, '\0', sizeof(src_ip));
+    inet_ntop(AF_INET6, addr, (char *)src_ip, sizeof(src_ip));
     if (regexec(&options->preg, (char *)src_ip, nmatch, pmatch, eflags) == 0) {
         return 1;
     } else {
@@ -316,267 +382,893 @@ check_ipv6_regex(const struct tcpr_in6_addr *addr)
     }
 }
 
+static uint32_t
+regex_memo_hash(const u_char *addr, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ addr[i]) * 16777619U;
+
+    return hash;
+}
+
+static void
+regex_memo_grow(regex_memo_t *memo)
+{
+    regex_memo_entry_t *old = memo->slots, *entry;
+    uint32_t old_size = memo->size, i, j;
+
+    memo->size = old_size ? old_size * 2 : REGEX_MEMO_MIN_SLOTS;
+    memo->slots = (regex_memo_entry_t *)safe_malloc(memo->size * sizeof(regex_memo_entry_t));
+
+    for (i = 0; i < old_size; i++) {
+        entry = &old[i];
+        if (entry->family == 0)
+            continue;
+
+        j = regex_memo_hash(entry->addr, entry->family == AF_INET ? 4 : 16) & (memo->size - 1);
+        while (memo->slots[j].family != 0)
+            j = (j + 1) & (memo->size - 1);
+        memo->slots[j] = *entry;
+    }
+
+    safe_free(old);
+}
+
 /**
- * uses libpcap library to parse the packets and build
- * the cache file.
+ * check_ipv4_regex()/check_ipv6_regex() for an address in network
+ * order, running the regex only the first time an address is seen.
+ * Captures have far fewer hosts than packets.
+ */
+static int
+check_regex_memo(regex_memo_t *memo, int family, const void *addr)
+{
+    size_t len = family == AF_INET ? 4 : 16;
+    regex_memo_entry_t *entry;
+    uint32_t ip, i;
+    int verdict;
+
+    /* at most half full keeps the probes short */
+    if ((memo->cnt + 1) * 2 > memo->size)
+        regex_memo_grow(memo);
+
+    i = regex_memo_hash((const u_char *)addr, len) & (memo->size - 1);
+    while ((entry = &memo->slots[i])->family != 0) {
+        if (entry->family == family && memcmp(entry->addr, addr, len) == 0)
+            return entry->verdict;
+        i = (i + 1) & (memo->size - 1);
+    }
+
+    if (family == AF_INET) {
+        memcpy(&ip, addr, sizeof(ip));
+        verdict = check_ipv4_regex(ip);
+    } else {
+        verdict = check_ipv6_regex((const struct tcpr_in6_addr *)addr);
+    }
+
+    memcpy(entry->addr, addr, len);
+    entry->family = family;
+    entry->verdict = verdict;
+    memo->cnt++;
+
+    return verdict;
+}
+
+static void
+regex_memo_free(regex_memo_t *memo)
+{
+    if (memo->slots != NULL)
+        dbgx(1, "--regex ran on %u distinct addresses", memo->cnt);
+
+    safe_free(memo->slots);
+    memo->size = memo->cnt = 0;
+}
+
+/*
+ * --single-pass: instead of reading the capture a second time, the
+ * first pass of auto mode records what the second pass needs to know
+ * about each packet: whether it was dropped by --include/--exclude,
+ * isn't IP, or else its source address.  Records are kept in memory
+ * and spilled to a temporary file past PREP_REC_BUFSIZE.
+ */
+#define PREP_REC_NOSEND     0       /* dropped by --include/--exclude */
+#define PREP_REC_NONIP      1
+#define PREP_REC_IPV4       2       /* followed by the IPv4 source */
+#define PREP_REC_IPV6       3       /* followed by the IPv6 source */
+#define PREP_REC_NONE       0xff    /* prep_state_t: no record */
+#define PREP_REC_BUFSIZE    (64 * 1024 * 1024)
+
+#define PREP_REC_ADDRLEN(type) \
+    ((type) == PREP_REC_IPV4 ? 4 : (type) == PREP_REC_IPV6 ? 16 : 0)
+
+static struct {
+    u_char *buf;
+    size_t len;
+    FILE *spill;
+} prep_records;
+
+/**
+ * appends a record of a first pass packet
+ */
+static void
+prep_record(u_char type, const u_char *addr)
+{
+    size_t addrlen = PREP_REC_ADDRLEN(type);
+
+    if (prep_records.buf == NULL)
+        prep_records.buf = (u_char *)safe_malloc(PREP_REC_BUFSIZE);
+
+    if (prep_records.len + 1 + addrlen > PREP_REC_BUFSIZE) {
+        if (prep_records.spill == NULL && (prep_records.spill = tmpfile()) == NULL)
+            errx(-1, "Unable to create temporary file for --single-pass: %s", strerror(errno));
+
+        if (fwrite(prep_records.buf, prep_records.len, 1, prep_records.spill) != 1)
+            errx(-1, "Unable to write temporary file for --single-pass: %s", strerror(errno));
+
+        prep_records.len = 0;
+    }
+
+    prep_records.buf[prep_records.len++] = type;
+    if (addrlen > 0) {
+        memcpy(prep_records.buf + prep_records.len, addr, addrlen);
+        prep_records.len += addrlen;
+    }
+}
+
+/**
+ * Notes the record of the packet being classified.  The caller appends
+ * it, in packet order, once the packet is done.
+ */
+static void
+prep_note(prep_state_t *state, u_char type, const u_char *addr)
+{
+    state->rec_type = type;
+    if (addr != NULL)
+        memcpy(state->rec_addr, addr, PREP_REC_ADDRLEN(type));
+}
+
+/**
+ * the second pass of auto mode for one record
+ */
+static void
+prep_record_cache(u_char type, const u_char *addr)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+    struct tcpr_in6_addr ip6;
+    uint32_t ip;
+    int unknown;
+
+    /* what the mode makes of hosts the tree doesn't know */
+    switch (options->mode) {
+    case ROUTER_MODE:
+        unknown = options->nonip;
+        break;
+    case SERVER_MODE:
+        unknown = DIR_SERVER;
+        break;
+    case CLIENT_MODE:
+        unknown = DIR_CLIENT;
+        break;
+    default:
+        unknown = DIR_UNKNOWN;
+        break;
+    }
+
+    switch (type) {
+    case PREP_REC_NOSEND:
+        add_cache(&options->cachedata, DONT_SEND, 0);
+        break;
+    case PREP_REC_NONIP:
+        add_cache(&options->cachedata, SEND, options->nonip);
+        break;
+    case PREP_REC_IPV4:
+        memcpy(&ip, addr, sizeof(ip));
+        add_cache(&options->cachedata, SEND, check_ip_tree(unknown, ip));
+        break;
+    case PREP_REC_IPV6:
+        memcpy(&ip6, addr, sizeof(ip6));
+        add_cache(&options->cachedata, SEND, check_ip6_tree(unknown, &ip6));
+        break;
+    default:
+        errx(-1, "Invalid --single-pass record type: %u", type);
+    }
+}
+
+/**
+ * Builds the cache from the first pass records, in place of reading the
+ * capture again.  Returns the number of packets.
  */
 static COUNTER
-process_raw_packets(pcap_t * pcap)
+process_records(void)
+{
+    u_char addr[16];
+    size_t pos = 0;
+    COUNTER packetnum = 0;
+    int type;
+
+    if (prep_records.spill != NULL) {
+        rewind(prep_records.spill);
+
+        while ((type = getc(prep_records.spill)) != EOF) {
+            if (type == PREP_REC_IPV4 || type == PREP_REC_IPV6) {
+                if (fread(addr, type == PREP_REC_IPV4 ? 4 : 16, 1, prep_records.spill) != 1)
+                    errx(-1, "%s", "Truncated --single-pass temporary file");
+            }
+
+            prep_record_cache(type, addr);
+            packetnum++;
+        }
+
+        fclose(prep_records.spill);
+        prep_records.spill = NULL;
+    }
+
+    while (pos < prep_records.len) {
+        type = prep_records.buf[pos++];
+        prep_record_cache(type, prep_records.buf + pos);
+        if (type == PREP_REC_IPV4)
+            pos += 4;
+        else if (type == PREP_REC_IPV6)
+            pos += 16;
+        packetnum++;
+    }
+
+    safe_free(prep_records.buf);
+    prep_records.buf = NULL;
+    prep_records.len = 0;
+
+    return packetnum;
+}
+
+/**
+ * --include/--exclude dropped the packet.  The first pass of auto mode
+ * leaves it to the second pass, which caches every packet.
+ */
+static bool
+classify_dont_send(int *send, tcpr_dir_t *direction, prep_state_t *state)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    *send = DONT_SEND;
+    *direction = 0;
+
+    if (options->mode != AUTO_MODE)
+        return true;
+
+    if (options->single_pass)
+        prep_note(state, PREP_REC_NOSEND, NULL);
+    return false;
+}
+
+/**
+ * Works out how the cache file treats one packet.  Returns true if
+ * the packet belongs in the cache with the given send and direction;
+ * print is set for packets that --verbose prints.  Everything it
+ * changes, the --regex memo, the first pass hosts and the --single-pass
+ * record, is in the calling thread's state, so this can run on any
+ * number of threads.
+ */
+static bool
+classify_packet(const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int dlt,
+        COUNTER packetnum, int *send, tcpr_dir_t *direction, bool *print,
+        prep_state_t *state)
 {
     ipv4_hdr_t *ip_hdr = NULL;
     ipv6_hdr_t *ip6_hdr = NULL;
     eth_hdr_t *eth_hdr = NULL;
-    struct pcap_pkthdr pkthdr;
-    const u_char *pktdata = NULL;
-    COUNTER packetnum = 0;
-    int l2len, cache_result = 0;
-    u_char ipbuff[MAXPACKET], *buffptr;
-    tcpr_dir_t direction = TCPR_DIR_ERROR;
+    pkt_meta_t meta;
+    int l2len = 0;
     tcpprep_opt_t *options = tcpprep->options;
 
-#ifdef ENABLE_VERBOSE
-    struct pollfd poller[1];
-    
-    poller[0].fd = tcpprep->tcpdump.outfd;
-    poller[0].events = POLLIN;
-    poller[0].revents = 0;
-#endif
-    
-    assert(pcap);
-    
-    while ((pktdata = pcap_next(pcap, &pkthdr)) != NULL) {
-        packetnum++;
+    dbgx(1, "Packet " COUNTER_SPEC, packetnum);
+    state->rec_type = PREP_REC_NONE;
 
-        dbgx(1, "Packet " COUNTER_SPEC, packetnum);
+    *send = SEND;
+    *direction = TCPR_DIR_ERROR;
+    *print = false;
 
-        /* look for include or exclude LIST match */
-        if (options->xX.list != NULL) {
-            if (options->xX.mode < xXExclude) {
-                if (!check_list(options->xX.list, packetnum)) {
-                    add_cache(&(options->cachedata), DONT_SEND, 0);
-                    continue;
-                }
-            }
-            else if (check_list(options->xX.list, packetnum)) {
-                add_cache(&(options->cachedata), DONT_SEND, 0);
-                continue;
-            }
+    /* look for include or exclude LIST match */
+    if (options->xX.list != NULL) {
+        if (options->xX.mode < xXExclude) {
+            if (!check_list(options->xX.list, packetnum))
+                return classify_dont_send(send, direction, state);
+        }
+        else if (check_list(options->xX.list, packetnum)) {
+            return classify_dont_send(send, direction, state);
         }
+    }
 
-        /*
-         * If the packet doesn't include an IPv4 header we should just treat
-         * it as a non-IP packet, UNLESS we're in MAC mode, in which case
-         * we should let the MAC matcher below handle it
-         */
+    /*
+     * If the packet doesn't include an IPv4 header we should just treat
+     * it as a non-IP packet, UNLESS we're in MAC mode, in which case
+     * we should let the MAC matcher below handle it
+     */
 
-        eth_hdr = (eth_hdr_t *)pktdata;
+    eth_hdr = (eth_hdr_t *)pktdata;
 
-        if (options->mode != MAC_MODE) {
-            dbg(3, "Looking for IPv4/v6 header in non-MAC mode");
-            
-            /* get the IP header (if any) */
-            buffptr = ipbuff;
-    
-            /* first look for IPv4 */
-            if ((ip_hdr = (ipv4_hdr_t *)get_ipv4(pktdata, pkthdr.caplen, 
-                    pcap_datalink(pcap), &buffptr))) {
-                dbg(2, "Packet is IPv4");
-                    
-            } 
-            
-            /* then look for IPv6 */
-            else if ((ip6_hdr = (ipv6_hdr_t *)get_ipv6(pktdata, pkthdr.caplen,
-                    pcap_datalink(pcap), &buffptr))) {
-                dbg(2, "Packet is IPv6");    
-            } 
-            
-            /* we're something else... */
-            else {
-                dbg(2, "Packet isn't IPv4/v6");
-
-                /* we don't want to cache these packets twice */
-                if (options->mode != AUTO_MODE) {
-                    dbg(3, "Adding to cache using options for Non-IP packets");
-                    add_cache(&options->cachedata, SEND, options->nonip);
-                }
-
-                /* go to next packet */
-                continue;
-            }
-    
-            l2len = get_l2len(pktdata, pkthdr.caplen, pcap_datalink(pcap));
-
-            /* look for include or exclude CIDR match */
-            if (options->xX.cidr != NULL) {
-                if (ip_hdr) {
-                    if (!process_xX_by_cidr_ipv4(options->xX.mode, options->xX.cidr, ip_hdr)) {
-                        add_cache(&options->cachedata, DONT_SEND, 0);
-                        continue;
-                    }
-                } else if (ip6_hdr) {
-                    if (!process_xX_by_cidr_ipv6(options->xX.mode, options->xX.cidr, ip6_hdr)) {
-                        add_cache(&options->cachedata, DONT_SEND, 0);
-                        continue;
-                    }
-                }
+    if (options->mode != MAC_MODE) {
+        dbg(3, "Looking for IPv4/v6 header in non-MAC mode");
+        
+        /* one walk finds the L2 length and the IP header (if any) */
+        if (state->meta != NULL)
+            meta = *state->meta;
+        else if (state->meta_fn(pktdata, pkthdr->caplen, &meta) < 0)
+            errx(-1, "Unable to process unsupported DLT type: %s (0x%x)",
+                 pcap_datalink_val_to_description(dlt), dlt);
+
+        l2len = meta.l2len;
+
+        /* first look for IPv4 */
+        if (meta.ether_type == ETHERTYPE_IP && l2len + TCPR_IPV4_H <= (int)pkthdr->caplen) {
+            ip_hdr = (ipv4_hdr_t *)(pktdata + l2len);
+            dbg(2, "Packet is IPv4");
+                
+        } 
+        
+        /* then look for IPv6 */
+        else if (meta.ether_type == ETHERTYPE_IP6 && l2len + TCPR_IPV6_H <= (int)pkthdr->caplen) {
+            ip6_hdr = (ipv6_hdr_t *)(pktdata + l2len);
+            dbg(2, "Packet is IPv6");    
+        } 
+        
+        /* we're something else... */
+        else {
+            dbg(2, "Packet isn't IPv4/v6");
+
+            /* we don't want to cache these packets twice */
+            if (options->mode != AUTO_MODE) {
+                dbg(3, "Adding to cache using options for Non-IP packets");
+                *direction = options->nonip;
+                return true;
             }
+
+            /* go to next packet */
+            if (options->single_pass)
+                prep_note(state, PREP_REC_NONIP, NULL);
+            return false;
         }
 
-        switch (options->mode) {
-        case REGEX_MODE:
-            dbg(2, "processing regex mode...");
+        /* look for include or exclude CIDR match */
+        if (options->xX.cidr != NULL) {
             if (ip_hdr) {
-                direction = check_ipv4_regex(ip_hdr->ip_src.s_addr);
+                if (!process_xX_by_cidr_ipv4(options->xX.mode, options->xX.cidr, ip_hdr))
+                    return classify_dont_send(send, direction, state);
             } else if (ip6_hdr) {
-                direction = check_ipv6_regex(&ip6_hdr->ip_src);
+                if (!process_xX_by_cidr_ipv6(options->xX.mode, options->xX.cidr, ip6_hdr))
+                    return classify_dont_send(send, direction, state);
             }
+        }
+    }
 
-            /* reverse direction? */
-            if (HAVE_OPT(REVERSE) && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
-                direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
+    *print = true;
 
-            cache_result = add_cache(&options->cachedata, SEND, direction); 
-            break;
+    switch (options->mode) {
+    case REGEX_MODE:
+        dbg(2, "processing regex mode...");
+        if (ip_hdr) {
+            *direction = check_regex_memo(&state->memo, AF_INET, &ip_hdr->ip_src.s_addr);
+        } else if (ip6_hdr) {
+            *direction = check_regex_memo(&state->memo, AF_INET6, &ip6_hdr->ip_src);
+        }
 
-        case CIDR_MODE:
-            dbg(2, "processing cidr mode...");
-            if (ip_hdr) {
-                direction = check_ip_cidr(options->cidrdata, ip_hdr->ip_src.s_addr) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
-            } else if (ip6_hdr) {
-                direction = check_ip6_cidr(options->cidrdata, &ip6_hdr->ip_src) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
-            }
+        /* reverse direction? */
+        if (HAVE_OPT(REVERSE) && (*direction == TCPR_DIR_C2S || *direction == TCPR_DIR_S2C))
+            *direction = *direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
 
-            /* reverse direction? */
-            if (HAVE_OPT(REVERSE) && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
-                direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
+        return true;
 
-            cache_result = add_cache(&options->cachedata, SEND, direction);
-            break;
+    case CIDR_MODE:
+        dbg(2, "processing cidr mode...");
+        if (ip_hdr) {
+            *direction = check_ip_cidr(options->cidrdata, ip_hdr->ip_src.s_addr) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
+        } else if (ip6_hdr) {
+            *direction = check_ip6_cidr(options->cidrdata, &ip6_hdr->ip_src) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
+        }
 
-        case MAC_MODE:
-            dbg(2, "processing mac mode...");
-            direction = macinstring(options->maclist, (u_char *)eth_hdr->ether_shost);
+        /* reverse direction? */
+        if (HAVE_OPT(REVERSE) && (*direction == TCPR_DIR_C2S || *direction == TCPR_DIR_S2C))
+            *direction = *direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
 
-            /* reverse direction? */
-            if (HAVE_OPT(REVERSE) && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
-                direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
+        return true;
 
-            cache_result = add_cache(&options->cachedata, SEND, direction);
-            break;
+    case MAC_MODE:
+        dbg(2, "processing mac mode...");
+        *direction = macinstring(options->maclist, (u_char *)eth_hdr->ether_shost);
 
-        case AUTO_MODE:
-            dbg(2, "processing first pass of auto mode...");
-            /* first run through in auto mode: create tree */
-            if (options->automode != FIRST_MODE) {
-                if (ip_hdr) {
-                    add_tree_ipv4(ip_hdr->ip_src.s_addr, pktdata);
-                } else if (ip6_hdr) {
-                    add_tree_ipv6(&ip6_hdr->ip_src, pktdata);
-                }
-            } else {
-                if (ip_hdr) {
-                    add_tree_first_ipv4(pktdata);
-                } else if (ip6_hdr) {
-                    add_tree_first_ipv6(pktdata);
-                }
-            }  
-            break;
+        /* reverse direction? */
+        if (HAVE_OPT(REVERSE) && (*direction == TCPR_DIR_C2S || *direction == TCPR_DIR_S2C))
+            *direction = *direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
 
-        case ROUTER_MODE:
-            /* 
-             * second run through in auto mode: create route
-             * based cache
-             */
-            dbg(2, "processing second pass of auto: router mode...");
-            if (ip_hdr) {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip_tree(options->nonip, ip_hdr->ip_src.s_addr));
-            } else {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip6_tree(options->nonip, &ip6_hdr->ip_src));
-            }
-            break;
+        return true;
 
-        case BRIDGE_MODE:
-            /*
-             * second run through in auto mode: create bridge
-             * based cache
-             */
-            dbg(2, "processing second pass of auto: bridge mode...");
+    case AUTO_MODE:
+        dbg(2, "processing first pass of auto mode...");
+        /* first run through in auto mode: create tree */
+        if (options->automode != FIRST_MODE) {
             if (ip_hdr) {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr));
-            } else {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src));
+                add_tree_ipv4(state->tree, ip_hdr->ip_src.s_addr, pktdata);
+            } else if (ip6_hdr) {
+                add_tree_ipv6(state->tree, &ip6_hdr->ip_src, pktdata);
             }
-            break;
-
-        case SERVER_MODE:
-            /* 
-             * second run through in auto mode: create bridge
-             * where unknowns are servers
-             */
-            dbg(2, "processing second pass of auto: server mode...");
+        } else {
             if (ip_hdr) {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip_tree(DIR_SERVER, ip_hdr->ip_src.s_addr));
-            } else {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip6_tree(DIR_SERVER, &ip6_hdr->ip_src));
+                add_tree_first_ipv4(state->tree, pktdata);
+            } else if (ip6_hdr) {
+                add_tree_first_ipv6(state->tree, pktdata);
             }
-            break;
+        }  
+
+        /* the source is all the second pass needs to know */
+        if (options->single_pass) {
+            if (ip_hdr)
+                prep_note(state, PREP_REC_IPV4, (u_char *)&ip_hdr->ip_src.s_addr);
+            else if (ip6_hdr)
+                prep_note(state, PREP_REC_IPV6, (u_char *)&ip6_hdr->ip_src);
+        }
+        return false;
 
-        case CLIENT_MODE:
-            /* 
-             * second run through in auto mode: create bridge
-             * where unknowns are clients
-             */
-            dbg(2, "processing second pass of auto: client mode...");
-            if (ip_hdr) {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip_tree(DIR_CLIENT, ip_hdr->ip_src.s_addr));
-            } else {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip6_tree(DIR_CLIENT, &ip6_hdr->ip_src));
-            }
+    case ROUTER_MODE:
+        /* 
+         * second run through in auto mode: create route
+         * based cache
+         */
+        dbg(2, "processing second pass of auto: router mode...");
+        if (ip_hdr) {
+            *direction = check_ip_tree(options->nonip, ip_hdr->ip_src.s_addr);
+        } else {
+            *direction = check_ip6_tree(options->nonip, &ip6_hdr->ip_src);
+        }
+        return true;
+
+    case BRIDGE_MODE:
+        /*
+         * second run through in auto mode: create bridge
+         * based cache
+         */
+        dbg(2, "processing second pass of auto: bridge mode...");
+        if (ip_hdr) {
+            *direction = check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr);
+        } else {
+            *direction = check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src);
+        }
+        return true;
+
+    case SERVER_MODE:
+        /* 
+         * second run through in auto mode: create bridge
+         * where unknowns are servers
+         */
+        dbg(2, "processing second pass of auto: server mode...");
+        if (ip_hdr) {
+            *direction = check_ip_tree(DIR_SERVER, ip_hdr->ip_src.s_addr);
+        } else {
+            *direction = check_ip6_tree(DIR_SERVER, &ip6_hdr->ip_src);
+        }
+        return true;
+
+    case CLIENT_MODE:
+        /* 
+         * second run through in auto mode: create bridge
+         * where unknowns are clients
+         */
+        dbg(2, "processing second pass of auto: client mode...");
+        if (ip_hdr) {
+            *direction = check_ip_tree(DIR_CLIENT, ip_hdr->ip_src.s_addr);
+        } else {
+            *direction = check_ip6_tree(DIR_CLIENT, &ip6_hdr->ip_src);
+        }
+        return true;
+
+    case PORT_MODE:
+        /*
+         * process ports based on their destination port
+         */
+        dbg(2, "processing port mode...");
+        *direction = check_dst_port(ip_hdr, ip6_hdr, (pkthdr->caplen - l2len));
+        return true;
+
+    case FIRST_MODE:
+        /*
+         * First packet mode, looks at each host and picks clients
+         * by the ones which send the first packet in a session
+         */
+        dbg(2, "processing second pass of auto: first packet mode...");
+        if (ip_hdr) {
+            *direction = check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr);
+        } else {
+            *direction = check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src);
+        }
+        return true;
+        
+    default:
+        errx(-1, "Whops!  What mode are we in anyways? %d", options->mode);
+    }
+
+    return false;
+}
+
+/**
+ * whether the packets of this pass are the ones the cache is built
+ * from, and so get a --queue-map entry: not the first of two auto mode
+ * passes
+ */
+static bool
+queue_map_pass(void)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    return options->qmap != NULL &&
+            (options->mode != AUTO_MODE || options->single_pass);
+}
+
+/**
+ * the --queue-map entry of a packet
+ */
+static u_int8_t
+prep_queue(const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int dlt,
+        const pkt_meta_t *meta)
+{
+    uint32_t hash;
+
+    /* maps are shared between machines, so the hash can't depend on the CPU */
+    hash = meta ? flow_hash_meta_portable(pktdata, meta) : flow_hash_portable(pkthdr, pktdata, dlt);
+    return (u_int8_t)(hash % tcpprep->options->queues);
+}
+
+/**
+ * uses libpcap library to parse the packets and build
+ * the cache file.
+ */
+static COUNTER
+process_raw_packets(pcap_t * pcap)
+{
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata = NULL;
+    COUNTER packetnum = 0;
+    tcpr_dir_t direction;
+    int send;
+    bool print, qmap = queue_map_pass();
+    prep_state_t state;
+    tcpprep_opt_t *options = tcpprep->options;
+
+    assert(pcap);
+
+#ifdef HAVE_LIBPTHREAD
+    if (use_workers())
+        return process_raw_packets_workers(pcap);
+#endif
+
+    memset(&state, 0, sizeof(state));
+    state.tree = &treeroot;
+    state.meta_fn = get_pkt_meta_fn(pcap_datalink(pcap));
+
+    while ((pktdata = pcap_next(pcap, &pkthdr)) != NULL) {
+        /* as if pcap_setfilter() had dropped it */
+        if (options->bpf_jit != NULL &&
+                tcpr_bpf_jit_filter(options->bpf_jit, pktdata, pkthdr.len, pkthdr.caplen) == 0)
+            continue;
+
+        packetnum++;
+
+        if (classify_packet(&pkthdr, pktdata, pcap_datalink(pcap), packetnum,
+                &send, &direction, &print, &state))
+            add_cache(&options->cachedata, send, direction);
+
+        if (state.rec_type != PREP_REC_NONE)
+            prep_record(state.rec_type, state.rec_addr);
+
+        if (qmap)
+            qmap_add(options->qmap, prep_queue(&pkthdr, pktdata, pcap_datalink(pcap), NULL));
+
+#ifdef ENABLE_VERBOSE
+        if (print && options->verbose)
+            tcpdump_print(&tcpprep->tcpdump, &pkthdr, pktdata);
+#endif
+    }
+
+    regex_memo_free(&state.memo);
+    return packetnum;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * --workers: the main thread reads the capture into chunks of packets,
+ * the workers classify whole chunks, and the main thread adds finished
+ * chunks to the cache in the order they were read, so the cache file
+ * is the same as the one process_raw_packets() writes on its own.
+ *
+ * In the first pass of auto mode each chunk's hosts go into a table of
+ * the chunk's own, merged into treeroot in the same order, so every host
+ * keeps the node of its first packet and the sum of its counts, just as
+ * if the packets had been added one by one.
+ */
+#define PREP_CHUNK_PKTS     1024    /* packets handed to a worker at once */
+#define PREP_CHUNKS         4       /* chunks in flight per worker */
+#define PREP_CHUNK_HOSTS    (PREP_CHUNK_PKTS * 4)   /* slots, up to 2 hosts a packet */
+
+typedef struct prep_pkt_s {
+    struct pcap_pkthdr pkthdr;
+    size_t offset;                  /* in chunk data[] */
+    tcpr_dir_t direction;
+    int send;
+    bool matched;                   /* passed the BPF filter, if any */
+    bool cache;
+    bool print;
+    u_char rec_type;                /* --single-pass record */
+    u_char rec_addr[16];
+    u_int8_t queue;                 /* --queue-map entry */
+} prep_pkt_t;
+
+typedef struct prep_chunk_s {
+    prep_pkt_t pkts[PREP_CHUNK_PKTS];
+    pkt_meta_t meta[PREP_CHUNK_PKTS];   /* headers of pkts[], see prep_worker() */
+    int cnt;
+    COUNTER first;                  /* packet number of pkts[0] */
+    u_char *data;
+    size_t data_len;
+    size_t data_size;
+    tcpr_data_tree_t tree;          /* first pass of auto mode: the chunk's hosts */
+    bool done;
+} prep_chunk_t;
+
+typedef struct prep_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t work;            /* a chunk was filled, or stop */
+    pthread_cond_t done;            /* a chunk was classified */
+    prep_chunk_t *chunks;
+    uint32_t nchunks;
+    uint32_t filled;                /* chunks handed to the workers */
+    uint32_t taken;                 /* chunks a worker has claimed */
+    int dlt;
+    struct bpf_insn *filter;        /* -xF, or NULL */
+    tcpr_bpf_jit_t *jit;            /* filter JIT compiled, or NULL */
+    bool qmap;                      /* work out --queue-map entries */
+    bool stop;
+} prep_pool_t;
+
+/**
+ * whether this pass classifies on --workers threads
+ */
+static bool
+use_workers(void)
+{
+    return tcpprep->options->workers > 1;
+}
+
+/**
+ * reads up to PREP_CHUNK_PKTS packets into the chunk and returns how
+ * many were read
+ */
+static int
+prep_chunk_fill(prep_chunk_t *chunk, pcap_t *pcap, COUNTER *packetnum)
+{
+    const u_char *pktdata;
+    prep_pkt_t *pkt;
+
+    chunk->cnt = 0;
+    chunk->data_len = 0;
+    chunk->first = *packetnum + 1;
+
+    while (chunk->cnt < PREP_CHUNK_PKTS) {
+        pkt = &chunk->pkts[chunk->cnt];
+        if ((pktdata = pcap_next(pcap, &pkt->pkthdr)) == NULL)
             break;
 
-        case PORT_MODE:
-            /*
-             * process ports based on their destination port
-             */
-            dbg(2, "processing port mode...");
-            cache_result = add_cache(&options->cachedata, SEND, 
-                check_dst_port(ip_hdr, ip6_hdr, (pkthdr.caplen - l2len)));
+        (*packetnum)++;
+
+        if (chunk->data_len + pkt->pkthdr.caplen > chunk->data_size) {
+            while (chunk->data_len + pkt->pkthdr.caplen > chunk->data_size)
+                chunk->data_size = chunk->data_size ? chunk->data_size * 2 : PREP_CHUNK_PKTS * 2048;
+            chunk->data = (u_char *)safe_realloc(chunk->data, chunk->data_size);
+        }
+
+        memcpy(chunk->data + chunk->data_len, pktdata, pkt->pkthdr.caplen);
+        pkt->offset = chunk->data_len;
+        chunk->data_len += pkt->pkthdr.caplen;
+        chunk->cnt++;
+    }
+
+    chunk->done = false;
+    return chunk->cnt;
+}
+
+/**
+ * Main loop of a --workers thread: claim the oldest unclaimed chunk,
+ * classify it and hand it back to the main thread
+ */
+static void *
+prep_worker(void *arg)
+{
+    prep_pool_t *pool = (prep_pool_t *)arg;
+    prep_chunk_t *chunk;
+    prep_pkt_t *pkt;
+    prep_state_t state;
+    const u_char *data[PREP_CHUNK_PKTS];
+    int len[PREP_CHUNK_PKTS];
+    bool have_meta;
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    state.meta_fn = get_pkt_meta_fn(pool->dlt);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->taken == pool->filled)
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        if (pool->stop)
             break;
 
-        case FIRST_MODE:
+        chunk = &pool->chunks[pool->taken++ % pool->nchunks];
+        pthread_mutex_unlock(&pool->lock);
+
+        /* walk the headers of the whole chunk in one go */
+        for (i = 0; i < chunk->cnt; i++) {
+            data[i] = chunk->data + chunk->pkts[i].offset;
+            len[i] = chunk->pkts[i].pkthdr.caplen;
+        }
+        have_meta = get_pkt_meta_batch(state.meta_fn, data, len, chunk->meta, chunk->cnt) == 0;
+
+        state.tree = &chunk->tree;
+        for (i = 0; i < chunk->cnt; i++) {
+            pkt = &chunk->pkts[i];
+            state.meta = have_meta ? &chunk->meta[i] : NULL;
+
             /*
-             * First packet mode, looks at each host and picks clients
-             * by the ones which send the first packet in a session
+             * Filtered out packets don't exist as far as the cache is
+             * concerned, just as if pcap_setfilter() had dropped them.
+             * -xF is the only -x/-X, so no packet list needs their
+             * numbers to skip them.
              */
-            dbg(2, "processing second pass of auto: first packet mode...");
-            if (ip_hdr) {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr));
-            } else {
-                cache_result = add_cache(&options->cachedata, SEND,
-                    check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src));
+            if (pool->jit != NULL)
+                pkt->matched = tcpr_bpf_jit_filter(pool->jit, chunk->data + pkt->offset,
+                        pkt->pkthdr.len, pkt->pkthdr.caplen) != 0;
+            else
+                pkt->matched = pool->filter == NULL ||
+                        bpf_filter(pool->filter, chunk->data + pkt->offset,
+                                pkt->pkthdr.len, pkt->pkthdr.caplen) != 0;
+            if (!pkt->matched)
+                continue;
+
+            pkt->cache = classify_packet(&pkt->pkthdr, chunk->data + pkt->offset,
+                    pool->dlt, chunk->first + i, &pkt->send, &pkt->direction, &pkt->print,
+                    &state);
+            pkt->rec_type = state.rec_type;
+            if (state.rec_type != PREP_REC_NONE)
+                memcpy(pkt->rec_addr, state.rec_addr, sizeof(pkt->rec_addr));
+
+            if (pool->qmap)
+                pkt->queue = prep_queue(&pkt->pkthdr, chunk->data + pkt->offset, pool->dlt,
+                        state.meta);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = true;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    regex_memo_free(&state.memo);
+    return NULL;
+}
+
+/**
+ * --workers version of process_raw_packets()
+ */
+static COUNTER
+process_raw_packets_workers(pcap_t *pcap)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+    prep_pool_t pool;
+    pthread_t *workers;
+    prep_chunk_t *chunk;
+    prep_pkt_t *pkt;
+    COUNTER packetnum = 0, matched = 0;
+    uint32_t next_read = 0, next_merge = 0;
+    bool eof = false;
+    int i, rcode;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.nchunks = options->workers * PREP_CHUNKS;
+    pool.chunks = (prep_chunk_t *)safe_malloc(pool.nchunks * sizeof(prep_chunk_t));
+    pool.dlt = pcap_datalink(pcap);
+    if (options->bpf.filter != NULL)
+        pool.filter = options->bpf.program.bf_insns;
+    pool.jit = options->bpf_jit;
+    pool.qmap = queue_map_pass();
+    if (options->mode == AUTO_MODE) {
+        for (i = 0; i < (int)pool.nchunks; i++)
+            tree_init(&pool.chunks[i].tree, PREP_CHUNK_HOSTS);
+    }
+
+    workers = (pthread_t *)safe_malloc(options->workers * sizeof(pthread_t));
+    for (i = 0; i < options->workers; i++) {
+        if ((rcode = pthread_create(&workers[i], NULL, prep_worker, &pool)) != 0)
+            errx(-1, "Unable to start --workers thread: %s", strerror(rcode));
+    }
+
+    for (;;) {
+        /* keep every chunk busy */
+        while (!eof && next_read - next_merge < pool.nchunks) {
+            chunk = &pool.chunks[next_read % pool.nchunks];
+            if (prep_chunk_fill(chunk, pcap, &packetnum) == 0) {
+                eof = true;
+                break;
             }
-            break;
-            
-        default:
-            errx(-1, "Whops!  What mode are we in anyways? %d", options->mode);
+
+            pthread_mutex_lock(&pool.lock);
+            pool.filled = ++next_read;
+            pthread_cond_signal(&pool.work);
+            pthread_mutex_unlock(&pool.lock);
         }
+
+        if (next_merge == next_read)
+            break;
+
+        /* then add the oldest one to the cache */
+        chunk = &pool.chunks[next_merge % pool.nchunks];
+        pthread_mutex_lock(&pool.lock);
+        while (!chunk->done)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        for (i = 0; i < chunk->cnt; i++) {
+            pkt = &chunk->pkts[i];
+            if (!pkt->matched)
+                continue;
+
+            matched++;
+            if (pkt->cache)
+                add_cache(&options->cachedata, pkt->send, pkt->direction);
+
+            if (pkt->rec_type != PREP_REC_NONE)
+                prep_record(pkt->rec_type, pkt->rec_addr);
+
+            if (pool.qmap)
+                qmap_add(options->qmap, pkt->queue);
+
 #ifdef ENABLE_VERBOSE
-        if (options->verbose)
-            tcpdump_print(&tcpprep->tcpdump, &pkthdr, pktdata);
+            if (pkt->print && options->verbose)
+                tcpdump_print(&tcpprep->tcpdump, &pkt->pkthdr, chunk->data + pkt->offset);
 #endif
+        }
+
+        if (options->mode == AUTO_MODE) {
+            tree_merge(&treeroot, &chunk->tree, options->automode != FIRST_MODE);
+            tree_clear(&chunk->tree);
+        }
+        next_merge++;
     }
 
-    return packetnum;
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < options->workers; i++) {
+        if ((rcode = pthread_join(workers[i], NULL)) != 0)
+            errx(-1, "Unable to join --workers thread: %s", strerror(rcode));
+    }
+
+    for (i = 0; i < (int)pool.nchunks; i++) {
+        safe_free(pool.chunks[i].data);
+        tree_free(&pool.chunks[i].tree);
+    }
+    safe_free(pool.chunks);
+    safe_free(workers);
+    pthread_cond_destroy(&pool.done);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+
+    dbgx(1, COUNTER_SPEC " of " COUNTER_SPEC " packets passed the filter", matched, packetnum);
+    return matched;
 }
+#endif /* HAVE_LIBPTHREAD */
 
 
 /**
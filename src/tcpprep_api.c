@@ -57,6 +57,8 @@ tcpprep_init()
     ctx->options = safe_malloc(sizeof(tcpprep_opt_t));
 
     ctx->options->bpf.optimize = BPF_OPTIMIZE;
+    ctx->options->workers = 1;
+    ctx->options->cache_version = 4;
 
     for (i = DEFAULT_LOW_SERVER_PORT; i <= DEFAULT_HIGH_SERVER_PORT; i++) {
         ctx->options->services.tcp[i] = 1;
@@ -72,7 +74,6 @@ tcpprep_init()
 void
 tcpprep_close(tcpprep_t *ctx)
 {
-    tcpr_cache_t *cache, *cache_nxt;
     tcpr_cidr_t *cidr, *cidr_nxt;
     tcpprep_opt_t *options;
 
@@ -88,12 +89,8 @@ tcpprep_close(tcpprep_t *ctx)
     safe_free(options->comment);
     safe_free(options->maclist);
 
-    cache = options->cachedata;
-    while (cache != NULL) {
-        cache_nxt = cache->next;
-        safe_free(cache);
-        cache = cache_nxt;
-    }
+    free_cache(options->cachedata);
+    tcpr_bpf_jit_close(options->bpf_jit);
 
     cidr = options->cidrdata;
     while (cidr != NULL) {
@@ -391,6 +388,26 @@ tcpprep_post_args(tcpprep_t *ctx, int argc, char *argv[])
         debug = OPT_VALUE_DBUG;
 #endif
 
+    /* STDIN can't be read twice */
+    if (HAVE_OPT(SINGLE_PASS) ||
+            (ctx->options->mode == AUTO_MODE && HAVE_OPT(PCAP) && strcmp(OPT_ARG(PCAP), "-") == 0))
+        ctx->options->single_pass = true;
+
+    if (HAVE_OPT(CACHE_VERSION))
+        ctx->options->cache_version = OPT_VALUE_CACHE_VERSION;
+
+    if (HAVE_OPT(QUEUES))
+        ctx->options->queues = OPT_VALUE_QUEUES;
+
+    if (HAVE_OPT(WORKERS)) {
+#ifdef HAVE_LIBPTHREAD
+        ctx->options->workers = OPT_VALUE_WORKERS;
+#else
+        if (OPT_VALUE_WORKERS > 1)
+            err(-1, "--workers requires tcpprep to be built with pthread support");
+#endif
+    }
+
 #ifdef ENABLE_VERBOSE
     if (HAVE_OPT(VERBOSE)) {
         ctx->options->verbose = 1;
@@ -398,6 +415,10 @@ tcpprep_post_args(tcpprep_t *ctx, int argc, char *argv[])
 
     if (HAVE_OPT(DECODE))
         ctx->tcpdump.args = safe_strdup(OPT_ARG(DECODE));
+
+    /* the cache is written from the pass records, without the packets to decode */
+    if (ctx->options->verbose && ctx->options->single_pass)
+        err(-1, "--verbose can't be used with --single-pass or an auto mode pcap read from STDIN");
 #endif
 
 
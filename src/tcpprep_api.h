@@ -24,6 +24,8 @@
 #include "config.h"
 #include "defines.h"
 #include "tcpreplay_api.h"
+#include "common/queue_map.h"
+#include "common/bpf_jit.h"
 
 #include <regex.h>
 
@@ -50,6 +52,7 @@ typedef struct tcpprep_opt_s {
     char *maclist;
     tcpr_xX_t xX;
     tcpr_bpf_t bpf;
+    tcpr_bpf_jit_t *bpf_jit;    /* bpf translated for uBPF's JIT, or NULL */
     tcpr_services_t services;
     char *comment; /* cache file comment */
     bool nocomment; /* don't include the cli in the comment */
@@ -60,6 +63,11 @@ typedef struct tcpprep_opt_s {
     double ratio;
     regex_t preg;
     bool nonip;
+    int workers;    /* threads classifying packets */
+    bool single_pass;   /* auto mode reads the pcap once */
+    int cache_version;  /* cache file format to write */
+    int queues;         /* --queue-map: queues to spread the flows over */
+    tcpr_qmap_t *qmap;  /* --queue-map being written, or NULL */
 } tcpprep_opt_t;
 
 typedef struct tcpprep_s {
@@ -60,6 +60,17 @@
 
 #include "config.h"
 
+/*
+ * On strictly aligned systems the L3 and L4 headers tcpedit edits in place
+ * are packed: they start wherever the L2 header leaves them (14 bytes in for
+ * Ethernet), and packing makes the compiler access their fields safely
+ */
+#ifdef FORCE_ALIGN
+#define TCPR_UNALIGNED __attribute__((__packed__))
+#else
+#define TCPR_UNALIGNED
+#endif
+
 #define ETHER_ADDR_LEN 0x6
 #define FDDI_ADDR_LEN 0x6
 #define TOKEN_RING_ADDR_LEN 0x6
@@ -70,6 +81,7 @@
  * Libnet defines header sizes for every builder function exported.
  */
 #define TCPR_802_1Q_H         0x12    /**< 802.1Q header:       18 bytes */
+#define TCPR_802_1AD_H        0x16    /**< 802.1ad QinQ header: 22 bytes */
 #define TCPR_802_1X_H         0x04    /**< 802.1X header:        4 bytes */
 #define TCPR_802_2_H          0x03    /**< 802.2 LLC header:     3 bytes */
 #define TCPR_802_2SNAP_H      0x08    /**< 802.2 LLC/SNAP header:8 bytes */
@@ -246,7 +258,7 @@ struct tcpr_arp_hdr
 #define ARPOP_INVREQUEST 8  /* req to identify peer */
 #define ARPOP_INVREPLY   9  /* resp identifying peer */
     /* address information allocated dynamically */
-};
+} TCPR_UNALIGNED;
 
 /*
  * BGP4 header
@@ -548,6 +560,9 @@ struct tcpr_ethernet_hdr
 #ifndef ETHERTYPE_VLAN
 #define ETHERTYPE_VLAN          0x8100  /* IEEE 802.1Q VLAN tagging */
 #endif
+#ifndef ETHERTYPE_QINQ
+#define ETHERTYPE_QINQ          0x88a8  /* IEEE 802.1ad service VLAN tagging */
+#endif
 #ifndef ETHERTYPE_EAP
 #define ETHERTYPE_EAP           0x888e  /* IEEE 802.1X EAP authentication */
 #endif
@@ -738,7 +753,7 @@ struct tcpr_ipv4_hdr
     uint8_t ip_p;            /* protocol */
     uint16_t ip_sum;         /* checksum */
     struct in_addr ip_src, ip_dst; /* source and dest address */
-};
+} TCPR_UNALIGNED;
 
 /*
  *  IP options
@@ -776,7 +791,7 @@ struct tcpr_in6_addr
         u_int16_t  __u6_addr16[8];
         u_int32_t  __u6_addr32[4];
     } __u6_addr;            /* 128-bit IP6 address */
-};
+} TCPR_UNALIGNED;
 #define tcpr_s6_addr __u6_addr.__u6_addr8
 #define tcpr_s6_addr8 __u6_addr.__u6_addr8
 #define tcpr_s6_addr16 __u6_addr.__u6_addr16
@@ -794,14 +809,14 @@ struct tcpr_ipv6_hdr
     uint8_t ip_nh;           /* next header */
     uint8_t ip_hl;           /* hop limit */
     struct tcpr_in6_addr ip_src, ip_dst; /* source and dest address */
-};
+} TCPR_UNALIGNED;
 
 struct tcpr_ipv6_ext_hdr_base
 {
     uint8_t ip_nh;          /* next header */
     uint8_t ip_len;         /* length of header in 8 octet units (sans 1st) */
     /* some more bytes are always here, but we don't know what kind */
-};
+} TCPR_UNALIGNED;
 
 #define TCPR_IPV6_NH_NO_NEXT 59
 #define TCPR_IPV6_NH_IPV6    41
@@ -896,7 +911,7 @@ struct tcpr_icmpv6_hdr
     uint16_t icmp_sum;       /* ICMP Checksum */
     uint16_t id;             /* ICMP id */
     uint16_t seq;            /* ICMP sequence number */
-};
+} TCPR_UNALIGNED;
 
 
 
@@ -1074,7 +1089,7 @@ struct tcpr_icmpv4_hdr
 #undef icmp_ttime
 #define icmp_ttime   dun.ts.its_ttime
     }dun;
-};
+} TCPR_UNALIGNED;
 
 
 /*
@@ -1625,7 +1640,7 @@ struct tcpr_tcp_hdr
     uint16_t th_win;         /* window */
     uint16_t th_sum;         /* checksum */
     uint16_t th_urp;         /* urgent pointer */
-};
+} TCPR_UNALIGNED;
 
 
 /*
@@ -1665,7 +1680,7 @@ struct tcpr_udp_hdr
     uint16_t uh_dport;       /* destination port */
     uint16_t uh_ulen;        /* length */
     uint16_t uh_sum;         /* checksum */
-};
+} TCPR_UNALIGNED;
 
 /*
  *  Sebek header
@@ -24,12 +24,20 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <time.h>
 
 #include "tcpreplay.h"
 #include "tcpreplay_api.h"
@@ -53,6 +61,10 @@ int debug = 0;
 tcpreplay_t *ctx;
 
 void flow_stats(const tcpreplay_t *ctx, bool unique_ip);
+static void memory_stats(const tcpreplay_t *ctx);
+static void source_stats(const tcpreplay_t *ctx);
+static void control_serve(tcpreplay_t *ctx, const char *path);
+static void search_run(tcpreplay_t *ctx);
 
 int
 main(int argc, char *argv[])
@@ -95,12 +107,17 @@ main(int argc, char *argv[])
         errx(-1, "Unable to edit packets given options:\n%s",
                tcpedit_geterr(tcpedit));
     }
+
+    tcpreplay_set_tcpedit(ctx, tcpedit);
 #endif
 
     if (ctx->options->preload_pcap && ! HAVE_OPT(QUIET)) {
         notice("File Cache is enabled");
     }
 
+    /* --control jobs may replay a partition, which needs every flow hash */
+    ctx->options->control = HAVE_OPT(CONTROL);
+
     /*
      * Setup up the file cache, if required
      */
@@ -110,21 +127,51 @@ main(int argc, char *argv[])
             ctx->options->file_cache[i].index = i;
             ctx->options->file_cache[i].cached = FALSE;
             ctx->options->file_cache[i].packet_cache = NULL;
+            ctx->options->file_cache[i].packet_cnt = 0;
+            ctx->options->file_cache[i].arena = NULL;
         }
     }
 
     for (i = 0; i < argc; i++) {
-        tcpreplay_add_pcapfile(ctx, argv[i]);
-
-        /* preload our pcap file? */
-        if (ctx->options->preload_pcap) {
-            preload_pcap_file(ctx, i);
-        }
+        if (tcpreplay_add_pcapfile(ctx, argv[i]) < 0)
+            errx(-1, "%s", tcpreplay_geterr(ctx));
     }
 
+    /* preload our pcap files? */
+    if (ctx->options->preload_pcap)
+        preload_pcap_files(ctx, argc);
+
     /* init the signal handlers */
     init_signal_handlers();
 
+    /* --plan: report whether the speed is feasible and stop */
+    if (HAVE_OPT(PLAN)) {
+        rcode = tcpr_replay_plan(ctx);
+        if (rcode < 0)
+            errx(-1, "Unable to plan the replay: %s", tcpreplay_geterr(ctx));
+
+        tcpreplay_close(ctx);
+        return rcode;
+    }
+
+    /* --control: serve replay jobs from the preloaded files until told to quit */
+    if (HAVE_OPT(CONTROL)) {
+        control_serve(ctx, OPT_ARG(CONTROL));
+        tcpreplay_close(ctx);
+        return 0;
+    }
+
+    /* --search: find the no-drop rate of each file and stop */
+    if (HAVE_OPT(SEARCH)) {
+        search_run(ctx);
+        tcpreplay_close(ctx);
+        return 0;
+    }
+
+    /* --start-at: wait for the agreed instant */
+    if (tcpreplay_wait_start(ctx) < 0)
+        errx(-1, "%s", tcpreplay_geterr(ctx));
+
     if (gettimeofday(&ctx->stats.start_time, NULL) < 0)
         errx(-1, "gettimeofday() failed: %s",  strerror(errno));
 
@@ -132,7 +179,10 @@ main(int argc, char *argv[])
     rcode = 0;
     if (ctx->options->loop > 0) {
         while (rcode == 0 && ctx->options->loop-- && !ctx->abort) {  /* limited loop */
-            if (ctx->options->dualfile) {
+            if (ctx->options->merge) {
+                /* every file at once, merged by timestamp */
+                rcode = tcpr_replay_index(ctx, 0);
+            } else if (ctx->options->dualfile) {
                 /* process two files at a time for network taps */
                 for (i = 0; i < argc; i += 2) {
                     rcode = tcpr_replay_index(ctx, i);
@@ -151,7 +201,10 @@ main(int argc, char *argv[])
     else {
         /* loop forever */
         while (rcode == 0 && !ctx->abort) {
-            if (ctx->options->dualfile) {
+            if (ctx->options->merge) {
+                /* every file at once, merged by timestamp */
+                rcode = tcpr_replay_index(ctx, 0);
+            } else if (ctx->options->dualfile) {
                 /* process two files at a time for network taps */
                 for (i = 0; i < argc; i += 2) {
                     rcode = tcpr_replay_index(ctx, i);
@@ -175,6 +228,10 @@ main(int argc, char *argv[])
         notice("\nWarning: %s\n", tcpreplay_getwarn(ctx));
     }
 
+    /* --tx-timestamps and --measure: collect what is still in flight */
+    wire_flush(ctx);
+    tcpreplay_measure_stop(ctx);
+
     if (ctx->stats.bytes_sent > 0) {
         if (gettimeofday(&ctx->stats.end_time, NULL) < 0)
             errx(-1, "gettimeofday() failed: %s",  strerror(errno));
@@ -185,12 +242,23 @@ main(int argc, char *argv[])
                     || tcpedit->seed
 #endif
                     );
+        memory_stats(ctx);
+        if (ctx->options->source_stats)
+            source_stats(ctx);
         sendpacket_getstat(ctx->intf1, buf, sizeof(buf));
         printf("%s", buf);
         if (ctx->intf2 != NULL) {
             sendpacket_getstat(ctx->intf2, buf, sizeof(buf));
             printf("%s", buf);
         }
+        for (i = 1; i < ctx->merge_intf_cnt; i++) {
+            sendpacket_getstat(ctx->merge_intf[i], buf, sizeof(buf));
+            printf("%s", buf);
+        }
+        for (i = 0; i < ctx->fanout_intf_cnt; i++) {
+            sendpacket_getstat(ctx->fanout_intf[i], buf, sizeof(buf));
+            printf("%s", buf);
+        }
     }
     tcpreplay_close(ctx);
     return 0;
@@ -251,6 +319,824 @@ flow_stats(const tcpreplay_t *ctx, bool unique_ip)
         printf("Flows: " COUNTER_SPEC " flows, %llu.%02u fps, " COUNTER_SPEC " flow packets, " COUNTER_SPEC " non-flow\n",
                 flows_total, flows_sec, flows_sec_100ths, flow_packets,
                 flow_non_flow_packets);
+
+    dbgx(1, "Flow table: " COUNTER_SPEC " flows in " COUNTER_SPEC " slots, " COUNTER_SPEC " bytes, "
+            COUNTER_SPEC " resets", stats->flow_table_flows, stats->flow_table_slots,
+            stats->flow_table_bytes, stats->flow_table_resets);
+}
+
+/**
+ * Print the memory held by the preload cache, flow table and tcpprep cache
+ */
+static void
+memory_stats(const tcpreplay_t *ctx)
+{
+    const tcpreplay_stats_t *stats = &ctx->stats;
+
+    if (stats->preload_bytes == 0 && stats->flow_table_bytes == 0 && stats->cache_bytes == 0)
+        return;
+
+    printf("Memory: " COUNTER_SPEC " bytes preload cache, " COUNTER_SPEC " bytes flow table, "
+            COUNTER_SPEC " bytes tcpprep cache\n",
+            stats->preload_bytes, stats->flow_table_bytes, stats->cache_bytes);
+}
+
+/**
+ * --source-stats: one line for each input file, so the ones which
+ * couldn't keep up stand out from the totals
+ */
+static void
+source_stats(const tcpreplay_t *ctx)
+{
+    const tcpreplay_source_stats_t *stats;
+    double mbps;
+    int i;
+
+    printf("Statistics for each source:\n"
+            "%12s %14s %10s %10s %10s %10s %10s  %s\n",
+            "packets", "bytes", "Mbps", "seconds", "retried", "late", "dropped", "file");
+
+    for (i = 0; i < ctx->options->source_cnt; i++) {
+        stats = &ctx->options->sources[i].stats;
+        mbps = stats->time_ns ? (double)stats->bytes_sent * 8000.0 / (double)stats->time_ns : 0.0;
+
+        printf("%12" PRIu64 " %14" PRIu64 " %10.2f %10.3f %10" PRIu64 " %10" PRIu64
+                " %10" PRIu64 "  %s\n",
+                (uint64_t)stats->pkts_sent, (uint64_t)stats->bytes_sent, mbps,
+                (double)stats->time_ns / 1000000000.0, (uint64_t)stats->retries,
+                (uint64_t)stats->late_packets, (uint64_t)stats->late_dropped,
+                ctx->options->sources[i].filename ? ctx->options->sources[i].filename : "-");
+    }
+}
+
+/*
+ * --control: a long lived tcpreplay.  The files stay preloaded and the
+ * interfaces open, and each job read from the socket is one replay of them
+ * with its own loop count and speed.
+ */
+
+#define CONTROL_LINE_LEN 1024
+#define CONTROL_MAX_TOKENS 32
+#define CONTROL_MAX_NODES 64                        /* distribute: this node and its peers */
+#define CONTROL_START_LEAD_NSEC 1000000000ULL       /* distribute: default start=+1 */
+#define CONTROL_PEER_TIMEOUT_SEC 30                 /* distribute: wait for a peer's answer */
+
+static void
+control_reply(int fd, const char *fmt, ...)
+{
+    char buf[CONTROL_LINE_LEN];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+    va_end(ap);
+
+    if (len < 0)
+        return;
+    if (len > (int)sizeof(buf) - 2)
+        len = sizeof(buf) - 2;
+    buf[len++] = '\n';
+
+    /* a client which went away mustn't take us with it */
+    if (send(fd, buf, len, MSG_NOSIGNAL) < 0)
+        dbgx(1, "control: unable to reply: %s", strerror(errno));
+}
+
+/* files=0,2,...: the sources to replay */
+static int
+control_files(tcpreplay_t *ctx, char *list, bool *sel)
+{
+    char *p = list, *end;
+    long idx;
+
+    while (*p) {
+        idx = strtol(p, &end, 10);
+        if (end == p || idx < 0 || idx >= ctx->options->source_cnt)
+            return -1;
+
+        /* dualfile replays pairs, named by their first file */
+        if (ctx->options->dualfile && idx % 2)
+            return -1;
+
+        sel[idx] = true;
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+
+    return 0;
+}
+
+/* the totals of one replay job */
+typedef struct control_result_s {
+    COUNTER packets;
+    COUNTER bytes;
+    COUNTER usec;
+    COUNTER failed;
+} control_result_t;
+
+/*
+ * replay [files=I,J] [loop=N] [topspeed|mbps=R|pps=R|multiplier=R]
+ *        [partition=K/N] [start=TIME]
+ * Runs one job, returns -1 with the reason in err.
+ */
+static int
+control_run(tcpreplay_t *ctx, char *args, control_result_t *res, char *err, size_t errlen)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_speed_t speed = options->speed;
+    tcpreplay_accurate accurate = options->accurate;
+    u_int32_t loop = options->loop;
+    bool sel[MAX_FILES], have_sel = false;
+    char *tok, *val, *save = NULL;
+    struct timeval diff;
+    COUNTER stage_every;
+    unsigned int part_idx, part_cnt;
+    double n;
+    int rcode = -1;
+
+    memset(sel, 0, sizeof(sel));
+    memset(res, 0, sizeof(*res));
+    options->loop = loop ? loop : 1;
+
+    for (tok = strtok_r(args, " \t\r\n", &save); tok != NULL;
+            tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if ((val = strchr(tok, '=')) != NULL)
+            *val++ = '\0';
+
+        if (strcmp(tok, "topspeed") == 0 && val == NULL) {
+            options->speed.mode = speed_topspeed;
+            options->speed.speed = 0;
+        } else if (strcmp(tok, "mbps") == 0 && val && (n = atof(val)) >= 0.0) {
+            options->speed.mode = speed_mbpsrate;
+            options->speed.speed = (COUNTER)(n * 1000000.0); /* convert to bps */
+        } else if (strcmp(tok, "pps") == 0 && val && (n = atof(val)) > 0.0) {
+            options->speed.mode = speed_packetrate;
+            options->speed.speed = (COUNTER)n;
+        } else if (strcmp(tok, "multiplier") == 0 && val && (n = atof(val)) > 0.0) {
+            options->speed.mode = speed_multiplier;
+            options->speed.multiplier = n;
+        } else if (strcmp(tok, "loop") == 0 && val && atoi(val) > 0) {
+            /* no looping forever, the daemon would never take another job */
+            options->loop = atoi(val);
+        } else if (strcmp(tok, "files") == 0 && val && control_files(ctx, val, sel) == 0) {
+            have_sel = true;
+        } else if (strcmp(tok, "partition") == 0 && val && !options->dualfile &&
+                sscanf(val, "%u/%u", &part_idx, &part_cnt) == 2 &&
+                part_cnt > 0 && part_idx < part_cnt) {
+            ctx->partition_idx = part_idx;
+            ctx->partition_cnt = part_cnt > 1 ? part_cnt : 0;
+        } else if (strcmp(tok, "start") == 0 && val) {
+            if (tcpreplay_parse_start_at(ctx, val) < 0) {
+                snprintf(err, errlen, "%s", tcpreplay_geterr(ctx));
+                goto out;
+            }
+        } else {
+            snprintf(err, errlen, "invalid option: %s%s%s", tok, val ? "=" : "", val ? val : "");
+            goto out;
+        }
+    }
+
+    /* every job starts its counters over */
+    stage_every = ctx->stats.stage_every;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.stage_every = stage_every;
+    ctx->iteration = 0;
+    if (options->flow_stats)
+        flow_hash_table_reset(ctx->flow_hash_table);
+
+    if (tcpreplay_wait_start(ctx) < 0) {
+        snprintf(err, errlen, "%s", tcpreplay_geterr(ctx));
+        goto out;
+    }
+
+    ctx->source_sel = have_sel ? sel : NULL;
+    gettimeofday(&ctx->stats.start_time, NULL);
+    rcode = 0;
+    while (rcode == 0 && options->loop-- && !ctx->abort)
+        rcode = tcpr_replay_index(ctx, 0);
+    gettimeofday(&ctx->stats.end_time, NULL);
+    ctx->source_sel = NULL;
+
+    if (rcode < 0) {
+        snprintf(err, errlen, "%s", tcpreplay_geterr(ctx));
+    } else if (ctx->abort) {
+        snprintf(err, errlen, "aborted");
+        rcode = -1;
+    } else {
+        timersub(&ctx->stats.end_time, &ctx->stats.start_time, &diff);
+        res->packets = ctx->stats.pkts_sent;
+        res->bytes = ctx->stats.bytes_sent;
+        res->usec = (COUNTER)TIMEVAL_TO_MICROSEC(&diff);
+        res->failed = ctx->stats.failed;
+    }
+
+out:
+    options->speed = speed;
+    options->loop = loop;
+    options->accurate = accurate;
+    options->start_at = 0;
+    ctx->start_deadline = 0;
+    ctx->partition_cnt = 0;
+    ctx->partition_idx = 0;
+    return rcode < 0 ? -1 : 0;
+}
+
+static void
+control_replay(tcpreplay_t *ctx, int fd, char *args)
+{
+    control_result_t res;
+    char err[CONTROL_LINE_LEN];
+
+    if (control_run(ctx, args, &res, err, sizeof(err)) < 0)
+        control_reply(fd, "ERR %s", err);
+    else
+        control_reply(fd, "OK packets=" COUNTER_SPEC " bytes=" COUNTER_SPEC
+                " usec=" COUNTER_SPEC " failed=" COUNTER_SPEC,
+                res.packets, res.bytes, res.usec, res.failed);
+}
+
+/*
+ * Connects to the --control socket of another node: a unix socket path,
+ * or HOST:PORT for a daemon listening on tcp:PORT.  Returns -1 on error.
+ */
+static int
+control_connect(const char *node)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un addr;
+    char host[256], *port;
+    int fd = -1;
+
+    if (strchr(node, '/') != NULL) {
+        if (strlen(node) >= sizeof(addr.sun_path))
+            return -1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy(addr.sun_path, node, sizeof(addr.sun_path));
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    strlcpy(host, node, sizeof(host));
+    if ((port = strrchr(host, ':')) == NULL)
+        return -1;
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* the value of key=VALUE in a reply line, 0 if it isn't there */
+static COUNTER
+control_field(const char *line, const char *key)
+{
+    const char *p = strstr(line, key);
+
+    return p ? (COUNTER)strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+/*
+ * distribute peers=NODE,... [replay options]
+ *
+ * Coordinates one replay over this node and its peers.  Each node has the
+ * same files preloaded and replays partition I/N of the flows, so only a
+ * job line crosses the network, never packets.  --mbps and --pps are the
+ * total and are split evenly, every node starts at the same start=TIME
+ * (a second from now by default) and the answer adds up their totals.
+ */
+static void
+control_distribute(tcpreplay_t *ctx, int fd, char *args)
+{
+    char *tok[CONTROL_MAX_TOKENS], *peer[CONTROL_MAX_NODES];
+    char job[CONTROL_LINE_LEN], line[CONTROL_LINE_LEN], err[CONTROL_LINE_LEN];
+    FILE *peer_in[CONTROL_MAX_NODES];
+    char *peers = NULL, *save = NULL, *t;
+    control_result_t res, total;
+    struct timespec now;
+    struct timeval tv = { CONTROL_PEER_TIMEOUT_SEC, 0 };
+    bool have_start = false;
+    int tok_cnt = 0, peer_cnt = 0, nodes, i, peer_fd, len = 0;
+    uint64_t start;
+
+    for (t = strtok_r(args, " \t\r\n", &save); t != NULL; t = strtok_r(NULL, " \t\r\n", &save)) {
+        if (strncmp(t, "peers=", 6) == 0) {
+            peers = t + 6;
+        } else if (strncmp(t, "partition=", 10) == 0 || tok_cnt == CONTROL_MAX_TOKENS) {
+            control_reply(fd, "ERR invalid option: %s", t);
+            return;
+        } else {
+            have_start = have_start || strncmp(t, "start=", 6) == 0;
+            tok[tok_cnt++] = t;
+        }
+    }
+
+    save = NULL;
+    for (t = peers ? strtok_r(peers, ",", &save) : NULL; t != NULL; t = strtok_r(NULL, ",", &save)) {
+        if (peer_cnt == CONTROL_MAX_NODES - 1) {
+            control_reply(fd, "ERR more than %d peers", CONTROL_MAX_NODES - 1);
+            return;
+        }
+        peer[peer_cnt++] = t;
+    }
+
+    if (peer_cnt == 0) {
+        control_reply(fd, "ERR distribute needs peers=NODE,...");
+        return;
+    }
+
+    nodes = peer_cnt + 1;
+    job[0] = '\0';
+    for (i = 0; i < tok_cnt; i++) {
+        if (strncmp(tok[i], "mbps=", 5) == 0)
+            len += snprintf(job + len, sizeof(job) - len, " mbps=%.6f", atof(tok[i] + 5) / nodes);
+        else if (strncmp(tok[i], "pps=", 4) == 0)
+            len += snprintf(job + len, sizeof(job) - len, " pps=%.3f", atof(tok[i] + 4) / nodes);
+        else
+            len += snprintf(job + len, sizeof(job) - len, " %s", tok[i]);
+        if (len >= (int)sizeof(job)) {
+            control_reply(fd, "ERR job too long");
+            return;
+        }
+    }
+
+    if (!have_start) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        start = TIMESPEC_TO_NANOSEC(&now) + CONTROL_START_LEAD_NSEC;
+        len += snprintf(job + len, sizeof(job) - len, " start=%" PRIu64 ".%09" PRIu64,
+                start / 1000000000, start % 1000000000);
+        if (len >= (int)sizeof(job)) {
+            control_reply(fd, "ERR job too long");
+            return;
+        }
+    }
+
+    /* reach every peer before any of them starts */
+    memset(peer_in, 0, sizeof(peer_in));
+    for (i = 0; i < peer_cnt; i++) {
+        if ((peer_fd = control_connect(peer[i])) < 0 ||
+                (peer_in[i] = fdopen(peer_fd, "r+")) == NULL) {
+            if (peer_fd >= 0)
+                close(peer_fd);
+            control_reply(fd, "ERR unable to reach %s", peer[i]);
+            goto done;
+        }
+
+        /* a peer that hangs mustn't hang this daemon too */
+        setsockopt(peer_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    /* peers get partitions 1 to N-1 */
+    for (i = 0; i < peer_cnt; i++) {
+        fprintf(peer_in[i], "replay%s partition=%d/%d\n", job, i + 1, nodes);
+        fflush(peer_in[i]);
+    }
+
+    memset(&total, 0, sizeof(total));
+    snprintf(line, sizeof(line), "%s partition=0/%d", job, nodes);
+    if (control_run(ctx, line, &res, err, sizeof(err)) < 0) {
+        control_reply(fd, "ERR local: %s", err);
+        goto done;
+    }
+    total = res;
+
+    for (i = 0; i < peer_cnt; i++) {
+        if (fgets(line, sizeof(line), peer_in[i]) == NULL) {
+            control_reply(fd, "ERR %s: no answer", peer[i]);
+            goto done;
+        }
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "OK ", 3) != 0) {
+            control_reply(fd, "ERR %s: %s", peer[i], line);
+            goto done;
+        }
+
+        total.packets += control_field(line, "packets=");
+        total.bytes += control_field(line, "bytes=");
+        total.usec = max(total.usec, control_field(line, "usec="));
+        total.failed += control_field(line, "failed=");
+    }
+
+    control_reply(fd, "OK nodes=%d packets=" COUNTER_SPEC " bytes=" COUNTER_SPEC
+            " usec=" COUNTER_SPEC " failed=" COUNTER_SPEC,
+            nodes, total.packets, total.bytes, total.usec, total.failed);
+
+done:
+    for (i = 0; i < peer_cnt; i++) {
+        if (peer_in[i] != NULL)
+            fclose(peer_in[i]);
+    }
+}
+
+/* runs the jobs of one connection, returns true once told to quit */
+static bool
+control_client(tcpreplay_t *ctx, int fd)
+{
+    struct timeval tv = { 1, 0 };
+    char line[CONTROL_LINE_LEN], *cmd;
+    bool quit = false;
+    FILE *in;
+    int i;
+
+    /* wake up every second to notice Ctrl-C */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ((in = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return false;
+    }
+
+    while (!quit && !ctx->abort) {
+        if (fgets(line, sizeof(line), in) == NULL) {
+            if (ferror(in) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                clearerr(in);
+                continue;
+            }
+            break;
+        }
+
+        cmd = line + strspn(line, " \t");
+        if (strncmp(cmd, "replay", 6) == 0 && strchr(" \t\r\n", cmd[6])) {
+            control_replay(ctx, fd, cmd + 6);
+        } else if (strncmp(cmd, "distribute", 10) == 0 && strchr(" \t\r\n", cmd[10])) {
+            control_distribute(ctx, fd, cmd + 10);
+        } else if (strncmp(cmd, "list", 4) == 0 && strchr(" \t\r\n", cmd[4])) {
+            for (i = 0; i < ctx->options->source_cnt; i++)
+                control_reply(fd, "%d " COUNTER_SPEC " %s", i,
+                        ctx->options->file_cache[i].packet_cnt,
+                        ctx->options->sources[i].filename);
+            control_reply(fd, "OK");
+        } else if (strncmp(cmd, "quit", 4) == 0 && strchr(" \t\r\n", cmd[4])) {
+            control_reply(fd, "OK");
+            quit = true;
+        } else if (*cmd != '\n' && *cmd != '\r' && *cmd != '\0') {
+            control_reply(fd, "ERR unknown command");
+        }
+    }
+
+    fclose(in);
+    return quit;
+}
+
+/*
+ * --control tcp:[ADDR:]PORT, for distribute jobs from other nodes.  Without
+ * an ADDR only the loopback listens, anything else has to be asked for.
+ */
+static int
+control_listen_tcp(const char *spec)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256], *port;
+    int listen_fd = -1, on = 1, rcode;
+
+    strlcpy(host, spec, sizeof(host));
+    if ((port = strrchr(host, ':')) != NULL) {
+        *port++ = '\0';
+    } else {
+        port = host;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rcode = getaddrinfo(port == host ? NULL : host, port, &hints, &res)) != 0)
+        errx(-1, "Invalid --control address %s: %s", spec, gai_strerror(rcode));
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(listen_fd, 8) == 0)
+            break;
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    freeaddrinfo(res);
+    if (listen_fd < 0)
+        errx(-1, "Unable to listen on %s: %s", spec, strerror(errno));
+
+    return listen_fd;
+}
+
+static void
+control_serve(tcpreplay_t *ctx, const char *path)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    struct stat st;
+    mode_t old_umask;
+    int listen_fd, fd, rcode;
+    bool quit = false, tcp = strncmp(path, "tcp:", 4) == 0;
+
+    if (tcp) {
+        listen_fd = control_listen_tcp(path + 4);
+    } else {
+        if (strlen(path) >= sizeof(addr.sun_path))
+            errx(-1, "--control socket path is too long: %s", path);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+        if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            errx(-1, "Unable to create --control socket: %s", strerror(errno));
+
+        /* only replace a socket left behind by an earlier run */
+        if (lstat(path, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode))
+                errx(-1, "--control %s exists and is not a socket", path);
+            unlink(path);
+        } else if (errno != ENOENT) {
+            errx(-1, "Unable to check --control %s: %s", path, strerror(errno));
+        }
+
+        /* anyone who can connect can send jobs, so only our user may */
+        old_umask = umask(077);
+        rcode = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+        umask(old_umask);
+        if (rcode < 0 || listen(listen_fd, 8) < 0)
+            errx(-1, "Unable to listen on %s: %s", path, strerror(errno));
+    }
+
+    notice("Waiting for replay jobs on %s", path);
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    while (!quit && !ctx->abort) {
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+        quit = control_client(ctx, fd);
+    }
+
+    close(listen_fd);
+    if (!tcp)
+        unlink(path);
+}
+
+/*
+ * --search: RFC 2544 style throughput test.  Each file is a frame size
+ * profile, sent in trials of --search-trial seconds at rates below the
+ * --mbps or --pps given, and the highest rate whose trial lost no more than
+ * --search-loss is its no-drop rate.  Loss comes from --measure, or from
+ * the RX counter of --search-rx.  The files stay preloaded and the
+ * interfaces open from one trial to the next.
+ */
+
+#define SEARCH_SETTLE_MS 2000       /* for the last packets, RFC 2544 section 23 */
+
+typedef struct search_s {
+    tcpreplay_speed_mode mode;      /* speed_mbpsrate or speed_packetrate */
+    double max;                     /* Mbps or pps */
+    double step;                    /* of max */
+    double loss;                    /* % allowed */
+    COUNTER trial_usec;
+    bool ramp;
+    const char *rx_intf;            /* or NULL for --measure */
+} search_t;
+
+/* what a trial sent and what came back */
+typedef struct search_trial_s {
+    COUNTER sent;
+    COUNTER bytes;
+    COUNTER usec;
+    COUNTER received;
+} search_trial_t;
+
+/* RX packets of intf, from sysfs */
+static int
+search_rx_packets(const char *intf, COUNTER *packets)
+{
+    char path[PATH_MAX];
+    unsigned long long n;
+    FILE *fp;
+    int rcode;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets", intf);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+
+    rcode = fscanf(fp, "%llu", &n);
+    fclose(fp);
+    if (rcode != 1)
+        return -1;
+
+    *packets = (COUNTER)n;
+    return 0;
+}
+
+static COUNTER
+search_received(tcpreplay_t *ctx, const search_t *search)
+{
+    COUNTER packets = 0;
+
+    if (search->rx_intf == NULL)
+        return __atomic_load_n(&ctx->measure->received, __ATOMIC_RELAXED);
+
+    if (search_rx_packets(search->rx_intf, &packets) < 0)
+        errx(-1, "Unable to read the RX counter of %s", search->rx_intf);
+
+    return packets;
+}
+
+/*
+ * Sends file idx at rate for at least trial_usec, whole passes at a time,
+ * and waits SEARCH_SETTLE_MS for what is still in flight.  Returns -1 on
+ * error or when aborted.
+ */
+static int
+search_trial(tcpreplay_t *ctx, const search_t *search, bool *sel, double rate,
+        search_trial_t *res)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    struct timespec settle = { SEARCH_SETTLE_MS / 1000, (SEARCH_SETTLE_MS % 1000) * 1000000 };
+    struct timeval diff;
+    COUNTER stage_every, rx_before, tagged = 0;
+    int rcode = 0;
+
+    options->speed.mode = search->mode;
+    options->speed.speed = search->mode == speed_mbpsrate ?
+            (COUNTER)(rate * 1000000.0) : (COUNTER)rate;
+
+    /* every trial starts its counters over, as --control jobs do */
+    stage_every = ctx->stats.stage_every;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.stage_every = stage_every;
+    ctx->iteration = 0;
+    if (options->flow_stats)
+        flow_hash_table_reset(ctx->flow_hash_table);
+
+    rx_before = search_received(ctx, search);
+    if (search->rx_intf == NULL)
+        tagged = ctx->measure->seq;
+    ctx->source_sel = sel;
+    gettimeofday(&ctx->stats.start_time, NULL);
+    do {
+        rcode = tcpr_replay_index(ctx, 0);
+        gettimeofday(&ctx->stats.end_time, NULL);
+        timersub(&ctx->stats.end_time, &ctx->stats.start_time, &diff);
+    } while (rcode == 0 && !ctx->abort && (COUNTER)TIMEVAL_TO_MICROSEC(&diff) < search->trial_usec);
+    ctx->source_sel = NULL;
+
+    if (rcode < 0 || ctx->abort)
+        return -1;
+
+    nanosleep(&settle, NULL);
+    /* packets too short for a tag can't be counted as lost */
+    res->sent = search->rx_intf == NULL ? ctx->measure->seq - tagged : ctx->stats.pkts_sent;
+    res->bytes = ctx->stats.bytes_sent;
+    res->usec = (COUNTER)TIMEVAL_TO_MICROSEC(&diff);
+    res->received = search_received(ctx, search) - rx_before;
+    return 0;
+}
+
+/*
+ * Runs the trials of one file and prints its no-drop rate: the last
+ * passing trial going up for a ramp, else a binary search between 0 and
+ * the maximum that stops once the two are within a step of each other
+ */
+static int
+search_file(tcpreplay_t *ctx, const search_t *search, int idx)
+{
+    const char *unit = search->mode == speed_mbpsrate ? "Mbps" : "pps";
+    const char *name = ctx->options->sources[idx].filename;
+    search_trial_t res, best;
+    bool sel[MAX_FILES];
+    double lo = 0.0, hi = search->max, rate, lost;
+    double step = search->max * search->step;
+    bool pass;
+    int trials = 0;
+
+    memset(sel, 0, sizeof(sel));
+    memset(&best, 0, sizeof(best));
+    sel[idx] = true;
+
+    rate = search->ramp ? step : search->max;
+    while (rate <= search->max + step / 2 && !ctx->abort) {
+        if (search_trial(ctx, search, sel, rate, &res) < 0)
+            return -1;
+
+        trials++;
+        lost = res.received < res.sent ?
+                (double)(res.sent - res.received) * 100.0 / (double)res.sent : 0.0;
+        pass = res.sent > 0 && lost <= search->loss;
+        printf("Search %s: trial %d at %.3f %s: " COUNTER_SPEC " sent, " COUNTER_SPEC
+                " received, %.3f%% lost, %s\n", name, trials, rate, unit,
+                res.sent, res.received, lost, pass ? "pass" : "fail");
+        fflush(NULL);
+
+        if (pass) {
+            lo = rate;
+            best = res;
+        } else {
+            hi = rate;
+        }
+
+        if (search->ramp) {
+            if (!pass)
+                break;
+            rate += step;
+        } else {
+            if (pass && rate == search->max)
+                break;
+            if (hi - lo <= step)
+                break;
+            rate = (lo + hi) / 2.0;
+        }
+    }
+
+    if (best.sent == 0) {
+        printf("Search %s: no rate passed, the lowest tried was %.3f %s\n",
+                name, hi, unit);
+        return 0;
+    }
+
+    printf("No-drop rate %s: %.3f %s, sent %.3f Mbps %.0f pps, mean frame " COUNTER_SPEC
+            " bytes, %d trials\n", name, lo, unit,
+            (double)best.bytes * 8.0 / (double)best.usec,
+            (double)best.sent * 1000000.0 / (double)best.usec,
+            best.bytes / best.sent, trials);
+    return 0;
+}
+
+static void
+search_run(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_speed_t speed = options->speed;
+    search_t search;
+    COUNTER packets;
+    int idx, step;
+
+    memset(&search, 0, sizeof(search));
+    if (options->speed.mode == speed_mbpsrate && options->speed.speed > 0) {
+        search.mode = speed_mbpsrate;
+        search.max = (double)options->speed.speed / 1000000.0;
+    } else if (options->speed.mode == speed_packetrate) {
+        search.mode = speed_packetrate;
+        search.max = (double)options->speed.speed;
+    } else {
+        errx(-1, "%s", "--search needs the highest rate to try as --mbps or --pps");
+    }
+
+    search.ramp = strcmp(OPT_ARG(SEARCH), "ramp") == 0;
+    if (!search.ramp && strcmp(OPT_ARG(SEARCH), "binary") != 0)
+        errx(-1, "Invalid --search: %s", OPT_ARG(SEARCH));
+
+    search.step = atof(OPT_ARG(SEARCH_STEP)) / 100.0;
+    if (search.step <= 0.0 || search.step > 1.0)
+        errx(-1, "Invalid --search-step: %s", OPT_ARG(SEARCH_STEP));
+
+    search.loss = atof(OPT_ARG(SEARCH_LOSS));
+    if (search.loss < 0.0 || search.loss >= 100.0)
+        errx(-1, "Invalid --search-loss: %s", OPT_ARG(SEARCH_LOSS));
+
+    search.trial_usec = (COUNTER)OPT_VALUE_SEARCH_TRIAL * 1000000;
+
+    if (HAVE_OPT(SEARCH_RX)) {
+        search.rx_intf = OPT_ARG(SEARCH_RX);
+        if (search_rx_packets(search.rx_intf, &packets) < 0)
+            errx(-1, "Unable to read the RX counter of %s", search.rx_intf);
+    } else if (ctx->measure == NULL) {
+        errx(-1, "%s", "--search needs --measure or --search-rx to tell what was lost");
+    }
+
+    step = options->dualfile ? 2 : 1;
+    for (idx = 0; idx < options->source_cnt && !ctx->abort; idx += step) {
+        if (search_file(ctx, &search, idx) < 0) {
+            if (!ctx->abort)
+                errx(-1, "Search failed: %s", tcpreplay_geterr(ctx));
+            break;
+        }
+    }
+
+    options->speed = speed;
 }
 
 /* vim: set tabstop=8 expandtab shiftwidth=4 softtabstop=4: */
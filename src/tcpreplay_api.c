@@ -21,6 +21,11 @@
 #include "config.h"
 #include "defines.h"
 #include "common.h"
+#include "common/queue_map.h"
+#include "common/flow_records.h"
+#ifdef ENABLE_FRAGROUTE
+#include "fragroute/fragroute.h"
+#endif
 
 #include <ctype.h>
 #include <fcntl.h>
@@ -31,10 +36,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "tcpreplay_api.h"
 #include "send_packets.h"
 #include "replay.h"
+#include "sleep.h"
 
 #ifdef TCPREPLAY_EDIT
 #include "tcpreplay_edit_opts.h"
@@ -42,6 +51,20 @@
 #include "tcpreplay_opts.h"
 #endif
 
+static char *tcpreplay_intf_name(tcpreplay_t *ctx, const char *value);
+static int tcpreplay_check_send_loop(tcpreplay_t *ctx);
+static int tcpreplay_auto_method(tcpreplay_t *ctx, bool qdisc_bypass);
+static int tcpreplay_open_workers(tcpreplay_t *ctx);
+static void tcpreplay_calibrate_spin(tcpreplay_t *ctx);
+static int tcpreplay_parse_secs(const char *value, double *secs);
+#if defined HAVE_NETMAP && defined __FreeBSD__
+static void tcpreplay_prefer_netmap(tcpreplay_t *ctx, const char *intf2);
+#endif
+static int tcpreplay_open_merge_intf(tcpreplay_t *ctx, int source_cnt);
+static int tcpreplay_open_fanout_intf(tcpreplay_t *ctx);
+#ifdef HAVE_LIBPTHREAD
+static void *tcpreplay_async_main(void *arg);
+#endif
 
 
 /**
@@ -86,11 +109,13 @@ tcpreplay_init()
 
     /* replay packets only once */
     ctx->options->loop = 1;
+    ctx->options->loop_gap_ns = -1;
 
     /* Default mode is to replay pcap once in real-time */
     ctx->options->speed.mode = speed_multiplier;
     ctx->options->speed.speed = 0;
     ctx->options->speed.multiplier = 1.0;
+    ctx->options->late_threshold_ns = LATE_THRESHOLD_NSEC;
 
     /* Set the default timing method */
     ctx->options->accurate = accurate_gtod;
@@ -101,19 +126,32 @@ tcpreplay_init()
     /* disable limit send */
     ctx->options->limit_send = -1;
 
+    /* send one packet per call to the injector */
+    ctx->options->batch_size = 1;
+    ctx->options->prefetch = PACKET_PREFETCH;
+
+    /* send from a single thread */
+    ctx->options->workers = 1;
+    ctx->options->clients = 1;
+    ctx->sleep_spin_nsec = ABSOLUTE_SLEEP_SPIN_NSEC;
+#ifdef TIMESTAMP_TRACE
+    ctx->trace = safe_malloc(sizeof(timestamp_trace_t));
+#endif
+
 #ifdef ENABLE_VERBOSE
     /* clear out tcpdump struct */
     ctx->options->tcpdump = (tcpdump_t *)safe_malloc(sizeof(tcpdump_t));
 #endif
 
+#ifdef ENABLE_FRAGROUTE
+    ctx->options->fragroute_dir = FRAGROUTE_DIR_BOTH;
+#endif
+
     if (fcntl(STDERR_FILENO, F_SETFL, O_NONBLOCK) < 0)
         tcpreplay_setwarn(ctx, "Unable to set STDERR to non-blocking: %s", strerror(errno));
 
-#ifdef ENABLE_PCAP_FINDALLDEVS
-    ctx->intlist = get_interface_list();
-#else
+    /* tcpreplay_intf_name() enumerates the interfaces if it has to */
     ctx->intlist = NULL;
-#endif
 
     /* set up flows - on by default*/
     ctx->options->flow_stats = 1;
@@ -123,6 +161,8 @@ tcpreplay_init()
     ctx->iteration = 0;
     ctx->intf1dlt = -1;
     ctx->intf2dlt = -1;
+    ctx->send_loop = -1;
+    ctx->ctl_switch = -1;
     ctx->abort = false;
     ctx->first_time = 1;
     return ctx;
@@ -143,6 +183,7 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
     tcpreplay_opt_t *options;
     int warn = 0;
     float n;
+    double secs;
 
     options = ctx->options;
 
@@ -159,9 +200,39 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
 
     options->loop = OPT_VALUE_LOOP;
 
+    if (HAVE_OPT(LOOP_GAP))
+        tcpreplay_set_loop_gap(ctx, (int64_t)OPT_VALUE_LOOP_GAP * 1000);
+
     if (HAVE_OPT(LIMIT))
         options->limit_send = OPT_VALUE_LIMIT;
 
+    if (HAVE_OPT(START_PACKET))
+        tcpreplay_set_start_packet(ctx, OPT_VALUE_START_PACKET);
+
+    if (HAVE_OPT(START_TIME)) {
+        if (tcpreplay_parse_secs(OPT_ARG(START_TIME), &secs) < 0) {
+            tcpreplay_seterr(ctx, "Invalid --start-time: %s", OPT_ARG(START_TIME));
+            return -1;
+        }
+        tcpreplay_set_start_time(ctx, (COUNTER)(secs * 1000000.0));
+    }
+
+    if (HAVE_OPT(END_TIME)) {
+        if (tcpreplay_parse_secs(OPT_ARG(END_TIME), &secs) < 0 || secs == 0) {
+            tcpreplay_seterr(ctx, "Invalid --end-time: %s", OPT_ARG(END_TIME));
+            return -1;
+        }
+        tcpreplay_set_end_time(ctx, (COUNTER)(secs * 1000000.0));
+    }
+
+    if (HAVE_OPT(DURATION)) {
+        if (tcpreplay_parse_secs(OPT_ARG(DURATION), &secs) < 0 || secs == 0) {
+            tcpreplay_seterr(ctx, "Invalid --duration: %s", OPT_ARG(DURATION));
+            return -1;
+        }
+        tcpreplay_set_end_time(ctx, options->start_time_us + (COUNTER)(secs * 1000000.0));
+    }
+
     if (HAVE_OPT(TOPSPEED)) {
         options->speed.mode = speed_topspeed;
         options->speed.speed = 0;
@@ -181,6 +252,31 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         options->speed.multiplier = atof(OPT_ARG(MULTIPLIER));
     }
 
+    if (HAVE_OPT(BURST))
+        options->speed.burst = OPT_VALUE_BURST;
+
+    if (HAVE_OPT(RATE_PROFILE) &&
+            tcpreplay_set_rate_profile(ctx, OPT_ARG(RATE_PROFILE)) < 0)
+        return -1;
+
+    if (HAVE_OPT(BATCH_SIZE))
+        options->batch_size = OPT_VALUE_BATCH_SIZE;
+
+    if (HAVE_OPT(PREFETCH))
+        options->prefetch = OPT_VALUE_PREFETCH;
+
+    if (HAVE_OPT(WORKERS))
+        options->workers = OPT_VALUE_WORKERS;
+
+    if (HAVE_OPT(CLIENTS))
+        options->clients = OPT_VALUE_CLIENTS;
+
+    if (HAVE_OPT(FLOW_TIMING))
+        options->flow_timing = true;
+
+    if (HAVE_OPT(FOLLOW))
+        options->follow = true;
+
     if (HAVE_OPT(MAXSLEEP)) {
         options->maxsleep.tv_sec = OPT_VALUE_MAXSLEEP / 1000;
         options->maxsleep.tv_nsec = (OPT_VALUE_MAXSLEEP % 1000) * 1000;
@@ -192,11 +288,20 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
 
     if (HAVE_OPT(DECODE))
         options->tcpdump->args = safe_strdup(OPT_ARG(DECODE));
+
+    if (HAVE_OPT(VERBOSE_SAMPLE))
+        options->tcpdump->sample_every = OPT_VALUE_VERBOSE_SAMPLE;
+
+    if (HAVE_OPT(VERBOSE_RATE))
+        options->tcpdump->sample_rate = OPT_VALUE_VERBOSE_RATE;
 #endif
 
     if (HAVE_OPT(STATS))
         options->stats = OPT_VALUE_STATS;
 
+    if (HAVE_OPT(SOURCE_STATS))
+        options->source_stats = true;
+
     /*
      * preloading the pcap before the first run
      */
@@ -205,6 +310,30 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         options->preload_pcap = true;
     }
 
+    if (HAVE_OPT(MMAP_PCAP))
+        options->mmap_pcap = true;
+
+    if (HAVE_OPT(PCAPNG_INTF))
+        tcpreplay_set_pcapng_intf(ctx, true);
+
+    if (HAVE_OPT(PIPELINE) && tcpreplay_set_pipeline(ctx, true) < 0)
+        return -1;
+
+    if (HAVE_OPT(DUAL_QUEUES) && tcpreplay_set_dual_queues(ctx, true) < 0)
+        return -1;
+
+    if (HAVE_OPT(PRELOAD_WINDOW) &&
+            tcpreplay_set_preload_window(ctx, OPT_VALUE_PRELOAD_WINDOW) < 0)
+        return -1;
+
+    if (HAVE_OPT(MAX_MEMORY) && tcpreplay_set_max_memory(ctx, OPT_VALUE_MAX_MEMORY) < 0)
+        return -1;
+
+    if (HAVE_OPT(PRELOAD_HUGEPAGES)) {
+        if (tcpreplay_set_hugepage_size(ctx, OPT_VALUE_PRELOAD_HUGEPAGES) < 0)
+            return -1;
+    }
+
     /* Dual file mode */
     if (HAVE_OPT(DUALFILE)) {
         options->dualfile = true;
@@ -218,6 +347,19 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         }
     }
 
+    if (HAVE_OPT(MERGE)) {
+        options->merge = true;
+        if (HAVE_OPT(MERGE_INTF)) {
+            int i, ct = STACKCT_OPT(MERGE_INTF);
+            char **list = (char **)STACKLST_OPT(MERGE_INTF);
+
+            for (i = 0; i < ct; i++) {
+                if (tcpreplay_add_merge_intf(ctx, list[i]) < 0)
+                    return -1;
+            }
+        }
+    }
+
     if (HAVE_OPT(NETMAP)) {
 #ifdef HAVE_NETMAP
         options->netmap = 1;
@@ -227,6 +369,77 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
 #endif
     }
 
+#ifdef HAVE_NETMAP
+    if (HAVE_OPT(NETMAP_MULTIQUEUE))
+        options->netmap_multiqueue = true;
+#endif
+
+    if (HAVE_OPT(AF_XDP) && tcpreplay_set_af_xdp(ctx, true) < 0)
+        return -1;
+
+    if (HAVE_OPT(IO_URING) && tcpreplay_set_io_uring(ctx, true) < 0)
+        return -1;
+
+    if (HAVE_OPT(DPDK) && tcpreplay_set_dpdk(ctx, OPT_ARG(DPDK)) < 0)
+        return -1;
+
+    if (HAVE_OPT(FANOUT_INTF)) {
+        int i, ct = STACKCT_OPT(FANOUT_INTF);
+        char **list = (char **)STACKLST_OPT(FANOUT_INTF);
+
+        for (i = 0; i < ct; i++) {
+            if (tcpreplay_add_fanout_intf(ctx, list[i]) < 0)
+                return -1;
+        }
+    }
+
+#ifdef TCPREPLAY_EDIT
+    if (HAVE_OPT(CSUM_OFFLOAD)) {
+#ifdef HAVE_PACKET_VNET_HDR
+        if (ctx->sp_type != SP_TYPE_NONE) {
+            tcpreplay_seterr(ctx, "%s", "--csum-offload requires PF_PACKET sockets");
+            return -1;
+        }
+        options->csum_offload = true;
+        /* TX_RING frames have no room for a virtio_net_hdr */
+        ctx->sp_type = SP_TYPE_PF_PACKET;
+#else
+        tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with PACKET_VNET_HDR support");
+        return -1;
+#endif
+    }
+
+    if (HAVE_OPT(PRELOAD_EDIT))
+        options->preload_edit = true;
+#endif
+
+    if (HAVE_OPT(GSO)) {
+#ifdef HAVE_PACKET_VNET_HDR
+        if (ctx->sp_type != SP_TYPE_NONE && ctx->sp_type != SP_TYPE_PF_PACKET) {
+            tcpreplay_seterr(ctx, "%s", "--gso requires PF_PACKET sockets");
+            return -1;
+        }
+        options->gso = true;
+        /* TX_RING frames have no room for a virtio_net_hdr */
+        ctx->sp_type = SP_TYPE_PF_PACKET;
+#else
+        tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with PACKET_VNET_HDR support");
+        return -1;
+#endif
+    }
+
+    if (HAVE_OPT(SEGMENT) && tcpreplay_set_segment(ctx, OPT_VALUE_SEGMENT) < 0)
+        return -1;
+
+    if (HAVE_OPT(PRELOAD_SNAPLEN))
+        tcpreplay_set_preload_snaplen(ctx, OPT_VALUE_PRELOAD_SNAPLEN);
+
+    if (HAVE_OPT(PRELOAD_DEDUP))
+        tcpreplay_set_preload_dedup(ctx, true);
+
+    if (HAVE_OPT(PRELOAD_IMAGE))
+        tcpreplay_set_preload_image(ctx, true);
+
     if (HAVE_OPT(UNIQUE_IP))
         options->unique_ip = 1;
 
@@ -238,6 +451,14 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         options->flow_expiry = OPT_VALUE_FLOW_EXPIRY;
     }
 
+    if (HAVE_OPT(FLOW_RECORDS) && tcpreplay_set_flow_records(ctx, OPT_ARG(FLOW_RECORDS)) < 0)
+        return -1;
+
+    if (HAVE_OPT(FLOW_HASH) && flow_hash_select_name(OPT_ARG(FLOW_HASH)) < 0) {
+        tcpreplay_seterr(ctx, "Unsupported flow hash: %s", OPT_ARG(FLOW_HASH));
+        return -1;
+    }
+
     if (HAVE_OPT(TIMER)) {
         if (strcmp(OPT_ARG(TIMER), "select") == 0) {
 #ifdef HAVE_SELECT
@@ -258,9 +479,37 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
             options->accurate = accurate_gtod;
         } else if (strcmp(OPT_ARG(TIMER), "nano") == 0) {
             options->accurate = accurate_nanosleep;
-        } else if (strcmp(OPT_ARG(TIMER), "abstime") == 0) {
-            tcpreplay_seterr(ctx, "%s", "abstime is deprecated");
+        } else if (strcmp(OPT_ARG(TIMER), "txtime") == 0) {
+#ifdef HAVE_SO_TXTIME
+            if (ctx->sp_type != SP_TYPE_NONE || options->csum_offload || options->gso) {
+                tcpreplay_seterr(ctx, "%s", "txtime timing requires PF_PACKET sockets without --csum-offload or --gso");
+                return -1;
+            }
+            if (options->batch_size > 1) {
+                tcpreplay_seterr(ctx, "%s", "txtime timing can't be combined with --batch-size");
+                return -1;
+            }
+            options->accurate = accurate_txtime;
+            /* launch times can't be attached to TX_RING frames */
+            ctx->sp_type = SP_TYPE_PF_PACKET;
+#else
+            tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with SO_TXTIME support");
             return -1;
+#endif
+        } else if (strcmp(OPT_ARG(TIMER), "rdtsc") == 0) {
+#if defined(__i386__) || defined(__x86_64__)
+            options->accurate = accurate_rdtsc;
+            rdtsc_sleep_init();
+#else
+            tcpreplay_seterr(ctx, "%s", "tcpreplay_api only supports rdtsc on x86");
+            return -1;
+#endif
+        } else if (strcmp(OPT_ARG(TIMER), "abstime") == 0) {
+            options->accurate = accurate_abs_time;
+            tcpreplay_calibrate_spin(ctx);
+        } else if (strcmp(OPT_ARG(TIMER), "hybrid") == 0) {
+            options->accurate = accurate_hybrid;
+            tcpreplay_calibrate_spin(ctx);
         } else {
             tcpreplay_seterr(ctx, "Unsupported timer mode: %s", OPT_ARG(TIMER));
             return -1;
@@ -273,19 +522,31 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
     }
 #endif
 
+    if (HAVE_OPT(START_AT) && tcpreplay_parse_start_at(ctx, OPT_ARG(START_AT)) < 0)
+        return -1;
+
     if (HAVE_OPT(PKTLEN)) {
         options->use_pkthdr_len = true;
         warn ++;
         tcpreplay_setwarn(ctx, "%s", "--pktlen may cause problems.  Use with caution.");
     }
 
-    if ((intname = get_interface(ctx->intlist, OPT_ARG(INTF1))) == NULL) {
+    if ((intname = tcpreplay_intf_name(ctx, OPT_ARG(INTF1))) == NULL) {
         tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF1));
         return -1;
     }
 
     options->intf1_name = safe_strdup(intname);
 
+#if defined HAVE_NETMAP && defined __FreeBSD__
+    if (!HAVE_OPT(BPF))
+        tcpreplay_prefer_netmap(ctx, HAVE_OPT(INTF2) ?
+                tcpreplay_intf_name(ctx, OPT_ARG(INTF2)) : NULL);
+#endif
+
+    if (HAVE_OPT(AUTO_METHOD) && tcpreplay_auto_method(ctx, HAVE_OPT(QDISC_BYPASS)) < 0)
+        return -1;
+
     /* open interfaces for writing */
     if ((ctx->intf1 = sendpacket_open(options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type)) == NULL) {
         tcpreplay_seterr(ctx, "Can't open %s: %s", options->intf1_name, ebuf);
@@ -295,11 +556,12 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
     ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
 
     if (HAVE_OPT(INTF2)) {
-        if (!HAVE_OPT(CACHEFILE) && !HAVE_OPT(DUALFILE)) {
-            tcpreplay_seterr(ctx, "--intf2=%s requires either --cachefile or --dualfile", OPT_ARG(INTF2));
+        if (!HAVE_OPT(CACHEFILE) && !HAVE_OPT(DUALFILE) && !HAVE_OPT(PCAPNG_INTF) && !HAVE_OPT(PREP)) {
+            tcpreplay_seterr(ctx, "--intf2=%s requires either --cachefile, --dualfile, --pcapng-intf or --prep",
+                    OPT_ARG(INTF2));
             return -1;
         }
-        if ((intname = get_interface(ctx->intlist, OPT_ARG(INTF2))) == NULL) {
+        if ((intname = tcpreplay_intf_name(ctx, OPT_ARG(INTF2))) == NULL) {
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF2));
             return -1;
         }
@@ -320,6 +582,92 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         }
     }
 
+    if (HAVE_OPT(QDISC_BYPASS) && tcpreplay_set_qdisc_bypass(ctx, true) < 0)
+        return -1;
+
+    if (HAVE_OPT(TX_TELEMETRY))
+        tcpreplay_set_tx_telemetry(ctx, true);
+
+    if (HAVE_OPT(TX_TIMESTAMPS) && tcpreplay_set_tx_timestamps(ctx, true) < 0)
+        return -1;
+
+    if (HAVE_OPT(BACKOFF)) {
+        if (strcmp(OPT_ARG(BACKOFF), "adaptive") == 0) {
+            tcpreplay_set_backoff(ctx, SP_BACKOFF_ADAPTIVE);
+        } else if (strcmp(OPT_ARG(BACKOFF), "spin") == 0) {
+            tcpreplay_set_backoff(ctx, SP_BACKOFF_SPIN);
+        } else if (strcmp(OPT_ARG(BACKOFF), "yield") == 0) {
+            tcpreplay_set_backoff(ctx, SP_BACKOFF_YIELD);
+        } else if (strcmp(OPT_ARG(BACKOFF), "poll") == 0) {
+            tcpreplay_set_backoff(ctx, SP_BACKOFF_POLL);
+        } else {
+            tcpreplay_seterr(ctx, "Unsupported backoff: %s", OPT_ARG(BACKOFF));
+            return -1;
+        }
+    }
+
+    if (HAVE_OPT(LATE_POLICY) || HAVE_OPT(LATE_THRESHOLD)) {
+        tcpreplay_late_policy policy = late_default;
+
+        if (!HAVE_OPT(LATE_POLICY)) {
+            /* keep the default policy, with the threshold given */
+        } else if (strcmp(OPT_ARG(LATE_POLICY), "catchup") == 0) {
+            policy = late_catchup;
+        } else if (strcmp(OPT_ARG(LATE_POLICY), "stretch") == 0) {
+            policy = late_stretch;
+        } else if (strcmp(OPT_ARG(LATE_POLICY), "drop") == 0) {
+            policy = late_drop;
+        } else if (strcmp(OPT_ARG(LATE_POLICY), "fail") == 0) {
+            policy = late_fail;
+        } else {
+            tcpreplay_seterr(ctx, "Unsupported late policy: %s", OPT_ARG(LATE_POLICY));
+            return -1;
+        }
+
+        if (tcpreplay_set_late_policy(ctx, policy, HAVE_OPT(LATE_THRESHOLD) ?
+                (uint64_t)OPT_VALUE_LATE_THRESHOLD * 1000 : LATE_THRESHOLD_NSEC) < 0)
+            return -1;
+    }
+
+    if (HAVE_OPT(STAGE_PROFILE))
+        tcpreplay_set_stage_profile(ctx, OPT_VALUE_STAGE_PROFILE);
+
+    if (HAVE_OPT(HELPER_CPU) && tcpreplay_set_helper_cpus(ctx, OPT_ARG(HELPER_CPU)) < 0)
+        return -1;
+
+    if (HAVE_OPT(CPU) && tcpreplay_set_sender_cpus(ctx, OPT_ARG(CPU)) < 0)
+        return -1;
+
+    if (HAVE_OPT(RT_PRIORITY) && tcpreplay_set_rt_priority(ctx, OPT_VALUE_RT_PRIORITY) < 0)
+        return -1;
+
+    if (HAVE_OPT(MLOCK) && tcpreplay_set_mlock(ctx, true) < 0)
+        return -1;
+
+    if (options->csum_offload) {
+        if (ctx->intf1dlt != DLT_EN10MB) {
+            tcpreplay_seterr(ctx, "--csum-offload requires an Ethernet interface, %s is %s",
+                    options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt));
+            return -1;
+        }
+        if (tcpreplay_set_csum_offload(ctx, true) < 0)
+            return -1;
+    }
+
+    if (options->gso) {
+        if (ctx->intf1dlt != DLT_EN10MB) {
+            tcpreplay_seterr(ctx, "--gso requires an Ethernet interface, %s is %s",
+                    options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt));
+            return -1;
+        }
+        if (tcpreplay_set_gso(ctx, true) < 0)
+            return -1;
+    }
+
+    if (options->accurate == accurate_txtime &&
+            tcpreplay_set_accurate(ctx, accurate_txtime) < 0)
+        return -1;
+
     if (HAVE_OPT(CACHEFILE)) {
         temp = safe_strdup(OPT_ARG(CACHEFILE));
         options->cache_packets = read_cache(&options->cachedata, temp,
@@ -327,6 +675,86 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         safe_free(temp);
     }
 
+    if (HAVE_OPT(PREP) && tcpreplay_set_prep(ctx, OPT_ARG(PREP)) < 0)
+        return -1;
+
+    if (HAVE_OPT(QUEUE_MAP) && tcpreplay_set_queue_map(ctx, OPT_ARG(QUEUE_MAP)) < 0)
+        return -1;
+
+#ifdef ENABLE_FRAGROUTE
+    if (HAVE_OPT(FRAGROUTE) && tcpreplay_set_fragroute(ctx, OPT_ARG(FRAGROUTE)) < 0)
+        return -1;
+
+    if (HAVE_OPT(FRAGDIR) && tcpreplay_set_fragdir(ctx, OPT_ARG(FRAGDIR)) < 0)
+        return -1;
+#endif
+
+    if (tcpreplay_open_workers(ctx) < 0)
+        return -1;
+
+    if (tcpreplay_open_merge_intf(ctx, argc) < 0)
+        return -1;
+
+    if (tcpreplay_open_fanout_intf(ctx) < 0)
+        return -1;
+
+    if (HAVE_OPT(STATS_EXPORT) || HAVE_OPT(STATS_PORT)) {
+        stats_export_format_t format = STATS_EXPORT_JSON;
+
+        if (HAVE_OPT(STATS_FORMAT)) {
+            if (strcmp(OPT_ARG(STATS_FORMAT), "prometheus") == 0) {
+                format = STATS_EXPORT_PROMETHEUS;
+            } else if (strcmp(OPT_ARG(STATS_FORMAT), "json") != 0) {
+                tcpreplay_seterr(ctx, "Invalid --stats-format: %s", OPT_ARG(STATS_FORMAT));
+                return -1;
+            }
+        }
+
+        if (tcpreplay_set_stats_export(ctx, HAVE_OPT(STATS_EXPORT) ? OPT_ARG(STATS_EXPORT) : NULL,
+                format, HAVE_OPT(STATS_BIND) ? OPT_ARG(STATS_BIND) : NULL,
+                HAVE_OPT(STATS_PORT) ? OPT_VALUE_STATS_PORT : 0) < 0)
+            return -1;
+    }
+
+    if (HAVE_OPT(CONTROL_SHM) && tcpreplay_set_control_shm(ctx, OPT_ARG(CONTROL_SHM)) == NULL)
+        return -1;
+
+    if (HAVE_OPT(TIMELINE)) {
+        timeline_format_t format = TIMELINE_CSV;
+
+        if (HAVE_OPT(TIMELINE_FORMAT)) {
+            if (strcmp(OPT_ARG(TIMELINE_FORMAT), "json") == 0) {
+                format = TIMELINE_JSON;
+            } else if (strcmp(OPT_ARG(TIMELINE_FORMAT), "csv") != 0) {
+                tcpreplay_seterr(ctx, "Invalid --timeline-format: %s", OPT_ARG(TIMELINE_FORMAT));
+                return -1;
+            }
+        }
+
+        if (tcpreplay_set_timeline(ctx, OPT_ARG(TIMELINE), format,
+                OPT_VALUE_TIMELINE_INTERVAL) < 0)
+            return -1;
+    }
+
+    if (HAVE_OPT(MEASURE)) {
+        int offset = MEASURE_TRAILER;
+        char *end;
+
+        if (HAVE_OPT(MEASURE_OFFSET) && strcmp(OPT_ARG(MEASURE_OFFSET), "trailer") != 0) {
+            offset = (int)strtol(OPT_ARG(MEASURE_OFFSET), &end, 10);
+            if (*end != '\0' || offset < 0 || offset > MAXPACKET) {
+                tcpreplay_seterr(ctx, "Invalid --measure-offset: %s", OPT_ARG(MEASURE_OFFSET));
+                return -1;
+            }
+        }
+
+        if (tcpreplay_set_measure(ctx, OPT_ARG(MEASURE), offset) < 0)
+            return -1;
+    }
+
+    if (tcpreplay_check_send_loop(ctx) < 0)
+        return -1;
+
     /* return -2 on warnings */
     if (warn > 0)
         return -2;
@@ -342,38 +770,142 @@ tcpreplay_close(tcpreplay_t *ctx)
 {
     tcpreplay_opt_t *options;
     interface_list_t *intlist, *intlistnext;
-    packet_cache_t *packet_cache, *next;
+    int i, j;
 
     assert(ctx);
     assert(ctx->options);
     options = ctx->options;
 
+#ifdef HAVE_LIBPTHREAD
+    /* don't free anything an async replay is still using */
+    if (ctx->async_started) {
+        tcpreplay_abort(ctx);
+        tcpreplay_wait(ctx);
+    }
+
+    send_packets_window_stop(ctx);
+#endif
+
+    if (ctx->stats_export != NULL) {
+        stats_export_publish(ctx->stats_export, &ctx->stats, ctx->intf1, ctx->intf2, false);
+        stats_export_close(ctx->stats_export);
+        ctx->stats_export = NULL;
+    }
+    safe_free(options->stats_export);
+    safe_free(options->stats_bind);
+
+    ctl_block_close(ctx->ctl, options->control_shm);
+    ctx->ctl = NULL;
+    safe_free(options->control_shm);
+
+    if (ctx->timeline != NULL) {
+        /* the last, partial, interval */
+        timeline_sample(ctx->timeline, &ctx->stats, ctx->intf1, ctx->intf2);
+        timeline_close(ctx->timeline);
+        ctx->timeline = NULL;
+    }
+    safe_free(options->timeline);
+
+    measure_close(ctx->measure);
+    ctx->measure = NULL;
+    safe_free(options->measure_intf);
+
+    rate_profile_free(ctx->rate_profile);
+    safe_free(options->rate_profile);
+
+    safe_free(options->sender_cpus);
+    safe_free(options->helper_cpus);
+
     safe_free(options->intf1_name);
     safe_free(options->intf2_name);
+    for (i = 0; i < options->merge_intf_cnt; i++)
+        safe_free(options->merge_intf_names[i]);
+    if (ctx->merge_intf != NULL) {
+        for (i = 1; i < ctx->merge_intf_cnt; i++)
+            sendpacket_close(ctx->merge_intf[i]);
+        safe_free(ctx->merge_intf);
+        safe_free(ctx->merge_map);
+    }
+    for (i = 0; i < options->fanout_intf_cnt; i++)
+        safe_free(options->fanout_intf_names[i]);
+    if (ctx->fanout_intf != NULL) {
+        for (i = 0; i < ctx->fanout_intf_cnt; i++)
+            sendpacket_close(ctx->fanout_intf[i]);
+        safe_free(ctx->fanout_intf);
+    }
+    if (ctx->worker_intf != NULL) {
+        for (i = 1; i < options->workers; i++) {
+            if (ctx->worker_intf[i] != NULL)
+                sendpacket_close(ctx->worker_intf[i]);
+        }
+        safe_free(ctx->worker_intf);
+    }
+    if (ctx->worker_counters != NULL) {
+        free(ctx->worker_counters);
+        ctx->worker_counters = NULL;
+    }
+    safe_free(ctx->wire_due);
     sendpacket_close(ctx->intf1);
     if (ctx->intf2 != NULL)
         sendpacket_close(ctx->intf2);
-    safe_free(options->cachedata);
+    close_cache(options->cachedata, options->cache_packets);
     safe_free(options->comment);
+    destroy_cidr(options->prep_cidr);
+    safe_free(options->prep_services);
+    safe_free(options->queue_map);
 
 #ifdef ENABLE_VERBOSE
     safe_free(options->tcpdump_args);
     tcpdump_close(options->tcpdump);
 #endif
 
-    /* free the flow hash table */
+    /* free the flow hash table, which writes out the open flows' records */
     flow_hash_table_release(ctx->flow_hash_table);
+    safe_free(ctx->scratch);
+    if (ctx->flow_records != NULL) {
+        flow_records_close(ctx->flow_records);
+        ctx->flow_records = NULL;
+    }
+    safe_free(options->flow_records);
+
+#ifdef TIMESTAMP_TRACE
+    safe_free(ctx->trace);
+#endif
+
+    /* free the worker partitions of the file cache */
+    for (i = 0; i < options->source_cnt; i++) {
+        if (options->file_cache[i].worker_cache == NULL)
+            continue;
+
+        for (j = 0; j < options->workers; j++)
+            safe_free(options->file_cache[i].worker_cache[j]);
+
+        safe_free(options->file_cache[i].worker_cache);
+        safe_free(options->file_cache[i].worker_cache_cnt);
+    }
+
+    for (i = 0; i < options->source_cnt; i++) {
+        pcap_index_free(options->sources[i].index);
+        if (options->sources[i].reader != NULL)
+            pcap_close(options->sources[i].reader);
+        /* a directory's reader thread stops when its socket is closed */
+        if (options->sources[i].fd_close)
+            close(options->sources[i].fd);
+        shm_ring_close(options->sources[i].shm);
+    }
 
     /* free the file cache */
     if (options->file_cache != NULL) {
-        packet_cache = options->file_cache->packet_cache;
-        while (packet_cache != NULL) {
-            next = packet_cache->next;
-            safe_free(packet_cache->pktdata);
-            safe_free(packet_cache);
-            packet_cache = next;
-        }
+        for (i = 0; i < options->source_cnt; i++)
+            packet_cache_free(&options->file_cache[i]);
     }
+    tcp_segment_free(&ctx->segs);
+
+#ifdef ENABLE_FRAGROUTE
+    if (ctx->frag_ctx != NULL)
+        fragroute_close(ctx->frag_ctx);
+    safe_free(ctx->frag_delayed);
+#endif
 
     /* free our interface list */
     if (ctx->intlist != NULL) {
@@ -396,7 +928,6 @@ tcpreplay_close(tcpreplay_t *ctx)
 int
 tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
 {
-    static int int1dlt = -1, int2dlt = -1;
     char *intname;
     char ebuf[SENDPACKET_ERRBUF_SIZE];
 
@@ -404,7 +935,7 @@ tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
     assert(value);
 
     if (intf == intf1) {
-        if ((intname = get_interface(ctx->intlist, value)) == NULL) {
+        if ((intname = tcpreplay_intf_name(ctx, value)) == NULL) {
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", value);
             return -1;
         }
@@ -417,9 +948,9 @@ tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
             return -1;
         }
 
-        int1dlt = sendpacket_get_dlt(ctx->intf1);
+        ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
     } else if (intf == intf2) {
-        if ((intname = get_interface(ctx->intlist, value)) == NULL) {
+        if ((intname = tcpreplay_intf_name(ctx, value)) == NULL) {
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", ctx->options->intf2_name);
             return -1;
         }
@@ -431,18 +962,18 @@ tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
             tcpreplay_seterr(ctx, "Can't open %s: %s", ctx->options->intf2_name, ebuf);
             return -1;
         }
-        int2dlt = sendpacket_get_dlt(ctx->intf2);
+        ctx->intf2dlt = sendpacket_get_dlt(ctx->intf2);
     }
 
     /*
      * If both interfaces are selected, then make sure both interfaces use
      * the same DLT type
      */
-    if (int1dlt != -1 && int2dlt != -1) {
-        if (int1dlt != int2dlt) {
+    if (ctx->intf1dlt != -1 && ctx->intf2dlt != -1) {
+        if (ctx->intf1dlt != ctx->intf2dlt) {
             tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
-                ctx->options->intf1_name, pcap_datalink_val_to_name(int1dlt), 
-                ctx->options->intf2_name, pcap_datalink_val_to_name(int2dlt));
+                ctx->options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt), 
+                ctx->options->intf2_name, pcap_datalink_val_to_name(ctx->intf2dlt));
             return -1;
         }
     }
@@ -498,6 +1029,19 @@ tcpreplay_set_loop(tcpreplay_t *ctx, u_int32_t value)
     return 0;
 }
 
+/**
+ * Capture time in nsec between the last packet of a file or loop and the
+ * first of the next, scaled by the multiplier like any other gap.  -1, the
+ * default, is the mean gap between the packets of the file before.
+ */
+int
+tcpreplay_set_loop_gap(tcpreplay_t *ctx, int64_t value)
+{
+    assert(ctx);
+    ctx->options->loop_gap_ns = value;
+    return 0;
+}
+
 /**
  * Set the unique IP address flag
  */
@@ -510,79 +1054,1148 @@ tcpreplay_set_unique_ip(tcpreplay_t *ctx, int value)
 }
 
 /**
- * Set netmap mode
+ * Set how many preloaded packets ahead of the one being sent have their
+ * data prefetched, 0 to turn prefetching off
  */
 int
-tcpreplay_set_netmap(tcpreplay_t *ctx, bool value)
+tcpreplay_set_prefetch(tcpreplay_t *ctx, int value)
 {
     assert(ctx);
-#ifdef HAVE_NETMAP
-    ctx->options->netmap = value;
-    return 0;
-#else
-    warn("netmap not compiled in");
-    return -1;
-#endif
+    if (value < 0 || value > PACKET_PREFETCH_MAX) {
+        tcpreplay_seterr(ctx, "prefetch distance must be between 0 and %d", PACKET_PREFETCH_MAX);
+        return -1;
+    }
+
+    ctx->options->prefetch = value;
     return 0;
 }
 
 /**
- * Tell tcpreplay to ignore the snaplen (default) and use the "actual"
- * packet len instead
+ * Set the max number of packets passed to the injector at once
+ * when sending at top speed
  */
 int
-tcpreplay_set_use_pkthdr_len(tcpreplay_t *ctx, bool value)
+tcpreplay_set_batch_size(tcpreplay_t *ctx, int value)
 {
     assert(ctx);
-    ctx->options->use_pkthdr_len = value;
+    if (value < 1 || value > SENDPACKET_BATCH_MAX) {
+        tcpreplay_seterr(ctx, "batch size must be between 1 and %d", SENDPACKET_BATCH_MAX);
+        return -1;
+    }
+
+    ctx->options->batch_size = value;
     return 0;
 }
 
 /**
- * Override the outbound MTU
+ * Set the number of threads sending packets.  Requires preloading.
  */
 int
-tcpreplay_set_mtu(tcpreplay_t *ctx, int value)
+tcpreplay_set_workers(tcpreplay_t *ctx, int value)
 {
     assert(ctx);
-    ctx->options->mtu = value;
+    if (value < 1 || value > MAX_WORKERS) {
+        tcpreplay_seterr(ctx, "number of workers must be between 1 and %d", MAX_WORKERS);
+        return -1;
+    }
+
+    ctx->options->workers = value;
     return 0;
 }
 
 /**
- * Sets the accurate timing mode
+ * Send every preloaded packet as this many copies, each one with its own
+ * IP addresses, as if from that many clients.  Requires preloading.
  */
 int
-tcpreplay_set_accurate(tcpreplay_t *ctx, tcpreplay_accurate value)
+tcpreplay_set_clients(tcpreplay_t *ctx, uint32_t value)
 {
     assert(ctx);
-    ctx->options->accurate = value;
+    if (value < 1 || value > MAX_CLIENTS) {
+        tcpreplay_seterr(ctx, "number of clients must be between 1 and %d", MAX_CLIENTS);
+        return -1;
+    }
+
+    ctx->options->clients = value;
     return 0;
 }
 
 /**
- * Sets the number of seconds between printing stats
+ * Keep the timing of every flow and reach the --mbps or --pps rate by
+ * sending as many copies of the file at once as it takes, each with its
+ * own IP addresses like --clients.  Requires preloading.
  */
 int
-tcpreplay_set_stats(tcpreplay_t *ctx, int value)
+tcpreplay_set_flow_timing(tcpreplay_t *ctx, bool value)
 {
     assert(ctx);
-    ctx->options->stats = value;
+
+    ctx->options->flow_timing = value;
     return 0;
 }
 
 /**
- * \brief Enable or disable dual file mode
+ * Keep reading directory and glob sources as files are added to them, so
+ * the replay only ends when it is stopped.  Set it before adding them.
+ */
+int
+tcpreplay_set_follow(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->follow = value;
+    return 0;
+}
+
+#ifdef TCPREPLAY_EDIT
+/**
+ * Edit every packet with this tcpedit context before sending it, NULL to
+ * send packets as they are.  The caller keeps ownership.
+ */
+int
+tcpreplay_set_tcpedit(tcpreplay_t *ctx, tcpedit_t *tcpedit)
+{
+    assert(ctx);
+    ctx->tcpedit = tcpedit;
+    if (tcpedit != NULL)
+        tcpedit_set_csum_offload(tcpedit, ctx->options->csum_offload);
+    return 0;
+}
+#endif
+
+/**
+ * Back the preload cache with hugepages of the given size in MB
+ * (2 or 1024), bound to the NUMA node of the output interface.
+ * A value of 0 uses regular pages.
+ */
+int
+tcpreplay_set_hugepage_size(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+#ifdef MAP_HUGETLB
+    if (value != 0 && value != 2 && value != 1024) {
+        tcpreplay_seterr(ctx, "hugepage size must be 2 or 1024 MB, not %d", value);
+        return -1;
+    }
+
+    ctx->options->hugepage_size = (size_t)value * 1024 * 1024;
+    return 0;
+#else
+    if (value == 0)
+        return 0;
+
+    tcpreplay_seterr(ctx, "%s", "hugepages are not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * Read pcap files by mapping them into memory rather than through libpcap.
+ * Files which can't be mapped are still read via libpcap.
+ */
+int
+tcpreplay_set_mmap_pcap(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->mmap_pcap = value;
+    return 0;
+}
+
+/**
+ * Send packets of multi-interface pcapng files out intf1 if they were
+ * captured on interface 0 and out intf2 otherwise.  Only the mapped
+ * reader knows the interface, so this turns on mmap_pcap.
+ */
+int
+tcpreplay_set_pcapng_intf(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->pcapng_intf = value;
+    if (value)
+        ctx->options->mmap_pcap = true;
+    return 0;
+}
+
+/**
+ * Read and edit packets on their own thread when not preloading.
+ */
+int
+tcpreplay_set_pipeline(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+#ifdef HAVE_LIBPTHREAD
+    ctx->options->pipeline = value;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "--pipeline requires pthread support");
+    return value ? -1 : 0;
+#endif
+}
+
+/**
+ * Send each --dualfile interface from its own thread
+ */
+int
+tcpreplay_set_dual_queues(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+#ifdef HAVE_LIBPTHREAD
+    ctx->options->dual_queues = value;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "--dual-queues requires pthread support");
+    return value ? -1 : 0;
+#endif
+}
+
+/**
+ * Read ahead of the replay by up to value MB on a reader thread that
+ * carries on through every file and --loop pass.  0 turns it off.
+ */
+int
+tcpreplay_set_preload_window(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+#ifdef HAVE_LIBPTHREAD
+    if (value < 0) {
+        tcpreplay_seterr(ctx, "invalid --preload-window: %d", value);
+        return -1;
+    }
+
+    ctx->options->preload_window = (size_t)value * 1024 * 1024;
+    ctx->options->pipeline = value > 0;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "--preload-window requires pthread support");
+    return value ? -1 : 0;
+#endif
+}
+
+/**
+ * Write a record of every flow the flow stats track to file as it
+ * expires or once the replay is over, see flow_records.c.  Must be set
+ * before any packet is counted.
+ */
+int
+tcpreplay_set_flow_records(tcpreplay_t *ctx, const char *file)
+{
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+
+    assert(ctx);
+    assert(file);
+
+    if (ctx->flow_records != NULL) {
+        tcpreplay_seterr(ctx, "%s", "flow records are already being written");
+        return -1;
+    }
+
+    if (!ctx->options->flow_stats) {
+        tcpreplay_seterr(ctx, "%s", "--flow-records requires flow stats");
+        return -1;
+    }
+
+    if ((ctx->flow_records = flow_records_open(file, ebuf, sizeof(ebuf))) == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    flow_hash_table_records(ctx->flow_hash_table, ctx->flow_records);
+    ctx->options->flow_records = safe_strdup(file);
+    return 0;
+}
+
+/**
+ * Give up on --preload-pcap once its cache holds more than value MB and
+ * replay from disk instead, see preload_pcap_files().  0 for no limit.
+ */
+int
+tcpreplay_set_max_memory(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+    if (value < 0) {
+        tcpreplay_seterr(ctx, "invalid --max-memory: %d", value);
+        return -1;
+    }
+
+    ctx->options->max_memory = (size_t)value * 1024 * 1024;
+    return 0;
+}
+
+/**
+ * Export statistics while replaying: rewrite file (if not NULL) in the
+ * given format every --stats seconds (default 1), and serve them over
+ * HTTP on port (if not 0) of bind_addr, or of 127.0.0.1 when bind_addr
+ * is NULL.  Runs on its own thread.
+ */
+int
+tcpreplay_set_stats_export(tcpreplay_t *ctx, const char *file,
+        stats_export_format_t format, const char *bind_addr, int port)
+{
+    tcpreplay_opt_t *options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+
+    assert(ctx);
+    options = ctx->options;
+
+    if (ctx->stats_export != NULL) {
+        tcpreplay_seterr(ctx, "%s", "statistics are already being exported");
+        return -1;
+    }
+
+    safe_free(options->stats_export);
+    options->stats_export = file ? safe_strdup(file) : NULL;
+    options->stats_format = format;
+    options->stats_port = port;
+    safe_free(options->stats_bind);
+    options->stats_bind = bind_addr ? safe_strdup(bind_addr) : NULL;
+
+    ctx->stats_export = stats_export_open(file, format, bind_addr, port, options->stats,
+            ebuf, sizeof(ebuf));
+    if (ctx->stats_export == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write a row of achieved versus target rate to file every interval_ms
+ * while replaying, see timeline.c
+ */
+int
+tcpreplay_set_timeline(tcpreplay_t *ctx, const char *file,
+        timeline_format_t format, uint32_t interval_ms)
+{
+    tcpreplay_opt_t *options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+
+    assert(ctx);
+    assert(file);
+    options = ctx->options;
+
+    if (ctx->timeline != NULL) {
+        tcpreplay_seterr(ctx, "%s", "a timeline is already being written");
+        return -1;
+    }
+
+    if ((ctx->timeline = timeline_open(file, format, interval_ms, ebuf, sizeof(ebuf))) == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    safe_free(options->timeline);
+    options->timeline = safe_strdup(file);
+    options->timeline_format = format;
+    options->timeline_interval = interval_ms;
+    return 0;
+}
+
+/**
+ * Tag every packet sent and match them up as they are received on intf,
+ * see measure_open().  offset is where the tag goes in each frame, or
+ * MEASURE_TRAILER.  Receiving starts right away.
+ */
+int
+tcpreplay_set_measure(tcpreplay_t *ctx, const char *intf, int offset)
+{
+    tcpreplay_opt_t *options;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    char *intname;
+
+    assert(ctx);
+    assert(intf);
+    options = ctx->options;
+
+    if (ctx->measure != NULL) {
+        tcpreplay_seterr(ctx, "%s", "already measuring");
+        return -1;
+    }
+
+    if ((intname = tcpreplay_intf_name(ctx, intf)) == NULL) {
+        tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", intf);
+        return -1;
+    }
+
+    if ((ctx->measure = measure_open(intname, offset, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "Can't open %s for --measure: %s", intname, ebuf);
+        return -1;
+    }
+
+    if (measure_start(ctx->measure, ebuf) < 0) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        measure_close(ctx->measure);
+        ctx->measure = NULL;
+        return -1;
+    }
+
+    safe_free(options->measure_intf);
+    options->measure_intf = safe_strdup(intname);
+    options->measure_offset = offset;
+    return 0;
+}
+
+/*
+ * --tx-timestamps and --measure only work in the single file send loop,
+ * which the command line and tcpreplay_prepare() both have to check
+ */
+static int
+tcpreplay_check_send_loop(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    /* only the single file send loop tags packets, one at a time */
+    if (ctx->measure != NULL && (options->dualfile || options->merge ||
+            options->workers > 1 || options->clients > 1 || options->flow_timing ||
+            options->batch_size > 1 || options->segment_mtu || ctx->frag_ctx != NULL)) {
+        tcpreplay_seterr(ctx, "%s", "Can't use --measure with --dualfile, --merge, --workers, "
+                "--clients, --flow-timing, --batch-size, --segment or --fragroute");
+        return -1;
+    }
+
+    /* departure times are only read back from intf1 by the main sender */
+    if (options->tx_timestamps && (options->intf2_name != NULL || options->merge ||
+            options->workers > 1 || options->clients > 1 || options->flow_timing)) {
+        tcpreplay_seterr(ctx, "%s", "Can't use --tx-timestamps with a second interface, --merge, "
+                "--workers, --clients or --flow-timing");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Ends --measure once the replay is over
+ *
+ * Waits MEASURE_LINGER_MS for the packets in flight, stops receiving and
+ * adds the results to the statistics.
+ */
+void
+tcpreplay_measure_stop(tcpreplay_t *ctx)
+{
+    measure_t *m = ctx->measure;
+    tcpreplay_stats_t *stats = &ctx->stats;
+
+    if (m == NULL || !m->running)
+        return;
+
+    measure_stop(m, MEASURE_LINGER_MS);
+    memcpy(&stats->latency, &m->latency, sizeof(stats->latency));
+    stats->measure_sent = m->seq;
+    stats->measure_received = m->received;
+    stats->measure_reordered = m->reordered;
+    stats->measure_duplicates = m->duplicates;
+    stats->measure_early = m->early;
+    if (m->skipped)
+        warnx("--measure: " COUNTER_SPEC " packets were too short to tag", m->skipped);
+}
+
+/**
+ * Bypass the kernel's queueing discipline layer on PF_PACKET interfaces.
+ * Applies to interfaces which are already open as well as any opened later.
+ */
+int
+tcpreplay_set_qdisc_bypass(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->qdisc_bypass = value;
+
+    if (ctx->intf1 != NULL && sendpacket_set_qdisc_bypass(ctx->intf1, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf1_name,
+                sendpacket_geterr(ctx->intf1));
+        return -1;
+    }
+
+    if (ctx->intf2 != NULL && sendpacket_set_qdisc_bypass(ctx->intf2, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf2_name,
+                sendpacket_geterr(ctx->intf2));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Time the send gaps of intf1 by when its packets left, taken from
+ * hardware or software transmit timestamps, see
+ * sendpacket_set_tx_timestamps().  intf1 must already be open.
+ */
+int
+tcpreplay_set_tx_timestamps(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    if (value && ctx->intf1 == NULL) {
+        tcpreplay_seterr(ctx, "%s", "--tx-timestamps requires an open interface");
+        return -1;
+    }
+
+    if (ctx->intf1 != NULL && sendpacket_set_tx_timestamps(ctx->intf1, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf1_name,
+                sendpacket_geterr(ctx->intf1));
+        return -1;
+    }
+
+    ctx->options->tx_timestamps = value;
+    safe_free(ctx->wire_due);
+    ctx->wire_due = NULL;
+    if (value) {
+        ctx->wire_due = (wire_due_t *)safe_malloc(TX_TSTAMP_PENDING * sizeof(wire_due_t));
+        ctx->wire_next_id = 0;
+        ctx->wire_seen = 0;
+        ctx->wire_last_ns = 0;
+        ctx->wire_countdown = TX_TSTAMP_DRAIN;
+        ctx->wire_restart = true;
+    }
+
+    return 0;
+}
+
+/**
+ * Have the kernel or NIC complete TCP/UDP checksums of PF_PACKET interfaces.
+ * Applies to interfaces which are already open as well as any worker opened
+ * later, and tells the tcpedit context to leave the checksums alone.  The
+ * tcpedit context is only told once every open interface has accepted, as
+ * sendpacket sends the frames of any other interface as they are.
+ */
+int
+tcpreplay_set_csum_offload(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->csum_offload = value;
+
+    if (ctx->intf1 != NULL && sendpacket_set_csum_offload(ctx->intf1, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf1_name,
+                sendpacket_geterr(ctx->intf1));
+        ctx->options->csum_offload = false;
+        return -1;
+    }
+
+    if (ctx->intf2 != NULL && sendpacket_set_csum_offload(ctx->intf2, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf2_name,
+                sendpacket_geterr(ctx->intf2));
+        ctx->options->csum_offload = false;
+        return -1;
+    }
+
+#ifdef TCPREPLAY_EDIT
+    if (ctx->tcpedit != NULL)
+        tcpedit_set_csum_offload(ctx->tcpedit, value);
+#endif
+
+    return 0;
+}
+
+/**
+ * Have the kernel or NIC segment TCP packets longer than the MTU of
+ * PF_PACKET interfaces, see sendpacket_set_gso().  Applies to interfaces
+ * which are already open as well as any worker opened later.
+ */
+int
+tcpreplay_set_gso(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->gso = value;
+
+    if (ctx->intf1 != NULL && sendpacket_set_gso(ctx->intf1, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf1_name,
+                sendpacket_geterr(ctx->intf1));
+        return -1;
+    }
+
+    if (ctx->intf2 != NULL && sendpacket_set_gso(ctx->intf2, value) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf2_name,
+                sendpacket_geterr(ctx->intf2));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Time every send and sample TX ring occupancy, see sendpacket_set_telemetry().
+ * Applies to interfaces which are already open as well as any worker opened
+ * later.
+ */
+int
+tcpreplay_set_tx_telemetry(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->tx_telemetry = value;
+
+    if (ctx->intf1 != NULL)
+        sendpacket_set_telemetry(ctx->intf1, value);
+
+    if (ctx->intf2 != NULL)
+        sendpacket_set_telemetry(ctx->intf2, value);
+
+    return 0;
+}
+
+/**
+ * What to do with packets more than threshold_ns behind their time.  The
+ * lateness of every packet goes into the stats either way.
+ */
+int
+tcpreplay_set_late_policy(tcpreplay_t *ctx, tcpreplay_late_policy value, uint64_t threshold_ns)
+{
+    assert(ctx);
+
+    if (value < late_default || value > late_fail) {
+        tcpreplay_seterr(ctx, "Invalid late policy: %d", value);
+        return -1;
+    }
+
+    ctx->options->late_policy = value;
+    ctx->options->late_threshold_ns = threshold_ns;
+    return 0;
+}
+
+/**
+ * How interfaces wait out EAGAIN and ENOBUFS, see sendpacket_set_backoff().
+ * Applies to interfaces which are already open as well as any worker opened
+ * later.
+ */
+int
+tcpreplay_set_backoff(tcpreplay_t *ctx, sendpacket_backoff_t value)
+{
+    assert(ctx);
+
+    ctx->options->backoff = value;
+
+    if (ctx->intf1 != NULL)
+        sendpacket_set_backoff(ctx->intf1, value);
+
+    if (ctx->intf2 != NULL)
+        sendpacket_set_backoff(ctx->intf2, value);
+
+    return 0;
+}
+
+/**
+ * Time how long 1 in every value packets spends reading, editing, in the
+ * flow stats, sleeping and sending, reported with the stats.  0 disables.
+ */
+int
+tcpreplay_set_stage_profile(tcpreplay_t *ctx, uint32_t value)
+{
+    assert(ctx);
+
+    ctx->options->stage_profile = value;
+    ctx->stats.stage_every = value;
+    ctx->stage_countdown = 0;
+    return 0;
+}
+
+/**
+ * Parses a --cpu or --helper-cpu list, which may only name CPUs this
+ * process is allowed to run on.
+ */
+static cpu_list_t *
+tcpreplay_parse_cpus(tcpreplay_t *ctx, const char *spec, const cpu_list_t *current)
+{
+    cpu_list_t *cpus;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    int i;
+
+    cpus = (cpu_list_t *)safe_malloc(sizeof(cpu_list_t));
+    if (cpu_list_parse(cpus, spec, ebuf, sizeof(ebuf)) < 0) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        safe_free(cpus);
+        return NULL;
+    }
+
+    for (i = 0; i < cpus->cnt; i++) {
+        if (!cpu_list_has(current, cpus->cpus[i])) {
+            tcpreplay_seterr(ctx, "CPU %d is offline or not allowed", cpus->cpus[i]);
+            safe_free(cpus);
+            return NULL;
+        }
+    }
+
+    return cpus;
+}
+
+/**
+ * \brief Pins the sending threads to the CPUs of a list such as "0,2-5"
+ *
+ * Worker i runs on the ith CPU, wrapping around.  "auto" takes one CPU
+ * per worker from the NUMA node of intf1, so open it and set the workers
+ * first.  Unless helper CPUs were already set, the helper threads get
+ * the CPUs left over.  NULL lets the senders run anywhere again.
+ */
+int
+tcpreplay_set_sender_cpus(tcpreplay_t *ctx, const char *spec)
+{
+    tcpreplay_opt_t *options;
+    cpu_list_t *cpus, current;
+    int node, senders;
+
+    assert(ctx);
+    options = ctx->options;
+
+    safe_free(options->sender_cpus);
+    options->sender_cpus = NULL;
+    if (spec == NULL)
+        return 0;
+
+    if (cpu_list_current(&current) < 0) {
+        tcpreplay_seterr(ctx, "Unable to get the CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+
+    if (strcmp(spec, "auto") != 0) {
+        if ((cpus = tcpreplay_parse_cpus(ctx, spec, &current)) == NULL)
+            return -1;
+    } else {
+        if (ctx->intf1 == NULL) {
+            tcpreplay_seterr(ctx, "%s", "--cpu=auto requires an open interface");
+            return -1;
+        }
+
+        cpus = (cpu_list_t *)safe_malloc(sizeof(cpu_list_t));
+        node = sendpacket_get_numa_node(ctx->intf1);
+        if (cpu_list_node(cpus, node) == 0)
+            cpu_list_intersect(cpus, &current);
+
+        if (cpus->cnt == 0) {
+            dbgx(1, "No NUMA node for %s, choosing among all CPUs", options->intf1_name);
+            memcpy(cpus, &current, sizeof(current));
+        }
+
+        /* CPU 0 takes most interrupts and housekeeping */
+        if (cpus->cnt > 1 && cpus->cpus[0] == 0) {
+            memmove(&cpus->cpus[0], &cpus->cpus[1], sizeof(int) * (cpus->cnt - 1));
+            cpus->cpus[cpus->cnt - 1] = 0;
+        }
+
+        /* the rest of the node is closest for the helpers */
+        senders = max(options->workers, 1);
+        if (options->helper_cpus == NULL && cpus->cnt > senders) {
+            options->helper_cpus = (cpu_list_t *)safe_malloc(sizeof(cpu_list_t));
+            memcpy(options->helper_cpus->cpus, &cpus->cpus[senders],
+                    sizeof(int) * (cpus->cnt - senders));
+            options->helper_cpus->cnt = cpus->cnt - senders;
+        }
+        cpus->cnt = min(cpus->cnt, senders);
+        dbgx(1, "Sending on CPUs %d-%d of NUMA node %d", cpus->cpus[0],
+                cpus->cpus[cpus->cnt - 1], node);
+    }
+
+    /*
+     * Helpers left on a sender's CPU would fight it for time, or never
+     * run at all under --rt-priority.  With no CPUs to spare they may go
+     * anywhere.
+     */
+    if (options->helper_cpus == NULL) {
+        options->helper_cpus = (cpu_list_t *)safe_malloc(sizeof(cpu_list_t));
+        memcpy(options->helper_cpus, &current, sizeof(current));
+        cpu_list_remove(options->helper_cpus, cpus);
+        if (options->helper_cpus->cnt == 0)
+            memcpy(options->helper_cpus, &current, sizeof(current));
+    }
+
+    options->sender_cpus = cpus;
+    return 0;
+}
+
+/**
+ * \brief Runs the reader, pipeline and preload threads on any CPU of a list
+ *
+ * NULL lets them run anywhere again.
+ */
+int
+tcpreplay_set_helper_cpus(tcpreplay_t *ctx, const char *spec)
+{
+    tcpreplay_opt_t *options;
+    cpu_list_t current;
+
+    assert(ctx);
+    options = ctx->options;
+
+    safe_free(options->helper_cpus);
+    options->helper_cpus = NULL;
+    if (spec == NULL)
+        return 0;
+
+    if (cpu_list_current(&current) < 0) {
+        tcpreplay_seterr(ctx, "Unable to get the CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((options->helper_cpus = tcpreplay_parse_cpus(ctx, spec, &current)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * \brief Runs the sending threads SCHED_FIFO at value, 0 for the default
+ *
+ * Fails up front when the process may not use SCHED_FIFO.
+ */
+int
+tcpreplay_set_rt_priority(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+
+    if (value > 0) {
+        if (cpu_sched_fifo(value) < 0) {
+            tcpreplay_seterr(ctx, "Unable to run SCHED_FIFO at priority %d: %s",
+                    value, strerror(errno));
+            return -1;
+        }
+        cpu_sched_fifo(0);
+    }
+
+    ctx->options->rt_priority = value;
+    return 0;
+}
+
+/**
+ * \brief Locks all memory, now and later, into RAM, or unlocks it
+ *
+ * Call it before preloading so the cache is locked as it is filled.
+ */
+int
+tcpreplay_set_mlock(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    if (value == ctx->options->mlock)
+        return 0;
+
+    if (cpu_sched_mlock(value) < 0) {
+        tcpreplay_seterr(ctx, "Unable to %s memory: %s", value ? "lock" : "unlock",
+                strerror(errno));
+        return -1;
+    }
+
+    ctx->options->mlock = value;
+    return 0;
+}
+
+/**
+ * Send via AF_XDP sockets.  Must be set before the interfaces are opened.
+ */
+int
+tcpreplay_set_af_xdp(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+#ifdef HAVE_AF_XDP
+    if (value)
+        ctx->sp_type = SP_TYPE_AF_XDP;
+    else if (ctx->sp_type == SP_TYPE_AF_XDP)
+        ctx->sp_type = SP_TYPE_NONE;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "AF_XDP support was not compiled in.  Requires Linux 5.4 or later.");
+    return value ? -1 : 0;
+#endif
+}
+
+/**
+ * Send via io_uring on a PF_PACKET socket.  Must be set before the
+ * interfaces are opened.
+ */
+int
+tcpreplay_set_io_uring(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+#ifdef HAVE_IO_URING
+    if (value)
+        ctx->sp_type = SP_TYPE_IO_URING;
+    else if (ctx->sp_type == SP_TYPE_IO_URING)
+        ctx->sp_type = SP_TYPE_NONE;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "io_uring support was not compiled in.  Requires Linux 5.6 or later.");
+    return value ? -1 : 0;
+#endif
+}
+
+/**
+ * Send via DPDK ports.  Starts the DPDK EAL with the given arguments, so
+ * it can only be called once and before the interfaces are opened.  The
+ * interfaces are then DPDK port numbers or device names.
+ */
+int
+tcpreplay_set_dpdk(tcpreplay_t *ctx, const char *eal_args)
+{
+#ifdef HAVE_DPDK
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+#endif
+
+    assert(ctx);
+#ifdef HAVE_DPDK
+    if (sendpacket_dpdk_init(eal_args, ebuf) < 0) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    ctx->sp_type = SP_TYPE_DPDK;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "DPDK support was not compiled in.  Configure with --with-dpdk.");
+    return -1;
+#endif
+}
+
+/**
+ * Replace the network interfaces with an in-process sink which discards
+ * every packet without a syscall.  The interface names are only used as
+ * labels.  Must be set before the interfaces are opened.
+ */
+int
+tcpreplay_set_null_sink(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    if (value)
+        ctx->sp_type = SP_TYPE_NULL;
+    else if (ctx->sp_type == SP_TYPE_NULL)
+        ctx->sp_type = SP_TYPE_NONE;
+    return 0;
+}
+
+/**
+ * Set netmap mode
+ */
+int
+tcpreplay_set_netmap(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+#ifdef HAVE_NETMAP
+    ctx->options->netmap = value;
+    return 0;
+#else
+    warn("netmap not compiled in");
+    return -1;
+#endif
+    return 0;
+}
+
+/**
+ * Tell tcpreplay to ignore the snaplen (default) and use the "actual"
+ * packet len instead
+ */
+int
+tcpreplay_set_use_pkthdr_len(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->use_pkthdr_len = value;
+    return 0;
+}
+
+/**
+ * Override the outbound MTU
+ */
+int
+tcpreplay_set_mtu(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+    ctx->options->mtu = value;
+    return 0;
+}
+
+/**
+ * Sets the accurate timing mode.  accurate_txtime enables SO_TXTIME on
+ * the interfaces which are already open, which must be using PF_PACKET.
+ */
+int
+tcpreplay_set_accurate(tcpreplay_t *ctx, tcpreplay_accurate value)
+{
+    assert(ctx);
+    ctx->options->accurate = value;
+
+    if (value != accurate_txtime)
+        return 0;
+
+    if (ctx->intf1 != NULL && sendpacket_enable_txtime(ctx->intf1) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf1_name,
+                sendpacket_geterr(ctx->intf1));
+        return -1;
+    }
+
+    if (ctx->intf2 != NULL && sendpacket_enable_txtime(ctx->intf2) < 0) {
+        tcpreplay_seterr(ctx, "%s: %s", ctx->options->intf2_name,
+                sendpacket_geterr(ctx->intf2));
+        return -1;
+    }
+
+    ctx->txtime_next = 0;
+    return 0;
+}
+
+/**
+ * Sends the first packet at value, CLOCK_REALTIME nsec, and times every
+ * later packet from it.  Needs the abstime timer, which it switches to
+ * from the other sleeping timers.
+ */
+int
+tcpreplay_set_start_at(tcpreplay_t *ctx, uint64_t value)
+{
+    assert(ctx);
+
+    if (value && ctx->options->accurate == accurate_txtime) {
+        tcpreplay_seterr(ctx, "%s", "--start-at requires --timer=abstime, not txtime");
+        return -1;
+    }
+
+    ctx->options->start_at = value;
+    if (value && ctx->options->accurate != accurate_abs_time) {
+        ctx->options->accurate = accurate_abs_time;
+        tcpreplay_calibrate_spin(ctx);
+    }
+
+    return 0;
+}
+
+/**
+ * --start-at TIME: seconds since the epoch with optional decimals, or
+ * +SECS from now
+ */
+int
+tcpreplay_parse_start_at(tcpreplay_t *ctx, const char *value)
+{
+    struct timespec now;
+    const char *p = value;
+    char *end;
+    uint64_t secs, nsec = 0, scale = 100000000;
+    bool relative = false;
+
+    if (*p == '+') {
+        relative = true;
+        p++;
+    }
+
+    errno = 0;
+    secs = strtoull(p, &end, 10);
+    if (end == p || errno != 0)
+        goto bad;
+
+    if (*end == '.') {
+        for (p = end + 1; *p >= '0' && *p <= '9'; p++) {
+            nsec += (*p - '0') * scale;
+            scale /= 10;
+        }
+        end = (char *)p;
+    }
+
+    if (*end != '\0')
+        goto bad;
+
+    if (relative) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        return tcpreplay_set_start_at(ctx, TIMESPEC_TO_NANOSEC(&now) + secs * 1000000000 + nsec);
+    }
+
+    return tcpreplay_set_start_at(ctx, secs * 1000000000 + nsec);
+
+bad:
+    tcpreplay_seterr(ctx, "Invalid --start-at time: %s", value);
+    return -1;
+}
+
+/**
+ * Sets the number of seconds between printing stats
+ */
+int
+tcpreplay_set_stats(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+    ctx->options->stats = value;
+    return 0;
+}
+
+/**
+ * \brief Enable or disable dual file mode
+ *
+ * In dual file mode, we read two files at the same time and use
+ * one file for each interface.
+ */
+
+int 
+tcpreplay_set_dualfile(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->dualfile = value;
+    return 0;
+}
+
+/**
+ * \brief Enable or disable merge mode
+ *
+ * In merge mode every source is read at the same time and the packets
+ * are sent in timestamp order, each source out its own interface (see
+ * tcpreplay_add_merge_intf()).
+ */
+int
+tcpreplay_set_merge(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->merge = value;
+    return 0;
+}
+
+/**
+ * \brief Adds an interface which gets a copy of every packet sent out intf1
+ */
+int
+tcpreplay_add_fanout_intf(tcpreplay_t *ctx, const char *value)
+{
+    tcpreplay_opt_t *options;
+    char *intname;
+
+    assert(ctx);
+    assert(value);
+    options = ctx->options;
+
+    if (options->fanout_intf_cnt >= MAX_FILES) {
+        tcpreplay_seterr(ctx, "Too many fan-out interfaces, max is %d", MAX_FILES);
+        return -1;
+    }
+
+    if ((intname = tcpreplay_intf_name(ctx, value)) == NULL) {
+        tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", value);
+        return -1;
+    }
+
+    options->fanout_intf_names[options->fanout_intf_cnt++] = safe_strdup(intname);
+    return 0;
+}
+
+/**
+ * \brief Adds the interface for the next source in merge mode
  *
- * In dual file mode, we read two files at the same time and use
- * one file for each interface.
+ * The Nth call sets the interface of the Nth source.  Sources without
+ * one go out intf1, and sources sharing an interface share its handle.
  */
-
-int 
-tcpreplay_set_dualfile(tcpreplay_t *ctx, bool value)
+int
+tcpreplay_add_merge_intf(tcpreplay_t *ctx, const char *value)
 {
+    tcpreplay_opt_t *options;
+    char *intname;
+
     assert(ctx);
-    ctx->options->dualfile = value;
+    assert(value);
+    options = ctx->options;
+
+    if (options->merge_intf_cnt >= MAX_FILES) {
+        tcpreplay_seterr(ctx, "Too many merge interfaces, max is %d", MAX_FILES);
+        return -1;
+    }
+
+    if ((intname = tcpreplay_intf_name(ctx, value)) == NULL) {
+        tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", value);
+        return -1;
+    }
+
+    options->merge_intf_names[options->merge_intf_cnt++] = safe_strdup(intname);
     return 0;
 }
 
@@ -601,6 +2214,61 @@ tcpreplay_set_preload_pcap(tcpreplay_t *ctx, bool value)
     return 0;
 }
 
+/**
+ * \brief Apply the tcpedit edits to the preloaded cache once
+ *
+ * Rather than editing every packet again on each loop, see --preload-edit.
+ * Needs preload_pcap, and isn't used by dual file or merge replays.
+ */
+int
+tcpreplay_set_preload_edit(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->preload_edit = value;
+    return 0;
+}
+
+/**
+ * \brief Only preload the first value bytes of each packet
+ *
+ * Packets are then sent truncated, which suits runs that only look at
+ * the headers.  0 preloads whole packets.
+ */
+int
+tcpreplay_set_preload_snaplen(tcpreplay_t *ctx, u_int32_t value)
+{
+    assert(ctx);
+    ctx->options->preload_snaplen = value;
+    return 0;
+}
+
+/**
+ * \brief Store byte for byte identical preloaded packets once
+ *
+ * Needs preload_pcap.  Shared packets are edited on a copy.
+ */
+int
+tcpreplay_set_preload_dedup(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->preload_dedup = value;
+    return 0;
+}
+
+/**
+ * \brief Map the preload cache of each file from <pcap>.tcprimg
+ *
+ * Needs preload_pcap.  A missing or stale image is written once the file
+ * has been preloaded, for the next run.
+ */
+int
+tcpreplay_set_preload_image(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->preload_image = value;
+    return 0;
+}
+
 /**
  * \brief Add a pcap file to be sent via tcpreplay
  *
@@ -613,6 +2281,16 @@ tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
     assert(ctx);
     assert(pcap_file);
 
+    /* STDIN is streamed like any other pipe */
+    if (strcmp(pcap_file, "-") == 0)
+        return tcpreplay_add_pcapfd(ctx, pcap_file, STDIN_FILENO);
+
+    if (strncmp(pcap_file, SHM_SOURCE_PREFIX, strlen(SHM_SOURCE_PREFIX)) == 0)
+        return tcpreplay_add_shm(ctx, pcap_file + strlen(SHM_SOURCE_PREFIX));
+
+    if (pcap_dir_is_source(pcap_file))
+        return tcpreplay_add_dir(ctx, pcap_file);
+
     if (ctx->options->source_cnt < MAX_FILES) {
         ctx->options->sources[ctx->options->source_cnt].filename = safe_strdup(pcap_file);
         ctx->options->sources[ctx->options->source_cnt].type = source_filename;
@@ -625,6 +2303,8 @@ tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
         ctx->options->file_cache[ctx->options->source_cnt].index = ctx->options->source_cnt;
         ctx->options->file_cache[ctx->options->source_cnt].cached = false;
         ctx->options->file_cache[ctx->options->source_cnt].packet_cache = NULL;
+        ctx->options->file_cache[ctx->options->source_cnt].packet_cnt = 0;
+        ctx->options->file_cache[ctx->options->source_cnt].arena = NULL;
 
         ctx->options->source_cnt += 1;
 
@@ -636,6 +2316,175 @@ tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
     return 0;
 }
 
+/**
+ * \brief Add a pcap stream arriving on a file descriptor as the next source
+ *
+ * fd is a pipe, socket or file positioned at the pcap header, read once
+ * through large buffered reads, see tcpr_pcap_fdopen_offline_nsec().  It
+ * can only be looped with --preload-pcap.  name stands in for the file
+ * name in messages and statistics.
+ */
+int
+tcpreplay_add_pcapfd(tcpreplay_t *ctx, const char *name, int fd)
+{
+    char buf[32];
+    int idx;
+
+    assert(ctx);
+
+    if ((idx = ctx->options->source_cnt) >= MAX_FILES) {
+        tcpreplay_seterr(ctx, "Unable to add more then %u files", MAX_FILES);
+        return -1;
+    }
+
+    if (name == NULL) {
+        snprintf(buf, sizeof(buf), "fd %d", fd);
+        name = buf;
+    }
+
+    ctx->options->sources[idx].type = source_fd;
+    ctx->options->sources[idx].fd = fd;
+    ctx->options->sources[idx].filename = safe_strdup(name);
+    ctx->options->sources[idx].fd_read = false;
+    ctx->options->sources[idx].fd_close = false;
+
+    ctx->options->file_cache[idx].index = idx;
+    ctx->options->file_cache[idx].cached = false;
+    ctx->options->file_cache[idx].packet_cache = NULL;
+    ctx->options->file_cache[idx].packet_cnt = 0;
+    ctx->options->file_cache[idx].arena = NULL;
+
+    ctx->options->source_cnt += 1;
+    return 0;
+}
+
+/**
+ * \brief Add a directory or glob of pcap files as the next source
+ *
+ * The files, such as tcpdump -G or -C rotates through, are replayed in
+ * natural order as one stream with one timeline, however many there are:
+ * a thread reads them, and opens each next file ahead of time, see
+ * common/pcap_dir.c.  With tcpreplay_set_follow() it keeps reading files
+ * as they are written.  Like a stream it can only be looped with
+ * --preload-pcap.
+ */
+int
+tcpreplay_add_dir(tcpreplay_t *ctx, const char *path)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    int fd;
+
+    assert(ctx);
+    assert(path);
+
+    if (ctx->options->source_cnt >= MAX_FILES) {
+        tcpreplay_seterr(ctx, "Unable to add more then %u files", MAX_FILES);
+        return -1;
+    }
+
+    if ((fd = pcap_dir_open_read(path, ctx->options->follow, ebuf)) < 0) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    if (tcpreplay_add_pcapfd(ctx, path, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    ctx->options->sources[ctx->options->source_cnt - 1].fd_close = true;
+    return 0;
+}
+
+/**
+ * \brief Add a shared memory packet ring as the next source
+ *
+ * name is the POSIX shared memory object an external generator created
+ * and writes packets into, see common/shm_ring.h.  It is attached here,
+ * so it has to exist by now.  Like a stream, a ring is read once: it can
+ * only be looped with --preload-pcap.
+ */
+int
+tcpreplay_add_shm(tcpreplay_t *ctx, const char *name)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    shm_ring_t *ring;
+    int idx;
+
+    assert(ctx);
+    assert(name);
+
+    if ((idx = ctx->options->source_cnt) >= MAX_FILES) {
+        tcpreplay_seterr(ctx, "Unable to add more then %u files", MAX_FILES);
+        return -1;
+    }
+
+    if ((ring = shm_ring_open(name, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    ctx->options->sources[idx].type = source_shm;
+    ctx->options->sources[idx].filename = safe_strdup(name);
+    ctx->options->sources[idx].shm = ring;
+
+    ctx->options->file_cache[idx].index = idx;
+    ctx->options->file_cache[idx].cached = false;
+    ctx->options->file_cache[idx].dlt = ring->hdr->datalink;
+    ctx->options->file_cache[idx].packet_cache = NULL;
+    ctx->options->file_cache[idx].packet_cnt = 0;
+    ctx->options->file_cache[idx].arena = NULL;
+
+    ctx->options->source_cnt += 1;
+    return 0;
+}
+
+/**
+ * \brief Add packets already in memory as the next source
+ *
+ * cnt packets of datalink dlt, pkthdrs[i] and pktdata[i] of each, are
+ * replayed without reading or parsing any file.  Only the headers are
+ * copied: the packet data must stay put until tcpreplay_close(), and is
+ * edited in place by --unique-ip and, with --preload-edit, by tcpedit.
+ * name stands in for the file name in messages and statistics.
+ */
+int
+tcpreplay_add_cache(tcpreplay_t *ctx, const char *name, int dlt,
+        const struct pcap_pkthdr *pkthdrs, u_char *const *pktdata, COUNTER cnt)
+{
+    tcpreplay_source_t *src;
+    file_cache_t *fc;
+    int idx;
+
+    assert(ctx);
+    assert(pkthdrs || cnt == 0);
+    assert(pktdata || cnt == 0);
+
+    if ((idx = ctx->options->source_cnt) >= MAX_FILES) {
+        tcpreplay_seterr(ctx, "Unable to add more then %u files", MAX_FILES);
+        return -1;
+    }
+
+    src = &ctx->options->sources[idx];
+    src->type = source_cache;
+    src->filename = safe_strdup(name != NULL ? name : "memory");
+    src->cache_pkthdrs = pkthdrs;
+    src->cache_pktdata = pktdata;
+    src->cache_cnt = cnt;
+
+    /* filled in by packet_cache_load() when it is first replayed */
+    fc = &ctx->options->file_cache[idx];
+    fc->index = idx;
+    fc->cached = false;
+    fc->dlt = dlt;
+    fc->packet_cache = NULL;
+    fc->packet_cnt = 0;
+    fc->arena = NULL;
+
+    ctx->options->source_cnt += 1;
+    return 0;
+}
+
 /**
  * Limit the total number of packets to send
  */
@@ -648,29 +2497,235 @@ tcpreplay_set_limit_send(tcpreplay_t *ctx, COUNTER value)
 }
 
 /**
- * \brief Specify the tcpprep cache file to use for replaying with two NICs
+ * Skip the packets of each file before packet # value.  Seeking uses the
+ * file's tcpcapinfo --index if it has one.
+ */
+int
+tcpreplay_set_start_packet(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->start_packet = value;
+    ctx->options->read_window = true;
+    return 0;
+}
+
+/**
+ * Skip the packets of each file captured less than value usec after its
+ * first packet
+ */
+int
+tcpreplay_set_start_time(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->start_time_us = value;
+    ctx->options->read_window = true;
+    return 0;
+}
+
+/**
+ * Stop reading each file at the first packet captured more than value
+ * usec after its first packet
+ */
+int
+tcpreplay_set_end_time(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->end_time_us = value;
+    ctx->options->read_window = true;
+    return 0;
+}
+
+/**
+ * \brief Specify the tcpprep cache file to use for replaying with two NICs
+ *
+ * Note: this only works if you have a single pcap file
+ * returns -1 on error
+ */
+int
+tcpreplay_set_tcpprep_cache(tcpreplay_t *ctx, char *file)
+{
+    assert(ctx);
+    char *tcpprep_file;
+
+    if (ctx->options->source_cnt > 1) {
+        tcpreplay_seterr(ctx, "%s", "Unable to use tcpprep cache file with a single pcap file");
+        return -1;
+    }
+
+    tcpprep_file = safe_strdup(file);
+    ctx->options->cache_packets = read_cache(&ctx->options->cachedata, 
+        tcpprep_file, &ctx->options->comment);
+
+    free(tcpprep_file);
+
+    return 0;
+}
+
+/**
+ * \brief Splits the preloaded packets across the interfaces like tcpprep
+ *
+ * Saves a tcpprep run and --cachefile: the direction of each packet is
+ * worked out when the files are preloaded.  spec is one of
+ *
+ *   cidr:CIDR[,CIDR...]    packets from these networks go out intf1
+ *   port                   packets to ports 0-1023 go out intf1
+ *   port:FILE              packets to the services in FILE go out intf1
+ *
+ * and everything else, non-IP included, goes out intf2.  The auto modes
+ * need the whole capture before the first packet can be classified and
+ * stay in tcpprep.
+ */
+int
+tcpreplay_set_prep(tcpreplay_t *ctx, const char *spec)
+{
+    tcpreplay_opt_t *options;
+    char *cidr;
+    int i;
+
+    assert(ctx);
+    assert(spec);
+    options = ctx->options;
+
+    if (options->cachedata != NULL || options->dualfile) {
+        tcpreplay_seterr(ctx, "%s", "--prep can not be used with --cachefile or --dualfile");
+        return -1;
+    }
+
+    destroy_cidr(options->prep_cidr);
+    options->prep_cidr = NULL;
+    safe_free(options->prep_services);
+    options->prep_services = NULL;
+
+    if (strncmp(spec, "cidr:", 5) == 0) {
+        /* parse_cidr() chops up its input */
+        cidr = safe_strdup(spec + 5);
+        if (!parse_cidr(&options->prep_cidr, cidr, ",")) {
+            tcpreplay_seterr(ctx, "Unable to parse --prep CIDR: %s", spec + 5);
+            safe_free(cidr);
+            return -1;
+        }
+        safe_free(cidr);
+    } else if (strcmp(spec, "port") == 0) {
+        options->prep_services = safe_malloc(sizeof(tcpr_services_t));
+        for (i = 0; i <= 1023; i++) {
+            options->prep_services->tcp[i] = 1;
+            options->prep_services->udp[i] = 1;
+        }
+    } else if (strncmp(spec, "port:", 5) == 0) {
+        options->prep_services = safe_malloc(sizeof(tcpr_services_t));
+        parse_services(spec + 5, options->prep_services);
+    } else {
+        tcpreplay_seterr(ctx, "Unsupported --prep mode: %s", spec);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Reads the queue of each packet from a tcpprep --queue-map file
+ *
+ * Preloaded packets take their --workers thread and netmap TX ring from
+ * it rather than from a hash of their flow.  Like the tcpprep cache the
+ * map is indexed by the packet's place in its file.
+ */
+int
+tcpreplay_set_queue_map(tcpreplay_t *ctx, const char *file)
+{
+    tcpreplay_opt_t *options;
+    int queues;
+
+    assert(ctx);
+    assert(file);
+    options = ctx->options;
+
+    safe_free(options->queue_map);
+    options->queue_map_packets = read_qmap(&options->queue_map, file, &queues);
+
+    if (options->workers > 1 && options->workers != queues)
+        tcpreplay_setwarn(ctx, "%s has %d queues for %d workers", file, queues,
+                options->workers);
+
+    return 0;
+}
+
+/**
+ * Split TCP packets with more than mtu bytes of IP into segments in
+ * software before sending them, see tcp_segment().  0 turns it off.
+ */
+int
+tcpreplay_set_segment(tcpreplay_t *ctx, uint32_t mtu)
+{
+    assert(ctx);
+
+    if (mtu != 0 && (mtu < TCP_SEGMENT_MIN_MTU || mtu > 65535)) {
+        tcpreplay_seterr(ctx, "Invalid segment MTU: %u", mtu);
+        return -1;
+    }
+
+    ctx->options->segment_mtu = mtu;
+    return 0;
+}
+
+/**
+ * \brief Sends IP packets through the fragroute rules in config
+ *
+ * The rules are applied as each packet is sent, see --fragroute.
+ */
+int
+tcpreplay_set_fragroute(tcpreplay_t *ctx, const char *config)
+{
+#ifdef ENABLE_FRAGROUTE
+    char ebuf[FRAGROUTE_ERRBUF_LEN];
+
+    assert(ctx);
+    assert(config);
+
+    if (ctx->frag_ctx != NULL)
+        fragroute_close(ctx->frag_ctx);
+
+    /* replayed fragments can be as large as the packets they came from */
+    if ((ctx->frag_ctx = fragroute_init(65535, DLT_EN10MB, config, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "Unable to load fragroute rules %s: %s", config, ebuf);
+        return -1;
+    }
+
+    return 0;
+#else
+    assert(ctx);
+    tcpreplay_seterr(ctx, "%s", "fragroute not supported");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Which packets fragroute applies to: c2s, s2c or both
  *
- * Note: this only works if you have a single pcap file
- * returns -1 on error
+ * c2s are the packets sent out intf1, s2c the ones sent out intf2.
  */
 int
-tcpreplay_set_tcpprep_cache(tcpreplay_t *ctx, char *file)
+tcpreplay_set_fragdir(tcpreplay_t *ctx, const char *dir)
 {
     assert(ctx);
-    char *tcpprep_file;
-
-    if (ctx->options->source_cnt > 1) {
-        tcpreplay_seterr(ctx, "%s", "Unable to use tcpprep cache file with a single pcap file");
+#ifdef ENABLE_FRAGROUTE
+    assert(dir);
+
+    if (strcmp(dir, "c2s") == 0) {
+        ctx->options->fragroute_dir = FRAGROUTE_DIR_C2S;
+    } else if (strcmp(dir, "s2c") == 0) {
+        ctx->options->fragroute_dir = FRAGROUTE_DIR_S2C;
+    } else if (strcmp(dir, "both") == 0) {
+        ctx->options->fragroute_dir = FRAGROUTE_DIR_BOTH;
+    } else {
+        tcpreplay_seterr(ctx, "Unknown --fragdir value: %s", dir);
         return -1;
     }
 
-    tcpprep_file = safe_strdup(file);
-    ctx->options->cache_packets = read_cache(&ctx->options->cachedata, 
-        tcpprep_file, &ctx->options->comment);
-
-    free(tcpprep_file);
-
     return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "fragroute not supported");
+    return -1;
+#endif
 }
 
 
@@ -769,6 +2824,7 @@ tcpreplay_get_pkts_sent(tcpreplay_t *ctx)
     assert(ctx);
 
     ctx->static_stats.pkts_sent = ctx->stats.pkts_sent;
+    tcpreplay_workers_stats(ctx, &ctx->static_stats);
     return ctx->static_stats.pkts_sent;
 }
 
@@ -780,6 +2836,7 @@ tcpreplay_get_bytes_sent(tcpreplay_t *ctx)
 {
     assert(ctx);
     ctx->static_stats.bytes_sent = ctx->stats.bytes_sent;
+    tcpreplay_workers_stats(ctx, &ctx->static_stats);
     return ctx->static_stats.bytes_sent;
 }
 
@@ -918,6 +2975,62 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         return -1;
     }
 
+    /* --prep classifies the packets as they are preloaded */
+    if ((ctx->options->prep_cidr != NULL || ctx->options->prep_services != NULL) &&
+            !ctx->options->preload_pcap) {
+        tcpreplay_seterr(ctx, "%s", "--prep requires --preload-pcap");
+        return -1;
+    }
+
+    if (ctx->options->preload_dedup && !ctx->options->preload_pcap) {
+        tcpreplay_seterr(ctx, "%s", "--preload-dedup requires --preload-pcap");
+        return -1;
+    }
+
+    if (ctx->options->preload_image && !ctx->options->preload_pcap) {
+        tcpreplay_seterr(ctx, "%s", "--preload-image requires --preload-pcap");
+        return -1;
+    }
+
+    /* the window reader walks the files one after another */
+    if (ctx->options->preload_window && (ctx->options->preload_pcap ||
+            ctx->options->dualfile || ctx->options->merge)) {
+        tcpreplay_seterr(ctx, "%s", "Can't use --preload-window with --preload-pcap, --dualfile or --merge");
+        return -1;
+    }
+
+    /* cache entries are numbered from the first packet of the file */
+    if (ctx->options->read_window && ctx->options->cachedata != NULL) {
+        tcpreplay_seterr(ctx, "%s", "Can't use --start-packet, --start-time or --end-time with a tcpprep cache file");
+        return -1;
+    }
+
+    if (ctx->options->queue_map != NULL) {
+        if (!ctx->options->preload_pcap) {
+            tcpreplay_seterr(ctx, "%s", "--queue-map requires --preload-pcap");
+            return -1;
+        }
+        if (ctx->options->read_window) {
+            tcpreplay_seterr(ctx, "%s", "Can't use --start-packet, --start-time or --end-time with --queue-map");
+            return -1;
+        }
+    }
+
+    /* fragments are sent from the single file send loop */
+    if (ctx->frag_ctx != NULL && (ctx->options->dualfile || ctx->options->merge ||
+            ctx->options->workers > 1)) {
+        tcpreplay_seterr(ctx, "%s", "Can't use --fragroute with --dualfile, --merge or --workers");
+        return -1;
+    }
+
+    if (tcpreplay_check_send_loop(ctx) < 0)
+        return -1;
+
+    if (ctx->options->end_time_us > 0 && ctx->options->end_time_us < ctx->options->start_time_us) {
+        tcpreplay_seterr(ctx, "%s", "--end-time must not be before --start-time");
+        return -1;
+    }
+
     if ((ctx->options->dualfile || ctx->options->cachedata != NULL) && 
            ctx->options->intf2_name == NULL) {
         tcpreplay_seterr(ctx, "%s", "dual file mode and tcpprep cache files require two interfaces");
@@ -940,18 +3053,30 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         ioport_sleep_init();
     }
 #endif
-    if (ctx->options->accurate == accurate_abs_time) {
-        tcpreplay_seterr(ctx, "%s", "tcpreplay_api only supports absolute time on Apple OS X");
+    if (ctx->options->accurate == accurate_abs_time ||
+            ctx->options->accurate == accurate_hybrid) {
+        tcpreplay_calibrate_spin(ctx);
+    }
+
+#if defined(__i386__) || defined(__x86_64__)
+    if (ctx->options->accurate == accurate_rdtsc && !rdtsc_ticks_per_msec) {
+        rdtsc_sleep_init();
+    }
+#else
+    if (ctx->options->accurate == accurate_rdtsc) {
+        tcpreplay_seterr(ctx, "%s", "tcpreplay_api only supports rdtsc on x86");
         return -1;
     }
+#endif
 
-    if ((intname = get_interface(ctx->intlist, ctx->options->intf1_name)) == NULL) {
+    if ((intname = tcpreplay_intf_name(ctx, ctx->options->intf1_name)) == NULL) {
         tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF1));
         return -1;
     }
 
-    /* open interfaces for writing */
-    if ((ctx->intf1 = sendpacket_open(ctx->options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type)) == NULL) {
+    /* open interfaces for writing, unless tcpreplay_set_interface() did */
+    if (ctx->intf1 == NULL &&
+            (ctx->intf1 = sendpacket_open(ctx->options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type)) == NULL) {
         tcpreplay_seterr(ctx, "Can't open %s: %s", ctx->options->intf1_name, ebuf);
         return -1;
     }
@@ -959,39 +3084,421 @@ tcpreplay_prepare(tcpreplay_t *ctx)
     int1dlt = sendpacket_get_dlt(ctx->intf1);
 
     if (ctx->options->intf2_name != NULL) {
-        if ((intname = get_interface(ctx->intlist, ctx->options->intf2_name)) == NULL) {
+        if ((intname = tcpreplay_intf_name(ctx, ctx->options->intf2_name)) == NULL) {
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF2));
             return -1;
         }
 
-        /* open interfaces for writing */
-        if ((ctx->intf2 = sendpacket_open(ctx->options->intf2_name, ebuf, TCPR_DIR_C2S, ctx->sp_type)) == NULL) {
-            tcpreplay_seterr(ctx, "Can't open %s: %s", ctx->options->intf2_name, ebuf);
+        /* open interfaces for writing */
+        if (ctx->intf2 == NULL &&
+                (ctx->intf2 = sendpacket_open(ctx->options->intf2_name, ebuf, TCPR_DIR_C2S, ctx->sp_type)) == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s: %s", ctx->options->intf2_name, ebuf);
+            return -1;
+        }
+
+        int2dlt = sendpacket_get_dlt(ctx->intf2);
+        if (int2dlt != int1dlt) {
+            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+                ctx->options->intf1_name, pcap_datalink_val_to_name(int1dlt), 
+                ctx->options->intf2_name, pcap_datalink_val_to_name(int2dlt));
+            return -1;
+        }
+    }
+
+    if (tcpreplay_open_workers(ctx) < 0)
+        return -1;
+
+    if (tcpreplay_open_merge_intf(ctx, ctx->options->source_cnt) < 0)
+        return -1;
+
+    if (tcpreplay_open_fanout_intf(ctx) < 0)
+        return -1;
+
+    /*
+     * Setup up the file cache, if required
+     */
+    if (ctx->options->preload_pcap && ctx->options->file_cache == NULL) {
+        /* Initialise each of the file cache structures */
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            ctx->options->file_cache[i].index = i;
+            ctx->options->file_cache[i].cached = FALSE;
+            ctx->options->file_cache[i].packet_cache = NULL;
+            ctx->options->file_cache[i].packet_cnt = 0;
+            ctx->options->file_cache[i].arena = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Opens the interface of each --merge-intf source
+ *
+ * Sources past the end of the --merge-intf list go out intf1 and each
+ * interface is opened once, however many sources use it.  Returns 0 on
+ * success (or when not merging) and -1 on error.
+ */
+static int
+tcpreplay_open_merge_intf(tcpreplay_t *ctx, int source_cnt)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    sendpacket_t *sp;
+    int i, j, dlt, int1dlt;
+
+    if (!options->merge || ctx->merge_intf != NULL)
+        return 0;
+
+    if (options->dualfile || options->cachedata != NULL) {
+        tcpreplay_seterr(ctx, "%s", "--merge can not be used with --dualfile or --cachefile");
+        return -1;
+    }
+
+    if (options->intf2_name != NULL || options->pcapng_intf) {
+        tcpreplay_seterr(ctx, "%s", "--merge sends each pcap out its --merge-intf, not --intf2");
+        return -1;
+    }
+
+    if (options->workers > 1) {
+        tcpreplay_seterr(ctx, "%s", "--merge can not be used with --workers");
+        return -1;
+    }
+
+    if (options->accurate == accurate_txtime) {
+        tcpreplay_seterr(ctx, "%s", "--merge is not supported with --timer=txtime");
+        return -1;
+    }
+
+    if (options->merge_intf_cnt > source_cnt) {
+        tcpreplay_seterr(ctx, "%d merge interfaces for only %d pcap files",
+                options->merge_intf_cnt, source_cnt);
+        return -1;
+    }
+
+    /* intf1, and at most one each for the rest */
+    ctx->merge_intf = safe_malloc(sizeof(sendpacket_t *) * (options->merge_intf_cnt + 1));
+    ctx->merge_map = safe_malloc(sizeof(sendpacket_t *) * (options->merge_intf_cnt + 1));
+    ctx->merge_intf[0] = ctx->intf1;
+    ctx->merge_intf_cnt = 1;
+    int1dlt = sendpacket_get_dlt(ctx->intf1);
+
+    for (i = 0; i < options->merge_intf_cnt; i++) {
+        ctx->merge_map[i] = ctx->intf1;
+        if (strcmp(options->merge_intf_names[i], options->intf1_name) == 0)
+            continue;
+
+        /* an earlier source already opened it? */
+        for (j = 0; j < i; j++) {
+            if (strcmp(options->merge_intf_names[j], options->merge_intf_names[i]) == 0) {
+                ctx->merge_map[i] = ctx->merge_map[j];
+                break;
+            }
+        }
+
+        if (j < i)
+            continue;
+
+        sp = sendpacket_open(options->merge_intf_names[i], ebuf, TCPR_DIR_C2S, ctx->sp_type);
+        if (sp == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s: %s", options->merge_intf_names[i], ebuf);
+            return -1;
+        }
+
+        ctx->merge_intf[ctx->merge_intf_cnt++] = sp;
+        ctx->merge_map[i] = sp;
+
+        dlt = sendpacket_get_dlt(sp);
+        if (dlt != int1dlt) {
+            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+                options->intf1_name, pcap_datalink_val_to_name(int1dlt),
+                options->merge_intf_names[i], pcap_datalink_val_to_name(dlt));
+            return -1;
+        }
+
+        if (options->qdisc_bypass && sendpacket_set_qdisc_bypass(sp, true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->merge_intf_names[i],
+                    sendpacket_geterr(sp));
+            return -1;
+        }
+
+        if (options->csum_offload && sendpacket_set_csum_offload(sp, true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->merge_intf_names[i],
+                    sendpacket_geterr(sp));
+            return -1;
+        }
+
+        if (options->gso && sendpacket_set_gso(sp, true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->merge_intf_names[i],
+                    sendpacket_geterr(sp));
+            return -1;
+        }
+
+        if (options->tx_telemetry)
+            sendpacket_set_telemetry(sp, true);
+
+        sendpacket_set_backoff(sp, options->backoff);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Opens every --fanout-intf interface
+ *
+ * They take the same send method, DLT and per-interface settings as
+ * intf1.  Returns 0 on success (or without --fanout-intf) and -1 on error.
+ */
+static int
+tcpreplay_open_fanout_intf(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    sendpacket_t *sp;
+    int i, j, dlt, int1dlt;
+
+    if (options->fanout_intf_cnt == 0 || ctx->fanout_intf != NULL)
+        return 0;
+
+    if (options->dualfile || options->merge || options->intf2_name != NULL) {
+        tcpreplay_seterr(ctx, "%s", "--fanout-intf copies --intf1 and can't be used with a second interface");
+        return -1;
+    }
+
+    if (options->workers > 1 || options->clients > 1 || options->flow_timing) {
+        tcpreplay_seterr(ctx, "%s", "--fanout-intf can not be used with --workers, --clients or --flow-timing");
+        return -1;
+    }
+
+    if (options->accurate == accurate_txtime) {
+        tcpreplay_seterr(ctx, "%s", "--fanout-intf is not supported with --timer=txtime");
+        return -1;
+    }
+
+    for (i = 0; i < options->fanout_intf_cnt; i++) {
+        if (strcmp(options->fanout_intf_names[i], options->intf1_name) == 0) {
+            tcpreplay_seterr(ctx, "--fanout-intf %s is already --intf1",
+                    options->fanout_intf_names[i]);
+            return -1;
+        }
+
+        for (j = 0; j < i; j++) {
+            if (strcmp(options->fanout_intf_names[j], options->fanout_intf_names[i]) == 0) {
+                tcpreplay_seterr(ctx, "--fanout-intf %s given twice",
+                        options->fanout_intf_names[i]);
+                return -1;
+            }
+        }
+    }
+
+    ctx->fanout_intf = safe_malloc(sizeof(sendpacket_t *) * options->fanout_intf_cnt);
+    int1dlt = sendpacket_get_dlt(ctx->intf1);
+
+    for (i = 0; i < options->fanout_intf_cnt; i++) {
+        sp = sendpacket_open(options->fanout_intf_names[i], ebuf, TCPR_DIR_C2S, ctx->sp_type);
+        if (sp == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s: %s", options->fanout_intf_names[i], ebuf);
+            return -1;
+        }
+
+        ctx->fanout_intf[ctx->fanout_intf_cnt++] = sp;
+
+        dlt = sendpacket_get_dlt(sp);
+        if (dlt != int1dlt) {
+            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+                options->intf1_name, pcap_datalink_val_to_name(int1dlt),
+                options->fanout_intf_names[i], pcap_datalink_val_to_name(dlt));
+            return -1;
+        }
+
+        if (options->qdisc_bypass && sendpacket_set_qdisc_bypass(sp, true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->fanout_intf_names[i],
+                    sendpacket_geterr(sp));
+            return -1;
+        }
+
+        if (options->csum_offload && sendpacket_set_csum_offload(sp, true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->fanout_intf_names[i],
+                    sendpacket_geterr(sp));
+            return -1;
+        }
+
+        if (options->gso && sendpacket_set_gso(sp, true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->fanout_intf_names[i],
+                    sendpacket_geterr(sp));
+            return -1;
+        }
+
+        if (options->tx_telemetry)
+            sendpacket_set_telemetry(sp, true);
+
+        sendpacket_set_backoff(sp, options->backoff);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Parses the seconds of --start-time, --end-time or --duration
+ *
+ * Returns 0, or -1 unless all of value is a number of seconds which
+ * still fits a COUNTER of microseconds.
+ */
+static int
+tcpreplay_parse_secs(const char *value, double *secs)
+{
+    char *end;
+
+    errno = 0;
+    *secs = strtod(value, &end);
+    if (end == value || *end != '\0' || errno != 0)
+        return -1;
+
+    /* also false for nan */
+    if (!(*secs >= 0 && *secs < 1e12))
+        return -1;
+
+    return 0;
+}
+
+/**
+ * \brief Measures the absolute_sleep() spin the first time a timer needs it
+ *
+ * sleep_spin_calibrate() sleeps for a couple of msec, so it runs once per
+ * context however many options ask for abstime or hybrid.
+ */
+static void
+tcpreplay_calibrate_spin(tcpreplay_t *ctx)
+{
+    if (ctx->sleep_spin_calibrated)
+        return;
+
+    ctx->sleep_spin_nsec = sleep_spin_calibrate();
+    ctx->sleep_spin_calibrated = true;
+}
+
+/**
+ * \brief Opens an additional handle on intf1 for each --workers thread
+ *
+ * Worker 0 shares ctx->intf1.  Returns 0 on success (or when only one
+ * worker was requested) and -1 on error.
+ */
+static int
+tcpreplay_open_workers(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    /* --clients and --flow-timing run on the worker threads, even just the one */
+    const char *opt = options->workers > 1 ? "--workers" :
+            options->flow_timing ? "--flow-timing" : "--clients";
+    int i;
+
+    if ((options->workers <= 1 && options->clients <= 1 && !options->flow_timing) ||
+            ctx->worker_intf != NULL)
+        return 0;
+
+#ifndef HAVE_LIBPTHREAD
+    tcpreplay_seterr(ctx, "%s requires pthread support", opt);
+    return -1;
+#else
+#ifdef TCPREPLAY_EDIT
+    tcpreplay_seterr(ctx, "%s is not supported by tcpreplay-edit", opt);
+    return -1;
+#endif
+#ifdef ENABLE_VERBOSE
+    if (options->verbose) {
+        tcpreplay_seterr(ctx, "%s can not be used with --verbose", opt);
+        return -1;
+    }
+#endif
+    if (!options->preload_pcap) {
+        tcpreplay_seterr(ctx, "%s requires --preload-pcap", opt);
+        return -1;
+    }
+
+    if (options->dualfile || options->merge || options->intf2_name != NULL) {
+        tcpreplay_seterr(ctx, "%s only supports a single interface", opt);
+        return -1;
+    }
+
+    if (options->speed.mode == speed_oneatatime || options->limit_send > 0) {
+        tcpreplay_seterr(ctx, "%s can not be used with --oneatatime or --limit", opt);
+        return -1;
+    }
+
+    if (ctx->sp_type == SP_TYPE_NETMAP) {
+        tcpreplay_seterr(ctx, "%s is not supported with --netmap", opt);
+        return -1;
+    }
+
+    if (ctx->sp_type == SP_TYPE_AF_XDP) {
+        tcpreplay_seterr(ctx, "%s is not supported with --af-xdp", opt);
+        return -1;
+    }
+
+    if (options->accurate == accurate_txtime) {
+        tcpreplay_seterr(ctx, "%s is not supported with --timer=txtime", opt);
+        return -1;
+    }
+
+    if (options->flow_timing) {
+        if (options->clients > 1) {
+            tcpreplay_seterr(ctx, "%s", "--flow-timing picks the number of clients itself");
+            return -1;
+        }
+
+        if (!(options->speed.mode == speed_mbpsrate && options->speed.speed > 0) &&
+                options->speed.mode != speed_packetrate) {
+            tcpreplay_seterr(ctx, "%s", "--flow-timing requires --mbps or --pps");
+            return -1;
+        }
+    }
+
+    ctx->worker_intf = safe_malloc(sizeof(sendpacket_t *) * options->workers);
+    ctx->worker_intf[0] = ctx->intf1;
+    if ((i = posix_memalign((void **)&ctx->worker_counters, WORKER_COUNTERS_ALIGN,
+            sizeof(worker_counters_t) * options->workers)) != 0) {
+        tcpreplay_seterr(ctx, "Unable to allocate worker counters: %s", strerror(i));
+        return -1;
+    }
+    memset(ctx->worker_counters, 0, sizeof(worker_counters_t) * options->workers);
+
+    for (i = 1; i < options->workers; i++) {
+        ctx->worker_intf[i] = sendpacket_open(options->intf1_name, ebuf,
+                TCPR_DIR_C2S, ctx->sp_type);
+        if (ctx->worker_intf[i] == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s for worker %d: %s",
+                    options->intf1_name, i, ebuf);
+            return -1;
+        }
+
+        if (options->qdisc_bypass &&
+                sendpacket_set_qdisc_bypass(ctx->worker_intf[i], true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->intf1_name,
+                    sendpacket_geterr(ctx->worker_intf[i]));
             return -1;
         }
 
-        int2dlt = sendpacket_get_dlt(ctx->intf2);
-        if (int2dlt != int1dlt) {
-            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
-                ctx->options->intf1_name, pcap_datalink_val_to_name(int1dlt), 
-                ctx->options->intf2_name, pcap_datalink_val_to_name(int2dlt));
+        if (options->csum_offload &&
+                sendpacket_set_csum_offload(ctx->worker_intf[i], true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->intf1_name,
+                    sendpacket_geterr(ctx->worker_intf[i]));
             return -1;
         }
-    }
 
-    /*
-     * Setup up the file cache, if required
-     */
-    if (ctx->options->preload_pcap && ctx->options->file_cache == NULL) {
-        /* Initialise each of the file cache structures */
-        for (i = 0; i < ctx->options->source_cnt; i++) {
-            ctx->options->file_cache[i].index = i;
-            ctx->options->file_cache[i].cached = FALSE;
-            ctx->options->file_cache[i].packet_cache = NULL;
+        if (options->gso && sendpacket_set_gso(ctx->worker_intf[i], true) < 0) {
+            tcpreplay_seterr(ctx, "%s: %s", options->intf1_name,
+                    sendpacket_geterr(ctx->worker_intf[i]));
+            return -1;
         }
+
+        if (options->tx_telemetry)
+            sendpacket_set_telemetry(ctx->worker_intf[i], true);
+
+        sendpacket_set_backoff(ctx->worker_intf[i], options->backoff);
     }
 
     return 0;
+#endif /* HAVE_LIBPTHREAD */
 }
 
 /**
@@ -1021,12 +3528,17 @@ tcpreplay_replay(tcpreplay_t *ctx, int idx)
     }
 
 
+    if (tcpreplay_wait_start(ctx) < 0)
+        return -1;
+
     if (gettimeofday(&ctx->stats.start_time, NULL) < 0) {
         tcpreplay_seterr(ctx, "gettimeofday() failed: %s",  strerror(errno));
         return -1;
     }
 
     ctx->running = true;
+    ctx->loop_wrap = false;
+    send_packets_sched_sender(ctx, 0);
 
     /* main loop, when not looping forever */
     if (ctx->options->loop > 0) {
@@ -1041,10 +3553,238 @@ tcpreplay_replay(tcpreplay_t *ctx, int idx)
         }
     }
 
+    wire_flush(ctx);
+    tcpreplay_measure_stop(ctx);
     ctx->running = false;
     return 0;
 }
 
+/**
+ * \brief Waits for --start-at, if given
+ *
+ * Sleeps on CLOCK_REALTIME, so a clock stepped or slewed by PTP during
+ * the wait is followed, until START_AT_LEAD_NSEC before the start.  The
+ * start is then converted to CLOCK_MONOTONIC, spun out by absolute_sleep()
+ * and becomes the deadline of the first packet.  Only the first replay
+ * waits.  Returns -1 if the start has already passed.
+ */
+int
+tcpreplay_wait_start(tcpreplay_t *ctx)
+{
+    uint64_t start = ctx->options->start_at, real_ns, mono_ns;
+    struct timespec wake, real, mono;
+
+    assert(ctx);
+
+    if (!start)
+        return 0;
+
+    ctx->options->start_at = 0;
+    clock_gettime(CLOCK_REALTIME, &real);
+    if (TIMESPEC_TO_NANOSEC(&real) >= start) {
+        tcpreplay_seterr(ctx, "--start-at time passed %.6f seconds ago",
+                (double)(TIMESPEC_TO_NANOSEC(&real) - start) / 1000000000.0);
+        return -1;
+    }
+
+    if (start - TIMESPEC_TO_NANOSEC(&real) > START_AT_LEAD_NSEC) {
+        NANOSEC_TO_TIMESPEC(start - START_AT_LEAD_NSEC, &wake);
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+            if (ctx->abort)
+                return 0;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    real_ns = TIMESPEC_TO_NANOSEC(&real);
+    mono_ns = TIMESPEC_TO_NANOSEC(&mono);
+    ctx->start_deadline = start > real_ns ? mono_ns + (start - real_ns) : mono_ns;
+    dbgx(1, "--start-at: first packet due at CLOCK_MONOTONIC %" PRIu64, ctx->start_deadline);
+    absolute_sleep(ctx->start_deadline, &ctx->sleep_spin_nsec);
+
+    return 0;
+}
+
+/**
+ * Looks up an interface name or alias.  The null sink and DPDK ports
+ * aren't kernel interfaces, so their names are taken as given, and so
+ * are METHOD:DEVICE and DEVICE@NETNS, which sendpacket_open() checks.
+ */
+static char *
+tcpreplay_intf_name(tcpreplay_t *ctx, const char *value)
+{
+    if (ctx->sp_type == SP_TYPE_NULL || ctx->sp_type == SP_TYPE_DPDK ||
+            strchr(value, ':') != NULL || strchr(value, '@') != NULL)
+        return (char *)value;
+
+    return get_interface_lazy(&ctx->intlist, value);
+}
+
+/* --auto-method candidates, the first of equally fast ones wins */
+static const struct {
+    const char *name;
+    sendpacket_type_t type;
+    bool qdisc_bypass;
+} auto_methods[] = {
+#ifdef HAVE_AF_XDP
+    { "AF_XDP", SP_TYPE_AF_XDP, false },
+#endif
+#ifdef HAVE_IO_URING
+    { "io_uring", SP_TYPE_IO_URING, false },
+#endif
+#ifdef HAVE_TX_RING
+    { "TX_RING with qdisc bypass", SP_TYPE_TX_RING, true },
+    { "TX_RING", SP_TYPE_TX_RING, false },
+#endif
+#ifdef HAVE_PF_PACKET
+    { "PF_PACKET with qdisc bypass", SP_TYPE_PF_PACKET, true },
+    { "PF_PACKET", SP_TYPE_PF_PACKET, false },
+#endif
+    { INJECT_METHOD, SP_TYPE_NONE, false },
+};
+
+#define AUTO_METHOD_PACKETS 4096    /* calibration burst per method */
+
+/**
+ * Sends a burst of AUTO_METHOD_PACKETS minimal frames on sp and returns
+ * the rate in packets per second, 0 if any of them failed.  The frames
+ * go to the 802.1D reserved group address with the local experimental
+ * Ethertype, so bridges don't forward them and hosts ignore them.
+ */
+static double
+auto_method_burst(sendpacket_t *sp)
+{
+    static const u_char dst[ETHER_ADDR_LEN] = { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x0e };
+    struct tcpr_ether_addr *mac;
+    struct pcap_pkthdr pkthdr;
+    struct timespec start, end;
+    u_char frame[60];       /* shortest Ethernet frame, bar the FCS */
+    uint64_t ns;
+    int i;
+
+    memset(frame, 0, sizeof(frame));
+    memcpy(frame, dst, ETHER_ADDR_LEN);
+    if ((mac = sendpacket_get_hwaddr(sp)) != NULL)
+        memcpy(frame + ETHER_ADDR_LEN, mac, ETHER_ADDR_LEN);
+    frame[12] = 0x88;       /* ETHERTYPE 0x88b5, local experimental */
+    frame[13] = 0xb5;
+
+    memset(&pkthdr, 0, sizeof(pkthdr));
+    pkthdr.caplen = pkthdr.len = sizeof(frame);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < AUTO_METHOD_PACKETS; i++) {
+        if (sendpacket(sp, frame, sizeof(frame), &pkthdr) < (int)sizeof(frame))
+            return 0.0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = TIMESPEC_TO_NANOSEC(&end) - TIMESPEC_TO_NANOSEC(&start);
+    return (double)AUTO_METHOD_PACKETS * 1000000000.0 / (double)(ns ? ns : 1);
+}
+
+/**
+ * \brief --auto-method: picks the fastest way to send on intf1
+ *
+ * Opens intf1 with each method tcpreplay was built with in turn and
+ * times a short burst through it, then sends everything with the fastest
+ * one.  netmap is left out as it takes the adapter away from the kernel,
+ * and methods without the qdisc bypass are left out when it was asked
+ * for.  Does nothing if a method was chosen some other way, or on
+ * interfaces other than Ethernet.
+ */
+static int
+tcpreplay_auto_method(tcpreplay_t *ctx, bool qdisc_bypass)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    double pps, best_pps = 0.0;
+    sendpacket_t *sp;
+    size_t i, best = 0;
+
+    if (ctx->sp_type != SP_TYPE_NONE || strchr(options->intf1_name, ':') != NULL) {
+        tcpreplay_setwarn(ctx, "%s", "--auto-method ignored, the injection method was already chosen");
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(auto_methods) / sizeof(auto_methods[0]); i++) {
+        if (qdisc_bypass && !auto_methods[i].qdisc_bypass && auto_methods[i].type != SP_TYPE_NONE)
+            continue;
+
+        if ((sp = sendpacket_try_open(options->intf1_name, ebuf, TCPR_DIR_C2S,
+                auto_methods[i].type)) == NULL) {
+            dbgx(1, "--auto-method: %s unavailable on %s: %s", auto_methods[i].name,
+                    options->intf1_name, ebuf);
+            continue;
+        }
+
+        if (sendpacket_get_dlt(sp) != DLT_EN10MB) {
+            sendpacket_close(sp);
+            notice("--auto-method: %s isn't Ethernet, using the default method",
+                    options->intf1_name);
+            return 0;
+        }
+
+        pps = 0.0;
+        if (!auto_methods[i].qdisc_bypass || sendpacket_set_qdisc_bypass(sp, true) == 0)
+            pps = auto_method_burst(sp);
+        sendpacket_close(sp);
+
+        notice("--auto-method: %s on %s: %.0f pps", auto_methods[i].name,
+                options->intf1_name, pps);
+        if (pps > best_pps) {
+            best_pps = pps;
+            best = i;
+        }
+    }
+
+    if (best_pps == 0.0) {
+        tcpreplay_seterr(ctx, "--auto-method: unable to send on %s with any method",
+                options->intf1_name);
+        return -1;
+    }
+
+    notice("--auto-method: sending with %s, calibrated at %.0f pps",
+            auto_methods[best].name, best_pps);
+    ctx->sp_type = auto_methods[best].type;
+    if (auto_methods[best].qdisc_bypass)
+        options->qdisc_bypass = true;
+
+    return 0;
+}
+
+#if defined HAVE_NETMAP && defined __FreeBSD__
+/**
+ * netmap is native on FreeBSD and sends far faster than /dev/bpf, so
+ * use it when nothing else was asked for and every interface supports
+ * it.  Features which need the kernel path keep BPF.
+ */
+static void
+tcpreplay_prefer_netmap(tcpreplay_t *ctx, const char *intf2)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    if (ctx->sp_type != SP_TYPE_NONE || options->merge ||
+            options->workers > 1 || options->clients > 1 || options->flow_timing)
+        return;
+
+    if (!sendpacket_netmap_capable(options->intf1_name) ||
+            (intf2 != NULL && !sendpacket_netmap_capable(intf2)))
+        return;
+
+    for (i = 0; i < options->fanout_intf_cnt; i++) {
+        if (!sendpacket_netmap_capable(options->fanout_intf_names[i]))
+            return;
+    }
+
+    notice("Using netmap on %s, use --bpf to send through /dev/bpf", options->intf1_name);
+    options->netmap = 1;
+    ctx->sp_type = SP_TYPE_NETMAP;
+}
+#endif
+
 /**
  * \brief Abort the tcpreplay_replay execution.
  *
@@ -1055,6 +3795,8 @@ tcpreplay_replay(tcpreplay_t *ctx, int idx)
 int
 tcpreplay_abort(tcpreplay_t *ctx)
 {
+    int i;
+
     assert(ctx);
     ctx->abort = true;
 
@@ -1066,6 +3808,17 @@ tcpreplay_abort(tcpreplay_t *ctx)
     if (ctx->intf2 != NULL)
         sendpacket_abort(ctx->intf2);
 
+    if (ctx->worker_intf != NULL) {
+        for (i = 1; i < ctx->options->workers; i++)
+            sendpacket_abort(ctx->worker_intf[i]);
+    }
+
+    for (i = 1; i < ctx->merge_intf_cnt; i++)
+        sendpacket_abort(ctx->merge_intf[i]);
+
+    for (i = 0; i < ctx->fanout_intf_cnt; i++)
+        sendpacket_abort(ctx->fanout_intf[i]);
+
     return 0;
 }
 
@@ -1123,6 +3876,287 @@ tcpreplay_is_running(tcpreplay_t *ctx)
     return ctx->running;
 }
 
+/**
+ * \brief Starts tcpreplay_replay() on its own thread and returns right away
+ *
+ * Use the progress callback, tcpreplay_get_stats() or tcpreplay_is_running()
+ * to follow the replay, and tcpreplay_wait() to collect its result.
+ */
+int
+tcpreplay_start_async(tcpreplay_t *ctx, int idx)
+{
+#ifdef HAVE_LIBPTHREAD
+    int rcode;
+
+    assert(ctx);
+
+    if (ctx->async_started) {
+        tcpreplay_seterr(ctx, "%s", "an async replay was already started");
+        return -1;
+    }
+
+    ctx->async_idx = idx;
+    ctx->async_rcode = 0;
+    ctx->running = true;    /* before we return, not once the thread runs */
+    if ((rcode = pthread_create(&ctx->async_thread, NULL, tcpreplay_async_main, ctx)) != 0) {
+        ctx->running = false;
+        tcpreplay_seterr(ctx, "Unable to start replay thread: %s", strerror(rcode));
+        return -1;
+    }
+
+    ctx->async_started = true;
+    return 0;
+#else
+    assert(ctx);
+    tcpreplay_seterr(ctx, "%s", "tcpreplay_start_async() requires pthread support");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Waits for a tcpreplay_start_async() replay to finish
+ *
+ * Returns what tcpreplay_replay() returned
+ */
+int
+tcpreplay_wait(tcpreplay_t *ctx)
+{
+#ifdef HAVE_LIBPTHREAD
+    int rcode;
+
+    assert(ctx);
+
+    if (!ctx->async_started) {
+        tcpreplay_seterr(ctx, "%s", "no async replay was started");
+        return -1;
+    }
+
+    if ((rcode = pthread_join(ctx->async_thread, NULL)) != 0) {
+        tcpreplay_seterr(ctx, "Unable to join replay thread: %s", strerror(rcode));
+        return -1;
+    }
+
+    ctx->async_started = false;
+    return ctx->async_rcode;
+#else
+    assert(ctx);
+    tcpreplay_seterr(ctx, "%s", "tcpreplay_wait() requires pthread support");
+    return -1;
+#endif
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *
+tcpreplay_async_main(void *arg)
+{
+    tcpreplay_t *ctx = (tcpreplay_t *)arg;
+    tcpreplay_stats_t snapshot;
+
+    ctx->async_rcode = tcpreplay_replay(ctx, ctx->async_idx);
+    ctx->running = false;
+
+    /* one last call with the final counters */
+    if (ctx->progress_cb != NULL) {
+        memcpy(&snapshot, &ctx->stats, sizeof(snapshot));
+        ctx->progress_cb(ctx, &snapshot, ctx->progress_user);
+    }
+
+    return NULL;
+}
+#endif
+
+/**
+ * \brief Changes the --mbps, --pps or --multiplier rate, also mid-run
+ *
+ * value is in the unit of the current speed mode: bits/sec for
+ * speed_mbpsrate, packets/sec for speed_packetrate and the factor for
+ * speed_multiplier.  The mode itself can't change and a --topspeed replay
+ * has no rate.  A running replay switches from its next packet on, without
+ * pausing and keeping its preloaded files.
+ */
+int
+tcpreplay_change_rate(tcpreplay_t *ctx, double value)
+{
+    tcpreplay_speed_t *speed;
+
+    assert(ctx);
+    speed = &ctx->options->speed;
+
+    switch (speed->mode) {
+    case speed_mbpsrate:
+        if (!speed->speed) {
+            tcpreplay_seterr(ctx, "%s", "a --topspeed replay has no rate to change");
+            return -1;
+        }
+        /* fall through */
+    case speed_packetrate:
+        if (value < 1.0) {
+            tcpreplay_seterr(ctx, "invalid rate: %f", value);
+            return -1;
+        }
+        break;
+
+    case speed_multiplier:
+        if (value <= 0.0) {
+            tcpreplay_seterr(ctx, "invalid multiplier: %f", value);
+            return -1;
+        }
+        break;
+
+    default:
+        tcpreplay_seterr(ctx, "%s", "the speed mode has no rate to change");
+        return -1;
+    }
+
+    if (!ctx->running) {
+        if (speed->mode == speed_multiplier)
+            speed->multiplier = (float)value;
+        else
+            speed->speed = (COUNTER)value;
+        return 0;
+    }
+
+    /* the send loop picks it up once it sees the new generation */
+    ctx->rate_pending = value;
+    __sync_synchronize();
+    ctx->rate_gen++;
+    return 0;
+}
+
+/**
+ * \brief Creates the control block an external rate controller uses
+ *
+ * name is the POSIX shared memory object to create, or NULL to have the
+ * block in this process for a controller thread.  Rate changes, pauses
+ * and source switches made through it with the ctl_block_*() calls take
+ * effect from the next packet or batch, see ctl_block.h.  Returns the
+ * block, or NULL on error.
+ */
+ctl_block_t *
+tcpreplay_set_control_shm(tcpreplay_t *ctx, const char *name)
+{
+    tcpreplay_opt_t *options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+
+    assert(ctx);
+    options = ctx->options;
+
+    if (ctx->ctl != NULL) {
+        tcpreplay_seterr(ctx, "%s", "the control block already exists");
+        return NULL;
+    }
+
+    if ((ctx->ctl = ctl_block_create(name, ebuf, sizeof(ebuf))) == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return NULL;
+    }
+
+    safe_free(options->control_shm);
+    options->control_shm = name ? safe_strdup(name) : NULL;
+    ctx->ctl_seen = 0;
+    ctx->ctl_rate_seen = 0;
+    ctx->ctl_source_seen = 0;
+    return ctx->ctl;
+}
+
+/**
+ * \brief Replays at the rate a profile gives over time, see rate_profile.c
+ *
+ * Rates are in the unit of the speed mode already set: Mbps for
+ * speed_mbpsrate, packets/sec for speed_packetrate or the multiplier.
+ * The profile starts with the first packet sent.  Set it before
+ * replaying; NULL drops it.
+ */
+int
+tcpreplay_set_rate_profile(tcpreplay_t *ctx, const char *spec)
+{
+    tcpreplay_opt_t *options;
+    rate_profile_t *profile;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    double scale, rate;
+
+    assert(ctx);
+    options = ctx->options;
+
+    if (spec == NULL) {
+        rate_profile_free(ctx->rate_profile);
+        ctx->rate_profile = NULL;
+        safe_free(options->rate_profile);
+        return 0;
+    }
+
+    switch (options->speed.mode) {
+    case speed_mbpsrate:
+        if (!options->speed.speed) {
+            tcpreplay_seterr(ctx, "%s", "--rate-profile can't be used with --topspeed");
+            return -1;
+        }
+        scale = 1000000.0;
+        break;
+
+    case speed_packetrate:
+    case speed_multiplier:
+        scale = 1.0;
+        break;
+
+    default:
+        tcpreplay_seterr(ctx, "%s", "--rate-profile requires --mbps, --pps or --multiplier");
+        return -1;
+    }
+
+    if ((profile = rate_profile_parse(spec, ebuf, sizeof(ebuf))) == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+
+    rate_profile_free(ctx->rate_profile);
+    ctx->rate_profile = profile;
+    ctx->rate_profile_scale = scale;
+    ctx->rate_profile_start = 0;
+    ctx->rate_profile_next = 0;
+    ctx->rate_profile_last = 0.0;   /* the first lookup hands it over */
+
+    safe_free(options->rate_profile);
+    options->rate_profile = safe_strdup(spec);
+
+    /* until then, the first packets go out at the starting rate */
+    rate = rate_profile_rate(profile, 0) * scale;
+    if (options->speed.mode == speed_multiplier)
+        options->speed.multiplier = (float)rate;
+    else
+        options->speed.speed = (COUNTER)max(rate, 1.0);
+
+    return 0;
+}
+
+/**
+ * \brief Calls callback with a statistics snapshot while replaying
+ *
+ * The callback runs every pkts packets and/or every msec milliseconds
+ * (0 turns either off), and once more when a tcpreplay_start_async()
+ * replay ends.  Pass a NULL callback to stop the calls.
+ */
+int
+tcpreplay_set_progress_callback(tcpreplay_t *ctx, tcpreplay_progress_callback callback,
+        void *user, COUNTER pkts, uint32_t msec)
+{
+    assert(ctx);
+
+    if (callback != NULL && !pkts && !msec) {
+        tcpreplay_seterr(ctx, "%s", "progress callback needs a packet count or an interval");
+        return -1;
+    }
+
+    ctx->progress_cb = NULL;
+    ctx->progress_user = user;
+    ctx->progress_pkts = pkts;
+    ctx->progress_ns = (uint64_t)msec * 1000000;
+    ctx->progress_last = ctx->stats.pkts_sent;
+    ctx->progress_next = 0;
+    ctx->progress_cb = callback;
+    return 0;
+}
+
 /**
  * \brief returns the current statistics during or after a replay
  *
@@ -1139,10 +4173,59 @@ tcpreplay_get_stats(tcpreplay_t *ctx)
 
     /* copy stats over so they don't change while caller is using the buffer */
     memcpy(&ctx->static_stats, &ctx->stats, sizeof(tcpreplay_stats_t));
+    tcpreplay_workers_stats(ctx, &ctx->static_stats);
     ptr = &ctx->static_stats;
     return ptr;
 }
 
+/**
+ * \brief Returns what source idx has sent, or NULL if there's no such source
+ *
+ * Each source's counts are brought up to date once it has been replayed,
+ * or with --merge as each packet goes out.
+ */
+const tcpreplay_source_stats_t *
+tcpreplay_get_source_stats(tcpreplay_t *ctx, int idx)
+{
+    assert(ctx);
+
+    if (idx < 0 || idx >= ctx->options->source_cnt) {
+        tcpreplay_seterr(ctx, "invalid source index value: %d", idx);
+        return NULL;
+    }
+
+    return &ctx->options->sources[idx].stats;
+}
+
+/**
+ * \brief Brings the packet and byte counts in stats up to date while
+ * --workers are replaying a file
+ *
+ * Each worker only counts into its own worker_counters_t, with plain
+ * stores, so the totals are the counts from before the workers started
+ * plus a read of every worker's.  Leaves stats alone between files,
+ * when ctx->stats has them all.
+ */
+void
+tcpreplay_workers_stats(const tcpreplay_t *ctx, tcpreplay_stats_t *stats)
+{
+    int running = __atomic_load_n(&ctx->workers_running, __ATOMIC_ACQUIRE);
+    COUNTER pkts = ctx->workers_base.pkts_sent;
+    COUNTER bytes = ctx->workers_base.bytes_sent;
+    int i;
+
+    if (!running)
+        return;
+
+    for (i = 0; i < running; i++) {
+        pkts += __atomic_load_n(&ctx->worker_counters[i].pkts_sent, __ATOMIC_RELAXED);
+        bytes += __atomic_load_n(&ctx->worker_counters[i].bytes_sent, __ATOMIC_RELAXED);
+    }
+
+    stats->pkts_sent = pkts;
+    stats->bytes_sent = bytes;
+}
+
 
 /**
  * \brief returns the current number of sources/files to be sent
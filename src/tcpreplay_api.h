@@ -25,10 +25,26 @@
 #include "defines.h"
 #include "common/sendpacket.h"
 #include "common/tcpdump.h"
+#include "common/stats_export.h"
+#include "common/timeline.h"
+#include "common/rate_profile.h"
+#include "common/cpu_sched.h"
+#include "common/pacer.h"
+#include "common/tcp_segment.h"
+#include "common/measure.h"
+#include "common/ctl_block.h"
+#include "timestamp_trace.h"
+
+#ifdef TCPREPLAY_EDIT
+#include "tcpedit/tcpedit.h"
+#endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef ENABLE_DMALLOC
 #include <dmalloc.h>
@@ -46,15 +62,94 @@ struct tcpreplay_s; /* forward declare */
 typedef struct packet_cache_s {
     struct pcap_pkthdr pkthdr;
     u_char *pktdata;
-    struct packet_cache_s *next;
+    uint32_t flow_hash;     /* flow_hash() of the unedited packet */
+    uint8_t flow_type;      /* flow_entry_type_t from preloading, if flow stats */
+    uint16_t ts_nsec;       /* nanoseconds pkthdr.ts drops */
+    uint32_t iface;         /* pcapng interface id */
+    uint16_t ip_addr_off;   /* --unique-ip: last 32 bits of the source IP */
+    uint8_t ip_ver;         /* --unique-ip: 4, 6, 0 for non-IP, 0xff if unknown DLT */
+    uint8_t shared;         /* --preload-dedup: pktdata is shared, edit a copy of it */
+    pkt_meta_t meta;        /* headers of the packet as it was read */
 } packet_cache_t;
 
+/* how a cached packet is sent, resolved once, see desc_compile() */
+typedef struct packet_desc_s {
+    uint64_t delta_ns;      /* capture time since the newest earlier packet */
+    uint32_t len;           /* bytes to send, len or caplen */
+    uint8_t intf;           /* 0 for intf1, 1 for intf2 */
+    uint8_t skip;           /* the tcpprep cache says not to send it */
+} packet_desc_t;
+
+/* packet data is carved out of large blocks, cache line aligned */
+#define PACKET_ARENA_SIZE   (16 * 1024 * 1024)
+#define PACKET_ARENA_ALIGN  64
+
+/*
+ * --workers: what one worker has sent, alone on its cache line so the
+ * workers never write a line another one is using
+ */
+#define WORKER_COUNTERS_ALIGN 64
+
+typedef struct worker_counters_s {
+    COUNTER pkts_sent;
+    COUNTER bytes_sent;
+    uint8_t pad[WORKER_COUNTERS_ALIGN - 2 * sizeof(COUNTER)];
+} worker_counters_t;
+
+/* --prefetch: packets ahead of the one being sent whose data is loaded */
+#define PACKET_PREFETCH     4
+#define PACKET_PREFETCH_MAX 64
+
+/*
+ * --tx-timestamps: the gap asked for before a packet, kept by the id its
+ * transmit timestamp will come back with
+ */
+#define TX_TSTAMP_PENDING   4096    /* packets in flight, a power of 2 */
+#define TX_TSTAMP_DRAIN     32      /* sends between reads of the error queue */
+#define TX_TSTAMP_WAIT_MS   100     /* for stragglers once the replay is over */
+#define TX_TSTAMP_NO_GAP    UINT64_MAX  /* first packet of a new timeline */
+
+typedef struct wire_due_s {
+    uint32_t id;
+    uint64_t due_ns;
+} wire_due_t;
+
+/* one block of back to back packet data */
+typedef struct packet_arena_s {
+    struct packet_arena_s *next;
+    size_t size;
+    size_t used;
+    size_t map_len;     /* non-zero if block is a hugepage mapping */
+    u_char *data;
+} packet_arena_t;
+
 /* packet cache header */
 typedef struct file_cache_s {
     int index;
     int cached;
     int dlt;
-    packet_cache_t *packet_cache;
+    bool replayed;      /* a full pass was sent, per interface flow stats are in */
+    packet_cache_t *packet_cache;   /* dense array of packet_cnt headers */
+    COUNTER packet_cnt;
+    COUNTER packet_alloc;
+    packet_arena_t *arena;          /* packet data blocks, newest first */
+    struct pcap_mmap_s *mmap;       /* --mmap-pcap: packet data left in the mapping */
+    void *image;                    /* --preload-image: packet data is in this mapping */
+    size_t image_len;
+    struct dedup_table_s *dedup;    /* --preload-dedup: unique packet data, or NULL */
+
+    /* --workers: flow consistent partitions of packet_cache */
+    packet_cache_t ***worker_cache;
+    COUNTER *worker_cache_cnt;
+    bpf_u_int32 max_caplen;         /* --clients: largest packet copied */
+    pkt_meta_fn_t meta_fn;          /* get_pkt_meta_fn() of dlt, once preloading starts */
+
+    packet_desc_t *desc;            /* one per packet_cache entry */
+    bool edited;                    /* --preload-edit ran tcpedit on the cache */
+
+    /* --multiplier: nsec to wait before each packet, see schedule_compile() */
+    uint64_t *schedule;
+    float schedule_multiplier;      /* multiplier the schedule was built for */
 } file_cache_t;
 
 /* speed mode selector */
@@ -73,9 +168,29 @@ typedef struct {
     COUNTER speed;
     float multiplier;
     int pps_multi;
+    COUNTER burst;      /* token bucket depth in bytes (mbps) or packets (pps) */
     u_int32_t (*manual_callback)(struct tcpreplay_s *, char *, COUNTER);
 } tcpreplay_speed_t;
 
+/* --late-policy: what happens to a packet which is due before it can go */
+typedef enum {
+    late_default = 0,   /* --multiplier catches up, --mbps/--pps stretch after a --burst */
+    late_catchup,       /* send it, and the packets behind it back to back until on time */
+    late_stretch,       /* send it and push the rest of the timeline back */
+    late_drop,          /* don't send it */
+    late_fail           /* stop the replay with an error */
+} tcpreplay_late_policy;
+
+/* default --late-threshold */
+#define LATE_THRESHOLD_NSEC 100000
+
+/* default --burst for --mbps and --pps */
+#define PACER_BURST_BYTES   3028    /* two full sized Ethernet frames */
+#define PACER_BURST_PACKETS 2
+
+/* --start-at: how long before the start the realtime sleep ends */
+#define START_AT_LEAD_NSEC  2000000
+
 /* accurate mode selector */
 typedef enum {
     accurate_gtod = 0,
@@ -83,19 +198,62 @@ typedef enum {
     accurate_rdtsc = 2,
     accurate_ioport = 3,
     accurate_nanosleep = 4,
-    accurate_abs_time = 5
+    accurate_abs_time = 5,
+    accurate_txtime = 6,
+    accurate_hybrid = 7
 } tcpreplay_accurate;
 
 typedef enum {
     source_filename = 1,
     source_fd = 2,
-    source_cache = 3
+    source_cache = 3,
+    source_shm = 4
 } tcpreplay_source_type;
 
+/* what one source sent, see tcpreplay_get_source_stats() */
+typedef struct {
+    COUNTER pkts_sent;
+    COUNTER bytes_sent;
+    COUNTER retries;            /* sends repeated on EAGAIN or ENOBUFS */
+    COUNTER late_packets;       /* more than --late-threshold behind */
+    COUNTER late_dropped;       /* of those, dropped by --late-policy=drop */
+    COUNTER passes;             /* times it was replayed */
+    COUNTER time_ns;            /* spent replaying it */
+} tcpreplay_source_stats_t;
+
+/* tcpreplay_add_pcapfile() of shm:NAME adds the shared memory ring NAME */
+#define SHM_SOURCE_PREFIX "shm:"
+
 typedef struct {
     tcpreplay_source_type type;
     int fd;
     char *filename;
+    struct pcap_mmap_s *mmap;   /* set while replaying a mapped file */
+    struct pcap_index_s *index; /* sidecar offset index, if the file has one */
+    bool index_loaded;          /* looked for the index already */
+    /* --start-packet/--start-time/--end-time state of the open file */
+    bool positioned;            /* seeked to the start of the window */
+    bool in_window;             /* passed the start of the window */
+    bool window_end;            /* passed --end-time */
+    COUNTER read_packets;       /* last packet # read from the file */
+    COUNTER first_usec;         /* timestamp of packet 1 */
+    /* of the last packet read, only the mapped reader knows them */
+    uint32_t pkt_nsec;          /* nanoseconds its pkthdr.ts drops */
+    uint32_t pkt_iface;         /* pcapng interface id */
+    bool nsec_pcap;             /* libpcap hands us nanosecond timestamps */
+    /* source_cache: the caller's packets, see tcpreplay_add_cache() */
+    const struct pcap_pkthdr *cache_pkthdrs;
+    u_char *const *cache_pktdata;
+    COUNTER cache_cnt;
+    /* source_fd: stdio buffer of the open stream, and whether it was read */
+    void *fd_buf;
+    bool fd_read;
+    bool fd_close;              /* opened by tcpreplay, close it with the context */
+    /* source_filename: reader kept open for the next --loop pass */
+    pcap_t *reader;
+    off_t reader_off;           /* of packet 1, -1 if it can't be rewound */
+    struct shm_ring_s *shm;     /* source_shm: the attached ring */
+    tcpreplay_source_stats_t stats;
 } tcpreplay_source_t;
 
 /* run-time options */
@@ -106,8 +264,10 @@ typedef struct tcpreplay_opt_s {
 
     tcpreplay_speed_t speed;
     u_int32_t loop;
+    int64_t loop_gap_ns;    /* --loop-gap, -1 for the mean gap of the pass */
 
     int stats;
+    bool source_stats;          /* print tcpreplay_source_stats_t of each source at the end */
     bool use_pkthdr_len;
 
     /* tcpprep cache data */
@@ -115,6 +275,16 @@ typedef struct tcpreplay_opt_s {
     char *cachedata;
     char *comment; /* tcpprep comment */
 
+    /* --prep: split preloaded packets without a cache file */
+    tcpr_cidr_t *prep_cidr;             /* sources on intf1, or NULL */
+    tcpr_services_t *prep_services;     /* servers on intf1, or NULL */
+
+    int fragroute_dir;      /* --fragdir FRAGROUTE_DIR_*: intf1 is c2s, intf2 is s2c */
+
+    /* --queue-map: the queue of each packet, used as its flow hash */
+    u_int8_t *queue_map;
+    COUNTER queue_map_packets;
+
     /* deal with MTU/packet len issues */
     int mtu;
 
@@ -124,12 +294,81 @@ typedef struct tcpreplay_opt_s {
     /* limit # of packets to send */
     COUNTER limit_send;
 
+    /* only replay part of each file */
+    bool read_window;
+    COUNTER start_packet;
+    COUNTER start_time_us;      /* after the first packet of the file */
+    COUNTER end_time_us;        /* 0 for the end of the file */
+
+    /* max # of packets per sendpacket_batch() call */
+    int batch_size;
+
+    /* # of preloaded packets to prefetch ahead, 0 for none */
+    int prefetch;
+
+    /* # of sending threads */
+    int workers;
+
+    /* --clients: copies of each packet, spread over the workers */
+    uint32_t clients;
+
+    /* --flow-timing: as many --clients as --mbps or --pps takes, each at the file's timing */
+    bool flow_timing;
+
+    /* PF_PACKET: skip the qdisc layer */
+    bool qdisc_bypass;
+
+    /* PF_PACKET: NIC completes the TCP/UDP checksums */
+    bool csum_offload;
+
+    /* PF_PACKET: kernel or NIC segments TCP packets longer than the MTU */
+    bool gso;
+
+    /* --segment: split TCP packets above this MTU in software, 0 for off */
+    uint32_t segment_mtu;
+
+    /* time sends and sample TX ring occupancy */
+    bool tx_telemetry;
+
+    /* time the send gaps by when packets left, not when they were sent */
+    bool tx_timestamps;
+
+    /* how to wait when an interface pushes back */
+    sendpacket_backoff_t backoff;
+    uint32_t stage_profile;     /* time 1 in this many packets per stage, 0 for off */
+
+    /* --cpu, --helper-cpu: where sending and helper threads run, NULL for anywhere */
+    cpu_list_t *sender_cpus;
+    cpu_list_t *helper_cpus;
+    int rt_priority;            /* SCHED_FIFO priority of the senders, 0 for off */
+    bool mlock;
+
     /* maximum sleep time between packets */
     struct timespec maxsleep;
 
+    /* --late-policy applies to packets more than late_threshold_ns late */
+    tcpreplay_late_policy late_policy;
+    uint64_t late_threshold_ns;
+
     /* pcap file caching */
     file_cache_t file_cache[MAX_FILES];
     bool preload_pcap;
+    u_int32_t preload_snaplen;  /* bytes of each packet to preload, 0 for all */
+    bool preload_dedup;     /* store identical packets once */
+    bool preload_edit;      /* tcpedit the cache once, not on every pass */
+    bool preload_image;     /* map the cache from <pcap>.tcprimg, write it if stale */
+    bool mmap_pcap;         /* read files via pcap_mmap rather than libpcap */
+    bool pcapng_intf;       /* pcapng interface 0 to intf1, the rest to intf2 */
+    bool pipeline;          /* read/edit on a separate thread from sending */
+    bool dual_queues;       /* --dualfile: a sending thread per interface */
+    bool control;           /* --control: jobs may ask for a partition of the flows */
+    uint64_t start_at;      /* --start-at, CLOCK_REALTIME nsec, 0 for right away */
+    size_t preload_window;  /* --preload-window bytes, 0 for off */
+    size_t max_memory;      /* --max-memory: preload cache budget in bytes, 0 for none */
+    size_t hugepage_size;   /* page size backing the cache, 0 for default */
+
+    /* --follow: keep reading directory sources as files are added */
+    bool follow;
 
     /* pcap files/sources to replay */
     int source_cnt;
@@ -145,13 +384,42 @@ typedef struct tcpreplay_opt_s {
     /* dual file mode */
     bool dualfile;
 
+    /* --merge: every source at once, in timestamp order */
+    bool merge;
+    int merge_intf_cnt;
+    char *merge_intf_names[MAX_FILES];  /* source i goes out [i], the rest intf1 */
+
+    /* --fanout-intf: every packet also goes out each of these */
+    int fanout_intf_cnt;
+    char *fanout_intf_names[MAX_FILES];
+
 #ifdef HAVE_NETMAP
     int netmap;
+    bool netmap_multiqueue;
 #endif
 
     /* print flow statistic */
     bool flow_stats;
     int flow_expiry;
+    char *flow_records;     /* --flow-records file, or NULL */
+
+    /* machine readable statistics */
+    char *stats_export;     /* file, or NULL */
+    char *control_shm;      /* --control-shm object name, or NULL */
+    int stats_port;         /* HTTP port, or 0 */
+    char *stats_bind;       /* address stats_port listens on, NULL for loopback */
+    stats_export_format_t stats_format;
+
+    /* --timeline: achieved vs target rate per interval */
+    char *timeline;         /* file, or NULL */
+    timeline_format_t timeline_format;
+    uint32_t timeline_interval; /* msec */
+
+    /* --measure: receive on this interface, the tag at measure_offset */
+    char *measure_intf;     /* or NULL */
+    int measure_offset;     /* or MEASURE_TRAILER */
+
+    char *rate_profile;     /* --rate-profile spec, or NULL */
 
     int unique_ip;
 } tcpreplay_opt_t;
@@ -163,6 +431,20 @@ typedef enum {
     intf2
 } tcpreplay_intf;
 
+/*
+ * progress callback definition:
+ * ctx              = tcpreplay context
+ * stats            = snapshot of the statistics, only valid during the call
+ * user             = pointer given to tcpreplay_set_progress_callback()
+ *
+ * Runs on the thread sending packets, so return quickly.  Calling
+ * tcpreplay_abort() or tcpreplay_change_rate() from the callback is fine.
+ */
+typedef void (*tcpreplay_progress_callback)(struct tcpreplay_s *ctx,
+        const tcpreplay_stats_t *stats, void *user);
+
+struct pipeline_s;
+
 /* tcpreplay context variable */
 #define TCPREPLAY_ERRSTR_LEN 1024
 typedef struct tcpreplay_s {
@@ -170,6 +452,15 @@ typedef struct tcpreplay_s {
     interface_list_t *intlist;
     sendpacket_t *intf1;
     sendpacket_t *intf2;
+    sendpacket_t **worker_intf;     /* one per worker, [0] is intf1 */
+    worker_counters_t *worker_counters; /* one per worker, see tcpreplay_workers_stats() */
+    int workers_running;            /* # of worker_counters in use, 0 between files */
+    worker_counters_t workers_base; /* ctx->stats when they were started */
+    sendpacket_t **merge_intf;      /* --merge: distinct handles, [0] is intf1 */
+    int merge_intf_cnt;
+    sendpacket_t **merge_map;       /* --merge: handle of each --merge-intf source */
+    sendpacket_t **fanout_intf;     /* --fanout-intf handles */
+    int fanout_intf_cnt;
     int intf1dlt;
     int intf2dlt;
     u_int32_t iteration;
@@ -180,18 +471,111 @@ typedef struct tcpreplay_s {
     int cache_bit;
     int cache_byte;
     int current_source; /* current source input being replayed */
+    const bool *source_sel; /* --control job: sources to replay, or NULL for all */
+    uint32_t partition_cnt; /* --control job: only flows with flow_hash % cnt */
+    uint32_t partition_idx; /* == idx, or 0 for every flow */
+
+    /* tcpprep cache directions of packets cache_dir_first and on */
+    u_int8_t cache_dirs[CACHE_DIR_BATCH];
+    COUNTER cache_dir_first;
+    int cache_dir_cnt;
 
     /* do_sleep helpers */
     struct timespec nap;
     uint32_t skip_packets;
     int first_time;
+    uint64_t txtime_next;           /* accurate_txtime: CLOCK_TAI nsec */
+    uint64_t abs_deadline;          /* accurate_abs_time: CLOCK_MONOTONIC nsec */
+    bool deadline_only;             /* --dual-queues: do_sleep() only moves abs_deadline */
+    uint64_t start_deadline;        /* --start-at: CLOCK_MONOTONIC of the first packet, 0 once sent */
+    uint64_t mult_start_ns;         /* --multiplier: CLOCK_MONOTONIC origin, 0 for unset */
+    uint64_t mult_due_ns;           /* --multiplier: last packet due, from mult_start_ns */
+    uint64_t mult_now_ns;           /* --multiplier: last clock reading */
+    uint64_t mult_ts_ns;            /* --multiplier: capture time since mult_start_ns */
+    uint64_t mult_scaled_ns;        /* --multiplier: mult_ts_ns / multiplier */
+    pacer_t pacer;                  /* --mbps/--pps token bucket */
+    const uint64_t *schedule_nap;   /* precompiled nap for this packet or NULL */
+    bool loop_wrap;                 /* the next packet follows a pass, see pass_end() */
+    uint64_t loop_gap_ns;           /* capture time from the last pass to the next packet */
+    uint64_t pass_first_ns;         /* capture time of the first packet of the pass */
+    COUNTER pass_pkts;              /* packets do_sleep() timed in the pass */
+    uint64_t timing_last_ns;        /* CLOCK_MONOTONIC of the last send, 0 for none */
+    uint64_t timing_due_ns;         /* gap asked for since then */
+    wire_due_t *wire_due;           /* --tx-timestamps: TX_TSTAMP_PENDING gaps asked for */
+    uint32_t wire_next_id;          /* id of the first packet sent after the last one timed */
+    uint32_t wire_seen;             /* id of the next timestamp expected back */
+    uint64_t wire_last_ns;          /* departure of wire_seen - 1, 0 for none */
+    uint32_t wire_countdown;        /* sends until the error queue is read */
+    bool wire_restart;              /* the next packet starts a new timeline */
+    int send_loop;                  /* send_loop() variant of the replay or -1, see send_loop_select() */
+    uint32_t stage_countdown;       /* --stage-profile: packets until the next sample */
+    uint64_t sleep_spin_nsec;       /* absolute_sleep() spin, see sleep_spin_calibrate() */
+    bool sleep_spin_calibrated;     /* sleep_spin_nsec was measured, see tcpreplay_calibrate_spin() */
+    timestamp_trace_t *trace;       /* TIMESTAMP_TRACE builds only */
+    struct fragroute_s *frag_ctx;   /* --fragroute or NULL */
+    struct frag_delayed_s *frag_delayed;    /* fragments not due yet, soonest first */
+    int frag_delayed_cnt;
+    int frag_delayed_alloc;
+    tcp_segment_t segs;             /* --segment: the segments of the packet being sent */
+#ifdef TCPREPLAY_EDIT
+    tcpedit_t *tcpedit;             /* edits each packet before it is sent, or NULL */
+#endif
 
     /* counter stats */
     tcpreplay_stats_t stats;
     tcpreplay_stats_t static_stats; /* stats returned by tcpreplay_get_stats() */
+    stats_export_t *stats_export;   /* --stats-export/--stats-port thread or NULL */
+    COUNTER stats_published;        /* pkts_sent of the last snapshot it was given */
+    uint64_t stats_next_print;      /* --stats: STATS_CLOCK nsec of the next print */
+    timeline_t *timeline;           /* --timeline or NULL */
+    measure_t *measure;             /* --measure or NULL */
+    uint64_t timeline_next;         /* STATS_CLOCK nsec of its next row */
+    tcpreplay_progress_callback progress_cb;    /* or NULL */
+    void *progress_user;
+    COUNTER progress_pkts;          /* call it every this many packets, or 0 */
+    uint64_t progress_ns;           /* and/or every this many nsec, or 0 */
+    COUNTER progress_last;          /* pkts_sent at the last call */
+    uint64_t progress_next;         /* STATS_CLOCK nsec of the next call */
+
+    /* tcpreplay_change_rate() while replaying */
+    volatile double rate_pending;
+    volatile uint32_t rate_gen;     /* bumped once rate_pending is set */
+    uint32_t rate_seen;             /* rate_gen the send loop has applied */
+
+    /* --control-shm, see ctl_block.h */
+    ctl_block_t *ctl;               /* or NULL */
+    uint32_t ctl_seen;              /* ctl->gen the send loop has applied */
+    uint32_t ctl_rate_seen;
+    uint32_t ctl_source_seen;
+    int ctl_switch;                 /* source to carry on from once this one stops, or -1 */
+
+    /* --rate-profile */
+    rate_profile_t *rate_profile;   /* or NULL */
+    double rate_profile_scale;      /* profile unit to tcpreplay_change_rate() unit */
+    double rate_profile_last;       /* rate last handed to the send loop */
+    uint64_t rate_profile_start;    /* STATS_CLOCK nsec it started, 0 before */
+    uint64_t rate_profile_next;     /* STATS_CLOCK nsec of the next lookup */
+    volatile bool rate_profile_reload;  /* SIGHUP: parse it again and restart */
+
+#ifdef HAVE_LIBPTHREAD
+    /* tcpreplay_start_async() */
+    pthread_t async_thread;
+    bool async_started;
+    int async_idx;
+    int async_rcode;
+#endif
+    struct pipeline_s *window;      /* --preload-window reader, once started */
+    COUNTER preload_bytes;          /* --max-memory: cache allocated so far, shared by preload threads */
+    volatile bool preload_over;     /* --max-memory: preload_bytes went over, stop preloading */
 
     /* flow statistics */
     flow_hash_table_t *flow_hash_table;
+    uint32_t flow_hash;             /* flow_hash() of the last packet in flow stats */
+    struct flow_records_s *flow_records;    /* --flow-records writer or NULL */
+
+    u_char *scratch;                /* copy of a packet being edited, see scratch_copy() */
+    size_t scratch_len;
+    bool late_failed;               /* --late-policy=fail stopped the replay */
 
     /* abort, suspend & running flags */
     volatile bool abort;
@@ -229,16 +613,76 @@ int tcpreplay_set_speed_mode(tcpreplay_t *, tcpreplay_speed_mode);
 int tcpreplay_set_speed_speed(tcpreplay_t *, COUNTER);
 int tcpreplay_set_speed_pps_multi(tcpreplay_t *, int);
 int tcpreplay_set_loop(tcpreplay_t *, u_int32_t);
+int tcpreplay_set_loop_gap(tcpreplay_t *, int64_t);
 int tcpreplay_set_unique_ip(tcpreplay_t *, int);
 int tcpreplay_set_netmap(tcpreplay_t *, bool);
+int tcpreplay_set_af_xdp(tcpreplay_t *, bool);
+int tcpreplay_set_io_uring(tcpreplay_t *, bool);
+int tcpreplay_set_dpdk(tcpreplay_t *, const char *);
+int tcpreplay_set_null_sink(tcpreplay_t *, bool);
+int tcpreplay_set_batch_size(tcpreplay_t *, int);
+int tcpreplay_set_prefetch(tcpreplay_t *, int);
+int tcpreplay_set_workers(tcpreplay_t *, int);
+int tcpreplay_set_clients(tcpreplay_t *, uint32_t);
+int tcpreplay_set_flow_timing(tcpreplay_t *, bool);
+int tcpreplay_set_follow(tcpreplay_t *, bool);
+#ifdef TCPREPLAY_EDIT
+int tcpreplay_set_tcpedit(tcpreplay_t *, tcpedit_t *);
+#endif
+int tcpreplay_set_hugepage_size(tcpreplay_t *, int);
+int tcpreplay_set_mmap_pcap(tcpreplay_t *, bool);
+int tcpreplay_set_pcapng_intf(tcpreplay_t *, bool);
+int tcpreplay_set_pipeline(tcpreplay_t *, bool);
+int tcpreplay_set_dual_queues(tcpreplay_t *, bool);
+int tcpreplay_set_preload_window(tcpreplay_t *, int);
+int tcpreplay_set_max_memory(tcpreplay_t *, int);
+int tcpreplay_set_stats_export(tcpreplay_t *, const char *, stats_export_format_t, const char *, int);
+int tcpreplay_set_timeline(tcpreplay_t *, const char *, timeline_format_t, uint32_t);
+int tcpreplay_set_measure(tcpreplay_t *, const char *, int);
+void tcpreplay_measure_stop(tcpreplay_t *);
+int tcpreplay_set_flow_records(tcpreplay_t *, const char *);
+int tcpreplay_set_qdisc_bypass(tcpreplay_t *, bool);
+int tcpreplay_set_csum_offload(tcpreplay_t *, bool);
+int tcpreplay_set_gso(tcpreplay_t *, bool);
+int tcpreplay_set_segment(tcpreplay_t *, uint32_t);
+int tcpreplay_set_tx_telemetry(tcpreplay_t *, bool);
+int tcpreplay_set_tx_timestamps(tcpreplay_t *, bool);
+int tcpreplay_set_backoff(tcpreplay_t *, sendpacket_backoff_t);
+int tcpreplay_set_late_policy(tcpreplay_t *, tcpreplay_late_policy, uint64_t);
+int tcpreplay_set_stage_profile(tcpreplay_t *, uint32_t);
+int tcpreplay_set_sender_cpus(tcpreplay_t *, const char *);
+int tcpreplay_set_helper_cpus(tcpreplay_t *, const char *);
+int tcpreplay_set_rt_priority(tcpreplay_t *, int);
+int tcpreplay_set_mlock(tcpreplay_t *, bool);
 int tcpreplay_set_use_pkthdr_len(tcpreplay_t *, bool);
 int tcpreplay_set_mtu(tcpreplay_t *, int);
 int tcpreplay_set_accurate(tcpreplay_t *, tcpreplay_accurate);
+int tcpreplay_set_start_at(tcpreplay_t *, uint64_t);
+int tcpreplay_parse_start_at(tcpreplay_t *, const char *);
 int tcpreplay_set_limit_send(tcpreplay_t *, COUNTER);
+int tcpreplay_set_start_packet(tcpreplay_t *, COUNTER);
+int tcpreplay_set_start_time(tcpreplay_t *, COUNTER);
+int tcpreplay_set_end_time(tcpreplay_t *, COUNTER);
 int tcpreplay_set_dualfile(tcpreplay_t *, bool);
+int tcpreplay_set_merge(tcpreplay_t *, bool);
+int tcpreplay_add_merge_intf(tcpreplay_t *, const char *);
+int tcpreplay_add_fanout_intf(tcpreplay_t *, const char *);
 int tcpreplay_set_tcpprep_cache(tcpreplay_t *, char *);
+int tcpreplay_set_prep(tcpreplay_t *, const char *);
+int tcpreplay_set_queue_map(tcpreplay_t *, const char *);
+int tcpreplay_set_fragroute(tcpreplay_t *, const char *);
+int tcpreplay_set_fragdir(tcpreplay_t *, const char *);
 int tcpreplay_add_pcapfile(tcpreplay_t *, char *);
+int tcpreplay_add_cache(tcpreplay_t *, const char *, int, const struct pcap_pkthdr *,
+        u_char *const *, COUNTER);
+int tcpreplay_add_pcapfd(tcpreplay_t *, const char *, int);
+int tcpreplay_add_dir(tcpreplay_t *, const char *);
+int tcpreplay_add_shm(tcpreplay_t *, const char *);
 int tcpreplay_set_preload_pcap(tcpreplay_t *, bool);
+int tcpreplay_set_preload_edit(tcpreplay_t *, bool);
+int tcpreplay_set_preload_snaplen(tcpreplay_t *, u_int32_t);
+int tcpreplay_set_preload_dedup(tcpreplay_t *, bool);
+int tcpreplay_set_preload_image(tcpreplay_t *, bool);
 
 /* information */
 int tcpreplay_get_source_count(tcpreplay_t *);
@@ -251,12 +695,22 @@ int tcpreplay_get_flow_expiry(tcpreplay_t *);
 /* functions controlling execution */
 int tcpreplay_prepare(tcpreplay_t *);
 int tcpreplay_replay(tcpreplay_t *, int);
+int tcpreplay_wait_start(tcpreplay_t *);
 const tcpreplay_stats_t *tcpreplay_get_stats(tcpreplay_t *);
+const tcpreplay_source_stats_t *tcpreplay_get_source_stats(tcpreplay_t *, int);
+void tcpreplay_workers_stats(const tcpreplay_t *, tcpreplay_stats_t *);
 int tcpreplay_abort(tcpreplay_t *);
 int tcpreplay_suspend(tcpreplay_t *);
 int tcpreplay_restart(tcpreplay_t *);
 bool tcpreplay_is_suspended(tcpreplay_t *);
 bool tcpreplay_is_running(tcpreplay_t *);
+int tcpreplay_start_async(tcpreplay_t *, int);
+int tcpreplay_wait(tcpreplay_t *);
+int tcpreplay_change_rate(tcpreplay_t *, double);
+ctl_block_t *tcpreplay_set_control_shm(tcpreplay_t *, const char *);
+int tcpreplay_set_rate_profile(tcpreplay_t *, const char *);
+int tcpreplay_set_progress_callback(tcpreplay_t *, tcpreplay_progress_callback,
+        void *, COUNTER, uint32_t);
 
 /* set callback for manual stepping */
 int tcpreplay_set_manual_callback(tcpreplay_t *ctx, tcpreplay_manual_callback);
@@ -37,6 +37,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "tcprewrite.h"
 #include "tcprewrite_opts.h"
@@ -59,12 +62,22 @@ void tcprewrite_init(void);
 void post_args(int argc, char *argv[]);
 void verify_input_pcap(pcap_t *pcap);
 int rewrite_packets(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout);
+static void dump_packet(pcap_dumper_t *pout, struct pcap_pkthdr *pkthdr, u_char *pktdata);
+static void write_fragments(tcpedit_t *tcpedit, pcap_dumper_t *pout, struct pcap_pkthdr *pkthdr,
+        u_char *pktdata, tcpr_dir_t cache_result, COUNTER packetnum);
+static void write_packet(tcpedit_t *tcpedit, pcap_dumper_t *pout, struct pcap_pkthdr *pkthdr,
+        u_char *pktdata, tcpr_dir_t cache_result, COUNTER packetnum);
+#ifdef HAVE_LIBPTHREAD
+static int rewrite_packets_workers(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout);
+#endif
 
 int 
 main(int argc, char *argv[])
 {
     int optct, rcode;
+    tcpr_compress_t compress;
     pcap_t *dlt_pcap;
+    char errbuf[PCAP_ERRBUF_SIZE];
 #ifdef ENABLE_FRAGROUTE
     char ebuf[FRAGROUTE_ERRBUF_LEN];
 #endif
@@ -96,6 +109,24 @@ main(int argc, char *argv[])
                 tcpedit_geterr(tcpedit));
     }
 
+    /* every --workers thread edits with an identically configured context */
+    if (options.workers > 1) {
+        int i;
+
+        options.worker_tcpedit = (tcpedit_t **)safe_malloc(options.workers * sizeof(tcpedit_t *));
+        for (i = 0; i < options.workers; i++) {
+            if (tcpedit_init(&options.worker_tcpedit[i], pcap_datalink(options.pin)) < 0)
+                errx(-1, "Error initializing tcpedit: %s", tcpedit_geterr(options.worker_tcpedit[i]));
+
+            if (tcpedit_post_args(options.worker_tcpedit[i]) < 0)
+                errx(-1, "Unable to parse args: %s", tcpedit_geterr(options.worker_tcpedit[i]));
+
+            if (tcpedit_validate(options.worker_tcpedit[i]) < 0)
+                errx(-1, "Unable to edit packets given options:\n%s",
+                        tcpedit_geterr(options.worker_tcpedit[i]));
+        }
+    }
+
    /* open up the output file */
     options.outfile = safe_strdup(OPT_ARG(OUTFILE));
     dbgx(1, "Rewriting DLT to %s",
@@ -119,18 +150,48 @@ main(int argc, char *argv[])
     }
 #endif
 
-    if ((options.pout = pcap_dump_open(dlt_pcap, options.outfile)) == NULL)
+    /* libpcap can't compress or write pcapng, so those always use our writer */
+    compress = TCPR_COMPRESS_NONE;
+    if (HAVE_OPT(COMPRESS) && compress_from_name(OPT_ARG(COMPRESS), &compress) < 0)
+        errx(-1, "Unknown --compress method: %s", OPT_ARG(COMPRESS));
+
+    if (compress == TCPR_COMPRESS_NONE && compress_from_path(options.outfile) != TCPR_COMPRESS_NONE)
+        warnx("%s is written uncompressed, use --compress=%s to compress it",
+                options.outfile, compress_name(compress_from_path(options.outfile)));
+
+    if (HAVE_OPT(WRITE_BUFFER) || HAVE_OPT(PCAPNG) || compress != TCPR_COMPRESS_NONE) {
+        options.writer = pcap_writer_open(options.outfile,
+                HAVE_OPT(PCAPNG) ? PCAP_WRITER_PCAPNG : PCAP_WRITER_PCAP,
+                pcap_datalink(dlt_pcap), 65535,
+                HAVE_OPT(WRITE_BUFFER) ? (size_t)OPT_VALUE_WRITE_BUFFER * 1024 * 1024 : 0,
+                HAVE_OPT(DIRECT_IO), compress, errbuf);
+        if (options.writer == NULL)
+            errx(-1, "Unable to open output pcap file: %s", errbuf);
+    } else if ((options.pout = pcap_dump_open(dlt_pcap, options.outfile)) == NULL) {
         errx(-1, "Unable to open output pcap file: %s", pcap_geterr(dlt_pcap));
+    }
     pcap_close(dlt_pcap);
 
     /* rewrite packets */
+#ifdef HAVE_LIBPTHREAD
+    if (options.workers > 1) {
+        if (rewrite_packets_workers(tcpedit, options.pin, options.pout) != 0)
+            errx(-1, "Error rewriting packets: %s", tcpedit_geterr(tcpedit));
+    } else
+#endif
     if (rewrite_packets(tcpedit, options.pin, options.pout) != 0)
         errx(-1, "Error rewriting packets: %s", tcpedit_geterr(tcpedit));
 
 
     /* clean up after ourselves */
-    pcap_dump_close(options.pout);
+    if (options.writer != NULL) {
+        if (pcap_writer_close(options.writer, errbuf) < 0)
+            errx(-1, "%s", errbuf);
+    } else {
+        pcap_dump_close(options.pout);
+    }
     pcap_close(options.pin);
+    tcp_segment_free(&options.segs);
 
 #ifdef ENABLE_VERBOSE
     tcpdump_close(&tcpdump);
@@ -147,6 +208,7 @@ tcprewrite_init(void)
 {
 
     memset(&options, 0, sizeof(options));
+    options.workers = 1;
 
 #ifdef ENABLE_VERBOSE
     /* clear out tcpdump struct */
@@ -201,9 +263,20 @@ post_args(_U_ int argc, _U_ char *argv[])
     }
 #endif
 
+    if (HAVE_OPT(SEGMENT))
+        options.segment_mtu = OPT_VALUE_SEGMENT;
+
+    if (HAVE_OPT(WORKERS))
+        options.workers = OPT_VALUE_WORKERS;
+
+#ifndef HAVE_LIBPTHREAD
+    if (options.workers > 1)
+        errx(-1, "%s", "--workers requires pthread support");
+#endif
+
     /* open up the input file */
     options.infile = safe_strdup(OPT_ARG(INFILE));
-    if ((options.pin = pcap_open_offline(options.infile, ebuf)) == NULL)
+    if ((options.pin = tcpr_pcap_open_offline(options.infile, ebuf)) == NULL)
         errx(-1, "Unable to open input pcap file: %s", ebuf);
 
 #ifdef HAVE_PCAP_SNAPSHOT
@@ -223,24 +296,15 @@ rewrite_packets(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout)
     tcpr_dir_t cache_result = TCPR_DIR_C2S;     /* default to primary */
     struct pcap_pkthdr pkthdr, *pkthdr_ptr;     /* packet header */
     const u_char *pktconst = NULL;              /* packet from libpcap */
-    u_char **pktdata = NULL;
+    u_char *pktdata = NULL;
     static u_char *pktdata_buff;
-    static char *frag = NULL;
     COUNTER packetnum = 0;
     int rcode;
-#ifdef ENABLE_FRAGROUTE
-    int frag_len, i, proto;
-#endif
 
     pkthdr_ptr = &pkthdr;
 
     if (pktdata_buff == NULL)
-        pktdata_buff = (u_char *)safe_malloc(MAXPACKET);
-
-    pktdata = &pktdata_buff;
-
-    if (frag == NULL)
-        frag = (char *)safe_malloc(MAXPACKET);
+        pktdata_buff = (u_char *)safe_malloc(TCPEDIT_HEADROOM + MAXPACKET);
 
     /* MAIN LOOP 
      * Keep sending while we have packets or until
@@ -252,13 +316,15 @@ rewrite_packets(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout)
 
         /* 
          * copy over the packet so we can pad it out if necessary and
-         * because pcap_next() returns a const ptr
+         * because pcap_next() returns a const ptr.  The headroom in front
+         * lets tcpedit grow the L2 header without moving the packet
          */
-        memcpy(*pktdata, pktconst, pkthdr.caplen);
+        pktdata = pktdata_buff + TCPEDIT_HEADROOM;
+        memcpy(pktdata, pktconst, pkthdr.caplen);
 
 #ifdef ENABLE_VERBOSE
         if (options.verbose)
-            tcpdump_print(&tcpdump, pkthdr_ptr, *pktdata);
+            tcpdump_print(&tcpdump, pkthdr_ptr, pktdata);
 #endif
 
         /* Dual nic processing? */
@@ -275,7 +341,8 @@ rewrite_packets(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout)
         if (cache_result == TCPR_DIR_NOSEND)
             goto WRITE_PACKET; /* still need to write it so cache stays in sync */
 
-        if ((rcode = tcpedit_packet(tcpedit, &pkthdr_ptr, pktdata, cache_result)) == TCPEDIT_ERROR) {
+        if ((rcode = tcpedit_packet_headroom(tcpedit, &pkthdr_ptr, &pktdata, cache_result,
+                TCPEDIT_HEADROOM)) == TCPEDIT_ERROR) {
             return -1;
         } else if ((rcode == TCPEDIT_SOFT_ERROR) && HAVE_OPT(SKIP_SOFT_ERRORS)) {
             /* don't write packet */
@@ -285,41 +352,394 @@ rewrite_packets(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout)
 
 
 WRITE_PACKET:
+        write_packet(tcpedit, pout, pkthdr_ptr, pktdata, cache_result, packetnum);
+    } /* while() */
+    return 0;
+}
+
+/**
+ * pcap_dump() or --write-buffer
+ */
+static void
+dump_packet(pcap_dumper_t *pout, struct pcap_pkthdr *pkthdr, u_char *pktdata)
+{
+    if (options.writer == NULL)
+        pcap_dump((u_char *)pout, pkthdr, pktdata);
+    else if (pcap_writer_write(options.writer, pkthdr, pktdata) < 0)
+        errx(-1, "%s", pcap_writer_geterr(options.writer));
+}
+
+/**
+ * Writes an edited packet or segment to the output file, running it
+ * through fragroute first if necessary
+ */
+static void
+write_fragments(_U_ tcpedit_t *tcpedit, pcap_dumper_t *pout, struct pcap_pkthdr *pkthdr_ptr,
+        u_char *pktdata, _U_ tcpr_dir_t cache_result, _U_ COUNTER packetnum)
+{
 #ifdef ENABLE_FRAGROUTE
-        if (options.frag_ctx == NULL) {
-            /* write the packet when there's no fragrouting to be done */
-            pcap_dump((u_char *)pout, pkthdr_ptr, *pktdata);
-        } else {
-            /* get the L3 protocol of the packet */
-            proto = tcpedit_l3proto(tcpedit, AFTER_PROCESS, *pktdata, pkthdr_ptr->caplen);
-
-            /* packet is IPv4/IPv6 AND needs to be fragmented */
-            if ((proto ==  ETHERTYPE_IP || proto == ETHERTYPE_IP6) &&
-                ((options.fragroute_dir == FRAGROUTE_DIR_BOTH) ||
-                 (cache_result == TCPR_DIR_C2S && options.fragroute_dir == FRAGROUTE_DIR_C2S) ||
-                 (cache_result == TCPR_DIR_S2C && options.fragroute_dir == FRAGROUTE_DIR_S2C))) {
-
-                if (fragroute_process(options.frag_ctx, *pktdata, pkthdr_ptr->caplen) < 0)
-                    errx(-1, "Error processing packet via fragroute: %s", options.frag_ctx->errbuf);
-
-                i = 0;
-                while ((frag_len = fragroute_getfragment(options.frag_ctx, &frag)) > 0) {
-                    /* frags get the same timestamp as the original packet */
-                    dbgx(1, "processing packet " COUNTER_SPEC " frag: %u (%d)", packetnum, i++, frag_len);
-                    pkthdr_ptr->caplen = frag_len;
-                    pkthdr_ptr->len = frag_len;
-                    pcap_dump((u_char *)pout, pkthdr_ptr, (u_char *)frag);
-                }
-            } else {
-                /* write the packet without fragroute */
-                pcap_dump((u_char *)pout, pkthdr_ptr, *pktdata);
-            }
+    fragroute_frag_t *frags;
+    size_t len;
+    int nfrags, i, proto;
+
+    if (options.frag_ctx == NULL) {
+        /* write the packet when there's no fragrouting to be done */
+        dump_packet(pout, pkthdr_ptr, pktdata);
+        return;
+    }
+
+    /* get the L3 protocol of the packet */
+    proto = tcpedit_l3proto(tcpedit, AFTER_PROCESS, pktdata, pkthdr_ptr->caplen);
+
+    /* packet is IPv4/IPv6 AND needs to be fragmented */
+    if ((proto ==  ETHERTYPE_IP || proto == ETHERTYPE_IP6) &&
+        ((options.fragroute_dir == FRAGROUTE_DIR_BOTH) ||
+         (cache_result == TCPR_DIR_C2S && options.fragroute_dir == FRAGROUTE_DIR_C2S) ||
+         (cache_result == TCPR_DIR_S2C && options.fragroute_dir == FRAGROUTE_DIR_S2C))) {
+
+        /* the fragments are written straight out of fragroute's buffers */
+        len = pkthdr_ptr->caplen;
+        if ((nfrags = fragroute_process_batch(options.frag_ctx, &pktdata, &len, NULL, 1, &frags)) < 0)
+            errx(-1, "Error processing packet via fragroute: %s", options.frag_ctx->errbuf);
+
+        for (i = 0; i < nfrags; i++) {
+            /* frags get the same timestamp as the original packet */
+            dbgx(1, "processing packet " COUNTER_SPEC " frag: %u (%d)", packetnum, i, frags[i].len);
+            pkthdr_ptr->caplen = frags[i].len;
+            pkthdr_ptr->len = frags[i].len;
+            dump_packet(pout, pkthdr_ptr, frags[i].data);
         }
+    } else {
+        /* write the packet without fragroute */
+        dump_packet(pout, pkthdr_ptr, pktdata);
+    }
 #else
     /* write the packet when there's no fragrouting to be done */
-    pcap_dump((u_char *)pout, pkthdr_ptr, *pktdata);
+    dump_packet(pout, pkthdr_ptr, pktdata);
+#endif
+}
+
+/**
+ * Writes an edited packet to the output file, split into segments first
+ * with --segment
+ */
+static void
+write_packet(tcpedit_t *tcpedit, pcap_dumper_t *pout, struct pcap_pkthdr *pkthdr_ptr,
+        u_char *pktdata, tcpr_dir_t cache_result, COUNTER packetnum)
+{
+    struct pcap_pkthdr pkthdr;
+    int i;
+
+    if (options.segment_mtu == 0 || pkthdr_ptr->caplen <= options.segment_mtu ||
+            tcp_segment(&options.segs, pktdata, pkthdr_ptr->caplen,
+                    tcpedit_get_output_dlt(tcpedit), options.segment_mtu) == 0) {
+        write_fragments(tcpedit, pout, pkthdr_ptr, pktdata, cache_result, packetnum);
+        return;
+    }
+
+    /* segments get the same timestamp as the original packet */
+    for (i = 0; i < options.segs.cnt; i++) {
+        memcpy(&pkthdr, pkthdr_ptr, sizeof(pkthdr));
+        pkthdr.caplen = pkthdr.len = options.segs.len[i];
+        write_fragments(tcpedit, pout, &pkthdr, options.segs.data[i], cache_result, packetnum);
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * --workers: the main thread reads the input into chunks of packets,
+ * the workers edit whole chunks, and the main thread writes finished
+ * chunks back out in the order they were read.  Each worker has its own
+ * tcpedit_t, and everything that depends on the order of the packets
+ * (the tcpprep cache, --verbose, fragroute and the output file) stays
+ * on the main thread, so the output is identical to rewrite_packets().
+ */
+#define REWRITE_CHUNK_PKTS  256     /* packets handed to a worker at once */
+#define REWRITE_CHUNKS      4       /* chunks in flight per worker */
+
+typedef struct rewrite_pkt_s {
+    struct pcap_pkthdr pkthdr;
+    size_t offset;                  /* in chunk in[], later out[] */
+    COUNTER packetnum;
+    tcpr_dir_t cache_result;
+    int rcode;
+} rewrite_pkt_t;
+
+typedef struct rewrite_chunk_s {
+    rewrite_pkt_t pkts[REWRITE_CHUNK_PKTS];
+    int cnt;
+    u_char *in;                     /* packets as read */
+    size_t in_len;
+    size_t in_size;
+    u_char *out;                    /* packets as edited */
+    size_t out_len;
+    size_t out_size;
+    bool done;
+    char errstr[TCPEDIT_ERRSTR_LEN];
+} rewrite_chunk_t;
+
+typedef struct rewrite_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t work;            /* a chunk was filled, or stop */
+    pthread_cond_t done;            /* a chunk was edited */
+    rewrite_chunk_t *chunks;
+    uint32_t nchunks;
+    uint32_t filled;                /* chunks handed to the workers */
+    uint32_t taken;                 /* chunks a worker has claimed */
+    bool stop;
+} rewrite_pool_t;
+
+typedef struct rewrite_worker_s {
+    rewrite_pool_t *pool;
+    tcpedit_t *tcpedit;
+    pthread_t thread;
+} rewrite_worker_t;
+
+/**
+ * makes sure buf has room for len more bytes after used
+ */
+static void
+rewrite_chunk_reserve(u_char **buf, size_t *size, size_t used, size_t len)
+{
+    if (used + len <= *size)
+        return;
+
+    while (used + len > *size)
+        *size = *size ? *size * 2 : REWRITE_CHUNK_PKTS * 2048;
+
+    *buf = (u_char *)safe_realloc(*buf, *size);
+}
+
+/**
+ * reads up to REWRITE_CHUNK_PKTS packets into the chunk and returns
+ * how many were read
+ */
+static int
+rewrite_chunk_fill(rewrite_chunk_t *chunk, pcap_t *pin, COUNTER *packetnum)
+{
+    tcpr_dir_t cache_result = TCPR_DIR_C2S;
+    const u_char *pktconst;
+    rewrite_pkt_t *pkt;
+
+    chunk->cnt = 0;
+    chunk->in_len = 0;
+
+    while (chunk->cnt < REWRITE_CHUNK_PKTS) {
+        pkt = &chunk->pkts[chunk->cnt];
+        if ((pktconst = pcap_next(pin, &pkt->pkthdr)) == NULL)
+            break;
+
+        (*packetnum)++;
+        dbgx(2, "packet " COUNTER_SPEC " caplen %d", *packetnum, pkt->pkthdr.caplen);
 
+        rewrite_chunk_reserve(&chunk->in, &chunk->in_size, chunk->in_len, pkt->pkthdr.caplen);
+        memcpy(chunk->in + chunk->in_len, pktconst, pkt->pkthdr.caplen);
+        pkt->offset = chunk->in_len;
+        chunk->in_len += pkt->pkthdr.caplen;
+
+#ifdef ENABLE_VERBOSE
+        if (options.verbose)
+            tcpdump_print(&tcpdump, &pkt->pkthdr, chunk->in + pkt->offset);
 #endif
-    } /* while() */
+
+        if (options.cachedata != NULL)
+            cache_result = check_cache(options.cachedata, *packetnum);
+
+        pkt->packetnum = *packetnum;
+        pkt->cache_result = cache_result;
+        pkt->rcode = TCPEDIT_OK;
+        chunk->cnt++;
+    }
+
+    chunk->done = false;
+    return chunk->cnt;
+}
+
+/**
+ * edits every packet in the chunk, leaving the results in out[].  scratch
+ * is TCPEDIT_HEADROOM + MAXPACKET bytes
+ */
+static void
+rewrite_chunk_edit(rewrite_chunk_t *chunk, tcpedit_t *tcpedit, u_char *scratch)
+{
+    struct pcap_pkthdr *pkthdr_ptr;
+    rewrite_pkt_t *pkt;
+    u_char *pktdata;
+    int i;
+
+    chunk->out_len = 0;
+
+    for (i = 0; i < chunk->cnt; i++) {
+        pkt = &chunk->pkts[i];
+        pkthdr_ptr = &pkt->pkthdr;
+        pktdata = scratch + TCPEDIT_HEADROOM;
+        memcpy(pktdata, chunk->in + pkt->offset, pkt->pkthdr.caplen);
+
+        /* NOSEND packets are still written, so the cache stays in sync */
+        if (pkt->cache_result != TCPR_DIR_NOSEND) {
+            /* tcpedit_packet() numbers the packet one past this */
+            tcpedit->runtime.packetnum = pkt->packetnum - 1;
+            pkt->rcode = tcpedit_packet_headroom(tcpedit, &pkthdr_ptr, &pktdata,
+                    pkt->cache_result, TCPEDIT_HEADROOM);
+            if (pkt->rcode == TCPEDIT_ERROR) {
+                snprintf(chunk->errstr, sizeof(chunk->errstr), "%s", tcpedit_geterr(tcpedit));
+                chunk->cnt = i + 1;
+                break;
+            }
+
+            if (pkthdr_ptr != &pkt->pkthdr)
+                memcpy(&pkt->pkthdr, pkthdr_ptr, sizeof(struct pcap_pkthdr));
+        }
+
+        rewrite_chunk_reserve(&chunk->out, &chunk->out_size, chunk->out_len, pkt->pkthdr.caplen);
+        memcpy(chunk->out + chunk->out_len, pktdata, pkt->pkthdr.caplen);
+        pkt->offset = chunk->out_len;
+        chunk->out_len += pkt->pkthdr.caplen;
+    }
+}
+
+/**
+ * writes out an edited chunk.  A packet which failed to edit is fatal,
+ * the packets before it have been written just like rewrite_packets()
+ */
+static void
+rewrite_chunk_write(rewrite_chunk_t *chunk, tcpedit_t *tcpedit, pcap_dumper_t *pout)
+{
+    rewrite_pkt_t *pkt;
+    int i;
+
+    for (i = 0; i < chunk->cnt; i++) {
+        pkt = &chunk->pkts[i];
+
+        if (pkt->rcode == TCPEDIT_ERROR) {
+            errx(-1, "Error rewriting packets: %s", chunk->errstr);
+        } else if ((pkt->rcode == TCPEDIT_SOFT_ERROR) && HAVE_OPT(SKIP_SOFT_ERRORS)) {
+            /* don't write packet */
+            dbgx(1, "Packet " COUNTER_SPEC " is suppressed from being written due to soft errors",
+                    pkt->packetnum);
+            continue;
+        }
+
+        write_packet(tcpedit, pout, &pkt->pkthdr, chunk->out + pkt->offset,
+                pkt->cache_result, pkt->packetnum);
+    }
+}
+
+/**
+ * Main loop of a --workers thread: claim the oldest unclaimed chunk,
+ * edit it and hand it back to the main thread
+ */
+static void *
+rewrite_worker(void *arg)
+{
+    rewrite_worker_t *worker = (rewrite_worker_t *)arg;
+    rewrite_pool_t *pool = worker->pool;
+    rewrite_chunk_t *chunk;
+    u_char *scratch;
+
+    scratch = (u_char *)safe_malloc(TCPEDIT_HEADROOM + MAXPACKET);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->taken == pool->filled)
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        if (pool->stop)
+            break;
+
+        chunk = &pool->chunks[pool->taken++ % pool->nchunks];
+        pthread_mutex_unlock(&pool->lock);
+
+        rewrite_chunk_edit(chunk, worker->tcpedit, scratch);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = true;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    safe_free(scratch);
+    return NULL;
+}
+
+/**
+ * --workers version of rewrite_packets()
+ */
+static int
+rewrite_packets_workers(tcpedit_t *tcpedit, pcap_t *pin, pcap_dumper_t *pout)
+{
+    rewrite_pool_t pool;
+    rewrite_worker_t *workers;
+    rewrite_chunk_t *chunk;
+    COUNTER packetnum = 0;
+    uint32_t next_read = 0, next_write = 0;
+    bool eof = false;
+    int i, rcode;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.nchunks = options.workers * REWRITE_CHUNKS;
+    pool.chunks = (rewrite_chunk_t *)safe_malloc(pool.nchunks * sizeof(rewrite_chunk_t));
+
+    workers = (rewrite_worker_t *)safe_malloc(options.workers * sizeof(rewrite_worker_t));
+    for (i = 0; i < options.workers; i++) {
+        workers[i].pool = &pool;
+        workers[i].tcpedit = options.worker_tcpedit[i];
+        if ((rcode = pthread_create(&workers[i].thread, NULL, rewrite_worker, &workers[i])) != 0)
+            errx(-1, "Unable to start --workers thread: %s", strerror(rcode));
+    }
+
+    for (;;) {
+        /* keep every chunk busy */
+        while (!eof && next_read - next_write < pool.nchunks) {
+            chunk = &pool.chunks[next_read % pool.nchunks];
+            if (rewrite_chunk_fill(chunk, pin, &packetnum) == 0) {
+                eof = true;
+                break;
+            }
+
+            pthread_mutex_lock(&pool.lock);
+            pool.filled = ++next_read;
+            pthread_cond_signal(&pool.work);
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        if (next_write == next_read)
+            break;
+
+        /* then write out the oldest one */
+        chunk = &pool.chunks[next_write % pool.nchunks];
+        pthread_mutex_lock(&pool.lock);
+        while (!chunk->done)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        rewrite_chunk_write(chunk, tcpedit, pout);
+        next_write++;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < options.workers; i++) {
+        if ((rcode = pthread_join(workers[i].thread, NULL)) != 0)
+            errx(-1, "Unable to join --workers thread: %s", strerror(rcode));
+    }
+
+    for (i = 0; i < (int)pool.nchunks; i++) {
+        safe_free(pool.chunks[i].in);
+        safe_free(pool.chunks[i].out);
+    }
+    safe_free(pool.chunks);
+    safe_free(workers);
+    pthread_cond_destroy(&pool.done);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+
     return 0;
 }
+#endif /* HAVE_LIBPTHREAD */
@@ -24,6 +24,7 @@
 #include "config.h"
 #include "defines.h"
 #include "tcpedit/tcpedit.h"
+#include "common/tcp_segment.h"
 
 #ifdef ENABLE_DMALLOC
 #include <dmalloc.h>
@@ -40,6 +41,7 @@ struct tcprewrite_opt_s {
     char *outfile;
     pcap_t *pin;
     pcap_dumper_t *pout;
+    pcap_writer_t *writer;      /* --write-buffer, in place of pout */
 
     /* tcpprep cache data */
     COUNTER cache_packets;
@@ -57,12 +59,17 @@ struct tcprewrite_opt_s {
 #ifdef ENABLE_FRAGROUTE
     char *fragroute_args;
     fragroute_t *frag_ctx;
-#define FRAGROUTE_DIR_C2S  1
-#define FRAGROUTE_DIR_S2C  2
-#define FRAGROUTE_DIR_BOTH 4
     int fragroute_dir;
 #endif
     tcpedit_t *tcpedit;
+
+    /* --segment: split TCP packets above this MTU, 0 for off */
+    uint32_t segment_mtu;
+    tcp_segment_t segs;
+
+    /* --workers: threads editing packets, each with its own tcpedit_t */
+    int workers;
+    tcpedit_t **worker_tcpedit;
 };
 
 typedef struct tcprewrite_opt_s tcprewrite_opt_t;
@@ -25,9 +25,7 @@
 
 #define TRACE_MAX_ENTRIES 15000
 
-uint32_t trace_num;
 struct timestamp_trace_entry {
-    COUNTER skip_length;
     COUNTER size;
     COUNTER bytes_sent;
     COUNTER now_us;
@@ -38,35 +36,39 @@ struct timestamp_trace_entry {
 };
 typedef struct timestamp_trace_entry timestamp_trace_entry_t;
 
-#ifdef TIMESTAMP_TRACE
-timestamp_trace_entry_t timestamp_trace_entry_array[TRACE_MAX_ENTRIES];
+/* one per tcpreplay_t, so contexts on other threads don't interleave */
+typedef struct timestamp_trace_s {
+    uint32_t num;
+    timestamp_trace_entry_t entries[TRACE_MAX_ENTRIES];
+} timestamp_trace_t;
 
-static inline void update_current_timestamp_trace_entry(COUNTER bytes_sent, COUNTER now_us,
-        COUNTER tx_us, COUNTER next_tx_us)
+#ifdef TIMESTAMP_TRACE
+static inline void update_current_timestamp_trace_entry(timestamp_trace_t *trace,
+        COUNTER bytes_sent, COUNTER now_us, COUNTER tx_us, COUNTER next_tx_us)
 {
-    if (trace_num >= TRACE_MAX_ENTRIES)
+    if (trace == NULL || trace->num >= TRACE_MAX_ENTRIES)
         return;
 
-    timestamp_trace_entry_array[trace_num].bytes_sent = bytes_sent;
-    timestamp_trace_entry_array[trace_num].now_us = now_us;
-    timestamp_trace_entry_array[trace_num].tx_us = tx_us;
-    timestamp_trace_entry_array[trace_num].next_tx_us = next_tx_us;
+    trace->entries[trace->num].bytes_sent = bytes_sent;
+    trace->entries[trace->num].now_us = now_us;
+    trace->entries[trace->num].tx_us = tx_us;
+    trace->entries[trace->num].next_tx_us = next_tx_us;
 }
 
-static inline void add_timestamp_trace_entry(COUNTER size, struct timeval *timestamp, COUNTER skip_length)
+static inline void add_timestamp_trace_entry(timestamp_trace_t *trace, COUNTER size,
+        struct timeval *timestamp)
 {
-    if (trace_num >= TRACE_MAX_ENTRIES)
+    if (trace == NULL || trace->num >= TRACE_MAX_ENTRIES)
         return;
 
-    timestamp_trace_entry_array[trace_num].skip_length = skip_length;
-    timestamp_trace_entry_array[trace_num].size = size;
-    timestamp_trace_entry_array[trace_num].timestamp.tv_sec = timestamp->tv_sec;
-    timestamp_trace_entry_array[trace_num].timestamp.tv_usec = timestamp->tv_usec;
-    ++trace_num;
+    trace->entries[trace->num].size = size;
+    trace->entries[trace->num].timestamp.tv_sec = timestamp->tv_sec;
+    trace->entries[trace->num].timestamp.tv_usec = timestamp->tv_usec;
+    ++trace->num;
 }
 
-static inline void dump_timestamp_trace_array(const struct timeval *start,
-        const struct timeval *stop, const COUNTER bps)
+static inline void dump_timestamp_trace_array(const timestamp_trace_t *trace,
+        const struct timeval *start, const struct timeval *stop, const COUNTER bps)
 {
     uint32_t i;
     COUNTER start_us = TIMEVAL_TO_MICROSEC(start);
@@ -75,29 +77,30 @@ static inline void dump_timestamp_trace_array(const struct timeval *start,
             start->tv_sec, start->tv_usec,
             stop->tv_sec, stop->tv_usec,
             start_us,
-            trace_num, bps);
-    for (i = 0; i < trace_num; ++i) {
-        long long int delta = timestamp_trace_entry_array[i].tx_us -
-                timestamp_trace_entry_array[i].next_tx_us;
+            trace->num, bps);
+    for (i = 0; i < trace->num; ++i) {
+        long long int delta = trace->entries[i].tx_us -
+                trace->entries[i].next_tx_us;
 
-        printf("timestamp=%zd.%zd, size=%llu now_us=%llu tx_us=%llu next_tx_us=%llu delta=%lld bytes_sent=%llu skip=%llu\n",
-                timestamp_trace_entry_array[i].timestamp.tv_sec,
-                timestamp_trace_entry_array[i].timestamp.tv_usec,
-                timestamp_trace_entry_array[i].size,
-                timestamp_trace_entry_array[i].now_us,
-                timestamp_trace_entry_array[i].tx_us,
-                timestamp_trace_entry_array[i].next_tx_us,
+        printf("timestamp=%zd.%zd, size=%llu now_us=%llu tx_us=%llu next_tx_us=%llu delta=%lld tokens=%llu\n",
+                trace->entries[i].timestamp.tv_sec,
+                trace->entries[i].timestamp.tv_usec,
+                trace->entries[i].size,
+                trace->entries[i].now_us,
+                trace->entries[i].tx_us,
+                trace->entries[i].next_tx_us,
                 delta,
-                timestamp_trace_entry_array[i].bytes_sent,
-                timestamp_trace_entry_array[i].skip_length);
+                trace->entries[i].bytes_sent);
     }
 }
 #else
-static inline void update_current_timestamp_trace_entry(COUNTER UNUSED(bytes_sent), COUNTER UNUSED(now_us),
+static inline void update_current_timestamp_trace_entry(timestamp_trace_t *UNUSED(trace),
+        COUNTER UNUSED(bytes_sent), COUNTER UNUSED(now_us),
         COUNTER UNUSED(tx_us), COUNTER UNUSED(next_tx_us)) { }
-static inline void add_timestamp_trace_entry(COUNTER UNUSED(size), struct timeval *UNUSED(timestamp),
-        COUNTER UNUSED(skip_length)) { }
-static inline void dump_timestamp_trace_array(const struct timeval *UNUSED(start),
+static inline void add_timestamp_trace_entry(timestamp_trace_t *UNUSED(trace), COUNTER UNUSED(size),
+        struct timeval *UNUSED(timestamp)) { }
+static inline void dump_timestamp_trace_array(const timestamp_trace_t *UNUSED(trace),
+        const struct timeval *UNUSED(start),
         const struct timeval *UNUSED(stop), const COUNTER UNUSED(bps)) { }
 #endif /* TIMESTAMP_TRACE */
 
@@ -40,8 +40,8 @@ extern int debug;
 /* static buffer used by tree_print*() functions */
 char tree_print_buff[TREEPRINTBUFFLEN]; 
 
-static tcpr_tree_t *new_tree();
-static tcpr_tree_t *packet2tree(const u_char *);
+static void new_tree(tcpr_tree_t *);
+static void packet2tree(const u_char *, tcpr_tree_t *);
 #ifdef DEBUG        /* prevent compile warnings */
 static char *tree_print(tcpr_data_tree_t *);
 static char *tree_printnode(const char *, const tcpr_tree_t *);
@@ -51,8 +51,225 @@ static int tree_checkincidr(tcpr_data_tree_t *, tcpr_buildcidr_t *);
 
 static int ipv6_cmp(const struct tcpr_in6_addr *a, const struct tcpr_in6_addr *b);
 
-RB_PROTOTYPE(tcpr_data_tree_s, tcpr_tree_s, node, tree_comp)
-RB_GENERATE(tcpr_data_tree_s, tcpr_tree_s, node, tree_comp)
+/**
+ * hashes the address of a host
+ */
+static uint32_t
+tree_hash(const tcpr_tree_t *key)
+{
+    uint32_t hash;
+    int i;
+
+    if (key->family == AF_INET) {
+        hash = (uint32_t)key->u.ip;
+    } else {
+        hash = 0;
+        for (i = 0; i < 4; i++)
+            hash = (hash ^ key->u.ip6.tcpr_s6_addr32[i]) * 0x9e3779b1;
+    }
+
+    /* spread the bits so neighbouring addresses land apart */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/**
+ * returns the slot holding the host with key's address, or the empty
+ * slot it belongs in
+ */
+static tcpr_tree_t *
+tree_slot(tcpr_data_tree_t *tree, const tcpr_tree_t *key)
+{
+    uint32_t mask = tree->size - 1;
+    uint32_t i = tree_hash(key) & mask;
+    tcpr_tree_t *node;
+
+    for (;;) {
+        node = &tree->nodes[i];
+        if (node->family == 0)
+            return node;
+
+        if (node->family == key->family) {
+            if (key->family == AF_INET) {
+                if (node->u.ip == key->u.ip)
+                    return node;
+            } else if (ipv6_cmp(&node->u.ip6, &key->u.ip6) == 0) {
+                return node;
+            }
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+/**
+ * returns the host with key's address or NULL
+ */
+static tcpr_tree_t *
+tree_find(tcpr_data_tree_t *tree, const tcpr_tree_t *key)
+{
+    tcpr_tree_t *node;
+
+    if (tree->size == 0)
+        return NULL;
+
+    node = tree_slot(tree, key);
+    return node->family != 0 ? node : NULL;
+}
+
+/**
+ * doubles the number of slots in the table
+ */
+static void
+tree_grow(tcpr_data_tree_t *tree)
+{
+    tcpr_tree_t *old = tree->nodes;
+    uint32_t old_size = tree->size, i;
+
+    tree->size = old_size ? old_size * 2 : TREE_INIT_SIZE;
+    tree->nodes = (tcpr_tree_t *)safe_malloc(tree->size * sizeof(tcpr_tree_t));
+    dbgx(1, "Growing host table to %u slots", tree->size);
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].family != 0)
+            memcpy(tree_slot(tree, &old[i]), &old[i], sizeof(tcpr_tree_t));
+    }
+
+    safe_free(old);
+}
+
+/**
+ * Returns the host with key's address, adding a copy of key if there
+ * isn't one yet.  *added says which happened.
+ */
+static tcpr_tree_t *
+tree_insert(tcpr_data_tree_t *tree, const tcpr_tree_t *key, bool *added)
+{
+    tcpr_tree_t *node;
+
+    assert(key->family != 0);
+
+    if ((node = tree_find(tree, key)) != NULL) {
+        *added = false;
+        return node;
+    }
+
+    /* keep the table at most half full */
+    if ((tree->count + 1) * 2 > tree->size)
+        tree_grow(tree);
+
+    node = tree_slot(tree, key);
+    memcpy(node, key, sizeof(tcpr_tree_t));
+    tree->count++;
+    *added = true;
+
+    return node;
+}
+
+static int
+tree_sort_comp(const void *a, const void *b)
+{
+    return tree_comp(*(tcpr_tree_t **)a, *(tcpr_tree_t **)b);
+}
+
+/**
+ * brings tree->sorted up to date with the table
+ */
+static void
+tree_sort(tcpr_data_tree_t *tree)
+{
+    uint32_t i, j;
+
+    if (tree->sorted != NULL && tree->sorted_count == tree->count)
+        return;
+
+    safe_free(tree->sorted);
+    tree->sorted = (tcpr_tree_t **)safe_malloc(max(tree->count, 1) * sizeof(tcpr_tree_t *));
+
+    for (i = 0, j = 0; i < tree->size; i++) {
+        if (tree->nodes[i].family != 0)
+            tree->sorted[j++] = &tree->nodes[i];
+    }
+
+    qsort(tree->sorted, tree->count, sizeof(tcpr_tree_t *), tree_sort_comp);
+    tree->sorted_count = tree->count;
+}
+
+/**
+ * starts an empty table of size slots, a power of 2, for about size / 2
+ * hosts
+ */
+void
+tree_init(tcpr_data_tree_t *tree, uint32_t size)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->size = size;
+    tree->nodes = (tcpr_tree_t *)safe_malloc(size * sizeof(tcpr_tree_t));
+}
+
+/**
+ * empties a table, keeping its slots
+ */
+void
+tree_clear(tcpr_data_tree_t *tree)
+{
+    if (tree->count > 0)
+        memset(tree->nodes, 0, tree->size * sizeof(tcpr_tree_t));
+
+    tree->count = 0;
+    safe_free(tree->sorted);
+    tree->sorted = NULL;
+    tree->sorted_count = 0;
+}
+
+/**
+ * bytes held by a table's slots and sorted hosts
+ */
+size_t
+tree_bytes(const tcpr_data_tree_t *tree)
+{
+    return tree->size * sizeof(tcpr_tree_t) +
+            (tree->sorted ? max(tree->sorted_count, 1) * sizeof(tcpr_tree_t *) : 0);
+}
+
+void
+tree_free(tcpr_data_tree_t *tree)
+{
+    safe_free(tree->nodes);
+    safe_free(tree->sorted);
+    memset(tree, 0, sizeof(*tree));
+}
+
+/**
+ * Adds the hosts of a table built from later packets than those of into.
+ * Hosts new to into keep the node from their first packet, as if the
+ * packets had been added to into one by one.  add_counts is false for
+ * tables of add_tree_first_ipv4/6(), whose counts are fixed by whoever
+ * saw a host first.
+ */
+void
+tree_merge(tcpr_data_tree_t *into, const tcpr_data_tree_t *from, bool add_counts)
+{
+    tcpr_tree_t *node;
+    uint32_t i;
+    bool added;
+
+    for (i = 0; i < from->size; i++) {
+        if (from->nodes[i].family == 0)
+            continue;
+
+        node = tree_insert(into, &from->nodes[i], &added);
+        if (!added && add_counts) {
+            node->server_cnt += from->nodes[i].server_cnt;
+            node->client_cnt += from->nodes[i].client_cnt;
+        }
+    }
+}
 
 /**
  * used with rbwalk to walk a tree and generate cidr_t * cidrdata.
@@ -67,11 +284,14 @@ tree_buildcidr(tcpr_data_tree_t *treeroot, tcpr_buildcidr_t * bcdata)
     struct tcpr_in6_addr network6;
     unsigned long mask = ~0;    /* turn on all bits */
     tcpprep_opt_t *options = tcpprep->options;
+    uint32_t n;
     int i, j, k;
 
     dbg(1, "Running: tree_buildcidr()");
 
-    RB_FOREACH(node, tcpr_data_tree_s, treeroot) {
+    tree_sort(treeroot);
+    for (n = 0; n < treeroot->count; n++) {
+        node = treeroot->sorted[n];
 
         /* we only check types that are vaild */
         if (bcdata->type != DIR_ANY)    /* don't check if we're adding ANY */
@@ -136,9 +356,11 @@ tree_checkincidr(tcpr_data_tree_t *treeroot, tcpr_buildcidr_t * bcdata)
 {
     tcpr_tree_t *node = NULL;
     tcpprep_opt_t *options = tcpprep->options;
+    uint32_t n;
 
-
-    RB_FOREACH(node, tcpr_data_tree_s, treeroot) {
+    tree_sort(treeroot);
+    for (n = 0; n < treeroot->count; n++) {
+        node = treeroot->sorted[n];
 
         /* we only check types that are vaild */
         if (bcdata->type != DIR_ANY)    /* don't check if we're adding ANY */
@@ -232,13 +454,14 @@ tcpr_tree_to_cidr(const int masklen, const int type)
 tcpr_dir_t
 check_ip_tree(const int mode, const unsigned long ip)
 {
-    tcpr_tree_t *node = NULL, *finder = NULL;
+    tcpr_tree_t *node = NULL, finder;
 
-    finder = new_tree();
-    finder->family = AF_INET;
-    finder->u.ip = ip;
+    /* only the key is compared, and no allocation keeps --workers apart */
+    memset(&finder, 0, sizeof(finder));
+    finder.family = AF_INET;
+    finder.u.ip = ip;
 
-    node = RB_FIND(tcpr_data_tree_s, &treeroot, finder);
+    node = tree_find(&treeroot, &finder);
 
     if (node == NULL && mode == DIR_UNKNOWN)
         errx(-1, "%s (%lu) is an unknown system... aborting.!\n"
@@ -296,13 +519,13 @@ check_ip_tree(const int mode, const unsigned long ip)
 tcpr_dir_t
 check_ip6_tree(const int mode, const struct tcpr_in6_addr *addr)
 {
-    tcpr_tree_t *node = NULL, *finder = NULL;
+    tcpr_tree_t *node = NULL, finder;
 
-    finder = new_tree();
-    finder->family = AF_INET6;
-    finder->u.ip6 = *addr;
+    memset(&finder, 0, sizeof(finder));
+    finder.family = AF_INET6;
+    finder.u.ip6 = *addr;
 
-    node = RB_FIND(tcpr_data_tree_s, &treeroot, finder);
+    node = tree_find(&treeroot, &finder);
 
     if (node == NULL && mode == DIR_UNKNOWN)
         errx(-1, "%s is an unknown system... aborting.!\n"
@@ -367,149 +590,106 @@ check_ip6_tree(const int mode, const struct tcpr_in6_addr *addr)
  * client, if the DST IP doesn't exist in the TREE, we add it as a server
  */
 void
-add_tree_first_ipv4(const u_char *data)
+add_tree_first_ipv4(tcpr_data_tree_t *tree, const u_char *data)
 {
-    tcpr_tree_t *newnode = NULL, *findnode;
-    eth_hdr_t *eth_hdr = NULL;
+    tcpr_tree_t newnode;
     ipv4_hdr_t ip_hdr;
+    bool added;
     
     assert(data);
     /* 
      * first add/find the source IP/client 
      */
-    newnode = new_tree();
+    new_tree(&newnode);
 
-    eth_hdr = (eth_hdr_t *) (data);
     /* prevent issues with byte alignment, must memcpy */
     memcpy(&ip_hdr, (data + TCPR_ETH_H), TCPR_IPV4_H);
 
     /* copy over the source ip, and values to gurantee this a client */
-    newnode->family = AF_INET;
-    newnode->u.ip = ip_hdr.ip_src.s_addr;
-    newnode->type = DIR_CLIENT;
-    newnode->client_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-    
-    /* if we didn't find it, add it to the tree, else free it */
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
-    }
+    newnode.family = AF_INET;
+    newnode.u.ip = ip_hdr.ip_src.s_addr;
+    newnode.type = DIR_CLIENT;
+    newnode.client_cnt = 1000;
+
+    /* added only if we haven't seen it yet */
+    tree_insert(tree, &newnode, &added);
     
     /*
      * now add/find the destination IP/server
      */
-    newnode = new_tree();
-    eth_hdr = (eth_hdr_t *) (data);
-    memcpy(&ip_hdr, (data + TCPR_ETH_H), TCPR_IPV4_H);
-
-    newnode->family = AF_INET;
-    newnode->u.ip = ip_hdr.ip_dst.s_addr;
-    newnode->type = DIR_SERVER;
-    newnode->server_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
+    new_tree(&newnode);
 
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
-    }
+    newnode.family = AF_INET;
+    newnode.u.ip = ip_hdr.ip_dst.s_addr;
+    newnode.type = DIR_SERVER;
+    newnode.server_cnt = 1000;
+    tree_insert(tree, &newnode, &added);
 }
 
 void
-add_tree_first_ipv6(const u_char *data)
+add_tree_first_ipv6(tcpr_data_tree_t *tree, const u_char *data)
 {
-    tcpr_tree_t *newnode = NULL, *findnode;
-    eth_hdr_t *eth_hdr = NULL;
+    tcpr_tree_t newnode;
     ipv6_hdr_t ip6_hdr;
+    bool added;
 
     assert(data);
     /*
      * first add/find the source IP/client
      */
-    newnode = new_tree();
+    new_tree(&newnode);
     
-    eth_hdr = (eth_hdr_t *) (data);
     /* prevent issues with byte alignment, must memcpy */
     memcpy(&ip6_hdr, (data + TCPR_ETH_H), TCPR_IPV6_H);
 
     /* copy over the source ip, and values to gurantee this a client */
-    newnode->family = AF_INET6;
-    newnode->u.ip6 = ip6_hdr.ip_src;
-    newnode->type = DIR_CLIENT;
-    newnode->client_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    /* if we didn't find it, add it to the tree, else free it */
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
-    }
+    newnode.family = AF_INET6;
+    newnode.u.ip6 = ip6_hdr.ip_src;
+    newnode.type = DIR_CLIENT;
+    newnode.client_cnt = 1000;
+
+    /* added only if we haven't seen it yet */
+    tree_insert(tree, &newnode, &added);
 
     /*
      * now add/find the destination IP/server
      */
-    newnode = new_tree();
-    eth_hdr = (eth_hdr_t *) (data);
-    memcpy(&ip6_hdr, (data + TCPR_ETH_H), TCPR_IPV6_H);
+    new_tree(&newnode);
 
-    newnode->family = AF_INET6;
-    newnode->u.ip6 = ip6_hdr.ip_dst;
-    newnode->type = DIR_SERVER;
-    newnode->server_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
-    }
+    newnode.family = AF_INET6;
+    newnode.u.ip6 = ip6_hdr.ip_dst;
+    newnode.type = DIR_SERVER;
+    newnode.server_cnt = 1000;
+    tree_insert(tree, &newnode, &added);
 }
 
 static void
-add_tree_node(tcpr_tree_t *newnode)
+add_tree_node(tcpr_data_tree_t *tree, const tcpr_tree_t *newnode)
 {
     tcpr_tree_t *node;
+    bool added;
 
-    /* try to find a simular entry in the tree */
-    node = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
+    /* packet2tree() couldn't find an address */
+    if (newnode->family == 0) {
+        dbg(2, "no IPv4/v6 source address, not adding to the tree");
+        return;
+    }
 
-    dbgx(3, "%s", tree_printnode("add_tree", node));
+    /* find the host, or start one with the packet's type */
+    node = tree_insert(tree, newnode, &added);
 
-    /* new entry required */
-    if (node == NULL) {
-        /* increment counters */
-        if (newnode->type == DIR_SERVER) {
-            newnode->server_cnt++;
-        }
-        else if (newnode->type == DIR_CLIENT) {
-            newnode->client_cnt++;
-        }
-        /* insert it in */
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
+    dbgx(3, "%s", tree_printnode(added ? "add_tree" : "update node", node));
 
+    /* increment counter */
+    if (newnode->type == DIR_SERVER) {
+        node->server_cnt++;
     }
-    else {
-        /* we found something, so update it */
-        dbgx(2, "   node: %p\nnewnode: %p", node, newnode);
-        dbgx(3, "%s", tree_printnode("update node", node));
-        /* increment counter */
-        if (newnode->type == DIR_SERVER) {
-            node->server_cnt++;
-        }
-        else if (newnode->type == DIR_CLIENT) {
-            /* temp debug code */
-            node->client_cnt++;
-        }
-                    
-        /* didn't insert it, so free it */
-        safe_free(newnode);
+    else if (newnode->type == DIR_CLIENT) {
+        node->client_cnt++;
     }
 
     dbg(2, "------- START NEXT -------");
-    dbgx(3, "%s", tree_print(&treeroot));
+    dbgx(3, "%s", tree_print(tree));
 }
 
 /**
@@ -519,43 +699,43 @@ add_tree_node(tcpr_tree_t *newnode)
  * - the way the host acted the first time we saw it (client or server)
  */
 void
-add_tree_ipv4(const unsigned long ip, const u_char * data)
+add_tree_ipv4(tcpr_data_tree_t *tree, const unsigned long ip, const u_char * data)
 {
-    tcpr_tree_t *newnode = NULL;
+    tcpr_tree_t newnode;
     assert(data);
 
-    newnode = packet2tree(data);
+    packet2tree(data, &newnode);
 
-    assert(ip == newnode->u.ip);
+    assert(ip == newnode.u.ip);
 
-    if (newnode->type == DIR_UNKNOWN) {
+    if (newnode.type == DIR_UNKNOWN) {
         /* couldn't figure out if packet was client or server */
 
         dbgx(2, "%s (%lu) unknown client/server",
-            get_addr2name4(newnode->u.ip, RESOLVE), newnode->u.ip);
+            get_addr2name4(newnode.u.ip, RESOLVE), newnode.u.ip);
 
     }
-    add_tree_node(newnode);
+    add_tree_node(tree, &newnode);
 }
 
 void
-add_tree_ipv6(const struct tcpr_in6_addr * addr, const u_char * data)
+add_tree_ipv6(tcpr_data_tree_t *tree, const struct tcpr_in6_addr * addr, const u_char * data)
 {
-    tcpr_tree_t *newnode = NULL;
+    tcpr_tree_t newnode;
     assert(data);
 
-    newnode = packet2tree(data);
+    packet2tree(data, &newnode);
 
-    assert(ipv6_cmp(addr, &newnode->u.ip6) == 0);
+    assert(ipv6_cmp(addr, &newnode.u.ip6) == 0);
 
-    if (newnode->type == DIR_UNKNOWN) {
+    if (newnode.type == DIR_UNKNOWN) {
         /* couldn't figure out if packet was client or server */
 
         dbgx(2, "%s unknown client/server",
-            get_addr2name6(&newnode->u.ip6, RESOLVE));
+            get_addr2name6(&newnode.u.ip6, RESOLVE));
     }
 
-    add_tree_node(newnode);
+    add_tree_node(tree, &newnode);
 }
 
 /**
@@ -566,10 +746,16 @@ tree_calculate(tcpr_data_tree_t *treeroot)
 {
     tcpr_tree_t *node;
     tcpprep_opt_t *options = tcpprep->options;
+    uint32_t i;
 
     dbg(1, "Running tree_calculate()");
 
-    RB_FOREACH(node, tcpr_data_tree_s, treeroot) {
+    /* the order doesn't matter here, so skip sorting */
+    for (i = 0; i < treeroot->size; i++) {
+        node = &treeroot->nodes[i];
+        if (node->family == 0)
+            continue;
+
         dbgx(4, "Processing %s", get_addr2name4(node->u.ip, RESOLVE));
         if ((node->server_cnt > 0) || (node->client_cnt > 0)) {
             /* type based on: server >= (client*ratio) */
@@ -595,18 +781,17 @@ tree_calculate(tcpr_data_tree_t *treeroot)
 static int
 ipv6_cmp(const struct tcpr_in6_addr *a, const struct tcpr_in6_addr *b)
 {
-    int i, k;
+    int i;
 
     for (i = 0; i < 4; i++) {
-       if ((k = (a->tcpr_s6_addr32[i] - b->tcpr_s6_addr32[i]))) {
-           return (k > 0) ? 1 : -1;
-        }
+        if (a->tcpr_s6_addr32[i] != b->tcpr_s6_addr32[i])
+            return a->tcpr_s6_addr32[i] > b->tcpr_s6_addr32[i] ? 1 : -1;
     }
     return 0;
 }
 
 /**
- * tree_comp(), called by rbsearch compares two treees and returns:
+ * tree_comp(), used to sort the host table, compares two treees and returns:
  * 1  = first > second
  * -1 = first < second
  * 0  = first = second
@@ -647,7 +832,7 @@ tree_comp(tcpr_tree_t *t1, tcpr_tree_t *t2)
     }
 
     if (t1->family == AF_INET6) {
-        ret = ipv6_cmp(&t1->u.ip6, &t1->u.ip6);
+        ret = ipv6_cmp(&t1->u.ip6, &t2->u.ip6);
         dbgx(2, "cmp(%s, %s) = %d", get_addr2name6(&t1->u.ip6, RESOLVE),
                 get_addr2name6(&t2->u.ip6, RESOLVE), ret);
         return ret;
@@ -657,35 +842,29 @@ tree_comp(tcpr_tree_t *t1, tcpr_tree_t *t2)
 }
 
 /**
- * creates a new TREE * with reasonable defaults
+ * initializes a TREE * with reasonable defaults
  */
-static tcpr_tree_t *
-new_tree()
+static void
+new_tree(tcpr_tree_t *node)
 {
-    tcpr_tree_t *node;
-
-    node = (tcpr_tree_t *)safe_malloc(sizeof(tcpr_tree_t));
-
     memset(node, '\0', sizeof(tcpr_tree_t));
     node->server_cnt = 0;
     node->client_cnt = 0;
     node->type = DIR_UNKNOWN;
     node->masklen = -1;
     node->u.ip = 0;
-    return (node);
 }
 
 
 /**
- * returns a struct of TREE * from a packet header
+ * fills in a TREE * from a packet header
  * and sets the type to be SERVER or CLIENT or UNKNOWN
  * if it's an undefined packet, we return -1 for the type
  * the u_char * data should be the data that is passed by pcap_dispatch()
  */
-tcpr_tree_t *
-packet2tree(const u_char * data)
+static void
+packet2tree(const u_char * data, tcpr_tree_t *node)
 {
-    tcpr_tree_t *node = NULL;
     eth_hdr_t *eth_hdr = NULL;
     ipv4_hdr_t ip_hdr;
     ipv6_hdr_t ip6_hdr;
@@ -700,7 +879,7 @@ packet2tree(const u_char * data)
     char srcip[INET6_ADDRSTRLEN];
 #endif
 
-    node = new_tree();
+    new_tree(node);
 
     eth_hdr = (eth_hdr_t *) (data);
 
@@ -759,7 +938,7 @@ packet2tree(const u_char * data)
 
         /* ftp-data is going to skew our results so we ignore it */
         if (tcp_hdr.th_sport == 20)
-            return (node);
+            return;
 
         /* set TREE->type based on TCP flags */
         if (tcp_hdr.th_flags == TH_SYN) {
@@ -802,7 +981,7 @@ packet2tree(const u_char * data)
 
                 dbg(3, "is a dns client");
             }
-            return (node);
+            return;
             break;
         default:
             break;
@@ -825,7 +1004,7 @@ packet2tree(const u_char * data)
                 node->type = DIR_CLIENT;
                 dbg(3, "is a dns client");
             }
-            return (node);
+            return;
             break;
         default:
 
@@ -855,7 +1034,6 @@ packet2tree(const u_char * data)
 
     }
 
-    return (node);
 }
 
 #ifdef DEBUG
@@ -895,10 +1073,12 @@ tree_printnode(const char *name, const tcpr_tree_t *node)
 static char *
 tree_print(tcpr_data_tree_t *treeroot)
 {
-    tcpr_tree_t *node = NULL;
+    uint32_t i;
+
     memset(&tree_print_buff, '\0', TREEPRINTBUFFLEN);
-    RB_FOREACH(node, tcpr_data_tree_s, treeroot) {
-        tree_printnode("my node", node);
+    tree_sort(treeroot);
+    for (i = 0; i < treeroot->count; i++) {
+        tree_printnode("my node", treeroot->sorted[i]);
     }
     return (tree_print_buff);
 
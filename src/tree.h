@@ -21,13 +21,11 @@
 #ifndef __TREE_H__
 #define __TREE_H__
 
-#include "lib/tree.h"
-
 #define TREEPRINTBUFFLEN 2048
+#define TREE_INIT_SIZE (1 << 16)    /* initial # of host table slots, a power of 2 */
 
 typedef struct tcpr_tree_s {
-    RB_ENTRY(tcpr_tree_s) node;
-    int family;
+    int family;                 /* 0 marks an empty host table slot */
     union {
         unsigned long ip;           /* ip/network address in network byte order */
         struct tcpr_in6_addr ip6;
@@ -40,10 +38,17 @@ typedef struct tcpr_tree_s {
 } tcpr_tree_t;
 
 /*
- * replacement for RB_HEAD() which doesn't actually declare the root
+ * The hosts seen in auto mode: an open addressed hash table keyed by
+ * address, holding the nodes themselves so counting a packet is one
+ * probe and no allocation.  The passes which walk the hosts do so in
+ * address order through sorted, built once the table stops changing.
  */
 typedef struct tcpr_data_tree_s {
-    tcpr_tree_t *rbh_root;
+    tcpr_tree_t *nodes;
+    uint32_t size;              /* # of slots, a power of 2 */
+    uint32_t count;             /* # of hosts */
+    tcpr_tree_t **sorted;       /* hosts in tree_comp() order */
+    uint32_t sorted_count;      /* count when sorted was built */
 } tcpr_data_tree_t;
 
 typedef struct tcpr_buildcidr_s {
@@ -53,10 +58,15 @@ typedef struct tcpr_buildcidr_s {
 
 #define DNS_QUERY_FLAG 0x8000
 
-void add_tree_ipv4(const unsigned long, const u_char *);
-void add_tree_ipv6(const struct tcpr_in6_addr *, const u_char *);
-void add_tree_first_ipv4(const u_char *);
-void add_tree_first_ipv6(const u_char *);
+void add_tree_ipv4(tcpr_data_tree_t *, const unsigned long, const u_char *);
+void add_tree_ipv6(tcpr_data_tree_t *, const struct tcpr_in6_addr *, const u_char *);
+void add_tree_first_ipv4(tcpr_data_tree_t *, const u_char *);
+void add_tree_first_ipv6(tcpr_data_tree_t *, const u_char *);
+void tree_init(tcpr_data_tree_t *, uint32_t);
+void tree_clear(tcpr_data_tree_t *);
+void tree_free(tcpr_data_tree_t *);
+size_t tree_bytes(const tcpr_data_tree_t *);
+void tree_merge(tcpr_data_tree_t *, const tcpr_data_tree_t *, bool);
 tcpr_dir_t check_ip_tree(const int, const unsigned long);
 tcpr_dir_t check_ip6_tree(const int, const struct tcpr_in6_addr *);
 int process_tree();